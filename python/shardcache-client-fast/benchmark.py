@@ -0,0 +1,139 @@
+#!/usr/bin/env python
+#
+# Compares the native extension against the pure python client
+#
+# usage: benchmark.py [-H hosts] [-n requests] [-k keys] [-s value_size] [-b batch_size] [-t threads]
+#
+# hosts is a comma-separated list of label:address:port strings.
+# The pure python client (python/shardcache-client) is used only if importable.
+
+from __future__ import print_function
+
+import getopt
+import sys
+import threading
+import time
+
+import shardcacheclient
+
+try:
+    from shardcache_client.client import ShardcacheClient
+except Exception as e:
+    ShardcacheClient = None
+    pure_error = str(e)
+
+hosts = 'peer1:localhost:4444'
+num_requests = 10000
+num_keys = 1000
+value_size = 128
+batch_size = 100
+num_threads = 4
+
+
+def usage(rc):
+    print('usage: %s [-H hosts] [-n requests] [-k keys] [-s value_size] '
+          '[-b batch_size] [-t threads]' % sys.argv[0])
+    sys.exit(rc)
+
+
+def run(name, requests, fn):
+    start = time.time()
+    fn()
+    elapsed = max(time.time() - start, 1e-6)
+    print('%-28s %8d requests in %7.3f secs (%10.0f requests/s)'
+          % (name, requests, elapsed, requests / elapsed))
+
+
+def bench_sets(client, keys, value):
+    def fn():
+        for i in range(num_requests):
+            client.set(keys[i % len(keys)], value)
+    return fn
+
+
+def bench_gets(client, keys):
+    def fn():
+        for i in range(num_requests):
+            client.get(keys[i % len(keys)])
+    return fn
+
+
+def bench_get_multi(client, keys):
+    batches = [[keys[(b + i) % len(keys)] for i in range(batch_size)]
+               for b in range(0, num_requests, batch_size)]
+
+    def fn():
+        for batch in batches:
+            client.get_multi(batch)
+    return fn
+
+
+def bench_threads(client, keys):
+    # the extension releases the GIL while waiting for the nodes,
+    # so the threads share the same client without serializing the requests
+    # (the pure python client can't be shared among threads)
+    def worker(offset):
+        for i in range(num_requests // num_threads):
+            client.get(keys[(offset + i) % len(keys)])
+
+    def fn():
+        threads = [threading.Thread(target=worker, args=(t * 7919,)) for t in range(num_threads)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+    return fn
+
+
+def main():
+    global hosts, num_requests, num_keys, value_size, batch_size, num_threads
+
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 'hH:n:k:s:b:t:')
+    except getopt.GetoptError as e:
+        print(e)
+        usage(-1)
+
+    for opt, arg in opts:
+        if opt == '-h':
+            usage(0)
+        elif opt == '-H':
+            hosts = arg
+        elif opt == '-n':
+            num_requests = int(arg)
+        elif opt == '-k':
+            num_keys = int(arg)
+        elif opt == '-s':
+            value_size = int(arg)
+        elif opt == '-b':
+            batch_size = int(arg)
+        elif opt == '-t':
+            num_threads = int(arg)
+
+    if min(num_requests, num_keys, value_size, batch_size, num_threads) <= 0:
+        usage(-1)
+
+    keys = ['shc_bench_%d' % i for i in range(num_keys)]
+    value = 'x' * value_size
+
+    # label:address:port -> (label, address:port)
+    nodes = [tuple(node.split(':', 1)) for node in hosts.split(',')]
+    fast = shardcacheclient.Client(nodes)
+
+    run('fast set', num_requests, bench_sets(fast, keys, value.encode()))
+    run('fast get', num_requests, bench_gets(fast, keys))
+    run('fast get_multi (batch %d)' % batch_size, num_requests, bench_get_multi(fast, keys))
+    run('fast get (%d threads)' % num_threads,
+        num_requests // num_threads * num_threads, bench_threads(fast, keys))
+
+    if ShardcacheClient is None:
+        print('pure python client not available (%s)' % pure_error)
+        return
+
+    pure = ShardcacheClient(hosts)
+    run('pure set', num_requests, bench_sets(pure, keys, value))
+    run('pure get', num_requests, bench_gets(pure, keys))
+
+
+if __name__ == '__main__':
+    main()
@@ -1,59 +1,182 @@
 #include <Python.h>
 #include <shardcache_client.h>
 
+#if PY_MAJOR_VERSION >= 3
+#define PyString_FromStringAndSize PyBytes_FromStringAndSize
+#define BUFFER_TPFLAGS Py_TPFLAGS_DEFAULT
+#else
+#define BUFFER_TPFLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER)
+#endif
+
+static PyObject * ShardcacheError = NULL;
+
+/* - */
+
+// Memory returned by the client library, exposed through the buffer protocol
+// so that the values can be handed to python (as memoryview objects) without copying them
+
+typedef struct {
+    PyObject_HEAD
+    void       * data;
+    Py_ssize_t   len;
+} Buffer;
+
+static void Buffer_dealloc(PyObject * self) {
+    Buffer * buffer = (Buffer *)self;
+    free(buffer->data);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static int Buffer_getbuffer(PyObject * self, Py_buffer * view, int flags) {
+    Buffer * buffer = (Buffer *)self;
+    return PyBuffer_FillInfo(view, self, buffer->data, buffer->len, 1, flags);
+}
+
+static PyBufferProcs Buffer_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+    NULL,                           // bf_getreadbuffer
+    NULL,                           // bf_getwritebuffer
+    NULL,                           // bf_getsegcount
+    NULL,                           // bf_getcharbuffer
+#endif
+    Buffer_getbuffer,               // bf_getbuffer
+    NULL,                           // bf_releasebuffer
+};
+
+static PyTypeObject BufferType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "shardcacheclient.Buffer",      // tp_name
+    sizeof(Buffer),                 // tp_basicsize
+    0,                              // tp_itemsize
+    Buffer_dealloc,                 // tp_dealloc
+    0,                              // tp_print
+    NULL,                           // tp_getattr
+    NULL,                           // tp_setattr
+    NULL,                           // tp_compare
+    NULL,                           // tp_repr
+    NULL,                           // tp_as_number
+    NULL,                           // tp_as_sequence
+    NULL,                           // tp_as_mapping
+    NULL,                           // tp_hash
+    NULL,                           // tp_call
+    NULL,                           // tp_str
+    NULL,                           // tp_getattro
+    NULL,                           // tp_setattro
+    &Buffer_as_buffer,              // tp_as_buffer
+    BUFFER_TPFLAGS,                 // tp_flags
+    "Value owned by the shardcache client library",  // tp_doc
+};
+
+// takes ownership of data (which is released even on failure)
+static PyObject * value_new(void * data, size_t len) {
+    Buffer * buffer = PyObject_New(Buffer, &BufferType);
+    if (buffer == NULL) {
+        free(data);
+        return NULL;
+    }
+    buffer->data = data;
+    buffer->len  = (Py_ssize_t)len;
+
+    PyObject * view = PyMemoryView_FromObject((PyObject *)buffer);
+    Py_DECREF(buffer);
+    return view;
+}
+
+/* - */
+
 typedef struct {
     PyObject_HEAD
     shardcache_client_t * shardcache;
 } Client;
 
-static PyObject * Client_new(PyTypeObject * type, PyObject * args, PyObject * kwds) {
-    PyObject * self   = type->tp_alloc(type, 0);
-    Client   * client = (Client *)self;
+static PyObject * client_error(Client * client) {
+    PyObject * error = Py_BuildValue("(is)",
+                                     shardcache_client_errno(client->shardcache),
+                                     shardcache_client_errstr(client->shardcache));
+    if (error) {
+        PyErr_SetObject(ShardcacheError, error);
+        Py_DECREF(error);
+    }
+    return NULL;
+}
 
-    if (self == NULL)
+static shardcache_node_t * node_from_object(PyObject * node_object) {
+    char * node_label   = NULL;
+    char * node_address = NULL;
+
+    // either a (label, address) tuple or a full node string (label:address)
+    if (PyTuple_Check(node_object)) {
+        if (!PyArg_ParseTuple(node_object, "ss", &node_label, &node_address))
+            return NULL;
+    } else if (!PyArg_Parse(node_object, "s", &node_address)) {
         return NULL;
+    }
+
+    size_t size = strlen(node_address) + (node_label ? strlen(node_label) + 2 : 1);
+    char * node_string = malloc(size);
+    if (node_label)
+        snprintf(node_string, size, "%s:%s", node_label, node_address);
+    else
+        snprintf(node_string, size, "%s", node_address);
+
+    // multiple addresses (replicas) can be separated by ';'
+    shardcache_node_t * node = shardcache_node_create_from_string(node_string);
+    if (node == NULL)
+        PyErr_Format(PyExc_ValueError, "Bad node string '%s'", node_string);
+    free(node_string);
+    return node;
+}
 
+static PyObject * Client_new(PyTypeObject * type, PyObject * args, PyObject * kwds) {
     PyObject * node_list = NULL;
-    PyObject * secret    = NULL;
-    char     * auth      = NULL;
+    char     * auth      = NULL; // accepted for compatibility, the nodes don't use it anymore
 
-    Py_ssize_t node_list_nr = 0;
-    if (!PyArg_ParseTuple(args, "Os", &node_list, &auth))
-        goto fail;
+    static char * kwlist[] = { "nodes", "secret", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|z", kwlist, &node_list, &auth))
+        return NULL;
 
     if (!PySequence_Check(node_list)) {
-        // TODO: throw exceptions
-        goto fail;
+        PyErr_SetString(PyExc_TypeError, "The nodes must be a sequence");
+        return NULL;
     }
 
-    node_list_nr = PySequence_Size(node_list);
-    if (node_list_nr <= 0)
-        goto fail;
+    Py_ssize_t node_list_nr = PySequence_Size(node_list);
+    if (node_list_nr <= 0) {
+        PyErr_SetString(PyExc_ValueError, "At least one node is required");
+        return NULL;
+    }
 
-    shardcache_node_t **nodes = malloc(node_list_nr * sizeof(shardcache_node_t *));
+    shardcache_node_t ** nodes = calloc(node_list_nr, sizeof(shardcache_node_t *));
 
     int i;
     for (i = 0; i < node_list_nr; i++) {
         PyObject * node_object = PySequence_GetItem(node_list, i);
+        if (node_object == NULL)
+            break;
+        nodes[i] = node_from_object(node_object);
+        Py_DECREF(node_object);
+        if (nodes[i] == NULL)
+            break;
+    }
 
-        char * node_label   = NULL;
-        char * node_address = NULL;
-
-        PyArg_ParseTuple(node_object, "ss", &node_label, &node_address);
-
-        nodes[i] = shardcache_node_create(node_label, &node_address, 1);
+    if (i < node_list_nr) {
+        shardcache_free_nodes(nodes, i);
+        return NULL;
     }
 
-    client->shardcache = shardcache_client_create(nodes, (int)node_list_nr, auth);
+    PyObject * self = type->tp_alloc(type, 0);
+    if (self != NULL) {
+        Client * client = (Client *)self;
+        client->shardcache = shardcache_client_create(nodes, (int)node_list_nr);
+        if (client->shardcache == NULL) {
+            PyErr_SetString(ShardcacheError, "Can't create the shardcache client");
+            Py_DECREF(self);
+            self = NULL;
+        }
+    }
     shardcache_free_nodes(nodes, (int)node_list_nr);
 
     return self;
-
-fail:
-    Py_XDECREF(secret);
-    Py_XDECREF(node_list);
-    Py_XDECREF(self);
-    return NULL;    
 }
 
 static void Client_dealloc(PyObject * self) {
@@ -61,68 +184,604 @@ static void Client_dealloc(PyObject * self) {
     if (client->shardcache)
         shardcache_client_destroy(client->shardcache);
 
-    self->ob_type->tp_free(self);
+    Py_TYPE(self)->tp_free(self);
 }
 
+// The methods below accept keys and values as any object supporting the buffer
+// protocol (bytes, str, bytearray, memoryview ...) and don't copy them.
+// The GIL is released while talking to the nodes, the client can be shared
+// among python threads.
+
 static PyObject * Client_get(PyObject * self, PyObject * args) {
-    Client   * client     = (Client *)self;
-    PyObject * key_string = NULL;
-    if (!PyArg_ParseTuple(args, "O", &key_string))
+    Client    * client = (Client *)self;
+    Py_buffer   key;
+    if (!PyArg_ParseTuple(args, "s*", &key))
         return NULL;
 
-    void   * data;
+    void   * data = NULL;
     size_t   data_len;
+    int      err;
+
+    Py_BEGIN_ALLOW_THREADS
+    data_len = shardcache_client_get(client->shardcache, key.buf, key.len, &data);
+    err = shardcache_client_errno(client->shardcache);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&key);
+
+    if (data_len == 0) {
+        free(data);
+        if (err != SHARDCACHE_CLIENT_OK)
+            return client_error(client);
+        Py_RETURN_NONE;
+    }
+
+    return value_new(data, data_len);
+}
+
+static PyObject * Client_offset(PyObject * self, PyObject * args) {
+    Client       * client = (Client *)self;
+    Py_buffer      key;
+    unsigned int   offset = 0;
+    unsigned int   length = 0;
+    if (!PyArg_ParseTuple(args, "s*II", &key, &offset, &length))
+        return NULL;
+
+    void * data = malloc(length ? length : 1);
+    if (data == NULL) {
+        PyBuffer_Release(&key);
+        return PyErr_NoMemory();
+    }
+
+    size_t data_len;
+    int    err;
+
+    Py_BEGIN_ALLOW_THREADS
+    data_len = shardcache_client_offset(client->shardcache, key.buf, key.len, offset, data, length);
+    err = shardcache_client_errno(client->shardcache);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&key);
+
+    if (data_len == 0 && err != SHARDCACHE_CLIENT_OK) {
+        free(data);
+        return client_error(client);
+    }
+
+    return value_new(data, data_len);
+}
+
+typedef struct {
+    PyObject * callback;
+    int        failed;
+    int        stopped;
+} get_async_arg_t;
+
+static int get_async_chunk(char * node, void * key, size_t klen, void * data, size_t dlen,
+                           size_t total_len, int error, void * priv)
+{
+    get_async_arg_t * arg = (get_async_arg_t *)priv;
+    if (error) {
+        arg->failed = 1;
+        return -1;
+    }
+
+    // the end of the value is reported by the return of get_async()
+    if (data == NULL && dlen == 0)
+        return 0;
+
+    PyGILState_STATE state = PyGILState_Ensure();
+
+    // the chunk is valid only during this call, so it's copied
+    int rc = 0;
+    PyObject * result = PyObject_CallFunction(arg->callback, "(Nn)",
+                                              PyString_FromStringAndSize(data, dlen),
+                                              (Py_ssize_t)total_len);
+    if (result == NULL) {
+        arg->failed = 1;
+        rc = -1;
+    } else {
+        // returning False stops the transfer
+        if (result == Py_False) {
+            arg->stopped = 1;
+            rc = -1;
+        }
+        Py_DECREF(result);
+    }
+
+    PyGILState_Release(state);
+    return rc;
+}
+
+static PyObject * Client_get_async(PyObject * self, PyObject * args) {
+    Client    * client   = (Client *)self;
+    Py_buffer   key;
+    PyObject  * callback = NULL;
+    if (!PyArg_ParseTuple(args, "s*O", &key, &callback))
+        return NULL;
+
+    if (!PyCallable_Check(callback)) {
+        PyBuffer_Release(&key);
+        PyErr_SetString(PyExc_TypeError, "The callback must be callable");
+        return NULL;
+    }
+
+    get_async_arg_t arg = { callback, 0, 0 };
+    int rc;
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = shardcache_client_get_async(client->shardcache, key.buf, key.len, get_async_chunk, &arg);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&key);
+
+    // an exception raised by the callback takes precedence
+    if (PyErr_Occurred())
+        return NULL;
+
+    if (arg.stopped)
+        Py_RETURN_FALSE;
+
+    if (rc != 0 || arg.failed)
+        return client_error(client);
+
+    Py_RETURN_TRUE;
+}
+
+#define SET_MODE_SET 0
+#define SET_MODE_ADD 1
+
+static PyObject * client_set_internal(PyObject * self, PyObject * args, PyObject * kwds, int mode) {
+    Client       * client = (Client *)self;
+    Py_buffer      key;
+    Py_buffer      value;
+    unsigned int   expire = 0;
+
+    static char * kwlist[] = { "key", "value", "expire", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*s*|I", kwlist, &key, &value, &expire))
+        return NULL;
+
+    int rc;
+    Py_BEGIN_ALLOW_THREADS
+    if (mode == SET_MODE_ADD)
+        rc = shardcache_client_add(client->shardcache, key.buf, key.len, value.buf, value.len, expire);
+    else
+        rc = shardcache_client_set(client->shardcache, key.buf, key.len, value.buf, value.len, expire);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&key);
+    PyBuffer_Release(&value);
+
+    if (rc == -1)
+        return client_error(client);
+
+    // add() returns False if the key already exists
+    return PyBool_FromLong(rc == 0);
+}
 
-    data_len = shardcache_client_get(client->shardcache,
-                                     PyString_AsString(key_string),
-                                     PyString_Size(key_string),
-                                     &data);
+static PyObject * Client_set(PyObject * self, PyObject * args, PyObject * kwds) {
+    return client_set_internal(self, args, kwds, SET_MODE_SET);
+}
+
+static PyObject * Client_add(PyObject * self, PyObject * args, PyObject * kwds) {
+    return client_set_internal(self, args, kwds, SET_MODE_ADD);
+}
+
+static PyObject * client_counter_internal(PyObject * self, PyObject * args, PyObject * kwds, int decrement) {
+    Client       * client  = (Client *)self;
+    Py_buffer      key;
+    long long      amount  = 1;
+    long long      initial = 0;
+    unsigned int   expire  = 0;
+
+    static char * kwlist[] = { "key", "amount", "initial", "expire", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*|LLI", kwlist, &key, &amount, &initial, &expire))
+        return NULL;
+
+    int64_t computed = 0;
+    int rc;
+    Py_BEGIN_ALLOW_THREADS
+    if (decrement)
+        rc = shardcache_client_decrement(client->shardcache, key.buf, key.len,
+                                         amount, initial, &computed, expire);
+    else
+        rc = shardcache_client_increment(client->shardcache, key.buf, key.len,
+                                         amount, initial, &computed, expire);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&key);
+
+    if (rc == -1)
+        return client_error(client);
+
+    return PyLong_FromLongLong(computed);
+}
+
+static PyObject * Client_increment(PyObject * self, PyObject * args, PyObject * kwds) {
+    return client_counter_internal(self, args, kwds, 0);
+}
+
+static PyObject * Client_decrement(PyObject * self, PyObject * args, PyObject * kwds) {
+    return client_counter_internal(self, args, kwds, 1);
+}
+
+#define KEY_COMMAND_DELETE 0
+#define KEY_COMMAND_EVICT  1
+#define KEY_COMMAND_TOUCH  2
+#define KEY_COMMAND_EXISTS 3
+
+static PyObject * client_key_command(PyObject * self, PyObject * args, int cmd) {
+    Client    * client = (Client *)self;
+    Py_buffer   key;
+    if (!PyArg_ParseTuple(args, "s*", &key))
+        return NULL;
+
+    int rc = -1;
+    Py_BEGIN_ALLOW_THREADS
+    switch(cmd) {
+        case KEY_COMMAND_DELETE:
+            rc = shardcache_client_del(client->shardcache, key.buf, key.len);
+            break;
+        case KEY_COMMAND_EVICT:
+            rc = shardcache_client_evict(client->shardcache, key.buf, key.len);
+            break;
+        case KEY_COMMAND_TOUCH:
+            rc = shardcache_client_touch(client->shardcache, key.buf, key.len);
+            break;
+        case KEY_COMMAND_EXISTS:
+            rc = shardcache_client_exists(client->shardcache, key.buf, key.len);
+            break;
+    }
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&key);
+
+    if (rc == -1)
+        return client_error(client);
+
+    if (cmd == KEY_COMMAND_EXISTS)
+        return PyBool_FromLong(rc == 1);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject * Client_delete(PyObject * self, PyObject * args) {
+    return client_key_command(self, args, KEY_COMMAND_DELETE);
+}
+
+static PyObject * Client_evict(PyObject * self, PyObject * args) {
+    return client_key_command(self, args, KEY_COMMAND_EVICT);
+}
+
+static PyObject * Client_touch(PyObject * self, PyObject * args) {
+    return client_key_command(self, args, KEY_COMMAND_TOUCH);
+}
+
+static PyObject * Client_exists(PyObject * self, PyObject * args) {
+    return client_key_command(self, args, KEY_COMMAND_EXISTS);
+}
+
+// The items of the batched commands are built directly on the buffers of the keys
+// (and of the values) instead of using shc_multi_item_create(), which would copy them
+
+typedef struct {
+    shc_multi_item_t ** items;
+    Py_buffer         * keys;
+    Py_buffer         * values;
+    Py_ssize_t          count;
+} multi_batch_t;
+
+static void multi_batch_destroy(multi_batch_t * batch) {
+    Py_ssize_t i;
+    for (i = 0; i < batch->count; i++) {
+        PyBuffer_Release(&batch->keys[i]);
+        if (batch->values) {
+            PyBuffer_Release(&batch->values[i]);
+        } else if (batch->items[i]) {
+            // the values fetched by get_multi() not handed to python
+            free(batch->items[i]->data);
+        }
+        free(batch->items[i]);
+    }
+    free(batch->items);
+    free(batch->keys);
+    free(batch->values);
+}
+
+static int multi_batch_add(multi_batch_t * batch, PyObject * key, PyObject * value, unsigned int expire) {
+    Py_ssize_t i = batch->count;
+
+    if (!PyArg_Parse(key, "s*", &batch->keys[i]))
+        return -1;
+
+    if (value && !PyArg_Parse(value, "s*", &batch->values[i])) {
+        PyBuffer_Release(&batch->keys[i]);
+        return -1;
+    }
+
+    shc_multi_item_t * item = calloc(1, sizeof(shc_multi_item_t));
+    if (item == NULL) {
+        PyBuffer_Release(&batch->keys[i]);
+        if (value)
+            PyBuffer_Release(&batch->values[i]);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    item->key  = batch->keys[i].buf;
+    item->klen = batch->keys[i].len;
+    if (value) {
+        item->data = batch->values[i].buf;
+        item->dlen = batch->values[i].len;
+    }
+    item->expire = expire;
+
+    batch->items[i] = item;
+    batch->count++;
+    return 0;
+}
+
+static int multi_batch_init(multi_batch_t * batch, Py_ssize_t size, int with_values) {
+    memset(batch, 0, sizeof(multi_batch_t));
+    // the items array is NULL-terminated
+    batch->items = calloc(size + 1, sizeof(shc_multi_item_t *));
+    batch->keys  = calloc(size ? size : 1, sizeof(Py_buffer));
+    if (with_values)
+        batch->values = calloc(size ? size : 1, sizeof(Py_buffer));
+    if (!batch->items || !batch->keys || (with_values && !batch->values)) {
+        multi_batch_destroy(batch);
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
 
+static PyObject * Client_get_multi(PyObject * self, PyObject * args) {
+    Client   * client = (Client *)self;
+    PyObject * keys   = NULL;
+    if (!PyArg_ParseTuple(args, "O", &keys))
+        return NULL;
+
+    PyObject * sequence = PySequence_Fast(keys, "The keys must be a sequence");
+    if (sequence == NULL)
+        return NULL;
 
-    if (data_len == 0)
-        // TODO: exception
+    Py_ssize_t num_keys = PySequence_Fast_GET_SIZE(sequence);
+    multi_batch_t batch;
+    if (multi_batch_init(&batch, num_keys, 0) != 0) {
+        Py_DECREF(sequence);
         return NULL;
+    }
+
+    Py_ssize_t i;
+    for (i = 0; i < num_keys; i++) {
+        if (multi_batch_add(&batch, PySequence_Fast_GET_ITEM(sequence, i), NULL, 0) != 0) {
+            multi_batch_destroy(&batch);
+            Py_DECREF(sequence);
+            return NULL;
+        }
+    }
 
-    PyObject * response = PyString_FromStringAndSize(data, data_len);
-    free(data);
-    return response;
+    int rc = 0;
+    if (num_keys) {
+        Py_BEGIN_ALLOW_THREADS
+        rc = shardcache_client_get_multi(client->shardcache, batch.items);
+        Py_END_ALLOW_THREADS
+    }
+
+    PyObject * result = NULL;
+    if (rc != 0) {
+        client_error(client);
+    } else {
+        // the values are returned in the same order as the keys, None if not found
+        result = PyList_New(num_keys);
+        for (i = 0; result && i < num_keys; i++) {
+            shc_multi_item_t * item = batch.items[i];
+            PyObject * value;
+            if (item->data && item->dlen) {
+                value = value_new(item->data, item->dlen);
+                item->data = NULL;
+            } else {
+                value = Py_None;
+                Py_INCREF(value);
+            }
+            if (value == NULL) {
+                Py_CLEAR(result);
+                break;
+            }
+            PyList_SET_ITEM(result, i, value);
+        }
+    }
+
+    multi_batch_destroy(&batch);
+    Py_DECREF(sequence);
+    return result;
 }
 
-static PyObject * Client_set(PyObject * self, PyObject * args) {
-    Client   * client       = (Client *)self;
-    PyObject * key_string   = NULL;
-    PyObject * value_string = NULL;
-    unsigned int expire = 0;
+static PyObject * Client_set_multi(PyObject * self, PyObject * args, PyObject * kwds) {
+    Client       * client = (Client *)self;
+    PyObject     * values = NULL;
+    unsigned int   expire = 0;
+
+    static char * kwlist[] = { "items", "expire", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|I", kwlist, &values, &expire))
+        return NULL;
+
+    // either a dictionary or a sequence of (key, value) pairs
+    PyObject * pairs = PyDict_Check(values)
+                     ? PyDict_Items(values)
+                     : PySequence_Fast(values, "The items must be a dictionary or a sequence of pairs");
+    if (pairs == NULL)
+        return NULL;
 
-    if (!PyArg_ParseTuple(args, "OO|I", &key_string, &value_string, &expire))
+    PyObject * sequence = PySequence_Fast(pairs, "The items must be a dictionary or a sequence of pairs");
+    Py_DECREF(pairs);
+    if (sequence == NULL)
         return NULL;
 
-    int response = shardcache_client_set(client->shardcache,
-                                         PyString_AsString(key_string),
-                                         PyString_Size(key_string),
-                                         PyString_AsString(value_string),
-                                         PyString_Size(value_string),
-                                         expire); // Hardcoded for now
+    Py_ssize_t num_items = PySequence_Fast_GET_SIZE(sequence);
+    multi_batch_t batch;
+    if (multi_batch_init(&batch, num_items, 1) != 0) {
+        Py_DECREF(sequence);
+        return NULL;
+    }
 
-    return Py_BuildValue("i", response);
+    Py_ssize_t i;
+    for (i = 0; i < num_items; i++) {
+        PyObject * key   = NULL;
+        PyObject * value = NULL;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(sequence, i), "OO", &key, &value) ||
+            multi_batch_add(&batch, key, value, expire) != 0)
+        {
+            multi_batch_destroy(&batch);
+            Py_DECREF(sequence);
+            return NULL;
+        }
+    }
+
+    int rc = 0;
+    if (num_items) {
+        Py_BEGIN_ALLOW_THREADS
+        rc = shardcache_client_set_multi(client->shardcache, batch.items);
+        Py_END_ALLOW_THREADS
+    }
+
+    PyObject * result = NULL;
+    if (rc != 0) {
+        client_error(client);
+    } else {
+        // maps each key to the outcome of its own set command
+        result = PyDict_New();
+        for (i = 0; result && i < num_items; i++) {
+            PyObject * key = PySequence_Fast_GET_ITEM(PySequence_Fast_GET_ITEM(sequence, i), 0);
+            if (PyDict_SetItem(result, key, batch.items[i]->status == 0 ? Py_True : Py_False) != 0)
+                Py_CLEAR(result);
+        }
+    }
+
+    multi_batch_destroy(&batch);
+    Py_DECREF(sequence);
+    return result;
 }
 
+static PyObject * Client_stats(PyObject * self, PyObject * args) {
+    Client * client    = (Client *)self;
+    char   * node_name = NULL;
+    if (!PyArg_ParseTuple(args, "s", &node_name))
+        return NULL;
+
+    char   * buf = NULL;
+    size_t   len = 0;
+    int      rc;
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = shardcache_client_stats(client->shardcache, node_name, &buf, &len);
+    Py_END_ALLOW_THREADS
+
+    if (rc != 0)
+        return client_error(client);
+
+    PyObject * stats = PyString_FromStringAndSize(buf, len);
+    free(buf);
+    return stats;
+}
+
+static PyObject * Client_check(PyObject * self, PyObject * args) {
+    Client * client    = (Client *)self;
+    char   * node_name = NULL;
+    if (!PyArg_ParseTuple(args, "s", &node_name))
+        return NULL;
+
+    int rc;
+    Py_BEGIN_ALLOW_THREADS
+    rc = shardcache_client_check(client->shardcache, node_name);
+    Py_END_ALLOW_THREADS
+
+    return PyBool_FromLong(rc == 0);
+}
+
+static PyObject * Client_near_cache_enable(PyObject * self, PyObject * args) {
+    Client       * client = (Client *)self;
+    Py_ssize_t     size   = 0;
+    unsigned int   ttl    = 0;
+    if (!PyArg_ParseTuple(args, "n|I", &size, &ttl))
+        return NULL;
+
+    if (shardcache_client_near_cache_enable(client->shardcache, size, ttl) != 0)
+        return client_error(client);
+
+    Py_RETURN_NONE;
+}
+
+// options follow the library convention: the current value is returned
+// and a new one is set only if provided (and not negative)
+#define CLIENT_OPTION(_name) \
+static PyObject * Client_##_name(PyObject * self, PyObject * args) { \
+    Client * client    = (Client *)self; \
+    int      new_value = -1; \
+    if (!PyArg_ParseTuple(args, "|i", &new_value)) \
+        return NULL; \
+    return PyLong_FromLong(shardcache_client_##_name(client->shardcache, new_value)); \
+}
+
+CLIENT_OPTION(tcp_timeout)
+CLIENT_OPTION(pipeline_max)
+CLIENT_OPTION(multi_command_max_keys)
+CLIENT_OPTION(use_random_node)
+CLIENT_OPTION(routing_mode)
+CLIENT_OPTION(topology_check_interval)
+
 /* - */
 
 static PyMethodDef Client_methods[] = {
-    { "get", Client_get, METH_VARARGS, "Get a key from the shardcache" },
-    { "set", Client_set, METH_VARARGS, "Set a key in the shardcache" },
+    { "get", Client_get, METH_VARARGS,
+      "get(key) -> memoryview or None\nGet a key from the shardcache" },
+    { "offset", Client_offset, METH_VARARGS,
+      "offset(key, offset, length) -> memoryview\nGet part of the value of a key" },
+    { "get_async", Client_get_async, METH_VARARGS,
+      "get_async(key, callback) -> bool\nGet a key calling callback(chunk, total_size) for each chunk "
+      "as soon as it's received, returning False from the callback stops the transfer "
+      "(and makes get_async() return False)" },
+    { "get_multi", Client_get_multi, METH_VARARGS,
+      "get_multi(keys) -> list\nGet multiple keys at once, the values (or None) "
+      "are returned in the same order as the keys" },
+    { "set", (PyCFunction)Client_set, METH_VARARGS | METH_KEYWORDS,
+      "set(key, value, expire=0) -> True\nSet a key in the shardcache" },
+    { "add", (PyCFunction)Client_add, METH_VARARGS | METH_KEYWORDS,
+      "add(key, value, expire=0) -> bool\nSet a key only if it doesn't exist yet" },
+    { "set_multi", (PyCFunction)Client_set_multi, METH_VARARGS | METH_KEYWORDS,
+      "set_multi(items, expire=0) -> dict\nSet multiple keys at once, items is a dictionary "
+      "(or a sequence of pairs), the outcome of each set is returned by key" },
+    { "increment", (PyCFunction)Client_increment, METH_VARARGS | METH_KEYWORDS,
+      "increment(key, amount=1, initial=0, expire=0) -> int\nIncrement a counter" },
+    { "decrement", (PyCFunction)Client_decrement, METH_VARARGS | METH_KEYWORDS,
+      "decrement(key, amount=1, initial=0, expire=0) -> int\nDecrement a counter" },
+    { "delete", Client_delete, METH_VARARGS, "delete(key)\nRemove a key from the shardcache" },
+    { "evict", Client_evict, METH_VARARGS, "evict(key)\nEvict a key from the caches" },
+    { "touch", Client_touch, METH_VARARGS, "touch(key)\nLoad a key in the cache of its owner" },
+    { "exists", Client_exists, METH_VARARGS, "exists(key) -> bool\nCheck if a key exists" },
+    { "stats", Client_stats, METH_VARARGS, "stats(node) -> bytes\nGet the stats of a node" },
+    { "check", Client_check, METH_VARARGS, "check(node) -> bool\nCheck if a node is alive" },
+    { "near_cache_enable", Client_near_cache_enable, METH_VARARGS,
+      "near_cache_enable(size, ttl=0)\nKeep a local copy of the values retrieved by get()" },
+    { "tcp_timeout", Client_tcp_timeout, METH_VARARGS, "tcp_timeout([new_value]) -> int" },
+    { "pipeline_max", Client_pipeline_max, METH_VARARGS, "pipeline_max([new_value]) -> int" },
+    { "multi_command_max_keys", Client_multi_command_max_keys, METH_VARARGS,
+      "multi_command_max_keys([new_value]) -> int" },
+    { "use_random_node", Client_use_random_node, METH_VARARGS, "use_random_node([new_value]) -> int" },
+    { "routing_mode", Client_routing_mode, METH_VARARGS, "routing_mode([new_value]) -> int" },
+    { "topology_check_interval", Client_topology_check_interval, METH_VARARGS,
+      "topology_check_interval([new_value]) -> int" },
     { NULL }
 };
 
 static PyTypeObject ClientType = {
-    PyObject_HEAD_INIT(NULL)
-    0,                              // ob_size
+    PyVarObject_HEAD_INIT(NULL, 0)
     "shardcacheclient.Client",      // tp_name
     sizeof(Client),                 // tp_basicsize
     0,                              // tp_itemsize
     Client_dealloc,                 // tp_dealloc
-    NULL,                           // tp_print
+    0,                              // tp_print
     NULL,                           // tp_getattr
     NULL,                           // tp_setattr
     NULL,                           // tp_compare
@@ -137,7 +796,9 @@ static PyTypeObject ClientType = {
     NULL,                           // tp_setattro
     NULL,                           // tp_as_buffer
     Py_TPFLAGS_DEFAULT,             // tp_flags
-    "Shardcache client interface",  // tp_doc
+    "Client(nodes, secret=None)\n"
+    "Shardcache client interface, nodes is a sequence of (label, address) tuples\n"
+    "(or of 'label:address' strings), multiple addresses can be separated by ';'",  // tp_doc
     NULL,                           // tp_traverse
     NULL,                           // tp_clear
     NULL,                           // tp_richcompare
@@ -163,17 +824,45 @@ static PyMethodDef module_methods[] = {
     { NULL }
 };
 
-PyMODINIT_FUNC initshardcacheclient(void) {
+static PyObject * module_init(void) {
     PyObject * module;
 
-    if (PyType_Ready(&ClientType) < 0)
-        return;
+    if (PyType_Ready(&ClientType) < 0 || PyType_Ready(&BufferType) < 0)
+        return NULL;
 
+#if PY_MAJOR_VERSION >= 3
+    static struct PyModuleDef module_def = {
+        PyModuleDef_HEAD_INIT,
+        "shardcacheclient",
+        "Bindings to the shardcache-client library",
+        -1,
+        module_methods
+    };
+    module = PyModule_Create(&module_def);
+#else
+    // the callbacks of get_async() might need to acquire the GIL
+    PyEval_InitThreads();
     module = Py_InitModule("shardcacheclient", module_methods);
+#endif
     if (module == NULL)
-        return;
+        return NULL;
+
+    ShardcacheError = PyErr_NewException("shardcacheclient.Error", NULL, NULL);
+    Py_INCREF(ShardcacheError);
+    PyModule_AddObject(module, "Error", ShardcacheError);
 
     Py_INCREF(&ClientType);
     PyModule_AddObject(module, "Client", (PyObject *)&ClientType);
+
+    return module;
 }
 
+#if PY_MAJOR_VERSION >= 3
+PyMODINIT_FUNC PyInit_shardcacheclient(void) {
+    return module_init();
+}
+#else
+PyMODINIT_FUNC initshardcacheclient(void) {
+    module_init();
+}
+#endif
@@ -0,0 +1,126 @@
+import threading
+import unittest
+import shardcacheclient
+
+# like test_connection.py these tests need a shardcached peer on localhost:4444
+NODES = (('peer1', 'localhost:4444'),)
+
+class TestClient(unittest.TestCase):
+    def setUp(self):
+        self.client = shardcacheclient.Client(NODES, '')
+
+    def test_bad_nodes(self):
+        self.assertRaises(ValueError, shardcacheclient.Client, (), '')
+        self.assertRaises(TypeError, shardcacheclient.Client, 42, '')
+
+    def test_missing_key(self):
+        self.client.delete('test_missing_key')
+        self.assertEqual(self.client.get('test_missing_key'), None)
+        self.assertFalse(self.client.exists('test_missing_key'))
+
+    def test_add_and_delete(self):
+        self.client.delete('test_add')
+        self.assertTrue(self.client.add('test_add', 'first'))
+        self.assertFalse(self.client.add('test_add', 'second'))
+        self.assertEqual(self.client.get('test_add').tobytes(), b'first')
+        self.assertTrue(self.client.exists('test_add'))
+        self.client.delete('test_add')
+        self.assertFalse(self.client.exists('test_add'))
+
+    def test_buffers(self):
+        # any object exporting a buffer can be used as key or value
+        value = bytearray(b'\x00\x01binary\xff')
+        self.client.set(memoryview(b'test_buffers'), value)
+        self.assertEqual(self.client.get(b'test_buffers').tobytes(), bytes(value))
+
+    def test_multi(self):
+        items = dict(('test_multi%d' % i, 'value%d' % i) for i in range(100))
+        result = self.client.set_multi(items)
+        self.assertEqual(sorted(result.keys()), sorted(items.keys()))
+        self.assertTrue(all(result.values()))
+        # the pairs can also be passed as a sequence
+        self.assertEqual(self.client.set_multi([('test_multi_pair', 'pair')]), { 'test_multi_pair': True })
+
+        keys = sorted(items.keys()) + ['test_multi_missing']
+        self.client.delete('test_multi_missing')
+        values = self.client.get_multi(keys)
+        self.assertEqual(len(values), len(keys))
+        self.assertEqual(values[-1], None)
+        for key, value in zip(keys[:-1], values[:-1]):
+            self.assertEqual(value.tobytes(), items[key].encode())
+
+        self.assertEqual(self.client.get_multi([]), [])
+        self.assertRaises(TypeError, self.client.set_multi, 42)
+
+    def test_counters(self):
+        self.client.delete('test_counter')
+        self.assertEqual(self.client.increment('test_counter', initial=10), 11)
+        self.assertEqual(self.client.increment('test_counter', amount=5), 16)
+        self.assertEqual(self.client.decrement('test_counter', 6), 10)
+
+    def test_get_async(self):
+        value = b'x' * (1 << 20)
+        self.client.set('test_get_async', value)
+
+        chunks = []
+        def collect(chunk, total_size):
+            self.assertEqual(total_size, len(value))
+            chunks.append(chunk)
+        self.assertTrue(self.client.get_async('test_get_async', collect))
+        self.assertEqual(b''.join(chunks), value)
+
+        # returning False stops the transfer
+        stopped = []
+        def stop(chunk, total_size):
+            stopped.append(chunk)
+            return False
+        self.assertFalse(self.client.get_async('test_get_async', stop))
+        self.assertEqual(len(stopped), 1)
+
+        # an exception raised by the callback is propagated
+        def fail(chunk, total_size):
+            raise KeyError('test')
+        self.assertRaises(KeyError, self.client.get_async, 'test_get_async', fail)
+
+        self.assertRaises(TypeError, self.client.get_async, 'test_get_async', 42)
+
+    def test_errors(self):
+        # nothing listens on this port
+        client = shardcacheclient.Client((('peer1', 'localhost:1'),), '')
+        client.tcp_timeout(100)
+        self.assertRaises(shardcacheclient.Error, client.set, 'test_errors', 'value')
+        self.assertFalse(client.check('peer1'))
+
+    def test_options(self):
+        self.client.tcp_timeout(1000)
+        self.assertEqual(self.client.tcp_timeout(), 1000)
+        self.client.multi_command_max_keys(10)
+        self.assertEqual(self.client.multi_command_max_keys(), 10)
+        self.assertTrue(self.client.check('peer1'))
+        self.assertTrue(len(self.client.stats('peer1')) > 0)
+
+    def test_near_cache(self):
+        self.client.near_cache_enable(1 << 20)
+        self.client.set('test_near_cache', 'value')
+        for i in range(10):
+            self.assertEqual(self.client.get('test_near_cache').tobytes(), b'value')
+
+    def test_threads(self):
+        # the client can be shared by several threads
+        # (the GIL is released while waiting for the peer)
+        self.client.set('test_threads', 'value')
+        errors = []
+        def run():
+            for i in range(100):
+                value = self.client.get('test_threads')
+                if value is None or value.tobytes() != b'value':
+                    errors.append(value)
+        threads = [threading.Thread(target=run) for i in range(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(errors, [])
+
+if __name__ == '__main__':
+    unittest.main()
@@ -5,8 +5,9 @@ class Test(unittest.TestCase):
     def runTest(self):
         x = shardcacheclient.Client((('peer1', 'localhost:4444'),), '')
         x.set('mannaia', '234')
-        x.get('mannaia')
+        self.assertEqual(x.get('mannaia').tobytes(), b'234')
+        self.assertEqual([v.tobytes() for v in x.get_multi(['mannaia'])], [b'234'])
+        self.assertEqual(x.offset('mannaia', 1, 2).tobytes(), b'34')
 
 if __name__ == '__main__':
     unittest.main()
-
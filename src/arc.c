@@ -697,6 +697,7 @@ typedef struct {
     time_t ttl;
     void *data;
     size_t dlen;
+    int ref;
  } upload_obj_cb_arg_t;
 
 static void *
@@ -705,21 +706,25 @@ update_obj_cb(void *data, size_t dlen, void *user)
     upload_obj_cb_arg_t *arg = (upload_obj_cb_arg_t *)user;
     arc_object_t *obj = (arc_object_t *)data;
     arc_t *cache = (arc_t *)arg->cache;
-    cache->ops->store(obj->ptr, arg->data, arg->dlen, cache->ops->priv);
+    if (arg->ref)
+        cache->ops->store_ref(obj->ptr, arg->data, arg->dlen, cache->ops->priv);
+    else
+        cache->ops->store(obj->ptr, arg->data, arg->dlen, cache->ops->priv);
     if (arg->ttl) {
     }
     //retain_ref(cache->refcnt, obj->node);
     return arg->data;
 }
 
-int
-arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen, time_t ttl)
+static int
+arc_load_internal(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen, time_t ttl, int ref)
 {
     upload_obj_cb_arg_t arg = {
         .cache = cache,
         .ttl = ttl,
         .data = valuep,
-        .dlen = vlen
+        .dlen = vlen,
+        .ref = ref
     };
     arc_object_t *obj = ht_get_deep_copy(cache->hash, (void *)key, klen, NULL, update_obj_cb, &arg);
     if (obj) {
@@ -733,7 +738,10 @@ arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen,
 
     // let our cache user initialize the underlying object
     cache->ops->init(key, klen, 0, ttl, (arc_resource_t)obj, obj->ptr, cache->ops->priv);
-    cache->ops->store(obj->ptr, valuep, vlen, cache->ops->priv);
+    if (ref)
+        cache->ops->store_ref(obj->ptr, valuep, vlen, cache->ops->priv);
+    else
+        cache->ops->store(obj->ptr, valuep, vlen, cache->ops->priv);
 
     retain_ref(cache->refcnt, obj->node);
     // NOTE: atomicity here is ensured by the hashtable implementation
@@ -748,7 +756,7 @@ arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen,
             release_ref(cache->refcnt, obj->node);
             // XXX - yes, we have to release it twice
             release_ref(cache->refcnt, obj->node);
-            return arc_load(cache, key, klen, valuep, vlen, ttl);
+            return arc_load_internal(cache, key, klen, valuep, vlen, ttl, ref);
         case 0:
             break;
         default:
@@ -761,6 +769,20 @@ arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen,
     return rc;
 }
 
+int
+arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen, time_t ttl)
+{
+    return arc_load_internal(cache, key, klen, valuep, vlen, ttl, 0);
+}
+
+int
+arc_load_ref(arc_t *cache, const void *key, size_t klen, void *ref, size_t vlen, time_t ttl)
+{
+    if (!cache->ops->store_ref)
+        return -1;
+    return arc_load_internal(cache, key, klen, ref, vlen, ttl, 1);
+}
+
 size_t
 arc_size(arc_t *cache)
 {
@@ -819,5 +841,155 @@ arc_set_mode(arc_t *cache, arc_mode_t mode)
     ATOMIC_SET(cache->mode, mode);
 }
 
+// max number of objects collected by arc_walk() each time the lock is held
+#define ARC_WALK_CHUNK_SIZE 1024
+
+int
+arc_walk(arc_t *cache, arc_walk_callback_t cb, void *priv)
+{
+    arc_state_t *states[2] = { &cache->mru, &cache->mfu };
+    arc_object_t *objs[ARC_WALK_CHUNK_SIZE];
+    arc_object_t *cursor = NULL; // the last object collected from the current list
+    int count = 0;
+    int rc = 0;
+    int i = 0;
+
+    while (i < 2 && rc == 0) {
+        int n = 0;
+        int frequent = i;
+
+        // collect (and retain) a chunk of objects, so that the callback
+        // can be called (and other threads can use the cache) without holding the lock
+        MUTEX_LOCK(cache->lock);
+        arc_list_t *pos = &states[i]->head;
+        if (cursor && ATOMIC_READ(cursor->state) != states[i]) {
+            // the object we stopped at has been moved or removed meanwhile,
+            // so there is no way to know where to go ahead from
+            pos = NULL;
+        } else if (cursor) {
+            pos = &cursor->head;
+        }
+        while (pos && pos->prev && pos->prev != &states[i]->head && n < ARC_WALK_CHUNK_SIZE) {
+            pos = pos->prev;
+            arc_object_t *obj = arc_list_entry(pos, arc_object_t, head);
+            retain_ref(cache->refcnt, obj->node);
+            objs[n++] = obj;
+        }
+        arc_object_t *prev_cursor = cursor;
+        cursor = NULL;
+        if (n == ARC_WALK_CHUNK_SIZE) {
+            cursor = objs[n - 1];
+            retain_ref(cache->refcnt, cursor->node);
+        }
+        MUTEX_UNLOCK(cache->lock);
+
+        if (prev_cursor)
+            release_ref(cache->refcnt, prev_cursor->node);
+
+        if (!cursor)
+            i++;
+
+        int j;
+        for (j = 0; j < n; j++) {
+            if (rc == 0 && cb(objs[j]->ptr, frequent, priv) != 0)
+                rc = -1;
+            release_ref(cache->refcnt, objs[j]->node);
+        }
+        count += n;
+    }
+
+    if (cursor)
+        release_ref(cache->refcnt, cursor->node);
+
+    return rc == 0 ? count : -1;
+}
+
+arc_resource_t
+arc_restore_prepare(arc_t *cache,
+                    const void *key,
+                    size_t klen,
+                    time_t ttl,
+                    arc_restore_callback_t cb,
+                    void *priv)
+{
+    // the current value always wins over the restored one
+    if (ht_exists(ATOMIC_READ(cache->hash), (void *)key, klen))
+        return NULL;
+
+    arc_object_t *obj = arc_object_create(cache, key, klen);
+    if (!obj)
+        return NULL;
+
+    cache->ops->init(key, klen, 0, ttl, (arc_resource_t)obj, obj->ptr, cache->ops->priv);
+    size_t size = 0;
+    if (cb(obj->ptr, &size, priv) != 0 || size >= ATOMIC_READ(cache->c)) {
+        release_ref(cache->refcnt, obj->node);
+        return NULL;
+    }
+    obj->size = ARC_OBJ_BASE_SIZE(obj) + cache->cos + size;
+
+    return obj;
+}
+
+int
+arc_restore_commit(arc_t *cache, arc_resource_t *objs, char *frequent, int count)
+{
+    int added = 0;
+    int i;
+
+    // NOTE: the objects are published and put into the lists while holding
+    //       the lock, so nobody can try moving them before they are in the list
+    MUTEX_LOCK(cache->lock);
+    for (i = 0; i < count; i++) {
+        arc_object_t *obj = (arc_object_t *)objs[i];
+        arc_state_t *state = frequent[i] ? &cache->mfu : &cache->mru;
+        retain_ref(cache->refcnt, obj->node);
+        if (ht_set_if_not_exists(ATOMIC_READ(cache->hash), (void *)obj->key, obj->klen, obj, sizeof(arc_object_t)) == 0) {
+            arc_list_prepend(&obj->head, &state->head);
+            ATOMIC_INCREMENT(state->count);
+            ATOMIC_SET(obj->state, state);
+            ATOMIC_INCREASE(state->size, obj->size);
+            added++;
+        } else {
+            // the object has been created in the meanwhile (or it can't be added),
+            // it will be destroyed once the lock is released
+            release_ref(cache->refcnt, obj->node);
+        }
+    }
+    if (added)
+        ATOMIC_INCREMENT(cache->needs_balance);
+    MUTEX_UNLOCK(cache->lock);
+
+    // the objects added to the lists are retained by the cache now
+    for (i = 0; i < count; i++) {
+        arc_object_t *obj = (arc_object_t *)objs[i];
+        if (!ATOMIC_READ(obj->state))
+            objs[i] = NULL;
+        release_ref(cache->refcnt, obj->node);
+    }
+
+    if (added)
+        arc_balance(cache);
+
+    return added;
+}
+
+size_t
+arc_get_p(arc_t *cache)
+{
+    MUTEX_LOCK(cache->lock);
+    size_t p = cache->p;
+    MUTEX_UNLOCK(cache->lock);
+    return p;
+}
+
+void
+arc_set_p(arc_t *cache, size_t p)
+{
+    MUTEX_LOCK(cache->lock);
+    cache->p = MIN(p, ATOMIC_READ(cache->c));
+    MUTEX_UNLOCK(cache->lock);
+}
+
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
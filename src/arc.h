@@ -36,6 +36,14 @@ typedef struct _arc_ops {
     int (*fetch_multi) (void **objs, size_t *sizes, int *statuses, int num_objects, void *priv);
 
     void (*store) (void *obj, void *data, size_t size, void *priv);
+
+    /**
+     * @brief Store a reference to data owned by the caller (see arc_load_ref()).
+     *
+     * The callback is expected to retain 'ref' instead of copying the data.
+     * Optional, arc_load_ref() fails if not provided
+     */
+    void (*store_ref) (void *obj, void *ref, size_t size, void *priv);
     
     /**
      * @brief This function is called when the cache is full and we need to evict
@@ -108,6 +116,13 @@ int arc_lookup_multi(arc_t *cache,
 
 int arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen, time_t ttl);
 
+/**
+ * @brief Like arc_load() but the object is initialized through the store_ref callback
+ *        (so it can reference 'ref' instead of holding a copy of the data)
+ * @return -1 if the store_ref callback has not been provided
+ */
+int arc_load_ref(arc_t *cache, const void *key, size_t klen, void *ref, size_t vlen, time_t ttl);
+
 /**
  * @brief Release the resource previously alloc'd by arc_lookup()
  * @note  The retain count will be decreased by 1.\nThe underlying
@@ -216,6 +231,87 @@ uint64_t arc_count(arc_t *cache);
 
 void arc_set_mode(arc_t *cache, arc_mode_t mode);
 
+/**
+ * @brief Callback called by arc_walk() for each object in the mru and mfu lists
+ * @param ptr      The cached object (as initialized by the init callback)
+ * @param frequent 1 if the object belongs to the mfu list, 0 if it belongs to the mru one
+ * @param priv     The private pointer passed to arc_walk()
+ * @return 0 to go ahead, -1 to stop walking
+ */
+typedef int (*arc_walk_callback_t)(void *ptr, int frequent, void *priv);
+
+/**
+ * @brief Walk through all the objects in the mru and the mfu lists
+ *        (ghost lists are skipped), from the least recently used to the
+ *        most recently used one (mru list first)
+ * @param cache  : A valid pointer to an initialized arc_t structure
+ * @param cb     : The callback to call for each object
+ * @param priv   : A pointer which will be passed to the callback
+ * @return The number of objects visited, -1 if the walk was stopped by the callback
+ * @note The objects are collected (and retained) a chunk at a time, the cache
+ *       is not locked while the callback is being called, so the lists might
+ *       change in the meanwhile. If the last object of a chunk has been moved
+ *       to another list (or removed) before the next chunk is collected,
+ *       the rest of its list is skipped
+ */
+int arc_walk(arc_t *cache, arc_walk_callback_t cb, void *priv);
+
+/**
+ * @brief Callback called by arc_restore_prepare() to fill a new object
+ *        (right after the init callback)
+ * @param size : Must be set to the size of the object data
+ *               (as it would be returned by the fetch callback)
+ * @return 0 on success, -1 if the object can't be filled
+ */
+typedef int (*arc_restore_callback_t)(void *ptr, size_t *size, void *priv);
+
+/**
+ * @brief Create a new object and fill it without fetching it, the object
+ *        is not visible until passed to arc_restore_commit()
+ *        (used to warm up the cache)
+ * @param cache    : A valid pointer to an initialized arc_t structure
+ * @param key      : The key
+ * @param klen     : The length of the key
+ * @param ttl      : The ttl passed to the init callback
+ * @param cb       : The callback filling the new object
+ * @param priv     : A pointer which will be passed to the callback
+ * @return The new object, NULL if the key is already in the cache,
+ *         if the object doesn't fit in the cache or in case of errors
+ */
+arc_resource_t arc_restore_prepare(arc_t *cache,
+                                   const void *key,
+                                   size_t klen,
+                                   time_t ttl,
+                                   arc_restore_callback_t cb,
+                                   void *priv);
+
+/**
+ * @brief Put the objects created by arc_restore_prepare() straight into the
+ *        mru or the mfu list, in the given order (so the last one will be
+ *        the most recently used)
+ * @param cache    : A valid pointer to an initialized arc_t structure
+ * @param objs     : The objects returned by arc_restore_prepare()
+ * @param frequent : For each object, 1 to put it in the mfu list, 0 for the mru list
+ * @param count    : The number of objects
+ * @return The number of objects added to the cache, the ones whose key
+ *         has been added to the cache in the meanwhile are dropped
+ * @note The objects are released, so they can't be used anymore by the caller.
+ *       The pointers to the objects which have been dropped (or already
+ *       evicted by the time this function returns) are set to NULL
+ */
+int arc_restore_commit(arc_t *cache, arc_resource_t *objs, char *frequent, int count);
+
+/**
+ * @brief Get the target size of the mru list (the 'p' marker)
+ */
+size_t arc_get_p(arc_t *cache);
+
+/**
+ * @brief Set the target size of the mru list (the 'p' marker),
+ *        it will be capped to the size of the cache
+ */
+void arc_set_p(arc_t *cache, size_t p);
+
 #endif /* SHARDCACHE_ARC_H */
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
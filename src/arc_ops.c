@@ -62,8 +62,64 @@ typedef struct
     char *peer_addr;
     int fd;
     char status;
+    int received;
+    int retried;
+    // the replica the request has been sent to
+    // (see shardcache_node_address_begin())
+    shardcache_node_t *node;
+    int addr_index;
+    int tracked;
+    struct timeval start;
 } shc_fetch_async_arg_t;
 
+static inline void
+arc_ops_fetch_from_peer_track_end(shc_fetch_async_arg_t *arg, int measured, int failed)
+{
+    if (!arg->tracked)
+        return;
+    shardcache_node_address_end(arg->node, arg->addr_index, measured ? &arg->start : NULL, failed);
+    arg->tracked = 0;
+}
+
+static int arc_ops_fetch_from_peer_async_cb(char *peer,
+                                            void *key,
+                                            size_t klen,
+                                            void *data,
+                                            size_t len,
+                                            int idx,
+                                            size_t total_len,
+                                            void *priv);
+
+// NOTE: this runs in the async reader callback, with obj->lock held,
+//       so it must not block: the new connection is established
+//       asynchronously and the request is written by the async worker
+//       once the socket becomes writable
+static int
+arc_ops_fetch_from_peer_retry(shardcache_t *cache, cached_object_t *obj, shc_fetch_async_arg_t *arg)
+{
+    arg->retried = 1;
+    arg->fd = shardcache_reconnect_to_peer(cache, arg->peer_addr, arg->fd);
+    if (arg->fd < 0)
+        return -1;
+
+    async_read_wrk_t *wrk = NULL;
+    int rc = fetch_from_peer_async_deferred(arg->peer_addr,
+                                            obj->key,
+                                            obj->klen,
+                                            arc_ops_fetch_from_peer_async_cb,
+                                            arg,
+                                            arg->fd,
+                                            &wrk);
+    if (rc != 0) {
+        close(arg->fd);
+        arg->fd = -1;
+        return -1;
+    }
+
+    shardcache_queue_async_read_wrk(cache, wrk);
+    return 0;
+}
+
 static int
 arc_ops_fetch_from_peer_async_cb(char *peer,
                                  void *key,
@@ -77,12 +133,15 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
     shc_fetch_async_arg_t *arg = (shc_fetch_async_arg_t *)priv;
     cached_object_t *obj = arg->obj;
     shardcache_t *cache = arg->cache;
-    char *peer_addr = arg->peer_addr;
     int fd = arg->fd;
 
     MUTEX_LOCK(obj->lock);
 
+    if (idx >= 0)
+        arg->received = 1;
+
     if (!obj->res) {
+        arc_ops_fetch_from_peer_track_end(arg, 0, 0);
         list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
         if (fd >= 0)
             close(fd);
@@ -92,6 +151,7 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
     }
 
     if (!obj->listeners) {
+        arc_ops_fetch_from_peer_track_end(arg, 0, 0);
         if (fd >= 0)
             close(fd);
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
@@ -104,6 +164,7 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
     switch(idx) {
         case -1:
         {
+            arc_ops_fetch_from_peer_track_end(arg, 1, 0);
             list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
             COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
             COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
@@ -126,9 +187,20 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
         }
         case -2:
         {
+            // connections taken from the pool are not checked in advance,
+            // if this one broke before receiving anything it was most likely
+            // a stale connection, so let's give it another chance using a
+            // fresh one before notifying the error to the listeners
+            if (!arg->received && !arg->retried && fd >= 0 &&
+                arc_ops_fetch_from_peer_retry(cache, obj, arg) == 0)
+            {
+                MUTEX_UNLOCK(obj->lock);
+                return -1;
+            }
+            arc_ops_fetch_from_peer_track_end(arg, 0, 1);
             list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
-            if (fd >= 0)
-                close(fd);
+            if (arg->fd >= 0)
+                close(arg->fd);
             COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
             MUTEX_UNLOCK(obj->lock);
             arc_drop_resource(cache->arc, obj->res);
@@ -137,9 +209,10 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
         }
         case -3:
         {
+            arc_ops_fetch_from_peer_track_end(arg, 0, 0);
 
             if (fd >= 0)
-                shardcache_release_connection_for_peer(cache, peer_addr, fd);
+                shardcache_release_connection_for_node(cache, arg->node, arg->addr_index, fd);
             free(arg);
 
             COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
@@ -203,21 +276,31 @@ arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
     SHC_DEBUG2("Fetching data for key %.*s from peer %s", obj->klen, obj->key, peer); 
 
     shardcache_node_t *node = shardcache_node_select(cache, peer);
-    if (!peer) {
+    if (!node) {
         SHC_ERROR("Can't find address for node %s\n", peer);
         return rc;
     }
-    char *peer_addr = shardcache_node_get_address(node);
+    // the replica with the lowest load is preferred
+    int addr_index = shardcache_node_select_address_index(node);
+    char *peer_addr = shardcache_node_get_address_at_index(node, addr_index);
 
     // another peer is responsible for this item, let's get the value from there
 
-    int fd = shardcache_get_connection_for_peer(cache, peer_addr);
+    int fd = shardcache_get_connection_for_node(cache, node, addr_index);
+    shardcache_node_address_begin(node, addr_index);
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
     if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC)) {
-        shc_fetch_async_arg_t *arg = malloc(sizeof(shc_fetch_async_arg_t));
+        shc_fetch_async_arg_t *arg = calloc(1, sizeof(shc_fetch_async_arg_t));
         arg->obj = obj;
         arg->cache = cache;
         arg->peer_addr = peer_addr;
         arg->fd = fd;
+        arg->node = node;
+        arg->addr_index = addr_index;
+        arg->tracked = 1;
+        arg->start = start;
         async_read_wrk_t *wrk = NULL;
         arc_retain_resource(cache->arc, obj->res);
         rc = fetch_from_peer_async(peer_addr,
@@ -250,6 +333,7 @@ arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
 
                 COBJ_SET_FLAG(obj, COBJ_FLAG_EVICTED);
             }
+            arc_ops_fetch_from_peer_track_end(arg, 0, 1);
             if (fd >= 0)
                 close(fd);
             arc_release_resource(cache->arc, obj->res);
@@ -259,9 +343,10 @@ arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
     } else { 
         fbuf_t value = FBUF_STATIC_INITIALIZER;
         rc = fetch_from_peer(peer_addr, obj->key, obj->klen, &value, fd);
+        shardcache_node_address_end(node, addr_index, rc == 0 ? &start : NULL, rc != 0);
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
         if (rc == 0) {
-            shardcache_release_connection_for_peer(cache, peer_addr, fd);
+            shardcache_release_connection_for_node(cache, node, addr_index, fd);
             if (fbuf_used(&value)) {
                 obj->data = fbuf_data(&value);
                 obj->dlen = fbuf_used(&value);
@@ -297,6 +382,7 @@ arc_ops_init(const void *key, size_t len, int async, time_t ttl, arc_resource_t
         obj->key = obj->kbuf;
     memcpy(obj->key, key, obj->klen);
     obj->data = NULL;
+    obj->vbuf = NULL;
     COBJ_UNSET_FLAG(obj, COBJ_FLAG_COMPLETE);
     obj->res = res;
     if (async) {
@@ -308,19 +394,240 @@ arc_ops_init(const void *key, size_t len, int async, time_t ttl, arc_resource_t
     MUTEX_INIT(obj->lock);
 }
 
+// the size accounted by the arc for the data of the object
+// (volatile values are already accounted in the volatile table size)
+#define COBJ_DATA_SIZE(_o) (((_o)->data == (_o)->dbuf || (_o)->vbuf) ? 0 : (_o)->dlen)
+
 static void *
-arc_ops_fetch_copy_volatile_object_cb(void *ptr, size_t len, void *user)
+arc_ops_fetch_ref_volatile_object_cb(void *ptr, size_t len, void *user)
 {
     cached_object_t *obj = (cached_object_t *)user;
     volatile_object_t *item = (volatile_object_t *)ptr;
+    // NOTE: the value can't change while it's retained
+    //       (a new buffer is created when the item is updated)
     if (item->dlen) {
-        obj->data = (item->dlen > sizeof(obj->dbuf)) ? malloc(item->dlen) : obj->dbuf;
-        memcpy(obj->data, item->data, item->dlen);
+        obj->vbuf = volatile_buf_retain(item->buf);
+        obj->data = item->data;
         obj->dlen = item->dlen;
     }
     return (void *)obj;
 }
 
+static inline void
+arc_ops_release_data(cached_object_t *obj)
+{
+    if (obj->vbuf)
+        volatile_buf_release(obj->vbuf);
+    else if (obj->data != obj->dbuf)
+        free(obj->data);
+    obj->vbuf = NULL;
+    obj->data = NULL;
+    obj->dlen = 0;
+}
+
+typedef struct {
+    cached_object_t *obj;
+    shardcache_t *cache;
+} shc_fetch_storage_arg_t;
+
+static void
+arc_ops_fetch_from_storage_done(void *key, size_t klen, void *value, size_t vlen, int status, void *priv)
+{
+    shc_fetch_storage_arg_t *arg = (shc_fetch_storage_arg_t *)priv;
+    cached_object_t *obj = arg->obj;
+    shardcache_t *cache = arg->cache;
+    free(arg);
+
+    ATOMIC_DECREMENT(cache->cnt[SHARDCACHE_COUNTER_STORAGE_INFLIGHT].value);
+
+    MUTEX_LOCK(obj->lock);
+
+    gettimeofday(&obj->ts, NULL);
+
+    if (status != 0) {
+        SHC_ERROR("Asynchronous fetch storage callback returned an error (%d)", status);
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+        free(value);
+        if (obj->listeners)
+            list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
+    } else if (!value) {
+        SHC_DEBUG("Item not found for key %.*s", obj->klen, obj->key);
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_NOT_FOUND].value);
+        if (obj->listeners)
+            list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
+    } else {
+        obj->data = value;
+        obj->dlen = vlen;
+        SHC_DEBUG3("Asynchronous fetch storage callback returned value %s (%lu) for key %.*s",
+               shardcache_hex_escape(obj->data, obj->dlen, DEBUG_DUMP_MAXSIZE, 0),
+               (unsigned long)obj->dlen, obj->klen, obj->key);
+        if (obj->listeners) {
+            shardcache_fetch_from_peer_notify_arg notify_arg = {
+                .obj = obj,
+                .data = obj->data,
+                .len = obj->dlen,
+                .total_size = obj->dlen
+            };
+            list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener, &notify_arg);
+            list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
+        }
+    }
+
+    // getters coming after this point will find the object complete and won't
+    // register any listener (an object without data is served as not found
+    // until it's dropped)
+    COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
+    COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
+
+    int evicted = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) ||
+                   COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED));
+
+    if (!obj->data || evicted)
+        COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
+
+    int drop = COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP);
+    if (!drop) {
+        arc_update_resource_size(cache->arc, obj->res, obj->dlen);
+
+        if (cache->expire_time > 0 && !cache->lazy_expiration)
+            shardcache_schedule_expiration(cache, obj->key, obj->klen, cache->expire_time, 0);
+    }
+
+    MUTEX_UNLOCK(obj->lock);
+
+    // NOTE: if arc_ops_fetch() didn't return yet, the object is still locked
+    //       by the arc subsystem and dropping it here won't have any effect,
+    //       arc_ops_fetch() will take care of it instead
+    if (drop)
+        arc_drop_resource(cache->arc, obj->res);
+    else
+        arc_release_resource(cache->arc, obj->res);
+
+    ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
+}
+
+static void
+arc_ops_fetch_from_storage_job(void *priv)
+{
+    shc_fetch_storage_arg_t *arg = (shc_fetch_storage_arg_t *)priv;
+    cached_object_t *obj = arg->obj;
+    shardcache_t *cache = arg->cache;
+
+    void *value = NULL;
+    size_t vlen = 0;
+    // NOTE: the key can't change while the object is being fetched
+    int rc = cache->storage.fetch(obj->key, obj->klen, &value, &vlen, cache->storage.priv);
+    arc_ops_fetch_from_storage_done(obj->key, obj->klen, value, vlen, (rc == -1) ? -1 : 0, arg);
+}
+
+void
+arc_ops_fetch_batch(void **items, int count, void *priv)
+{
+    shardcache_t *cache = (shardcache_t *)priv;
+
+    int i;
+    void *mem = calloc(count, (sizeof(void *) * 2) + (sizeof(size_t) * 2));
+    if (!mem) {
+        SHC_ERROR("Can't allocate memory to fetch a batch of %d keys", count);
+        // the listeners are notified and the objects released as for
+        // any other failed fetch
+        for (i = 0; i < count; i++) {
+            shc_fetch_storage_arg_t *arg = (shc_fetch_storage_arg_t *)items[i];
+            arc_ops_fetch_from_storage_done(arg->obj->key, arg->obj->klen, NULL, 0, -1, arg);
+        }
+        return;
+    }
+
+    void **keys = mem;
+    void **values = keys + count;
+    size_t *klens = (size_t *)(values + count);
+    size_t *vlens = klens + count;
+
+    for (i = 0; i < count; i++) {
+        shc_fetch_storage_arg_t *arg = (shc_fetch_storage_arg_t *)items[i];
+        // NOTE: the key can't change while the object is being fetched
+        keys[i] = arg->obj->key;
+        klens[i] = arg->obj->klen;
+    }
+
+    // in case of failure fetch_multi() returns how many items
+    // it managed to fetch before failing
+    int rc = cache->storage.fetch_multi(keys, klens, count, values, vlens, cache->storage.priv);
+
+    for (i = 0; i < count; i++) {
+        int status = (rc == 0 || i < rc) ? 0 : -1;
+        arc_ops_fetch_from_storage_done(keys[i], klens[i], values[i], vlens[i], status, items[i]);
+    }
+
+    free(mem);
+}
+
+// start fetching the object from the storage without blocking the caller,
+// returns 0 if the listeners will be notified once the fetch is complete
+// or -1 if the object needs to be fetched synchronously
+// NOTE: the object must not be locked by the caller since
+//       the fetch could complete before returning
+static int
+arc_ops_fetch_from_storage_async(shardcache_t *cache, cached_object_t *obj)
+{
+    if (!cache->storage.fetch_async && !ATOMIC_READ(cache->storage_io))
+        return -1;
+
+    shc_fetch_storage_arg_t *arg = malloc(sizeof(shc_fetch_storage_arg_t));
+    arg->obj = obj;
+    arg->cache = cache;
+
+    arc_retain_resource(cache->arc, obj->res);
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_STORAGE_INFLIGHT].value);
+
+    int rc = -1;
+    if (cache->storage.fetch_async) {
+        rc = cache->storage.fetch_async(obj->key,
+                                        obj->klen,
+                                        arc_ops_fetch_from_storage_done,
+                                        arg,
+                                        cache->storage.priv);
+    } else {
+        // NOTE: the storage i/o threads can be replaced at runtime
+        //       (see shardcache_storage_io_threads())
+        pthread_rwlock_rdlock(&cache->storage_io_lock);
+        if (cache->storage_batcher) {
+            // concurrent misses are coalesced in a single fetch_multi call
+            // (unless too many are already pending)
+            rc = storage_io_batcher_add(cache->storage_batcher, arg);
+        } else if (cache->storage_io) {
+            // if the storage i/o threads can't keep up the worker will
+            // fetch the object by itself, slowing down the new requests
+            rc = storage_io_pool_run(cache->storage_io, arc_ops_fetch_from_storage_job, arg);
+        }
+        pthread_rwlock_unlock(&cache->storage_io_lock);
+    }
+
+    if (rc != 0) {
+        ATOMIC_DECREMENT(cache->cnt[SHARDCACHE_COUNTER_STORAGE_INFLIGHT].value);
+        arc_release_resource(cache->arc, obj->res);
+        free(arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+// look up the update of the key still waiting to be written to the storage (if any),
+// see write_behind_lookup() for the return value
+static int
+arc_ops_write_behind_lookup(shardcache_t *cache, cached_object_t *obj)
+{
+    int rc = -1;
+    // NOTE: the write-behind queue can be replaced at runtime
+    //       (see shardcache_write_behind())
+    pthread_rwlock_rdlock(&cache->write_behind_lock);
+    if (cache->write_behind)
+        rc = write_behind_lookup(cache->write_behind, obj->key, obj->klen, &obj->data, &obj->dlen);
+    pthread_rwlock_unlock(&cache->write_behind_lock);
+    return rc;
+}
+
 int
 arc_ops_fetch(void *item, size_t *size, void * priv)
 {
@@ -396,13 +703,39 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
                      obj->key,
                      obj->klen,
                      NULL,
-                     arc_ops_fetch_copy_volatile_object_cb,
+                     arc_ops_fetch_ref_volatile_object_cb,
                      obj);
     if (obj->data && obj->dlen) {
         SHC_DEBUG3("Found volatile value %s (%lu) for key %.*s",
                shardcache_hex_escape(obj->data, obj->dlen, DEBUG_DUMP_MAXSIZE, 0),
                (unsigned long)obj->dlen, obj->klen, obj->key);
+    } else if (arc_ops_write_behind_lookup(cache, obj) >= 0) {
+        // the key has an update which didn't reach the storage yet
+        // (if it's a removal obj->data is left empty)
+        SHC_DEBUG3("Found pending update (%lu) for key %.*s",
+               (unsigned long)obj->dlen, obj->klen, obj->key);
     } else if (cache->use_persistent_storage && cache->storage.fetch) {
+        if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC)) {
+            MUTEX_UNLOCK(obj->lock);
+            int started = (arc_ops_fetch_from_storage_async(cache, obj) == 0);
+            MUTEX_LOCK(obj->lock);
+            if (started) {
+                if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_FETCHING)) {
+                    // the object is kept in the cache while being fetched,
+                    // its size will be updated once the fetch is complete
+                    MUTEX_UNLOCK(obj->lock);
+                    *size = 0;
+                    return 0;
+                }
+
+                // the fetch completed before we got here
+                *size = obj->dlen;
+                int drop = COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP);
+                MUTEX_UNLOCK(obj->lock);
+                return drop;
+            }
+        }
+
         int rc = cache->storage.fetch(obj->key, obj->klen, &obj->data, &obj->dlen, cache->storage.priv);
         if (rc == -1) {
             if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC) && obj->listeners)
@@ -449,7 +782,7 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
         list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
     }
 
-    *size = (obj->data == obj->dbuf) ? 0 : obj->dlen;
+    *size = COBJ_DATA_SIZE(obj);
 
     int evicted = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) ||
                    COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED));
@@ -542,8 +875,7 @@ arc_ops_store(void *item, void *data, size_t size, void *priv)
     //shardcache_t *cache = (shardcache_t *)priv;
     MUTEX_LOCK(obj->lock); // XXX - this shouldn't be really necessary
 
-    if (obj->data != obj->dbuf)
-        free(obj->data);
+    arc_ops_release_data(obj);
 
     obj->data = (size > sizeof(obj->dbuf)) ? malloc(size) : obj->dbuf;
     memcpy(obj->data, data, size);
@@ -552,6 +884,22 @@ arc_ops_store(void *item, void *data, size_t size, void *priv)
     MUTEX_UNLOCK(obj->lock);
 }
 
+void
+arc_ops_store_ref(void *item, void *ref, size_t size, void *priv)
+{
+    cached_object_t *obj = (cached_object_t *)item;
+    volatile_buf_t *buf = (volatile_buf_t *)ref;
+    MUTEX_LOCK(obj->lock);
+
+    arc_ops_release_data(obj);
+
+    obj->vbuf = volatile_buf_retain(buf);
+    obj->data = buf->data;
+    obj->dlen = buf->len;
+
+    MUTEX_UNLOCK(obj->lock);
+}
+
 void
 arc_ops_evict(void *item, void *priv)
 {
@@ -582,8 +930,7 @@ arc_ops_evict(void *item, void *priv)
 
     // no lock is necessary here ... if we are here
     // nobody is referencing us anymore
-    if (obj->data != obj->dbuf)
-        free(obj->data);
+    arc_ops_release_data(obj);
 
     if (obj->key != obj->kbuf)
         free(obj->key);
@@ -22,6 +22,10 @@ typedef struct {
 
     size_t dlen; // The length of the data (if any, 0 otherwise)
 
+    volatile_buf_t *vbuf; // If the object holds the value of a volatile item, the data
+                          // pointer refers to the (retained) buffer of the volatile item
+                          // instead of a private copy
+
     struct timeval ts; // the timestamp of when the object has been loaded
                        // into the cache
     
@@ -56,8 +60,12 @@ typedef struct {
 
 void arc_ops_init(const void *key, size_t len, int async, time_t ttl, arc_resource_t res, void *ptr, void *priv);
 int arc_ops_fetch(void *item, size_t *size, void * priv);
+// fetch a batch of coalesced misses (see storage_io_batcher_create())
+void arc_ops_fetch_batch(void **items, int count, void *priv);
 void arc_ops_evict(void *item, void *priv);
 void arc_ops_store(void *item, void *data, size_t size, void *priv);
+// reference a volatile_buf_t instead of copying its data
+void arc_ops_store_ref(void *item, void *ref, size_t size, void *priv);
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
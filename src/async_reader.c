@@ -6,23 +6,43 @@
 #include "shardcache.h"
 #include "async_reader.h"
 #include "messaging.h"
+#include "compression.h"
 
+// max amount of data following a complete message which is kept
+// in the context until the caller asks to parse the next message
+#define ASYNC_READER_PENDING_MAX (1<<16)
+
+// what we are expecting next while parsing the records
+#define SHC_RSTATE_FLAGS     0 // flags byte (v3 only)
+#define SHC_RSTATE_LENGTH    1 // chunk size (v1), record size (v2) or varint size (v3)
+#define SHC_RSTATE_DATA      2 // data of the actual chunk (v1) or record (v2/v3)
+#define SHC_RSTATE_SEPARATOR 3 // RSEP or EOM
+#define SHC_RSTATE_CRC       4 // crc following the EOM (v3 only)
 
 #pragma pack(push, 1)
 struct _async_read_ctx_s {
     async_read_callback_t cb;
     shardcache_hdr_t hdr;
     void *cb_priv;
-    rbuf_t *buf;
-    char chunk[65536];
-    uint16_t clen;
-    uint16_t coff;
-    uint32_t rlen;
-    int rnum;
+    // input which couldn't be parsed yet because it follows a complete message
+    fbuf_t *pending;
     char state;
+    char rstate;
     char magic[4];
     char version;
     int moff;
+    unsigned char flags;
+    char compressed;
+    int rnum;
+    uint32_t rlen; // size of the actual record (sum of the chunks received so far in v1)
+    uint32_t slen; // size of the actual chunk (v1) or of the actual record on the wire (v2/v3)
+    uint32_t soff; // amount of bytes of the actual chunk/record received so far
+    unsigned char lbuf[4]; // fixed-size fields split across multiple reads
+    int loff;
+    uint32_t vint;
+    int vshift;
+    uint32_t crc;
+    char *zdata;
     struct timeval last_update;
 };
 #pragma pack(pop)
@@ -45,117 +65,357 @@ async_read_context_protocol_version(async_read_ctx_t *ctx)
     return ctx->version;
 }
 
+static inline void
+async_read_error(async_read_ctx_t *ctx)
+{
+    ctx->state = SHC_STATE_READING_ERR;
+    if (ctx->cb)
+        ctx->cb(NULL, 0, -2, ctx->rlen, ctx->cb_priv);
+}
+
+static inline void
+async_read_done(async_read_ctx_t *ctx)
+{
+    ctx->state = SHC_STATE_READING_DONE;
+    if (ctx->cb && ctx->cb(NULL, 0, -1, ctx->rlen, ctx->cb_priv) != 0)
+        async_read_error(ctx);
+}
+
+// accumulates a fixed-size field (which might be split across multiple reads)
+// into ctx->lbuf and returns 1 once it has been completely received
+static inline int
+async_read_fixed(async_read_ctx_t *ctx, char **pp, char *end, int size)
+{
+    int avail = end - *pp;
+    int n = size - ctx->loff;
+    if (n > avail)
+        n = avail;
+    memcpy(ctx->lbuf + ctx->loff, *pp, n);
+    ctx->loff += n;
+    *pp += n;
+    if (ctx->loff < size)
+        return 0;
+    ctx->loff = 0;
+    return 1;
+}
+
+// returns 1 once the varint has been completely read (and its value is in ctx->vint),
+// 0 if more data is needed and -1 if the varint is malformed
 static inline int
-async_read_move_to_next_record(async_read_ctx_t *ctx)
+async_read_varint(async_read_ctx_t *ctx, char **pp, char *end)
 {
-    if (rbuf_used(ctx->buf) < 1) {
-        // TRUNCATED - we need more data
-        ctx->state = SHC_STATE_READING_RSEP;
-        return 1;
+    while (*pp < end) {
+        u_char byte = *(*pp)++;
+        ctx->vint |= (uint32_t)(byte & 0x7F) << ctx->vshift;
+        if (!(byte & 0x80)) {
+            ctx->vshift = 0;
+            return 1;
+        }
+        ctx->vshift += 7;
+        if (ctx->vshift >= 7 * SHC_VARINT_MAXLEN)
+            return -1;
     }
+    return 0;
+}
 
-    u_char bsep = 0;
-    rbuf_read(ctx->buf, &bsep, 1);
+static inline int
+async_read_decompress_record(async_read_ctx_t *ctx)
+{
+    uint32_t olen = 0;
+    int olen_size = 0;
+    while (olen_size < ctx->slen && olen_size < SHC_VARINT_MAXLEN) {
+        u_char byte = ctx->zdata[olen_size];
+        olen |= (uint32_t)(byte & 0x7F) << (7 * olen_size++);
+        if (!(byte & 0x80))
+            break;
+    }
 
-    if (bsep == SHARDCACHE_RSEP) {
-        ctx->state = SHC_STATE_READING_RECORD;
-        if (ctx->cb && ctx->cb(NULL, 0, ctx->rnum, ctx->rlen, ctx->cb_priv) != 0)
-        {
-            ctx->state = SHC_STATE_READING_ERR;
-            if (ctx->cb)
-                ctx->cb(NULL, 0, -2, ctx->rlen, ctx->cb_priv);
-            return -1;
-        }
-        ctx->rnum++;
-        ctx->rlen = 0;
-    } else if (bsep == 0) {
-        ctx->state = SHC_STATE_READING_DONE;
-        return 1;
-    } else {
-        ctx->state = SHC_STATE_READING_ERR;
-        if (ctx->cb)
-            ctx->cb(NULL, 0, -2, ctx->rlen, ctx->cb_priv);
+    char *data = olen <= SHARDCACHE_MSG_MAX_RECORD_LEN ? malloc(olen ? olen : 1) : NULL;
+    int dlen = data ? compression_lz4_decompress(ctx->zdata + olen_size,
+                                                 ctx->slen - olen_size,
+                                                 data,
+                                                 olen)
+                    : -1;
+    free(ctx->zdata);
+    ctx->zdata = NULL;
+
+    if (dlen < 0 || (uint32_t)dlen != olen) {
+        SHC_WARNING("Can't decompress record %d", ctx->rnum);
+        free(data);
         return -1;
     }
-    return 0;
+
+    ctx->rlen = dlen;
+    ctx->crc = compression_crc32(ctx->crc, data, dlen);
+
+    int rc = 0;
+    if (dlen && ctx->cb)
+        rc = ctx->cb(data, dlen, ctx->rnum, dlen, ctx->cb_priv);
+
+    free(data);
+    return rc == 0 ? 0 : -1;
 }
 
-static inline void
-async_read_parse_protocol_v1(async_read_ctx_t *ctx)
+// parses the size of the next chunk (v1) or record (v2/v3)
+// returns 0 if more data is needed, 1 if the size has been parsed or -1 on errors
+static inline int
+async_read_record_length(async_read_ctx_t *ctx, char **pp, char *end)
 {
-    for (;;) {
+    if (ctx->version < 2) {
+        if (!async_read_fixed(ctx, pp, end, sizeof(uint16_t)))
+            return 0;
+        uint16_t clen;
+        memcpy(&clen, ctx->lbuf, sizeof(clen));
+        ctx->slen = ntohs(clen);
+        ctx->rlen += ctx->slen;
+    } else if (ctx->version < 3) {
+        if (!async_read_fixed(ctx, pp, end, sizeof(uint32_t)))
+            return 0;
+        uint32_t rlen;
+        memcpy(&rlen, ctx->lbuf, sizeof(rlen));
+        ctx->slen = ntohl(rlen);
+        ctx->rlen = ctx->slen;
+    } else {
+        int rc = async_read_varint(ctx, pp, end);
+        if (rc != 1)
+            return rc;
+        ctx->slen = ctx->vint >> 1;
+        ctx->rlen = ctx->slen;
+        ctx->compressed = (ctx->vint & SHC_RECORD_COMPRESSED);
+        ctx->vint = 0;
+    }
 
-        if (ctx->coff == ctx->clen && ctx->state == SHC_STATE_READING_RECORD) {
-            if (rbuf_used(ctx->buf) < 2)
-                break;
+    if (ctx->rlen > SHARDCACHE_MSG_MAX_RECORD_LEN) {
+        SHC_WARNING("Maximum record size exceeded (%dMB)",
+                    SHARDCACHE_MSG_MAX_RECORD_LEN >> 20);
+        return -1;
+    }
 
-            // let's call the read_async callback
-            if (ctx->clen > 0 && ctx->cb && ctx->cb(ctx->chunk, ctx->clen, ctx->rnum, ctx->clen, ctx->cb_priv) != 0)
-            {
-                ctx->state = SHC_STATE_READING_ERR;
-                if (ctx->cb)
-                    ctx->cb(NULL, 0, -2, ctx->clen, ctx->cb_priv);
-                return;
-            } 
-
-            uint16_t nlen = 0;
-            rbuf_read(ctx->buf, (u_char *)&nlen, 2);
-            ctx->clen = ntohs(nlen);
-            ctx->rlen += ctx->clen;
-            ctx->coff = 0;
-        }
-        if (ctx->clen > ctx->coff) {
-            int rb = rbuf_read(ctx->buf, (u_char *)ctx->chunk + ctx->coff, ctx->clen - ctx->coff);
-            ctx->coff += rb;
-            if (!rbuf_used(ctx->buf))
-                break; // TRUNCATED - we need more data
+    ctx->soff = 0;
+
+    if (ctx->compressed) {
+        ctx->zdata = malloc(ctx->slen ? ctx->slen : 1);
+        if (!ctx->zdata)
+            return -1;
+    }
+
+    return 1;
+}
+
+// consumes the record data available in the input, passing it directly to the callback
+// (no intermediate copies are done, apart for compressed records which need
+// to be completely received before being decompressed)
+static inline int
+async_read_record_data(async_read_ctx_t *ctx, char **pp, char *end)
+{
+    uint32_t avail = end - *pp;
+    uint32_t n = ctx->slen - ctx->soff;
+    if (n > avail)
+        n = avail;
+
+    if (n) {
+        if (ctx->compressed) {
+            memcpy(ctx->zdata + ctx->soff, *pp, n);
         } else {
-            if (async_read_move_to_next_record(ctx) != 0)
-                break;
+            if (ctx->version >= 3)
+                ctx->crc = compression_crc32(ctx->crc, *pp, n);
+            // NOTE: in protocol v1 the 'total_len' passed to the callback
+            //       is the size of the actual chunk
+            if (ctx->cb && ctx->cb(*pp, n, ctx->rnum, ctx->version < 2 ? ctx->slen : ctx->rlen, ctx->cb_priv) != 0)
+                return -1;
+        }
+        *pp += n;
+        ctx->soff += n;
+    }
 
+    if (ctx->soff < ctx->slen)
+        return 0;
+
+    if (ctx->compressed) {
+        ctx->compressed = 0;
+        if (async_read_decompress_record(ctx) != 0)
+            return -1;
+    }
+
+    return 1;
+}
+
+// returns 1 if the parser can go ahead, 0 if more data is needed
+// (or if the message has been completely parsed or an error occurred)
+static inline int
+async_read_record(async_read_ctx_t *ctx, char **pp, char *end)
+{
+    int rc;
+    switch(ctx->rstate) {
+        case SHC_RSTATE_FLAGS:
+            if (*pp == end)
+                return 0;
+            ctx->flags = *(*pp)++;
+            ctx->rstate = SHC_RSTATE_LENGTH;
+            break;
+        case SHC_RSTATE_LENGTH:
+            rc = async_read_record_length(ctx, pp, end);
+            if (rc == 0)
+                return 0; // TRUNCATED - we need more data
+            if (rc == -1) {
+                async_read_error(ctx);
+                return 0;
+            }
+            // a chunk of size 0 terminates the record in protocol v1
+            ctx->rstate = (ctx->version < 2 && ctx->slen == 0)
+                        ? SHC_RSTATE_SEPARATOR
+                        : SHC_RSTATE_DATA;
+            break;
+        case SHC_RSTATE_DATA:
+            rc = async_read_record_data(ctx, pp, end);
+            if (rc == 0)
+                return 0; // TRUNCATED - we need more data
+            if (rc == -1) {
+                async_read_error(ctx);
+                return 0;
+            }
+            ctx->rstate = ctx->version < 2 ? SHC_RSTATE_LENGTH : SHC_RSTATE_SEPARATOR;
+            break;
+        case SHC_RSTATE_SEPARATOR:
+        {
+            if (*pp == end) {
+                ctx->state = SHC_STATE_READING_RSEP;
+                return 0;
+            }
+            u_char bsep = *(*pp)++;
+            ctx->state = SHC_STATE_READING_RECORD;
+            if (bsep == SHARDCACHE_RSEP) {
+                if (ctx->cb && ctx->cb(NULL, 0, ctx->rnum, ctx->rlen, ctx->cb_priv) != 0) {
+                    async_read_error(ctx);
+                    return 0;
+                }
+                ctx->rnum++;
+                ctx->rlen = 0;
+                ctx->rstate = SHC_RSTATE_LENGTH;
+            } else if (bsep == SHARDCACHE_EOM) {
+                if (ctx->version >= 3 && (ctx->flags & SHC_FLAG_CRC)) {
+                    ctx->rstate = SHC_RSTATE_CRC;
+                } else {
+                    async_read_done(ctx);
+                    return 0;
+                }
+            } else {
+                async_read_error(ctx);
+                return 0;
+            }
+            break;
         }
+        case SHC_RSTATE_CRC:
+        {
+            if (!async_read_fixed(ctx, pp, end, sizeof(uint32_t)))
+                return 0;
+            uint32_t crc;
+            memcpy(&crc, ctx->lbuf, sizeof(crc));
+            if (ntohl(crc) != ctx->crc) {
+                SHC_WARNING("Checksum mismatch (%08x != %08x)", ntohl(crc), ctx->crc);
+                async_read_error(ctx);
+            } else {
+                async_read_done(ctx);
+            }
+            return 0;
+        }
+        default:
+            async_read_error(ctx);
+            return 0;
     }
+    return 1;
 }
 
-static inline void
-async_read_parse_protocol_v2(async_read_ctx_t *ctx)
+// parses as much as possible of the provided input (stopping at the end of a message)
+// and returns the number of bytes consumed
+static int
+async_read_parse(async_read_ctx_t *ctx, char *data, int len)
 {
-    for (;;) {
+    char *p = data;
+    char *end = data + len;
 
-        if (ctx->coff == ctx->rlen && ctx->state == SHC_STATE_READING_RECORD) {
-            if (ctx->rlen > 0 && async_read_move_to_next_record(ctx) != 0)
+    for (;;) {
+        switch(ctx->state) {
+            case SHC_STATE_READING_NONE:
+            {
+                while (p < end && (u_char)*p == SHC_HDR_NOOP)
+                    p++; // skip
+                if (p == end)
+                    goto out;
+                ctx->hdr = 0;
+                ctx->moff = 0;
+                ctx->state = SHC_STATE_READING_MAGIC;
                 break;
-
-            if (rbuf_used(ctx->buf) < 4)
+            }
+            case SHC_STATE_READING_MAGIC:
+            {
+                int n = sizeof(ctx->magic) - ctx->moff;
+                if (n > end - p)
+                    n = end - p;
+                memcpy(&ctx->magic[ctx->moff], p, n);
+                ctx->moff += n;
+                p += n;
+                if (ctx->moff < sizeof(ctx->magic))
+                    goto out;
+
+                uint32_t rmagic;
+                memcpy((char *)&rmagic, ctx->magic, sizeof(uint32_t));
+                if ((ntohl(rmagic)&0xFFFFFF00) != (SHC_MAGIC&0xFFFFFF00)) {
+                    async_read_error(ctx);
+                    goto out;
+                }
+                ctx->version = ctx->magic[3];
+                if (ctx->version > SHC_PROTOCOL_VERSION_MAX) {
+                    SHC_WARNING("Unsupported protocol version %02x", ctx->version);
+                    async_read_error(ctx);
+                    goto out;
+                }
+                ctx->state = SHC_STATE_READING_HDR;
                 break;
-
-            uint32_t rlen = 0;
-            rbuf_read(ctx->buf, (u_char *)&rlen, 4);
-
-            // if this is an empty record, move directly to the next
-            if (rlen == 0 && async_read_move_to_next_record(ctx) != 0)
+            }
+            case SHC_STATE_READING_HDR:
+            {
+                if (p == end)
+                    goto out;
+                ctx->hdr = (u_char)*p++;
+                ctx->state = SHC_STATE_READING_RECORD;
+                ctx->rstate = ctx->version >= 3 ? SHC_RSTATE_FLAGS : SHC_RSTATE_LENGTH;
                 break;
-
-            ctx->rlen = ntohl(rlen);
-            ctx->clen = (uint16_t)ctx->rlen; // XXX
-            ctx->coff = 0;
-        }
-        if (ctx->rlen > ctx->coff) {
-            int rb = rbuf_read(ctx->buf, (u_char *)ctx->chunk + ctx->coff, ctx->rlen - ctx->coff);
-            // let's call the read_async callback
-            if (ctx->cb && ctx->cb(ctx->chunk + ctx->coff, rb, ctx->rnum, ctx->rlen, ctx->cb_priv) != 0)
+            }
+            case SHC_STATE_READING_RECORD:
+            case SHC_STATE_READING_RSEP:
             {
-                ctx->state = SHC_STATE_READING_ERR;
-                if (ctx->cb)
-                    ctx->cb(NULL, 0, -2, ctx->rlen, ctx->cb_priv);
+                if (!async_read_record(ctx, &p, end))
+                    goto out;
                 break;
-            } 
-            ctx->coff += rb;
-
-            if (!rbuf_used(ctx->buf))
-                break; // TRUNCATED - we need more data
+            }
+            default:
+                goto out;
         }
     }
+
+out:
+    return p - data;
+}
+
+static inline void
+async_read_context_reset(async_read_ctx_t *ctx)
+{
+    ctx->state = SHC_STATE_READING_NONE;
+    ctx->rstate = SHC_RSTATE_LENGTH;
+    ctx->rnum = 0;
+    ctx->rlen = 0;
+    ctx->slen = 0;
+    ctx->soff = 0;
+    ctx->moff = 0;
+    ctx->loff = 0;
+    ctx->version = 0;
+    ctx->flags = 0;
+    ctx->compressed = 0;
+    ctx->vint = 0;
+    ctx->vshift = 0;
+    ctx->crc = 0;
+    memset(ctx->magic, 0, sizeof(ctx->magic));
 }
 
 async_read_context_state_t
@@ -164,105 +424,78 @@ async_read_context_update(async_read_ctx_t *ctx)
     gettimeofday(&ctx->last_update, NULL);
 
     if (__builtin_expect(ctx->state == SHC_STATE_READING_DONE, 0))
-    {
-        ctx->state = SHC_STATE_READING_NONE;
-        ctx->rnum = 0;
-        ctx->rlen = 0;
-        ctx->moff = 0;
-        ctx->version = 0;
-        ctx->clen = 0;
-        ctx->coff = 0;
-        memset(ctx->magic, 0, sizeof(ctx->magic));
-    }
+        async_read_context_reset(ctx);
 
-    if (!rbuf_used(ctx->buf))
+    if (!fbuf_used(ctx->pending) || ctx->state == SHC_STATE_READING_ERR)
         return ctx->state;
 
-    if (ctx->state == SHC_STATE_READING_NONE)
-    {
-        ctx->hdr = 0;
-        unsigned char byte;
-        rbuf_read(ctx->buf, &byte, 1);
-        while (byte == SHC_HDR_NOOP && rbuf_used(ctx->buf) > 0)
-            rbuf_read(ctx->buf, &byte, 1); // skip
-
-        if (byte == SHC_HDR_NOOP && !rbuf_used(ctx->buf))
-            return ctx->state;
-
-        ctx->magic[0] = byte;
-        ctx->state = SHC_STATE_READING_MAGIC;
-        ctx->moff = 1;
-    }
-
-    if (ctx->state == SHC_STATE_READING_MAGIC) {
-        if (rbuf_used(ctx->buf) < sizeof(uint32_t) - ctx->moff) {
-            return ctx->state;
-        }
-
-        rbuf_read(ctx->buf, (u_char *)&ctx->magic[ctx->moff], sizeof(uint32_t) - ctx->moff);
-        uint32_t rmagic;
-        memcpy((char *)&rmagic, ctx->magic, sizeof(uint32_t));
-        if ((ntohl(rmagic)&0xFFFFFF00) != (SHC_MAGIC&0xFFFFFF00)) {
-            ctx->state = SHC_STATE_READING_ERR;
-            if (ctx->cb)
-                ctx->cb(NULL, 0, -2, ctx->clen, ctx->cb_priv);
-            return ctx->state;
-        }
-        ctx->version = ctx->magic[3];
-        if (ctx->version > SHC_PROTOCOL_VERSION) {
-            SHC_WARNING("Unsupported protocol version %02x", ctx->version);
-            ctx->state = SHC_STATE_READING_ERR;
-            if (ctx->cb)
-                ctx->cb(NULL, 0, -2, ctx->clen, ctx->cb_priv);
-            return ctx->state;
-        }
-
-        ctx->state = SHC_STATE_READING_HDR;
-    }
-
-    if (ctx->state == SHC_STATE_READING_HDR)
-    {
-        if (rbuf_used(ctx->buf) < 1)
-            return ctx->state;
-        rbuf_read(ctx->buf, (unsigned char *)&ctx->hdr, 1);
-
-        ctx->state = SHC_STATE_READING_RECORD;
-    }
+    int consumed = async_read_parse(ctx, fbuf_data(ctx->pending), fbuf_used(ctx->pending));
+    fbuf_remove(ctx->pending, consumed);
 
-    if (ctx->state == SHC_STATE_READING_RECORD) {
-        if (ctx->version < 2)
-            async_read_parse_protocol_v1(ctx);
-        else
-            async_read_parse_protocol_v2(ctx);
-    }
-
-
-    if (ctx->state == SHC_STATE_READING_DONE) {
-        if (ctx->cb && ctx->cb(NULL, 0, -1, ctx->clen, ctx->cb_priv) != 0) {
-            ctx->state = SHC_STATE_READING_ERR;
-            if (ctx->cb)
-                ctx->cb(NULL, 0, -2, ctx->clen, ctx->cb_priv);
-            return ctx->state;
-        }
-    }
     return ctx->state;
 }
 
 async_read_context_state_t
 async_read_context_consume_data(async_read_ctx_t *ctx, rbuf_t *in)
 {
-    int used_bytes = rbuf_move(in, ctx->buf, rbuf_used(in));
-    if (used_bytes)
-        return async_read_context_update(ctx);
-    return ctx->state;
+    int len = rbuf_used(in);
+    if (!len)
+        return ctx->state;
+
+    char *data = malloc(len);
+    rbuf_read(in, (u_char *)data, len);
+    fbuf_add_binary(ctx->pending, data, len);
+    free(data);
+
+    return async_read_context_update(ctx);
 }
 
 async_read_context_state_t
 async_read_context_input_data(async_read_ctx_t *ctx, void *data, int len, int *processed)
 {
-    int used_bytes = rbuf_write(ctx->buf, data, len);
-    if (used_bytes)
+    int used_bytes = 0;
+
+    if (ctx->state == SHC_STATE_READING_ERR) {
+        // nothing else will be parsed, just discard the data
+        if (processed)
+            *processed = len;
+        return ctx->state;
+    }
+
+    // data left after a previous message needs to be parsed first
+    if (fbuf_used(ctx->pending)) {
+        int avail = ASYNC_READER_PENDING_MAX - fbuf_used(ctx->pending);
+        used_bytes = len < avail ? len : avail;
+        if (used_bytes > 0)
+            fbuf_add_binary(ctx->pending, data, used_bytes);
         async_read_context_update(ctx);
+        if (fbuf_used(ctx->pending)) {
+            if (processed)
+                *processed = used_bytes;
+            return ctx->state;
+        }
+    } else {
+        gettimeofday(&ctx->last_update, NULL);
+        if (ctx->state == SHC_STATE_READING_DONE)
+            async_read_context_reset(ctx);
+    }
+
+    // parse directly from the input buffer
+    if (used_bytes < len && ctx->state != SHC_STATE_READING_ERR && ctx->state != SHC_STATE_READING_DONE)
+        used_bytes += async_read_parse(ctx, (char *)data + used_bytes, len - used_bytes);
+
+    if (ctx->state == SHC_STATE_READING_ERR) {
+        used_bytes = len;
+    } else if (used_bytes < len) {
+        // a message has been completely parsed, keep what follows
+        // until the caller asks to parse the next message
+        int leftover = len - used_bytes;
+        if (leftover > ASYNC_READER_PENDING_MAX)
+            leftover = ASYNC_READER_PENDING_MAX;
+        fbuf_add_binary(ctx->pending, (char *)data + used_bytes, leftover);
+        used_bytes += leftover;
+    }
+
     if (processed)
         *processed = used_bytes;
     return ctx->state;
@@ -273,7 +506,14 @@ async_read_context_create(async_read_callback_t cb,
                           void *priv)
 {
     async_read_ctx_t *ctx = calloc(1, sizeof(async_read_ctx_t));
-    ctx->buf = rbuf_create(1<<16);
+    if (!ctx)
+        return NULL;
+    ctx->pending = fbuf_create(FBUF_MAXLEN_NONE);
+    if (!ctx->pending) {
+        free(ctx);
+        return NULL;
+    }
+    ctx->rstate = SHC_RSTATE_LENGTH;
     ctx->cb = cb;
     ctx->cb_priv = priv;
     gettimeofday(&ctx->last_update, NULL);
@@ -283,7 +523,8 @@ async_read_context_create(async_read_callback_t cb,
 void
 async_read_context_destroy(async_read_ctx_t *ctx)
 {
-    rbuf_destroy(ctx->buf);
+    fbuf_free(ctx->pending);
+    free(ctx->zdata);
     free(ctx);
 }
 
@@ -308,7 +549,8 @@ read_async_input_data(iomux_t *iomux, int fd, unsigned char *data, int len, void
     if (close)
         iomux_close(iomux, fd);
 
-    return len;
+    // what didn't fit in the pending buffer is left to the iomux
+    return processed;
 }
 
 void
@@ -317,9 +559,9 @@ read_async_input_eof(iomux_t *iomux, int fd, void *priv)
     async_read_ctx_t *ctx = (async_read_ctx_t *)priv;
 
     if (ctx->state != SHC_STATE_READING_DONE)
-        ctx->cb(NULL, 0, -2, ctx->clen, ctx->cb_priv);
+        ctx->cb(NULL, 0, -2, ctx->rlen, ctx->cb_priv);
 
-    ctx->cb(NULL, 0, -3, ctx->clen, ctx->cb_priv);
+    ctx->cb(NULL, 0, -3, ctx->rlen, ctx->cb_priv);
 
     async_read_context_destroy(ctx);
 }
@@ -6,8 +6,12 @@
 #include <rbuf.h>
 #include "protocol.h"
 
+// idx >= 0 , data points to (part of) the data of the record at index idx
+//             (data == NULL, len = 0 when the record is complete and more follow)
 // idx = -1 , data == NULL, len = 0 when finished
 // idx = -2 , data == NULL, len = 0 if an error occurred
+// NOTE: data points directly into the buffer provided to the reader
+//       and is valid only until the callback returns
 typedef int (*async_read_callback_t)(void *data,
                                      size_t len,
                                      int  idx,
@@ -51,6 +55,9 @@ typedef struct {
     async_read_ctx_t *ctx;
     iomux_callbacks_t cbs;
     int fd;
+    // request to be written once the worker is added to the iomux (if any)
+    char *output;
+    unsigned int output_len;
 } async_read_wrk_t;
 #pragma pack(pop)
 
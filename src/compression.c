@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "compression.h"
+
+#define LZ4_MINMATCH      4
+#define LZ4_LASTLITERALS  5   // the last 5 bytes are always literals
+#define LZ4_MFLIMIT       12  // a match can't start within the last 12 bytes
+#define LZ4_MAX_DISTANCE  65535
+#define LZ4_HASH_LOG      12
+#define LZ4_RUN_MASK      15
+
+// slicing-by-8 tables (crc32_table[0] is the classic bytewise table)
+static uint32_t crc32_table[8][256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+static void
+crc32_table_init()
+{
+    uint32_t i;
+    for (i = 0; i < 256; i++) {
+        uint32_t c = i;
+        int k;
+        for (k = 0; k < 8; k++)
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        crc32_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        int k;
+        for (k = 1; k < 8; k++)
+            crc32_table[k][i] = (crc32_table[k-1][i] >> 8) ^ crc32_table[0][crc32_table[k-1][i] & 0xFF];
+    }
+}
+
+uint32_t
+compression_crc32(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&crc32_table_once, crc32_table_init);
+
+    const unsigned char *p = data;
+    crc = ~crc;
+
+    // process 8 bytes at once
+    while (len >= 8) {
+        uint32_t one = (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24)) ^ crc;
+        uint32_t two = (p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24));
+        crc = crc32_table[7][one & 0xFF] ^
+              crc32_table[6][(one >> 8) & 0xFF] ^
+              crc32_table[5][(one >> 16) & 0xFF] ^
+              crc32_table[4][one >> 24] ^
+              crc32_table[3][two & 0xFF] ^
+              crc32_table[2][(two >> 8) & 0xFF] ^
+              crc32_table[1][(two >> 16) & 0xFF] ^
+              crc32_table[0][two >> 24];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = crc32_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+static inline uint32_t
+lz4_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t
+lz4_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline int
+lz4_write_length(unsigned char **opp, unsigned char *oend, size_t len)
+{
+    unsigned char *op = *opp;
+    while (len >= 255) {
+        if (op >= oend)
+            return -1;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend)
+        return -1;
+    *op++ = (unsigned char)len;
+    *opp = op;
+    return 0;
+}
+
+// emits a sequence made of 'litlen' literals followed by a match
+// of 'mlen' bytes at distance 'offset' (mlen == 0 for the last sequence)
+static int
+lz4_write_sequence(unsigned char **opp,
+                   unsigned char *oend,
+                   const unsigned char *literals,
+                   size_t litlen,
+                   size_t offset,
+                   size_t mlen)
+{
+    unsigned char *op = *opp;
+
+    if (op >= oend)
+        return -1;
+
+    unsigned char *token = op++;
+
+    if (litlen >= LZ4_RUN_MASK) {
+        *token = LZ4_RUN_MASK << 4;
+        if (lz4_write_length(&op, oend, litlen - LZ4_RUN_MASK) != 0)
+            return -1;
+    } else {
+        *token = litlen << 4;
+    }
+
+    if ((size_t)(oend - op) < litlen)
+        return -1;
+    memcpy(op, literals, litlen);
+    op += litlen;
+
+    if (mlen) {
+        if (oend - op < 2)
+            return -1;
+        *op++ = offset & 0xFF;
+        *op++ = (offset >> 8) & 0xFF;
+
+        size_t ml = mlen - LZ4_MINMATCH;
+        if (ml >= LZ4_RUN_MASK) {
+            *token |= LZ4_RUN_MASK;
+            if (lz4_write_length(&op, oend, ml - LZ4_RUN_MASK) != 0)
+                return -1;
+        } else {
+            *token |= ml;
+        }
+    }
+
+    *opp = op;
+    return 0;
+}
+
+int
+compression_lz4_compress(const void *in, size_t ilen, void *out, size_t olen)
+{
+    const unsigned char *istart = in;
+    const unsigned char *ip = istart;
+    const unsigned char *anchor = istart;
+    const unsigned char *iend = istart + ilen;
+    unsigned char *op = out;
+    unsigned char *oend = op + olen;
+
+    if (ilen > INT32_MAX || olen > INT32_MAX)
+        return -1;
+
+    if (ilen > LZ4_MFLIMIT) {
+        uint32_t table[1<<LZ4_HASH_LOG];
+        memset(table, 0, sizeof(table));
+
+        const unsigned char *mflimit = iend - LZ4_MFLIMIT;
+        const unsigned char *matchlimit = iend - LZ4_LASTLITERALS;
+
+        while (ip < mflimit) {
+            uint32_t sequence = lz4_read32(ip);
+            uint32_t h = lz4_hash(sequence);
+            const unsigned char *ref = istart + table[h];
+            table[h] = ip - istart;
+
+            if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE || lz4_read32(ref) != sequence) {
+                ip++;
+                continue;
+            }
+
+            size_t mlen = LZ4_MINMATCH;
+            while (ip + mlen < matchlimit && ref[mlen] == ip[mlen])
+                mlen++;
+
+            if (lz4_write_sequence(&op, oend, anchor, ip - anchor, ip - ref, mlen) != 0)
+                return -1;
+
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+
+    if (lz4_write_sequence(&op, oend, anchor, iend - anchor, 0, 0) != 0)
+        return -1;
+
+    return op - (unsigned char *)out;
+}
+
+static inline int
+lz4_read_length(const unsigned char **ipp, const unsigned char *iend, size_t *len)
+{
+    const unsigned char *ip = *ipp;
+    unsigned char byte;
+    do {
+        if (ip >= iend)
+            return -1;
+        byte = *ip++;
+        *len += byte;
+    } while (byte == 255);
+    *ipp = ip;
+    return 0;
+}
+
+int
+compression_lz4_decompress(const void *in, size_t ilen, void *out, size_t olen)
+{
+    const unsigned char *ip = in;
+    const unsigned char *iend = ip + ilen;
+    unsigned char *ostart = out;
+    unsigned char *op = ostart;
+    unsigned char *oend = op + olen;
+
+    if (ilen > INT32_MAX || olen > INT32_MAX)
+        return -1;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+
+        size_t litlen = token >> 4;
+        if (litlen == LZ4_RUN_MASK && lz4_read_length(&ip, iend, &litlen) != 0)
+            return -1;
+
+        if ((size_t)(iend - ip) < litlen || (size_t)(oend - op) < litlen)
+            return -1;
+
+        memcpy(op, ip, litlen);
+        op += litlen;
+        ip += litlen;
+
+        // the last sequence contains only literals
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - ostart))
+            return -1;
+
+        size_t mlen = token & LZ4_RUN_MASK;
+        if (mlen == LZ4_RUN_MASK && lz4_read_length(&ip, iend, &mlen) != 0)
+            return -1;
+        mlen += LZ4_MINMATCH;
+
+        if ((size_t)(oend - op) < mlen)
+            return -1;
+
+        const unsigned char *ref = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            // NOTE: source and destination overlap (repeating pattern)
+            //       so we can't use memcpy() here
+            while (mlen--)
+                *op++ = *ref++;
+        }
+    }
+
+    return op - ostart;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,33 @@
+#ifndef SHARDCACHE_COMPRESSION_H
+#define SHARDCACHE_COMPRESSION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Self-contained helpers used by protocol version 3 to compress
+ * records and to checksum messages.
+ *
+ * The compressor produces (and the decompressor accepts) the LZ4 'block'
+ * format, so that compressed records can be produced/consumed by any
+ * implementation of the LZ4 block format without depending on liblz4
+ */
+
+// update a crc32 (IEEE 802.3, the same used by zlib) with the provided data.
+// NOTE: 0 must be used as initial value
+uint32_t compression_crc32(uint32_t crc, const void *data, size_t len);
+
+// compress 'ilen' bytes from 'in' into the 'out' buffer (of size 'olen')
+// returns the size of the compressed data or -1 if it doesn't fit into 'olen' bytes
+// (which also means that the data is not compressible enough to be worth compressing)
+int compression_lz4_compress(const void *in, size_t ilen, void *out, size_t olen);
+
+// decompress 'ilen' bytes from 'in' into the 'out' buffer (of size 'olen')
+// returns the size of the decompressed data or -1 if the input is malformed
+// or the decompressed data doesn't fit into 'olen' bytes
+int compression_lz4_decompress(const void *in, size_t ilen, void *out, size_t olen);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
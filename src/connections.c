@@ -344,6 +344,54 @@ open_connection(const char *host, int port, unsigned int timeout)
     return sock;
 }
 
+/*!
+ * \brief Start connecting to a specified host/port without blocking.
+ * \param host host name or ip address
+ * \param port port number
+ * \returns file handle (in non-blocking mode) on success, or -1 otherwise (errno is set).
+ *
+ * \note The connection might still be in progress when the function returns,
+ * the caller needs to wait for the file handle to become writable and then
+ * check SO_ERROR to know if the connection has been established.
+ */
+int
+open_connection_nonblocking(const char *host, int port)
+{
+    int val = 1;
+    struct sockaddr_in sockaddr;
+    int sock;
+
+    errno = EINVAL;
+    if (host == NULL || !*host || port == 0)
+        return -1;
+
+    if (string2sockaddr(host, port, &sockaddr) == -1)
+        return -1;
+
+    sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == -1)
+        return -1;
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &val,  sizeof(val));
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    if (connect(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1 && errno != EINPROGRESS) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    return sock;
+}
+
 /*!
  * \brief Open a UNIX domain socket.
  * \param filename filename for socket
@@ -380,6 +428,54 @@ open_lsocket(const char *filename)
     return sock;
 }
 
+/*!
+ * \brief Open a connection to a UNIX domain socket.
+ * \param filename filename of the socket
+ * \param timeout timeout in milliseconds for send and receive
+ *        0 to use the system default
+ * \returns file handle on success, or -1 otherwise (errno is set).
+ */
+int
+open_lconnection(const char *filename, unsigned int timeout)
+{
+    struct sockaddr_un sockaddr;
+    int sock;
+    struct timeval tv = { timeout/1000, (timeout%1000) * 1000 };
+
+    errno = EINVAL;
+    if (filename == NULL || !*filename || strlen(filename) >= sizeof(sockaddr.sun_path))
+        return -1;
+
+    sock = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+        return -1;
+
+    if (timeout > 0) {
+        if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1
+            || setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+        {
+            fprintf(stderr, "%s: Failed to set timeout to %d : %s\n", filename, timeout, strerror(errno));
+            close(sock);
+            return -1;
+        }
+    }
+
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sun_family = AF_UNIX;
+    strncpy(sockaddr.sun_path, filename, sizeof(sockaddr.sun_path) - 1);
+
+    // NOTE: connecting to a local socket never blocks for long
+    //       (it fails immediately if nobody is listening)
+    if (connect(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1) {
+        close(sock);
+        return -1;
+    }
+
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    return sock;
+}
+
 /*!
  * \brief Open a FIFO.
  * \param filename FIFO file name
@@ -1,12 +1,9 @@
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <fcntl.h>
-#include <sys/select.h>
-
-
-#include <fbuf.h>
-#include <hashtable.h>
-#include <queue.h>
+#include <sys/time.h>
 
 #include <atomic_defs.h>
 
@@ -15,22 +12,59 @@
 
 #include <errno.h>
 
+// number of filedescriptors each thread can keep aside for itself
+// (one per peer, the slot is selected using the peer id)
+#define CONNECTIONS_POOL_STASH_SIZE 8
+
+// size of the (open addressing) index used to resolve addresses to peer ids,
+// MUST be a power of 2 and bigger than CONNECTIONS_POOL_MAX_PEERS
+#define CONNECTIONS_POOL_INDEX_SIZE (CONNECTIONS_POOL_MAX_PEERS << 1)
+
+struct _connection_pool_entry_s {
+    int fd;
+    uint32_t next;
+    struct timeval last_access;
+};
 
-#include <time.h>
-#include <sys/resource.h>
+// Each peer owns a fixed set of entries (allocated when the peer is registered)
+// and two lock-free stacks referencing them: the stack of entries holding an
+// available connection and the stack of unused entries.
+// The heads of both stacks are 64bit words where the lower 32 bits hold
+// the index (+1) of the first entry (0 if the stack is empty) and the upper
+// 32 bits hold a tag which is increased at each update to prevent ABA issues.
+typedef struct {
+    char *addr;
+    int size;
+    connection_pool_entry_t *entries;
+    uint64_t available;
+    uint64_t unused;
+} connections_pool_peer_t;
+
+typedef struct {
+    int peer_id;
+    int fd;
+    struct timeval last_access;
+} connections_pool_slot_t;
+
+typedef struct _connections_pool_stash_s {
+    connections_pool_t *pool;
+    connections_pool_slot_t slots[CONNECTIONS_POOL_STASH_SIZE];
+    struct _connections_pool_stash_s *prev;
+    struct _connections_pool_stash_s *next;
+} connections_pool_stash_t;
 
 struct _connections_pool_s {
-    hashtable_t *table;
+    connections_pool_peer_t *peers[CONNECTIONS_POOL_MAX_PEERS];
+    int index[CONNECTIONS_POOL_INDEX_SIZE]; // peer_id + 1 , 0 if the slot is empty
+    int num_peers;
+    pthread_mutex_t lock; // serializes peers registration and the stashes list
+    pthread_key_t stash_key;
+    connections_pool_stash_t *stashes;
+    connections_pool_counters_t counters;
     int tcp_timeout;
     int max_spare;
     int check;
     int expire_time;
-    int fds_limit;
-};
-
-struct _connection_pool_entry_s {
-    int fd;
-    struct timeval last_access;
 };
 
 static inline int
@@ -40,7 +74,7 @@ is_connection_time_valid(connections_pool_t *cc, struct timeval *conn_time)
     gettimeofday(&now, NULL);
     struct timeval result = { 0, 0 };
     int expire_time = ATOMIC_READ(cc->expire_time);
-    struct timeval threshold = { expire_time/1000, expire_time*1000 };
+    struct timeval threshold = { expire_time/1000, (expire_time%1000)*1000 };
     timersub(&now, conn_time, &result);
 
     if (timercmp(&result, &threshold, >))
@@ -49,219 +83,421 @@ is_connection_time_valid(connections_pool_t *cc, struct timeval *conn_time)
     return 1;
 }
 
+static int
+write_noop(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    char noop = SHC_HDR_NOOP;
+    int rc = write(fd, &noop, 1);
+    fcntl(fd, F_SETFL, flags);
+
+    return rc;
+}
+
+// NOTE: connections are not validated when checked out (unless explicitly
+// requested using connections_pool_check()), a broken connection will be
+// detected by the reader of the response which can then ask for a new one
+// using connections_pool_reconnect()
+static inline int
+is_connection_valid(connections_pool_t *cc, int fd, struct timeval *last_access)
+{
+    if (!ATOMIC_READ(cc->check))
+        return 1;
+
+    return (is_connection_time_valid(cc, last_access) || write_noop(fd) == 1);
+}
+
+static inline int
+stack_pop(uint64_t *head, connection_pool_entry_t *entries)
+{
+    for (;;) {
+        uint64_t old_head = ATOMIC_READ(*head);
+        uint32_t index = old_head & 0xffffffff;
+        if (!index)
+            return -1;
+        // entries are never released while the pool is alive
+        // so it's safe to access them even if the head changes
+        uint64_t new_head = (((old_head >> 32) + 1) << 32) | entries[index - 1].next;
+        if (ATOMIC_CAS(*head, old_head, new_head))
+            return index - 1;
+    }
+}
+
+static inline void
+stack_push(uint64_t *head, connection_pool_entry_t *entries, int index)
+{
+    for (;;) {
+        uint64_t old_head = ATOMIC_READ(*head);
+        entries[index].next = old_head & 0xffffffff;
+        uint64_t new_head = (((old_head >> 32) + 1) << 32) | (uint32_t)(index + 1);
+        if (ATOMIC_CAS(*head, old_head, new_head))
+            return;
+    }
+}
+
+static connections_pool_peer_t *
+connections_pool_peer_create(char *addr, int size)
+{
+    connections_pool_peer_t *peer = calloc(1, sizeof(connections_pool_peer_t));
+    peer->addr = strdup(addr);
+    peer->size = size > 0 ? size : 0;
+    if (peer->size) {
+        peer->entries = calloc(peer->size, sizeof(connection_pool_entry_t));
+        int i;
+        for (i = 0; i < peer->size; i++)
+            stack_push(&peer->unused, peer->entries, i);
+    }
+    return peer;
+}
+
+static void
+connections_pool_peer_destroy(connections_pool_peer_t *peer)
+{
+    int index = stack_pop(&peer->available, peer->entries);
+    while (index >= 0) {
+        close(peer->entries[index].fd);
+        index = stack_pop(&peer->available, peer->entries);
+    }
+    free(peer->entries);
+    free(peer->addr);
+    free(peer);
+}
+
+static void
+connections_pool_stash_release(void *ptr)
+{
+    connections_pool_stash_t *stash = (connections_pool_stash_t *)ptr;
+    connections_pool_t *cc = stash->pool;
+
+    pthread_mutex_lock(&cc->lock);
+    if (stash->prev)
+        stash->prev->next = stash->next;
+    else
+        cc->stashes = stash->next;
+    if (stash->next)
+        stash->next->prev = stash->prev;
+    pthread_mutex_unlock(&cc->lock);
+
+    int i;
+    for (i = 0; i < CONNECTIONS_POOL_STASH_SIZE; i++) {
+        if (stash->slots[i].fd >= 0)
+            close(stash->slots[i].fd);
+    }
+    free(stash);
+}
+
+static inline connections_pool_stash_t *
+connections_pool_stash(connections_pool_t *cc)
+{
+    connections_pool_stash_t *stash = pthread_getspecific(cc->stash_key);
+    if (__builtin_expect(stash != NULL, 1))
+        return stash;
+
+    stash = calloc(1, sizeof(connections_pool_stash_t));
+    if (!stash)
+        return NULL;
+
+    stash->pool = cc;
+    int i;
+    for (i = 0; i < CONNECTIONS_POOL_STASH_SIZE; i++) {
+        stash->slots[i].peer_id = -1;
+        stash->slots[i].fd = -1;
+    }
+
+    if (pthread_setspecific(cc->stash_key, stash) != 0) {
+        free(stash);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cc->lock);
+    stash->next = cc->stashes;
+    if (cc->stashes)
+        cc->stashes->prev = stash;
+    cc->stashes = stash;
+    pthread_mutex_unlock(&cc->lock);
+
+    return stash;
+}
+
 connections_pool_t *
 connections_pool_create(int tcp_timeout, int expire_time, int max_spare)
 {
     connections_pool_t *cc = calloc(1, sizeof(connections_pool_t));
-    cc->table = ht_create(128, 65535, (ht_free_item_callback_t)queue_destroy);
+    if (pthread_key_create(&cc->stash_key, connections_pool_stash_release) != 0) {
+        free(cc);
+        return NULL;
+    }
+    pthread_mutex_init(&cc->lock, NULL);
     cc->tcp_timeout = tcp_timeout;
     cc->max_spare = max_spare;
     cc->expire_time = expire_time;
-
-    // XXX - hack to overcome the 1024 FD_SETSIZE limit on some
-    //       system's select() implementation (notably linux)
-    struct rlimit rlim;
-    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
-        int limit = sizeof(fd_set) * rlim.rlim_max;
-        if (!limit)
-            limit = sizeof(fd_set) * rlim.rlim_cur;
-        // defaults to at least 8192 fds
-        cc->fds_limit = (limit > 0) ? limit/FD_SETSIZE : 8192;
-    }
-
     return cc;
 }
 
 void
 connections_pool_destroy(connections_pool_t *cc)
 {
-    ht_destroy(cc->table);
+    pthread_key_delete(cc->stash_key);
+
+    // threads still alive won't release their stash anymore
+    // (the key has been deleted) so let's close all the stashed connections
+    pthread_mutex_lock(&cc->lock);
+    connections_pool_stash_t *stash = cc->stashes;
+    while (stash) {
+        connections_pool_stash_t *next = stash->next;
+        int i;
+        for (i = 0; i < CONNECTIONS_POOL_STASH_SIZE; i++) {
+            if (stash->slots[i].fd >= 0)
+                close(stash->slots[i].fd);
+        }
+        free(stash);
+        stash = next;
+    }
+    cc->stashes = NULL;
+
+    int i;
+    for (i = 0; i < cc->num_peers; i++)
+        connections_pool_peer_destroy(cc->peers[i]);
+    pthread_mutex_unlock(&cc->lock);
+
+    pthread_mutex_destroy(&cc->lock);
     free(cc);
 }
 
-static void
-free_connection(void *conn)
+static inline uint32_t
+connections_pool_hash(char *addr)
 {
-    connection_pool_entry_t *entry = (connection_pool_entry_t *)conn;
-    close(entry->fd);
-    free(entry);
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    unsigned char *p = (unsigned char *)addr;
+    while (*p) {
+        hash ^= *p++;
+        hash *= 16777619U;
+    }
+    return hash;
 }
 
-static queue_t *
-get_connection_queue(connections_pool_t *cc, char *addr)
+static inline int
+connections_pool_lookup(connections_pool_t *cc, char *addr, uint32_t hash, int *free_slot)
 {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-
-    pthread_mutex_lock(&lock);
-    queue_t *connection_queue = ht_get(cc->table, addr, strlen(addr), NULL);
-    if (!connection_queue) {
-        // there is no queue, so we are the first one opening a connection to 'addr'
-        connection_queue = queue_create();
-        queue_set_bpool_size(connection_queue, cc->max_spare);
-        queue_set_free_value_callback(connection_queue, free_connection);
-        if (ht_set(cc->table, addr, strlen(addr), connection_queue, 0) != 0) {
-            // ERRORS
-            queue_destroy(connection_queue);
-            pthread_mutex_unlock(&lock);
-            return NULL;
+    int i;
+    for (i = 0; i < CONNECTIONS_POOL_INDEX_SIZE; i++) {
+        int slot = (hash + i) & (CONNECTIONS_POOL_INDEX_SIZE - 1);
+        int peer_id = ATOMIC_READ(cc->index[slot]) - 1;
+        if (peer_id < 0) {
+            if (free_slot)
+                *free_slot = slot;
+            break;
         }
+        if (strcmp(cc->peers[peer_id]->addr, addr) == 0)
+            return peer_id;
     }
-    pthread_mutex_unlock(&lock);
-    return connection_queue;
+    return -1;
 }
 
 int
-connections_queue_empty(hashtable_t *table, void *value, size_t vlen, void *user)
+connections_pool_peer_id(connections_pool_t *cc, char *addr)
 {
-    queue_t *connection_queue = (queue_t *)value;
-    connection_pool_entry_t *entry = queue_pop_left(connection_queue);
-    while (entry) {
-        close(entry->fd);
-        free(entry);
-        entry = queue_pop_left(connection_queue);
+    uint32_t hash = connections_pool_hash(addr);
+
+    // lookups are lock-free, only the registration of a new peer
+    // needs to be serialized
+    int peer_id = connections_pool_lookup(cc, addr, hash, NULL);
+    if (peer_id >= 0)
+        return peer_id;
+
+    pthread_mutex_lock(&cc->lock);
+    int slot = -1;
+    peer_id = connections_pool_lookup(cc, addr, hash, &slot);
+    if (peer_id < 0 && slot >= 0 && cc->num_peers < CONNECTIONS_POOL_MAX_PEERS) {
+        peer_id = cc->num_peers;
+        cc->peers[peer_id] = connections_pool_peer_create(addr, ATOMIC_READ(cc->max_spare));
+        ATOMIC_INCREMENT(cc->num_peers);
+        // publishing the index slot makes the new peer visible to the readers
+        ATOMIC_SET(cc->index[slot], peer_id + 1);
     }
-    return 1;
+    pthread_mutex_unlock(&cc->lock);
+
+    return peer_id;
 }
 
-static int
-write_noop(connections_pool_t *cc, int fd, int flags)
+static void
+connections_pool_flush(connections_pool_t *cc)
 {
-    int rc = -1;
-    flags |= O_NONBLOCK;
-    fcntl(fd, F_SETFL, flags);
-    char noop = SHC_HDR_NOOP;
-
-    int fdset_size = sizeof(fd_set) * cc->fds_limit;
-    // we want to fit at most cc->fds_limit filedescriptors
-    char fdset[fdset_size];
+    int num_peers = ATOMIC_READ(cc->num_peers);
+    int i;
+    for (i = 0; i < num_peers; i++) {
+        connections_pool_peer_t *peer = cc->peers[i];
+        int index = stack_pop(&peer->available, peer->entries);
+        while (index >= 0) {
+            close(peer->entries[index].fd);
+            stack_push(&peer->unused, peer->entries, index);
+            index = stack_pop(&peer->available, peer->entries);
+        }
+    }
 
-    struct timeval before;
-    gettimeofday(&before, NULL);
-    for (;;) {
-        FD_SET(fd, (fd_set *)fdset);
-        struct timeval timeout = { 1, 0 };
-        int rc = select(fd + 1, NULL, (fd_set *)fdset, NULL, &timeout);
-        switch (rc) {
-            case -1:
-                if (errno == EINTR || errno == EAGAIN)
-                    continue;
-                break;
-            case 1:
-                rc = write(fd, &noop, 1);
-                if (rc <= 0 && errno != EINTR && errno != EAGAIN)
-                    continue;
-                break;
-            default:
-            {
-                suseconds_t msecs = ATOMIC_READ(cc->tcp_timeout);
-                struct timeval limit = { msecs/1000, ((msecs*1000) % 1000000) };
-                struct timeval now;
-                struct timeval diff = { 0, 0 };
-                gettimeofday(&now, NULL);
-                timersub(&now, &before, &diff);
-                if (timercmp(&diff, &limit, >))
-                    break;
-            }
+    // the connections stashed aside by the threads are holding
+    // filedescriptors as well. The owner of a stash might be using it
+    // concurrently so the slots are emptied atomically (the stashes
+    // themselves can't go away while we hold the lock)
+    pthread_mutex_lock(&cc->lock);
+    connections_pool_stash_t *stash = cc->stashes;
+    while (stash) {
+        for (i = 0; i < CONNECTIONS_POOL_STASH_SIZE; i++) {
+            int fd = ATOMIC_READ(stash->slots[i].fd);
+            if (fd >= 0 && ATOMIC_CAS(stash->slots[i].fd, fd, -1))
+                close(fd);
         }
+        stash = stash->next;
     }
+    pthread_mutex_unlock(&cc->lock);
+}
 
-    flags &= ~O_NONBLOCK;
-    fcntl(fd, F_SETFL, flags);
-    return rc;
+static inline int
+connections_pool_connect(connections_pool_t *cc, char *addr)
+{
+    ATOMIC_INCREMENT(cc->counters.misses);
+    int new_fd = connect_to_peer(addr, ATOMIC_READ(cc->tcp_timeout));
+    if (new_fd == -1 && (errno == EMFILE || errno == ENFILE)) {
+        connections_pool_flush(cc);
+        // give us one more chance
+        new_fd = connect_to_peer(addr, ATOMIC_READ(cc->tcp_timeout));
+    }
+    return new_fd;
 }
 
 int
-connections_pool_get(connections_pool_t *cc, char *addr)
+connections_pool_get_by_id(connections_pool_t *cc, int peer_id)
 {
-    queue_t *connection_queue = get_connection_queue(cc, addr);
-    if (!connection_queue)
+    if (peer_id < 0 || peer_id >= ATOMIC_READ(cc->num_peers))
         return -1;
 
-    connection_pool_entry_t *entry = queue_pop_left(connection_queue);
-    while (entry) {
-        int fd = entry->fd;
-        struct timeval last_access = entry->last_access;
-        free(entry);
-        int flags = fcntl(fd, F_GETFL, 0);
-        if (flags == -1) {
+    connections_pool_peer_t *peer = cc->peers[peer_id];
+
+    // first check if the current thread has a connection stashed aside
+    connections_pool_stash_t *stash = connections_pool_stash(cc);
+    if (stash) {
+        connections_pool_slot_t *slot = &stash->slots[peer_id % CONNECTIONS_POOL_STASH_SIZE];
+        int fd = ATOMIC_READ(slot->fd);
+        // the slot might be concurrently emptied by connections_pool_flush()
+        if (slot->peer_id == peer_id && fd >= 0 && ATOMIC_CAS(slot->fd, fd, -1)) {
+            if (is_connection_valid(cc, fd, &slot->last_access)) {
+                ATOMIC_INCREMENT(cc->counters.hits);
+                return fd;
+            }
             close(fd);
-            entry = queue_pop_left(connection_queue);
-            continue;
         }
+    }
 
-        if (!ATOMIC_READ(cc->check))
-            return fd;
+    int index = stack_pop(&peer->available, peer->entries);
+    while (index >= 0) {
+        int fd = peer->entries[index].fd;
+        struct timeval last_access = peer->entries[index].last_access;
+        stack_push(&peer->unused, peer->entries, index);
 
-        // NOTE - this is a blocking write which will honor the configured tcp timeout
-        if (is_connection_time_valid(cc, &last_access) || write_noop(cc, fd, flags) == 1)
+        if (is_connection_valid(cc, fd, &last_access)) {
+            ATOMIC_INCREMENT(cc->counters.hits);
             return fd;
-        else
-            close(fd);
+        }
+        close(fd);
 
-        entry = queue_pop_left(connection_queue);
+        index = stack_pop(&peer->available, peer->entries);
     }
 
-    int new_fd = connect_to_peer(addr, ATOMIC_READ(cc->tcp_timeout));
-    if (new_fd == -1 && (errno == EMFILE || errno == ENFILE)) {
-        ht_foreach_value(cc->table, connections_queue_empty, NULL);
-        // give us one more chance
-        new_fd = connect_to_peer(addr, ATOMIC_READ(cc->tcp_timeout));
-    }
-    return new_fd;
+    return connections_pool_connect(cc, peer->addr);
 }
 
-
 void
-connections_pool_add(connections_pool_t *cc, char *addr, int fd)
+connections_pool_add_by_id(connections_pool_t *cc, int peer_id, int fd)
 {
-    queue_t *connection_queue = get_connection_queue(cc, addr);
-    if (!connection_queue) {
+    if (fd < 0)
+        return;
+
+    if (peer_id < 0 || peer_id >= ATOMIC_READ(cc->num_peers)) {
         close(fd);
         return;
     }
 
-    if (queue_count(connection_queue) < ATOMIC_READ(cc->max_spare)) {
-        connection_pool_entry_t *entry = malloc(sizeof(connection_pool_entry_t));
-        entry->fd = fd;
-        gettimeofday(&entry->last_access, NULL);
-        if (queue_push_right(connection_queue, entry) != 0) {
-            free(entry);
-            close(fd);
+    connections_pool_peer_t *peer = cc->peers[peer_id];
+
+    struct timeval last_access = { 0, 0 };
+    if (ATOMIC_READ(cc->check))
+        gettimeofday(&last_access, NULL);
+
+    connections_pool_stash_t *stash = connections_pool_stash(cc);
+    if (stash) {
+        connections_pool_slot_t *slot = &stash->slots[peer_id % CONNECTIONS_POOL_STASH_SIZE];
+        if (ATOMIC_READ(slot->fd) < 0) {
+            slot->peer_id = peer_id;
+            slot->last_access = last_access;
+            // the filedescriptor is published last
+            // (see connections_pool_flush())
+            ATOMIC_SET(slot->fd, fd);
+            return;
         }
-    } else {
+    }
+
+    int index = stack_pop(&peer->unused, peer->entries);
+    if (index < 0) {
+        // no more spare connections allowed for this peer
         close(fd);
+        return;
     }
+
+    peer->entries[index].fd = fd;
+    peer->entries[index].last_access = last_access;
+    stack_push(&peer->available, peer->entries, index);
 }
 
 int
-connections_pool_tcp_timeout(connections_pool_t *cc, int new_value)
+connections_pool_get(connections_pool_t *cc, char *addr)
 {
-    int old_value = ATOMIC_READ(cc->tcp_timeout);
+    int peer_id = connections_pool_peer_id(cc, addr);
+    if (peer_id < 0)
+        return connections_pool_connect(cc, addr);
 
-    if (new_value >= 0)
-        ATOMIC_SET(cc->tcp_timeout, new_value);
+    return connections_pool_get_by_id(cc, peer_id);
+}
 
-    return old_value;
+void
+connections_pool_add(connections_pool_t *cc, char *addr, int fd)
+{
+    connections_pool_add_by_id(cc, connections_pool_peer_id(cc, addr), fd);
 }
 
 int
-connections_pool_expire_time(connections_pool_t *cc, int new_value)
+connections_pool_reconnect(connections_pool_t *cc, char *addr, int fd)
 {
-    int old_value = ATOMIC_READ(cc->expire_time);
+    if (fd >= 0)
+        close(fd);
+
+    ATOMIC_INCREMENT(cc->counters.reconnects);
+
+    return connect_to_peer(addr, ATOMIC_READ(cc->tcp_timeout));
+}
+
+int
+connections_pool_tcp_timeout(connections_pool_t *cc, int new_value)
+{
+    int old_value = ATOMIC_READ(cc->tcp_timeout);
 
     if (new_value >= 0)
-        ATOMIC_SET(cc->expire_time, new_value);
+        ATOMIC_SET(cc->tcp_timeout, new_value);
 
     return old_value;
 }
 
 int
-connections_pool_max_spare(connections_pool_t *cc, int new_value)
+connections_pool_expire_time(connections_pool_t *cc, int new_value)
 {
-    int old_value = ATOMIC_READ(cc->max_spare);
+    int old_value = ATOMIC_READ(cc->expire_time);
 
     if (new_value >= 0)
-        ATOMIC_SET(cc->max_spare, new_value);
+        ATOMIC_SET(cc->expire_time, new_value);
 
     return old_value;
 }
@@ -276,5 +512,11 @@ connections_pool_check(connections_pool_t *cc, int new_value)
     return old_value;
 }
 
+connections_pool_counters_t *
+connections_pool_counters(connections_pool_t *cc)
+{
+    return &cc->counters;
+}
+
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
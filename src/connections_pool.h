@@ -1,18 +1,47 @@
 #ifndef CONNECTIONS_POOL_H
 #define CONNECTIONS_POOL_H
 
+#include <stdint.h>
+
 typedef struct _connections_pool_s connections_pool_t;
 
 typedef struct _connection_pool_entry_s connection_pool_entry_t;
 
+typedef struct {
+    uint64_t hits;       // checkouts served by an already connected filedescriptor
+    uint64_t misses;     // checkouts which required a new connection
+    uint64_t reconnects; // pooled connections found broken and replaced
+} connections_pool_counters_t;
+
+// max number of distinct peers tracked by a single pool,
+// connections to peers exceeding this limit won't be pooled
+#define CONNECTIONS_POOL_MAX_PEERS 1024
+
 connections_pool_t * connections_pool_create(int tcp_timeout, int expire_time, int max_spare);
 void connections_pool_destroy(connections_pool_t *cc);
+
+// returns the integer id identifying 'addr' in the pool (registering it if necessary)
+// or -1 if no more peers can be registered
+int connections_pool_peer_id(connections_pool_t *cc, char *addr);
+
+// same as connections_pool_get() and connections_pool_add() but sparing the
+// lookup of the address (callers can keep the id returned by
+// connections_pool_peer_id() together with the address)
+int connections_pool_get_by_id(connections_pool_t *cc, int peer_id);
+void connections_pool_add_by_id(connections_pool_t *cc, int peer_id, int fd);
+
+// close a (pooled) connection which has been found broken
+// and return a new connection to the same peer
+int connections_pool_reconnect(connections_pool_t *cc, char *addr, int fd);
+
 int connections_pool_get(connections_pool_t *cc, char *addr);
 void connections_pool_add(connections_pool_t *cc, char *addr, int fd);
 int connections_pool_tcp_timeout(connections_pool_t *cc, int new_value);
 int connections_pool_check(connections_pool_t *cc, int new_value);
 int connections_pool_expire_time(connections_pool_t *cc, int new_value);
 
+connections_pool_counters_t *connections_pool_counters(connections_pool_t *cc);
+
 #endif
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define THREAD_SAFE
+#include <atomic_defs.h>
+
+#include "epoch.h"
+
+// the readers are spread among a few slots (each on its own cacheline)
+// so that threads reading at the same time don't all bounce the same counter
+#define EPOCH_SLOTS 16
+#define EPOCH_CACHELINE 64
+
+// the writer yields the cpu this many times
+// before sleeping (for EPOCH_SLEEP microseconds)
+#define EPOCH_SPINS 4
+#define EPOCH_SLEEP 100
+
+typedef struct {
+    // readers in progress which entered with an even/odd epoch
+    int readers[2];
+    char pad[EPOCH_CACHELINE - 2 * sizeof(int)];
+} epoch_slot_t;
+
+struct _epoch_s {
+    epoch_slot_t slots[EPOCH_SLOTS];
+    unsigned int current;
+    pthread_mutex_t lock; // serializes the writers
+};
+
+static unsigned int epoch_next_slot = 0;
+static __thread int epoch_thread_slot = -1;
+
+epoch_t *
+epoch_create()
+{
+    epoch_t *epoch = calloc(1, sizeof(epoch_t));
+    if (!epoch)
+        return NULL;
+    MUTEX_INIT(epoch->lock);
+    return epoch;
+}
+
+void
+epoch_destroy(epoch_t *epoch)
+{
+    MUTEX_DESTROY(epoch->lock);
+    free(epoch);
+}
+
+int
+epoch_enter(epoch_t *epoch)
+{
+    if (epoch_thread_slot == -1)
+        epoch_thread_slot = (ATOMIC_INCREASE(epoch_next_slot, 1) - 1) % EPOCH_SLOTS;
+
+    int parity = ATOMIC_READ(epoch->current) & 1;
+    ATOMIC_INCREMENT(epoch->slots[epoch_thread_slot].readers[parity]);
+    return (epoch_thread_slot << 1) | parity;
+}
+
+void
+epoch_exit(epoch_t *epoch, int token)
+{
+    ATOMIC_DECREMENT(epoch->slots[token >> 1].readers[token & 1]);
+}
+
+void
+epoch_synchronize(epoch_t *epoch)
+{
+    MUTEX_LOCK(epoch->lock);
+    // a reader might have read the epoch right before the flip and
+    // incremented its counter only afterwards, so both the counters
+    // must be seen at zero once: the flip moves the new readers to
+    // the other counter, so that the one being waited for can drain
+    int i;
+    for (i = 0; i < 2; i++) {
+        int parity = ATOMIC_INCREASE(epoch->current, 1) & 1;
+        int old = parity ^ 1;
+        int n;
+        for (n = 0; n < EPOCH_SLOTS; n++) {
+            // read sections are short, a reader still in progress
+            // after a few rounds has most likely been preempted
+            int spins = 0;
+            while (ATOMIC_READ(epoch->slots[n].readers[old])) {
+                if (++spins < EPOCH_SPINS)
+                    sched_yield();
+                else
+                    usleep(EPOCH_SLEEP);
+            }
+        }
+    }
+    MUTEX_UNLOCK(epoch->lock);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
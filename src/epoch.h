@@ -0,0 +1,57 @@
+/**
+ * @file epoch.h
+ * @brief Grace periods for the structures replaced while other threads
+ *        might still be reading them
+ *
+ * Readers wrap each access to a shared pointer between epoch_enter()
+ * and epoch_exit(). A writer publishes the new structure, calls
+ * epoch_synchronize() and only then releases the old one: once it
+ * returns none of the readers can still be using it.
+ *
+ * Readers never block and only update a counter shared with the threads
+ * falling in the same slot, the writer waits for the readers which were
+ * in progress when the pointer has been replaced (the ones starting
+ * afterwards are not waited for).
+ *
+ * @note epoch_synchronize() must never be called from within a read section
+ *       (nor while holding a lock any reader might wait for), it would wait forever
+ */
+#ifndef SHARDCACHE_EPOCH_H
+#define SHARDCACHE_EPOCH_H
+
+typedef struct _epoch_s epoch_t;
+
+/**
+ * @brief Create a new epoch tracker
+ * @return A newly initialized epoch tracker, NULL on errors
+ */
+epoch_t *epoch_create();
+
+/**
+ * @brief Release all the resources used by an epoch tracker
+ * @note No reader must be in progress
+ */
+void epoch_destroy(epoch_t *epoch);
+
+/**
+ * @brief Begin a read section
+ * @return The token to provide to epoch_exit()
+ * @note Read sections can be nested
+ */
+int epoch_enter(epoch_t *epoch);
+
+/**
+ * @brief End the read section started by epoch_enter()
+ */
+void epoch_exit(epoch_t *epoch, int token);
+
+/**
+ * @brief Wait for all the read sections in progress to end
+ * @note Concurrent calls are serialized
+ */
+void epoch_synchronize(epoch_t *epoch);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -18,6 +18,7 @@
 #include <inttypes.h>
 
 #include "async_reader.h"
+#include "compression.h"
 
 #define DEBUG_DUMP_MAXSIZE 128
 
@@ -27,7 +28,7 @@ static char hdr_check[256] = {
     0, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x20 - 0x2F
     0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x30 - 0x3F
     0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x40 - 0x4F
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x50 - 0x5F
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x50 - 0x5F
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x60 - 0x6F
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x70 - 0x7F
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x80 - 0x8F
@@ -48,6 +49,60 @@ global_tcp_timeout(int timeout)
     return old_value;
 }
 
+static int _protocol_version = SHC_PROTOCOL_VERSION;
+
+int
+global_protocol_version(int version)
+{
+    int old_value = ATOMIC_READ(_protocol_version);
+
+    if (version > 0 && version <= SHC_PROTOCOL_VERSION_MAX)
+        ATOMIC_SET(_protocol_version, version);
+
+    return old_value;
+}
+
+static int _compression_threshold = SHARDCACHE_COMPRESSION_THRESHOLD_DEFAULT;
+
+int
+global_compression_threshold(int threshold)
+{
+    int old_value = ATOMIC_READ(_compression_threshold);
+
+    if (threshold >= 0)
+        ATOMIC_SET(_compression_threshold, threshold);
+
+    return old_value;
+}
+
+// settings of the shardcache instance (or client) the current thread
+// is sending messages for, -1 if the global ones apply
+static __thread int _thread_protocol_version = -1;
+static __thread int _thread_compression_threshold = -1;
+
+void
+messaging_thread_settings(int protocol_version, int compression_threshold)
+{
+    _thread_protocol_version = protocol_version;
+    _thread_compression_threshold = compression_threshold;
+}
+
+int
+messaging_protocol_version()
+{
+    if (_thread_protocol_version > 0)
+        return _thread_protocol_version;
+    return ATOMIC_READ(_protocol_version);
+}
+
+int
+messaging_compression_threshold()
+{
+    if (_thread_compression_threshold >= 0)
+        return _thread_compression_threshold;
+    return ATOMIC_READ(_compression_threshold);
+}
+
 static void read_message_async_eof(iomux_t *iomux, int fd, void *priv)
 {
     read_async_input_eof(iomux, fd, priv);
@@ -170,6 +225,38 @@ fetch_from_peer_helper(void *data,
     return ret;
 }
 
+static int
+fetch_from_peer_read_async(char *peer,
+                           void *key,
+                           size_t klen,
+                           fetch_from_peer_async_cb cb,
+                           void *priv,
+                           int fd,
+                           int should_close,
+                           async_read_wrk_t **wrk)
+{
+    fetch_from_peer_helper_arg_t *arg = calloc(1, sizeof(fetch_from_peer_helper_arg_t));
+    if (!arg)
+        return -1;
+    arg->peer = peer;
+    if (klen > sizeof(arg->buf))
+        arg->key = malloc(klen);
+    else
+        arg->key = arg->buf;
+    memcpy(arg->key, key, klen);
+    arg->klen = klen;
+    arg->fd = should_close ? fd : -1;
+    arg->cb = cb;
+    arg->priv = priv;
+    int rc = read_message_async(fd, fetch_from_peer_helper, arg, wrk);
+    if (rc != 0) {
+        if (arg->key != arg->buf)
+            free(arg->key);
+        free(arg);
+    }
+    return rc;
+}
+
 int
 fetch_from_peer_async(char *peer,
                       void *key,
@@ -212,25 +299,9 @@ fetch_from_peer_async(char *peer,
             rc = write_message(fd, SHC_HDR_GET_OFFSET, record, 3);
 
         if (rc == 0) {
-            fetch_from_peer_helper_arg_t *arg = calloc(1, sizeof(fetch_from_peer_helper_arg_t));
-            arg->peer = peer;
-            if (klen > sizeof(arg->buf))
-                arg->key = malloc(klen);
-            else
-                arg->key = arg->buf;
-            memcpy(arg->key, key, klen);
-            arg->klen = klen;
-            arg->fd = should_close ? fd : -1;
-            arg->cb = cb;
-            arg->priv = priv;
-            rc = read_message_async(fd, fetch_from_peer_helper, arg, wrk);
-            if (rc != 0) {
-                if (fd >= 0 && should_close)
-                    close(fd);
-                if (arg->key != arg->buf)
-                    free(arg->key);
-                free(arg);
-            }
+            rc = fetch_from_peer_read_async(peer, key, klen, cb, priv, fd, should_close, wrk);
+            if (rc != 0 && fd >= 0 && should_close)
+                close(fd);
         } else {
             if (fd >= 0 && should_close)
                 close(fd);
@@ -239,6 +310,190 @@ fetch_from_peer_async(char *peer,
     return rc;
 }
 
+int
+fetch_from_peer_async_deferred(char *peer,
+                               void *key,
+                               size_t klen,
+                               fetch_from_peer_async_cb cb,
+                               void *priv,
+                               int fd,
+                               async_read_wrk_t **wrk)
+{
+    if (fd < 0 || !wrk)
+        return -1;
+
+    shardcache_record_t record = {
+        .v = key,
+        .l = klen
+    };
+
+    fbuf_t msg = FBUF_STATIC_INITIALIZER;
+    if (build_message(SHC_HDR_GET_ASYNC, &record, 1, &msg, messaging_protocol_version()) != 0) {
+        fbuf_destroy(&msg);
+        return -1;
+    }
+
+    int rc = fetch_from_peer_read_async(peer, key, klen, cb, priv, fd, 0, wrk);
+    if (rc != 0) {
+        fbuf_destroy(&msg);
+        return -1;
+    }
+
+    // the request will be written by the iomux the worker is added to,
+    // once the socket becomes writable
+    char *output = NULL;
+    (*wrk)->output_len = fbuf_detach(&msg, &output, NULL);
+    (*wrk)->output = output;
+    return 0;
+}
+
+static int
+read_socket_fully(int fd, char *buf, int len, int ignore_timeout)
+{
+    int ofx = 0;
+    while (ofx < len) {
+        int rb = read_socket(fd, buf + ofx, len - ofx, ignore_timeout);
+        if (rb == 0 || (rb == -1 && errno != EINTR && errno != EAGAIN))
+            return -1;
+        if (rb > 0)
+            ofx += rb;
+    }
+    return len;
+}
+
+static int
+read_varint(int fd, uint32_t *value, int ignore_timeout)
+{
+    uint32_t v = 0;
+    int i;
+    for (i = 0; i < SHC_VARINT_MAXLEN; i++) {
+        unsigned char byte;
+        if (read_socket_fully(fd, (char *)&byte, 1, ignore_timeout) != 1)
+            return -1;
+        v |= (uint32_t)(byte & 0x7F) << (7 * i);
+        if (!(byte & 0x80)) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// reads the body of a protocol v3 message (right after the header byte)
+// NOTE: records exceeding expected_records are consumed (so that the connection
+//       can still be reused) but their data is discarded
+static int
+read_message_v3(int fd,
+                fbuf_t **records,
+                int expected_records,
+                int ignore_timeout)
+{
+    unsigned char flags = 0;
+    if (read_socket_fully(fd, (char *)&flags, 1, ignore_timeout) != 1)
+        return -1;
+
+    uint32_t crc = 0;
+    int record_index = 0;
+    int initial_lens[expected_records];
+    int i;
+    for (i = 0; i < expected_records; i++)
+        initial_lens[i] = records[i] ? fbuf_used(records[i]) : 0;
+
+    for (;;) {
+        fbuf_t *out = record_index < expected_records ? records[record_index] : NULL;
+
+        uint32_t vlen = 0;
+        if (read_varint(fd, &vlen, ignore_timeout) != 0)
+            break;
+
+        uint32_t len = vlen >> 1;
+        if (len > SHARDCACHE_MSG_MAX_RECORD_LEN) {
+            SHC_ERROR("Maximum record size exceeded (%dMB)",
+                      SHARDCACHE_MSG_MAX_RECORD_LEN >> 20);
+            break;
+        }
+
+        if (vlen & SHC_RECORD_COMPRESSED) {
+            char *compressed = malloc(len);
+            if (!compressed || read_socket_fully(fd, compressed, len, ignore_timeout) != len) {
+                free(compressed);
+                break;
+            }
+
+            uint32_t olen = 0;
+            int olen_size = 0;
+            while (olen_size < len && olen_size < SHC_VARINT_MAXLEN) {
+                unsigned char byte = compressed[olen_size];
+                olen |= (uint32_t)(byte & 0x7F) << (7 * olen_size++);
+                if (!(byte & 0x80))
+                    break;
+            }
+
+            char *data = olen <= SHARDCACHE_MSG_MAX_RECORD_LEN ? malloc(olen) : NULL;
+            int dlen = data ? compression_lz4_decompress(compressed + olen_size,
+                                                         len - olen_size,
+                                                         data,
+                                                         olen)
+                            : -1;
+            free(compressed);
+            if (dlen < 0 || (uint32_t)dlen != olen) {
+                SHC_ERROR("Can't decompress record %d", record_index);
+                free(data);
+                break;
+            }
+
+            crc = compression_crc32(crc, data, dlen);
+            if (out)
+                fbuf_add_binary(out, data, dlen);
+            free(data);
+        } else {
+            char buf[65536];
+            while (len) {
+                int to_read = len < sizeof(buf) ? len : sizeof(buf);
+                if (read_socket_fully(fd, buf, to_read, ignore_timeout) != to_read)
+                    break;
+                crc = compression_crc32(crc, buf, to_read);
+                if (out)
+                    fbuf_add_binary(out, buf, to_read);
+                len -= to_read;
+            }
+            if (len)
+                break;
+        }
+
+        record_index++;
+
+        unsigned char rsep = 0;
+        if (read_socket_fully(fd, (char *)&rsep, 1, ignore_timeout) != 1)
+            break;
+
+        if (rsep == SHARDCACHE_RSEP)
+            continue;
+
+        if (rsep != SHARDCACHE_EOM)
+            break; // BOGUS RESPONSE
+
+        if (flags & SHC_FLAG_CRC) {
+            uint32_t rcrc = 0;
+            if (read_socket_fully(fd, (char *)&rcrc, sizeof(rcrc), ignore_timeout) != sizeof(rcrc))
+                break;
+            if (ntohl(rcrc) != crc) {
+                SHC_ERROR("Checksum mismatch (%08x != %08x)", ntohl(rcrc), crc);
+                break;
+            }
+        }
+
+        return record_index;
+    }
+
+    for (i = 0; i < expected_records; i++) {
+        if (records[i])
+            fbuf_set_used(records[i], initial_lens[i]);
+    }
+
+    return -1;
+}
+
 // synchronous (blocking)  message reading
 int
 read_message(int fd,
@@ -284,7 +539,7 @@ read_message(int fd,
                 return -1;
             }
             version = ((char *)&magic)[3];
-            if (version > SHC_PROTOCOL_VERSION) {
+            if (version > SHC_PROTOCOL_VERSION_MAX) {
                 SHC_WARNING("Unsupported protocol version 0x%02x\n", version);
                 return -1;
             }
@@ -308,6 +563,9 @@ read_message(int fd,
             if (ohdr)
                 *ohdr = hdr;
             reading_message = 1;
+
+            if (version >= 3)
+                return read_message_v3(fd, records, expected_records, ignore_timeout);
         }
 
         if (version < 2) {
@@ -484,33 +742,73 @@ record_to_array(fbuf_t *record, char ***items, size_t **lens)
     int data_len = fbuf_used(record);
 
     if (data_len < sizeof(uint32_t))
-        return -1;
+        return 0;
 
     uint32_t num_items = ntohl(*((uint32_t *)data));
     data += sizeof(uint32_t);
+    data_len -= sizeof(uint32_t);
+
+    // each item needs at least its size
+    if (num_items > data_len / sizeof(uint32_t))
+        return 0;
+
+    if (items)
+        *items = calloc(num_items + 1, sizeof(char *));
+    if (lens)
+        *lens = calloc(num_items + 1, sizeof(size_t));
 
     int i;
     for (i = 0; i < num_items; i++) {
+        if (data_len < sizeof(uint32_t))
+            break;
         uint32_t item_size = ntohl(*((uint32_t *)data));
         data += sizeof(uint32_t);
-        *items = realloc(*items, (sizeof(char *) * num_items) + 1);
-        if (items) {
-            if (item_size) {
-                (*items)[i] = malloc(item_size);
-                memcpy((*items)[i], data, item_size);
-                data += item_size;
-            } 
-        } else {
-            data += item_size;
+        data_len -= sizeof(uint32_t);
+        if (item_size > data_len)
+            break;
+
+        if (items && item_size) {
+            (*items)[i] = malloc(item_size);
+            memcpy((*items)[i], data, item_size);
         }
+        data += item_size;
+        data_len -= item_size;
 
-        if (lens) {
-            *lens = realloc(*lens, (sizeof(size_t) * num_items) + 1);
+        if (lens)
             (*lens)[i] = item_size;
+    }
+
+    if (i < num_items) {
+        // truncated record
+        if (items) {
+            int n;
+            for (n = 0; n < i; n++)
+                free((*items)[n]);
+            free(*items);
+            *items = NULL;
         }
+        if (lens) {
+            free(*lens);
+            *lens = NULL;
+        }
+        return 0;
     }
 
-    return 0;
+    return num_items;
+}
+
+void
+keys_to_record(int num_keys, void **keys, size_t *klens, fbuf_t *out)
+{
+    uint32_t num_keys_nbo = htonl(num_keys);
+    fbuf_add_binary(out, (char *)&num_keys_nbo, sizeof(num_keys_nbo));
+
+    int i;
+    for (i = 0; i < num_keys; i++) {
+        uint32_t klen_nbo = htonl(klens[i]);
+        fbuf_add_binary(out, (char *)&klen_nbo, sizeof(klen_nbo));
+        fbuf_add_binary(out, keys[i], klens[i]);
+    }
 }
 
 static inline uint32_t
@@ -628,6 +926,109 @@ rc_to_status(int rc, rc_to_status_mode_t mode)
 }
 
 
+int
+varint_encode(uint32_t value, unsigned char *out)
+{
+    int len = 0;
+    while (value >= 0x80) {
+        out[len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[len++] = value;
+    return len;
+}
+
+static int
+build_record_v3(shardcache_record_t *record, int threshold, fbuf_t *out)
+{
+    unsigned char vlen[SHC_VARINT_MAXLEN];
+    unsigned char olen[SHC_VARINT_MAXLEN];
+    size_t len = record->v ? record->l : 0;
+
+    if (len > SHARDCACHE_MSG_MAX_RECORD_LEN)
+        return -1;
+
+    if (threshold > 0 && len >= (size_t)threshold && len > 16) {
+        // compression is used only if it saves at least 1/16 of the size
+        int olen_size = varint_encode(len, olen);
+        size_t max_size = len - (len >> 4) - olen_size;
+        char *compressed = malloc(max_size);
+        if (compressed) {
+            int clen = compression_lz4_compress(record->v, len, compressed, max_size);
+            if (clen > 0) {
+                int vlen_size = varint_encode(((olen_size + clen) << 1) | SHC_RECORD_COMPRESSED, vlen);
+                fbuf_add_binary(out, (char *)vlen, vlen_size);
+                fbuf_add_binary(out, (char *)olen, olen_size);
+                fbuf_add_binary(out, compressed, clen);
+                free(compressed);
+                return 1;
+            }
+            free(compressed);
+        }
+    }
+
+    int vlen_size = varint_encode(len << 1, vlen);
+    fbuf_add_binary(out, (char *)vlen, vlen_size);
+    if (len)
+        fbuf_add_binary(out, record->v, len);
+
+    return 0;
+}
+
+static int
+build_message_v3(unsigned char hdr,
+                 shardcache_record_t *records,
+                 int num_records,
+                 fbuf_t *out)
+{
+    static char eom = SHARDCACHE_EOM;
+    static char sep = SHARDCACHE_RSEP;
+    static shardcache_record_t empty_record = { NULL, 0 };
+
+    int initial_len = fbuf_used(out);
+    uint32_t magic = htonl((SHC_MAGIC & 0xFFFFFF00) | 3);
+    fbuf_add_binary(out, (char *)&magic, sizeof(magic));
+    fbuf_add_binary(out, (char *)&hdr, 1);
+
+    unsigned char flags = SHC_FLAG_CRC;
+    int flags_offset = fbuf_used(out);
+    fbuf_add_binary(out, (char *)&flags, 1);
+
+    if (!num_records) {
+        records = &empty_record;
+        num_records = 1;
+    }
+
+    int threshold = messaging_compression_threshold();
+    uint32_t crc = 0;
+    int i;
+    for (i = 0; i < num_records; i++) {
+        if (i > 0)
+            fbuf_add_binary(out, &sep, 1);
+
+        int rc = build_record_v3(&records[i], threshold, out);
+        if (rc == -1) {
+            fbuf_set_used(out, initial_len);
+            return -1;
+        }
+
+        if (rc == 1)
+            flags |= SHC_FLAG_COMPRESSED;
+
+        if (records[i].v && records[i].l)
+            crc = compression_crc32(crc, records[i].v, records[i].l);
+    }
+
+    fbuf_add_binary(out, &eom, 1);
+
+    uint32_t crc_nbo = htonl(crc);
+    fbuf_add_binary(out, (char *)&crc_nbo, sizeof(crc_nbo));
+
+    fbuf_data(out)[flags_offset] = flags;
+
+    return 0;
+}
+
 int build_message(unsigned char hdr,
                   shardcache_record_t *records,
                   int num_records,
@@ -638,7 +1039,10 @@ int build_message(unsigned char hdr,
     static char sep = SHARDCACHE_RSEP;
     uint16_t    eor = 0;
 
-    uint32_t magic = htonl(SHC_MAGIC);
+    if (version >= 3)
+        return build_message_v3(hdr, records, num_records, out);
+
+    uint32_t magic = htonl((SHC_MAGIC & 0xFFFFFF00) | version);
     fbuf_add_binary(out, (char *)&magic, sizeof(magic));
 
     fbuf_add_binary(out, (char *)&hdr, 1);
@@ -661,6 +1065,9 @@ int build_message(unsigned char hdr,
                 }
             } else if (version < 2) {
                 fbuf_add_binary(out, (char *)&eor, sizeof(eor));
+            } else {
+                uint32_t zero_len = 0;
+                fbuf_add_binary(out, (char *)&zero_len, sizeof(zero_len));
             }
         }
     } else { 
@@ -686,7 +1093,7 @@ write_message(int fd,
 
     fbuf_t msg = FBUF_STATIC_INITIALIZER;
 
-    if (build_message(hdr, records, num_records, &msg, SHC_PROTOCOL_VERSION) != 0)
+    if (build_message(hdr, records, num_records, &msg, messaging_protocol_version()) != 0)
     {
         // TODO - Error Messages
         fbuf_destroy(&msg);
@@ -801,6 +1208,63 @@ evict_from_peer(char *peer,
 }
 
 
+// read the response to a SET/ADD/CAS (0 if stored, 1 if the key exists already,
+// -1 or the error code on errors) or to an INCR/DECR command
+static int64_t
+read_set_response(char *peer, int fd, int mode, int64_t *computed_amount)
+{
+    int64_t rc = -1;
+    shardcache_hdr_t hdr = 0;
+    fbuf_t resp[2];
+    fbuf_t *respp[2] = { &resp[0], &resp[1] };
+
+    FBUF_STATIC_INITIALIZER_POINTER(&resp[0], 0, 10, 10, 1);
+    FBUF_STATIC_INITIALIZER_POINTER(&resp[1], 0, 64, 256, 1);
+
+    errno = 0;
+
+    int num_records = read_message(fd, respp, 2, &hdr, 0);
+
+    SHC_DEBUG2("%s: Got response for command %02x from peer %s : %s\n",
+              __FUNCTION__, hdr, peer, fbuf_data(&resp[0]));
+
+    if (hdr == SHC_HDR_ERROR && num_records == 2) {
+        char *error_code = fbuf_data(&resp[0]);
+        SHC_ERROR("%s : %.*s (%d)", __FUNCTION__, fbuf_used(&resp[1]), fbuf_data(&resp[1]), *error_code);
+        rc = *error_code;
+    } else if (hdr != SHC_HDR_RESPONSE && num_records == 1) {
+        SHC_ERROR("Bad response (%02x) from %s : %s\n", hdr, peer, strerror(errno));
+        rc = -1;
+    } else {
+        if (mode < 3) { // anything but INCR and DECR
+            char *res = fbuf_data(&resp[0]);
+            if (res) {
+                switch(*res) {
+                    case SHC_RES_EXISTS:
+                        rc = 1;
+                        break;
+                    case SHC_RES_OK:
+                        rc = 0;
+                        break;
+                    default:
+                        rc = -1;
+                        break;
+                }
+            } else {
+                rc = -1;
+            }
+        } else { // INCR AND DECR responses differ from other set-related responses
+            char *decimal_string = fbuf_data(&resp[0]);
+            int64_t amount = strtoll(decimal_string, NULL, 10);
+            if (computed_amount)
+                *computed_amount = amount;
+            rc =  (!amount && errno) ? -1 : 0;
+        }
+    }
+    fbuf_destroy(&resp[0]);
+    fbuf_destroy(&resp[1]);
+    return rc;
+}
 
 static inline int
 _send_to_peer_internal(char *peer,
@@ -894,60 +1358,8 @@ _send_to_peer_internal(char *peer,
         return -1;
     }
 
-    if (rc == 0 && expect_response) {
-        shardcache_hdr_t hdr = 0;
-        fbuf_t resp[2];
-        fbuf_t *respp[2] = { &resp[0], &resp[1] };
-
-        FBUF_STATIC_INITIALIZER_POINTER(&resp[0], 0, 10, 10, 1);
-        FBUF_STATIC_INITIALIZER_POINTER(&resp[1], 0, 64, 256, 1);
-
-        errno = 0;
-
-        int num_records = read_message(fd, respp, 2, &hdr, 0);
-
-        SHC_DEBUG2("%s: Got response for command %02x from peer %s : %s\n",
-                  __FUNCTION__, hdr, peer, fbuf_data(&resp[0]));
-
-        if (hdr == SHC_HDR_ERROR && num_records == 2) {
-            char *error_code = fbuf_data(&resp[0]);
-            SHC_ERROR("%s : %.*s (%d)", __FUNCTION__, fbuf_used(&resp[1]), fbuf_data(&resp[1]), *error_code);
-            rc = *error_code;
-        } else if (hdr != SHC_HDR_RESPONSE && num_records == 1) {
-            SHC_ERROR("Bad response (%02x) from %s : %s\n", hdr, peer, strerror(errno));
-            rc = -1;
-        } else {
-            if (mode < 3) { // anything but INCR and DECR
-                char *res = fbuf_data(&resp[0]);
-                if (res) {
-                    switch(*res) {
-                        case SHC_RES_EXISTS:
-                            rc = 1;
-                            break;
-                        case SHC_RES_OK:
-                            rc = 0;
-                            break;
-                        default:
-                            rc = -1;
-                            break;
-                    }
-                } else {
-                    rc = -1;
-                }
-            } else { // INCR AND DECR responses differ from other set-related responses
-                char *decimal_string = fbuf_data(&resp[0]);
-                int64_t amount = strtoll(decimal_string, NULL, 10);
-                if (computed_amount)
-                    *computed_amount = amount;
-                rc =  (!amount && errno) ? -1 : 0;
-            }
-        }
-        fbuf_destroy(&resp[0]);
-        fbuf_destroy(&resp[1]);
-    } else if (rc != 0) {
-        fprintf(stderr, "Error reading from socket %d (%s) : %s\n",
-                fd, peer, strerror(errno));
-    }
+    if (expect_response)
+        rc = read_set_response(peer, fd, mode, computed_amount);
 
     if (should_close)
         close(fd);
@@ -1007,17 +1419,280 @@ add_to_peer(char *peer,
                                   expect_response);
 }
 
-int
-cas_on_peer(char *peer,
-            void *key,
-            size_t klen,
-            void *old_value,
-            size_t old_vlen,
-            void *value,
-            size_t vlen,
-            uint32_t ttl,
-            uint32_t cttl,
-            int fd,
+static int
+write_buffer(int fd, fbuf_t *buf)
+{
+    while(fbuf_used(buf) > 0) {
+        int wb = fbuf_write(buf, fd, 0);
+        if (wb == 0 || (wb == -1 && errno != EINTR && errno != EAGAIN))
+            return -1;
+    }
+    return 0;
+}
+
+static int
+write_fully(int fd, char *data, size_t len)
+{
+    size_t ofx = 0;
+    while (ofx < len) {
+        ssize_t wb = write(fd, data + ofx, len - ofx);
+        if (wb == 0 || (wb == -1 && errno != EINTR && errno != EAGAIN))
+            return -1;
+        if (wb > 0)
+            ofx += wb;
+    }
+    return 0;
+}
+
+// append a record whose size is known in advance
+// (protocol version 1 records are chunked)
+static void
+build_stream_record(void *data, size_t len, char version, uint32_t *crc, fbuf_t *out)
+{
+    if (version < 2) {
+        if (len) {
+            _chunkize_buffer(data, len, out);
+        } else {
+            uint16_t eor = 0;
+            fbuf_add_binary(out, (char *)&eor, sizeof(eor));
+        }
+    } else if (version < 3) {
+        uint32_t len_nbo = htonl(len);
+        fbuf_add_binary(out, (char *)&len_nbo, sizeof(len_nbo));
+        fbuf_add_binary(out, data, len);
+    } else {
+        shardcache_record_t record = { .v = data, .l = len };
+        build_record_v3(&record, 0, out);
+        if (len)
+            *crc = compression_crc32(*crc, data, len);
+    }
+}
+
+int
+send_stream_to_peer_begin(int fd,
+                          void *key,
+                          size_t klen,
+                          size_t vlen,
+                          char version,
+                          uint32_t *crc)
+{
+    static char sep = SHARDCACHE_RSEP;
+
+    if (vlen > SHARDCACHE_MSG_MAX_RECORD_LEN || klen > SHARDCACHE_MSG_MAX_RECORD_LEN)
+        return -1;
+
+    fbuf_t msg = FBUF_STATIC_INITIALIZER;
+    unsigned char hdr = SHC_HDR_SET;
+    uint32_t magic = htonl((SHC_MAGIC & 0xFFFFFF00) | version);
+    fbuf_add_binary(&msg, (char *)&magic, sizeof(magic));
+    fbuf_add_binary(&msg, (char *)&hdr, 1);
+    if (version >= 3) {
+        // nothing is compressed, the value can't be known in advance
+        unsigned char flags = SHC_FLAG_CRC;
+        fbuf_add_binary(&msg, (char *)&flags, 1);
+    }
+
+    *crc = 0;
+    build_stream_record(key, klen, version, crc, &msg);
+    fbuf_add_binary(&msg, &sep, 1);
+
+    // the size of the value precedes its data
+    // (version 1 records are instead sent in chunks)
+    if (version >= 3) {
+        unsigned char vlen_varint[SHC_VARINT_MAXLEN];
+        int vlen_size = varint_encode(vlen << 1, vlen_varint);
+        fbuf_add_binary(&msg, (char *)vlen_varint, vlen_size);
+    } else if (version == 2) {
+        uint32_t vlen_nbo = htonl(vlen);
+        fbuf_add_binary(&msg, (char *)&vlen_nbo, sizeof(vlen_nbo));
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+
+    int rc = write_buffer(fd, &msg);
+    fbuf_destroy(&msg);
+    return rc;
+}
+
+int
+send_stream_to_peer_data(int fd,
+                         void *data,
+                         size_t len,
+                         char version,
+                         uint32_t *crc)
+{
+    if (version >= 3 && len)
+        *crc = compression_crc32(*crc, data, len);
+
+    size_t ofx = 0;
+    while (ofx < len) {
+        size_t writelen = len - ofx;
+        if (version < 2) {
+            if (writelen > UINT16_MAX)
+                writelen = UINT16_MAX;
+            uint16_t size = htons(writelen);
+            if (write_fully(fd, (char *)&size, sizeof(size)) != 0)
+                return -1;
+        }
+        if (write_fully(fd, (char *)data + ofx, writelen) != 0)
+            return -1;
+        ofx += writelen;
+    }
+    return 0;
+}
+
+int
+send_stream_to_peer_end(char *peer,
+                        int fd,
+                        uint32_t ttl,
+                        char version,
+                        uint32_t crc)
+{
+    static char sep = SHARDCACHE_RSEP;
+
+    fbuf_t msg = FBUF_STATIC_INITIALIZER;
+    if (version < 2) {
+        uint16_t eor = 0;
+        fbuf_add_binary(&msg, (char *)&eor, sizeof(eor));
+    }
+
+    if (ttl) {
+        uint32_t ttl_nbo = htonl(ttl);
+        fbuf_add_binary(&msg, &sep, 1);
+        build_stream_record(&ttl_nbo, sizeof(ttl_nbo), version, &crc, &msg);
+    }
+
+    char eom = version >= 3 ? SHARDCACHE_EOM : 0;
+    fbuf_add_binary(&msg, &eom, 1);
+    if (version >= 3) {
+        uint32_t crc_nbo = htonl(crc);
+        fbuf_add_binary(&msg, (char *)&crc_nbo, sizeof(crc_nbo));
+    }
+
+    int rc = write_buffer(fd, &msg);
+    fbuf_destroy(&msg);
+    if (rc != 0)
+        return -1;
+
+    return read_set_response(peer, fd, 0, NULL);
+}
+
+int
+send_multi_to_peer(char *peer,
+                   void **keys,
+                   size_t *klens,
+                   void **values,
+                   size_t *vlens,
+                   int num_keys,
+                   uint32_t ttl,
+                   uint32_t cttl,
+                   int *statuses,
+                   int fd)
+{
+    int should_close = 0;
+    if (fd < 0) {
+        fd = connect_to_peer(peer, ATOMIC_READ(_tcp_timeout));
+        if (fd < 0)
+            return -1;
+        should_close = 1;
+    }
+
+    // queue all the commands and send them at once
+    fbuf_t msg = FBUF_STATIC_INITIALIZER;
+    int i;
+    for (i = 0; i < num_keys; i++) {
+        uint32_t ttl_nbo = htonl(ttl);
+        uint32_t cttl_nbo = htonl(cttl);
+        shardcache_record_t record[4] = {
+            {
+                .v = keys[i],
+                .l = klens[i]
+            },
+            {
+                .v = values[i],
+                .l = vlens[i]
+            },
+            {
+                .v = &ttl_nbo,
+                .l = sizeof(ttl_nbo)
+            },
+            {
+                .v = &cttl_nbo,
+                .l = sizeof(cttl_nbo)
+            }
+        };
+        int num_records = cttl ? 4 : (ttl ? 3 : 2);
+        if (build_message(SHC_HDR_SET, record, num_records, &msg, messaging_protocol_version()) != 0) {
+            fbuf_destroy(&msg);
+            if (should_close)
+                close(fd);
+            return -1;
+        }
+        statuses[i] = -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+
+    while(fbuf_used(&msg) > 0) {
+        int wb = fbuf_write(&msg, fd, 0);
+        if (wb == 0 || (wb == -1 && errno != EINTR && errno != EAGAIN)) {
+            fbuf_destroy(&msg);
+            if (should_close)
+                close(fd);
+            return -1;
+        }
+    }
+    fbuf_destroy(&msg);
+
+    // and now collect the responses (which come in the same order)
+    int rc = 0;
+    for (i = 0; i < num_keys; i++) {
+        shardcache_hdr_t hdr = 0;
+        fbuf_t resp[2];
+        fbuf_t *respp[2] = { &resp[0], &resp[1] };
+
+        FBUF_STATIC_INITIALIZER_POINTER(&resp[0], 0, 10, 10, 1);
+        FBUF_STATIC_INITIALIZER_POINTER(&resp[1], 0, 64, 256, 1);
+
+        int num_records = read_message(fd, respp, 2, &hdr, 0);
+        if (num_records < 1) {
+            SHC_ERROR("Can't read the response for key %d of %d from peer %s : %s",
+                      i + 1, num_keys, peer, strerror(errno));
+            fbuf_destroy(&resp[0]);
+            fbuf_destroy(&resp[1]);
+            rc = -1;
+            break;
+        }
+
+        if (hdr == SHC_HDR_ERROR && num_records == 2) {
+            SHC_ERROR("%s : %.*s", __FUNCTION__, fbuf_used(&resp[1]), fbuf_data(&resp[1]));
+        } else if (hdr == SHC_HDR_RESPONSE && fbuf_used(&resp[0]) &&
+                   *((char *)fbuf_data(&resp[0])) == SHC_RES_OK)
+        {
+            statuses[i] = 0;
+        }
+
+        fbuf_destroy(&resp[0]);
+        fbuf_destroy(&resp[1]);
+    }
+
+    if (should_close)
+        close(fd);
+
+    return rc;
+}
+
+int
+cas_on_peer(char *peer,
+            void *key,
+            size_t klen,
+            void *old_value,
+            size_t old_vlen,
+            void *value,
+            size_t vlen,
+            uint32_t ttl,
+            uint32_t cttl,
+            int fd,
             int expect_response)
 {
     return _send_to_peer_internal(peer,
@@ -1404,9 +2079,12 @@ check_peer(char *peer,
     return -1;
 }
 
-shardcache_storage_index_t *
-index_from_peer(char *peer,
-                int fd)
+int
+topology_from_peer(char *peer,
+                   uint32_t *version,
+                   char **nodes,
+                   char **migration_nodes,
+                   int fd)
 {
     int should_close = 0;
     if (fd < 0) {
@@ -1414,46 +2092,195 @@ index_from_peer(char *peer,
         should_close = 1;
     }
 
-    shardcache_storage_index_t *index = calloc(1, sizeof(shardcache_storage_index_t));
-    if (fd >= 0) {
-        int rc = write_message(fd, SHC_HDR_GET_INDEX, NULL, 0);
-        if (rc == 0) {
-            fbuf_t resp = FBUF_STATIC_INITIALIZER;
-            fbuf_t *respp = &resp;
-            shardcache_hdr_t hdr = 0;
-            int num_records = read_message(fd, &respp, 1, &hdr, 1);
-            if (hdr == SHC_HDR_INDEX_RESPONSE && num_records == 1) {
-                char *data = fbuf_data(&resp);
-                int len = fbuf_used(&resp);
-                int ofx = 0;
-                while (ofx < len) {
-                    uint32_t *nklen = (uint32_t *)(data+ofx);
-                    uint32_t klen = ntohl(*nklen);
-                    if (klen == 0) {
-                        // the index has ended
-                        break;
-                    } else if (ofx + klen + 8 > len) {
-                        // TODO - Error messages (truncated?)
-                        break;
-                    }
-                    ofx += 4;
-                    void *key = malloc(klen);
-                    memcpy(key, data+ofx, klen);
-                    ofx += klen;
-                    uint32_t *nvlen = (uint32_t *)(data+ofx);
-                    uint32_t vlen = ntohl(*nvlen);
-                    ofx += 4;
-                    index->items = realloc(index->items, (index->size + 1) * sizeof(shardcache_storage_index_item_t));
-                    index->items[index->size].key = key;
-                    index->items[index->size].klen = klen;
-                    index->items[index->size].vlen = vlen;
-                    index->size++;
-                }
+    if (fd < 0)
+        return -1;
+
+    int rc = -1;
+    uint32_t nversion = htonl(*version);
+    shardcache_record_t record = { &nversion, *version ? sizeof(nversion) : 0 };
+    if (write_message(fd, SHC_HDR_TOPOLOGY, &record, 1) == 0) {
+        fbuf_t resp[3] = { FBUF_STATIC_INITIALIZER, FBUF_STATIC_INITIALIZER, FBUF_STATIC_INITIALIZER };
+        fbuf_t *respp[3] = { &resp[0], &resp[1], &resp[2] };
+        shardcache_hdr_t hdr = 0;
+        int num_records = read_message(fd, respp, 3, &hdr, 0);
+        if (hdr == SHC_HDR_RESPONSE && num_records == 3 &&
+            fbuf_used(&resp[0]) == sizeof(uint32_t))
+        {
+            memcpy(&nversion, fbuf_data(&resp[0]), sizeof(uint32_t));
+            // a node always has at least itself in the current continuum,
+            // no lists means that the known topology is still valid
+            if (!fbuf_used(&resp[1])) {
+                rc = 0;
+            } else {
+                *version = ntohl(nversion);
+                *nodes = strndup(fbuf_data(&resp[1]), fbuf_used(&resp[1]));
+                *migration_nodes = fbuf_used(&resp[2])
+                                 ? strndup(fbuf_data(&resp[2]), fbuf_used(&resp[2]))
+                                 : NULL;
+                rc = 1;
+            }
+        } else if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
+            SHC_DEBUG("Peer %s doesn't support the TOPOLOGY command", peer);
+        }
+        fbuf_destroy(&resp[0]);
+        fbuf_destroy(&resp[1]);
+        fbuf_destroy(&resp[2]);
+    }
+
+    if (should_close)
+        close(fd);
+
+    return rc;
+}
+
+int
+subscribe_to_peer(char *peer,
+                  int fd)
+{
+    if (fd < 0)
+        return -1;
+
+    int rc = write_message(fd, SHC_HDR_SUBSCRIBE, NULL, 0);
+    if (rc == 0) {
+        fbuf_t resp = FBUF_STATIC_INITIALIZER;
+        fbuf_t *respp = &resp;
+        shardcache_hdr_t hdr = 0;
+        int num_records = read_message(fd, &respp, 1, &hdr, 0);
+        rc = -1;
+        if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
+            char *res = fbuf_data(&resp);
+            if (res && *res == SHC_RES_OK)
+                rc = 0;
+        }
+        fbuf_destroy(&resp);
+    }
+
+    if (rc != 0)
+        SHC_DEBUG("Peer %s refused the subscription", peer);
+
+    return rc;
+}
+
+int
+index_from_peer_foreach(char *peer,
+                        int fd,
+                        index_from_peer_cb cb,
+                        void *priv)
+{
+    int should_close = 0;
+    if (fd < 0) {
+        fd = connect_to_peer(peer, ATOMIC_READ(_tcp_timeout));
+        if (fd < 0)
+            return -1;
+        should_close = 1;
+    }
+
+    int ret = -1;
+    uint64_t cursor = 0;
+    do {
+        // ask for the next chunk of the index (servers not supporting
+        // the chunked index will ignore the cursor and return the whole index)
+        uint32_t ncursor[2] = { htonl(cursor >> 32), htonl(cursor & 0xFFFFFFFF) };
+        uint32_t nsize = htonl(SHARDCACHE_INDEX_CHUNK_SIZE);
+        shardcache_record_t record[2] = {
+            {
+                .v = ncursor,
+                .l = sizeof(ncursor)
+            },
+            {
+                .v = &nsize,
+                .l = sizeof(nsize)
             }
+        };
+
+        if (write_message(fd, SHC_HDR_GET_INDEX, record, 2) != 0)
+            break;
+
+        fbuf_t resp = FBUF_STATIC_INITIALIZER;
+        fbuf_t resp_cursor = FBUF_STATIC_INITIALIZER;
+        fbuf_t *respp[2] = { &resp, &resp_cursor };
+        shardcache_hdr_t hdr = 0;
+        int num_records = read_message(fd, respp, 2, &hdr, 1);
+        if (hdr != SHC_HDR_INDEX_RESPONSE || num_records < 1) {
             fbuf_destroy(&resp);
+            fbuf_destroy(&resp_cursor);
+            break;
         }
-        if (should_close)
-            close(fd);
+
+        char *data = fbuf_data(&resp);
+        int len = fbuf_used(&resp);
+        int ofx = 0;
+        int stop = 0;
+        while (ofx + 4 <= len) {
+            uint32_t klen = ntohl(*((uint32_t *)(data+ofx)));
+            if (klen == 0) {
+                // the index has ended
+                break;
+            } else if (ofx + klen + 8 > len) {
+                SHC_WARNING("Truncated index received from peer %s", peer);
+                stop = 1;
+                break;
+            }
+            ofx += 4;
+            void *key = data+ofx;
+            ofx += klen;
+            uint32_t vlen = ntohl(*((uint32_t *)(data+ofx)));
+            ofx += 4;
+            if (cb(key, klen, vlen, priv) != 0) {
+                stop = 1;
+                break;
+            }
+        }
+
+        if (fbuf_used(&resp_cursor) == sizeof(ncursor)) {
+            memcpy(ncursor, fbuf_data(&resp_cursor), sizeof(ncursor));
+            cursor = ((uint64_t)ntohl(ncursor[0]) << 32) | ntohl(ncursor[1]);
+        } else {
+            // no cursor, the peer sent the whole index
+            cursor = 0;
+        }
+
+        fbuf_destroy(&resp);
+        fbuf_destroy(&resp_cursor);
+
+        if (stop)
+            break;
+
+        if (cursor == 0)
+            ret = 0;
+    } while (cursor);
+
+    if (should_close)
+        close(fd);
+
+    return ret;
+}
+
+static int
+index_from_peer_collect(void *key, size_t klen, size_t vlen, void *priv)
+{
+    shardcache_storage_index_t *index = (shardcache_storage_index_t *)priv;
+    // grow the array exponentially
+    if (index->size == 0 || (index->size >= 64 && (index->size & (index->size - 1)) == 0)) {
+        size_t newsize = index->size ? index->size * 2 : 64;
+        index->items = realloc(index->items, newsize * sizeof(shardcache_storage_index_item_t));
+    }
+    index->items[index->size].key = malloc(klen);
+    memcpy(index->items[index->size].key, key, klen);
+    index->items[index->size].klen = klen;
+    index->items[index->size].vlen = vlen;
+    index->size++;
+    return 0;
+}
+
+shardcache_storage_index_t *
+index_from_peer(char *peer,
+                int fd)
+{
+    shardcache_storage_index_t *index = calloc(1, sizeof(shardcache_storage_index_t));
+    if (index_from_peer_foreach(peer, fd, index_from_peer_collect, index) != 0) {
+        shardcache_free_index(index);
+        return NULL;
     }
     return index;
 }
@@ -1540,34 +2367,223 @@ abort_migrate_peer(char *peer,
     return -1;
 }
 
-int
-connect_to_peer(char *address_string, unsigned int timeout)
+static inline char *
+local_socket_path(char *address_string)
 {
-    static __thread char host[2048];
-    static __thread int port = 0;
-    static __thread int len = 0;
+    if (strncmp(address_string, "unix:", 5) == 0)
+        return address_string + 5;
+    if (strncmp(address_string, "shm:", 4) == 0)
+        return address_string + 4;
+    return NULL;
+}
 
+static inline int
+peer_host_port(char *address_string, char *host, size_t size, int *port)
+{
+    int len;
     char *sep = strchr(address_string, ':');
 
     if (sep) {
         len = sep - address_string;
-        port = strtol(sep+1, NULL , 10);
+        *port = strtol(sep+1, NULL , 10);
     } else {
         len = strlen(address_string);
-        port = SHARDCACHE_PORT_DEFAULT;
+        *port = SHARDCACHE_PORT_DEFAULT;
     }
 
-    if (__builtin_expect(len < sizeof(host), 1)) {
-        snprintf(host, len + 1, "%s", address_string);
-    } else {
+    if (__builtin_expect((size_t)len >= size, 0)) {
         SHC_ERROR("address_string too long : %s", address_string);
         return -1;
     }
+    snprintf(host, len + 1, "%s", address_string);
+    return 0;
+}
+
+int
+connect_to_peer(char *address_string, unsigned int timeout)
+{
+    static __thread char host[2048];
+    int port = 0;
+
+    char *path = local_socket_path(address_string);
+    if (path) {
+        int fd = open_lconnection(path, timeout);
+        if (__builtin_expect(fd < 0 && errno != EMFILE, 0))
+            SHC_DEBUG("Can't connect to %s", address_string);
+        return fd;
+    }
+
+    if (peer_host_port(address_string, host, sizeof(host), &port) != 0)
+        return -1;
+
     int fd = open_connection(host, port, timeout);
     if (__builtin_expect(fd < 0 && errno != EMFILE, 0))
         SHC_DEBUG("Can't connect to %s", address_string);
     return fd;
 }
 
+int
+connect_to_peer_nonblocking(char *address_string)
+{
+    static __thread char host[2048];
+    int port = 0;
+
+    char *path = local_socket_path(address_string);
+    if (path) {
+        // connecting to a local socket doesn't block
+        int fd = open_lconnection(path, 0);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        } else if (__builtin_expect(errno != EMFILE, 0)) {
+            SHC_DEBUG("Can't connect to %s", address_string);
+        }
+        return fd;
+    }
+
+    if (peer_host_port(address_string, host, sizeof(host), &port) != 0)
+        return -1;
+
+    int fd = open_connection_nonblocking(host, port);
+    if (__builtin_expect(fd < 0 && errno != EMFILE, 0))
+        SHC_DEBUG("Can't connect to %s", address_string);
+    return fd;
+}
+
+shm_channel_t *
+open_shm_channel(char *address_string, unsigned int timeout)
+{
+    int fd = connect_to_peer(address_string, timeout);
+    if (fd < 0)
+        return NULL;
+
+    if (write_message(fd, SHC_HDR_SHM_OPEN, NULL, 0) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // the file descriptors come attached to a NOOP
+    // byte sent right before the actual response
+    shm_channel_t *ch = shm_channel_receive(fd);
+    if (!ch) {
+        close(fd);
+        return NULL;
+    }
+
+    shardcache_hdr_t hdr = 0;
+    fbuf_t resp = FBUF_STATIC_INITIALIZER;
+    fbuf_t *respp = &resp;
+    int num_records = read_message(fd, &respp, 1, &hdr, 0);
+    char *res = fbuf_data(&resp);
+    if (hdr != SHC_HDR_RESPONSE || num_records != 1 || !res || *res != SHC_RES_OK) {
+        SHC_DEBUG("Shm channel refused by %s", address_string);
+        fbuf_destroy(&resp);
+        shm_channel_destroy(ch); // closes fd as well
+        return NULL;
+    }
+    fbuf_destroy(&resp);
+
+    return ch;
+}
+
+int
+write_message_shm(shm_channel_t *ch,
+                  unsigned char hdr,
+                  shardcache_record_t *records,
+                  int num_records,
+                  unsigned int timeout)
+{
+    fbuf_t msg = FBUF_STATIC_INITIALIZER;
+
+    if (build_message(hdr, records, num_records, &msg, messaging_protocol_version()) != 0) {
+        fbuf_destroy(&msg);
+        return -1;
+    }
+
+    char *data = fbuf_data(&msg);
+    int left = fbuf_used(&msg);
+    while (left > 0) {
+        int wb = shm_channel_write(ch, data, left);
+        if (wb == -1 || (wb == 0 && shm_channel_wait(ch, SHM_CHANNEL_WAIT_WRITE, timeout) != 0)) {
+            fbuf_destroy(&msg);
+            return -1;
+        }
+        data += wb;
+        left -= wb;
+    }
+
+    fbuf_destroy(&msg);
+    return 0;
+}
+
+typedef struct {
+    fbuf_t **out;
+    int expected_records;
+    int num_records;
+} read_message_shm_arg_t;
+
+static int
+read_message_shm_helper(void *data, size_t len, int idx, size_t total_len, void *priv)
+{
+    read_message_shm_arg_t *arg = (read_message_shm_arg_t *)priv;
+
+    if (idx >= 0) {
+        if (data && idx < arg->expected_records && arg->out[idx])
+            fbuf_add_binary(arg->out[idx], data, len);
+        else if (!data)
+            arg->num_records++; // a record has been completed and more will follow
+    } else if (idx == -1) {
+        arg->num_records++;
+    }
+
+    return (idx >= -1) ? 0 : -1;
+}
+
+int
+read_message_shm(shm_channel_t *ch,
+                 fbuf_t **out,
+                 int expected_records,
+                 shardcache_hdr_t *hdr,
+                 unsigned int timeout)
+{
+    if (expected_records < 1)
+        return -1;
+
+    read_message_shm_arg_t arg = {
+        .out = out,
+        .expected_records = expected_records,
+        .num_records = 0
+    };
+
+    async_read_ctx_t *ctx = async_read_context_create(read_message_shm_helper, &arg);
+    async_read_context_state_t state = SHC_STATE_READING_NONE;
+
+    while (state != SHC_STATE_READING_DONE && state != SHC_STATE_READING_ERR) {
+        void *data = NULL;
+        int len = shm_channel_peek(ch, &data);
+        if (len == -1)
+            break;
+
+        if (len == 0) {
+            if (shm_channel_wait(ch, SHM_CHANNEL_WAIT_READ, timeout) != 0)
+                break;
+            continue;
+        }
+
+        int processed = 0;
+        state = async_read_context_input_data(ctx, data, len, &processed);
+        shm_channel_consume(ch, processed);
+    }
+
+    if (hdr)
+        *hdr = async_read_context_hdr(ctx);
+
+    async_read_context_destroy(ctx);
+
+    if (state != SHC_STATE_READING_DONE)
+        return -1;
+
+    return (arg.num_records < expected_records) ? arg.num_records : expected_records;
+}
+
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
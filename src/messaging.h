@@ -8,11 +8,34 @@
 #include "shardcache.h"
 #include "protocol.h"
 #include "async_reader.h"
+#include "shm_channel.h"
 
 // TODO - Document all exposed functions
 
 int global_tcp_timeout(int tcp_timeout);
 
+// protocol version used for outgoing messages (defaults to SHC_PROTOCOL_VERSION)
+// NOTE: responses always use the same version as the request they refer to
+int global_protocol_version(int version);
+
+// records bigger than the threshold will be compressed when using protocol version 3
+// (0 disables compression, defaults to SHARDCACHE_COMPRESSION_THRESHOLD_DEFAULT)
+int global_compression_threshold(int threshold);
+
+// the shardcache instances and the clients apply their own settings
+// (overriding the global ones) to the messages sent by the calling thread
+// on their behalf. Negative values restore the global settings
+void messaging_thread_settings(int protocol_version, int compression_threshold);
+
+// the settings which apply to the messages built by the calling thread
+int messaging_protocol_version();
+int messaging_compression_threshold();
+
+// encode 'value' as a varint (used for record lengths in protocol version 3)
+// NOTE: 'out' must be able to hold at least SHC_VARINT_MAXLEN bytes
+// returns the number of bytes written to 'out'
+int varint_encode(uint32_t value, unsigned char *out);
+
 // synchronously read a message (blocking)
 int read_message(int fd,
                  fbuf_t **out,
@@ -58,8 +81,13 @@ char rc_to_status(int rc, rc_to_status_mode_t mode);
 
 // convert a (de-chunkized) record to an array of vaules
 // NOTE: the record MUST be complete and without the chunk-size headers
+// returns the number of items (0 if the record is empty or malformed)
 uint32_t record_to_array(fbuf_t *record, char ***items, size_t **lens);
 
+// convert an array of keys to a (not chunkized) record
+// which can be passed to build_message() (as used by the _MULTI commands)
+void keys_to_record(int num_keys, void **keys, size_t *klens, fbuf_t *out);
+
 // delete a key from a peer
 int delete_from_peer(char *peer,
                      void *key,
@@ -87,6 +115,49 @@ int send_to_peer(char *peer,
                  int fd,
                  int expect_response);
 
+// send a SET command to a peer writing the value in chunks, so that it never
+// needs to be fully buffered: send_stream_to_peer_begin() writes everything
+// up to the data of the value (whose size needs to be known in advance),
+// send_stream_to_peer_data() is then called until exactly 'vlen' bytes have
+// been written and send_stream_to_peer_end() completes the message and reads
+// the response (0 if stored, -1 otherwise).
+// 'crc' keeps the checksum of the records sent with protocol version 3
+int send_stream_to_peer_begin(int fd,
+                              void *key,
+                              size_t klen,
+                              size_t vlen,
+                              char version,
+                              uint32_t *crc);
+
+int send_stream_to_peer_data(int fd,
+                             void *data,
+                             size_t len,
+                             char version,
+                             uint32_t *crc);
+
+int send_stream_to_peer_end(char *peer,
+                            int fd,
+                            uint32_t ttl,
+                            char version,
+                            uint32_t crc);
+
+// send new values for multiple keys to a peer, pipelining the SET commands
+// on the same connection (all the commands are written at once and then
+// all the responses are read).
+// The status for each key (0 if stored, -1 otherwise) is stored in 'statuses'.
+// Returns 0 if all the responses have been received, -1 otherwise
+// (in which case the connection can't be reused)
+int send_multi_to_peer(char *peer,
+                       void **keys,
+                       size_t *klens,
+                       void **values,
+                       size_t *vlens,
+                       int num_keys,
+                       uint32_t ttl,
+                       uint32_t cttl,
+                       int *statuses,
+                       int fd);
+
 // cas operation for a given key on a peer
 int cas_on_peer(char *peer,
                 void *key,
@@ -177,6 +248,23 @@ int stats_from_peer(char *peer,
 int check_peer(char *peer,
                int fd);
 
+// retrieve the topology of the cluster from a peer (using the TOPOLOGY command).
+// If *version is not zero it's sent as the version already known by the caller.
+// Returns 0 if the topology didn't change, 1 if *version has been updated and
+// the comma-separated node lists (*migration_nodes is NULL if no migration is
+// in progress) have been returned as newly allocated strings, -1 on error
+int topology_from_peer(char *peer,
+                       uint32_t *version,
+                       char **nodes,
+                       char **migration_nodes,
+                       int fd);
+
+// subscribe to the invalidations pushed by a peer (using the SUBSCRIBE command)
+// NOTE: the connection can't be used for anything else afterwards, the peer
+//       will only send EVICT_MULTI messages on it (which must not be answered)
+int subscribe_to_peer(char *peer,
+                      int fd);
+
 // start migration
 int migrate_peer(char *peer,
                  void *msgdata,
@@ -188,14 +276,57 @@ int abort_migrate_peer(char *peer, int fd);
 
 
 // connect to a given peer and return the opened filedescriptor
+// NOTE: besides <address:port> strings, "unix:<path>" and "shm:<path>"
+//       addresses are accepted and a connection to the unix domain socket
+//       at <path> is opened
 int connect_to_peer(char *address_string, unsigned int timeout);
 
+// start connecting to a given peer without blocking and return the
+// filedescriptor (in non-blocking mode), the connection is established
+// once the filedescriptor becomes writable and SO_ERROR is 0
+int connect_to_peer_nonblocking(char *address_string);
+
+// open a shared memory channel with a peer listening on a unix domain socket
+// ("unix:<path>" or "shm:<path>" address), returns NULL on failure
+shm_channel_t *open_shm_channel(char *address_string, unsigned int timeout);
+
+// synchronously write a message to a shared memory channel
+// (blocking until the whole message fits into the ring)
+int write_message_shm(shm_channel_t *ch,
+                      unsigned char hdr,
+                      shardcache_record_t *records,
+                      int num_records,
+                      unsigned int timeout);
+
+// synchronously read a message from a shared memory channel (blocking)
+// returns the number of records read (at most expected_records) or -1 on error
+int read_message_shm(shm_channel_t *ch,
+                     fbuf_t **out,
+                     int expected_records,
+                     shardcache_hdr_t *hdr,
+                     unsigned int timeout);
+
 // retrieve the index of keys stored in a given peer
+// (or NULL if it couldn't be retrieved entirely)
 // NOTE: caller must use shardcache_free_index() to release memory used
 //       by the returned shardcache_storage_index_t pointer
 shardcache_storage_index_t *index_from_peer(char *peer,
                                             int fd);
 
+// called for each item of the index received from a peer,
+// the key is valid only until the callback returns.
+// Must return 0 to go ahead or -1 to stop receiving the index
+typedef int (*index_from_peer_cb)(void *key, size_t klen, size_t vlen, void *priv);
+
+// retrieve the index of keys stored in a given peer a chunk at a time
+// (so that the whole index is never held in memory), calling 'cb'
+// for each received item.
+// Returns 0 if the whole index has been received, -1 otherwise
+int index_from_peer_foreach(char *peer,
+                            int fd,
+                            index_from_peer_cb cb,
+                            void *priv);
+
 typedef int (*fetch_from_peer_async_cb)(char *peer,
                                         void *key,
                                         size_t klen,
@@ -215,6 +346,18 @@ int fetch_from_peer_async(char *peer,
                           int fd,
                           async_read_wrk_t **async_read_wrk_t);
 
+// same as fetch_from_peer_async() (always returning a worker) but the request
+// is not written to the socket, which might still be connecting
+// (see connect_to_peer_nonblocking()), the message is rather left in the
+// worker (wrk->output) and will be sent once the worker is added to an iomux
+int fetch_from_peer_async_deferred(char *peer,
+                                   void *key,
+                                   size_t klen,
+                                   fetch_from_peer_async_cb cb,
+                                   void *priv,
+                                   int fd,
+                                   async_read_wrk_t **wrk);
+
 
 #endif
 
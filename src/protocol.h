@@ -10,9 +10,23 @@
 #define SHARDCACHE_MSG_MAX_RECORD_LEN (1<<28) // 256MB
 
 // last byte holds the protocol version
+// NOTE: SHC_PROTOCOL_VERSION is the version used by default for outgoing
+//       messages, while any version up to SHC_PROTOCOL_VERSION_MAX is
+//       accepted (and used when responding to messages using it)
 #define SHC_PROTOCOL_VERSION 2
+#define SHC_PROTOCOL_VERSION_MAX 3
 #define SHC_MAGIC 0x73686300 | SHC_PROTOCOL_VERSION
 
+// flags byte following the header in protocol version 3
+#define SHC_FLAG_CRC        0x01 // a crc32 of the records' data follows the EOM
+#define SHC_FLAG_COMPRESSED 0x02 // at least one of the records is compressed
+
+// bit set in the (varint-encoded) record length when the record is compressed
+#define SHC_RECORD_COMPRESSED 0x01
+
+// max size of a varint-encoded 32bit integer
+#define SHC_VARINT_MAXLEN 5
+
 typedef enum {
     // data commands
     SHC_HDR_GET              = 0x01,
@@ -44,11 +58,18 @@ typedef enum {
     // administrative commands
     SHC_HDR_CHECK            = 0x31,
     SHC_HDR_STATS            = 0x32,
+    SHC_HDR_TOPOLOGY         = 0x33,
 
     // index-related commands
     SHC_HDR_GET_INDEX        = 0x41,
     SHC_HDR_INDEX_RESPONSE   = 0x42,
 
+    // transport commands
+    SHC_HDR_SHM_OPEN         = 0x51,
+
+    // notification commands
+    SHC_HDR_SUBSCRIBE        = 0x61,
+
     // no-op (for ping/health-check)
     SHC_HDR_NOOP             = 0x90,
 
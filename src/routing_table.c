@@ -0,0 +1,318 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <chash.h>
+#include <siphash.h>
+
+#include "routing_table.h"
+
+// all the nodes and clients must hash the keys the same way
+static unsigned char routing_table_hash_key[16] = {
+    's', 'h', 'a', 'r', 'd', 'c', 'a', 'c', 'h', 'e', '-', 'r', 'o', 'u', 't', 'e'
+};
+
+// marks the points shared by different nodes, chash orders them arbitrarily
+// so the keys falling on them are looked up in the continuum itself
+#define ROUTING_TABLE_TIE 0xFFFF
+
+struct _routing_table_s {
+    shardcache_routing_mode_t mode;
+    int num_nodes;
+    char **labels;
+    size_t *lens;
+    int self;
+    // the points of the chash continuum (sorted) and their owners (table mode)
+    uint32_t *points;
+    uint16_t *owners;
+    uint32_t num_points;
+    // the index of the first point in each bucket of the hash space (table mode)
+    uint32_t *buckets;
+    // only built if some points are shared by different nodes (table mode)
+    struct chash_t *chash;
+    // the node indices sorted by label (jump mode)
+    uint16_t *order;
+};
+
+typedef struct {
+    uint32_t point;
+    uint16_t owner;
+} routing_table_point_t;
+
+static int
+routing_table_index(routing_table_t *table, const char *label, size_t len)
+{
+    int i;
+    for (i = 0; i < table->num_nodes; i++) {
+        if (table->lens[i] == len && memcmp(table->labels[i], label, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// the hash used by libchash for both the points of the continuum and the keys
+// (the leveldb bloom filter hash, see also the python and java clients)
+static inline uint32_t
+routing_table_chash_hash(const unsigned char *b, size_t len)
+{
+    const uint32_t seed = 0xbc9f1d34;
+    const uint32_t m = 0xc6a4a793;
+    uint32_t h = seed ^ (uint32_t)len * m;
+
+    while (len >= 4) {
+        h += b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+        h *= m;
+        h ^= h >> 16;
+        b += 4;
+        len -= 4;
+    }
+
+    switch (len) {
+        case 3:
+            h += b[2] << 16;
+        case 2:
+            h += b[1] << 8;
+        case 1:
+            h += b[0];
+            h *= m;
+            h ^= h >> 24;
+    }
+    return h;
+}
+
+static int
+routing_table_point_cmp(const void *p1, const void *p2)
+{
+    const routing_table_point_t *a = (const routing_table_point_t *)p1;
+    const routing_table_point_t *b = (const routing_table_point_t *)p2;
+    if (a->point != b->point)
+        return a->point < b->point ? -1 : 1;
+    return (int)a->owner - (int)b->owner;
+}
+
+static int
+routing_table_build_buckets(routing_table_t *table)
+{
+    // the continuum is rebuilt as libchash does: each node owns the points
+    // hashed from "<replica><label>" and a key belongs to the first point
+    // greater than its own hash (wrapping around)
+    table->num_points = table->num_nodes * ROUTING_TABLE_CHASH_REPLICAS;
+    routing_table_point_t *points = malloc(sizeof(routing_table_point_t) * table->num_points);
+    table->points = malloc(sizeof(uint32_t) * table->num_points);
+    table->owners = malloc(sizeof(uint16_t) * table->num_points);
+    table->buckets = malloc(sizeof(uint32_t) * (ROUTING_TABLE_BUCKETS + 1));
+    if (!points || !table->points || !table->owners || !table->buckets) {
+        free(points);
+        return -1;
+    }
+
+    uint32_t n = 0;
+    int i, r;
+    for (i = 0; i < table->num_nodes; i++) {
+        for (r = 0; r < ROUTING_TABLE_CHASH_REPLICAS; r++) {
+            char name[32 + table->lens[i]];
+            int len = snprintf(name, sizeof(name), "%d", r);
+            memcpy(name + len, table->labels[i], table->lens[i]);
+            points[n].point = routing_table_chash_hash((unsigned char *)name, len + table->lens[i]);
+            points[n].owner = i;
+            n++;
+        }
+    }
+    qsort(points, table->num_points, sizeof(routing_table_point_t), routing_table_point_cmp);
+
+    int ties = 0;
+    for (n = 0; n < table->num_points; n++) {
+        table->points[n] = points[n].point;
+        table->owners[n] = points[n].owner;
+    }
+    for (n = 0; n < table->num_points; ) {
+        // the points sharing the same value (sorted by owner)
+        uint32_t last = n;
+        while (last + 1 < table->num_points && points[last + 1].point == points[n].point)
+            last++;
+        if (points[last].owner != points[n].owner) {
+            while (n <= last)
+                table->owners[n++] = ROUTING_TABLE_TIE;
+            ties++;
+        }
+        n = last + 1;
+    }
+    free(points);
+
+    // each bucket covers 1/64K of the hash space, so the lookup only
+    // searches among the (few) points falling in the bucket of the key
+    uint32_t bucket = 0;
+    for (n = 0; n < table->num_points; n++) {
+        while (bucket <= (table->points[n] >> 16))
+            table->buckets[bucket++] = n;
+    }
+    while (bucket <= ROUTING_TABLE_BUCKETS)
+        table->buckets[bucket++] = table->num_points;
+
+    if (ties) {
+        table->chash = chash_create((const char **)table->labels,
+                                    table->lens,
+                                    table->num_nodes,
+                                    ROUTING_TABLE_CHASH_REPLICAS);
+        if (!table->chash)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+routing_table_build_order(routing_table_t *table)
+{
+    table->order = malloc(sizeof(uint16_t) * table->num_nodes);
+    if (!table->order)
+        return -1;
+
+    // the same list of nodes might be configured in a different order
+    // on each node, the order of the jump buckets must not depend on it
+    int i;
+    for (i = 0; i < table->num_nodes; i++) {
+        int j = i;
+        while (j > 0 && strcmp(table->labels[table->order[j-1]], table->labels[i]) > 0) {
+            table->order[j] = table->order[j-1];
+            j--;
+        }
+        table->order[j] = i;
+    }
+    return 0;
+}
+
+routing_table_t *
+routing_table_create(shardcache_routing_mode_t mode,
+                     char **labels,
+                     int num_nodes,
+                     char *me)
+{
+    if (num_nodes < 1 || num_nodes > ROUTING_TABLE_MAX_NODES)
+        return NULL;
+
+    if (mode != SHARDCACHE_ROUTING_TABLE && mode != SHARDCACHE_ROUTING_JUMP)
+        return NULL;
+
+    routing_table_t *table = calloc(1, sizeof(routing_table_t));
+    if (!table)
+        return NULL;
+
+    table->mode = mode;
+    table->num_nodes = num_nodes;
+    table->self = -1;
+    table->labels = calloc(num_nodes, sizeof(char *));
+    table->lens = calloc(num_nodes, sizeof(size_t));
+    if (!table->labels || !table->lens) {
+        routing_table_destroy(table);
+        return NULL;
+    }
+
+    int i;
+    for (i = 0; i < num_nodes; i++) {
+        table->labels[i] = strdup(labels[i]);
+        table->lens[i] = strlen(labels[i]);
+        if (me && strcmp(labels[i], me) == 0)
+            table->self = i;
+    }
+
+    int rc = (mode == SHARDCACHE_ROUTING_TABLE)
+           ? routing_table_build_buckets(table)
+           : routing_table_build_order(table);
+
+    if (rc != 0) {
+        routing_table_destroy(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+void
+routing_table_destroy(routing_table_t *table)
+{
+    int i;
+    for (i = 0; table->labels && i < table->num_nodes; i++)
+        free(table->labels[i]);
+    free(table->labels);
+    free(table->lens);
+    free(table->points);
+    free(table->owners);
+    free(table->buckets);
+    if (table->chash)
+        chash_free(table->chash);
+    free(table->order);
+    free(table);
+}
+
+// Lamping and Veach, "A Fast, Minimal Memory, Consistent Hash Algorithm"
+static inline int
+routing_table_jump(uint64_t hash, int num_buckets)
+{
+    int64_t b = -1;
+    int64_t j = 0;
+    while (j < num_buckets) {
+        b = j;
+        hash = hash * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double)(1LL << 31) / (double)((hash >> 33) + 1));
+    }
+    return (int)b;
+}
+
+static inline int
+routing_table_lookup_buckets(routing_table_t *table, void *key, size_t klen)
+{
+    uint32_t hash = routing_table_chash_hash(key, klen);
+    uint32_t low = table->buckets[hash >> 16];
+    uint32_t high = table->buckets[(hash >> 16) + 1];
+
+    // the first point greater than the hash is either in the
+    // bucket of the key or the first one of the following buckets
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (table->points[mid] > hash)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+
+    if (low >= table->num_points)
+        low = 0;
+
+    int owner = table->owners[low];
+    if (owner == ROUTING_TABLE_TIE) {
+        const char *node_name = NULL;
+        size_t name_len = 0;
+        chash_lookup(table->chash, key, klen, &node_name, &name_len);
+        owner = node_name ? routing_table_index(table, node_name, name_len) : -1;
+    }
+    return owner;
+}
+
+int
+routing_table_lookup(routing_table_t *table, void *key, size_t klen)
+{
+    if (table->mode == SHARDCACHE_ROUTING_TABLE)
+        return routing_table_lookup_buckets(table, key, klen);
+
+    uint64_t hash = sip_hash24(routing_table_hash_key, key, klen);
+    return table->order[routing_table_jump(hash, table->num_nodes)];
+}
+
+char *
+routing_table_label(routing_table_t *table, int index, size_t *len)
+{
+    if (index < 0 || index >= table->num_nodes)
+        return NULL;
+    if (len)
+        *len = table->lens[index];
+    return table->labels[index];
+}
+
+int
+routing_table_self(routing_table_t *table)
+{
+    return table->self;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,81 @@
+/**
+ * @file routing_table.h
+ * @brief Prebuilt tables mapping keys to the index of their owner
+ *
+ * A routing table is built once for a given list of nodes (and the chash
+ * continuum built on it) and never modified afterwards, so lookups need
+ * neither locks nor string compares: the key is hashed and the index of
+ * the owner is read from the table.
+ *
+ * Two modes are supported (see shardcache_routing_mode_t):
+ *  - table: the chash continuum rebuilt as libchash does, split in 64K
+ *           buckets of the hash space so that a lookup only searches among
+ *           the few points falling in the bucket of the key. The keys are
+ *           assigned exactly as chash_lookup() does, so nodes and clients
+ *           using either mode agree on the owners
+ *  - jump:  jump consistent hashing on the nodes sorted by label, which
+ *           needs no table at all but moves keys optimally only when nodes
+ *           are added or removed at the end of the sorted list
+ *
+ * @note The jump mode assigns the keys differently than chash_lookup() does,
+ *       so all the nodes (and the clients routing the keys) must use it
+ */
+#ifndef SHARDCACHE_ROUTING_TABLE_H
+#define SHARDCACHE_ROUTING_TABLE_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "shardcache.h"
+
+//! number of buckets the hash space is split in (SHARDCACHE_ROUTING_TABLE mode)
+#define ROUTING_TABLE_BUCKETS 65536
+
+//! replicas of each node in the continuum (the same used by the nodes and the clients)
+#define ROUTING_TABLE_CHASH_REPLICAS 200
+
+//! max number of nodes which can be addressed by a routing table
+#define ROUTING_TABLE_MAX_NODES 65535
+
+typedef struct _routing_table_s routing_table_t;
+
+/**
+ * @brief Create a new routing table
+ * @param mode      SHARDCACHE_ROUTING_TABLE or SHARDCACHE_ROUTING_JUMP
+ * @param labels    The labels of the nodes, the indices returned by the lookups
+ *                  refer to this array
+ * @param num_nodes The number of labels
+ * @param me        If not NULL, the label of the local node
+ *                  (see routing_table_self())
+ * @return A newly initialized routing table, NULL on errors
+ */
+routing_table_t *routing_table_create(shardcache_routing_mode_t mode,
+                                      char **labels,
+                                      int num_nodes,
+                                      char *me);
+
+/**
+ * @brief Release all the resources used by a routing table
+ */
+void routing_table_destroy(routing_table_t *table);
+
+/**
+ * @brief Get the index (in the labels array provided at creation time)
+ *        of the node owning a key
+ */
+int routing_table_lookup(routing_table_t *table, void *key, size_t klen);
+
+/**
+ * @brief Get the label of the node at a given index
+ */
+char *routing_table_label(routing_table_t *table, int index, size_t *len);
+
+/**
+ * @brief Get the index of the local node, -1 if not part of the table
+ */
+int routing_table_self(routing_table_t *table);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
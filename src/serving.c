@@ -18,8 +18,10 @@
 
 #include "messaging.h"
 #include "connections.h"
+#include "shm_channel.h"
 #include "shardcache.h"
 #include "counters.h"
+#include "compression.h"
 
 #include "serving.h"
 
@@ -43,6 +45,9 @@ typedef struct {
 struct _shardcache_serving_s {
     shardcache_t *cache;
     int sock;
+    int lsock;          // unix domain socket (-1 if not listening on any)
+    char *lsock_path;
+    int lsock_added;    // lsock has been added to the mux by the io thread
     pthread_t io_thread;
     iomux_t *io_mux;
     int leave;
@@ -57,6 +62,19 @@ typedef struct _shardcache_connection_context_s shardcache_connection_context_t;
 
 #define SHARDCACHE_REQUEST_RECORDS_MAX 5
 
+// max number of index items sent in a single GET_INDEX response chunk
+#define SHARDCACHE_INDEX_CHUNK_SIZE_MAX (1<<16)
+
+// max size of the buffer reserved for a record when its first chunk arrives,
+// the size is announced by the peer so bigger records are rather grown
+// as the data actually arrives
+#define SHARDCACHE_RECORD_PREALLOC_MAX (1<<20)
+
+// max amount of data buffered for the response to a GET_MULTI command,
+// the values which don't fit are not sent (their status is SHC_RES_ERR)
+// and the client is expected to fetch them with a plain GET
+#define SHARDCACHE_GET_MULTI_MAX_SIZE (1<<26)
+
 typedef struct _shardcache_request_s {
     fbuf_t records[SHARDCACHE_REQUEST_RECORDS_MAX];
     int fd;
@@ -85,12 +103,24 @@ typedef struct {
             size_t klen;
         } single;
         struct {
+            // the distinct keys requested (duplicates share the same slot)
             void **keys;
             size_t *klens;
             int num_keys;
             void **values;
             size_t *vlens;
+            char *statuses;
+            char *complete;
             int num_values;
+            // maps each requested key to its slot
+            int *slots;
+            int num_requested;
+            // how many times each slot is copied in the response
+            int *copies;
+            // the size of the values buffered so far (as sent in the response)
+            size_t size;
+            hashtable_t *index;
+            pthread_mutex_t lock;
         } multi;
     };
 } shardcache_get_async_ctx_t;
@@ -112,6 +142,14 @@ struct _shardcache_connection_context_s {
     shardcache_worker_context_t *worker;
     int closed;
     struct timeval in_prune_since;
+    // set if the client asked to exchange messages through a shared memory
+    // channel instead of the socket (which is then used only to detect
+    // when the client goes away)
+    shm_channel_t *shm;
+    fbuf_t *shm_output; // output which didn't fit in the ring yet
+    // set if the client subscribed to the invalidations, the socket
+    // is then written only by the evictor thread
+    shardcache_subscriber_t *subscriber;
 };
 #pragma pack(pop)
 
@@ -122,8 +160,29 @@ async_read_handler(void *data, size_t len, int idx, size_t total_len, void *priv
         (shardcache_connection_context_t *)priv;
 
 
-    if (idx >= 0 && idx < SHARDCACHE_REQUEST_RECORDS_MAX)
-        fbuf_add_binary(&ctx->records[idx], data, len);
+    if (idx >= 0 && idx < SHARDCACHE_REQUEST_RECORDS_MAX && len) {
+        fbuf_t *record = &ctx->records[idx];
+        // from protocol version 2 the size of the whole record is known
+        // when the first data arrives, so the buffer can be allocated once
+        // and the data copied there directly from the input buffer
+        // (the buffer will then be handed over to the request without copying).
+        // The reservation is capped since the size comes from the peer
+        if (!fbuf_used(record) && total_len > len &&
+            async_read_context_protocol_version(ctx->reader_ctx) >= 2)
+        {
+            size_t size = total_len < SHARDCACHE_RECORD_PREALLOC_MAX
+                        ? total_len + 1
+                        : SHARDCACHE_RECORD_PREALLOC_MAX;
+            char *buf = malloc(size);
+            if (buf) {
+                char *old_buf = NULL;
+                fbuf_detach(record, &old_buf, NULL);
+                free(old_buf);
+                fbuf_attach(record, buf, size, 0);
+            }
+        }
+        fbuf_add_binary(record, data, len);
+    }
 
     // idx == -1 means that reading finished
     // idx == -2 means error
@@ -181,6 +240,12 @@ shardcache_connection_context_destroy(shardcache_connection_context_t *ctx)
         req = TAILQ_FIRST(&ctx->requests);
     }
     async_read_context_destroy(ctx->reader_ctx);
+    if (ctx->shm) {
+        shm_channel_destroy(ctx->shm);
+        fbuf_free(ctx->shm_output);
+    }
+    if (ctx->subscriber)
+        shardcache_subscriber_remove(ctx->subscriber);
     ATOMIC_DECREMENT(ctx->serv->num_connections);
     free(ctx);
 }
@@ -193,31 +258,6 @@ send_data(shardcache_request_t *req, fbuf_t *data)
     SPIN_UNLOCK(req->output_lock);
 }
 
-static void
-write_statuses(shardcache_request_t *req, char mode, int num_items, ...)
-{
-    fbuf_t out = FBUF_STATIC_INITIALIZER;
-
-    fbuf_t **items = malloc(sizeof(fbuf_t *) * num_items);
-    va_list arg;
-    va_start(arg, num_items);
-    int i;
-    for (i = 0; i < num_items; i++) {
-        int rc = va_arg(arg, int);
-        items[i] = fbuf_create(0);
-        char st = rc_to_status(rc, mode); 
-        fbuf_add_binary(items[i], &st, 1);
-    }
-    va_end(arg);
-
-    array_to_record(num_items, items, &out);
-
-    for (i = 0; i < num_items; i++)
-        fbuf_free(items[i]);
-
-    free(items);
-}
-
 static void
 write_status(shardcache_request_t *req, char mode, int rc)
 {
@@ -228,6 +268,22 @@ write_status(shardcache_request_t *req, char mode, int rc)
 
     char version = async_read_context_protocol_version(req->ctx->reader_ctx);
 
+    if (version >= 3) {
+        char status = rc_to_status(rc, mode);
+        shardcache_record_t record = { &status, 1 };
+        int no_data = (req->hdr == SHC_HDR_GET ||
+                       req->hdr == SHC_HDR_GET_ASYNC ||
+                       req->hdr == SHC_HDR_GET_OFFSET);
+        fbuf_t output = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+        if (build_message(SHC_HDR_RESPONSE, &record, no_data ? 0 : 1, &output, version) == 0)
+            send_data(req, &output);
+        else
+            ATOMIC_INCREMENT(req->error);
+        fbuf_destroy(&output);
+        ATOMIC_INCREMENT(req->done);
+        return;
+    }
+
     if (version < 2)
         out[1] = 1;
     else
@@ -287,7 +343,15 @@ send_async_data_response_preamble(shardcache_request_t *req, uint32_t total_size
 
     fbuf_add_binary(&output, (void *)&hdr, 1);
 
-    if (version > 1) {
+    if (version > 2) {
+        // NOTE: streamed responses are never compressed nor checksummed
+        //       since the data is sent as soon as it's available
+        unsigned char flags = 0;
+        fbuf_add_binary(&output, (char *)&flags, 1);
+        unsigned char vlen[SHC_VARINT_MAXLEN];
+        int vlen_size = varint_encode(total_size << 1, vlen);
+        fbuf_add_binary(&output, (char *)vlen, vlen_size);
+    } else if (version > 1) {
         uint32_t size = htonl(total_size);
         fbuf_add_binary(&output, (char *)&size, sizeof(uint32_t));
     }
@@ -323,7 +387,12 @@ send_async_data_response_epilogue(shardcache_request_t *req, char status)
 
     // read above about the third record in get/offset responses
     // introduced from protocol version 2
-    if (version > 1) {
+    if (version > 2) {
+        unsigned char status_size = 1 << 1; // varint-encoded size of an uncompressed record
+        fbuf_add_binary(&output, (void *)&status_size, 1);
+        fbuf_add_binary(&output, (void *)&status, 1);
+        fbuf_add_binary(&output, &eom, 1);
+    } else if (version > 1) {
         uint32_t status_size = htonl(1);
         fbuf_add_binary(&output, (void *)&status_size, sizeof(status_size));
         fbuf_add_binary(&output, (void *)&status, 1);
@@ -337,45 +406,110 @@ send_async_data_response_epilogue(shardcache_request_t *req, char status)
     return 0;
 }
 
-static int
-send_async_multi_data_response(shardcache_get_async_ctx_t *ctx)
+// the response to a GET_MULTI command contains two records,
+// the values (as an array, in the same order of the requested keys)
+// and one status byte for each of them
+static void
+send_async_multi_data_response(shardcache_request_t *req,
+                               int num_items,
+                               void **values,
+                               size_t *vlens,
+                               char *statuses)
 {
-    int i;
-    fbuf_t *items[ctx->multi.num_keys];
+    char version = async_read_context_protocol_version(req->ctx->reader_ctx);
+    fbuf_t array = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+    keys_to_record(num_items, values, vlens, &array);
 
-    for (i = 0; i < ctx->multi.num_keys; i++) {
-        items[i] = fbuf_create(0);
-        fbuf_attach(items[i], ctx->multi.values[i], ctx->multi.vlens[i], ctx->multi.vlens[i]);
-    }
+    shardcache_record_t records[2] = {
+        {
+            .v = fbuf_data(&array),
+            .l = fbuf_used(&array)
+        },
+        {
+            .v = statuses,
+            .l = num_items
+        }
+    };
 
-    fbuf_t out = FBUF_STATIC_INITIALIZER;
+    fbuf_t output = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+    if (build_message(SHC_HDR_RESPONSE, records, 2, &output, version) == 0)
+        send_data(req, &output);
+    else
+        ATOMIC_INCREMENT(req->error);
 
-    array_to_record(ctx->multi.num_keys, items, &out);
+    fbuf_destroy(&output);
+    fbuf_destroy(&array);
+    ATOMIC_INCREMENT(req->done);
+}
 
-    return 0;
+static void
+send_async_multi_data_error(shardcache_request_t *req, int num_items)
+{
+    void **values = calloc(num_items + 1, sizeof(void *));
+    size_t *vlens = calloc(num_items + 1, sizeof(size_t));
+    char *statuses = malloc(num_items + 1);
+    memset(statuses, SHC_RES_ERR, num_items + 1);
+    send_async_multi_data_response(req, num_items, values, vlens, statuses);
+    free(values);
+    free(vlens);
+    free(statuses);
 }
 
+// NOTE: takes ownership of the keys and klens arrays (as returned by record_to_array())
+static shardcache_get_async_ctx_t *
+get_async_multi_ctx_create(shardcache_request_t *req, void **keys, size_t *klens, int num_keys)
+{
+    shardcache_get_async_ctx_t *ctx = calloc(1, sizeof(shardcache_get_async_ctx_t));
+    ctx->req = req;
+    ctx->is_multi = 1;
+    ctx->multi.keys = keys;
+    ctx->multi.klens = klens;
+    ctx->multi.num_requested = num_keys;
+    ctx->multi.slots = malloc(sizeof(int) * num_keys);
+    ctx->multi.copies = calloc(num_keys, sizeof(int));
+    ctx->multi.index = ht_create(num_keys, 0, NULL);
+    MUTEX_INIT(ctx->multi.lock);
+
+    // the same key could be requested multiple times,
+    // it will be fetched once and its value copied in the response
+    int i;
+    for (i = 0; i < num_keys; i++) {
+        int slot = (int)(intptr_t)ht_get(ctx->multi.index, keys[i], klens[i], NULL);
+        if (slot) {
+            ctx->multi.slots[i] = slot - 1;
+            ctx->multi.copies[slot - 1]++;
+            free(keys[i]);
+            continue;
+        }
+        slot = ctx->multi.num_keys++;
+        keys[slot] = keys[i];
+        klens[slot] = klens[i];
+        ctx->multi.slots[i] = slot;
+        ctx->multi.copies[slot] = 1;
+        ht_set(ctx->multi.index, keys[slot], klens[slot], (void *)(intptr_t)(slot + 1), sizeof(int));
+    }
+
+    ctx->multi.values = calloc(ctx->multi.num_keys, sizeof(void *));
+    ctx->multi.vlens = calloc(ctx->multi.num_keys, sizeof(size_t));
+    ctx->multi.statuses = malloc(ctx->multi.num_keys);
+    memset(ctx->multi.statuses, SHC_RES_OK, ctx->multi.num_keys);
+    ctx->multi.complete = calloc(1, ctx->multi.num_keys);
+
+    return ctx;
+}
 
 static inline shardcache_get_async_ctx_t *
 get_async_ctx_create(shardcache_request_t *req, void **keys, size_t *klens, int num_keys)
 {
+    if (req->hdr == SHC_HDR_GET_MULTI)
+        return get_async_multi_ctx_create(req, keys, klens, num_keys);
+
     shardcache_get_async_ctx_t *ctx = malloc(sizeof(shardcache_get_async_ctx_t));
     ctx->req = req;
-
-    if (num_keys > 1) {
-        ctx->is_multi = 1;
-        ctx->multi.keys = (void **)keys;
-        ctx->multi.klens = klens;
-        ctx->multi.num_keys = num_keys;
-        ctx->multi.values = malloc(sizeof(void *) * num_keys);
-        ctx->multi.vlens = malloc(sizeof(size_t) * num_keys);
-        ctx->multi.num_values = 0;
-    } else {
-        ctx->is_multi = 0;
-        ctx->single.key = malloc(klens[0]);
-        memcpy(ctx->single.key, keys[0], klens[0]);
-        ctx->single.klen = klens[0];
-    }
+    ctx->is_multi = 0;
+    ctx->single.key = malloc(klens[0]);
+    memcpy(ctx->single.key, keys[0], klens[0]);
+    ctx->single.klen = klens[0];
     return ctx;
 }
 
@@ -396,12 +530,20 @@ get_async_ctx_destroy(shardcache_get_async_ctx_t *ctx)
         }
         free(ctx->multi.values);
         free(ctx->multi.vlens);
+        free(ctx->multi.statuses);
+        free(ctx->multi.complete);
+        free(ctx->multi.slots);
+        free(ctx->multi.copies);
+        ht_destroy(ctx->multi.index);
+        MUTEX_DESTROY(ctx->multi.lock);
     } else {
         free(ctx->single.key);
     }
     free(ctx);
 }
 
+// NOTE: the callback can be called concurrently for different keys
+//       (if some of them are still being loaded when requested)
 static int
 get_async_multi_data_handler(void *key,
                              size_t klen,
@@ -413,43 +555,78 @@ get_async_multi_data_handler(void *key,
 {
     shardcache_get_async_ctx_t *ctx = (shardcache_get_async_ctx_t *)priv;
 
-    shardcache_request_t *req = (shardcache_request_t *)ctx->req;
+    MUTEX_LOCK(ctx->multi.lock);
 
-    if (dlen == 0 && total_size == 0) {
-        if (!timestamp) { // Error
-            ATOMIC_INCREMENT(req->error);
-            get_async_ctx_destroy(ctx);
+    int slot = (int)(intptr_t)ht_get(ctx->multi.index, key, klen, NULL) - 1;
+    if (UNLIKELY(slot < 0 || ctx->multi.complete[slot])) {
+        MUTEX_UNLOCK(ctx->multi.lock);
+        return -1;
+    }
+
+    // the total size is known when the first chunk arrives, the value is
+    // dropped right away if it wouldn't fit in the response
+    size_t expected = (ctx->multi.vlens[slot] || total_size < dlen) ? dlen : total_size;
+    int copies = ctx->multi.copies[slot];
+
+    if (dlen && ctx->multi.statuses[slot] == SHC_RES_OK &&
+        ctx->multi.size + expected * copies > SHARDCACHE_GET_MULTI_MAX_SIZE)
+    {
+        SHC_DEBUG("Value of %.*s dropped from the GET_MULTI response (%zu bytes buffered)",
+                  klen, key, ctx->multi.size);
+        ctx->multi.size -= ctx->multi.vlens[slot] * copies;
+        free(ctx->multi.values[slot]);
+        ctx->multi.values[slot] = NULL;
+        ctx->multi.vlens[slot] = 0;
+        ctx->multi.statuses[slot] = SHC_RES_ERR;
+    }
+
+    // nothing is buffered anymore for dropped values
+    if (dlen && ctx->multi.statuses[slot] == SHC_RES_OK) {
+        char *value = realloc(ctx->multi.values[slot], ctx->multi.vlens[slot] + dlen);
+        if (!value) {
+            MUTEX_UNLOCK(ctx->multi.lock);
             return -1;
         }
+        memcpy(value + ctx->multi.vlens[slot], data, dlen);
+        ctx->multi.values[slot] = value;
+        ctx->multi.vlens[slot] += dlen;
+        ctx->multi.size += dlen * copies;
+    }
 
+    // a timestamp is provided with the last chunk, an empty call without
+    // timestamp means either that the key doesn't exist or that an error
+    // occurred while part of the data had already been received
+    if (timestamp || (!dlen && !total_size)) {
+        if (!timestamp && ctx->multi.vlens[slot])
+            ctx->multi.statuses[slot] = SHC_RES_ERR;
+        ctx->multi.complete[slot] = 1;
         ctx->multi.num_values++;
-
-        if (ctx->multi.num_values == ctx->multi.num_keys) {
-            if (send_async_multi_data_response(ctx) != 0) {
-                ATOMIC_INCREMENT(req->error);
-                get_async_ctx_destroy(ctx);
-                return -1;
-            }
-            get_async_ctx_destroy(ctx);
-        }
     }
 
-    if (UNLIKELY(!dlen))
-        return 0;
+    int done = (ctx->multi.num_values == ctx->multi.num_keys);
 
-    int i;
-    for (i = 0; i < ctx->multi.num_keys; i++) {
-        if (klen == ctx->multi.klens[i] &&
-            memcmp(key, ctx->multi.keys[i], klen) == 0)
-        {
-            ctx->multi.values[i] = realloc(ctx->multi.values[i], ctx->multi.vlens[i] + dlen);
-            memcpy(ctx->multi.values[i] + ctx->multi.vlens[i], data, dlen);
-            ctx->multi.vlens[i] += dlen;
+    MUTEX_UNLOCK(ctx->multi.lock);
+
+    if (done) {
+        int num_items = ctx->multi.num_requested;
+        void **values = malloc(sizeof(void *) * num_items);
+        size_t *vlens = malloc(sizeof(size_t) * num_items);
+        char *statuses = malloc(num_items);
+        int i;
+        for (i = 0; i < num_items; i++) {
+            int slot = ctx->multi.slots[i];
+            values[i] = ctx->multi.values[slot];
+            vlens[i] = ctx->multi.vlens[slot];
+            statuses[i] = ctx->multi.statuses[slot];
         }
+        send_async_multi_data_response(ctx->req, num_items, values, vlens, statuses);
+        get_async_ctx_destroy(ctx);
+        free(values);
+        free(vlens);
+        free(statuses);
     }
 
     return 0;
-
 }
 
 static int
@@ -572,8 +749,13 @@ get_async_data_handler(void *key,
             // flush what we have left in the accumulator
             char rsep = SHARDCACHE_RSEP;
             fbuf_add_binary(&output, &rsep, 1);
-            uint32_t rsize = htonl(sizeof(uint32_t));
-            fbuf_add_binary(&output, (void *)&rsize, sizeof(rsize));
+            if (version > 2) {
+                unsigned char rsize = sizeof(uint32_t) << 1;
+                fbuf_add_binary(&output, (void *)&rsize, 1);
+            } else {
+                uint32_t rsize = htonl(sizeof(uint32_t));
+                fbuf_add_binary(&output, (void *)&rsize, sizeof(rsize));
+            }
             uint32_t rlen = htonl(total_size - req->copied);
             fbuf_add_binary(&output, (void *)&rlen, sizeof(rlen));
             send_data(req, &output);
@@ -668,18 +850,197 @@ shardcache_async_command_response(void *key, size_t klen, int64_t ret, void *pri
     }
 }
 
+static int shardcache_shm_input_handler(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv);
+
+static int
+shardcache_shm_open(shardcache_request_t *req)
+{
+    shardcache_connection_context_t *ctx = req->ctx;
+
+    // a shared memory channel can be offered only to local clients
+    // and only if there are no other responses queued on the socket
+    struct sockaddr_storage saddr;
+    socklen_t addr_len = sizeof(saddr);
+    if (ctx->shm || ctx->num_requests > 1 ||
+        getsockname(ctx->fd, (struct sockaddr *)&saddr, &addr_len) != 0 ||
+        saddr.ss_family != AF_UNIX)
+    {
+        SHC_WARNING("Refusing to open a shm channel on fd %d", ctx->fd);
+        return -1;
+    }
+
+    shm_channel_t *shm = shm_channel_create(SHM_CHANNEL_RING_SIZE_DEFAULT);
+    if (!shm)
+        return -1;
+
+    iomux_callbacks_t shm_callbacks = {
+        .mux_connection = NULL,
+        .mux_input = shardcache_shm_input_handler,
+        .mux_output = NULL,
+        .mux_eof = NULL,
+        .priv = ctx
+    };
+
+    // NOTE: the file descriptors are sent right away, attached to a NOOP byte,
+    //       while the actual response will follow through the usual output path
+    if (shm_channel_send(shm, ctx->fd) != 0 ||
+        !iomux_add(ctx->worker->iomux, shm_channel_fd(shm), &shm_callbacks))
+    {
+        SHC_WARNING("Can't setup the shm channel on fd %d: %s", ctx->fd, strerror(errno));
+        shm_channel_destroy(shm);
+        return -1;
+    }
+
+    ctx->shm = shm;
+    ctx->shm_output = fbuf_create(FBUF_MAXLEN_NONE);
+
+    return 0;
+}
+
+// hand the connection over to the evictor thread, which will push there
+// the invalidations. The ack is queued there as well, so that nothing can
+// be written out of order on the socket, and the request completes without output
+static int
+shardcache_subscribe(shardcache_request_t *req)
+{
+    shardcache_connection_context_t *ctx = req->ctx;
+
+    if (ctx->subscriber || ctx->shm || ctx->num_requests > 1) {
+        SHC_WARNING("Refusing to subscribe fd %d to the invalidations", ctx->fd);
+        return -1;
+    }
+
+    char status = SHC_RES_OK;
+    shardcache_record_t record = { &status, 1 };
+    fbuf_t ack = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+    int rc = build_message(SHC_HDR_RESPONSE, &record, 1, &ack,
+                           async_read_context_protocol_version(ctx->reader_ctx));
+    if (rc == 0) {
+        ctx->subscriber = shardcache_subscriber_add(ctx->serv->cache, ctx->fd, &ack);
+        if (!ctx->subscriber)
+            rc = -1;
+    }
+    fbuf_destroy(&ack);
+
+    if (rc == 0)
+        ATOMIC_INCREMENT(req->done);
+
+    return rc;
+}
+
+// join the node strings as expected in the NODES records of the TOPOLOGY response
+static void
+topology_nodes_encode(fbuf_t *buf, shardcache_node_t **nodes, int num_nodes)
+{
+    int i;
+    for (i = 0; i < num_nodes; i++) {
+        if (i > 0)
+            fbuf_add(buf, ",");
+        fbuf_add(buf, shardcache_node_get_string(nodes[i]));
+    }
+}
+
+// the version of the topology is a checksum of the node lists, so that all
+// the nodes report the same version for the same topology and the clients
+// can compare it with the one they already know without asking for the lists
+static int
+shardcache_topology(shardcache_request_t *req)
+{
+    shardcache_t *cache = req->ctx->serv->cache;
+    char version = async_read_context_protocol_version(req->ctx->reader_ctx);
+    fbuf_t nodes_buf = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+    fbuf_t migration_buf = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+    int num_nodes = 0;
+    shardcache_node_t **nodes = shardcache_get_nodes(cache, &num_nodes);
+    if (nodes) {
+        topology_nodes_encode(&nodes_buf, nodes, num_nodes);
+        shardcache_free_nodes(nodes, num_nodes);
+    }
+    nodes = shardcache_get_migration_nodes(cache, &num_nodes);
+    if (nodes) {
+        topology_nodes_encode(&migration_buf, nodes, num_nodes);
+        shardcache_free_nodes(nodes, num_nodes);
+    }
+
+    uint32_t topology_version = compression_crc32(0, fbuf_data(&nodes_buf), fbuf_used(&nodes_buf));
+    topology_version = compression_crc32(topology_version, "|", 1);
+    topology_version = compression_crc32(topology_version, fbuf_data(&migration_buf), fbuf_used(&migration_buf));
+    uint32_t nversion = htonl(topology_version);
+
+    // the node lists are omitted if the client already knows this version
+    if (fbuf_used(&req->records[0]) == sizeof(uint32_t) &&
+        memcmp(fbuf_data(&req->records[0]), &nversion, sizeof(uint32_t)) == 0)
+    {
+        fbuf_clear(&nodes_buf);
+        fbuf_clear(&migration_buf);
+    }
+
+    shardcache_record_t records[3] = {
+        { &nversion, sizeof(nversion) },
+        { fbuf_data(&nodes_buf), fbuf_used(&nodes_buf) },
+        { fbuf_data(&migration_buf), fbuf_used(&migration_buf) }
+    };
+
+    fbuf_t out = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+    int rc = build_message(SHC_HDR_RESPONSE, records, 3, &out, version);
+    if (rc == 0) {
+        send_data(req, &out);
+        ATOMIC_INCREMENT(req->done);
+    } else {
+        SHC_ERROR("Can't build the TOPOLOGY response");
+    }
+
+    fbuf_destroy(&out);
+    fbuf_destroy(&nodes_buf);
+    fbuf_destroy(&migration_buf);
+    return rc;
+}
+
+// encode the items of the index as expected in the INDEX record
+static void
+index_encode(fbuf_t *buf, shardcache_storage_index_item_t *items, size_t count)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        uint32_t klen = (uint32_t)items[i].klen;
+        uint32_t vlen = (uint32_t)items[i].vlen;
+        void *key = items[i].key;
+        uint32_t nklen = htonl(klen);
+        uint32_t nvlen = htonl(vlen);
+        fbuf_add_binary(buf, (char *)&nklen, sizeof(nklen));
+        fbuf_add_binary(buf, key, klen);
+        fbuf_add_binary(buf, (char *)&nvlen, sizeof(nvlen));
+    }
+    size_t zero = 0;
+    // no klen terminates the list
+    fbuf_add_binary(buf, (char *)&zero, sizeof(zero));
+}
+
 static void
 process_request(shardcache_request_t *req)
 {
 
     shardcache_t *cache = req->ctx->serv->cache; //XXX
 
+    // the responses (and the commands forwarded to the peers)
+    // use the current settings of the instance
+    shardcache_messaging_settings(cache);
+
     int rc = 0;
     void *key = fbuf_data(&req->records[0]);
     size_t klen = fbuf_used(&req->records[0]);
 
     char version = async_read_context_protocol_version(req->ctx->reader_ctx);
 
+    if (UNLIKELY(req->ctx->subscriber != NULL)) {
+        // nothing is expected from a subscribed client, close the connection
+        SHC_WARNING("Unexpected message %02x from the subscriber on fd %d",
+                    req->hdr, req->ctx->fd);
+        ATOMIC_INCREMENT(req->error);
+        ATOMIC_INCREMENT(req->done);
+        return;
+    }
+
     switch(req->hdr) {
         case SHC_HDR_GET:
         case SHC_HDR_GET_ASYNC:
@@ -748,14 +1109,18 @@ process_request(shardcache_request_t *req)
         }
         case SHC_HDR_EVICT_MULTI:
         {
-            uint32_t num_items = *((uint32_t *)key);
-            char *p = ((char *)key) + sizeof(uint32_t);
-            while (num_items-- > 0) {
-                uint32_t ks = *((uint32_t *)p);
-                p += ks;
-                shardcache_evict(cache, (void *)p, ks);
+            char **keys = NULL;
+            size_t *lens = NULL;
+            uint32_t num_keys = record_to_array(&req->records[0], &keys, &lens);
+            int i;
+            for (i = 0; i < num_keys; i++) {
+                if (lens[i])
+                    shardcache_evict(cache, keys[i], lens[i]);
+                free(keys[i]);
             }
-            write_status(req, WRITE_STATUS_MODE_SIMPLE, 0);
+            free(keys);
+            free(lens);
+            write_status(req, WRITE_STATUS_MODE_SIMPLE, (fbuf_used(&req->records[0]) && !num_keys) ? -1 : 0);
             break;
         }
         case SHC_HDR_CAS:
@@ -825,35 +1190,38 @@ process_request(shardcache_request_t *req)
             char **keys = NULL;
             size_t *lens = NULL;
             uint32_t num_keys = record_to_array(&req->records[0], &keys, &lens);
-            
+            if (!num_keys) {
+                SHC_WARNING("Bad record format for message GET_MULTI");
+                free(keys);
+                free(lens);
+                send_async_multi_data_error(req, 0);
+                break;
+            }
 
             shardcache_get_async_ctx_t *ctx = get_async_ctx_create(req, (void **)keys, lens, num_keys);
-                
+
+            // NOTE: the context (and the keys) might be already released
+            //       when shardcache_get_multi() returns
             int rc = shardcache_get_multi(cache,
-                                          (void **)keys,
-                                          lens,
-                                          num_keys,
+                                          ctx->multi.keys,
+                                          ctx->multi.klens,
+                                          ctx->multi.num_keys,
                                           get_async_multi_data_handler,
                                           ctx);
 
             if (rc != 0) {
                 get_async_ctx_destroy(ctx);
-                fbuf_t out = FBUF_STATIC_INITIALIZER;
-                array_to_record(0, NULL, &out);
-                write_statuses(req, WRITE_STATUS_MODE_SIMPLE, 1, -1);
+                send_async_multi_data_error(req, num_keys);
             }
             break;
         }
         case SHC_HDR_SET_MULTI:
-        {
-            // TODO - IMPLEMENT
-            write_statuses(req, WRITE_STATUS_MODE_SIMPLE, 1, -1);
-            break;
-        }
         case SHC_HDR_DELETE_MULTI:
         {
-            // TODO - IMPLEMENT
-            write_statuses(req, 1, WRITE_STATUS_MODE_SIMPLE, -1);
+            // not supported yet, the clients send the
+            // single SET/DELETE commands instead
+            SHC_WARNING("Unsupported command: 0x%02x", (unsigned char)req->hdr);
+            write_status(req, WRITE_STATUS_MODE_SIMPLE, -1);
             break;
         }
         case SHC_HDR_MIGRATION_BEGIN:
@@ -904,6 +1272,24 @@ process_request(shardcache_request_t *req)
             write_status(req, WRITE_STATUS_MODE_SIMPLE, 0);
             break;
         }
+        case SHC_HDR_TOPOLOGY:
+        {
+            if (shardcache_topology(req) != 0)
+                write_status(req, WRITE_STATUS_MODE_SIMPLE, -1);
+            break;
+        }
+        case SHC_HDR_SHM_OPEN:
+        {
+            rc = shardcache_shm_open(req);
+            write_status(req, WRITE_STATUS_MODE_SIMPLE, rc);
+            break;
+        }
+        case SHC_HDR_SUBSCRIBE:
+        {
+            if (shardcache_subscribe(req) != 0)
+                write_status(req, WRITE_STATUS_MODE_SIMPLE, -1);
+            break;
+        }
         case SHC_HDR_STATS:
         {
             fbuf_t buf = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
@@ -923,6 +1309,28 @@ process_request(shardcache_request_t *req)
                     fbuf_printf(&buf, "%s", shardcache_node_get_string(nodes[i]));
                 }
                 fbuf_add(&buf, "\r\n");
+
+                // the load measured on the addresses of the peers
+                // by the fetches of the keys they own
+                for (i = 0; i < num_nodes; i++) {
+                    char *label = shardcache_node_get_label(nodes[i]);
+                    if (strcmp(label, cache->me) == 0)
+                        continue;
+                    shardcache_node_t *peer = shardcache_node_select(cache, label);
+                    int n, num_addresses = peer ? shardcache_node_num_addresses(peer) : 0;
+                    for (n = 0; n < num_addresses; n++) {
+                        char *addr = shardcache_node_get_address_at_index(peer, n);
+                        shardcache_node_address_stats_t stats;
+                        if (shardcache_node_get_address_stats(peer, n, &stats) != 0)
+                            continue;
+                        fbuf_printf(&buf, "peer_%s_requests;%" PRIu64 "\r\n"
+                                          "peer_%s_errors;%" PRIu64 "\r\n"
+                                          "peer_%s_latency;%" PRIu64 "\r\n"
+                                          "peer_%s_outstanding;%d\r\n",
+                                          addr, stats.requests, addr, stats.errors,
+                                          addr, stats.latency, addr, stats.outstanding);
+                    }
+                }
                 shardcache_free_nodes(nodes, num_nodes);
             }
 
@@ -957,34 +1365,72 @@ process_request(shardcache_request_t *req)
         {
             fbuf_t buf = FBUF_STATIC_INITIALIZER;
             fbuf_t out = FBUF_STATIC_INITIALIZER;
-            SHC_DEBUG("Fetching index");
-            shardcache_storage_index_t *index = shardcache_get_index(cache);
-            SHC_DEBUG("Index got");
-            if (index) {
-                int i;
-                for (i = 0; i < index->size; i++) {
-                    uint32_t klen = (uint32_t)index->items[i].klen;
-                    uint32_t vlen = (uint32_t)index->items[i].vlen;
-                    void *key = index->items[i].key;
-                    uint32_t nklen = htonl(klen);
-                    uint32_t nvlen = htonl(vlen);
-                    fbuf_add_binary(&buf, (char *)&nklen, sizeof(nklen));
-                    fbuf_add_binary(&buf, key, klen);
-                    fbuf_add_binary(&buf, (char *)&nvlen, sizeof(nvlen));
+            int num_records = 1;
+            uint64_t cursor = 0;
+            uint32_t ncursor[2] = { 0, 0 };
+
+            if (fbuf_used(&req->records[0]) == sizeof(ncursor)) {
+                // the client wants the index a chunk at a time, starting from the provided cursor
+                // (and using, if provided, the requested chunk size)
+                uint32_t isize = SHARDCACHE_INDEX_CHUNK_SIZE;
+                memcpy(ncursor, fbuf_data(&req->records[0]), sizeof(ncursor));
+                cursor = ((uint64_t)ntohl(ncursor[0]) << 32) | ntohl(ncursor[1]);
+                if (fbuf_used(&req->records[1]) == sizeof(uint32_t)) {
+                    memcpy(&isize, fbuf_data(&req->records[1]), sizeof(uint32_t));
+                    isize = ntohl(isize);
+                    if (isize == 0 || isize > SHARDCACHE_INDEX_CHUNK_SIZE_MAX)
+                        isize = SHARDCACHE_INDEX_CHUNK_SIZE_MAX;
                 }
-                size_t zero = 0;
-                // no klen terminates the list
-                fbuf_add_binary(&buf, (char *)&zero, sizeof(zero));
 
-                shardcache_free_index(index);
+                SHC_DEBUG("Scanning index (cursor: %llu)", cursor);
+                shardcache_storage_index_item_t *items = calloc(isize, sizeof(shardcache_storage_index_item_t));
+                int count = shardcache_scan_index(cache, &cursor, items, isize);
+                if (count >= 0) {
+                    index_encode(&buf, items, count);
+                    int i;
+                    for (i = 0; i < count; i++)
+                        free(items[i].key);
+                    num_records = 2;
+                } else if (cursor == 0) {
+                    // the storage can't be scanned, send the whole index at once
+                    // (the client will know because there is no cursor in the response)
+                    shardcache_storage_index_t *index = shardcache_get_index(cache);
+                    if (index) {
+                        index_encode(&buf, index->items, index->size);
+                        shardcache_free_index(index);
+                    }
+                } else {
+                    free(items);
+                    write_status(req, WRITE_STATUS_MODE_SIMPLE, -1);
+                    SHC_ERROR("Can't scan the index (unexpected cursor %llu)", cursor);
+                    fbuf_destroy(&buf);
+                    break;
+                }
+                free(items);
+            } else {
+                SHC_DEBUG("Fetching index");
+                shardcache_storage_index_t *index = shardcache_get_index(cache);
+                SHC_DEBUG("Index got");
+                if (index) {
+                    index_encode(&buf, index->items, index->size);
+                    shardcache_free_index(index);
+                }
             }
 
             // chunkize the data and build an actual message
-            shardcache_record_t record = {
-                .v = fbuf_data(&buf),
-                .l = fbuf_used(&buf)
+            ncursor[0] = htonl(cursor >> 32);
+            ncursor[1] = htonl(cursor & 0xFFFFFFFF);
+            shardcache_record_t records[2] = {
+                {
+                    .v = fbuf_data(&buf),
+                    .l = fbuf_used(&buf)
+                },
+                {
+                    .v = ncursor,
+                    .l = sizeof(ncursor)
+                }
             };
-            if (build_message(SHC_HDR_INDEX_RESPONSE, &record, 1, &out, version) == 0)
+            if (build_message(SHC_HDR_INDEX_RESPONSE, records, num_records, &out, version) == 0)
             {
                 // destroy it early ... since we still need one more copy
                 SHC_DEBUG("Index response sent (%d)", fbuf_used(&out));
@@ -1109,15 +1555,44 @@ shardcache_check_context_state(iomux_t *iomux,
         // badly formatted message has been sent by the client
         struct sockaddr_in saddr;
         socklen_t addr_len = sizeof(struct sockaddr_in);
-        getpeername(fd, (struct sockaddr *)&saddr, &addr_len);
-        SHC_WARNING("Bad message %02x from %s (%d)",
-                    ctx->hdr, inet_ntoa(saddr.sin_addr), state);
+        memset(&saddr, 0, sizeof(saddr));
+        getpeername(ctx->fd, (struct sockaddr *)&saddr, &addr_len);
+        SHC_WARNING("Bad message %02x from %s (%d)", ctx->hdr,
+                    saddr.sin_family == AF_INET ? inet_ntoa(saddr.sin_addr) : "local client",
+                    state);
         return -1;
     }
     return 0;
 }
 
 
+static int shardcache_shm_process_input(iomux_t *iomux, shardcache_connection_context_t *ctx);
+
+// copy as much output as possible into the shared memory ring,
+// what doesn't fit is kept aside and written at the next round
+static int
+shardcache_shm_send(shardcache_connection_context_t *ctx, char *data, int len)
+{
+    int pending = fbuf_used(ctx->shm_output);
+    if (pending) {
+        int wb = shm_channel_write(ctx->shm, fbuf_data(ctx->shm_output), pending);
+        if (wb == -1)
+            return -1;
+        fbuf_remove(ctx->shm_output, wb);
+        pending -= wb;
+    }
+
+    if (len) {
+        int wb = pending ? 0 : shm_channel_write(ctx->shm, data, len);
+        if (wb == -1)
+            return -1;
+        if (wb < len)
+            fbuf_add_binary(ctx->shm_output, data + wb, len - wb);
+    }
+
+    return 0;
+}
+
 static int
 shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len, void *priv)
 {
@@ -1126,14 +1601,32 @@ shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len,
 
     *len = 0;
 
+    // NOTE: when a shm channel is in use the output callback is
+    //       registered on its doorbell but the data goes to the ring
+    int use_shm = (ctx->shm && fd == shm_channel_fd(ctx->shm));
+
+    if (use_shm && fbuf_used(ctx->shm_output)) {
+        if (shardcache_shm_send(ctx, NULL, 0) != 0) {
+            iomux_close(iomux, ctx->fd);
+            return IOMUX_OUTPUT_MODE_NONE;
+        }
+        // the doorbell is always writable, so while the ring is full
+        // the output callback is dropped and registered again by the
+        // input handler once the client has freed some space
+        if (fbuf_used(ctx->shm_output) && !shm_channel_arm_write(ctx->shm)) {
+            iomux_unset_output_callback(iomux, fd);
+            return IOMUX_OUTPUT_MODE_NONE;
+        }
+    }
+
     shardcache_request_t *req = TAILQ_FIRST(&ctx->requests);
 
     if (req) {
         if (UNLIKELY(ATOMIC_READ(req->error))) {
             // abort the request and close the connection
             // if there was an error while fetching a remote object
-            if (!iomux_close(iomux, fd)) {
-                close(fd);
+            if (!iomux_close(iomux, ctx->fd)) {
+                close(ctx->fd);
                 shardcache_connection_context_destroy(ctx);
             }
             return IOMUX_OUTPUT_MODE_NONE;
@@ -1141,11 +1634,25 @@ shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len,
 
         int done = ATOMIC_READ(req->done);
 
+        char *output = NULL;
+        int output_len = 0;
         SPIN_LOCK(req->output_lock);
         if (fbuf_used(&req->output))
-            *len = fbuf_detach(&req->output, (char **)out, NULL);
+            output_len = fbuf_detach(&req->output, &output, NULL);
         SPIN_UNLOCK(req->output_lock);
 
+        if (use_shm) {
+            int rc = shardcache_shm_send(ctx, output, output_len);
+            free(output);
+            if (rc != 0) {
+                iomux_close(iomux, ctx->fd);
+                return IOMUX_OUTPUT_MODE_NONE;
+            }
+        } else {
+            *out = (unsigned char *)output;
+            *len = output_len;
+        }
+
         if (done) {
             TAILQ_REMOVE(&ctx->requests, req, next);
             ctx->num_requests--;
@@ -1153,12 +1660,17 @@ shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len,
             // if we have pending input data this is time
             // to process it and move to the next request
             int state = async_read_context_update(ctx->reader_ctx);
-            if (shardcache_check_context_state(iomux, fd, ctx, state) != 0) {
-                iomux_close(iomux, fd);
-                *len = 0;
+            if (shardcache_check_context_state(iomux, fd, ctx, state) != 0 ||
+                (use_shm && shardcache_shm_process_input(iomux, ctx) != 0))
+            {
+                iomux_close(iomux, ctx->fd);
+                if (*len) {
+                    free(*out);
+                    *len = 0;
+                }
             }
         }
-    } else {
+    } else if (!use_shm || !fbuf_used(ctx->shm_output)) {
         iomux_unset_output_callback(iomux, fd);
     }
     return IOMUX_OUTPUT_MODE_FREE;
@@ -1196,6 +1708,72 @@ shardcache_input_handler(iomux_t *iomux,
     return processed;
 }
 
+static int
+shardcache_shm_process_input(iomux_t *iomux, shardcache_connection_context_t *ctx)
+{
+    int fd = shm_channel_fd(ctx->shm);
+
+    for (;;) {
+        while (ctx->num_requests <= ctx->serv->cache->serving_look_ahead) {
+            void *data = NULL;
+            int len = shm_channel_peek(ctx->shm, &data);
+            if (len == -1)
+                return -1;
+            if (len == 0)
+                break;
+
+            int processed = 0;
+            async_read_context_state_t state =
+                async_read_context_input_data(ctx->reader_ctx, data, len, &processed);
+            shm_channel_consume(ctx->shm, processed);
+
+            if (shardcache_check_context_state(iomux, fd, ctx, state) != 0)
+                return -1;
+
+            // the reader can't accept more data until the
+            // current request has been served (the output handler
+            // will call us again once done)
+            if (!processed && state != SHC_STATE_READING_DONE)
+                return 0;
+        }
+
+        if (ctx->num_requests > ctx->serv->cache->serving_look_ahead) {
+            SHC_DEBUG2("Too many pipelined requests, waiting");
+            return 0;
+        }
+
+        // the ring is empty, ask the client to ring the doorbell
+        // when writing new data (unless it did in the meanwhile)
+        if (!shm_channel_arm(ctx->shm))
+            return 0;
+    }
+}
+
+static int
+shardcache_shm_input_handler(iomux_t *iomux,
+                             int fd,
+                             unsigned char *data,
+                             int len,
+                             void *priv)
+{
+    shardcache_connection_context_t *ctx =
+        (shardcache_connection_context_t *)priv;
+
+    // the data read from the doorbell is meaningless,
+    // the requests must be read from the ring
+    if (shardcache_shm_process_input(iomux, ctx) != 0) {
+        iomux_close(iomux, ctx->fd);
+        return len;
+    }
+
+    // the doorbell might have been rung because the client freed
+    // some space in the ring, resume the output if it was waiting for it
+    if (fbuf_used(ctx->shm_output) || TAILQ_FIRST(&ctx->requests))
+        iomux_set_output_callback(iomux, fd, shardcache_output_handler);
+
+    return len;
+}
+
 static void
 shardcache_eof_handler(iomux_t *iomux, int fd, void *priv)
 {
@@ -1204,6 +1782,9 @@ shardcache_eof_handler(iomux_t *iomux, int fd, void *priv)
 
     close(fd);
 
+    if (ctx && ctx->shm)
+        iomux_remove(iomux, shm_channel_fd(ctx->shm));
+
     if (ctx) {
         if (TAILQ_FIRST(&ctx->requests) != NULL) {
             ctx->closed = 1;
@@ -1354,6 +1935,19 @@ serve_cache(void *priv)
     iomux_listen(serv->io_mux, serv->sock);
 
     while (!ATOMIC_READ(serv->leave)) {
+        // the unix domain socket can be opened at any time,
+        // but only this thread can add it to the mux
+        int lsock = ATOMIC_READ(serv->lsock);
+        if (lsock >= 0 && !serv->lsock_added) {
+            if (iomux_add(serv->io_mux, lsock, &connection_callbacks)) {
+                iomux_listen(serv->io_mux, lsock);
+                SHC_NOTICE("Listening on unix socket %s", serv->lsock_path);
+            } else {
+                SHC_ERROR("Can't add the unix socket to the mux");
+            }
+            serv->lsock_added = 1;
+        }
+
         int timeout = ATOMIC_READ(serv->cache->iomux_run_timeout_high);
         struct timeval tv = { timeout/1e6, timeout%(int)1e6 };
         iomux_run(serv->io_mux, &tv);
@@ -1392,6 +1986,7 @@ start_serving(shardcache_t *cache, unsigned int num_workers)
     shardcache_serving_t *s = calloc(1, sizeof(shardcache_serving_t));
     s->cache = cache;
     s->num_workers = num_workers;
+    s->lsock = -1;
 
     // open the listening socket
     char *brkt = NULL;
@@ -1476,6 +2071,32 @@ destroy_serving_worker(shardcache_worker_context_t *wrk)
     free(wrk);
 }
 
+int
+serve_unix_socket(shardcache_serving_t *s, char *path)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    MUTEX_LOCK(lock);
+    if (ATOMIC_READ(s->lsock) >= 0) {
+        SHC_ERROR("Already listening on the unix socket %s", s->lsock_path);
+        MUTEX_UNLOCK(lock);
+        return -1;
+    }
+
+    int lsock = open_lsocket(path);
+    if (lsock == -1) {
+        SHC_ERROR("Can't open the unix socket %s : %s", path, strerror(errno));
+        MUTEX_UNLOCK(lock);
+        return -1;
+    }
+
+    s->lsock_path = strdup(path);
+    // the connections will be accepted as soon as the io thread notices the socket
+    ATOMIC_SET(s->lsock, lsock);
+
+    MUTEX_UNLOCK(lock);
+    return 0;
+}
+
 int
 configure_serving_workers(shardcache_serving_t *s, unsigned int num_workers)
 {
@@ -1525,6 +2146,13 @@ stop_serving(shardcache_serving_t *s)
     iomux_remove(s->io_mux, s->sock);
     close(s->sock);
 
+    if (s->lsock >= 0) {
+        iomux_remove(s->io_mux, s->lsock);
+        close(s->lsock);
+        unlink(s->lsock_path);
+        free(s->lsock_path);
+    }
+
     // now the workers
     SHC_NOTICE("Collecting worker threads (might have to wait until i/o is finished)");
     clear_workers_list(s->workers);
@@ -11,6 +11,10 @@ shardcache_serving_t *start_serving(shardcache_t *cache, unsigned int num_worker
 
 int configure_serving_workers(shardcache_serving_t *s, unsigned int num_workers);
 
+// accept connections on a unix domain socket as well
+// (clients connected this way can also ask to use a shared memory channel)
+int serve_unix_socket(shardcache_serving_t *s, char *path);
+
 void stop_serving(shardcache_serving_t *s);
 
 #endif
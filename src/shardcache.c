@@ -9,6 +9,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -36,6 +37,43 @@ const char *LIBSHARDCACHE_BUILD_INFO = X_STRINGIFY(BUILD_INFO);
 extern int shardcache_log_initialized;
 extern unsigned int shardcache_loglevel;
 
+static const char *shardcache_storage_batch_histogram_labels[STORAGE_IO_BATCH_HISTOGRAM_SIZE] = {
+    "storage_batch_size_1", "storage_batch_size_2", "storage_batch_size_4", "storage_batch_size_8",
+    "storage_batch_size_16", "storage_batch_size_32", "storage_batch_size_64", "storage_batch_size_more"
+};
+
+
+// build the routing table for a list of nodes (NULL in the chash mode)
+static routing_table_t *
+shardcache_routing_table_create(shardcache_t *cache,
+                                int mode,
+                                shardcache_node_t **nodes,
+                                int num_nodes)
+{
+    if (mode == SHARDCACHE_ROUTING_CHASH)
+        return NULL;
+
+    char *labels[num_nodes];
+    int i;
+    for (i = 0; i < num_nodes; i++)
+        labels[i] = shardcache_node_get_label(nodes[i]);
+
+    routing_table_t *table = routing_table_create(mode, labels, num_nodes, cache->me);
+    if (!table)
+        SHC_ERROR("Can't create the routing table for %d nodes", num_nodes);
+    return table;
+}
+
+// release a table replaced while other threads might still be looking up keys
+// through it, must be called without holding the migration lock
+static void
+shardcache_routing_table_release(shardcache_t *cache, routing_table_t *table)
+{
+    if (!table)
+        return;
+    epoch_synchronize(cache->routing_epoch);
+    routing_table_destroy(table);
+}
 
 static int
 shardcache_test_ownership_internal(shardcache_t *cache,
@@ -54,12 +92,39 @@ shardcache_test_ownership_internal(shardcache_t *cache,
     if (cache->num_shards == 1)
         return 1;
 
+    // the first thread noticing that the migrator is done completes the
+    // migration (which takes the migration lock itself)
+    if (ATOMIC_READ(cache->migration) && ATOMIC_CAS(cache->migration_done, 1, 2))
+        shardcache_migration_end(cache);
+
+    int token = epoch_enter(cache->routing_epoch);
+    routing_table_t *table = migration ? ATOMIC_READ(cache->migration_routing)
+                                       : ATOMIC_READ(cache->routing);
+    if (table) {
+        int index = routing_table_lookup(table, key, klen);
+        char *label = routing_table_label(table, index, &name_len);
+        if (label) {
+            if (owner) {
+                if (len && name_len + 1 > *len)
+                    name_len = *len - 1;
+                memcpy(owner, label, name_len);
+                owner[name_len] = 0;
+            }
+            if (len)
+                *len = name_len;
+            int mine = (index == routing_table_self(table));
+            epoch_exit(cache->routing_epoch, token);
+            return mine;
+        }
+        // the table couldn't tell the owner (see routing_table_lookup()),
+        // the continuum has the final word
+        name_len = 0;
+    }
+    epoch_exit(cache->routing_epoch, token);
+
     SPIN_LOCK(cache->migration_lock);
 
     chash_t *continuum = NULL;
-    if (cache->migration && cache->migration_done) { 
-        shardcache_migration_end(cache);
-    } 
 
     if (migration) {
         if (cache->migration) {
@@ -110,6 +175,9 @@ shardcache_test_ownership(shardcache_t *cache,
 int
 shardcache_get_connection_for_peer(shardcache_t *cache, char *peer)
 {
+    // the messages sent on this connection use our own settings
+    shardcache_messaging_settings(cache);
+
     if (!ATOMIC_READ(cache->use_persistent_connections))
         return connect_to_peer(peer, cache->tcp_timeout);
 
@@ -132,6 +200,70 @@ shardcache_release_connection_for_peer(shardcache_t *cache, char *peer, int fd)
     connections_pool_add(cache->connections_pool, peer, fd);
 }
 
+static inline int
+shardcache_node_pool_id(shardcache_t *cache, shardcache_node_t *node, int index)
+{
+    int pool_id = shardcache_node_get_address_pool_id(node, index);
+    if (pool_id < 0) {
+        // resolved only once, the next requests to the same address
+        // will go straight to the pool without looking it up
+        char *peer = shardcache_node_get_address_at_index(node, index);
+        pool_id = connections_pool_peer_id(cache->connections_pool, peer);
+        if (pool_id >= 0)
+            shardcache_node_set_address_pool_id(node, index, pool_id);
+    }
+    return pool_id;
+}
+
+int
+shardcache_get_connection_for_node(shardcache_t *cache, shardcache_node_t *node, int index)
+{
+    char *peer = shardcache_node_get_address_at_index(node, index);
+    if (!peer)
+        return -1;
+
+    shardcache_messaging_settings(cache);
+
+    if (!ATOMIC_READ(cache->use_persistent_connections))
+        return connect_to_peer(peer, cache->tcp_timeout);
+
+    int pool_id = shardcache_node_pool_id(cache, node, index);
+    if (pool_id < 0) // too many peers, this one can't be pooled
+        return connections_pool_get(cache->connections_pool, peer);
+
+    return connections_pool_get_by_id(cache->connections_pool, pool_id);
+}
+
+void
+shardcache_release_connection_for_node(shardcache_t *cache, shardcache_node_t *node, int index, int fd)
+{
+    if (fd < 0)
+        return;
+
+    if (!ATOMIC_READ(cache->use_persistent_connections)) {
+        close(fd);
+        return;
+    }
+
+    connections_pool_add_by_id(cache->connections_pool, shardcache_node_pool_id(cache, node, index), fd);
+}
+
+int
+shardcache_reconnect_to_peer(shardcache_t *cache, char *peer, int fd)
+{
+    if (fd >= 0)
+        close(fd);
+
+    // the connection has been found broken while waiting for a response,
+    // replace it with a fresh one (and account for it in the pool counters)
+    if (ATOMIC_READ(cache->use_persistent_connections))
+        ATOMIC_INCREMENT(connections_pool_counters(cache->connections_pool)->reconnects);
+
+    // NOTE: callers are async reader callbacks which can't block,
+    //       so the connection might still be in progress when returned
+    return connect_to_peer_nonblocking(peer);
+}
+
 static void
 shardcache_do_nothing(int sig)
 {
@@ -145,9 +277,8 @@ typedef struct {
 
 typedef struct {
     shardcache_t *cache;
-    shardcache_key_t item;
     int is_volatile;
-} expire_key_ctx_t;
+} shardcache_expire_arg_t;
 
 typedef shardcache_key_t shardcache_evictor_job_t;
 
@@ -168,15 +299,492 @@ shardcache_evictor_job_t *create_evictor_job(void *key, size_t klen)
     return job;
 }
 
+// max number of keys extracted from the evictor queue at each iteration
+#define SHARDCACHE_EVICTOR_BATCH_MAX 4096
+// max number of keys sent in a single EVICT_MULTI message
+// (bigger batches are pipelined on the same connection)
+#define SHARDCACHE_EVICTOR_MESSAGE_MAX 512
+
+typedef struct {
+    shardcache_evictor_job_t **jobs;
+    int count;
+} shardcache_evictor_batch_t;
+
+static int
+evictor_collect_jobs(hashtable_t *table, void *value, size_t vlen, void *user)
+{
+    shardcache_evictor_batch_t *batch = (shardcache_evictor_batch_t *)user;
+    batch->jobs[batch->count++] = (shardcache_evictor_job_t *)value;
+    // remove the value from the table (and since there is no free value
+    // callback the job won't be released on removal) and stop the
+    // iteration once the batch is full
+    return (batch->count < SHARDCACHE_EVICTOR_BATCH_MAX) ? -1 : -2;
+}
+
+// seconds after which a peer found not supporting EVICT_MULTI
+// is probed again (it might have been upgraded meanwhile)
+#define SHARDCACHE_EVICTOR_LEGACY_RECHECK 60
+
+typedef enum {
+    EVICTOR_PEER_PENDING = 0,
+    EVICTOR_PEER_DONE,
+    EVICTOR_PEER_STALE,       // nothing has been received back
+    EVICTOR_PEER_UNSUPPORTED, // all the EVICT_MULTI commands have been rejected
+    EVICTOR_PEER_FAILED
+} shardcache_evictor_peer_status_t;
+
+typedef struct {
+    char *label;
+    char *addr;
+    int pool_id;
+    int fd;
+    int legacy;   // the peer is sent single EVICT commands
+    int fallback; // EVICT_MULTI has been dropped, single commands are being tried
+    int expected;
+    int received;
+    int errors;
+    shardcache_evictor_peer_status_t status;
+    async_read_ctx_t *reader;
+} shardcache_evictor_peer_t;
+
+typedef struct {
+    fbuf_t multi;   // EVICT_MULTI commands
+    int num_multi;
+    fbuf_t single;  // EVICT commands (built only if there are legacy peers)
+    int num_single;
+} shardcache_evictor_messages_t;
+
+static int
+evictor_read_response(void *data, size_t len, int idx, size_t total_len, void *priv)
+{
+    shardcache_evictor_peer_t *peer = (shardcache_evictor_peer_t *)priv;
+    if (idx == 0 && len == 1 && *((char *)data) != SHC_RES_OK)
+        peer->errors++;
+    return 0;
+}
+
+static int
+evictor_input_data(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    shardcache_evictor_peer_t *peer = (shardcache_evictor_peer_t *)priv;
+    int processed = 0;
+
+    // all the responses to the pipelined messages will arrive on the same connection
+    async_read_context_state_t state = async_read_context_input_data(peer->reader, data, len, &processed);
+    while (state == SHC_STATE_READING_DONE) {
+        if (++peer->received == peer->expected)
+            break;
+        state = async_read_context_update(peer->reader);
+    }
+
+    if (state == SHC_STATE_READING_ERR || peer->received == peer->expected)
+        iomux_close(iomux, fd);
+
+    return processed;
+}
+
+static void
+evictor_eof(iomux_t *iomux, int fd, void *priv)
+{
+    // the filedescriptor will be released (or put back in the pool)
+    // once all the peers have been served
+}
+
+// sends the messages to all the peers in the EVICTOR_PEER_PENDING status
+// and updates their status according to the responses
+static void
+evictor_send_batch(shardcache_t *cache,
+                   connections_pool_t *connections,
+                   shardcache_evictor_peer_t *peers,
+                   int num_peers,
+                   shardcache_evictor_messages_t *messages,
+                   int retry)
+{
+    iomux_t *iomux = iomux_create(0, 0);
+    if (!iomux)
+        return;
+
+    int tcp_timeout = ATOMIC_READ(cache->tcp_timeout);
+    struct timeval maxwait = { tcp_timeout / 1000, (tcp_timeout % 1000) * 1000 };
+
+    int i;
+    for (i = 0; i < num_peers; i++) {
+        shardcache_evictor_peer_t *peer = &peers[i];
+        if (peer->status != EVICTOR_PEER_PENDING)
+            continue;
+
+        peer->fd = -1;
+        if (retry)
+            peer->fd = connections_pool_reconnect(connections, peer->addr, -1);
+        else if (peer->pool_id >= 0)
+            peer->fd = connections_pool_get_by_id(connections, peer->pool_id);
+        else
+            peer->fd = connections_pool_get(connections, peer->addr);
+
+        if (peer->fd < 0) {
+            SHC_WARNING("Can't connect to peer %s to send eviction commands", peer->label);
+            peer->status = EVICTOR_PEER_FAILED;
+            continue;
+        }
+
+        fbuf_t *output = peer->legacy ? &messages->single : &messages->multi;
+        peer->expected = peer->legacy ? messages->num_single : messages->num_multi;
+        peer->received = 0;
+        peer->errors = 0;
+        peer->reader = async_read_context_create(evictor_read_response, peer);
+
+        iomux_callbacks_t cbs = {
+            .mux_input = evictor_input_data,
+            .mux_eof = evictor_eof,
+            .priv = peer
+        };
+
+        if (!peer->reader || !iomux_add(iomux, peer->fd, &cbs)) {
+            if (peer->reader)
+                async_read_context_destroy(peer->reader);
+            peer->reader = NULL;
+            close(peer->fd);
+            peer->fd = -1;
+            peer->status = EVICTOR_PEER_FAILED;
+            continue;
+        }
+
+        // all the messages are queued at once and flushed by the iomux
+        // concurrently on all the connections
+        iomux_write(iomux, peer->fd, (unsigned char *)fbuf_data(output), fbuf_used(output), IOMUX_OUTPUT_MODE_COPY);
+    }
+
+    struct timeval now, deadline;
+    gettimeofday(&now, NULL);
+    timeradd(&now, &maxwait, &deadline);
+    while (!iomux_isempty(iomux) && timercmp(&now, &deadline, <)) {
+        struct timeval tv = { 0, 100000 };
+        iomux_run(iomux, &tv);
+        gettimeofday(&now, NULL);
+    }
+
+    for (i = 0; i < num_peers; i++) {
+        shardcache_evictor_peer_t *peer = &peers[i];
+        if (peer->status != EVICTOR_PEER_PENDING)
+            continue;
+
+        iomux_remove(iomux, peer->fd);
+        if (!peer->legacy && peer->received == peer->expected && peer->errors == peer->received) {
+            // peers which don't know about EVICT_MULTI
+            // reply with an error to each one of them
+            peer->status = EVICTOR_PEER_UNSUPPORTED;
+            connections_pool_add_by_id(connections, peer->pool_id, peer->fd);
+        } else if (peer->received == peer->expected) {
+            peer->status = EVICTOR_PEER_DONE;
+            connections_pool_add_by_id(connections, peer->pool_id, peer->fd);
+            if (peer->errors)
+                SHC_WARNING("Peer %s returned errors for %d eviction commands",
+                            peer->label, peer->errors);
+        } else {
+            // if nothing has been received this was most likely a stale connection
+            // (or a peer dropping the connection on an unknown command)
+            peer->status = peer->received ? EVICTOR_PEER_FAILED : EVICTOR_PEER_STALE;
+            SHC_WARNING("Peer %s acknowledged only %d out of %d eviction commands",
+                        peer->label, peer->received, peer->expected);
+            close(peer->fd);
+        }
+        peer->fd = -1;
+        async_read_context_destroy(peer->reader);
+        peer->reader = NULL;
+    }
+
+    iomux_destroy(iomux);
+}
+
+static int
+evictor_peer_is_legacy(hashtable_t *legacy_peers, char *label)
+{
+    time_t *since = ht_get(legacy_peers, label, strlen(label), NULL);
+    if (!since)
+        return 0;
+
+    if (time(NULL) - *since >= SHARDCACHE_EVICTOR_LEGACY_RECHECK) {
+        // let's check again if the peer understands EVICT_MULTI
+        ht_delete(legacy_peers, label, strlen(label), NULL, NULL);
+        return 0;
+    }
+    return 1;
+}
+
+static void
+evictor_peer_set_legacy(hashtable_t *legacy_peers, char *label)
+{
+    time_t *since = malloc(sizeof(time_t));
+    if (!since)
+        return;
+    *since = time(NULL);
+    ht_delete(legacy_peers, label, strlen(label), NULL, NULL);
+    if (ht_set(legacy_peers, label, strlen(label), since, sizeof(time_t)) != 0)
+        free(since);
+    SHC_NOTICE("Peer %s doesn't support EVICT_MULTI, single EVICT commands will be used", label);
+}
+
+static int
+evictor_build_single_messages(shardcache_evictor_batch_t *batch, shardcache_evictor_messages_t *messages)
+{
+    if (messages->num_single)
+        return 0;
+
+    int i;
+    for (i = 0; i < batch->count; i++) {
+        shardcache_record_t record = {
+            .v = batch->jobs[i]->key,
+            .l = batch->jobs[i]->klen
+        };
+        if (build_message(SHC_HDR_EVICT, &record, 1, &messages->single, messaging_protocol_version()) != 0) {
+            SHC_ERROR("Can't build the EVICT message for key %.*s",
+                      (int)batch->jobs[i]->klen, (char *)batch->jobs[i]->key);
+            fbuf_clear(&messages->single);
+            return -1;
+        }
+    }
+    messages->num_single = batch->count;
+    return 0;
+}
+
+// eviction commands are idempotent so, if a peer failed without acknowledging
+// anything, the batch is sent again on a fresh connection (only to that peer).
+// Peers running an older version of the protocol, which don't know about
+// EVICT_MULTI, are detected (either they reject the commands or they drop
+// the connection) and are then sent single EVICT commands
+static void
+evictor_send_to_peers(shardcache_t *cache,
+                      connections_pool_t *connections,
+                      hashtable_t *legacy_peers,
+                      shardcache_evictor_batch_t *batch,
+                      shardcache_evictor_messages_t *messages)
+{
+    int num_peers = 0;
+    shardcache_evictor_peer_t peers[cache->num_shards];
+
+    int i;
+    for (i = 0; i < cache->num_shards; i++) {
+        char *label = shardcache_node_get_label(cache->shards[i]);
+        if (strcmp(label, cache->me) == 0)
+            continue;
+
+        shardcache_evictor_peer_t *peer = &peers[num_peers++];
+        memset(peer, 0, sizeof(shardcache_evictor_peer_t));
+        peer->label = label;
+        // the acknowledgements aren't tracked, so an address
+        // left aside isn't probed by the evictor
+        peer->addr = shardcache_node_get_address(cache->shards[i]);
+        peer->pool_id = connections_pool_peer_id(connections, peer->addr);
+        peer->fd = -1;
+        peer->legacy = evictor_peer_is_legacy(legacy_peers, label);
+        peer->status = EVICTOR_PEER_PENDING;
+        if (peer->legacy && evictor_build_single_messages(batch, messages) != 0)
+            peer->status = EVICTOR_PEER_FAILED;
+    }
+
+    int attempt;
+    for (attempt = 0; attempt < 3; attempt++) {
+        evictor_send_batch(cache, connections, peers, num_peers, messages, attempt > 0);
+
+        int pending = 0;
+        for (i = 0; i < num_peers; i++) {
+            shardcache_evictor_peer_t *peer = &peers[i];
+            if (peer->status == EVICTOR_PEER_DONE && peer->fallback) {
+                // single commands went through after EVICT_MULTI
+                // had been dropped twice
+                evictor_peer_set_legacy(legacy_peers, peer->label);
+            } else if (peer->status == EVICTOR_PEER_UNSUPPORTED ||
+                      (peer->status == EVICTOR_PEER_STALE && attempt == 1 && !peer->legacy))
+            {
+                if (peer->status == EVICTOR_PEER_UNSUPPORTED)
+                    evictor_peer_set_legacy(legacy_peers, peer->label);
+                else
+                    peer->fallback = 1;
+                peer->legacy = 1;
+                peer->status = evictor_build_single_messages(batch, messages) == 0
+                             ? EVICTOR_PEER_PENDING
+                             : EVICTOR_PEER_FAILED;
+            } else if (peer->status == EVICTOR_PEER_STALE && attempt == 0) {
+                peer->status = EVICTOR_PEER_PENDING;
+            }
+            if (peer->status == EVICTOR_PEER_PENDING)
+                pending++;
+        }
+        if (!pending)
+            break;
+    }
+}
+
+// max amount of notifications queued for a subscriber which isn't reading them,
+// a subscriber lagging behind this much is dropped (and, since the connection
+// is closed, it will know that it might have missed some invalidation)
+#define SHARDCACHE_SUBSCRIBER_OUTPUT_MAX (4<<20)
+
+struct _shardcache_subscriber_s {
+    int fd;        // duplicate of the client connection, written only by the evictor
+    int refcnt;    // one reference is held by the subscribers list and one
+                   // by the serving connection
+    int closed;    // set when the serving connection goes away
+    fbuf_t output; // data which couldn't be written yet
+    struct _shardcache_subscriber_s *next;
+};
+
+static void
+shardcache_subscriber_release(shardcache_subscriber_t *sub)
+{
+    if (ATOMIC_DECREASE(sub->refcnt, 1) > 0)
+        return;
+    close(sub->fd);
+    fbuf_destroy(&sub->output);
+    free(sub);
+}
+
+shardcache_subscriber_t *
+shardcache_subscriber_add(shardcache_t *cache, int fd, fbuf_t *ack)
+{
+    // the notifications are pushed by the evictor thread
+    if (!cache->evictor_jobs)
+        return NULL;
+
+    shardcache_subscriber_t *sub = calloc(1, sizeof(shardcache_subscriber_t));
+    sub->fd = dup(fd);
+    if (sub->fd == -1) {
+        SHC_ERROR("Can't duplicate the subscriber fd %d: %s", fd, strerror(errno));
+        free(sub);
+        return NULL;
+    }
+    sub->refcnt = 2;
+    FBUF_STATIC_INITIALIZER_POINTER(&sub->output, FBUF_MAXLEN_NONE, 64, 1024, 512);
+    fbuf_concat(&sub->output, ack);
+
+    MUTEX_LOCK(cache->subscribers_lock);
+    sub->next = cache->subscribers;
+    cache->subscribers = sub;
+    MUTEX_UNLOCK(cache->subscribers_lock);
+
+    // wake up the evictor so that the ack is delivered right away
+    MUTEX_LOCK(cache->evictor_lock);
+    pthread_cond_signal(&cache->evictor_cond);
+    MUTEX_UNLOCK(cache->evictor_lock);
+
+    return sub;
+}
+
+void
+shardcache_subscriber_remove(shardcache_subscriber_t *sub)
+{
+    // the evictor will unlink it from the list at the next iteration
+    ATOMIC_SET(sub->closed, 1);
+    shardcache_subscriber_release(sub);
+}
+
+// write as much of the queued output as possible without blocking,
+// returns -1 if the subscriber must be dropped
 static int
-evict_key(hashtable_t *table, void *value, size_t vlen, void *user)
+evictor_flush_subscriber(shardcache_subscriber_t *sub)
+{
+    while (fbuf_used(&sub->output)) {
+        ssize_t wb = send(sub->fd, fbuf_data(&sub->output), fbuf_used(&sub->output), MSG_DONTWAIT);
+        if (wb > 0) {
+            fbuf_remove(&sub->output, wb);
+        } else if (wb == -1 && errno == EINTR) {
+            continue;
+        } else if (wb == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            return -1;
+        }
+    }
+    return (fbuf_used(&sub->output) > SHARDCACHE_SUBSCRIBER_OUTPUT_MAX) ? -1 : 0;
+}
+
+// queue the messages (if any) for all the subscribers and flush the pending output,
+// the subscribers which went away (or failed) are released
+static void
+evictor_notify_subscribers(shardcache_t *cache, fbuf_t *messages)
+{
+    MUTEX_LOCK(cache->subscribers_lock);
+    shardcache_subscriber_t *prev = NULL;
+    shardcache_subscriber_t *sub = cache->subscribers;
+    while (sub) {
+        shardcache_subscriber_t *next = sub->next;
+        int closed = ATOMIC_READ(sub->closed);
+        if (!closed) {
+            if (messages)
+                fbuf_add_binary(&sub->output, fbuf_data(messages), fbuf_used(messages));
+            if (evictor_flush_subscriber(sub) != 0) {
+                SHC_WARNING("Dropping the invalidations subscriber on fd %d", sub->fd);
+                // the serving worker will notice it and release the connection
+                shutdown(sub->fd, SHUT_RDWR);
+                closed = 1;
+            }
+        }
+        if (closed) {
+            if (prev)
+                prev->next = next;
+            else
+                cache->subscribers = next;
+            shardcache_subscriber_release(sub);
+        } else {
+            prev = sub;
+        }
+        sub = next;
+    }
+    MUTEX_UNLOCK(cache->subscribers_lock);
+}
+
+static void
+evictor_process_batch(shardcache_t *cache,
+                      connections_pool_t *connections,
+                      hashtable_t *legacy_peers,
+                      shardcache_evictor_batch_t *batch)
 {
-    shardcache_evictor_job_t **job = (shardcache_evictor_job_t **)user;
-    *job = (shardcache_evictor_job_t *)value;
-    // remove the value from the table and stop the iteration 
-    // and since there is no free value callback the job won't
-    // be released on removal 
-    return -2;
+    shardcache_messaging_settings(cache);
+
+    shardcache_evictor_messages_t messages = {
+        .multi = FBUF_STATIC_INITIALIZER,
+        .num_multi = 0,
+        .single = FBUF_STATIC_INITIALIZER,
+        .num_single = 0
+    };
+
+    int offset;
+    for (offset = 0; offset < batch->count; offset += SHARDCACHE_EVICTOR_MESSAGE_MAX) {
+        int num_keys = batch->count - offset;
+        if (num_keys > SHARDCACHE_EVICTOR_MESSAGE_MAX)
+            num_keys = SHARDCACHE_EVICTOR_MESSAGE_MAX;
+
+        void *keys[num_keys];
+        size_t klens[num_keys];
+        int i;
+        for (i = 0; i < num_keys; i++) {
+            keys[i] = batch->jobs[offset + i]->key;
+            klens[i] = batch->jobs[offset + i]->klen;
+        }
+
+        fbuf_t record = FBUF_STATIC_INITIALIZER;
+        keys_to_record(num_keys, keys, klens, &record);
+        shardcache_record_t msg_record = {
+            .v = fbuf_data(&record),
+            .l = fbuf_used(&record)
+        };
+        if (build_message(SHC_HDR_EVICT_MULTI, &msg_record, 1, &messages.multi, messaging_protocol_version()) == 0)
+            messages.num_multi++;
+        else
+            SHC_ERROR("Can't build the EVICT_MULTI message for %d keys", num_keys);
+        fbuf_destroy(&record);
+    }
+
+    if (messages.num_multi) {
+        if (cache->num_shards > 1)
+            evictor_send_to_peers(cache, connections, legacy_peers, batch, &messages);
+
+        // the same messages are pushed to the subscribed clients
+        evictor_notify_subscribers(cache, &messages.multi);
+    }
+
+    fbuf_destroy(&messages.multi);
+    fbuf_destroy(&messages.single);
 }
 
 static inline void
@@ -201,75 +809,45 @@ evictor(void *priv)
                                                               SHARDCACHE_CONNECTION_EXPIRE_DEFAULT,
                                                               1);
 
-    while (!ATOMIC_READ(cache->quit))
-    {
+    // peers not supporting EVICT_MULTI (label -> when they have been detected)
+    hashtable_t *legacy_peers = ht_create(16, 0, free);
 
-        // this will extract only the first value
-        shardcache_evictor_job_t *job = NULL;
-        ht_foreach_value(jobs, evict_key, &job);
-        if (job) {
+    shardcache_evictor_batch_t batch = {
+        .jobs = malloc(sizeof(shardcache_evictor_job_t *) * SHARDCACHE_EVICTOR_BATCH_MAX),
+        .count = 0
+    };
 
-            SHC_DEBUG2("Eviction job for key '%.*s' started", job->klen, job->key);
+    while (!ATOMIC_READ(cache->quit))
+    {
+        ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_EVICTOR_QUEUE].value, ht_count(jobs));
 
-            int i;
-            for (i = 0; i < cache->num_shards; i++) {
-                char *peer = shardcache_node_get_label(cache->shards[i]);
-                if (strcmp(peer, cache->me) != 0) {
-                    SHC_DEBUG3("Sending Eviction command to %s", peer);
-                    int rindex = random()%shardcache_node_num_addresses(cache->shards[i]);
-                    char *addr = shardcache_node_get_address_at_index(cache->shards[i], rindex);
-                    int fd = connections_pool_get(connections, addr);
-                    if (fd < 0)
-                        break;
+        // drain (up to SHARDCACHE_EVICTOR_BATCH_MAX) jobs from the queue
+        batch.count = 0;
+        ht_foreach_value(jobs, evictor_collect_jobs, &batch);
+        if (batch.count) {
+            SHC_DEBUG2("Eviction batch of %d keys started", batch.count);
 
-                    int retries = 0;
-                    for (;;) {
-                        int flags = fcntl(fd, F_GETFL, 0);
-                        if (flags == -1) {
-                            close(fd);
-                            fd = connections_pool_get(connections, addr);
-                            if (fd < 0)
-                                break;
-                            continue;
-                        }
+            ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_EVICTOR_BATCH_SIZE].value, batch.count);
+            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EVICTOR_BATCHES].value);
 
-                        flags |= O_NONBLOCK;
-                        fcntl(fd, F_SETFL, flags);
-
-                        int rb = 0;
-                        do {
-                            char discard[1<<16];
-                            rb = read(fd, &discard, sizeof(discard));
-                        } while (rb > 0);
-
-                        if (rb == 0 || (rb == -1 && errno != EINTR && errno != EAGAIN)) {
-                            close(fd);
-                            fd = connections_pool_get(connections, addr);
-                            if (fd < 0)
-                                break;
-                            if (retries++ < 5)
-                                continue;
-                        }
-                        flags &= ~O_NONBLOCK;
-                        fcntl(fd, F_SETFL, flags);
-                        break;
-                    }
+            // NOTE: reading the subscribers list without the lock is fine here,
+            //       at worst a subscription arrived right now will miss keys
+            //       changed before it was acknowledged
+            if (cache->num_shards > 1 || cache->subscribers)
+                evictor_process_batch(cache, connections, legacy_peers, &batch);
 
-                    int rc = evict_from_peer(addr, job->key, job->klen, fd, 0);
-                    if (rc == 0) {
-                        connections_pool_add(connections, addr, fd);
-                    } else {
-                        SHC_WARNING("evict_from_peer return %d for peer %s", rc, peer);
-                        close(fd);
-                    }
-                }
-            }
+            SHC_DEBUG2("Eviction batch of %d keys completed", batch.count);
 
-            SHC_DEBUG2("Eviction job for key '%.*s' completed", job->klen, job->key);
-            destroy_evictor_job(job);
+            int i;
+            for (i = 0; i < batch.count; i++)
+                destroy_evictor_job(batch.jobs[i]);
         }
 
+        // deliver the output still pending and release the gone subscribers
+        evictor_notify_subscribers(cache, NULL);
+
         if (!ht_count(jobs)) {
+            ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_EVICTOR_QUEUE].value, 0);
             // if we have no more jobs to handle let's sleep a bit
             struct timeval now;
             int rc = 0;
@@ -285,132 +863,194 @@ evictor(void *priv)
         }
         shardcache_update_size_counters(cache);
     }
+    free(batch.jobs);
+    ht_destroy(legacy_peers);
     connections_pool_destroy(connections);
     return NULL;
 }
 
-static void
-destroy_volatile(volatile_object_t *obj)
+volatile_buf_t *
+volatile_buf_create(void *data, size_t len)
 {
-    free(obj->data);
-    free(obj);
+    volatile_buf_t *buf = malloc(sizeof(volatile_buf_t) + len);
+    if (!buf)
+        return NULL;
+    buf->refcnt = 1;
+    buf->len = len;
+    if (len)
+        memcpy(buf->data, data, len);
+    return buf;
 }
 
-static void
-shardcache_expire_key_cb(iomux_t *iomux, void *priv)
+volatile_buf_t *
+volatile_buf_retain(volatile_buf_t *buf)
 {
-    expire_key_ctx_t *ctx = (expire_key_ctx_t *)priv;
-    void *ptr = NULL;
-    if (ctx->is_volatile) {
-        ht_delete(ctx->cache->volatile_timeouts, ctx->item.key, ctx->item.klen, &ptr, NULL);
-        if (!ptr)
-            return;
+    ATOMIC_INCREMENT(buf->refcnt);
+    return buf;
+}
 
-        free(ptr);
-        ht_delete(ctx->cache->volatile_storage, ctx->item.key, ctx->item.klen, &ptr, NULL);
-        if (ptr) {
-            volatile_object_t *prev = (volatile_object_t *)ptr;
-            ATOMIC_DECREASE(ctx->cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
-                            prev->dlen);
-            destroy_volatile(prev);
-        }
-    } else {
-        ht_delete(ctx->cache->cache_timeouts, ctx->item.key, ctx->item.klen, &ptr, NULL);
-        if (!ptr)
-            return;
-        free(ptr);
-    }
-    ATOMIC_INCREMENT(ctx->cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
-    arc_remove(ctx->cache->arc, (const void *)ctx->item.key, ctx->item.klen);
+void
+volatile_buf_release(volatile_buf_t *buf)
+{
+    if (buf && ATOMIC_DECREASE(buf->refcnt, 1) == 0)
+        free(buf);
 }
 
-typedef struct {
-    int cmd;
-#define SHARDACHE_EXPIRE_SCHEDULE 1
-#define SHARDACHE_EXPIRE_UNSCHEDULE 2
-    void *key;
-    size_t klen;
-    time_t expire;
-    int is_volatile;
-} shardcache_expire_job_t;
+// replace the value of a volatile item, the previous buffer is released
+// (but it's still valid for the cached objects which retained it)
+static inline void
+volatile_object_set_buf(volatile_object_t *obj, volatile_buf_t *buf)
+{
+    volatile_buf_release(obj->buf);
+    obj->buf = buf;
+    obj->data = buf ? buf->data : NULL;
+    obj->dlen = buf ? buf->len : 0;
+}
 
 static void
-shardcache_expire_context_destroy(expire_key_ctx_t *ctx)
+destroy_volatile(volatile_object_t *obj)
 {
-    free(ctx->item.key);
-    free(ctx);
+    volatile_buf_release(obj->buf);
+    free(obj);
 }
 
+static inline pthread_mutex_t *
+shardcache_volatile_store_key_lock(shardcache_t *cache, void *key, size_t klen)
+{
+    uint32_t hash = 5381;
+    size_t i;
+    for (i = 0; i < klen; i++)
+        hash = ((hash << 5) + hash) + ((unsigned char *)key)[i];
+    return &cache->volatile_store_locks[hash % SHARDCACHE_VOLATILE_STORE_LOCKS];
+}
+
+// lock the key to prevent concurrent updates of the volatile storage
+// (and the volatile store from being opened or closed meanwhile),
+// the returned lock must be passed to shardcache_volatile_store_unlock()
+static inline pthread_mutex_t *
+shardcache_volatile_store_lock(shardcache_t *cache, void *key, size_t klen)
+{
+    pthread_mutex_t *lock = shardcache_volatile_store_key_lock(cache, key, klen);
+    MUTEX_LOCK(*lock);
+    return lock;
+}
+
+static inline void
+shardcache_volatile_store_unlock(pthread_mutex_t *lock)
+{
+    if (lock)
+        MUTEX_UNLOCK(*lock);
+}
+
+// write the new value of a volatile item to the store (if enabled)
+// NOTE: must be called while holding the lock for the key
+static inline void
+shardcache_volatile_store_update(shardcache_t *cache,
+                                 void *key,
+                                 size_t klen,
+                                 volatile_object_t *item)
+{
+    if (!cache->volatile_store)
+        return;
+
+    volatile_store_loc_t loc = volatile_store_put(cache->volatile_store, key, klen,
+                                                  item->data, item->dlen, item->expire);
+    if (!loc)
+        SHC_WARNING("Can't write the volatile item %.*s to the store", (int)klen, (char *)key);
+
+    volatile_store_release(cache->volatile_store, item->loc);
+    item->loc = loc;
+}
+
+static void shardcache_commence_eviction(shardcache_t *cache, void *key, size_t klen);
+
+static void
+shardcache_expire_key_cb(void *key, size_t klen, void *priv)
+{
+    shardcache_expire_arg_t *arg = (shardcache_expire_arg_t *)priv;
+    shardcache_t *cache = arg->cache;
+    void *ptr = NULL;
+    if (arg->is_volatile) {
+        pthread_mutex_t *lock = shardcache_volatile_store_lock(cache, key, klen);
+        ht_delete(cache->volatile_storage, key, klen, &ptr, NULL);
+        // NOTE: there is no need for a deletion marker since
+        //       the record will be ignored once expired
+        if (ptr && cache->volatile_store)
+            volatile_store_release(cache->volatile_store, ((volatile_object_t *)ptr)->loc);
+        shardcache_volatile_store_unlock(lock);
+        if (ptr) {
+            volatile_object_t *prev = (volatile_object_t *)ptr;
+            ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
+                            prev->dlen);
+            destroy_volatile(prev);
+        }
+    }
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
+    arc_remove(cache->arc, (const void *)key, klen);
+
+    // the copies cached by the peers and by the subscribed clients
+    // must go away together with the expired volatile item
+    if (ptr)
+        shardcache_commence_eviction(cache, key, klen);
+}
+
+typedef struct {
+    int cmd;
+#define SHARDACHE_EXPIRE_SCHEDULE 1
+#define SHARDACHE_EXPIRE_UNSCHEDULE 2
+    void *key; // points right after the job structure (allocated together)
+    size_t klen;
+    time_t expire;
+    int is_volatile;
+} shardcache_expire_job_t;
+
+#define SHARDCACHE_EXPIRER_TICK      100   // (in millisecs) resolution of the expiration timers
+#define SHARDCACHE_EXPIRER_BATCH_MAX 65536 // max number of jobs handled before running the timers
+
 void *
 shardcache_expire_keys(void *priv)
 {
     shardcache_t *cache = (shardcache_t *)priv;
+    shardcache_expire_arg_t cache_arg = { cache, 0 };
+    shardcache_expire_arg_t volatile_arg = { cache, 1 };
+    time_t last_update = 0;
+
     while (!ATOMIC_READ(cache->quit))
     {
-        shardcache_expire_job_t *job = queue_pop_left(cache->expirer_queue);
-        while (job) {
-            if (job->cmd == SHARDACHE_EXPIRE_UNSCHEDULE) {
-                void *ptr = NULL;
-                hashtable_t *table = job->is_volatile ? cache->volatile_timeouts : cache->cache_timeouts;
-
-                ht_delete(table, job->key, job->klen, &ptr, NULL);
-                if (ptr) {
-                    iomux_timeout_id_t *tid = (iomux_timeout_id_t *)ptr;
-                    iomux_unschedule(cache->expirer_mux, *tid);
-                    free(tid);
-                } else {
-                    // TODO - Error messages ?
-                }
-                free(job->key);
-                free(job);
-                job = queue_pop_left(cache->expirer_queue);
-                continue;
-            }
+        ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_EXPIRER_BACKLOG].value, queue_count(cache->expirer_queue));
 
-            expire_key_ctx_t *ctx = calloc(1, sizeof(expire_key_ctx_t));
-            ctx->item.key = job->key;
-            ctx->item.klen = job->klen;
-            ctx->cache = cache;
-            ctx->is_volatile = job->is_volatile;
-            hashtable_t *table = job->is_volatile ? cache->volatile_timeouts : cache->cache_timeouts;
-            struct timeval timeout = { job->expire, (int)random()%(int)1e6 };
-            iomux_timeout_id_t *tid_ptr = NULL;
-            void *prev = NULL;
-            iomux_timeout_id_t tid = 0;
-            ht_delete(table, job->key, job->klen, &prev, NULL);
-
-            if (prev) {
-                tid_ptr = (iomux_timeout_id_t *)prev;
-                tid = iomux_reschedule(cache->expirer_mux,
-                                       *tid_ptr,
-                                       &timeout,
-                                       shardcache_expire_key_cb,
-                                       ctx,
-                                       (iomux_timeout_free_context_cb)shardcache_expire_context_destroy);
-                *tid_ptr = tid;
-            } else {
-                tid = iomux_schedule(cache->expirer_mux,
-                                     &timeout, shardcache_expire_key_cb,
-                                     ctx,
-                                     (iomux_timeout_free_context_cb)shardcache_expire_context_destroy);
-                tid_ptr = malloc(sizeof(iomux_timeout_id_t));
-                *tid_ptr = tid;
-            }
-            if (tid && tid_ptr) {
-                ht_set(table, job->key, job->klen, tid_ptr, sizeof(iomux_timeout_id_t));
-            } else {
-                free(tid_ptr);
-                shardcache_expire_context_destroy(ctx);
-                // TODO - Erro message
+        int num_jobs = 0;
+        shardcache_expire_job_t *job = NULL;
+        while (num_jobs++ < SHARDCACHE_EXPIRER_BATCH_MAX && (job = queue_pop_left(cache->expirer_queue))) {
+            timing_wheel_t *timers = job->is_volatile ? cache->volatile_timers : cache->cache_timers;
+            if (job->cmd == SHARDACHE_EXPIRE_UNSCHEDULE) {
+                // NOTE: it's fine if no timer was scheduled for the key
+                timing_wheel_cancel(timers, job->key, job->klen);
+            } else if (timing_wheel_schedule(timers, job->key, job->klen, (uint64_t)job->expire * 1000) != 0) {
+                SHC_ERROR("Can't schedule the expiration of key %.*s", (int)job->klen, (char *)job->key);
             }
-
             free(job);
-            job = queue_pop_left(cache->expirer_queue);
         }
 
-        struct timeval tv = { 1, 0 };
-        iomux_run(cache->expirer_mux, &tv);
-        shardcache_update_size_counters(cache);
+        // expire all the keys which are due (slot by slot)
+        uint64_t cache_lag = 0;
+        uint64_t volatile_lag = 0;
+        timing_wheel_run(cache->cache_timers, shardcache_expire_key_cb, &cache_arg, &cache_lag);
+        timing_wheel_run(cache->volatile_timers, shardcache_expire_key_cb, &volatile_arg, &volatile_lag);
+
+        ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_EXPIRER_LAG].value,
+                   cache_lag > volatile_lag ? cache_lag : volatile_lag);
+        ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_EXPIRER_TIMERS].value,
+                   timing_wheel_count(cache->cache_timers) + timing_wheel_count(cache->volatile_timers));
+
+        time_t now = time(NULL);
+        if (now != last_update) {
+            shardcache_update_size_counters(cache);
+            last_update = now;
+        }
+
+        if (!queue_count(cache->expirer_queue))
+            usleep(SHARDCACHE_EXPIRER_TICK * 1000);
     }
     return NULL;
 }
@@ -435,6 +1075,8 @@ shardcache_run_async(void *priv)
     queue_t *async_queue = arg->cache->async_context[arg->index % cache->num_async].queue;
     shardcache_thread_init(cache);
     while (!ATOMIC_READ(cache->async_quit)) {
+        // pick up the changes to the protocol settings
+        shardcache_messaging_settings(cache);
         int timeout = ATOMIC_READ(cache->iomux_run_timeout_low);
         struct timeval tv = { timeout/1e6, timeout%(int)1e6 };
         iomux_run(async_mux, &tv);
@@ -445,10 +1087,15 @@ shardcache_run_async(void *priv)
                      wrk->cbs.mux_eof(async_mux, wrk->fd, wrk->cbs.priv);
                  else
                      async_read_context_destroy(wrk->ctx);
+            } else if (wrk->output) {
+                // the request has been deferred until the connection is
+                // established, the iomux will write it as soon as possible
+                iomux_write(async_mux, wrk->fd, (unsigned char *)wrk->output, wrk->output_len, IOMUX_OUTPUT_MODE_COPY);
             }
             int tcp_timeout = global_tcp_timeout(-1);
             struct timeval maxwait = { tcp_timeout / 1000, (tcp_timeout % 1000) * 1000 };
             iomux_set_timeout(async_mux, wrk->fd, &maxwait);
+            free(wrk->output);
             free(wrk);
             wrk = queue_pop_left(async_queue);
         }
@@ -458,6 +1105,514 @@ shardcache_run_async(void *priv)
     return NULL;
 }
 
+static void
+shardcache_storage_io_counters(shardcache_t *cache,
+                               storage_io_pool_t *pool,
+                               storage_io_batcher_t *batcher,
+                               int add)
+{
+    if (!cache->counters)
+        return;
+
+    if (pool) {
+        storage_io_pool_counters_t *pool_counters = storage_io_pool_counters(pool);
+        if (add) {
+            shardcache_counter_add(cache->counters, "storage_io_queued", &pool_counters->queued);
+            shardcache_counter_add(cache->counters, "storage_io_running", &pool_counters->running);
+            shardcache_counter_add(cache->counters, "storage_io_rejected", &pool_counters->rejected);
+        } else {
+            shardcache_counter_remove(cache->counters, "storage_io_queued");
+            shardcache_counter_remove(cache->counters, "storage_io_running");
+            shardcache_counter_remove(cache->counters, "storage_io_rejected");
+        }
+    }
+
+    if (batcher) {
+        storage_io_batcher_counters_t *batcher_counters = storage_io_batcher_counters(batcher);
+        if (add) {
+            shardcache_counter_add(cache->counters, "storage_batch_pending", &batcher_counters->pending);
+            shardcache_counter_add(cache->counters, "storage_batches", &batcher_counters->batches);
+            shardcache_counter_add(cache->counters, "storage_batched_keys", &batcher_counters->items);
+            shardcache_counter_add(cache->counters, "storage_batch_rejected", &batcher_counters->rejected);
+        } else {
+            shardcache_counter_remove(cache->counters, "storage_batch_pending");
+            shardcache_counter_remove(cache->counters, "storage_batches");
+            shardcache_counter_remove(cache->counters, "storage_batched_keys");
+            shardcache_counter_remove(cache->counters, "storage_batch_rejected");
+        }
+        int i;
+        for (i = 0; i < STORAGE_IO_BATCH_HISTOGRAM_SIZE; i++) {
+            if (add)
+                shardcache_counter_add(cache->counters,
+                                       shardcache_storage_batch_histogram_labels[i],
+                                       &batcher_counters->histogram[i]);
+            else
+                shardcache_counter_remove(cache->counters, shardcache_storage_batch_histogram_labels[i]);
+        }
+    }
+}
+
+// (re)start the storage i/o threads (and the batcher) using the actual settings
+// of the instance. The old ones are stopped once replaced, completing the fetches
+// they still have queued, so it must not be called holding any key lock
+static int
+shardcache_storage_io_setup(shardcache_t *cache)
+{
+    storage_io_pool_t *pool = NULL;
+    storage_io_batcher_t *batcher = NULL;
+
+    // NOTE: the write lock is held while starting the new threads as well,
+    //       so concurrent calls can't replace each other's threads
+    pthread_rwlock_wrlock(&cache->storage_io_lock);
+
+    int num_threads = ATOMIC_READ(cache->storage_io_threads);
+    if (cache->use_persistent_storage && cache->storage.fetch &&
+        !cache->storage.fetch_async && num_threads > 0)
+    {
+        pool = storage_io_pool_create(num_threads,
+                                      SHARDCACHE_STORAGE_IO_QUEUE_SIZE,
+                                      cache->storage.thread_start,
+                                      cache->storage.thread_exit,
+                                      cache->storage.priv);
+        if (!pool) {
+            pthread_rwlock_unlock(&cache->storage_io_lock);
+            return -1;
+        }
+
+        int batch_size = ATOMIC_READ(cache->storage_batch_size);
+        if (cache->storage.fetch_multi && batch_size > 1) {
+            batcher = storage_io_batcher_create(batch_size,
+                                                ATOMIC_READ(cache->storage_batch_window),
+                                                pool,
+                                                arc_ops_fetch_batch,
+                                                cache);
+            if (!batcher) {
+                pthread_rwlock_unlock(&cache->storage_io_lock);
+                storage_io_pool_destroy(pool);
+                return -1;
+            }
+        }
+    }
+
+    storage_io_pool_t *old_pool = cache->storage_io;
+    storage_io_batcher_t *old_batcher = cache->storage_batcher;
+    shardcache_storage_io_counters(cache, old_pool, old_batcher, 0);
+    cache->storage_io = pool;
+    cache->storage_batcher = batcher;
+    shardcache_storage_io_counters(cache, pool, batcher, 1);
+
+    pthread_rwlock_unlock(&cache->storage_io_lock);
+
+    // the batcher flushes its pending items to the old pool
+    // which runs them before going away
+    if (old_batcher)
+        storage_io_batcher_destroy(old_batcher);
+    if (old_pool)
+        storage_io_pool_destroy(old_pool);
+
+    return 0;
+}
+
+// build the path of the directory used by this instance under 'base'
+static void
+shardcache_instance_path(shardcache_t *cache, char *base, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%s", base, cache->me);
+    // the node label might contain characters which can't be used in a filename
+    char *p;
+    for (p = path + strlen(base) + 1; *p; p++) {
+        if (*p == '/')
+            *p = '_';
+    }
+}
+
+static void
+shardcache_write_behind_counters(shardcache_t *cache, write_behind_t *wb, int add)
+{
+    if (!cache->counters || !wb)
+        return;
+
+    if (add) {
+        write_behind_counters_t *wb_counters = write_behind_counters(wb);
+        shardcache_counter_add(cache->counters, "write_behind_pending", &wb_counters->pending);
+        shardcache_counter_add(cache->counters, "write_behind_coalesced", &wb_counters->coalesced);
+        shardcache_counter_add(cache->counters, "write_behind_flushed", &wb_counters->flushed);
+        shardcache_counter_add(cache->counters, "write_behind_batches", &wb_counters->batches);
+        shardcache_counter_add(cache->counters, "write_behind_errors", &wb_counters->errors);
+        shardcache_counter_add(cache->counters, "write_behind_dropped", &wb_counters->dropped);
+        shardcache_counter_add(cache->counters, "write_behind_lag_ms", &wb_counters->lag);
+    } else {
+        shardcache_counter_remove(cache->counters, "write_behind_pending");
+        shardcache_counter_remove(cache->counters, "write_behind_coalesced");
+        shardcache_counter_remove(cache->counters, "write_behind_flushed");
+        shardcache_counter_remove(cache->counters, "write_behind_batches");
+        shardcache_counter_remove(cache->counters, "write_behind_errors");
+        shardcache_counter_remove(cache->counters, "write_behind_dropped");
+        shardcache_counter_remove(cache->counters, "write_behind_lag_ms");
+    }
+}
+
+int
+shardcache_write_behind(shardcache_t *cache, int num_threads, int max_pending, char *path)
+{
+    if (num_threads < 0 || max_pending < 0)
+        return -1;
+
+    if (!max_pending)
+        max_pending = SHARDCACHE_WRITE_BEHIND_MAX_PENDING_DEFAULT;
+
+    int rc = 0;
+
+    // NOTE: the write lock is held while draining the old queue, so that
+    //       nothing can queue updates (or bypass them) in the meanwhile
+    pthread_rwlock_wrlock(&cache->write_behind_lock);
+    write_behind_t *old_wb = cache->write_behind;
+    if (old_wb) {
+        shardcache_write_behind_counters(cache, old_wb, 0);
+        cache->write_behind = NULL;
+        write_behind_destroy(old_wb);
+    }
+
+    if (num_threads > 0 && cache->use_persistent_storage && cache->storage.store) {
+        char instance_path[PATH_MAX];
+        if (path)
+            shardcache_instance_path(cache, path, instance_path, sizeof(instance_path));
+        cache->write_behind = write_behind_create(&cache->storage,
+                                                  num_threads,
+                                                  max_pending,
+                                                  path ? instance_path : NULL);
+        if (cache->write_behind)
+            shardcache_write_behind_counters(cache, cache->write_behind, 1);
+        else
+            rc = -1;
+    }
+    pthread_rwlock_unlock(&cache->write_behind_lock);
+
+    return rc;
+}
+
+static inline write_behind_t *
+shardcache_write_behind_acquire(shardcache_t *cache)
+{
+    pthread_rwlock_rdlock(&cache->write_behind_lock);
+    return cache->write_behind;
+}
+
+static inline void
+shardcache_write_behind_release(shardcache_t *cache)
+{
+    pthread_rwlock_unlock(&cache->write_behind_lock);
+}
+
+typedef struct {
+    volatile_store_t *store;
+    void *value;
+    size_t vlen;
+    time_t expire;
+    volatile_store_loc_t loc;
+    int alive;
+} shardcache_volatile_replay_arg_t;
+
+static void *
+shardcache_volatile_replay_update_cb(void *ptr, size_t len, void *user)
+{
+    shardcache_volatile_replay_arg_t *arg = (shardcache_volatile_replay_arg_t *)user;
+    volatile_object_t *item = (volatile_object_t *)ptr;
+    volatile_store_t *store = arg->store;
+
+    // items not coming from the log have been set after the instance
+    // started, so they are newer than any record
+    if (!item->loc) {
+        if (arg->alive)
+            volatile_store_release(store, arg->loc);
+        return item;
+    }
+
+    if (item->loc > arg->loc) {
+        // we already found a newer record for the same key
+        if (arg->alive)
+            volatile_store_release(store, arg->loc);
+        return item;
+    }
+
+    // NOTE: items without data are placeholders for deletion markers or
+    //       expired records (which have been already released)
+    if (item->data)
+        volatile_store_release(store, item->loc);
+
+    volatile_object_set_buf(item, arg->alive ? volatile_buf_create(arg->value, arg->vlen) : NULL);
+    item->expire = arg->expire;
+    item->loc = arg->loc;
+
+    return item;
+}
+
+static void
+shardcache_volatile_replay_cb(volatile_store_t *store,
+                              void *key,
+                              size_t klen,
+                              void *value,
+                              size_t vlen,
+                              time_t expire,
+                              volatile_store_loc_t loc,
+                              void *priv)
+{
+    shardcache_t *cache = (shardcache_t *)priv;
+    shardcache_volatile_replay_arg_t arg = {
+        .store = store,
+        .value = value,
+        .vlen = vlen,
+        .expire = expire,
+        .loc = loc,
+        .alive = (value && (!expire || expire > time(NULL)))
+    };
+
+    // expired records are obsolete already (deletion markers are released by the store)
+    if (value && !arg.alive)
+        volatile_store_release(store, loc);
+
+    // records are replayed in parallel, so the newest one for each key
+    // (the one with the greatest location) is kept
+    for (;;) {
+        if (ht_get_deep_copy(cache->volatile_storage, key, klen, NULL,
+                             shardcache_volatile_replay_update_cb, &arg))
+        {
+            return;
+        }
+
+        volatile_object_t *obj = calloc(1, sizeof(volatile_object_t));
+        if (arg.alive)
+            volatile_object_set_buf(obj, volatile_buf_create(value, vlen));
+        obj->expire = expire;
+        obj->loc = loc;
+        if (ht_set_if_not_exists(cache->volatile_storage, key, klen, obj, sizeof(volatile_object_t)) == 0)
+            return;
+
+        // someone else added the key in the meanwhile
+        destroy_volatile(obj);
+    }
+}
+
+static int
+shardcache_volatile_replay_collect(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user)
+{
+    linked_list_t *to_delete = (linked_list_t *)user;
+    volatile_object_t *item = (volatile_object_t *)value;
+    if (item->loc && !item->data) {
+        shardcache_key_t *k = malloc(sizeof(shardcache_key_t) + klen);
+        k->key = k + 1;
+        k->klen = klen;
+        memcpy(k->key, key, klen);
+        list_push_value(to_delete, k);
+    }
+    return 1;
+}
+
+static int
+shardcache_volatile_replay_schedule(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user)
+{
+    shardcache_t *cache = (shardcache_t *)user;
+    volatile_object_t *item = (volatile_object_t *)value;
+    // the items set after the instance started are accounted already
+    if (!item->loc)
+        return 1;
+    ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, item->dlen);
+    if (item->expire) {
+        time_t now = time(NULL);
+        shardcache_schedule_expiration(cache, key, klen,
+                                       item->expire > now ? item->expire - now : 1, 1);
+    }
+    return 1;
+}
+
+typedef struct {
+    volatile_store_t *store;
+    void *key;
+    size_t klen;
+    volatile_store_loc_t old_loc;
+    int rc;
+} shardcache_volatile_relocate_arg_t;
+
+static void *
+shardcache_volatile_relocate_update_cb(void *ptr, size_t len, void *user)
+{
+    shardcache_volatile_relocate_arg_t *arg = (shardcache_volatile_relocate_arg_t *)user;
+    volatile_object_t *item = (volatile_object_t *)ptr;
+    if (item->loc == arg->old_loc && item->data) {
+        volatile_store_loc_t loc = volatile_store_put(arg->store, arg->key, arg->klen,
+                                                      item->data, item->dlen, item->expire);
+        if (loc) {
+            item->loc = loc;
+            arg->rc = 1;
+        } else {
+            arg->rc = -1;
+        }
+    }
+    return item;
+}
+
+static int
+shardcache_volatile_relocate_cb(volatile_store_t *store,
+                                void *key,
+                                size_t klen,
+                                void *value,
+                                size_t vlen,
+                                time_t expire,
+                                volatile_store_loc_t old_loc,
+                                void *priv)
+{
+    shardcache_t *cache = (shardcache_t *)priv;
+    shardcache_volatile_relocate_arg_t arg = {
+        .store = store,
+        .key = key,
+        .klen = klen,
+        .old_loc = old_loc,
+        .rc = 0
+    };
+
+    pthread_mutex_t *lock = shardcache_volatile_store_lock(cache, key, klen);
+    ht_get_deep_copy(cache->volatile_storage, key, klen, NULL,
+                     shardcache_volatile_relocate_update_cb, &arg);
+    shardcache_volatile_store_unlock(lock);
+
+    return arg.rc;
+}
+
+// write to the log the items set before the store was opened
+static int
+shardcache_volatile_store_persist(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user)
+{
+    volatile_store_t *store = (volatile_store_t *)user;
+    volatile_object_t *item = (volatile_object_t *)value;
+    if (!item->loc && item->data) {
+        item->loc = volatile_store_put(store, key, klen, item->data, item->dlen, item->expire);
+        if (!item->loc)
+            SHC_WARNING("Can't write the volatile item %.*s to the store", (int)klen, (char *)key);
+    }
+    return 1;
+}
+
+static int
+shardcache_volatile_store_forget(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user)
+{
+    ((volatile_object_t *)value)->loc = 0;
+    return 1;
+}
+
+// NOTE: opening or closing the store requires all the key locks,
+//       so it excludes any update of the volatile storage
+static inline void
+shardcache_volatile_store_lock_all(shardcache_t *cache)
+{
+    int i;
+    for (i = 0; i < SHARDCACHE_VOLATILE_STORE_LOCKS; i++)
+        MUTEX_LOCK(cache->volatile_store_locks[i]);
+}
+
+static inline void
+shardcache_volatile_store_unlock_all(shardcache_t *cache)
+{
+    int i;
+    for (i = SHARDCACHE_VOLATILE_STORE_LOCKS - 1; i >= 0; i--)
+        MUTEX_UNLOCK(cache->volatile_store_locks[i]);
+}
+
+static void
+shardcache_volatile_store_counters(shardcache_t *cache, volatile_store_t *store, int add)
+{
+    volatile_store_counters_t *counters = volatile_store_counters(store);
+    struct {
+        const char *name;
+        uint64_t *value;
+    } vstore_counters[] = {
+        { "vstore_segments", &counters->segments },
+        { "vstore_size", &counters->size },
+        { "vstore_dead", &counters->dead },
+        { "vstore_compactions", &counters->compactions },
+        { "vstore_replay_records", &counters->replay_records },
+        { "vstore_replay_ms", &counters->replay_time },
+        { "vstore_replay_rate", &counters->replay_rate }
+    };
+    int i;
+    for (i = 0; i < sizeof(vstore_counters) / sizeof(vstore_counters[0]); i++) {
+        if (add)
+            shardcache_counter_add(cache->counters, vstore_counters[i].name, vstore_counters[i].value);
+        else
+            shardcache_counter_remove(cache->counters, vstore_counters[i].name);
+    }
+}
+
+int
+shardcache_volatile_store(shardcache_t *cache, char *path, size_t segment_size)
+{
+    shardcache_volatile_store_lock_all(cache);
+
+    volatile_store_t *old_store = cache->volatile_store;
+
+    if (!path) {
+        if (old_store) {
+            // the items don't refer to any record anymore
+            cache->volatile_store = NULL;
+            ht_foreach_pair(cache->volatile_storage, shardcache_volatile_store_forget, NULL);
+        }
+        shardcache_volatile_store_unlock_all(cache);
+
+        if (old_store) {
+            shardcache_volatile_store_counters(cache, old_store, 0);
+            // NOTE: the compactor might be waiting for a key lock,
+            //       so the store can be closed only once they are released
+            volatile_store_close(old_store);
+        }
+        return 0;
+    }
+
+    if (old_store) {
+        shardcache_volatile_store_unlock_all(cache);
+        SHC_ERROR("The volatile store is already enabled");
+        return -1;
+    }
+
+    char instance_path[PATH_MAX];
+    shardcache_instance_path(cache, path, instance_path, sizeof(instance_path));
+
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    volatile_store_t *store = volatile_store_open(instance_path,
+                                                  segment_size ? segment_size
+                                                               : VOLATILE_STORE_SEGMENT_SIZE_DEFAULT,
+                                                  num_threads > 0 ? num_threads : 1,
+                                                  shardcache_volatile_replay_cb,
+                                                  shardcache_volatile_relocate_cb,
+                                                  cache);
+    if (!store) {
+        shardcache_volatile_store_unlock_all(cache);
+        SHC_ERROR("Can't open the volatile store at %s", instance_path);
+        return -1;
+    }
+
+    // drop the placeholders left by deletion markers and expired records
+    linked_list_t *to_delete = list_create();
+    ht_foreach_pair(cache->volatile_storage, shardcache_volatile_replay_collect, to_delete);
+    shardcache_key_t *k = list_shift_value(to_delete);
+    while (k) {
+        ht_delete(cache->volatile_storage, k->key, k->klen, NULL, NULL);
+        free(k);
+        k = list_shift_value(to_delete);
+    }
+    list_destroy(to_delete);
+
+    ht_foreach_pair(cache->volatile_storage, shardcache_volatile_replay_schedule, cache);
+    ht_foreach_pair(cache->volatile_storage, shardcache_volatile_store_persist, store);
+
+    cache->volatile_store = store;
+    shardcache_volatile_store_unlock_all(cache);
+
+    shardcache_volatile_store_counters(cache, store, 1);
+
+    SHC_NOTICE("Restored %llu volatile records from %s",
+               (unsigned long long)volatile_store_counters(store)->replay_records, instance_path);
+    return 0;
+}
+
 shardcache_t *
 shardcache_create(char *me,
                   shardcache_node_t **nodes,
@@ -470,14 +1625,24 @@ shardcache_create(char *me,
     int i, n;
     size_t shard_lens[nnodes];
     char *shard_names[nnodes];
+    struct timeval startup_time;
+
+    gettimeofday(&startup_time, NULL);
 
     shardcache_t *cache = calloc(1, sizeof(shardcache_t));
 
     cache->evict_on_delete = 1;
     cache->use_persistent_connections = 1;
     cache->tcp_timeout = SHARDCACHE_TCP_TIMEOUT_DEFAULT;
+    cache->protocol_version = global_protocol_version(-1);
+    cache->compression_threshold = global_compression_threshold(-1);
     cache->expire_time = SHARDCACHE_EXPIRE_TIME_DEFAULT;
     cache->serving_look_ahead = SHARDCACHE_SERVING_LOOK_AHEAD_DEFAULT;
+    cache->migration_threads = SHARDCACHE_MIGRATION_THREADS_DEFAULT;
+    cache->migration_batch_size = SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT;
+    cache->storage_io_threads = SHARDCACHE_STORAGE_IO_THREADS_DEFAULT;
+    cache->storage_batch_size = SHARDCACHE_STORAGE_BATCH_SIZE_DEFAULT;
+    cache->storage_batch_window = SHARDCACHE_STORAGE_BATCH_WINDOW_DEFAULT;
     cache->iomux_run_timeout_low = SHARDCACHE_IOMUX_RUN_TIMEOUT_LOW;
     cache->iomux_run_timeout_high = SHARDCACHE_IOMUX_RUN_TIMEOUT_HIGH;
     if (num_async > 0)
@@ -488,6 +1653,11 @@ shardcache_create(char *me,
         cache->num_async = SHARDCACHE_ASYNC_THREADS_NUM_DEFAULT;
 
     SPIN_INIT(cache->migration_lock);
+    pthread_rwlock_init(&cache->storage_io_lock, NULL);
+    pthread_rwlock_init(&cache->write_behind_lock, NULL);
+
+    for (i = 0; i < SHARDCACHE_VOLATILE_STORE_LOCKS; i++)
+        MUTEX_INIT(cache->volatile_store_locks[i]);
 
     if (st) {
         if (st->version != SHARDCACHE_STORAGE_API_VERSION) {
@@ -510,6 +1680,7 @@ shardcache_create(char *me,
     cache->ops.fetch   = arc_ops_fetch;
     cache->ops.evict   = arc_ops_evict;
     cache->ops.store   = arc_ops_store;
+    cache->ops.store_ref = arc_ops_store_ref;
 
     cache->ops.priv = cache;
     cache->shards = malloc(sizeof(shardcache_node_t *) * nnodes);
@@ -555,6 +1726,11 @@ shardcache_create(char *me,
 
     cache->chash = chash_create((const char **)shard_names, shard_lens, cache->num_shards, 200);
 
+    // the keys are routed through the continuum until a
+    // routing table is requested (see shardcache_routing_mode())
+    cache->routing_epoch = epoch_create();
+    cache->routing_mode = SHARDCACHE_ROUTING_CHASH;
+
     // we need to tell the arc subsystem how big are the cached objects (well ... at least the container struct
     // which is attached to each cached object to encapsulate its actual data and extra flags/members
     cache->arc = arc_create(&cache->ops, cache_size, sizeof(cached_object_t), cache->arc_lists_size, cache->arc_mode);
@@ -589,6 +1765,7 @@ shardcache_create(char *me,
     if (ATOMIC_READ(cache->evict_on_delete)) {
         MUTEX_INIT(cache->evictor_lock);
         CONDITION_INIT(cache->evictor_cond);
+        MUTEX_INIT(cache->subscribers_lock);
         cache->evictor_jobs = ht_create(128, 8192, NULL);
         pthread_create(&cache->evictor_th, NULL, evictor, cache);
     }
@@ -603,6 +1780,11 @@ shardcache_create(char *me,
                                                       SHARDCACHE_CONNECTION_EXPIRE_DEFAULT,
                                                       (num_workers/2)+ 1);
 
+    connections_pool_counters_t *pool_counters = connections_pool_counters(cache->connections_pool);
+    shardcache_counter_add(cache->counters, "pool_hits", &pool_counters->hits);
+    shardcache_counter_add(cache->counters, "pool_misses", &pool_counters->misses);
+    shardcache_counter_add(cache->counters, "pool_reconnects", &pool_counters->reconnects);
+
     global_tcp_timeout(ATOMIC_READ(cache->tcp_timeout));
 
     cache->async_context = calloc(1, sizeof(shardcache_async_io_context_t) * cache->num_async);
@@ -621,12 +1803,16 @@ shardcache_create(char *me,
         }
     }
 
-    if (!shardcache_log_initialized)
-        shardcache_log_init("libshardcache", LOG_WARNING);
+    if (shardcache_storage_io_setup(cache) != 0) {
+        shardcache_destroy(cache);
+        return NULL;
+    }
+
+    if (!shardcache_log_initialized)
+        shardcache_log_init("libshardcache", LOG_WARNING);
 
-    cache->cache_timeouts = ht_create(1<<16, 1<<20, (ht_free_item_callback_t)free);
-    cache->volatile_timeouts = ht_create(1<<16, 1<<20, (ht_free_item_callback_t)free);
-    cache->expirer_mux = iomux_create(0, 1);
+    cache->cache_timers = timing_wheel_create(SHARDCACHE_EXPIRER_TICK);
+    cache->volatile_timers = timing_wheel_create(SHARDCACHE_EXPIRER_TICK);
     cache->expirer_queue = queue_create();
     pthread_create(&cache->expirer_th, NULL, shardcache_expire_keys, cache);
 
@@ -645,6 +1831,10 @@ shardcache_create(char *me,
         return NULL;
     }
 
+    gettimeofday(&tv, NULL);
+    timersub(&tv, &startup_time, &tv);
+    ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_STARTUP_TIME].value, (tv.tv_sec * 1000) + (tv.tv_usec / 1000));
+
     return cache;
 }
 
@@ -670,6 +1860,12 @@ shardcache_destroy(shardcache_t *cache)
     if (cache->serv)
         stop_serving(cache->serv);
 
+    // NOTE: the fetches still queued are completed before returning,
+    //       so it must happen before destroying the arc instance
+    ATOMIC_SET(cache->storage_io_threads, 0);
+    shardcache_storage_io_setup(cache);
+    pthread_rwlock_destroy(&cache->storage_io_lock);
+
     if (cache->async_context) {
         // NOTE : should be destroyed only after
         //        the serving subsystem has been stopped
@@ -681,6 +1877,7 @@ shardcache_destroy(shardcache_t *cache)
                          wrk->cbs.mux_eof(cache->async_context[i].mux, wrk->fd, wrk->cbs.priv);
                      else
                          async_read_context_destroy(wrk->ctx);
+                    free(wrk->output);
                     free(wrk);
                     wrk = queue_pop_left(cache->async_context[i].queue);
                 }
@@ -698,6 +1895,15 @@ shardcache_destroy(shardcache_t *cache)
         pthread_join(cache->evictor_th, NULL);
         MUTEX_DESTROY(cache->evictor_lock);
         CONDITION_DESTROY(cache->evictor_cond);
+        // the serving subsystem is stopped so the connections
+        // don't hold any reference anymore
+        shardcache_subscriber_t *sub = cache->subscribers;
+        while (sub) {
+            shardcache_subscriber_t *next = sub->next;
+            shardcache_subscriber_release(sub);
+            sub = next;
+        }
+        MUTEX_DESTROY(cache->subscribers_lock);
         ht_set_free_item_callback(cache->evictor_jobs,
                 (ht_free_item_callback_t)destroy_evictor_job);
         ht_destroy(cache->evictor_jobs);
@@ -720,6 +1926,11 @@ shardcache_destroy(shardcache_t *cache)
     if (cache->replica)
         shardcache_replica_destroy(cache->replica);
 
+    // NOTE: the pending updates are written to the storage before returning,
+    //       so it must happen once nothing can queue new updates anymore
+    shardcache_write_behind(cache, 0, 0, NULL);
+    pthread_rwlock_destroy(&cache->write_behind_lock);
+
     if (cache->counters) {
         for (i = 0; i < SHARDCACHE_NUM_COUNTERS; i ++) {
             shardcache_counter_remove(cache->counters, cache->cnt[i].name);
@@ -728,9 +1939,21 @@ shardcache_destroy(shardcache_t *cache)
         shardcache_counter_remove(cache->counters, "mfu_size");
         shardcache_counter_remove(cache->counters, "mrug_size");
         shardcache_counter_remove(cache->counters, "mfug_size");
+        shardcache_counter_remove(cache->counters, "pool_hits");
+        shardcache_counter_remove(cache->counters, "pool_misses");
+        shardcache_counter_remove(cache->counters, "pool_reconnects");
+        if (cache->volatile_store)
+            shardcache_volatile_store_counters(cache, cache->volatile_store, 0);
         shardcache_release_counters(cache->counters);
     }
 
+    // NOTE: the serving subsystem and the expirer are stopped,
+    //       so nothing can update the volatile storage anymore
+    if (cache->volatile_store)
+        volatile_store_close(cache->volatile_store);
+    for (i = 0; i < SHARDCACHE_VOLATILE_STORE_LOCKS; i++)
+        MUTEX_DESTROY(cache->volatile_store_locks[i]);
+
     if (cache->volatile_storage)
         ht_destroy(cache->volatile_storage);
 
@@ -740,25 +1963,29 @@ shardcache_destroy(shardcache_t *cache)
     if (cache->chash)
         chash_free(cache->chash);
 
-    if (cache->expirer_mux)
-        iomux_destroy(cache->expirer_mux);
+    if (cache->routing)
+        routing_table_destroy(cache->routing);
+    if (cache->migration_routing)
+        routing_table_destroy(cache->migration_routing);
+    if (cache->routing_epoch)
+        epoch_destroy(cache->routing_epoch);
 
     if (cache->expirer_queue) {
         shardcache_expire_job_t *job = queue_pop_left(cache->expirer_queue);
         while(job) {
-            free(job->key);
             free(job);
             job = queue_pop_left(cache->expirer_queue);
         }
         queue_destroy(cache->expirer_queue);
     }
 
-    if (cache->cache_timeouts)
-        ht_destroy(cache->cache_timeouts);
+    if (cache->cache_timers)
+        timing_wheel_destroy(cache->cache_timers);
 
-    if (cache->volatile_timeouts)
-        ht_destroy(cache->volatile_timeouts);
+    if (cache->volatile_timers)
+        timing_wheel_destroy(cache->volatile_timers);
 
+    free(cache->migration_checkpoint);
     free(cache->me);
 
     free(cache->addr);
@@ -791,6 +2018,12 @@ shardcache_set_workers_num(shardcache_t *cache, unsigned int num_workers)
     return configure_serving_workers(cache->serv, num_workers);
 }
 
+int
+shardcache_listen_unix(shardcache_t *cache, char *path)
+{
+    return serve_unix_socket(cache->serv, path);
+}
+
 typedef struct {
     int stat;
     size_t dlen;
@@ -1442,7 +2675,13 @@ shardcache_exists(shardcache_t *cache,
     {
         // TODO - clean this bunch of nested conditions
         if (!ht_exists(cache->volatile_storage, key, klen)) {
-            if (cache->use_persistent_storage && cache->storage.exist) {
+            write_behind_t *wb = shardcache_write_behind_acquire(cache);
+            int pending = wb ? write_behind_lookup(wb, key, klen, NULL, NULL) : -1;
+            shardcache_write_behind_release(cache);
+            if (pending >= 0) {
+                // the key has an update which didn't reach the storage yet
+                rc = pending;
+            } else if (cache->use_persistent_storage && cache->storage.exist) {
                 if (!cache->storage.exist(key, klen, cache->storage.priv)) {
                     rc = 0;
                 } else {
@@ -1527,6 +2766,10 @@ shardcache_touch(shardcache_t *cache, void *key, size_t klen)
 static void
 shardcache_commence_eviction(shardcache_t *cache, void *key, size_t klen)
 {
+    // the evictor runs only if evict_on_delete is enabled
+    if (!cache->evictor_jobs)
+        return;
+
     shardcache_evictor_job_t *job = create_evictor_job(key, klen);
 
     SHC_DEBUG2("Adding evictor job for key %.*s", klen, key);
@@ -1546,20 +2789,18 @@ shardcache_commence_eviction(shardcache_t *cache, void *key, size_t klen)
 static inline int
 shardcache_queue_expiration_job(shardcache_t *cache, void *key, size_t klen, int expire, int is_volatile, int cmd)
 {
-    shardcache_expire_job_t *job = calloc(1, sizeof(shardcache_expire_job_t));
+    shardcache_expire_job_t *job = malloc(sizeof(shardcache_expire_job_t) + klen);
     job->cmd = cmd;
 
-    job->key = malloc(klen);
+    job->key = job + 1;
     job->klen = klen;
     memcpy(job->key, key, klen);
     job->expire = expire;
     job->is_volatile = is_volatile;
 
     int rc = queue_push_right(cache->expirer_queue, job);
-    if (rc != 0) {
-        free(job->key);
+    if (rc != 0)
         free(job);
-    }
 
     return rc;
 }
@@ -1582,6 +2823,9 @@ shardcache_schedule_expiration(shardcache_t *cache,
 }
 
 typedef struct {
+    shardcache_t *cache;
+    void *key;
+    size_t klen;
     void *new_value;
     size_t new_len;
     void *prev_value;
@@ -1595,9 +2839,17 @@ shardcache_cas_volatile_cb(void *ptr, size_t len, void *user)
     shardcache_cas_volatile_cb_arg_t *arg = (shardcache_cas_volatile_cb_arg_t *)user;
     volatile_object_t *item = (volatile_object_t *)ptr;
     if (item->dlen == arg->prev_len && memcmp(item->data, arg->prev_value, item->dlen) == 0) {
-        item->data = realloc(item->data, arg->new_len);
-        memcpy(item->data, arg->new_value, arg->new_len);
+        // the value might be shared with some cached object, so it can't be changed in place
+        if (arg->new_len > item->dlen) {
+            ATOMIC_INCREASE(arg->cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
+                            arg->new_len - item->dlen);
+        } else {
+            ATOMIC_DECREASE(arg->cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
+                            item->dlen - arg->new_len);
+        }
+        volatile_object_set_buf(item, volatile_buf_create(arg->new_value, arg->new_len));
         arg->matched = 1;
+        shardcache_volatile_store_update(arg->cache, arg->key, arg->klen, item);
     }
 
     return item;
@@ -1620,17 +2872,27 @@ shardcache_store_volatile(shardcache_t *cache,
     volatile_object_t *prev = NULL;
     // ensure removing this key from the persistent storage (if present)
     // since it's now going to be a volatile item
-    if (cache->use_persistent_storage && cache->storage.remove)
+    write_behind_t *wb = shardcache_write_behind_acquire(cache);
+    if (wb)
+        write_behind_remove(wb, key, klen);
+    else if (cache->use_persistent_storage && cache->storage.remove)
         cache->storage.remove(key, klen, cache->storage.priv);
+    shardcache_write_behind_release(cache);
 
     if (mode == 2 && prev_value == NULL) // if CAS and prev_value is NULL we really want ADD
         mode = 1;
 
+    pthread_mutex_t *lock = shardcache_volatile_store_lock(cache, key, klen);
+
     if (mode == 1 && ht_exists(cache->volatile_storage, key, klen)) {
+        shardcache_volatile_store_unlock(lock);
         SHC_DEBUG("A volatile value already exists for key %.*s", klen, key);
         return 1;
     } else if (mode == 2) {
         shardcache_cas_volatile_cb_arg_t arg = {
+            .cache = cache,
+            .key = key,
+            .klen = klen,
             .new_value = value,
             .new_len = vlen,
             .prev_value = prev_value,
@@ -1643,28 +2905,33 @@ shardcache_store_volatile(shardcache_t *cache,
                                                     NULL,
                                                     shardcache_cas_volatile_cb,
                                                     &arg);
-        if (obj)
+        if (obj) {
+            shardcache_volatile_store_unlock(lock);
             return !arg.matched;
+        }
     }
 
-    obj = malloc(sizeof(volatile_object_t));
-    obj->data = malloc(vlen);
-    memcpy(obj->data, value, vlen);
-    obj->dlen = vlen;
+    obj = calloc(1, sizeof(volatile_object_t));
+    volatile_object_set_buf(obj, volatile_buf_create(value, vlen));
     time_t now = time(NULL);
     time_t real_expire = expire ? time(NULL) + expire : 0;
     obj->expire = real_expire;
+    obj->loc = 0;
+    shardcache_volatile_store_update(cache, key, klen, obj);
 
     SHC_DEBUG2("Setting volatile item %.*s to expire %d (now: %d)", 
         klen, key, obj->expire, (int)now);
 
+    // the cached object (if any) will share the value with the volatile storage,
+    // it must be retained before the item is visible to other threads
+    volatile_buf_t *cached_buf = cache->cache_on_set ? volatile_buf_retain(obj->buf) : NULL;
+
     void *prev_ptr = NULL;
     if (mode == 1) {
         int rc = ht_set_if_not_exists(cache->volatile_storage, key, klen,
                                   obj, sizeof(volatile_object_t));
-        if (rc == 0) {
-            ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, obj->dlen);
-        } else {
+        // NOTE: the table size is updated below
+        if (rc != 0) {
             prev_ptr = obj;
             obj = NULL;
         }
@@ -1675,6 +2942,11 @@ shardcache_store_volatile(shardcache_t *cache,
                        &prev_ptr, NULL);
     }
 
+    if (prev_ptr && cache->volatile_store)
+        volatile_store_release(cache->volatile_store, ((volatile_object_t *)prev_ptr)->loc);
+
+    shardcache_volatile_store_unlock(lock);
+
     if (prev_ptr) {
         prev = (volatile_object_t *)prev_ptr;
         if (vlen > prev->dlen) {
@@ -1686,7 +2958,7 @@ shardcache_store_volatile(shardcache_t *cache,
         }
         destroy_volatile(prev); 
         if (cache->cache_on_set)
-            arc_load(cache->arc, (const void *)key, klen, value, vlen, cexpire);
+            arc_load_ref(cache->arc, (const void *)key, klen, cached_buf, vlen, cexpire);
         else
             arc_remove(cache->arc, (const void *)key, klen);
 
@@ -1697,6 +2969,8 @@ shardcache_store_volatile(shardcache_t *cache,
         ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, vlen);
     }
 
+    volatile_buf_release(cached_buf);
+
     if (obj && obj->expire)
         shardcache_schedule_expiration(cache, key, klen, expire, 1);
 
@@ -1724,6 +2998,14 @@ shardcache_store(shardcache_t *cache,
             mode = 1;
         } else if (cache->use_persistent_storage) {
             if (cache->storage.cas) {
+                // the storage must hold the current value to compare with
+                write_behind_t *wb = shardcache_write_behind_acquire(cache);
+                if (wb && write_behind_flush_key(wb, key, klen) != 0) {
+                    SHC_ERROR("Can't write the pending update for key %.*s before the CAS",
+                              (int)klen, (char *)key);
+                    shardcache_write_behind_release(cache);
+                    return -1;
+                }
                 rc = cache->storage.cas(key,
                                         klen,
                                         prev_value,
@@ -1731,6 +3013,7 @@ shardcache_store(shardcache_t *cache,
                                         value,
                                         vlen,
                                         cache->storage.priv);
+                shardcache_write_behind_release(cache);
                 if (rc == 0 && !replica)
                     shardcache_commence_eviction(cache, key, klen);
             } else {
@@ -1755,7 +3038,19 @@ shardcache_store(shardcache_t *cache,
                                          mode,
                                          replica);
 
-    rc = cache->storage.store(key, klen, value, vlen, mode, cache->storage.priv);
+    write_behind_t *wb = shardcache_write_behind_acquire(cache);
+    if (wb && mode == 0) {
+        rc = write_behind_store(wb, key, klen, value, vlen);
+    } else if (wb && write_behind_flush_key(wb, key, klen) != 0) {
+        // ADD needs to know if the key exists in the storage
+        SHC_ERROR("Can't write the pending update for key %.*s before the ADD",
+                  (int)klen, (char *)key);
+        shardcache_write_behind_release(cache);
+        return -1;
+    } else {
+        rc = cache->storage.store(key, klen, value, vlen, mode, cache->storage.priv);
+    }
+    shardcache_write_behind_release(cache);
 
     if (cache->cache_on_set)
         arc_load(cache->arc, (const void *)key, klen, value, vlen, cexpire);
@@ -2038,27 +3333,64 @@ static int safe_strtoll(char *str, size_t len, int64_t *out) {
     return 0;
 }
 
+typedef struct {
+    shardcache_t *cache;
+    void *key;
+    size_t klen;
+    int64_t amount;
+} shardcache_increment_volatile_cb_arg_t;
+
 static void *
 shardcache_increment_volatile_cb(void *ptr, size_t len, void *user)
 {
     static __thread int64_t ret = 0;
 
-    int64_t *amount = (int64_t *)user;
+    shardcache_increment_volatile_cb_arg_t *arg = (shardcache_increment_volatile_cb_arg_t *)user;
     volatile_object_t *item = (volatile_object_t *)ptr;
     if (!safe_strtoll((char *)item->data, item->dlen, &ret)) {
         SHC_ERROR("Volatile object was expected to be an integer in shardcache_increment_volatile_cb()");
         return NULL;
     }
-    ret += *amount;
+    ret += arg->amount;
     fbuf_t new = FBUF_STATIC_INITIALIZER_PARAMS(0, 10, 10, 1);
     fbuf_nprintf(&new, 20, "%"PRIi64, ret);
-    free(item->data);
-    int blen = 0;
-    item->dlen = fbuf_detach(&new, (char **)&item->data, &blen);
+    size_t new_len = fbuf_used(&new);
+    if (new_len > item->dlen) {
+        ATOMIC_INCREASE(arg->cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
+                        new_len - item->dlen);
+    } else {
+        ATOMIC_DECREASE(arg->cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
+                        item->dlen - new_len);
+    }
+    // the value might be shared with some cached object, so it can't be changed in place
+    volatile_object_set_buf(item, volatile_buf_create(fbuf_data(&new), new_len));
+    fbuf_destroy(&new);
+
+    shardcache_volatile_store_update(arg->cache, arg->key, arg->klen, item);
 
     return &ret;
 }
 
+static inline void *
+shardcache_increment_volatile(shardcache_t *cache, void *key, size_t klen, int64_t amount)
+{
+    shardcache_increment_volatile_cb_arg_t arg = {
+        .cache = cache,
+        .key = key,
+        .klen = klen,
+        .amount = amount
+    };
+    pthread_mutex_t *lock = shardcache_volatile_store_lock(cache, key, klen);
+    void *v = ht_get_deep_copy(cache->volatile_storage,
+                               key,
+                               klen,
+                               NULL,
+                               shardcache_increment_volatile_cb,
+                               &arg);
+    shardcache_volatile_store_unlock(lock);
+    return v;
+}
+
 int
 shardcache_increment_internal(shardcache_t *cache,
                               void *key,
@@ -2085,12 +3417,7 @@ shardcache_increment_internal(shardcache_t *cache,
 
     if (is_mine == 1)
     {
-        void *v = ht_get_deep_copy(cache->volatile_storage,
-                                  key,
-                                  klen,
-                                  NULL,
-                                  shardcache_increment_volatile_cb,
-                                  &amount);
+        void *v = shardcache_increment_volatile(cache, key, klen, amount);
         if (!v) {
             if (cache->use_persistent_storage && !expire) {
                 int64_t real_amount;
@@ -2114,7 +3441,18 @@ shardcache_increment_internal(shardcache_t *cache,
                 }
 
                 if (real_function) {
+                    // the storage must hold the current value to increment
+                    write_behind_t *wb = shardcache_write_behind_acquire(cache);
+                    if (wb && write_behind_flush_key(wb, key, klen) != 0) {
+                        SHC_ERROR("Can't write the pending update for key %.*s before the increment",
+                                  (int)klen, (char *)key);
+                        shardcache_write_behind_release(cache);
+                        if (cb)
+                            cb(key, klen, 0, priv);
+                        return -1;
+                    }
                     rc = real_function(key, klen, real_amount, initial, &value, cache->storage.priv);
+                    shardcache_write_behind_release(cache);
                     v = (void *)&value;
                 }
             }
@@ -2126,12 +3464,7 @@ shardcache_increment_internal(shardcache_t *cache,
                 size_t dsize = snprintf(data, sizeof(data), "%"PRIi64, value);
                 rc = shardcache_store_volatile(cache, key, klen, data, dsize, NULL, 0, expire, cexpire, 1, 0);
                 if (rc != 0) {
-                    v = ht_get_deep_copy(cache->volatile_storage,
-                                         key,
-                                         klen,
-                                         NULL,
-                                         shardcache_increment_volatile_cb,
-                                         &amount);
+                    v = shardcache_increment_volatile(cache, key, klen, amount);
                 } else {
                     v = (void *)&value;
                 }
@@ -2187,12 +3520,7 @@ shardcache_increment_internal(shardcache_t *cache,
                     size_t dsize = snprintf(data, sizeof(data), "%"PRIi64, initial + amount);
                     rc = shardcache_store_volatile(cache, key, klen, data, dsize, NULL, 0, expire, cexpire, 1, 0);
                     if (rc == 1) {
-                        void *v = ht_get_deep_copy(cache->volatile_storage,
-                                                   key,
-                                                   klen,
-                                                   NULL,
-                                                   shardcache_increment_volatile_cb,
-                                                   &amount);
+                        void *v = shardcache_increment_volatile(cache, key, klen, amount);
                         if (v) {
                             value = *((int *)v);
                             free(v);
@@ -2308,11 +3636,22 @@ shardcache_del_internal(shardcache_t *cache,
     if (is_mine == 1)
     {
         void *prev_ptr;
+        pthread_mutex_t *lock = shardcache_volatile_store_lock(cache, key, klen);
         rc = ht_delete(cache->volatile_storage, key, klen, &prev_ptr, NULL);
+        if (rc == 0 && cache->volatile_store) {
+            if (volatile_store_del(cache->volatile_store, key, klen) != 0)
+                SHC_WARNING("Can't write the deletion of the volatile item %.*s to the store", (int)klen, (char *)key);
+            if (prev_ptr)
+                volatile_store_release(cache->volatile_store, ((volatile_object_t *)prev_ptr)->loc);
+        }
+        shardcache_volatile_store_unlock(lock);
 
         if (rc != 0) {
             if (cache->use_persistent_storage) {
-                if (cache->storage.remove) {
+                write_behind_t *wb = shardcache_write_behind_acquire(cache);
+                if (wb) {
+                    rc = write_behind_remove(wb, key, klen);
+                } else if (cache->storage.remove) {
                     rc = cache->storage.remove(key, klen, cache->storage.priv);
                 } else {
                     // if there is a readonly persistent storage
@@ -2322,6 +3661,7 @@ shardcache_del_internal(shardcache_t *cache,
                     // to a node using a readonly persistent storage
                     rc = 0;
                 }
+                shardcache_write_behind_release(cache);
             }
         } else if (prev_ptr) {
             shardcache_unschedule_expiration(cache, key, klen, 1);
@@ -2448,231 +3788,950 @@ shardcache_evict_multi(shardcache_t *cache,
     for (i = 0; i < nkeys; i++)
         shardcache_evict(cache, keys[i], klens[i]);
 
-    return 0;
+    return 0;
+}
+
+// must be called with the migration lock held
+static shardcache_node_t **
+shardcache_copy_nodes(shardcache_node_t **nodes, int num_nodes)
+{
+    int i;
+    shardcache_node_t **list = malloc(sizeof(shardcache_node_t *) * num_nodes);
+    for (i = 0; i < num_nodes; i++) {
+        shardcache_node_t *orig = nodes[i];
+        char *label = shardcache_node_get_label(orig);
+        int num_replicas = shardcache_node_num_addresses(orig);
+        char *addresses[num_replicas];
+        shardcache_node_get_all_addresses(orig, addresses, num_replicas);
+        list[i] = shardcache_node_create(label, addresses, num_replicas);
+    }
+    return list;
+}
+
+shardcache_node_t **
+shardcache_get_nodes(shardcache_t *cache, int *num_nodes)
+{
+    SPIN_LOCK(cache->migration_lock);
+    shardcache_node_t **list = shardcache_copy_nodes(cache->shards, cache->num_shards);
+    if (num_nodes)
+        *num_nodes = cache->num_shards;
+    SPIN_UNLOCK(cache->migration_lock);
+    return list;
+}
+
+shardcache_node_t **
+shardcache_get_migration_nodes(shardcache_t *cache, int *num_nodes)
+{
+    shardcache_node_t **list = NULL;
+    int num = 0;
+    SPIN_LOCK(cache->migration_lock);
+    if (cache->migration && cache->migration_shards) {
+        list = shardcache_copy_nodes(cache->migration_shards, cache->num_migration_shards);
+        num = cache->num_migration_shards;
+    }
+    SPIN_UNLOCK(cache->migration_lock);
+    if (num_nodes)
+        *num_nodes = num;
+    return list;
+}
+
+void
+shardcache_free_nodes(shardcache_node_t **nodes, int num_nodes)
+{
+    int i;
+    for (i = 0; i < num_nodes; i++)
+        shardcache_node_destroy(nodes[i]);
+    free(nodes);
+}
+
+int
+shardcache_get_counters(shardcache_t *cache, shardcache_counter_t **counters)
+{
+    return shardcache_get_all_counters(cache->counters, counters); 
+}
+
+void
+shardcache_clear_counters(shardcache_t *cache)
+{
+    int i;
+    for (i = 0; i < SHARDCACHE_NUM_COUNTERS; i++)
+        ATOMIC_SET(cache->cnt[i].value, 0);
+}
+
+int
+shardcache_scan_index(shardcache_t *cache,
+                      uint64_t *cursor,
+                      shardcache_storage_index_item_t *items,
+                      size_t isize)
+{
+    if (!cache->use_persistent_storage) {
+        *cursor = 0;
+        return 0;
+    }
+
+    if (!cache->storage.scan_index)
+        return -1;
+
+    return cache->storage.scan_index(cursor, items, isize, cache->storage.priv);
+}
+
+shardcache_storage_index_t *
+shardcache_get_index(shardcache_t *cache)
+{
+    shardcache_storage_index_t *index = NULL;
+
+    if (cache->use_persistent_storage) {
+        size_t isize = 65535;
+        if (cache->storage.count)
+            isize = cache->storage.count(cache->storage.priv);
+
+        ssize_t count = 0;
+        shardcache_storage_index_item_t *items = NULL;
+        if (cache->storage.scan_index) {
+            // the number of items might change while scanning,
+            // so grow the array as needed
+            if (!isize)
+                isize = SHARDCACHE_INDEX_CHUNK_SIZE;
+            items = calloc(sizeof(shardcache_storage_index_item_t), isize);
+            uint64_t cursor = 0;
+            do {
+                if (isize - count < SHARDCACHE_INDEX_CHUNK_SIZE) {
+                    while (isize - count < SHARDCACHE_INDEX_CHUNK_SIZE)
+                        isize *= 2;
+                    items = realloc(items, isize * sizeof(shardcache_storage_index_item_t));
+                }
+                count += cache->storage.scan_index(&cursor, &items[count], isize - count, cache->storage.priv);
+            } while (cursor);
+        } else if (cache->storage.index) {
+            items = calloc(sizeof(shardcache_storage_index_item_t), isize);
+            count = cache->storage.index(items, isize, cache->storage.priv);
+        }
+        index = calloc(1, sizeof(shardcache_storage_index_t));
+        index->items = items;
+        index->size = count; 
+    }
+    return index;
+}
+
+void
+shardcache_free_index(shardcache_storage_index_t *index)
+{
+    if (index->items) {
+        int i;
+        for (i = 0; i < index->size; i++)
+            free(index->items[i].key);
+        free(index->items);
+    }
+    free(index);
+}
+
+static int
+expire_migrated(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user)
+{
+    shardcache_t *cache = (shardcache_t *)user;
+    volatile_object_t *v = (volatile_object_t *)value;
+
+    char node_name[1024];
+    size_t node_len = sizeof(node_name);
+    memset(node_name, 0, node_len);
+    int is_mine = shardcache_test_migration_ownership(cache, key, klen, node_name, &node_len);
+    if (is_mine == -1) {
+        SHC_WARNING("expire_migrated running while no migration continuum present ... aborting");
+        return 0;
+    } else if (!is_mine) {
+        SHC_DEBUG("Forcing Key %.*s to expire because not owned anymore", klen, key);
+
+        v->expire = 0;
+    }
+    return 1;
+}
+
+
+#define SHARDCACHE_MIGRATION_CHECKPOINT_MAGIC   0x6d636873 // "shcm"
+#define SHARDCACHE_MIGRATION_CHECKPOINT_VERSION 1
+
+// NOTE: the checkpoint is followed by 'num_failed' records made of
+//       the key length (uint32_t) and the key itself.
+//       All the integers are stored in host byte order
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fingerprint;    // identifies the nodes of the migration continuum
+    uint64_t cursor;         // where to resume the index scan from
+    uint64_t scanned_items;
+    uint64_t migrated_items;
+    uint64_t migrated_bytes;
+    uint64_t errors;
+    uint32_t num_failed;     // number of keys which couldn't be migrated
+    uint32_t reserved;
+} migration_checkpoint_hdr_t;
+
+typedef struct {
+    char *addr;         // the address of the new owner
+    int num_items;
+    void **keys;
+    size_t *klens;
+} migration_batch_t;
+
+typedef struct {
+    shardcache_t *cache;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    linked_list_t *queue;   // batches waiting for a worker
+    int inflight;           // batches queued or being processed
+    int max_inflight;
+    int quit;
+    int batch_size;
+
+    hashtable_t *failed;    // keys which couldn't be migrated (and must not be removed)
+    int aborted;
+
+    pthread_mutex_t throttle_lock;
+    uint64_t throttle_last;
+    double keys_budget;
+    double bytes_budget;
+
+    uint64_t fingerprint;
+    uint64_t cursor;
+    uint64_t started;
+
+    uint64_t migrated_items;
+    uint64_t migrated_bytes;
+    uint64_t scanned_items;
+    uint64_t errors;
+    uint64_t total_items;
+    uint64_t rate;          // keys scanned per second
+    uint64_t eta;           // seconds left (estimated)
+} migration_ctx_t;
+
+static inline uint64_t
+migration_now_usecs(void)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static int
+migration_aborted(migration_ctx_t *ctx)
+{
+    if (ATOMIC_READ(ctx->aborted))
+        return 1;
+
+    SPIN_LOCK(ctx->cache->migration_lock);
+    int aborted = (ctx->cache->migration == NULL);
+    SPIN_UNLOCK(ctx->cache->migration_lock);
+
+    if (aborted) {
+        SHC_WARNING("Migrator running while no migration continuum present ... aborting");
+        ATOMIC_SET(ctx->aborted, 1);
+    }
+    return aborted;
+}
+
+static inline void
+migration_failed_key(migration_ctx_t *ctx, void *key, size_t klen)
+{
+    ATOMIC_INCREMENT(ctx->errors);
+    // the value is never used, only the presence of the key matters
+    ht_set(ctx->failed, key, klen, ctx, 0);
+}
+
+// the keys and bytes budgets are refilled continuously (up to one second
+// worth of traffic) and are allowed to go negative, so that batches bigger
+// than the per-second limits still make progress
+static void
+migration_throttle(migration_ctx_t *ctx, int keys, size_t bytes)
+{
+    shardcache_t *cache = ctx->cache;
+    for (;;) {
+        int max_rate = ATOMIC_READ(cache->migration_max_rate);
+        int max_bandwidth = ATOMIC_READ(cache->migration_max_bandwidth);
+
+        if ((!max_rate && !max_bandwidth) || migration_aborted(ctx))
+            return;
+
+        double wait = 0;
+
+        MUTEX_LOCK(ctx->throttle_lock);
+        uint64_t now = migration_now_usecs();
+        double elapsed = (double)(now - ctx->throttle_last) / 1e6;
+        ctx->throttle_last = now;
+
+        if (max_rate) {
+            ctx->keys_budget += elapsed * max_rate;
+            if (ctx->keys_budget > max_rate)
+                ctx->keys_budget = max_rate;
+            if (ctx->keys_budget < 0)
+                wait = -ctx->keys_budget / max_rate;
+        } else {
+            ctx->keys_budget = 0;
+        }
+
+        if (max_bandwidth) {
+            ctx->bytes_budget += elapsed * max_bandwidth;
+            if (ctx->bytes_budget > max_bandwidth)
+                ctx->bytes_budget = max_bandwidth;
+            if (ctx->bytes_budget < 0 && -ctx->bytes_budget / max_bandwidth > wait)
+                wait = -ctx->bytes_budget / max_bandwidth;
+        } else {
+            ctx->bytes_budget = 0;
+        }
+
+        if (wait == 0) {
+            ctx->keys_budget -= keys;
+            ctx->bytes_budget -= bytes;
+        }
+        MUTEX_UNLOCK(ctx->throttle_lock);
+
+        if (wait == 0)
+            return;
+
+        // don't sleep too long so that changes to the limits
+        // (and aborts) are noticed in a timely manner
+        usleep(wait < 0.1 ? wait * 1e6 : 100000);
+    }
+}
+
+static migration_batch_t *
+migration_batch_create(shardcache_t *cache, char *node_name, int size)
+{
+    shardcache_node_t *peer = shardcache_node_select(cache, node_name);
+    if (!peer) {
+        SHC_ERROR("Can't find address for peer %s (me : %s)", node_name, cache->me);
+        return NULL;
+    }
+
+    migration_batch_t *batch = calloc(1, sizeof(migration_batch_t));
+    // the node might be released (if the migration is aborted)
+    // while the batch is still being processed
+    batch->addr = strdup(shardcache_node_get_address(peer));
+    batch->keys = calloc(size, sizeof(void *));
+    batch->klens = calloc(size, sizeof(size_t));
+    return batch;
+}
+
+static void
+migration_batch_destroy(migration_batch_t *batch)
+{
+    int i;
+    for (i = 0; i < batch->num_items; i++)
+        free(batch->keys[i]);
+    free(batch->keys);
+    free(batch->klens);
+    free(batch->addr);
+    free(batch);
+}
+
+// fetch the keys in the batch from the storage and send them
+// to their new owner (all at once, using the same connection)
+static void
+migration_batch_process(migration_ctx_t *ctx, migration_batch_t *batch)
+{
+    shardcache_t *cache = ctx->cache;
+    int num_items = batch->num_items;
+
+    if (migration_aborted(ctx))
+        return;
+
+    void *values[num_items];
+    size_t vlens[num_items];
+    int statuses[num_items];
+    memset(values, 0, sizeof(values));
+    memset(vlens, 0, sizeof(vlens));
+
+    int i;
+    if (cache->storage.fetch_multi && num_items > 1) {
+        // in case of failure fetch_multi() returns how many items
+        // it managed to fetch before failing
+        int rc = cache->storage.fetch_multi(batch->keys, batch->klens, num_items,
+                                            values, vlens, cache->storage.priv);
+        for (i = 0; rc != 0 && i < num_items; i++) {
+            if (i < rc)
+                continue;
+            free(values[i]);
+            values[i] = NULL;
+            SHC_ERROR("Fetch storage callback retunrned an error during migration (key %.*s)",
+                      batch->klens[i], batch->keys[i]);
+            migration_failed_key(ctx, batch->keys[i], batch->klens[i]);
+        }
+    } else if (cache->storage.fetch) {
+        for (i = 0; i < num_items; i++) {
+            int rc = cache->storage.fetch(batch->keys[i], batch->klens[i],
+                                          &values[i], &vlens[i], cache->storage.priv);
+            if (rc == -1) {
+                SHC_ERROR("Fetch storage callback retunrned an error during migration (%d)", rc);
+                values[i] = NULL;
+                migration_failed_key(ctx, batch->keys[i], batch->klens[i]);
+            }
+        }
+    }
+
+    // keys which have been removed in the meanwhile are simply skipped
+    void *keys[num_items];
+    size_t klens[num_items];
+    int count = 0;
+    size_t bytes = 0;
+    for (i = 0; i < num_items; i++) {
+        if (!values[i])
+            continue;
+        keys[count] = batch->keys[i];
+        klens[count] = batch->klens[i];
+        values[count] = values[i];
+        vlens[count] = vlens[i];
+        bytes += vlens[i];
+        count++;
+    }
+
+    if (count) {
+        migration_throttle(ctx, count, bytes);
+
+        if (!migration_aborted(ctx)) {
+            SHC_DEBUG("Migrator copying %d keys to peer %s", count, batch->addr);
+            int fd = shardcache_get_connection_for_peer(cache, batch->addr);
+            int rc = send_multi_to_peer(batch->addr, keys, klens, values, vlens, count,
+                                        0, cache->expire_time, statuses, fd);
+            if (rc == 0)
+                shardcache_release_connection_for_peer(cache, batch->addr, fd);
+            else if (fd >= 0)
+                close(fd);
+
+            for (i = 0; i < count; i++) {
+                if (rc == 0 && statuses[i] == 0) {
+                    ATOMIC_INCREMENT(ctx->migrated_items);
+                    ATOMIC_INCREASE(ctx->migrated_bytes, vlens[i]);
+                } else {
+                    SHC_WARNING("Errors copying %.*s to peer %s", klens[i], keys[i], batch->addr);
+                    migration_failed_key(ctx, keys[i], klens[i]);
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < count; i++)
+        free(values[i]);
+}
+
+static void *
+migration_worker(void *priv)
+{
+    migration_ctx_t *ctx = (migration_ctx_t *)priv;
+
+    shardcache_thread_init(ctx->cache);
+
+    for (;;) {
+        MUTEX_LOCK(ctx->lock);
+        migration_batch_t *batch = list_shift_value(ctx->queue);
+        while (!batch && !ctx->quit) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+            batch = list_shift_value(ctx->queue);
+        }
+        MUTEX_UNLOCK(ctx->lock);
+
+        if (!batch)
+            break;
+
+        migration_batch_process(ctx, batch);
+        migration_batch_destroy(batch);
+
+        MUTEX_LOCK(ctx->lock);
+        ctx->inflight--;
+        pthread_cond_broadcast(&ctx->cond);
+        MUTEX_UNLOCK(ctx->lock);
+    }
+
+    shardcache_thread_end(ctx->cache);
+    return NULL;
+}
+
+static void
+migration_enqueue(migration_ctx_t *ctx, migration_batch_t *batch)
+{
+    MUTEX_LOCK(ctx->lock);
+    // don't let the scanner run too far ahead of the workers
+    while (ctx->inflight >= ctx->max_inflight)
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    ctx->inflight++;
+    list_push_value(ctx->queue, batch);
+    pthread_cond_broadcast(&ctx->cond);
+    MUTEX_UNLOCK(ctx->lock);
+}
+
+static void
+migration_wait_idle(migration_ctx_t *ctx)
+{
+    MUTEX_LOCK(ctx->lock);
+    while (ctx->inflight > 0)
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    MUTEX_UNLOCK(ctx->lock);
+}
+
+static int
+migration_flush_batch(hashtable_t *table, void *value, size_t vlen, void *user)
+{
+    migration_ctx_t *ctx = (migration_ctx_t *)user;
+    migration_batch_t *batch = (migration_batch_t *)value;
+    if (batch->num_items)
+        migration_enqueue(ctx, batch);
+    else
+        migration_batch_destroy(batch);
+    return -1;
+}
+
+// queue the key to be copied to its new owner (if it's not ours anymore).
+// Keys are grouped by destination in the 'batches' table, each batch
+// is handed to the workers once it's full.
+// NOTE: takes ownership of the key
+static void
+migration_add_key(migration_ctx_t *ctx, hashtable_t *batches, void *key, size_t klen)
+{
+    shardcache_t *cache = ctx->cache;
+
+    char node_name[1024];
+    size_t node_len = sizeof(node_name);
+    memset(node_name, 0, node_len);
+
+    SHC_DEBUG("Migrator processign key %.*s", klen, key);
+
+    int is_mine = shardcache_test_migration_ownership(cache, key, klen, node_name, &node_len);
+
+    if (is_mine == -1) {
+        SHC_WARNING("Migrator running while no migration continuum present ... aborting");
+        ATOMIC_SET(ctx->aborted, 1);
+        free(key);
+        return;
+    }
+
+    if (is_mine) {
+        free(key);
+        return;
+    }
+
+    migration_batch_t *batch = ht_get(batches, node_name, node_len, NULL);
+    if (!batch) {
+        batch = migration_batch_create(cache, node_name, ctx->batch_size);
+        if (!batch) {
+            migration_failed_key(ctx, key, klen);
+            free(key);
+            return;
+        }
+        ht_set(batches, node_name, node_len, batch, sizeof(migration_batch_t));
+    }
+
+    batch->keys[batch->num_items] = key;
+    batch->klens[batch->num_items] = klen;
+    batch->num_items++;
+
+    if (batch->num_items == ctx->batch_size) {
+        ht_delete(batches, node_name, node_len, NULL, NULL);
+        migration_enqueue(ctx, batch);
+    }
 }
 
-shardcache_node_t **
-shardcache_get_nodes(shardcache_t *cache, int *num_nodes)
+static uint64_t
+migration_fingerprint(shardcache_t *cache)
 {
+    // FNV-1a of our label, combined with the hashes of the labels
+    // of the migration continuum (regardless of their order)
+    uint64_t fingerprint = 0;
     int i;
-    int num = 0;
     SPIN_LOCK(cache->migration_lock);
-    num = cache->num_shards;
-    if (num_nodes)
-        *num_nodes = num;
-    shardcache_node_t **list = malloc(sizeof(shardcache_node_t *) * num);
-    for (i = 0; i < num; i++) {
-        shardcache_node_t *orig = cache->shards[i];
-        char *label = shardcache_node_get_label(orig);
-        int num_replicas = shardcache_node_num_addresses(orig);
-        char *addresses[num_replicas];
-        shardcache_node_get_all_addresses(orig, addresses, num_replicas);
-        list[i] = shardcache_node_create(label, addresses, num_replicas);
+    for (i = -1; i < cache->num_migration_shards; i++) {
+        char *label = (i < 0) ? cache->me : shardcache_node_get_label(cache->migration_shards[i]);
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        while (*label) {
+            hash ^= (unsigned char)*label++;
+            hash *= 0x100000001b3ULL;
+        }
+        fingerprint = (i < 0) ? hash : fingerprint ^ hash;
     }
     SPIN_UNLOCK(cache->migration_lock);
-    return list;
+    return fingerprint;
 }
 
-void
-shardcache_free_nodes(shardcache_node_t **nodes, int num_nodes)
+static int
+migration_checkpoint_add_key(hashtable_t *table, void *key, size_t klen, void *user)
 {
-    int i;
-    for (i = 0; i < num_nodes; i++)
-        shardcache_node_destroy(nodes[i]);
-    free(nodes);
+    fbuf_t *buf = (fbuf_t *)user;
+    uint32_t len = klen;
+    fbuf_add_binary(buf, (char *)&len, sizeof(len));
+    fbuf_add_binary(buf, key, klen);
+    return 1;
 }
 
-int
-shardcache_get_counters(shardcache_t *cache, shardcache_counter_t **counters)
+// NOTE: must be called when there are no batches in flight, so that all
+//       the keys before the cursor have been either migrated or marked as failed
+static void
+migration_checkpoint_save(migration_ctx_t *ctx, char *path)
 {
-    return shardcache_get_all_counters(cache->counters, counters); 
-}
+    migration_checkpoint_hdr_t hdr = {
+        .magic = SHARDCACHE_MIGRATION_CHECKPOINT_MAGIC,
+        .version = SHARDCACHE_MIGRATION_CHECKPOINT_VERSION,
+        .fingerprint = ctx->fingerprint,
+        .cursor = ctx->cursor,
+        .scanned_items = ATOMIC_READ(ctx->scanned_items),
+        .migrated_items = ATOMIC_READ(ctx->migrated_items),
+        .migrated_bytes = ATOMIC_READ(ctx->migrated_bytes),
+        .errors = ATOMIC_READ(ctx->errors),
+        .num_failed = ht_count(ctx->failed)
+    };
+
+    fbuf_t buf = FBUF_STATIC_INITIALIZER;
+    fbuf_add_binary(&buf, (char *)&hdr, sizeof(hdr));
+    ht_foreach_key(ctx->failed, migration_checkpoint_add_key, &buf);
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd == -1) {
+        SHC_ERROR("Can't create the migration checkpoint %s: %s", tmp_path, strerror(errno));
+        fbuf_destroy(&buf);
+        return;
+    }
 
-void
-shardcache_clear_counters(shardcache_t *cache)
-{
-    int i;
-    for (i = 0; i < SHARDCACHE_NUM_COUNTERS; i++)
-        ATOMIC_SET(cache->cnt[i].value, 0);
+    int rc = 0;
+    while (fbuf_used(&buf) > 0 && rc == 0) {
+        int wb = fbuf_write(&buf, fd, 0);
+        if (wb <= 0 && errno != EINTR)
+            rc = -1;
+    }
+    fbuf_destroy(&buf);
+
+    if (rc == 0 && fsync(fd) != 0)
+        rc = -1;
+
+    close(fd);
+
+    if (rc != 0 || rename(tmp_path, path) != 0) {
+        SHC_ERROR("Can't write the migration checkpoint %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        return;
+    }
+
+    SHC_DEBUG("Migration checkpoint saved (scanned %"PRIu64", migrated %"PRIu64")",
+              hdr.scanned_items, hdr.migrated_items);
 }
 
-shardcache_storage_index_t *
-shardcache_get_index(shardcache_t *cache)
+// returns 0 if the migration can resume from the checkpoint,
+// the keys which previously failed are queued for a new attempt
+static int
+migration_checkpoint_load(migration_ctx_t *ctx, char *path, hashtable_t *batches)
 {
-    shardcache_storage_index_t *index = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
 
-    if (cache->use_persistent_storage) {
-        size_t isize = 65535;
-        if (cache->storage.count)
-            isize = cache->storage.count(cache->storage.priv);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(migration_checkpoint_hdr_t)) {
+        SHC_WARNING("Ignoring invalid migration checkpoint %s", path);
+        close(fd);
+        return -1;
+    }
 
-        ssize_t count = 0;
-        shardcache_storage_index_item_t *items = NULL;
-        if (cache->storage.index) {
-            items = calloc(sizeof(shardcache_storage_index_item_t), isize);
-            count = cache->storage.index(items, isize, cache->storage.priv);
-        }
-        index = calloc(1, sizeof(shardcache_storage_index_t));
-        index->items = items;
-        index->size = count; 
+    size_t size = st.st_size;
+    char *data = malloc(size);
+    size_t rb = 0;
+    while (rb < size) {
+        ssize_t n = read(fd, data + rb, size - rb);
+        if (n <= 0 && errno != EINTR)
+            break;
+        if (n > 0)
+            rb += n;
     }
-    return index;
+    close(fd);
+
+    migration_checkpoint_hdr_t hdr;
+    memcpy(&hdr, data, sizeof(hdr));
+
+    if (rb != size ||
+        hdr.magic != SHARDCACHE_MIGRATION_CHECKPOINT_MAGIC ||
+        hdr.version != SHARDCACHE_MIGRATION_CHECKPOINT_VERSION)
+    {
+        SHC_WARNING("Ignoring invalid migration checkpoint %s", path);
+        free(data);
+        return -1;
+    }
+
+    if (hdr.fingerprint != ctx->fingerprint) {
+        SHC_NOTICE("Ignoring the migration checkpoint %s (it refers to a different migration)", path);
+        free(data);
+        return -1;
+    }
+
+    ctx->cursor = hdr.cursor;
+    ctx->scanned_items = hdr.scanned_items;
+    ctx->migrated_items = hdr.migrated_items;
+    ctx->migrated_bytes = hdr.migrated_bytes;
+    ctx->errors = hdr.errors;
+
+    size_t offset = sizeof(hdr);
+    uint32_t i;
+    for (i = 0; i < hdr.num_failed; i++) {
+        uint32_t klen;
+        if (offset + sizeof(klen) > size)
+            break;
+        memcpy(&klen, data + offset, sizeof(klen));
+        offset += sizeof(klen);
+        if (klen > size - offset)
+            break;
+        void *key = malloc(klen);
+        memcpy(key, data + offset, klen);
+        offset += klen;
+        migration_add_key(ctx, batches, key, klen);
+    }
+
+    free(data);
+
+    SHC_NOTICE("Resuming migration from checkpoint %s (scanned %"PRIu64", migrated %"PRIu64", retrying %u)",
+               path, hdr.scanned_items, hdr.migrated_items, i);
+    return 0;
 }
 
-void
-shardcache_free_index(shardcache_storage_index_t *index)
+static void
+migration_update_stats(migration_ctx_t *ctx, uint64_t resumed_items)
 {
-    if (index->items) {
-        int i;
-        for (i = 0; i < index->size; i++)
-            free(index->items[i].key);
-        free(index->items);
-    }
-    free(index);
+    uint64_t elapsed = (migration_now_usecs() - ctx->started) / 1000000;
+    uint64_t scanned = ATOMIC_READ(ctx->scanned_items);
+    if (!elapsed || scanned <= resumed_items)
+        return;
+
+    uint64_t rate = (scanned - resumed_items) / elapsed;
+    ATOMIC_SET(ctx->rate, rate);
+
+    uint64_t total = ATOMIC_READ(ctx->total_items);
+    uint64_t eta = (rate && total > scanned) ? (total - scanned) / rate : 0;
+    ATOMIC_SET(ctx->eta, eta);
 }
 
 static int
-expire_migrated(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user)
+migration_remove_item(migration_ctx_t *ctx, void *key, size_t klen)
 {
-    shardcache_t *cache = (shardcache_t *)user;
-    volatile_object_t *v = (volatile_object_t *)value;
+    shardcache_t *cache = ctx->cache;
 
     char node_name[1024];
     size_t node_len = sizeof(node_name);
     memset(node_name, 0, node_len);
+
     int is_mine = shardcache_test_migration_ownership(cache, key, klen, node_name, &node_len);
     if (is_mine == -1) {
-        SHC_WARNING("expire_migrated running while no migration continuum present ... aborting");
+        ATOMIC_SET(ctx->aborted, 1);
+        return -1;
+    }
+
+    if (is_mine || ht_exists(ctx->failed, key, klen))
         return 0;
-    } else if (!is_mine) {
-        SHC_DEBUG("Forcing Key %.*s to expire because not owned anymore", klen, key);
 
-        v->expire = 0;
-    }
-    return 1;
+    write_behind_t *wb = shardcache_write_behind_acquire(cache);
+    if (wb)
+        write_behind_remove(wb, key, klen);
+    else if (cache->storage.remove)
+        cache->storage.remove(key, klen, cache->storage.priv);
+    shardcache_write_behind_release(cache);
+
+    SHC_DEBUG2("removed item %.*s", klen, key);
+    return 0;
 }
 
+// remove the keys which have been copied to their new owners.
+// The index is scanned again (instead of remembering all the migrated keys)
+// which also covers the keys migrated before resuming from a checkpoint.
+// Writes to keys not owned anymore are sent to the new owners
+// while the migration is in progress, so everything else
+// which is not ours and didn't fail can go
+static void
+migration_remove_items(migration_ctx_t *ctx)
+{
+    shardcache_t *cache = ctx->cache;
+    int i;
+
+    if (cache->storage.scan_index) {
+        shardcache_storage_index_item_t *items =
+            calloc(SHARDCACHE_INDEX_CHUNK_SIZE, sizeof(shardcache_storage_index_item_t));
+        uint64_t cursor = 0;
+        do {
+            int n = shardcache_scan_index(cache, &cursor, items, SHARDCACHE_INDEX_CHUNK_SIZE);
+            for (i = 0; i < n; i++) {
+                if (!ctx->aborted)
+                    migration_remove_item(ctx, items[i].key, items[i].klen);
+                free(items[i].key);
+            }
+        } while (cursor && !ctx->aborted);
+        free(items);
+    } else {
+        shardcache_storage_index_t *index = shardcache_get_index(cache);
+        for (i = 0; i < index->size && !ctx->aborted; i++)
+            migration_remove_item(ctx, index->items[i].key, index->items[i].klen);
+        shardcache_free_index(index);
+    }
+}
 
 void *
 migrate(void *priv)
 {
     shardcache_t *cache = (shardcache_t *)priv;
 
-    shardcache_storage_index_t *index = shardcache_get_index(cache);
-    int aborted = 0;
-    linked_list_t *to_delete = list_create();
+    // the keys with a pending update might not be in the storage index yet
+    write_behind_t *wb = shardcache_write_behind_acquire(cache);
+    if (wb)
+        write_behind_flush(wb);
+    shardcache_write_behind_release(cache);
 
-    uint64_t migrated_items = 0;
-    uint64_t scanned_items = 0;
-    uint64_t errors = 0;
-    uint64_t total_items = 0;
+    int num_threads = ATOMIC_READ(cache->migration_threads);
 
-    shardcache_thread_init(cache);
+    migration_ctx_t ctx = {
+        .cache = cache,
+        .queue = list_create(),
+        .max_inflight = num_threads * 2,
+        .batch_size = ATOMIC_READ(cache->migration_batch_size),
+        .failed = ht_create(128, 1<<20, NULL),
+        .throttle_last = migration_now_usecs(),
+        .started = migration_now_usecs()
+    };
 
-    if (index) {
-        total_items = index->size;
+    shardcache_thread_init(cache);
 
-        shardcache_counter_add(cache->counters, "migrated_items", &migrated_items);
-        shardcache_counter_add(cache->counters, "scanned_items", &scanned_items);
-        shardcache_counter_add(cache->counters, "total_items", &total_items);
-        shardcache_counter_add(cache->counters, "migration_errors", &errors);
+    if (cache->use_persistent_storage) {
+        MUTEX_INIT(ctx.lock);
+        MUTEX_INIT(ctx.throttle_lock);
+        pthread_cond_init(&ctx.cond, NULL);
+
+        char *checkpoint = NULL;
+        SPIN_LOCK(cache->migration_lock);
+        if (cache->migration_checkpoint && cache->storage.scan_index)
+            checkpoint = strdup(cache->migration_checkpoint);
+        SPIN_UNLOCK(cache->migration_lock);
 
-        SHC_INFO("Migrator starting (%d items to precess)", total_items);
+        shardcache_counter_add(cache->counters, "migrated_items", &ctx.migrated_items);
+        shardcache_counter_add(cache->counters, "migrated_bytes", &ctx.migrated_bytes);
+        shardcache_counter_add(cache->counters, "scanned_items", &ctx.scanned_items);
+        shardcache_counter_add(cache->counters, "total_items", &ctx.total_items);
+        shardcache_counter_add(cache->counters, "migration_errors", &ctx.errors);
+        shardcache_counter_add(cache->counters, "migration_rate", &ctx.rate);
+        shardcache_counter_add(cache->counters, "migration_eta", &ctx.eta);
 
+        pthread_t workers[num_threads];
         int i;
-        for (i = 0; i < index->size; i++) {
-            size_t klen = index->items[i].klen;
-            void *key = index->items[i].key;
-
-            char node_name[1024];
-            size_t node_len = sizeof(node_name);
-            memset(node_name, 0, node_len);
-
-            SHC_DEBUG("Migrator processign key %.*s", klen, key);
+        for (i = 0; i < num_threads; i++)
+            pthread_create(&workers[i], NULL, migration_worker, &ctx);
+
+        // the keys waiting for a batch to fill up, by destination
+        hashtable_t *batches = ht_create(128, 1024, NULL);
+
+        ctx.fingerprint = migration_fingerprint(cache);
+        if (checkpoint && migration_checkpoint_load(&ctx, checkpoint, batches) != 0)
+            ctx.cursor = 0;
+        uint64_t resumed_items = ctx.scanned_items;
+
+        if (cache->storage.scan_index) {
+            // walk through the index a chunk at a time
+            // instead of loading it all in memory
+            if (cache->storage.count)
+                ctx.total_items = cache->storage.count(cache->storage.priv);
+
+            SHC_INFO("Migrator starting (%"PRIu64" items to precess, %d threads)",
+                     ctx.total_items, num_threads);
+
+            shardcache_storage_index_item_t *items =
+                calloc(SHARDCACHE_INDEX_CHUNK_SIZE, sizeof(shardcache_storage_index_item_t));
+            time_t last_checkpoint = time(NULL);
+            do {
+                int n = shardcache_scan_index(cache, &ctx.cursor, items, SHARDCACHE_INDEX_CHUNK_SIZE);
+                for (i = 0; i < n; i++) {
+                    if (!migration_aborted(&ctx))
+                        migration_add_key(&ctx, batches, items[i].key, items[i].klen);
+                    else
+                        free(items[i].key);
+                    ATOMIC_INCREMENT(ctx.scanned_items);
+                }
 
-            int is_mine = shardcache_test_migration_ownership(cache, key, klen, node_name, &node_len);
+                migration_update_stats(&ctx, resumed_items);
 
-            int rc = 0;
-            
-            if (is_mine == -1) {
-                SHC_WARNING("Migrator running while no migration continuum present ... aborting");
-                ATOMIC_INCREMENT(errors);
-                aborted = 1;
-                break;
-            } else if (!is_mine) {
-                // if we are not the owner try asking our peer responsible for this data
-                void *value = NULL;
-                size_t vlen = 0;
-                if (cache->storage.fetch) {
-                    rc = cache->storage.fetch(key, klen, &value, &vlen, cache->storage.priv);
-                    if (rc == -1) {
-                        SHC_ERROR("Fetch storage callback retunrned an error during migration (%d)", rc);
-                        ATOMIC_INCREMENT(errors);
-                        ATOMIC_INCREMENT(scanned_items);
-                        continue;
-                    }
-                }
-                if (value) {
-                    shardcache_node_t *peer = shardcache_node_select(cache, (char *)node_name);
-                    if (peer) {
-                        char *addr = shardcache_node_get_address(peer);
-                        SHC_DEBUG("Migrator copying %.*s to peer %s (%s)", klen, key, node_name, addr);
-                        int fd = shardcache_get_connection_for_peer(cache, addr);
-                        rc = send_to_peer(addr, key, klen, value, vlen, 0, cache->expire_time, fd, 1);
-                        if (rc == 0) {
-                            shardcache_release_connection_for_peer(cache, addr, fd);
-                            ATOMIC_INCREMENT(migrated_items);
-                            list_push_value(to_delete, &index->items[i]);
-                        } else {
-                            close(fd);
-                            SHC_WARNING("Errors copying %.*s to peer %s (%s)", klen, key, node_name, addr);
-                            ATOMIC_INCREMENT(errors);
-                        }
-                    } else {
-                        SHC_ERROR("Can't find address for peer %s (me : %s)", node_name, cache->me);
-                        ATOMIC_INCREMENT(errors);
-                    }
+                time_t now = time(NULL);
+                if (checkpoint && ctx.cursor && now - last_checkpoint >= SHARDCACHE_MIGRATION_CHECKPOINT_INTERVAL) {
+                    // everything before the cursor must be done before saving it
+                    ht_foreach_value(batches, migration_flush_batch, &ctx);
+                    migration_wait_idle(&ctx);
+                    if (!migration_aborted(&ctx))
+                        migration_checkpoint_save(&ctx, checkpoint);
+                    last_checkpoint = now;
                 }
+            } while (ctx.cursor && !migration_aborted(&ctx));
+            free(items);
+        } else {
+            shardcache_storage_index_t *index = shardcache_get_index(cache);
+            ctx.total_items = index->size;
+
+            SHC_INFO("Migrator starting (%"PRIu64" items to precess, %d threads)",
+                     ctx.total_items, num_threads);
+
+            for (i = 0; i < index->size && !migration_aborted(&ctx); i++) {
+                migration_add_key(&ctx, batches, index->items[i].key, index->items[i].klen);
+                index->items[i].key = NULL;
+                ATOMIC_INCREMENT(ctx.scanned_items);
+                if (i % SHARDCACHE_INDEX_CHUNK_SIZE == 0)
+                    migration_update_stats(&ctx, resumed_items);
             }
-            ATOMIC_INCREMENT(scanned_items);
+
+            shardcache_free_index(index);
+        }
+
+        ht_foreach_value(batches, migration_flush_batch, &ctx);
+        ht_destroy(batches);
+
+        migration_wait_idle(&ctx);
+
+        MUTEX_LOCK(ctx.lock);
+        ctx.quit = 1;
+        pthread_cond_broadcast(&ctx.cond);
+        MUTEX_UNLOCK(ctx.lock);
+
+        for (i = 0; i < num_threads; i++)
+            pthread_join(workers[i], NULL);
+
+        migration_update_stats(&ctx, resumed_items);
+
+        if (!migration_aborted(&ctx)) {
+            SHC_INFO("Migration completed, now removing not-owned  items");
+            migration_remove_items(&ctx);
         }
 
+        // keep the checkpoint if aborted, so that a new attempt can resume from there
+        if (checkpoint && !ctx.aborted)
+            unlink(checkpoint);
+        free(checkpoint);
+
         shardcache_counter_remove(cache->counters, "migrated_items");
+        shardcache_counter_remove(cache->counters, "migrated_bytes");
         shardcache_counter_remove(cache->counters, "scanned_items");
         shardcache_counter_remove(cache->counters, "total_items");
         shardcache_counter_remove(cache->counters, "migration_errors");
-    }
+        shardcache_counter_remove(cache->counters, "migration_rate");
+        shardcache_counter_remove(cache->counters, "migration_eta");
 
-    if (!aborted) {
-            SHC_INFO("Migration completed, now removing not-owned  items");
-        shardcache_storage_index_item_t *item = list_shift_value(to_delete);
-        while (item) {
-            if (cache->storage.remove)
-                cache->storage.remove(item->key, item->klen, cache->storage.priv);
-
-            SHC_DEBUG2("removed item %.*s", item->klen, item->key);
-
-            item = list_shift_value(to_delete);
-        }
+        pthread_cond_destroy(&ctx.cond);
+        MUTEX_DESTROY(ctx.throttle_lock);
+        MUTEX_DESTROY(ctx.lock);
+    }
 
+    if (!ctx.aborted) {
         // and now let's expire all the volatile keys that don't belong to us anymore
         ht_foreach_pair(cache->volatile_storage, expire_migrated, cache);
         //ATOMIC_SET(cache->next_expire, 0);
     }
 
-    list_destroy(to_delete);
+    list_destroy(ctx.queue);
+    ht_destroy(ctx.failed);
 
     SPIN_LOCK(cache->migration_lock);
     cache->migration_done = 1;
     SPIN_UNLOCK(cache->migration_lock);
-    if (index) {
-        SHC_INFO("Migrator ended: processed %d items, migrated %d, errors %d",
-                total_items, migrated_items, errors);
+    if (cache->use_persistent_storage) {
+        SHC_INFO("Migrator ended: processed %"PRIu64" items, migrated %"PRIu64" (%"PRIu64" bytes), errors %"PRIu64,
+                ctx.scanned_items, ctx.migrated_items, ctx.migrated_bytes, ctx.errors);
     }
 
-    if (index)
-        shardcache_free_index(index);
-
     shardcache_thread_end(cache);
     return NULL;
 }
@@ -2719,16 +4778,22 @@ shardcache_set_migration_continuum(shardcache_t *cache,
     size_t shard_lens[num_nodes];
     char *shard_names[num_nodes];
 
-    SPIN_LOCK(cache->migration_lock);
-
-    if (cache->migration) {
-        // already in a migration, ignore this command
-        SPIN_UNLOCK(cache->migration_lock);
+    // the table is built before taking the lock (it might take a while)
+    int mode = ATOMIC_READ(cache->routing_mode);
+    routing_table_t *table = shardcache_routing_table_create(cache, mode, nodes, num_nodes);
+    if (mode != SHARDCACHE_ROUTING_CHASH && !table)
         return -1;
-    }
 
-    if (shardcache_check_migration_continuum(cache, nodes, num_nodes) != 0) {
+    SPIN_LOCK(cache->migration_lock);
+
+    if (cache->migration || mode != cache->routing_mode ||
+        shardcache_check_migration_continuum(cache, nodes, num_nodes) != 0)
+    {
+        // already in a migration (or the routing mode changed meanwhile),
+        // ignore this command
         SPIN_UNLOCK(cache->migration_lock);
+        if (table)
+            routing_table_destroy(table);
         return -1;
     }
 
@@ -2751,6 +4816,8 @@ shardcache_set_migration_continuum(shardcache_t *cache,
                                     num_nodes,
                                     200);
 
+    ATOMIC_SET(cache->migration_routing, table);
+
     SPIN_UNLOCK(cache->migration_lock);
     return 0;
 }
@@ -2778,19 +4845,15 @@ shardcache_migration_begin_internal(shardcache_t *cache,
         for (i = 0; i < num_nodes; i++) {
             if (i > 0) 
                 fbuf_add(&mgb_message, ",");
-            int num_replicas = shardcache_node_num_addresses(nodes[i]);
             char *label = shardcache_node_get_label(nodes[i]);
-            int rindex = random()%num_replicas;
-            char *addr = shardcache_node_get_address_at_index(nodes[i], rindex);
+            char *addr = shardcache_node_get_address(nodes[i]);
             fbuf_printf(&mgb_message, "%s:%s", label, addr);
         }
 
         for (i = 0; i < cache->num_shards; i++) {
             if (strcmp(shardcache_node_get_label(cache->shards[i]), cache->me) != 0) {
-                int num_replicas = shardcache_node_num_addresses(nodes[i]);
-                char *label = shardcache_node_get_label(nodes[i]);
-                int rindex = random()%num_replicas;
-                char *addr = shardcache_node_get_address_at_index(nodes[i], rindex);
+                char *label = shardcache_node_get_label(cache->shards[i]);
+                char *addr = shardcache_node_get_address(cache->shards[i]);
                 int fd = shardcache_get_connection_for_peer(cache, addr);
                 int rc = migrate_peer(addr,
                                       fbuf_data(&mgb_message),
@@ -2831,11 +4894,14 @@ shardcache_migration_abort_internal(shardcache_t *cache)
         SHC_NOTICE("Migration aborted");
         ret = 0;
     }
+    routing_table_t *replaced = cache->migration_routing;
+    ATOMIC_SET(cache->migration_routing, NULL);
     cache->migration = NULL;
     cache->migration_shards = NULL;
     cache->num_migration_shards = 0;
 
     SPIN_UNLOCK(cache->migration_lock);
+    shardcache_routing_table_release(cache, replaced);
     pthread_join(cache->migrate_th, NULL);
     return ret;
 }
@@ -2852,11 +4918,15 @@ static int
 shardcache_migration_end_internal(shardcache_t *cache)
 {
     int ret = -1;
+    routing_table_t *replaced = NULL;
     SPIN_LOCK(cache->migration_lock);
     if (cache->migration) {
         chash_free(cache->chash);
         shardcache_free_nodes(cache->shards, cache->num_shards);
         cache->chash = cache->migration;
+        replaced = cache->routing;
+        ATOMIC_SET(cache->routing, cache->migration_routing);
+        ATOMIC_SET(cache->migration_routing, NULL);
         cache->shards = cache->migration_shards;
         cache->num_shards = cache->num_migration_shards;
         cache->migration = NULL;
@@ -2867,6 +4937,7 @@ shardcache_migration_end_internal(shardcache_t *cache)
     }
     cache->migration_done = 0;
     SPIN_UNLOCK(cache->migration_lock);
+    shardcache_routing_table_release(cache, replaced);
     pthread_join(cache->migrate_th, NULL);
     return ret;
 }
@@ -2911,6 +4982,23 @@ shardcache_get_set_option(int *option, int new_value)
     return old_value;
 }
 
+int
+shardcache_protocol_version(shardcache_t *cache, int new_value)
+{
+    if (new_value == 0)
+        new_value = SHC_PROTOCOL_VERSION;
+    else if (new_value > SHC_PROTOCOL_VERSION_MAX)
+        new_value = -1;
+
+    return shardcache_get_set_option(&cache->protocol_version, new_value);
+}
+
+int
+shardcache_compression_threshold(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->compression_threshold, new_value);
+}
+
 int
 shardcache_use_persistent_connections(shardcache_t *cache, int new_value)
 {
@@ -2926,6 +5014,58 @@ shardcache_arc_mode(shardcache_t *cache, arc_mode_t new_value)
     return old_value;
 }
 
+int
+shardcache_routing_mode(shardcache_t *cache, int new_value)
+{
+    if (new_value < 0)
+        return ATOMIC_READ(cache->routing_mode);
+
+    if (new_value > SHARDCACHE_ROUTING_JUMP)
+        return -1;
+
+    // NOTE: the tables are built with the migration lock held so that they
+    //       can't get out of sync with the continua, changing the mode is
+    //       expected to happen once (before starting to serve requests)
+    routing_table_t *replaced = NULL;
+    routing_table_t *replaced_migration = NULL;
+
+    SPIN_LOCK(cache->migration_lock);
+    int old_value = cache->routing_mode;
+    if (new_value != old_value) {
+        routing_table_t *table = shardcache_routing_table_create(cache, new_value,
+                                                                 cache->shards,
+                                                                 cache->num_shards);
+        routing_table_t *migration_table = NULL;
+        if (cache->migration)
+            migration_table = shardcache_routing_table_create(cache, new_value,
+                                                              cache->migration_shards,
+                                                              cache->num_migration_shards);
+
+        if (new_value != SHARDCACHE_ROUTING_CHASH &&
+            (!table || (cache->migration && !migration_table)))
+        {
+            if (table)
+                routing_table_destroy(table);
+            if (migration_table)
+                routing_table_destroy(migration_table);
+            SPIN_UNLOCK(cache->migration_lock);
+            return -1;
+        }
+
+        replaced = cache->routing;
+        replaced_migration = cache->migration_routing;
+        ATOMIC_SET(cache->routing, table);
+        ATOMIC_SET(cache->migration_routing, migration_table);
+        ATOMIC_SET(cache->routing_mode, new_value);
+    }
+    SPIN_UNLOCK(cache->migration_lock);
+
+    shardcache_routing_table_release(cache, replaced);
+    shardcache_routing_table_release(cache, replaced_migration);
+
+    return old_value;
+}
+
 int
 shardcache_cache_on_set(shardcache_t *cache, int new_value)
 {
@@ -2978,8 +5118,104 @@ shardcache_lazy_expiration(shardcache_t *cache, int new_value)
     return shardcache_get_set_option(&cache->lazy_expiration, new_value);
 }
 
+int
+shardcache_storage_io_threads(shardcache_t *cache, int new_value)
+{
+    int old_value = shardcache_get_set_option(&cache->storage_io_threads, new_value);
+
+    if (new_value >= 0 && new_value != old_value && shardcache_storage_io_setup(cache) != 0) {
+        SHC_ERROR("Can't start %d storage i/o threads", new_value);
+        ATOMIC_SET(cache->storage_io_threads, old_value);
+        return -1;
+    }
+
+    return old_value;
+}
+
+int
+shardcache_storage_batch_size(shardcache_t *cache, int new_value)
+{
+    int old_value = shardcache_get_set_option(&cache->storage_batch_size, new_value);
+
+    if (new_value >= 0 && new_value != old_value && shardcache_storage_io_setup(cache) != 0) {
+        SHC_ERROR("Can't restart the storage i/o threads with batches of %d keys", new_value);
+        ATOMIC_SET(cache->storage_batch_size, old_value);
+        return -1;
+    }
+
+    return old_value;
+}
+
+int
+shardcache_storage_batch_window(shardcache_t *cache, int new_value)
+{
+    int old_value = shardcache_get_set_option(&cache->storage_batch_window, new_value);
+
+    if (new_value >= 0 && new_value != old_value && shardcache_storage_io_setup(cache) != 0) {
+        SHC_ERROR("Can't restart the storage i/o threads with a %d usecs batch window", new_value);
+        ATOMIC_SET(cache->storage_batch_window, old_value);
+        return -1;
+    }
+
+    return old_value;
+}
+
+int
+shardcache_migration_threads(shardcache_t *cache, int new_value)
+{
+    if (new_value == 0)
+        new_value = SHARDCACHE_MIGRATION_THREADS_DEFAULT;
+
+    return shardcache_get_set_option(&cache->migration_threads, new_value);
+}
+
+int
+shardcache_migration_batch_size(shardcache_t *cache, int new_value)
+{
+    if (new_value == 0)
+        new_value = SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT;
+
+    return shardcache_get_set_option(&cache->migration_batch_size, new_value);
+}
+
+int
+shardcache_migration_max_rate(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->migration_max_rate, new_value);
+}
+
+int
+shardcache_migration_max_bandwidth(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->migration_max_bandwidth, new_value);
+}
+
+int
+shardcache_migration_checkpoint(shardcache_t *cache, char *path)
+{
+    char *new_path = path ? strdup(path) : NULL;
+    if (path && !new_path)
+        return -1;
+
+    SPIN_LOCK(cache->migration_lock);
+    char *old_path = cache->migration_checkpoint;
+    cache->migration_checkpoint = new_path;
+    SPIN_UNLOCK(cache->migration_lock);
+
+    free(old_path);
+    return 0;
+}
+
+void
+shardcache_messaging_settings(shardcache_t *cache)
+{
+    messaging_thread_settings(ATOMIC_READ(cache->protocol_version),
+                              ATOMIC_READ(cache->compression_threshold));
+}
+
 void shardcache_thread_init(shardcache_t *cache)
 {
+    shardcache_messaging_settings(cache);
     if (cache->storage.thread_start)
         cache->storage.thread_start(cache->storage.priv);
 }
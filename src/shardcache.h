@@ -34,6 +34,24 @@ typedef struct _shardcache_s shardcache_t;
                                                      // requests to handle ahead
 #define SHARDCACHE_ASYNC_THREADS_NUM_DEFAULT  1      // number of async i/o threads used
                                                      // for inter-node communication
+#define SHARDCACHE_COMPRESSION_THRESHOLD_DEFAULT 4096 // (in bytes) records bigger than this
+                                                        // are compressed (protocol version 3)
+#define SHARDCACHE_STORAGE_IO_THREADS_DEFAULT 8      // number of threads running the synchronous
+                                                     // storage fetches on behalf of the workers
+#define SHARDCACHE_STORAGE_IO_QUEUE_SIZE      1024   // max number of storage fetches waiting
+                                                     // for a storage i/o thread
+#define SHARDCACHE_STORAGE_BATCH_SIZE_DEFAULT 32     // max number of concurrent misses
+                                                     // coalesced in a single fetch_multi
+#define SHARDCACHE_STORAGE_BATCH_WINDOW_DEFAULT 200  // (in microsecs) max time a miss waits
+                                                     // for other misses to be coalesced with
+#define SHARDCACHE_WRITE_BEHIND_MAX_PENDING_DEFAULT 65536 // max number of keys waiting to be
+                                                          // written to the storage in write-behind mode
+#define SHARDCACHE_MIGRATION_THREADS_DEFAULT 4        // number of threads copying the keys
+                                                     // to their new owners during a migration
+#define SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT 64   // max number of keys sent at once
+                                                     // to a peer during a migration
+#define SHARDCACHE_MIGRATION_CHECKPOINT_INTERVAL 5   // (in secs) how often the progress of a
+                                                     // migration is saved (if enabled)
 extern const char *LIBSHARDCACHE_VERSION;
 extern const char *LIBSHARDCACHE_BUILD_INFO;
 
@@ -101,6 +119,117 @@ shardcache_t *shardcache_create(char *me,
                         int num_async,
                         size_t cache_size);
 
+/**
+ * @brief Persist the volatile keys to an append-only log so that they
+ *        survive restarts
+ * @param cache        A valid pointer to a shardcache_t structure
+ * @param path         The directory where the log will be stored, the instance
+ *                     will use a subdirectory named after its node label.
+ *                     If NULL persistence of the volatile keys will be disabled
+ *                     (and the log closed, if it was open)
+ * @param segment_size The size of the log segments (if 0 the default
+ *                     VOLATILE_STORE_SEGMENT_SIZE_DEFAULT will be used)
+ * @return 0 on success, -1 otherwise (or if the log is already enabled)
+ * @note The existing log is replayed (in parallel, using as many threads as
+ *       the number of cpus) into the volatile storage, the keys set before
+ *       calling this function take precedence over the replayed records and
+ *       are written to the log as well. Updates of the volatile keys are
+ *       blocked while the log is being replayed, so it's better to enable
+ *       it right after creating the instance
+ * @note Data is written to the log through memory-mappings and is never
+ *       explicitly synced to disk, so it survives restarts and crashes of
+ *       the process, but not crashes of the host. The space for the segments
+ *       is reserved when they are created, so running out of disk space makes
+ *       the writes to the log fail instead of crashing the process
+ */
+int shardcache_volatile_store(shardcache_t *cache, char *path, size_t segment_size);
+
+/**
+ * @brief Get/Set the number of threads used to run the synchronous fetch
+ *        callback of the storage when serving asynchronous requests
+ * @param cache     A valid pointer to a shardcache_t structure
+ * @param new_value The new number of threads, if 0 the fetch callback will
+ *                  be run directly by the worker threads (blocking them
+ *                  until the storage returns).
+ *                  If negative the actual value is returned without changing it
+ * @return the previous value, -1 if the new threads can't be started
+ *         (the old ones are kept in this case)
+ * @note The threads are replaced at runtime, the fetches already queued to the
+ *       old threads are completed before returning
+ * @note The storage i/o threads are not used if the storage implements
+ *       the fetch_async callback.\n
+ *       When all the threads are busy and SHARDCACHE_STORAGE_IO_QUEUE_SIZE fetches
+ *       are already queued, new fetches will be run directly by the workers
+ * @note defaults to SHARDCACHE_STORAGE_IO_THREADS_DEFAULT
+ */
+int shardcache_storage_io_threads(shardcache_t *cache, int new_value);
+
+/**
+ * @brief Get/Set the max number of concurrent misses coalesced into a single
+ *        call to the fetch_multi callback of the storage
+ * @param cache     A valid pointer to a shardcache_t structure
+ * @param new_value The new max number of keys in a batch, if 1 or 0 the misses
+ *                  won't be coalesced.
+ *                  If negative the actual value is returned without changing it
+ * @return the previous value, -1 if the storage i/o threads can't be restarted
+ * @note Changing it restarts the storage i/o threads (see shardcache_storage_io_threads())
+ * @note Misses are coalesced only if the storage implements the fetch_multi
+ *       callback (but not the fetch_async one) and the storage i/o threads
+ *       are enabled (see shardcache_storage_io_threads()).\n
+ *       If the storage i/o threads can't keep up, up to STORAGE_IO_BATCHER_MAX_PENDING
+ *       batches are collected, then the misses are fetched directly by the workers
+ * @note defaults to SHARDCACHE_STORAGE_BATCH_SIZE_DEFAULT
+ */
+int shardcache_storage_batch_size(shardcache_t *cache, int new_value);
+
+/**
+ * @brief Get/Set the max time a miss waits for other misses to be coalesced with
+ * @param cache     A valid pointer to a shardcache_t structure
+ * @param new_value The new time window (in microseconds).
+ *                  If negative the actual value is returned without changing it
+ * @return the previous value, -1 if the storage i/o threads can't be restarted
+ * @note A batch is sent to the storage as soon as it's full,
+ *       even if the time window didn't pass yet
+ * @note Changing it restarts the storage i/o threads (see shardcache_storage_io_threads())
+ * @note defaults to SHARDCACHE_STORAGE_BATCH_WINDOW_DEFAULT
+ */
+int shardcache_storage_batch_window(shardcache_t *cache, int new_value);
+
+/**
+ * @brief Enable/Disable the write-behind mode for the updates to the persistent storage
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param num_threads The number of threads writing the queued updates to the storage,
+ *                    if 0 the write-behind mode will be disabled and the storage
+ *                    will be updated synchronously (the default)
+ * @param max_pending The max number of keys waiting to be written to the storage,
+ *                    once reached new updates block until the queue drains
+ *                    (if 0 SHARDCACHE_WRITE_BEHIND_MAX_PENDING_DEFAULT will be used)
+ * @param path        The directory where the log backing the queue will be stored,
+ *                    the instance will use a subdirectory named after its node label.
+ *                    If NULL the queue is kept only in memory and the pending updates
+ *                    are lost if the process crashes
+ * @return 0 on success, -1 otherwise (the write-behind mode is disabled in this case)
+ * @note It can be called at any time, the updates pending in the current queue
+ *       (if any) are written to the storage before the new one is created
+ * @note It has no effect if the persistent storage is not used
+ *       or if it doesn't support stores
+ * @note In write-behind mode a SET is acknowledged as soon as it has been queued,
+ *       updates of the same key still waiting to be written are coalesced and
+ *       each writer thread takes all the keys queued so far at each round.
+ *       Gets of a key with a pending update are served from the queue.\n
+ *       ADD, CAS and increments (which need the current value in the storage)
+ *       write the pending update of the key synchronously before running
+ *       and fail if it can't be written.\n
+ *       Failed writes are retried with an exponential backoff, updates still
+ *       failing after 10 attempts are dropped (and
+ *       accounted in the write_behind_dropped counter).
+ *       All the pending updates are written before shardcache_destroy() returns
+ * @note The log is written through memory-mappings (see shardcache_volatile_store())
+ *       and replayed when the queue is created, so the queued updates survive restarts
+ *       and crashes of the process, but not crashes of the host
+ */
+int shardcache_write_behind(shardcache_t *cache, int num_threads, int max_pending, char *path);
+
 
 
 typedef enum {
@@ -112,6 +241,32 @@ int shardcache_arc_mode(shardcache_t *cache, arc_mode_t new_value);
 
 int shardcache_cache_on_set(shardcache_t *cache, int new_value);
 
+typedef enum {
+    SHARDCACHE_ROUTING_CHASH = 0, // chash_lookup() on each key (the default)
+    SHARDCACHE_ROUTING_TABLE = 1, // the chash continuum split in 64K buckets
+    SHARDCACHE_ROUTING_JUMP  = 2  // jump consistent hashing
+} shardcache_routing_mode_t;
+
+/*
+ * @brief Allows to change the way the owner of a key is determined
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The new routing mode (see shardcache_routing_mode_t).\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status).
+ * @return the previous value for the routing_mode setting, -1 if the
+ *         tables for the new mode couldn't be built
+ * @note The table and jump modes use a routing table built for the current
+ *       (and the migration) continuum, so looking up the owner of a key
+ *       costs a single hash and doesn't take any lock. The tables are
+ *       rebuilt when a migration begins and swapped when it ends.
+ * @note The chash and table modes assign the keys the same way, the jump
+ *       mode doesn't: if used, all the nodes (and the clients, see
+ *       shardcache_client_routing_mode()) MUST use it
+ * @note defaults to SHARDCACHE_ROUTING_CHASH
+ */
+int shardcache_routing_mode(shardcache_t *cache, int new_value);
+
 /*
  * @brief Allows to change the evict_on_delete behaviour at runtime
  * @param cache       A valid pointer to a shardcache_t structure
@@ -176,6 +331,35 @@ int shardcache_tcp_timeout(shardcache_t *cache, int new_value);
  */
 int shardcache_conn_expire_time(shardcache_t *cache, int new_value);
 
+/*
+ * @brief Allows to change the protocol version used for outgoing messages
+ *        (commands forwarded to peers, evictions and replica messages)
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The protocol version to use (1 up to SHC_PROTOCOL_VERSION_MAX)\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status)
+ * @return the previous value for the protocol_version setting
+ * @note Incoming messages are accepted in any supported version and responses
+ *       always use the same version of the request, so version 3 can be enabled
+ *       once all the nodes in the cluster have been upgraded
+ * @note defaults to SHC_PROTOCOL_VERSION
+ */
+int shardcache_protocol_version(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the size above which records are compressed
+ *        when using protocol version 3 (both in requests and responses)
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The threshold in bytes (0 disables compression)\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status)
+ * @return the previous value for the compression_threshold setting
+ * @note defaults to SHARDCACHE_COMPRESSION_THRESHOLD_DEFAULT
+ */
+int shardcache_compression_threshold(shardcache_t *cache, int new_value);
+
 /*
  * @brief Allows to change the timeout passed to iomux_run()
  *               by the serving workers and the async reader
@@ -265,6 +449,44 @@ void shardcache_set_size(shardcache_t *cache, size_t new_size);
 
 int shardcache_set_workers_num(shardcache_t *cache, unsigned int num_workers);
 
+/**
+ * @brief Save the content of the cache (the objects in the mru and mfu lists,
+ *        their timestamps and the arc 'p' marker) to a snapshot file
+ * @param cache   A valid pointer to a shardcache_t structure
+ * @param path    The path of the snapshot file (an existing file will be
+ *                atomically replaced once the snapshot is complete)
+ * @return The number of objects saved to the snapshot, -1 in case of errors
+ * @note The cache is not locked while the snapshot is being taken
+ *       (so it can be done while serving requests)
+ */
+int shardcache_cache_dump(shardcache_t *cache, char *path);
+
+/**
+ * @brief Load the objects saved by shardcache_cache_dump() into the cache
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param path        The path of the snapshot file
+ * @param num_threads The number of threads to use to restore the objects
+ * @return The number of objects restored, -1 in case of errors
+ * @note Objects which would have already expired, whose owner is not the same
+ *       anymore or which are already in the cache are skipped.
+ *       The chunks are decoded in parallel but added to the cache in the
+ *       same order they have been saved, so the recency order is preserved
+ */
+int shardcache_cache_restore(shardcache_t *cache, char *path, int num_threads);
+
+/**
+ * @brief Accept connections on a unix domain socket as well
+ * @param cache   A valid pointer to a shardcache_t structure
+ * @param path    The path of the socket (an existing file will be replaced)
+ * @return 0 on success, -1 otherwise
+ * @note Clients running on the same host can connect to the socket using
+ *       "unix:<path>" as node address, avoiding the tcp loopback overhead,
+ *       or "shm:<path>" to exchange messages through a shared memory channel
+ *       (supported only on linux)
+ * @note Can be called only once, the socket is removed by shardcache_destroy()
+ */
+int shardcache_listen_unix(shardcache_t *cache, char *path);
+
 /**
  * @brief Get partial value data value for a key
  * @param cache   A valid pointer to a shardcache_t structure
@@ -687,6 +909,35 @@ int shardcache_test_ownership(shardcache_t *cache,
  */
 shardcache_storage_index_t *shardcache_get_index(shardcache_t *cache);
 
+/**
+ * @brief The number of index items requested (and sent) at each round
+ *        when scanning the index of a remote node
+ */
+#define SHARDCACHE_INDEX_CHUNK_SIZE 4096
+
+/**
+ * @brief Scan the index of keys managed by the specific shardcache instance
+ *        a chunk at a time, without holding the whole index in memory
+ * @param cache  A valid pointer to a shardcache_t structure
+ * @param cursor A pointer to the scan cursor, which must be set to 0 to start
+ *               a new scan. It's updated at each call and it's set back to 0
+ *               once the scan is complete
+ * @param items  An array where to store the items of the next chunk
+ * @param isize  The number of slots in the items array
+ * @return The number of items stored in the items array (which can be 0 even
+ *         if the scan is not complete yet);\n
+ *         -1 if the storage module doesn't support scanning the index
+ *         (in which case shardcache_get_index() must be used instead)
+ * @note The caller MUST release the keys of the returned items using free()
+ * @note The keys existing for the whole duration of the scan are returned
+ *       at least once, while keys added or removed during the scan
+ *       might be returned or not
+ */
+int shardcache_scan_index(shardcache_t *cache,
+                          uint64_t *cursor,
+                          shardcache_storage_index_item_t *items,
+                          size_t isize);
+
 /**
  * @brief Release all resources used by the index provided as argument
  * @param index A pointer to a valid shardcache_storage_index_t structure
@@ -727,6 +978,71 @@ int shardcache_migration_abort(shardcache_t *cache);
  */
 int shardcache_migration_end(shardcache_t *cache);
 
+/**
+ * @brief Get/Set the number of threads copying the keys to their new owners
+ *        during a migration
+ * @param cache     A valid pointer to a shardcache_t structure
+ * @param new_value The new number of threads (if 0 SHARDCACHE_MIGRATION_THREADS_DEFAULT
+ *                  will be used).\n
+ *                  If negative the actual value is returned without changing it
+ * @return the previous value
+ * @note It affects only the migrations started after calling it
+ * @note The index is scanned by the migration thread which groups the keys
+ *       to migrate by destination, each group is then fetched from the storage
+ *       and sent to the new owner (using a single connection and pipelining
+ *       the commands) by one of the migration threads
+ */
+int shardcache_migration_threads(shardcache_t *cache, int new_value);
+
+/**
+ * @brief Get/Set the max number of keys sent at once to a peer during a migration
+ * @param cache     A valid pointer to a shardcache_t structure
+ * @param new_value The new batch size (if 0 SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT
+ *                  will be used).\n
+ *                  If negative the actual value is returned without changing it
+ * @return the previous value
+ * @note It affects only the migrations started after calling it
+ */
+int shardcache_migration_batch_size(shardcache_t *cache, int new_value);
+
+/**
+ * @brief Get/Set the max number of keys migrated per second
+ * @param cache     A valid pointer to a shardcache_t structure
+ * @param new_value The max number of keys per second, 0 means no limit (the default).\n
+ *                  If negative the actual value is returned without changing it
+ * @return the previous value
+ * @note It can be changed while a migration is in progress,
+ *       to avoid starving the live traffic
+ */
+int shardcache_migration_max_rate(shardcache_t *cache, int new_value);
+
+/**
+ * @brief Get/Set the max number of bytes (of values) migrated per second
+ * @param cache     A valid pointer to a shardcache_t structure
+ * @param new_value The max number of bytes per second, 0 means no limit (the default).\n
+ *                  If negative the actual value is returned without changing it
+ * @return the previous value
+ * @note It can be changed while a migration is in progress,
+ *       to avoid starving the live traffic
+ */
+int shardcache_migration_max_bandwidth(shardcache_t *cache, int new_value);
+
+/**
+ * @brief Save the progress of the migrations to a file
+ *
+ *        Every SHARDCACHE_MIGRATION_CHECKPOINT_INTERVAL seconds the position
+ *        in the index (and the keys which couldn't be migrated) are saved to 'path',
+ *        so that a migration to the same nodes which has been aborted (or interrupted
+ *        by a restart) resumes from there instead of starting over
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param path  The path of the checkpoint file, if NULL checkpoints are disabled
+ *              (the default)
+ * @return 0 on success, -1 otherwise
+ * @note Checkpoints are used only if the storage implements the scan_index callback
+ * @note The checkpoint file is removed once a migration completes
+ */
+int shardcache_migration_checkpoint(shardcache_t *cache, char *path);
+
 
 /**
  * @brief   Notify the internal shardcache core about a new woerker thread which might
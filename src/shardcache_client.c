@@ -1,230 +1,1724 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <chash.h>
 #include <fbuf.h>
 #include <rbuf.h>
 #include <linklist.h>
 #include <queue.h>
 #include <iomux.h>
+#include <bsd_queue.h>
 
 #include <pthread.h>
 
 #include "connections.h"
 #include "messaging.h"
 #include "connections_pool.h"
+#include "routing_table.h"
+#include "epoch.h"
 #include "shardcache_internal.h"
 #include "shardcache_client.h"
 
 #define SHC_PIPELINE_MAX_DEFAULT SHARDCACHE_SERVING_LOOK_AHEAD_DEFAULT
 
+// seconds to wait before trying again to open a shm channel to a node
+#define SHC_SHM_RETRY_INTERVAL 5
+
+// max number of keys requested with a single GET_MULTI command
+#define SHC_MULTI_COMMAND_MAX_KEYS_DEFAULT 256
+
+// seconds to wait before trying again to send GET_MULTI commands
+// to a node which didn't understand them (pipelined GETs are used meanwhile)
+#define SHC_MULTI_COMMAND_RETRY_INTERVAL 300
+
+// seconds to wait before trying again to subscribe to the invalidations of a node
+#define SHC_NEAR_CACHE_RETRY_INTERVAL 2
+
+// size of the reads done by the get streams (and max size of the chunks they return)
+#define SHC_STREAM_READ_SIZE 65536
+
+// max number of single-key gets collected in the same batch
+// (see shardcache_client_auto_multi_window())
+#define SHC_AUTO_MULTI_MAX_KEYS_DEFAULT 128
+
+// number of invalidation counters the keys are spread on
+#define SHC_NEAR_CACHE_EPOCHS 4096
+
+typedef struct _shc_near_cache_s shc_near_cache_t;
+
+typedef struct _shc_auto_multi_batch_s shc_auto_multi_batch_t;
+
+// the topology of the cluster as known by the nodes (see shardcache_client_topology_refresh()).
+// A topology is never modified once published and, when replaced, it's released only
+// after the threads routing through it are done (see shc_topology_refresh())
+typedef struct _shc_topology_s {
+    uint32_t version;
+    chash_t *chash;
+    shardcache_node_t **nodes;
+    int num_nodes;
+    // the continuum the keys are being moved to (NULL if no migration is in progress)
+    chash_t *migration;
+    shardcache_node_t **migration_nodes;
+    int num_migration_nodes;
+    // the routing tables built on both continua (NULL in the chash routing mode)
+    routing_table_t *routing;
+    routing_table_t *migration_routing;
+    // the nodes unknown to the client when it has been created, the known ones
+    // are referenced from the shards array instead (to use the configured addresses).
+    // Both are owned by the client, the threads might still reference them
+    // (as their current node) after the topology has been replaced
+    shardcache_node_t **new_nodes;
+    int num_new_nodes;
+} shc_topology_t;
+
+// per-thread state of a client, the same client can be shared among
+// multiple threads and each of them gets its own error state, its own
+// current node and its own shm channels (which can't be shared)
+typedef struct _shardcache_client_tls_s {
+    shardcache_client_t *client;
+    int error;
+    char errstr[1024];
+    shardcache_node_t *current_node;
+    unsigned int seed;
+    // shared memory channels to the nodes configured with a "shm:<path>"
+    // address (indexed as the shards array)
+    shm_channel_t **shm_channels;
+    time_t *shm_failures;
+    // set by the near cache when a miss has been fetched by this thread
+    int near_fetched;
+    // the address (replica) of the node selected for the command in progress
+    // (see shardcache_node_address_begin())
+    shardcache_node_t *tracked_node;
+    int tracked_index;
+    struct timeval tracked_start;
+    struct _shardcache_client_tls_s *prev;
+    struct _shardcache_client_tls_s *next;
+} shardcache_client_tls_t;
+
 struct shardcache_client_s {
     chash_t *chash;
     shardcache_node_t **shards;
     connections_pool_t *connections;
     int num_shards;
     int use_random_node;
-    shardcache_node_t *current_node;
     int pipeline_max;
-    int errno;
     int multi_command_max_wait;
-    char errstr[1024];
+    int multi_command_max_keys;
+    // last time a node failed to answer a GET_MULTI command
+    // (indexed as the shards array)
+    time_t *multi_failures;
     queue_t *async_jobs;
     pthread_t thread;
     pthread_cond_t wakeup_cond;
     pthread_mutex_t wakeup_lock;
     int quit;
+    pthread_key_t tls_key;
+    pthread_mutex_t tls_lock; // serializes access to the tls list
+    shardcache_client_tls_t *tls;
+    // returned by the accessors if the thread state can't be allocated
+    shardcache_client_tls_t fallback_tls;
+    // local copy of the values (see shardcache_client_near_cache_enable())
+    shc_near_cache_t *near_cache;
+    // the topology fetched from the nodes, NULL until the first refresh
+    // (the continuum built on the shards array is used meanwhile).
+    // Readers access it only within an epoch read section
+    shc_topology_t *topology;
+    epoch_t *epoch;
+    // the nodes learned from the topologies (and not in the shards array),
+    // kept until the client is destroyed
+    shardcache_node_t **learned_nodes;
+    int num_learned_nodes;
+    pthread_mutex_t topology_lock; // serializes the refreshes
+    int topology_check_interval;
+    time_t topology_checked;
+    // see shardcache_client_routing_mode(), the table built on the shards array
+    // is replaced only with the topology lock held (and read within an epoch
+    // read section, as the topology)
+    int routing_mode;
+    routing_table_t *routing;
+    // single-key gets collected to be sent together (see shardcache_client_auto_multi_window())
+    int auto_multi_window;
+    int auto_multi_max_keys;
+    int protocol_version;      // see shardcache_client_protocol_version()
+    int compression_threshold; // see shardcache_client_compression_threshold()
+    shc_auto_multi_batch_t *auto_multi_batch; // the batch still accepting keys
+    pthread_mutex_t auto_multi_lock;
+    pthread_cond_t auto_multi_full; // signaled when the open batch reaches the max number of keys
+};
+
+static void
+shardcache_client_tls_free(shardcache_client_tls_t *tls)
+{
+    int i;
+    for (i = 0; tls->shm_channels && i < tls->client->num_shards; i++) {
+        if (tls->shm_channels[i])
+            shm_channel_destroy(tls->shm_channels[i]);
+    }
+    free(tls->shm_channels);
+    free(tls->shm_failures);
+    free(tls);
+}
+
+static void
+shardcache_client_tls_release(void *ptr)
+{
+    shardcache_client_tls_t *tls = (shardcache_client_tls_t *)ptr;
+    shardcache_client_t *c = tls->client;
+
+    MUTEX_LOCK(c->tls_lock);
+    if (tls->prev)
+        tls->prev->next = tls->next;
+    else
+        c->tls = tls->next;
+    if (tls->next)
+        tls->next->prev = tls->prev;
+    MUTEX_UNLOCK(c->tls_lock);
+
+    shardcache_client_tls_free(tls);
+}
+
+static inline shardcache_client_tls_t *
+shardcache_client_tls(shardcache_client_t *c)
+{
+    shardcache_client_tls_t *tls = pthread_getspecific(c->tls_key);
+    if (__builtin_expect(tls != NULL, 1))
+        return tls;
+
+    tls = calloc(1, sizeof(shardcache_client_tls_t));
+    if (!tls)
+        return &c->fallback_tls;
+
+    tls->client = c;
+    tls->shm_channels = calloc(c->num_shards, sizeof(shm_channel_t *));
+    tls->shm_failures = calloc(c->num_shards, sizeof(time_t));
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    tls->seed = (unsigned int)(tv.tv_usec ^ (uintptr_t)tls);
+
+    if (!tls->shm_channels || !tls->shm_failures ||
+        pthread_setspecific(c->tls_key, tls) != 0)
+    {
+        free(tls->shm_channels);
+        free(tls->shm_failures);
+        free(tls);
+        return &c->fallback_tls;
+    }
+
+    MUTEX_LOCK(c->tls_lock);
+    tls->next = c->tls;
+    if (c->tls)
+        c->tls->prev = tls;
+    c->tls = tls;
+    MUTEX_UNLOCK(c->tls_lock);
+
+    return tls;
+}
+
+static void
+shardcache_client_set_error(shardcache_client_t *c, int error, const char *fmt, ...)
+    __attribute__ ((format (printf, 3, 4)));
+
+static void
+shardcache_client_set_error(shardcache_client_t *c, int error, const char *fmt, ...)
+{
+    shardcache_client_tls_t *tls = shardcache_client_tls(c);
+    if (tls == &c->fallback_tls)
+        return;
+    tls->error = error;
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(tls->errstr, sizeof(tls->errstr), fmt, args);
+    va_end(args);
+}
+
+static inline void
+shardcache_client_clear_error(shardcache_client_t *c)
+{
+    shardcache_client_tls_t *tls = shardcache_client_tls(c);
+    if (tls == &c->fallback_tls)
+        return;
+    tls->error = SHARDCACHE_CLIENT_OK;
+    tls->errstr[0] = 0;
+}
+
+// addr is NULL when no node could be selected for the command
+static void
+shardcache_client_set_connect_error(shardcache_client_t *c, char *addr)
+{
+    if (addr)
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NETWORK,
+                                    "Can't connect to '%s'", addr);
+    else
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NETWORK,
+                                    "No node available");
+}
+
+int
+shardcache_client_tcp_timeout(shardcache_client_t *c, int new_value)
+{
+    return connections_pool_tcp_timeout(c->connections, new_value);
+}
+
+int shardcache_client_check_connection_timeout(shardcache_client_t *c, int new_value)
+{
+    return connections_pool_expire_time(c->connections, new_value);
+}
+
+int
+shardcache_client_protocol_version(shardcache_client_t *c, int new_value)
+{
+    int old_value = ATOMIC_READ(c->protocol_version);
+
+    if (new_value > 0 && new_value <= SHC_PROTOCOL_VERSION_MAX)
+        ATOMIC_SET(c->protocol_version, new_value);
+
+    return old_value;
+}
+
+int
+shardcache_client_compression_threshold(shardcache_client_t *c, int new_value)
+{
+    int old_value = ATOMIC_READ(c->compression_threshold);
+
+    if (new_value >= 0)
+        ATOMIC_SET(c->compression_threshold, new_value);
+
+    return old_value;
+}
+
+// the messages sent by the calling thread on behalf of
+// the client use the settings of the client
+static inline void
+shc_messaging_settings(shardcache_client_t *c)
+{
+    messaging_thread_settings(ATOMIC_READ(c->protocol_version),
+                              ATOMIC_READ(c->compression_threshold));
+}
+
+static inline int
+shc_connection_get(shardcache_client_t *c, char *addr)
+{
+    shc_messaging_settings(c);
+    return connections_pool_get(c->connections, addr);
+}
+
+int
+shardcache_client_use_random_node(shardcache_client_t *c, int new_value)
+{
+    int old_value = ATOMIC_READ(c->use_random_node);
+    ATOMIC_SET(c->use_random_node, new_value);
+    return old_value;
+}
+
+int
+shardcache_client_multi_command_max_wait(shardcache_client_t *c, int new_value)
+{
+    int old_value = ATOMIC_READ(c->multi_command_max_wait);
+    ATOMIC_SET(c->multi_command_max_wait, new_value);
+    return old_value;
+}
+
+int
+shardcache_client_pipeline_max(shardcache_client_t *c, int new_value)
+{
+    int old_value = ATOMIC_READ(c->pipeline_max);
+    if (new_value >= 0)
+        ATOMIC_SET(c->pipeline_max, new_value);
+    return old_value;
+}
+
+int
+shardcache_client_multi_command_max_keys(shardcache_client_t *c, int new_value)
+{
+    int old_value = ATOMIC_READ(c->multi_command_max_keys);
+    if (new_value >= 0)
+        ATOMIC_SET(c->multi_command_max_keys, new_value);
+    return old_value;
+}
+
+int
+shardcache_client_auto_multi_window(shardcache_client_t *c, int new_value)
+{
+    int old_value = ATOMIC_READ(c->auto_multi_window);
+    if (new_value >= 0)
+        ATOMIC_SET(c->auto_multi_window, new_value);
+    return old_value;
+}
+
+int
+shardcache_client_auto_multi_max_keys(shardcache_client_t *c, int new_value)
+{
+    int old_value = ATOMIC_READ(c->auto_multi_max_keys);
+    if (new_value > 0)
+        ATOMIC_SET(c->auto_multi_max_keys, new_value);
+    return old_value;
+}
+
+int
+shardcache_client_topology_check_interval(shardcache_client_t *c, int new_value)
+{
+    int old_value = ATOMIC_READ(c->topology_check_interval);
+    if (new_value >= 0)
+        ATOMIC_SET(c->topology_check_interval, new_value);
+    return old_value;
+}
+
+static int shc_topology_refresh(shardcache_client_t *c, int force);
+
+int
+shardcache_client_routing_mode(shardcache_client_t *c, int new_value)
+{
+    if (new_value < 0)
+        return ATOMIC_READ(c->routing_mode);
+
+    if (new_value > SHARDCACHE_ROUTING_JUMP)
+        return -1;
+
+    routing_table_t *replaced = NULL;
+
+    MUTEX_LOCK(c->topology_lock);
+    int old_value = c->routing_mode;
+    if (new_value != old_value) {
+        char *labels[c->num_shards];
+        int i;
+        for (i = 0; i < c->num_shards; i++)
+            labels[i] = shardcache_node_get_label(c->shards[i]);
+
+        routing_table_t *table = NULL;
+        if (new_value != SHARDCACHE_ROUTING_CHASH) {
+            table = routing_table_create(new_value, labels, c->num_shards, NULL);
+            if (!table) {
+                MUTEX_UNLOCK(c->topology_lock);
+                shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_INTERNAL,
+                                            "Can't create the routing table");
+                return -1;
+            }
+        }
+        replaced = c->routing;
+        ATOMIC_SET(c->routing, table);
+        ATOMIC_SET(c->routing_mode, new_value);
+    }
+    MUTEX_UNLOCK(c->topology_lock);
+
+    if (replaced) {
+        epoch_synchronize(c->epoch);
+        routing_table_destroy(replaced);
+    }
+
+    // the tables of the known topology must be rebuilt as well
+    if (new_value != old_value && ATOMIC_READ(c->topology))
+        shc_topology_refresh(c, 1);
+
+    return old_value;
+}
+
+shardcache_client_t *
+shardcache_client_create(shardcache_node_t **nodes, int num_nodes)
+{
+    int i;
+    if (!num_nodes) {
+        SHC_ERROR("Can't create a shardcache client with no nodes");
+        return NULL;
+    }
+    shardcache_client_t *c = calloc(1, sizeof(shardcache_client_t));
+    if (pthread_key_create(&c->tls_key, shardcache_client_tls_release) != 0) {
+        SHC_ERROR("Can't create the thread-local key for the shardcache client");
+        free(c);
+        return NULL;
+    }
+    size_t shard_lens[num_nodes];
+    char *shard_names[num_nodes];
+
+    c->shards = malloc(sizeof(shardcache_node_t *) * num_nodes);
+    c->connections = connections_pool_create(SHARDCACHE_TCP_TIMEOUT_DEFAULT,
+                                             SHARDCACHE_CONNECTION_EXPIRE_DEFAULT,
+                                             1);
+    for (i = 0; i < num_nodes; i++) {
+        c->shards[i] = shardcache_node_copy(nodes[i]);
+
+        shard_names[i] = shardcache_node_get_label(c->shards[i]);
+        shard_lens[i] = strlen(shard_names[i]);
+    }
+
+    c->num_shards = num_nodes;
+
+    c->chash = chash_create((const char **)shard_names, shard_lens, c->num_shards, 200);
+
+    MUTEX_INIT(c->tls_lock);
+    c->fallback_tls.client = c;
+    c->fallback_tls.error = SHARDCACHE_CLIENT_ERROR_INTERNAL;
+    snprintf(c->fallback_tls.errstr, sizeof(c->fallback_tls.errstr),
+             "Can't allocate the thread state");
+
+    c->pipeline_max = SHC_PIPELINE_MAX_DEFAULT;
+    c->multi_command_max_keys = SHC_MULTI_COMMAND_MAX_KEYS_DEFAULT;
+    c->multi_failures = calloc(num_nodes, sizeof(time_t));
+
+    c->async_jobs = queue_create();
+    MUTEX_INIT(c->wakeup_lock);
+    CONDITION_INIT(c->wakeup_cond);
+
+    MUTEX_INIT(c->topology_lock);
+    c->epoch = epoch_create();
+
+    // the keys are routed through the continuum until a routing
+    // table is requested (see shardcache_client_routing_mode())
+    c->routing_mode = SHARDCACHE_ROUTING_CHASH;
+
+    c->auto_multi_max_keys = SHC_AUTO_MULTI_MAX_KEYS_DEFAULT;
+    MUTEX_INIT(c->auto_multi_lock);
+
+    c->protocol_version = global_protocol_version(-1);
+    c->compression_threshold = global_compression_threshold(-1);
+    CONDITION_INIT(c->auto_multi_full);
+
+    return c;
+}
+
+static inline char *
+select_other_node(shardcache_client_t *c, shardcache_client_tls_t *tls, char *addr)
+{
+    if (c->num_shards == 1)
+        return addr;
+
+    shardcache_node_t *node = NULL;
+    char *new_addr = NULL;
+    do {
+        node = c->shards[rand_r(&tls->seed)%c->num_shards];
+        new_addr = shardcache_node_get_address(node);
+    } while (strcmp(addr, new_addr) == 0);
+    tls->current_node = node;
+
+    return new_addr;
+}
+
+static inline shm_channel_t *
+select_shm_channel(shardcache_client_t *c,
+                   shardcache_client_tls_t *tls,
+                   shardcache_node_t *node,
+                   char *addr)
+{
+    // the fallback state (see shardcache_client_tls()) has no channels
+    if (!tls->shm_channels || !tls->shm_failures || !addr || strncmp(addr, "shm:", 4) != 0)
+        return NULL;
+
+    int i;
+    for (i = 0; i < c->num_shards; i++) {
+        if (c->shards[i] != node)
+            continue;
+
+        if (!tls->shm_channels[i]) {
+            // if the channel can't be opened the node will be
+            // reached through its unix socket for a while
+            time_t now = time(NULL);
+            if (now - tls->shm_failures[i] < SHC_SHM_RETRY_INTERVAL)
+                return NULL;
+
+            tls->shm_channels[i] = open_shm_channel(addr, connections_pool_tcp_timeout(c->connections, -1));
+            if (!tls->shm_channels[i])
+                tls->shm_failures[i] = now;
+        }
+        return tls->shm_channels[i];
+    }
+    return NULL;
+}
+
+static inline void shc_address_track_end(shardcache_client_tls_t *tls, int measured, int failed);
+
+// send a command through a shm channel and read the response,
+// returns the number of records in the response or -1 on error
+static int
+shardcache_client_shm_command(shardcache_client_t *c,
+                              shm_channel_t *shm,
+                              unsigned char hdr,
+                              shardcache_record_t *records,
+                              int num_records,
+                              fbuf_t **out,
+                              int expected_records)
+{
+    int timeout = connections_pool_tcp_timeout(c->connections, -1);
+    shardcache_hdr_t rhdr = 0;
+    int rc = -1;
+
+    if (write_message_shm(shm, hdr, records, num_records, timeout) == 0)
+        rc = read_message_shm(shm, out, expected_records, &rhdr, timeout);
+
+    if (rc == -1) {
+        // the channel is out of sync (or the node went away),
+        // a new one will be opened by the next command
+        shardcache_client_tls_t *tls = shardcache_client_tls(c);
+        int i;
+        for (i = 0; tls->shm_channels && i < c->num_shards; i++) {
+            if (tls->shm_channels[i] == shm)
+                tls->shm_channels[i] = NULL;
+        }
+        shm_channel_destroy(shm);
+    }
+
+    // the address has been selected (and tracked) by select_node_route()
+    shc_address_track_end(shardcache_client_tls(c), rc != -1, rc == -1);
+
+    return (rc != -1 && rhdr == SHC_HDR_RESPONSE) ? rc : -1;
+}
+
+// send a command expecting a single status byte as response through a shm channel
+static int
+shardcache_client_shm_status(shardcache_client_t *c,
+                             shm_channel_t *shm,
+                             unsigned char hdr,
+                             shardcache_record_t *records,
+                             int num_records)
+{
+    fbuf_t resp = FBUF_STATIC_INITIALIZER;
+    fbuf_t *respp = &resp;
+    int rc = -1;
+    if (shardcache_client_shm_command(c, shm, hdr, records, num_records, &respp, 1) == 1 &&
+        fbuf_used(&resp) == 1)
+    {
+        switch(*((unsigned char *)fbuf_data(&resp))) {
+            case SHC_RES_OK:
+            case SHC_RES_NO:
+                rc = 0;
+                break;
+            case SHC_RES_YES:
+            case SHC_RES_EXISTS:
+                rc = 1;
+                break;
+            default:
+                break;
+        }
+    }
+    fbuf_destroy(&resp);
+    return rc;
+}
+
+static shardcache_node_t *
+shc_lookup_node(chash_t *chash,
+                routing_table_t *table,
+                shardcache_node_t **nodes,
+                int num_nodes,
+                void *key,
+                size_t klen)
+{
+    const char *node_name;
+    size_t name_len = 0;
+    int i;
+
+    // the tables are built on the labels of the same nodes array
+    if (table) {
+        int index = routing_table_lookup(table, key, klen);
+        if (index >= 0)
+            return nodes[index];
+        // the table couldn't tell the owner (see routing_table_lookup()),
+        // the continuum has the final word
+    }
+
+    chash_lookup(chash, key, klen, &node_name, &name_len);
+
+    for (i = 0; i < num_nodes; i++) {
+        char *label = shardcache_node_get_label(nodes[i]);
+        if (strlen(label) == name_len && strncmp(node_name, label, name_len) == 0)
+            return nodes[i];
+    }
+    return NULL;
+}
+
+static void
+shc_topology_destroy(shc_topology_t *topology)
+{
+    if (topology->chash)
+        chash_free(topology->chash);
+    if (topology->migration)
+        chash_free(topology->migration);
+    if (topology->routing)
+        routing_table_destroy(topology->routing);
+    if (topology->migration_routing)
+        routing_table_destroy(topology->migration_routing);
+    free(topology->nodes);
+    free(topology->migration_nodes);
+    free(topology->new_nodes);
+    free(topology);
+}
+
+// returns the node learned from a previous topology with the same label and
+// addresses (releasing the provided one) or registers the provided one,
+// called with the topology lock held
+static shardcache_node_t *
+shc_learned_node(shardcache_client_t *c, shardcache_node_t *node)
+{
+    int i;
+    for (i = 0; i < c->num_learned_nodes; i++) {
+        if (strcmp(shardcache_node_get_string(c->learned_nodes[i]), shardcache_node_get_string(node)) == 0) {
+            shardcache_node_destroy(node);
+            return c->learned_nodes[i];
+        }
+    }
+    c->learned_nodes = realloc(c->learned_nodes, sizeof(shardcache_node_t *) * (c->num_learned_nodes + 1));
+    c->learned_nodes[c->num_learned_nodes++] = node;
+    return node;
+}
+
+// parse a comma-separated list of node strings (as sent in the TOPOLOGY response)
+// into the provided array, the nodes configured when the client has been created
+// are referenced instead of the ones received (so that they are reached through
+// the same addresses used for the static continuum)
+static int
+shc_topology_parse_nodes(shardcache_client_t *c,
+                         shc_topology_t *topology,
+                         char *str,
+                         shardcache_node_t ***nodes,
+                         chash_t **chash,
+                         routing_table_t **routing)
+{
+    int num_nodes = 0;
+    char *copy = strdup(str);
+    char *s = copy;
+    while (s && *s) {
+        char *tok = strsep(&s, ",");
+        if (!*tok)
+            continue;
+
+        shardcache_node_t *node = shardcache_node_create_from_string(tok);
+        if (!node) {
+            free(copy);
+            return -1;
+        }
+
+        int i;
+        for (i = 0; i < c->num_shards; i++) {
+            if (strcmp(shardcache_node_get_label(c->shards[i]), shardcache_node_get_label(node)) == 0)
+                break;
+        }
+
+        if (i < c->num_shards) {
+            shardcache_node_destroy(node);
+            node = c->shards[i];
+        } else {
+            node = shc_learned_node(c, node);
+            for (i = 0; i < topology->num_new_nodes && topology->new_nodes[i] != node; i++)
+                ;
+            if (i == topology->num_new_nodes) {
+                topology->new_nodes = realloc(topology->new_nodes,
+                                              sizeof(shardcache_node_t *) * (topology->num_new_nodes + 1));
+                topology->new_nodes[topology->num_new_nodes++] = node;
+            }
+        }
+
+        *nodes = realloc(*nodes, sizeof(shardcache_node_t *) * (num_nodes + 1));
+        (*nodes)[num_nodes++] = node;
+    }
+    free(copy);
+
+    if (!num_nodes)
+        return -1;
+
+    size_t lens[num_nodes];
+    char *labels[num_nodes];
+    int i;
+    for (i = 0; i < num_nodes; i++) {
+        labels[i] = shardcache_node_get_label((*nodes)[i]);
+        lens[i] = strlen(labels[i]);
+    }
+    *chash = chash_create((const char **)labels, lens, num_nodes, 200);
+    if (!*chash)
+        return -1;
+
+    int mode = ATOMIC_READ(c->routing_mode);
+    if (mode != SHARDCACHE_ROUTING_CHASH) {
+        *routing = routing_table_create(mode, labels, num_nodes, NULL);
+        if (!*routing)
+            return -1;
+    }
+
+    return num_nodes;
+}
+
+static shc_topology_t *
+shc_topology_create(shardcache_client_t *c, uint32_t version, char *nodes, char *migration_nodes)
+{
+    shc_topology_t *topology = calloc(1, sizeof(shc_topology_t));
+    topology->version = version;
+
+    topology->num_nodes = shc_topology_parse_nodes(c, topology, nodes,
+                                                   &topology->nodes,
+                                                   &topology->chash,
+                                                   &topology->routing);
+    if (topology->num_nodes < 0) {
+        shc_topology_destroy(topology);
+        return NULL;
+    }
+
+    if (migration_nodes) {
+        topology->num_migration_nodes = shc_topology_parse_nodes(c, topology, migration_nodes,
+                                                                 &topology->migration_nodes,
+                                                                 &topology->migration,
+                                                                 &topology->migration_routing);
+        if (topology->num_migration_nodes < 0) {
+            shc_topology_destroy(topology);
+            return NULL;
+        }
+    }
+
+    return topology;
+}
+
+// ask the nodes (starting from a random one) for the topology of the cluster,
+// returns 0 if the known topology is up to date or has been replaced, -1 if no
+// node could provide it. If 'force' is true the topology is replaced even if
+// it didn't change
+static int
+shc_topology_refresh(shardcache_client_t *c, int force)
+{
+    int rc = -1;
+    shc_topology_t *replaced = NULL;
+
+    MUTEX_LOCK(c->topology_lock);
+
+    shc_topology_t *topology = c->topology;
+    uint32_t version = (topology && !force) ? topology->version : 0;
+    shardcache_node_t **nodes = topology ? topology->nodes : c->shards;
+    int num_nodes = topology ? topology->num_nodes : c->num_shards;
+
+    int i;
+    int offset = random() % num_nodes;
+    for (i = 0; i < num_nodes && rc != 0; i++) {
+        char *addr = shardcache_node_get_address(nodes[(offset + i) % num_nodes]);
+        int fd = shc_connection_get(c, addr);
+        if (fd < 0)
+            continue;
+
+        char *nodes_string = NULL;
+        char *migration_string = NULL;
+        uint32_t new_version = version;
+        int ret = topology_from_peer(addr, &new_version, &nodes_string, &migration_string, fd);
+        if (ret == -1) {
+            close(fd);
+            continue;
+        }
+        connections_pool_add(c->connections, addr, fd);
+
+        if (ret == 1) {
+            shc_topology_t *new_topology = shc_topology_create(c, new_version, nodes_string, migration_string);
+            if (new_topology) {
+                SHC_DEBUG("Topology changed (version %08x, %d nodes, %d migration nodes)",
+                          new_version, new_topology->num_nodes, new_topology->num_migration_nodes);
+                ATOMIC_SET(c->topology, new_topology);
+                replaced = topology;
+                rc = 0;
+            } else {
+                SHC_WARNING("Can't parse the topology received from %s", addr);
+            }
+        } else {
+            rc = 0;
+        }
+        free(nodes_string);
+        free(migration_string);
+    }
+
+    ATOMIC_SET(c->topology_checked, time(NULL));
+
+    MUTEX_UNLOCK(c->topology_lock);
+
+    // the replaced topology can be released once
+    // no thread is routing through it anymore
+    if (replaced) {
+        epoch_synchronize(c->epoch);
+        shc_topology_destroy(replaced);
+    }
+
+    return rc;
+}
+
+int
+shardcache_client_topology_refresh(shardcache_client_t *c)
+{
+    if (shc_topology_refresh(c, 0) != 0) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't get the topology from any node");
+        return -1;
+    }
+    shardcache_client_clear_error(c);
+    return 0;
+}
+
+// refresh the topology if it hasn't been checked for topology_check_interval seconds,
+// a single thread takes care of it while the others keep using the known topology
+static inline void
+shc_topology_check(shardcache_client_t *c)
+{
+    int interval = ATOMIC_READ(c->topology_check_interval);
+    if (!interval)
+        return;
+
+    time_t checked = ATOMIC_READ(c->topology_checked);
+    time_t now = time(NULL);
+    if (now - checked >= interval && ATOMIC_CAS(c->topology_checked, checked, now))
+        shc_topology_refresh(c, 0);
+}
+
+// how the owner of a key is selected while a migration is in progress,
+// following the same rules the nodes apply to the commands they receive
+#define SHC_ROUTE_READ  0 // the old continuum (the owner looks into the new one if needed)
+#define SHC_ROUTE_WRITE 1 // the new continuum
+
+static inline int
+shc_command_route(shardcache_hdr_t hdr)
+{
+    switch(hdr) {
+        case SHC_HDR_GET:
+        case SHC_HDR_GET_ASYNC:
+        case SHC_HDR_GET_OFFSET:
+        case SHC_HDR_GET_MULTI:
+            return SHC_ROUTE_READ;
+        default:
+            break;
+    }
+    return SHC_ROUTE_WRITE;
+}
+
+static inline shardcache_node_t *
+shc_route_node(shardcache_client_t *c,
+               shardcache_client_tls_t *tls,
+               int route,
+               void *key,
+               size_t klen)
+{
+    shardcache_node_t *node = NULL;
+    int token = epoch_enter(c->epoch);
+    shc_topology_t *topology = ATOMIC_READ(c->topology);
+
+    if (!topology && c->num_shards == 1) {
+        node = c->shards[0];
+    } else if (ATOMIC_READ(c->use_random_node)) {
+        node = tls->current_node;
+        if (!node) {
+            node = c->shards[rand_r(&tls->seed)%c->num_shards];
+            tls->current_node = node;
+        }
+    } else {
+        if (!topology)
+            node = shc_lookup_node(c->chash,
+                                   ATOMIC_READ(c->routing),
+                                   c->shards,
+                                   c->num_shards,
+                                   key, klen);
+        else if (route == SHC_ROUTE_WRITE && topology->migration)
+            node = shc_lookup_node(topology->migration,
+                                   topology->migration_routing,
+                                   topology->migration_nodes,
+                                   topology->num_migration_nodes,
+                                   key, klen);
+        else
+            node = shc_lookup_node(topology->chash,
+                                   topology->routing,
+                                   topology->nodes,
+                                   topology->num_nodes,
+                                   key, klen);
+        if (node)
+            tls->current_node = node;
+    }
+    epoch_exit(c->epoch, token);
+
+    return node;
+}
+
+static inline void
+shc_address_track_begin(shardcache_client_tls_t *tls, shardcache_node_t *node, int index)
+{
+    shardcache_node_address_begin(node, index);
+    tls->tracked_node = node;
+    tls->tracked_index = index;
+    gettimeofday(&tls->tracked_start, NULL);
+}
+
+static inline void
+shc_address_track_end(shardcache_client_tls_t *tls, int measured, int failed)
+{
+    if (!tls->tracked_node)
+        return;
+    shardcache_node_address_end(tls->tracked_node,
+                                tls->tracked_index,
+                                measured ? &tls->tracked_start : NULL,
+                                failed);
+    tls->tracked_node = NULL;
+}
+
+// returns the connection obtained by select_node() to the pool
+// (or closes it if the command failed) and accounts the response
+// time to the selected address
+static inline void
+shc_release_connection(shardcache_client_t *c, char *addr, int fd, int failed)
+{
+    shc_address_track_end(shardcache_client_tls(c), !failed, failed);
+    if (failed)
+        close(fd);
+    else
+        connections_pool_add(c->connections, addr, fd);
+}
+
+static inline char *
+select_node_route(shardcache_client_t *c,
+                  int route,
+                  void *key,
+                  size_t klen,
+                  int *fd,
+                  shm_channel_t **shm)
+{
+    char *addr = NULL;
+    // the selection only touches the state of the calling thread,
+    // no locks are needed when the client is shared among threads
+    shardcache_client_tls_t *tls = shardcache_client_tls(c);
+
+    // the command will be sent either on a pooled connection or on a shm channel
+    shc_messaging_settings(c);
+
+    shc_topology_check(c);
+
+    shardcache_node_t *node = shc_route_node(c, tls, route, key, klen);
+
+    // a command which didn't release its connection isn't measured
+    shc_address_track_end(tls, 0, 0);
+
+    if (node) {
+        // the replica with the lowest load is preferred, an address left
+        // aside is probed only by the commands which are going to be tracked
+        if (!fd && !shm)
+            return shardcache_node_get_address(node);
+
+        int index = shardcache_node_select_address_index(node);
+        addr = shardcache_node_get_address_at_index(node, index);
+        if (!addr)
+            return NULL;
+
+        // commands supporting it will go through
+        // the shm channel instead of the socket
+        if (shm && (*shm = select_shm_channel(c, tls, node, addr))) {
+            shc_address_track_begin(tls, node, index);
+            return addr;
+        }
+
+        if (fd) {
+            int retries = 3;
+            do {
+                *fd = shc_connection_get(c, addr);
+                if (*fd < 0) {
+                    if (node) {
+                        // the failure makes the replica less likely to be selected
+                        shardcache_node_address_begin(node, index);
+                        shardcache_node_address_end(node, index, NULL, 1);
+                        node = NULL;
+                    }
+                    // the node might have left the cluster,
+                    // let the next command check the topology again
+                    ATOMIC_SET(c->topology_checked, 0);
+                    char *other_addr = select_other_node(c, tls, addr);
+                    if (!other_addr || other_addr == addr)
+                        break;
+                    addr = other_addr;
+                }
+            } while (*fd < 0 && retries--);
+
+            if (*fd >= 0 && node)
+                shc_address_track_begin(tls, node, index);
+        }
+    }
+
+    return addr;
+}
+
+static inline char *
+select_node(shardcache_client_t *c, void *key, size_t klen, int *fd, shm_channel_t **shm)
+{
+    return select_node_route(c, SHC_ROUTE_READ, key, klen, fd, shm);
+}
+
+/*
+ * Auto multi
+ *
+ * When a window is configured, the single-key gets issued concurrently by
+ * multiple threads are collected in batches and sent with a single
+ * shardcache_client_get_multi() call (so one GET_MULTI command, or a burst of
+ * pipelined GETs, per node). The first caller finding no open batch creates
+ * one and becomes its leader: it waits for the window to expire (or for the
+ * batch to be filled up by the other callers), sends the batch and wakes up
+ * the other callers, each of them then picks its own value.
+ * No thread is involved and nothing is collected unless the window is set.
+ */
+
+struct _shc_auto_multi_batch_s {
+    shc_multi_item_t **items; // NULL-terminated
+    int count;
+    int max_keys;
+    int done;
+    int refcnt; // callers still to pick their value
+    int rc;
+    int error;
+    char errstr[1024];
+    pthread_cond_t cond; // signaled when the values are available
+};
+
+static void
+shc_auto_multi_batch_destroy(shc_auto_multi_batch_t *batch)
+{
+    int i;
+    for (i = 0; i < batch->count; i++) {
+        // the keys belong to the callers
+        free(batch->items[i]->data);
+        free(batch->items[i]);
+    }
+    free(batch->items);
+    CONDITION_DESTROY(batch->cond);
+    free(batch);
+}
+
+static shc_auto_multi_batch_t *
+shc_auto_multi_batch_create(int max_keys)
+{
+    shc_auto_multi_batch_t *batch = calloc(1, sizeof(shc_auto_multi_batch_t));
+    if (!batch)
+        return NULL;
+    batch->items = calloc(max_keys + 1, sizeof(shc_multi_item_t *));
+    if (!batch->items) {
+        free(batch);
+        return NULL;
+    }
+    batch->max_keys = max_keys;
+    CONDITION_INIT(batch->cond);
+    return batch;
+}
+
+
+static size_t
+shc_auto_multi_get(shardcache_client_t *c, void *key, size_t klen, void **data, int window)
+{
+    shc_multi_item_t *item = calloc(1, sizeof(shc_multi_item_t));
+    if (!item)
+        return 0;
+    // the caller is blocked until the batch has been sent,
+    // so the key doesn't need to be copied
+    item->key = key;
+    item->klen = klen;
+
+    MUTEX_LOCK(c->auto_multi_lock);
+
+    int leader = 0;
+    shc_auto_multi_batch_t *batch = c->auto_multi_batch;
+    if (!batch) {
+        batch = shc_auto_multi_batch_create(ATOMIC_READ(c->auto_multi_max_keys));
+        if (!batch) {
+            MUTEX_UNLOCK(c->auto_multi_lock);
+            free(item);
+            shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_INTERNAL,
+                                        "Can't allocate a new batch");
+            return 0;
+        }
+        c->auto_multi_batch = batch;
+        leader = 1;
+    }
+
+    int index = batch->count++;
+    batch->items[index] = item;
+    batch->refcnt++;
+
+    if (batch->count == batch->max_keys) {
+        // no more keys fit, the next caller will start a new batch
+        c->auto_multi_batch = NULL;
+        if (!leader)
+            pthread_cond_broadcast(&c->auto_multi_full);
+    }
+
+    if (leader) {
+        struct timeval now, wait_time = { window / 1000000, window % 1000000 };
+        gettimeofday(&now, NULL);
+        timeradd(&now, &wait_time, &wait_time);
+        struct timespec abstime = { wait_time.tv_sec, wait_time.tv_usec * 1000 };
+
+        while (c->auto_multi_batch == batch &&
+               pthread_cond_timedwait(&c->auto_multi_full, &c->auto_multi_lock, &abstime) == 0);
+
+        if (c->auto_multi_batch == batch)
+            c->auto_multi_batch = NULL;
+
+        MUTEX_UNLOCK(c->auto_multi_lock);
+
+        int rc = shardcache_client_get_multi(c, batch->items);
+
+        MUTEX_LOCK(c->auto_multi_lock);
+        batch->rc = rc;
+        if (rc != 0) {
+            // the other callers don't share the thread state of the leader
+            batch->error = shardcache_client_errno(c);
+            snprintf(batch->errstr, sizeof(batch->errstr), "%s", shardcache_client_errstr(c));
+        }
+        batch->done = 1;
+        pthread_cond_broadcast(&batch->cond);
+    } else {
+        while (!batch->done)
+            pthread_cond_wait(&batch->cond, &c->auto_multi_lock);
+    }
+
+    size_t size = item->dlen;
+    if (size) {
+        if (data) {
+            *data = item->data;
+            item->data = NULL;
+        }
+        shardcache_client_clear_error(c);
+    } else if (batch->rc != 0) {
+        // the values not received might have been lost with the failed nodes
+        shardcache_client_set_error(c, batch->error ? batch->error : SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "%s", batch->errstr);
+    } else {
+        shardcache_client_clear_error(c);
+    }
+
+    if (--batch->refcnt == 0)
+        shc_auto_multi_batch_destroy(batch);
+
+    MUTEX_UNLOCK(c->auto_multi_lock);
+
+    return size;
+}
+
+static size_t
+shardcache_client_get_remote(shardcache_client_t *c, void *key, size_t klen, void **data)
+{
+    int window = ATOMIC_READ(c->auto_multi_window);
+    if (window > 0)
+        return shc_auto_multi_get(c, key, klen, data, window);
+
+    int fd = -1;
+    shm_channel_t *shm = NULL;
+    char *addr = select_node(c, key, klen, &fd, &shm);
+
+    if (fd < 0 && !shm) {
+        shardcache_client_set_connect_error(c, addr);
+        return 0;
+    }
+
+    fbuf_t value = FBUF_STATIC_INITIALIZER;
+    int rc = -1;
+    if (shm) {
+        shardcache_record_t record = { .v = key, .l = klen };
+        fbuf_t *records[2] = { &value, NULL };
+        if (shardcache_client_shm_command(c, shm, SHC_HDR_GET, &record, 1, records, 2) == 2)
+            rc = 0;
+    } else {
+        rc = fetch_from_peer(addr, key, klen, &value, fd);
+    }
+    if (rc == 0) {
+        size_t size = fbuf_used(&value);
+        if (data)
+            *data = fbuf_data(&value);
+        else
+            fbuf_destroy(&value);
+
+        shardcache_client_clear_error(c);
+
+        if (fd >= 0)
+            shc_release_connection(c, addr, fd, 0);
+        return size;
+    } else {
+        if (fd >= 0)
+            shc_release_connection(c, addr, fd, 1);
+        fbuf_destroy(&value);
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't fetch data from node '%s'", addr);
+        return 0;
+    }
+    return 0;
+}
+
+/*
+ * Near cache
+ *
+ * Values fetched by shardcache_client_get() are kept in a local arc cache
+ * which is kept coherent with the nodes through their invalidations:
+ * a listener thread subscribes to all the nodes (see SHC_HDR_SUBSCRIBE) and
+ * drops the keys received in the EVICT_MULTI messages they push.
+ * Each cached value remembers the invalidation counter of its key (and the
+ * generation of the subscriptions) as they were before querying the node,
+ * a value is considered stale as soon as any of them changes. The cache is used
+ * only while all the nodes are subscribed and the generation changes each time
+ * a subscription is established or lost, so nothing fetched while some
+ * invalidation could have been missed is ever served.
+ */
+
+typedef struct {
+    int fd;
+    async_read_ctx_t *reader;
+    fbuf_t keys; // the keys record of the message being read
+    time_t last_attempt;
+} shc_near_subscription_t;
+
+struct _shc_near_cache_s {
+    arc_t *arc;
+    arc_ops_t ops;
+    uint64_t *lists_size[4];
+    uint32_t ttl;
+    uint32_t generation; // changes when a subscription is established or lost
+    uint32_t epochs[SHC_NEAR_CACHE_EPOCHS]; // changes when a key is invalidated
+    int active; // number of nodes currently subscribed
+    shc_near_subscription_t *subscriptions; // indexed as the shards array
+    pthread_t listener;
+    int quit;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stale;
+    uint64_t invalidations;
+    uint64_t flushes;
 };
 
-int
-shardcache_client_tcp_timeout(shardcache_client_t *c, int new_value)
-{
-    return connections_pool_tcp_timeout(c->connections, new_value);
-}
+typedef struct {
+    void *key;
+    size_t klen;
+    void *data;
+    size_t dlen;
+    time_t expire; // 0 if the value doesn't expire
+    uint32_t generation;
+    uint32_t epoch;
+    int epoch_index;
+    int loaded;
+} shc_near_object_t;
 
-int shardcache_client_check_connection_timeout(shardcache_client_t *c, int new_value)
+static inline int
+shc_near_cache_epoch_index(void *key, size_t klen)
 {
-    return connections_pool_expire_time(c->connections, new_value);
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    size_t i;
+    for (i = 0; i < klen; i++) {
+        hash ^= ((unsigned char *)key)[i];
+        hash *= 16777619U;
+    }
+    return hash % SHC_NEAR_CACHE_EPOCHS;
 }
 
-int
-shardcache_client_use_random_node(shardcache_client_t *c, int new_value)
+static inline int
+shc_near_cache_is_fresh(shc_near_cache_t *nc, shc_near_object_t *obj)
 {
-    int old_value = c->use_random_node;
-    c->use_random_node = new_value;
-    return old_value;
+    return (obj->generation == ATOMIC_READ(nc->generation) &&
+            obj->epoch == ATOMIC_READ(nc->epochs[obj->epoch_index]) &&
+            (!obj->expire || obj->expire > time(NULL)));
 }
 
-int
-shardcache_client_multi_command_max_wait(shardcache_client_t *c, int new_value)
+static void
+shc_near_cache_invalidate(shardcache_client_t *c, void *key, size_t klen)
 {
-    int old_value = c->multi_command_max_wait;
-    c->multi_command_max_wait = new_value;
-    return old_value;
+    shc_near_cache_t *nc = c->near_cache;
+    if (!nc)
+        return;
+
+    // bumping the counter is what makes any copy of the value stale
+    // (even one being fetched right now), removing it only releases the memory
+    ATOMIC_INCREMENT(nc->epochs[shc_near_cache_epoch_index(key, klen)]);
+    arc_remove(nc->arc, key, klen);
+    ATOMIC_INCREMENT(nc->invalidations);
 }
 
-int
-shardcache_client_pipeline_max(shardcache_client_t *c, int new_value)
+static void
+shc_near_cache_init_object(const void *key, size_t klen, int async, time_t ttl, arc_resource_t res, void *ptr, void *priv)
 {
-    int old_value = c->pipeline_max;
-    if (new_value >= 0)
-        c->pipeline_max = new_value;
-    return old_value;
+    shc_near_object_t *obj = (shc_near_object_t *)ptr;
+    obj->key = malloc(klen);
+    memcpy(obj->key, key, klen);
+    obj->klen = klen;
+    obj->epoch_index = shc_near_cache_epoch_index(obj->key, klen);
 }
 
-shardcache_client_t *
-shardcache_client_create(shardcache_node_t **nodes, int num_nodes)
+static int
+shc_near_cache_fetch_object(void *ptr, size_t *size, void *priv)
 {
-    int i;
-    if (!num_nodes) {
-        SHC_ERROR("Can't create a shardcache client with no nodes");
-        return NULL;
-    }
-    shardcache_client_t *c = calloc(1, sizeof(shardcache_client_t));
-    size_t shard_lens[num_nodes];
-    char *shard_names[num_nodes];
+    shc_near_object_t *obj = (shc_near_object_t *)ptr;
+    shardcache_client_t *c = (shardcache_client_t *)priv;
+    shc_near_cache_t *nc = c->near_cache;
 
-    c->shards = malloc(sizeof(shardcache_node_t *) * num_nodes);
-    c->connections = connections_pool_create(SHARDCACHE_TCP_TIMEOUT_DEFAULT,
-                                             SHARDCACHE_CONNECTION_EXPIRE_DEFAULT,
-                                             1);
-    for (i = 0; i < num_nodes; i++) {
-        c->shards[i] = shardcache_node_copy(nodes[i]);
+    // NOTE: arc_lookup() calls us synchronously, so we are running
+    //       in the thread which asked for the value
+    shardcache_client_tls(c)->near_fetched = 1;
+    ATOMIC_INCREMENT(nc->misses);
 
-        shard_names[i] = shardcache_node_get_label(c->shards[i]);
-        shard_lens[i] = strlen(shard_names[i]);
+    // the snapshot must be taken before querying the node
+    obj->generation = ATOMIC_READ(nc->generation);
+    obj->epoch = ATOMIC_READ(nc->epochs[obj->epoch_index]);
+
+    void *data = NULL;
+    size_t dlen = shardcache_client_get_remote(c, obj->key, obj->klen, &data);
+    if (shardcache_client_errno(c) != SHARDCACHE_CLIENT_OK) {
+        free(data);
+        return -1;
     }
 
-    c->num_shards = num_nodes;
+    obj->data = data;
+    obj->dlen = dlen;
+    if (nc->ttl)
+        obj->expire = time(NULL) + nc->ttl;
+    ATOMIC_SET(obj->loaded, 1);
 
-    c->chash = chash_create((const char **)shard_names, shard_lens, c->num_shards, 200);
+    *size = obj->klen + dlen;
 
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    srandom((unsigned)tv.tv_usec);
+    // missing keys are not cached since the creation of a key is not
+    // always notified, neither are the values which are already stale
+    return (dlen && shc_near_cache_is_fresh(nc, obj)) ? 0 : 1;
+}
 
-    c->pipeline_max = SHC_PIPELINE_MAX_DEFAULT;
+static void
+shc_near_cache_evict_object(void *ptr, void *priv)
+{
+    shc_near_object_t *obj = (shc_near_object_t *)ptr;
+    free(obj->key);
+    free(obj->data);
+}
 
-    c->async_jobs = queue_create();
+static size_t
+shc_near_cache_get(shardcache_client_t *c,
+                   shardcache_client_tls_t *tls,
+                   void *key,
+                   size_t klen,
+                   void **data)
+{
+    shc_near_cache_t *nc = c->near_cache;
+
+    // a stale value is dropped and looked up once more
+    int attempts = 2;
+    while (attempts--) {
+        shc_near_object_t *obj = NULL;
+        tls->near_fetched = 0;
+        arc_resource_t res = arc_lookup(nc->arc, key, klen, (void **)&obj, 0, 0);
+        if (!res) {
+            // if the fetch failed the error has been already set
+            if (tls->near_fetched)
+                return 0;
+            break;
+        }
 
-    return c;
+        if (!ATOMIC_READ(obj->loaded)) {
+            // another thread is fetching the value right now
+            arc_release_resource(nc->arc, res);
+            break;
+        }
+
+        if (!tls->near_fetched) {
+            if (!shc_near_cache_is_fresh(nc, obj)) {
+                ATOMIC_INCREMENT(nc->stale);
+                arc_drop_resource(nc->arc, res);
+                continue;
+            }
+            ATOMIC_INCREMENT(nc->hits);
+            shardcache_client_clear_error(c);
+        }
+
+        size_t dlen = obj->dlen;
+        if (data) {
+            *data = NULL;
+            if (dlen) {
+                *data = malloc(dlen);
+                memcpy(*data, obj->data, dlen);
+            }
+        }
+        arc_release_resource(nc->arc, res);
+        return dlen;
+    }
+
+    ATOMIC_INCREMENT(nc->misses);
+    return shardcache_client_get_remote(c, key, klen, data);
 }
 
-static inline char *
-select_other_node(shardcache_client_t *c, char *addr)
+static int
+shc_near_cache_read_record(void *data, size_t len, int idx, size_t total_len, void *priv)
 {
-    if (c->num_shards == 1)
-        return addr;
+    shc_near_subscription_t *sub = (shc_near_subscription_t *)priv;
+    if (idx == 0 && len)
+        fbuf_add_binary(&sub->keys, data, len);
+    return (idx >= -1) ? 0 : -1;
+}
 
-    shardcache_node_t *node = NULL;
-    char *new_addr = NULL;
-    do {
-        node = c->shards[random()%c->num_shards];
-        new_addr = shardcache_node_get_address(node);
-    } while (strcmp(addr, new_addr) == 0);
-    c->current_node = node;
+static void
+shc_near_cache_subscribe(shardcache_client_t *c, int i)
+{
+    shc_near_cache_t *nc = c->near_cache;
+    shc_near_subscription_t *sub = &nc->subscriptions[i];
+    char *addr = shardcache_node_get_address(c->shards[i]);
 
-    return addr;
+    shc_messaging_settings(c);
+    int fd = connect_to_peer(addr, connections_pool_tcp_timeout(c->connections, -1));
+    if (fd < 0)
+        return;
+
+    if (subscribe_to_peer(addr, fd) != 0) {
+        SHC_WARNING("Can't subscribe to the invalidations of %s", addr);
+        close(fd);
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    sub->fd = fd;
+    fbuf_clear(&sub->keys);
+    if (sub->reader)
+        async_read_context_destroy(sub->reader);
+    sub->reader = async_read_context_create(shc_near_cache_read_record, sub);
+
+    // anything fetched while this node wasn't subscribed is stale
+    ATOMIC_INCREMENT(nc->generation);
+    ATOMIC_INCREMENT(nc->active);
+    SHC_DEBUG("Subscribed to the invalidations of %s", addr);
 }
 
-static inline char *
-select_node(shardcache_client_t *c, void *key, size_t klen, int *fd)
+static void
+shc_near_cache_unsubscribe(shardcache_client_t *c, int i)
 {
-    const char *node_name;
-    size_t name_len = 0;
-    int i;
-    char *addr = NULL;
-    shardcache_node_t *node = NULL;
+    shc_near_cache_t *nc = c->near_cache;
+    shc_near_subscription_t *sub = &nc->subscriptions[i];
+
+    close(sub->fd);
+    sub->fd = -1;
+
+    // some invalidation might have been lost
+    ATOMIC_INCREMENT(nc->generation);
+    ATOMIC_DECREMENT(nc->active);
+    ATOMIC_INCREMENT(nc->flushes);
+    SHC_WARNING("Lost the subscription to the invalidations of %s",
+                shardcache_node_get_address(c->shards[i]));
+}
 
-    if (c->num_shards == 1) {
-        node = c->shards[0];
-    } else if (c->use_random_node) {
-        node = c->current_node;
-        if (!node) {
-            node = c->shards[random()%c->num_shards];
-            c->current_node = node;
+static int
+shc_near_cache_read(shardcache_client_t *c, int i)
+{
+    shc_near_subscription_t *sub = &c->near_cache->subscriptions[i];
+    char buf[65536];
+
+    for (;;) {
+        ssize_t rb = read(sub->fd, buf, sizeof(buf));
+        if (rb == -1 && errno == EINTR)
+            continue;
+        if (rb == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (rb <= 0)
+            return -1;
+
+        int offset = 0;
+        while (offset < rb) {
+            int processed = 0;
+            async_read_context_state_t state =
+                async_read_context_input_data(sub->reader, buf + offset, rb - offset, &processed);
+            offset += processed;
+
+            while (state == SHC_STATE_READING_DONE) {
+                if (async_read_context_hdr(sub->reader) == SHC_HDR_EVICT_MULTI) {
+                    char **keys = NULL;
+                    size_t *klens = NULL;
+                    uint32_t num_keys = record_to_array(&sub->keys, &keys, &klens);
+                    uint32_t k;
+                    for (k = 0; k < num_keys; k++)
+                        shc_near_cache_invalidate(c, keys[k], klens[k]);
+                    free(keys);
+                    free(klens);
+                }
+                fbuf_clear(&sub->keys);
+                state = async_read_context_update(sub->reader);
+            }
+
+            if (state == SHC_STATE_READING_ERR || (!processed && offset < rb))
+                return -1;
         }
-    } else {
-        chash_lookup(c->chash, key, klen, &node_name, &name_len);
+    }
+    return 0;
+}
+
+static void *
+shc_near_cache_listener(void *priv)
+{
+    shardcache_client_t *c = (shardcache_client_t *)priv;
+    shc_near_cache_t *nc = c->near_cache;
+    struct pollfd fds[c->num_shards];
+    int nodes[c->num_shards];
 
+    while (!ATOMIC_READ(nc->quit)) {
+        time_t now = time(NULL);
+        int i, n = 0;
         for (i = 0; i < c->num_shards; i++) {
-            if (strncmp(node_name, shardcache_node_get_label(c->shards[i]), name_len) == 0)
-            {
-                node = c->shards[i];
-                c->current_node = node;
-                break;
+            shc_near_subscription_t *sub = &nc->subscriptions[i];
+            if (sub->fd < 0 && now - sub->last_attempt >= SHC_NEAR_CACHE_RETRY_INTERVAL) {
+                sub->last_attempt = now;
+                shc_near_cache_subscribe(c, i);
+            }
+            if (sub->fd >= 0) {
+                fds[n].fd = sub->fd;
+                fds[n].events = POLLIN;
+                fds[n].revents = 0;
+                nodes[n++] = i;
             }
         }
-    }
 
-    if (node) {
-        addr = shardcache_node_get_address(node);
-        if (fd) {
-            int retries = 3;
-            do {
-                *fd = connections_pool_get(c->connections, addr);
-                if (*fd < 0) {
-                    char *other_addr = select_other_node(c, addr);
-                    if (other_addr == addr)
-                        break;
-                    addr = other_addr;
-                }
-            } while (*fd < 0 && retries--);
+        if (poll(fds, n, 500) <= 0)
+            continue;
+
+        for (i = 0; i < n; i++) {
+            if (fds[i].revents && shc_near_cache_read(c, nodes[i]) != 0)
+                shc_near_cache_unsubscribe(c, nodes[i]);
         }
     }
+    return NULL;
+}
 
-    return addr;
+int
+shardcache_client_near_cache_enable(shardcache_client_t *c, size_t size, uint32_t ttl)
+{
+    if (c->near_cache || !size) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_ARGS,
+                                    "The near cache is already enabled or the size is 0");
+        return -1;
+    }
+
+    shc_near_cache_t *nc = calloc(1, sizeof(shc_near_cache_t));
+    nc->ttl = ttl;
+    nc->ops.init = shc_near_cache_init_object;
+    nc->ops.fetch = shc_near_cache_fetch_object;
+    nc->ops.evict = shc_near_cache_evict_object;
+    nc->ops.priv = c;
+    nc->arc = arc_create(&nc->ops, size, sizeof(shc_near_object_t),
+                         nc->lists_size, SHARDCACHE_ARC_MODE_STRICT);
+
+    nc->subscriptions = calloc(c->num_shards, sizeof(shc_near_subscription_t));
+    int i;
+    for (i = 0; i < c->num_shards; i++) {
+        nc->subscriptions[i].fd = -1;
+        FBUF_STATIC_INITIALIZER_POINTER(&nc->subscriptions[i].keys, FBUF_MAXLEN_NONE, 64, 1024, 512);
+    }
+
+    c->near_cache = nc;
+    if (pthread_create(&nc->listener, NULL, shc_near_cache_listener, c) != 0) {
+        c->near_cache = NULL;
+        arc_destroy(nc->arc);
+        free(nc->subscriptions);
+        free(nc);
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_INTERNAL,
+                                    "Can't start the near cache listener");
+        return -1;
+    }
+
+    shardcache_client_clear_error(c);
+    return 0;
 }
 
-size_t
-shardcache_client_get(shardcache_client_t *c, void *key, size_t klen, void **data)
+static void
+shc_near_cache_destroy(shardcache_client_t *c)
 {
-    int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
+    shc_near_cache_t *nc = c->near_cache;
 
-    if (fd < 0) {
-        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
-        return 0;
+    ATOMIC_INCREMENT(nc->quit);
+    pthread_join(nc->listener, NULL);
+
+    int i;
+    for (i = 0; i < c->num_shards; i++) {
+        shc_near_subscription_t *sub = &nc->subscriptions[i];
+        if (sub->fd >= 0)
+            close(sub->fd);
+        if (sub->reader)
+            async_read_context_destroy(sub->reader);
+        fbuf_destroy(&sub->keys);
     }
+    free(nc->subscriptions);
+    arc_destroy(nc->arc);
+    free(nc);
+    c->near_cache = NULL;
+}
 
-    fbuf_t value = FBUF_STATIC_INITIALIZER;
-    int rc = fetch_from_peer(addr, key, klen, &value, fd);
-    if (rc == 0) {
-        size_t size = fbuf_used(&value);
-        if (data)
-            *data = fbuf_data(&value);
-        else
-            fbuf_destroy(&value);
+int
+shardcache_client_near_cache_stats(shardcache_client_t *c, shardcache_client_near_cache_stats_t *stats)
+{
+    shc_near_cache_t *nc = c->near_cache;
+    if (!nc) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_ARGS,
+                                    "The near cache is not enabled");
+        return -1;
+    }
 
-        c->errno = SHARDCACHE_CLIENT_OK;
-        c->errstr[0] = 0;
+    stats->hits = ATOMIC_READ(nc->hits);
+    stats->misses = ATOMIC_READ(nc->misses);
+    stats->stale = ATOMIC_READ(nc->stale);
+    stats->invalidations = ATOMIC_READ(nc->invalidations);
+    stats->flushes = ATOMIC_READ(nc->flushes);
+    stats->count = arc_count(nc->arc);
+    stats->size = arc_size(nc->arc);
+    stats->subscribed = ATOMIC_READ(nc->active);
 
-        connections_pool_add(c->connections, addr, fd);
-        return size;
-    } else {
-        close(fd);
-        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't fetch data from node '%s'", addr);
-        return 0;
+    shardcache_client_clear_error(c);
+    return 0;
+}
+
+static int
+shc_address_stats(shardcache_node_t **nodes,
+                  int num_nodes,
+                  char *address,
+                  shardcache_node_address_stats_t *stats)
+{
+    int i;
+    for (i = 0; i < num_nodes; i++) {
+        int n, num_addresses = shardcache_node_num_addresses(nodes[i]);
+        for (n = 0; n < num_addresses; n++) {
+            if (strcmp(shardcache_node_get_address_at_index(nodes[i], n), address) == 0)
+                return shardcache_node_get_address_stats(nodes[i], n, stats);
+        }
+    }
+    return -1;
+}
+
+int
+shardcache_client_address_stats(shardcache_client_t *c,
+                                char *address,
+                                shardcache_node_address_stats_t *stats)
+{
+    int rc = shc_address_stats(c->shards, c->num_shards, address, stats);
+    if (rc != 0) {
+        // the nodes learned from the topology are measured separately
+        int token = epoch_enter(c->epoch);
+        shc_topology_t *topology = ATOMIC_READ(c->topology);
+        if (topology)
+            rc = shc_address_stats(topology->new_nodes, topology->num_new_nodes, address, stats);
+        epoch_exit(c->epoch, token);
+    }
+
+    if (rc != 0) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_ARGS,
+                                    "Unknown address '%s'", address);
+        return -1;
     }
+
+    shardcache_client_clear_error(c);
     return 0;
 }
 
+size_t
+shardcache_client_get(shardcache_client_t *c, void *key, size_t klen, void **data)
+{
+    shc_near_cache_t *nc = c->near_cache;
+    if (nc && ATOMIC_READ(nc->active) == c->num_shards) {
+        shardcache_client_tls_t *tls = shardcache_client_tls(c);
+        if (tls != &c->fallback_tls)
+            return shc_near_cache_get(c, tls, key, klen, data);
+    }
+    return shardcache_client_get_remote(c, key, klen, data);
+}
+
 size_t
 shardcache_client_offset(shardcache_client_t *c, void *key, size_t klen, uint32_t offset, void *data, uint32_t dlen)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
+    char *addr = select_node(c, key, klen, &fd, NULL);
     if (fd < 0) {
-        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+        shardcache_client_set_connect_error(c, addr);
         return 0;
     }
 
@@ -235,16 +1729,15 @@ shardcache_client_offset(shardcache_client_t *c, void *key, size_t klen, uint32_
         if (data)
             memcpy(data, fbuf_data(&value), to_copy);
 
-        c->errno = SHARDCACHE_CLIENT_OK;
-        c->errstr[0] = 0;
+        shardcache_client_clear_error(c);
 
-        connections_pool_add(c->connections, addr, fd);
+        shc_release_connection(c, addr, fd, 0);
         fbuf_destroy(&value);
         return to_copy;
     } else {
-        close(fd);
-        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't fetch data from node '%s'", addr);
+        shc_release_connection(c, addr, fd, 1);
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't fetch data from node '%s'", addr);
     }
     fbuf_destroy(&value);
     return 0;
@@ -254,22 +1747,28 @@ int
 shardcache_client_exists(shardcache_client_t *c, void *key, size_t klen)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
-    if (fd < 0) {
-        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+    shm_channel_t *shm = NULL;
+    char *addr = select_node_route(c, SHC_ROUTE_WRITE, key, klen, &fd, &shm);
+    if (fd < 0 && !shm) {
+        shardcache_client_set_connect_error(c, addr);
         return -1;
     }
-    int rc = exists_on_peer(addr, key, klen, fd, 1);
+    int rc;
+    if (shm) {
+        shardcache_record_t record = { .v = key, .l = klen };
+        rc = shardcache_client_shm_status(c, shm, SHC_HDR_EXISTS, &record, 1);
+    } else {
+        rc = exists_on_peer(addr, key, klen, fd, 1);
+    }
     if (rc == -1) {
-        close(fd);
-        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
-        snprintf(c->errstr, sizeof(c->errstr),
-                "Can't check existance of data on node '%s'", addr);
+        if (fd >= 0)
+            shc_release_connection(c, addr, fd, 1);
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't check existance of data on node '%s'", addr);
     } else {
-        connections_pool_add(c->connections, addr, fd);
-        c->errno = SHARDCACHE_CLIENT_OK;
-        c->errstr[0] = 0;
+        if (fd >= 0)
+            shc_release_connection(c, addr, fd, 0);
+        shardcache_client_clear_error(c);
     }
     return rc;
 }
@@ -278,22 +1777,28 @@ int
 shardcache_client_touch(shardcache_client_t *c, void *key, size_t klen)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
-    if (fd < 0) {
-        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+    shm_channel_t *shm = NULL;
+    char *addr = select_node_route(c, SHC_ROUTE_WRITE, key, klen, &fd, &shm);
+    if (fd < 0 && !shm) {
+        shardcache_client_set_connect_error(c, addr);
         return -1;
     }
-    int rc = touch_on_peer(addr, key, klen, fd);
+    int rc;
+    if (shm) {
+        shardcache_record_t record = { .v = key, .l = klen };
+        rc = shardcache_client_shm_status(c, shm, SHC_HDR_TOUCH, &record, 1);
+    } else {
+        rc = touch_on_peer(addr, key, klen, fd);
+    }
     if (rc == -1) {
-        close(fd);
-        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
-        snprintf(c->errstr, sizeof(c->errstr),
-                 "Can't touch key '%s' on node '%s'", (char *)key, addr);
+        if (fd >= 0)
+            shc_release_connection(c, addr, fd, 1);
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't touch key '%s' on node '%s'", (char *)key, addr);
     } else {
-        connections_pool_add(c->connections, addr, fd);
-        c->errno = SHARDCACHE_CLIENT_OK;
-        c->errstr[0] = 0;
+        if (fd >= 0)
+            shc_release_connection(c, addr, fd, 0);
+        shardcache_client_clear_error(c);
     }
     return rc;
 }
@@ -311,15 +1816,32 @@ shardcache_client_set_internal(shardcache_client_t *c,
                                int mode) // 0 == SET, 1 == ADD, 2 == CAS, 3 == INCR, 4 == DECR
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
-    if (fd < 0) {
-        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+    shm_channel_t *shm = NULL;
+    // only SET and ADD can go through a shm channel
+    char *addr = select_node_route(c, SHC_ROUTE_WRITE, key, klen, &fd, mode < 2 ? &shm : NULL);
+    if (fd < 0 && !shm) {
+        shardcache_client_set_connect_error(c, addr);
         return -1;
     }
 
     int64_t rc = -1;
+    if (shm) {
+        uint32_t expire_nbo = htonl(expire);
+        shardcache_record_t records[3] = {
+            { .v = key, .l = klen },
+            { .v = data, .l = dlen },
+            { .v = &expire_nbo, .l = sizeof(expire_nbo) }
+        };
+        rc = shardcache_client_shm_status(c, shm, mode == 0 ? SHC_HDR_SET : SHC_HDR_ADD,
+                                          records, expire ? 3 : 2);
+        if (mode == 0 && rc == 1)
+            rc = -1;
+        mode = -1; // skip the socket-based commands
+    }
+
     switch(mode) {
+        case -1:
+            break;
         case 0:
             rc = send_to_peer(addr, key, klen, data, dlen, expire, 0, fd, 1);
             break;
@@ -340,14 +1862,19 @@ shardcache_client_set_internal(shardcache_client_t *c,
             return -1;
     }
 
+    // the local copy is dropped even if the command failed
+    // (it might have been applied anyway)
+    shc_near_cache_invalidate(c, key, klen);
+
     if (rc == -1) {
-        close(fd);
-        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't set new data on node '%s'", addr);
+        if (fd >= 0)
+            shc_release_connection(c, addr, fd, 1);
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't set new data on node '%s'", addr);
     } else {
-        connections_pool_add(c->connections, addr, fd);
-        c->errno = SHARDCACHE_CLIENT_OK;
-        c->errstr[0] = 0;
+        if (fd >= 0)
+            shc_release_connection(c, addr, fd, 0);
+        shardcache_client_clear_error(c);
     }
     return rc;
 }
@@ -406,21 +1933,29 @@ int
 shardcache_client_del(shardcache_client_t *c, void *key, size_t klen)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
-    if (fd < 0) {
-        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+    shm_channel_t *shm = NULL;
+    char *addr = select_node_route(c, SHC_ROUTE_WRITE, key, klen, &fd, &shm);
+    if (fd < 0 && !shm) {
+        shardcache_client_set_connect_error(c, addr);
         return -1;
     }
-    int rc = delete_from_peer(addr, key, klen, fd, 1);
+    int rc;
+    if (shm) {
+        shardcache_record_t record = { .v = key, .l = klen };
+        rc = shardcache_client_shm_status(c, shm, SHC_HDR_DELETE, &record, 1);
+    } else {
+        rc = delete_from_peer(addr, key, klen, fd, 1);
+    }
+    shc_near_cache_invalidate(c, key, klen);
     if (rc != 0) {
-        close(fd);
-        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't delete data from node '%s'", addr);
+        if (fd >= 0)
+            shc_release_connection(c, addr, fd, 1);
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't delete data from node '%s'", addr);
     } else {
-        connections_pool_add(c->connections, addr, fd);
-        c->errno = SHARDCACHE_CLIENT_OK;
-        c->errstr[0] = 0;
+        if (fd >= 0)
+            shc_release_connection(c, addr, fd, 0);
+        shardcache_client_clear_error(c);
     }
     return rc;
 }
@@ -429,22 +1964,30 @@ int
 shardcache_client_evict(shardcache_client_t *c, void *key, size_t klen)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
-    if (fd < 0) {
-        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+    shm_channel_t *shm = NULL;
+    char *addr = select_node_route(c, SHC_ROUTE_WRITE, key, klen, &fd, &shm);
+    if (fd < 0 && !shm) {
+        shardcache_client_set_connect_error(c, addr);
         return -1;
     }
 
-    int rc = evict_from_peer(addr, key, klen, fd, 1);
+    int rc;
+    if (shm) {
+        shardcache_record_t record = { .v = key, .l = klen };
+        rc = shardcache_client_shm_status(c, shm, SHC_HDR_EVICT, &record, 1);
+    } else {
+        rc = evict_from_peer(addr, key, klen, fd, 1);
+    }
+    shc_near_cache_invalidate(c, key, klen);
     if (rc != 0) {
-        close(fd);
-        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't evict data from node '%s'", addr);
+        if (fd >= 0)
+            shc_release_connection(c, addr, fd, 1);
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't evict data from node '%s'", addr);
     } else {
-        connections_pool_add(c->connections, addr, fd);
-        c->errno = SHARDCACHE_CLIENT_OK;
-        c->errstr[0] = 0;
+        if (fd >= 0)
+            shc_release_connection(c, addr, fd, 0);
+        shardcache_client_clear_error(c);
     }
 
     return rc;
@@ -464,8 +2007,8 @@ shardcache_get_node(shardcache_client_t *c, char *node_name)
     }
 
     if (!node) {
-        c->errno = SHARDCACHE_CLIENT_ERROR_ARGS;
-        snprintf(c->errstr, sizeof(c->errstr), "Unknown node '%s'", node_name);
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_ARGS,
+                                    "Unknown node '%s'", node_name);
         return NULL;
     }
 
@@ -481,23 +2024,21 @@ shardcache_client_stats(shardcache_client_t *c, char *node_name, char **buf, siz
         return -1;
 
     char *addr = shardcache_node_get_address(node);
-    int fd = connections_pool_get(c->connections, addr);
+    int fd = shc_connection_get(c, addr);
     if (fd < 0) {
-        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+        shardcache_client_set_connect_error(c, addr);
         return -1;
     }
 
     int rc = stats_from_peer(addr, buf, len, fd);
     if (rc != 0) {
         close(fd);
-        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
-        snprintf(c->errstr, sizeof(c->errstr),
-                "Can't get stats from node '%s'", shardcache_node_get_label(node));
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't get stats from node '%s'",
+                                    shardcache_node_get_label(node));
     } else {
         connections_pool_add(c->connections, addr, fd);
-        c->errno = SHARDCACHE_CLIENT_OK;
-        c->errstr[0] = 0;
+        shardcache_client_clear_error(c);
     }
 
     return rc;
@@ -510,23 +2051,20 @@ shardcache_client_check(shardcache_client_t *c, char *node_name) {
         return -1;
 
     char *addr = shardcache_node_get_address(node);
-    int fd = connections_pool_get(c->connections, addr);
+    int fd = shc_connection_get(c, addr);
     if (fd < 0) {
-        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+        shardcache_client_set_connect_error(c, addr);
         return -1;
     }
 
     int rc = check_peer(addr, fd);
     if (rc != 0) {
         close(fd);
-        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
-        snprintf(c->errstr, sizeof(c->errstr),
-                "Can't check node '%s'", shardcache_node_get_label(node));
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't check node '%s'", shardcache_node_get_label(node));
     } else {
         connections_pool_add(c->connections, addr, fd);
-        c->errno = SHARDCACHE_CLIENT_OK;
-        c->errstr[0] = 0;
+        shardcache_client_clear_error(c);
     }
     return rc;
 }
@@ -534,15 +2072,46 @@ shardcache_client_check(shardcache_client_t *c, char *node_name) {
 void
 shardcache_client_destroy(shardcache_client_t *c)
 {
+    if (c->near_cache)
+        shc_near_cache_destroy(c);
+
     if (c->thread) {
         __sync_fetch_and_add(&c->quit, 1);
-        pthread_join(c->thread, NULL);
         CONDITION_SIGNAL(c->wakeup_cond, c->wakeup_lock);
-        CONDITION_DESTROY(c->wakeup_cond);
-        MUTEX_DESTROY(c->wakeup_lock);
+        pthread_join(c->thread, NULL);
     }
+    CONDITION_DESTROY(c->wakeup_cond);
+    MUTEX_DESTROY(c->wakeup_lock);
     queue_destroy(c->async_jobs);
     chash_free(c->chash);
+
+    if (c->topology)
+        shc_topology_destroy(c->topology);
+    shardcache_free_nodes(c->learned_nodes, c->num_learned_nodes);
+    epoch_destroy(c->epoch);
+    if (c->routing)
+        routing_table_destroy(c->routing);
+    MUTEX_DESTROY(c->topology_lock);
+
+    CONDITION_DESTROY(c->auto_multi_full);
+    MUTEX_DESTROY(c->auto_multi_lock);
+
+    // threads still alive won't release their own state anymore
+    // (the key has been deleted) so let's release all of them here
+    pthread_key_delete(c->tls_key);
+    MUTEX_LOCK(c->tls_lock);
+    shardcache_client_tls_t *tls = c->tls;
+    while (tls) {
+        shardcache_client_tls_t *next = tls->next;
+        shardcache_client_tls_free(tls);
+        tls = next;
+    }
+    c->tls = NULL;
+    MUTEX_UNLOCK(c->tls_lock);
+    MUTEX_DESTROY(c->tls_lock);
+
+    free(c->multi_failures);
+
     shardcache_free_nodes(c->shards, c->num_shards);
     connections_pool_destroy(c->connections);
     free(c);
@@ -551,43 +2120,73 @@ shardcache_client_destroy(shardcache_client_t *c)
 int
 shardcache_client_errno(shardcache_client_t *c)
 {
-    return c->errno;
+    return shardcache_client_tls(c)->error;
 }
 
 char *
 shardcache_client_errstr(shardcache_client_t *c)
 {
-    return c->errstr;
+    return shardcache_client_tls(c)->errstr;
+}
+
+shardcache_storage_index_t *
+shardcache_client_index(shardcache_client_t *c, char *node_name)
+{
+    shardcache_node_t *node = shardcache_get_node(c, node_name);
+    if (!node)
+        return NULL;
+
+    char *addr = shardcache_node_get_address(node);
+    int fd = shc_connection_get(c, addr);
+    if (fd < 0) {
+        shardcache_client_set_connect_error(c, addr);
+        return NULL;
+    }
+
+    shardcache_storage_index_t *index = index_from_peer(addr, fd);
+    if (!index) {
+        close(fd);
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't get index from node '%s'",
+                                    shardcache_node_get_label(node));
+    } else {
+        connections_pool_add(c->connections, addr, fd);
+        shardcache_client_clear_error(c);
+    }
+
+    return index;
 }
 
-shardcache_storage_index_t *
-shardcache_client_index(shardcache_client_t *c, char *node_name)
+int
+shardcache_client_index_foreach(shardcache_client_t *c,
+                                char *node_name,
+                                shardcache_client_index_item_cb cb,
+                                void *priv)
 {
     shardcache_node_t *node = shardcache_get_node(c, node_name);
     if (!node)
-        return NULL;
+        return -1;
 
     char *addr = shardcache_node_get_address(node);
-    int fd = connections_pool_get(c->connections, addr);
+    int fd = shc_connection_get(c, addr);
     if (fd < 0) {
-        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
-        return NULL;
+        shardcache_client_set_connect_error(c, addr);
+        return -1;
     }
 
-    shardcache_storage_index_t *index = index_from_peer(addr, fd);
-    if (!index) {
+    int rc = index_from_peer_foreach(addr, fd, cb, priv);
+    if (rc != 0) {
+        // don't reuse the connection, it might be in an inconsistent state
         close(fd);
-        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
-        snprintf(c->errstr, sizeof(c->errstr),
-                "Can't get index from node '%s'", shardcache_node_get_label(node));
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't get index from node '%s'",
+                                    shardcache_node_get_label(node));
     } else {
         connections_pool_add(c->connections, addr, fd);
-        c->errno = SHARDCACHE_CLIENT_OK;
-        c->errstr[0] = 0;
+        shardcache_client_clear_error(c);
     }
 
-    return index;
+    return rc;
 }
 
 int
@@ -599,15 +2198,14 @@ shardcache_client_migration_begin(shardcache_client_t *c, shardcache_node_t **no
     for (i = 0; i < num_nodes; i++) {
         if (i > 0)
             fbuf_add(&mgb_message, ",");
-        fbuf_printf(&mgb_message, "%s:%s", shardcache_node_get_string(nodes[i]));
+        fbuf_printf(&mgb_message, "%s", shardcache_node_get_string(nodes[i]));
     }
 
     for (i = 0; i < c->num_shards; i++) {
         char *addr = shardcache_node_get_address(c->shards[i]);
-        int fd = connections_pool_get(c->connections, addr);
+        int fd = shc_connection_get(c, addr);
         if (fd < 0) {
-            c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-            snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+            shardcache_client_set_connect_error(c, addr);
             fbuf_destroy(&mgb_message);
             return -1;
         }
@@ -617,9 +2215,9 @@ shardcache_client_migration_begin(shardcache_client_t *c, shardcache_node_t **no
                               fbuf_used(&mgb_message), fd);
         if (rc != 0) {
             close(fd);
-            c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
-            snprintf(c->errstr, sizeof(c->errstr), "Node '%s' (%s) didn't aknowledge the migration\n",
-                    shardcache_node_get_label(c->shards[i]), addr);
+            shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                        "Node '%s' (%s) didn't aknowledge the migration\n",
+                                        shardcache_node_get_label(c->shards[i]), addr);
             fbuf_destroy(&mgb_message);
             // XXX - should we abort migration on peers that have been notified (if any)?
             return -1;
@@ -628,8 +2226,11 @@ shardcache_client_migration_begin(shardcache_client_t *c, shardcache_node_t **no
     }
     fbuf_destroy(&mgb_message);
 
-    c->errno = SHARDCACHE_CLIENT_OK;
-    c->errstr[0] = 0;
+    // route through the migration continuum right away
+    if (ATOMIC_READ(c->topology) || ATOMIC_READ(c->topology_check_interval))
+        shc_topology_refresh(c, 0);
+
+    shardcache_client_clear_error(c);
 
     return 0;
 }
@@ -642,10 +2243,9 @@ shardcache_client_migration_abort(shardcache_client_t *c)
         char *addr = shardcache_node_get_address(c->shards[i]);
         char *label = shardcache_node_get_label(c->shards[i]);
 
-        int fd = connections_pool_get(c->connections, addr);
+        int fd = shc_connection_get(c, addr);
         if (fd < 0) {
-            c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-            snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+            shardcache_client_set_connect_error(c, addr);
             return -1;
         }
 
@@ -653,16 +2253,17 @@ shardcache_client_migration_abort(shardcache_client_t *c)
 
         if (rc != 0) {
             close(fd);
-            c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
-            snprintf(c->errstr, sizeof(c->errstr),
-                     "Can't abort migration from node '%s'", label);
+            shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                        "Can't abort migration from node '%s'", label);
             return -1;
         }
         connections_pool_add(c->connections, addr, fd);
     }
 
-    c->errno = SHARDCACHE_CLIENT_OK;
-    c->errstr[0] = 0;
+    if (ATOMIC_READ(c->topology) || ATOMIC_READ(c->topology_check_interval))
+        shc_topology_refresh(c, 0);
+
+    shardcache_client_clear_error(c);
 
     return 0;
 }
@@ -672,8 +2273,21 @@ typedef struct {
     void *priv;
     int fd;
     connections_pool_t *connections;
+    // the tracking of the selected address, taken over from the thread state
+    shardcache_node_t *node;
+    int addr_index;
+    struct timeval start;
 } shardcache_client_get_async_data_arg_t;
 
+static inline void
+shardcache_client_get_async_track_end(shardcache_client_get_async_data_arg_t *arg, int measured, int failed)
+{
+    if (!arg->node)
+        return;
+    shardcache_node_address_end(arg->node, arg->addr_index, measured ? &arg->start : NULL, failed);
+    arg->node = NULL;
+}
+
 static int
 shardcache_client_get_async_data_helper(char *node,
                                         void *key,
@@ -688,14 +2302,17 @@ shardcache_client_get_async_data_helper(char *node,
     int rc = 0;
     switch(idx) {
         case -1:
+            shardcache_client_get_async_track_end(arg, 1, 0);
             rc = arg->cb(node, key, klen, NULL, 0, total_len, 0, arg->priv);
             break;
         case -2:
+            shardcache_client_get_async_track_end(arg, 0, 1);
             arg->cb(node, key, klen, data, dlen, total_len, 1, arg->priv);
             close(arg->fd);
             rc = -1;
             break;
         case -3:
+            shardcache_client_get_async_track_end(arg, 0, 0);
             connections_pool_add(arg->connections, node, arg->fd);
             free(arg);
             break;
@@ -715,10 +2332,9 @@ shardcache_client_get_async(shardcache_client_t *c,
                             void *priv)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
+    char *addr = select_node(c, key, klen, &fd, NULL);
     if (fd < 0) {
-        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+        shardcache_client_set_connect_error(c, addr);
         return -1;
     }
 
@@ -727,15 +2343,385 @@ shardcache_client_get_async(shardcache_client_t *c,
     arg->fd = fd;
     arg->cb = data_cb;
     arg->priv = priv;
-    return fetch_from_peer_async(addr,
-                                 key,
-                                 klen,
-                                 0,
-                                 0,
-                                 shardcache_client_get_async_data_helper,
-                                 arg,
-                                 fd,
-                                 NULL);
+
+    shardcache_client_tls_t *tls = shardcache_client_tls(c);
+    arg->node = tls->tracked_node;
+    arg->addr_index = tls->tracked_index;
+    arg->start = tls->tracked_start;
+    tls->tracked_node = NULL;
+
+    int rc = fetch_from_peer_async(addr,
+                                   key,
+                                   klen,
+                                   0,
+                                   0,
+                                   shardcache_client_get_async_data_helper,
+                                   arg,
+                                   fd,
+                                   NULL);
+    if (rc != 0) {
+        // the callback won't be called
+        shardcache_client_get_async_track_end(arg, 0, 1);
+        close(fd);
+        free(arg);
+    }
+    return rc;
+}
+
+/*
+ * Streams
+ *
+ * Streams keep the connection to the owner of a key across multiple calls,
+ * so that values can be read chunk by chunk as they arrive from the socket
+ * and written chunk by chunk as the application produces them, without ever
+ * holding the whole value in memory.
+ * Like shardcache_client_get_async(), they take over the tracking of the
+ * selected address from the thread state.
+ */
+
+typedef struct {
+    shardcache_client_t *client;
+    char *addr;
+    int fd;
+    shardcache_node_t *node;
+    int addr_index;
+    struct timeval start;
+} shc_stream_conn_t;
+
+static int
+shc_stream_connect(shardcache_client_t *c, int route, void *key, size_t klen, shc_stream_conn_t *conn)
+{
+    conn->client = c;
+    conn->fd = -1;
+    conn->addr = select_node_route(c, route, key, klen, &conn->fd, NULL);
+    if (conn->fd < 0) {
+        shardcache_client_set_connect_error(c, conn->addr);
+        return -1;
+    }
+
+    shardcache_client_tls_t *tls = shardcache_client_tls(c);
+    conn->node = tls->tracked_node;
+    conn->addr_index = tls->tracked_index;
+    conn->start = tls->tracked_start;
+    tls->tracked_node = NULL;
+    return 0;
+}
+
+// the connection goes back to the pool only if the whole response has been read
+static void
+shc_stream_release(shc_stream_conn_t *conn, int completed, int failed)
+{
+    if (conn->fd < 0)
+        return;
+
+    if (conn->node) {
+        shardcache_node_address_end(conn->node, conn->addr_index,
+                                    completed ? &conn->start : NULL, failed);
+        conn->node = NULL;
+    }
+
+    if (completed && !failed)
+        connections_pool_add(conn->client->connections, conn->addr, conn->fd);
+    else
+        close(conn->fd);
+    conn->fd = -1;
+}
+
+struct _shardcache_client_get_stream_s {
+    shc_stream_conn_t conn;
+    async_read_ctx_t *reader;
+    fbuf_t chunk;
+    size_t chunk_offset; // the part of the chunk already returned
+    int status_index;
+    char status;
+    int done;
+};
+
+static int
+shc_get_stream_read_record(void *data, size_t len, int idx, size_t total_len, void *priv)
+{
+    shardcache_client_get_stream_t *s = (shardcache_client_get_stream_t *)priv;
+    if (idx == 0 && len)
+        fbuf_add_binary(&s->chunk, data, len);
+    else if (idx == s->status_index && len == 1)
+        s->status = *((char *)data);
+    return 0;
+}
+
+shardcache_client_get_stream_t *
+shardcache_client_get_stream(shardcache_client_t *c,
+                             void *key,
+                             size_t klen,
+                             uint32_t offset,
+                             uint32_t length)
+{
+    if (offset && !length) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_ARGS,
+                                    "A length is required when reading from an offset");
+        return NULL;
+    }
+
+    shardcache_client_get_stream_t *s = calloc(1, sizeof(shardcache_client_get_stream_t));
+    if (!s) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_INTERNAL,
+                                    "Can't allocate a new stream");
+        return NULL;
+    }
+
+    if (shc_stream_connect(c, SHC_ROUTE_READ, key, klen, &s->conn) != 0) {
+        free(s);
+        return NULL;
+    }
+
+    uint32_t offset_nbo = htonl(offset);
+    uint32_t length_nbo = htonl(length);
+    shardcache_record_t record[3] = {
+        { .v = key, .l = klen },
+        { .v = &offset_nbo, .l = sizeof(uint32_t) },
+        { .v = &length_nbo, .l = sizeof(uint32_t) }
+    };
+
+    // the status follows the value in responses to GET_ASYNC
+    // and the remaining bytes in responses to GET_OFFSET
+    int rc;
+    if (length) {
+        rc = write_message(s->conn.fd, SHC_HDR_GET_OFFSET, record, 3);
+        s->status_index = 2;
+    } else {
+        rc = write_message(s->conn.fd, SHC_HDR_GET_ASYNC, record, 1);
+        s->status_index = 1;
+    }
+
+    if (rc != 0) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't send the request to node '%s'", s->conn.addr);
+        shc_stream_release(&s->conn, 0, 1);
+        free(s);
+        return NULL;
+    }
+
+    s->status = SHC_RES_OK;
+    s->reader = async_read_context_create(shc_get_stream_read_record, s);
+    if (!s->reader) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_INTERNAL,
+                                    "Can't create the reader for the stream");
+        shc_stream_release(&s->conn, 0, 0);
+        free(s);
+        return NULL;
+    }
+    shardcache_client_clear_error(c);
+    return s;
+}
+
+int
+shardcache_client_get_stream_next(shardcache_client_get_stream_t *s, void **data, size_t *dlen)
+{
+    shardcache_client_t *c = s->conn.client;
+    char buf[SHC_STREAM_READ_SIZE];
+
+    // a compressed record (protocol v3) is decompressed as a whole once fully
+    // received, so a single read can produce much more data than it consumed:
+    // the chunk is then returned in slices of at most SHC_STREAM_READ_SIZE bytes
+    if (s->chunk_offset >= fbuf_used(&s->chunk)) {
+        fbuf_clear(&s->chunk);
+        s->chunk_offset = 0;
+
+        while (!fbuf_used(&s->chunk) && !s->done) {
+            int rb = read_socket(s->conn.fd, buf, sizeof(buf), 0);
+            if (rb <= 0) {
+                s->done = -1;
+                break;
+            }
+
+            int offset = 0;
+            while (offset < rb && !s->done) {
+                int processed = 0;
+                async_read_context_state_t state =
+                    async_read_context_input_data(s->reader, buf + offset, rb - offset, &processed);
+                offset += processed;
+
+                if (state == SHC_STATE_READING_DONE) {
+                    if (async_read_context_hdr(s->reader) == SHC_HDR_RESPONSE && s->status == SHC_RES_OK)
+                        s->done = 1;
+                    else
+                        s->done = -1;
+                } else if (state == SHC_STATE_READING_ERR || !processed) {
+                    s->done = -1;
+                }
+            }
+        }
+
+        if (s->done)
+            shc_stream_release(&s->conn, 1, s->done == -1);
+    }
+
+    size_t avail = fbuf_used(&s->chunk) - s->chunk_offset;
+    if (avail) {
+        if (avail > SHC_STREAM_READ_SIZE)
+            avail = SHC_STREAM_READ_SIZE;
+        if (data)
+            *data = fbuf_data(&s->chunk) + s->chunk_offset;
+        if (dlen)
+            *dlen = avail;
+        s->chunk_offset += avail;
+        shardcache_client_clear_error(c);
+        return 1;
+    }
+
+    if (s->done == -1) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't fetch data from node '%s'", s->conn.addr);
+        return -1;
+    }
+
+    shardcache_client_clear_error(c);
+    return 0;
+}
+
+void
+shardcache_client_get_stream_close(shardcache_client_get_stream_t *s)
+{
+    // the rest of the response, if any, is still on the socket
+    shc_stream_release(&s->conn, 0, 0);
+    async_read_context_destroy(s->reader);
+    fbuf_destroy(&s->chunk);
+    free(s);
+}
+
+struct _shardcache_client_set_stream_s {
+    shc_stream_conn_t conn;
+    void *key;
+    size_t klen;
+    size_t vlen;
+    size_t written;
+    uint32_t expire;
+    char version;
+    uint32_t crc;
+    int failed;
+};
+
+shardcache_client_set_stream_t *
+shardcache_client_set_stream(shardcache_client_t *c,
+                             void *key,
+                             size_t klen,
+                             size_t vlen,
+                             uint32_t expire)
+{
+    if (vlen > SHARDCACHE_MSG_MAX_RECORD_LEN) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_ARGS,
+                                    "The value can't be bigger than %d bytes",
+                                    SHARDCACHE_MSG_MAX_RECORD_LEN);
+        return NULL;
+    }
+
+    shardcache_client_set_stream_t *s = calloc(1, sizeof(shardcache_client_set_stream_t));
+    if (!s) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_INTERNAL,
+                                    "Can't allocate a new stream");
+        return NULL;
+    }
+
+    // the key is needed again to drop the local copy once the value is stored
+    s->key = malloc(klen);
+    if (!s->key) {
+        free(s);
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_INTERNAL,
+                                    "Can't allocate a new stream");
+        return NULL;
+    }
+    memcpy(s->key, key, klen);
+    s->klen = klen;
+    s->vlen = vlen;
+    s->expire = expire;
+    s->version = ATOMIC_READ(c->protocol_version);
+
+    if (shc_stream_connect(c, SHC_ROUTE_WRITE, key, klen, &s->conn) != 0) {
+        free(s->key);
+        free(s);
+        return NULL;
+    }
+
+    if (send_stream_to_peer_begin(s->conn.fd, key, klen, vlen, s->version, &s->crc) != 0) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't send the request to node '%s'", s->conn.addr);
+        shc_stream_release(&s->conn, 0, 1);
+        free(s->key);
+        free(s);
+        return NULL;
+    }
+
+    shardcache_client_clear_error(c);
+    return s;
+}
+
+int
+shardcache_client_set_stream_write(shardcache_client_set_stream_t *s, void *data, size_t len)
+{
+    shardcache_client_t *c = s->conn.client;
+
+    if (s->failed) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "The stream to node '%s' already failed", s->conn.addr);
+        return -1;
+    }
+
+    if (len > s->vlen - s->written) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_ARGS,
+                                    "Can't write more than the %zu bytes announced",
+                                    s->vlen);
+        return -1;
+    }
+
+    if (send_stream_to_peer_data(s->conn.fd, data, len, s->version, &s->crc) != 0) {
+        s->failed = 1;
+        shc_stream_release(&s->conn, 0, 1);
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't send data to node '%s'", s->conn.addr);
+        return -1;
+    }
+
+    s->written += len;
+    shardcache_client_clear_error(c);
+    return 0;
+}
+
+int
+shardcache_client_set_stream_close(shardcache_client_set_stream_t *s)
+{
+    shardcache_client_t *c = s->conn.client;
+    int rc = -1;
+
+    if (s->failed) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                    "Can't set new data on node '%s'", s->conn.addr);
+    } else if (s->written != s->vlen) {
+        // the message can't be completed, the node will discard it
+        // when the connection is closed
+        shc_stream_release(&s->conn, 0, 0);
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_ARGS,
+                                    "Only %zu of the %zu bytes announced have been written",
+                                    s->written, s->vlen);
+    } else {
+        rc = send_stream_to_peer_end(s->conn.addr, s->conn.fd, s->expire, s->version, s->crc);
+
+        // the local copy is dropped even if the command failed
+        // (it might have been applied anyway)
+        shc_near_cache_invalidate(c, s->key, s->klen);
+
+        if (rc != 0) {
+            rc = -1;
+            shc_stream_release(&s->conn, 0, 1);
+            shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_NODE,
+                                        "Can't set new data on node '%s'", s->conn.addr);
+        } else {
+            shc_stream_release(&s->conn, 1, 0);
+            shardcache_client_clear_error(c);
+        }
+    }
+
+    free(s->key);
+    free(s);
+    return rc;
 }
 
 shc_multi_item_t *
@@ -763,10 +2749,61 @@ shc_multi_item_destroy(shc_multi_item_t *item)
 {
     free(item->key);
     free(item->data);
+    free(item);
+}
+
+// the topology references the nodes of the shards array when they are known,
+// so they can be compared by pointer
+static inline int
+shc_shard_index(shardcache_client_t *c, shardcache_node_t *node)
+{
+    int i;
+    for (i = 0; node && i < c->num_shards; i++) {
+        if (c->shards[i] == node)
+            return i;
+    }
+    return -1;
+}
+
+static inline int
+shc_node_index(shardcache_client_t *c, char *addr)
+{
+    int i;
+    for (i = 0; i < c->num_shards; i++) {
+        // any of the replicas might have been selected
+        int n, num_addresses = shardcache_node_num_addresses(c->shards[i]);
+        for (n = 0; n < num_addresses; n++) {
+            if (strcmp(shardcache_node_get_address_at_index(c->shards[i], n), addr) == 0)
+                return i;
+        }
+    }
+    return -1;
+}
+
+// returns the max number of keys which can be requested to the node
+// with a single GET_MULTI command, 0 if pipelined GETs must be used instead
+static inline int
+shc_multi_command_max_keys(shardcache_client_t *c, char *addr)
+{
+    int max_keys = ATOMIC_READ(c->multi_command_max_keys);
+    if (!max_keys)
+        return 0;
+
+    int i = shc_node_index(c, addr);
+    if (i >= 0) {
+        time_t failure = ATOMIC_READ(c->multi_failures[i]);
+        if (failure && time(NULL) - failure < SHC_MULTI_COMMAND_RETRY_INTERVAL)
+            return 0;
+    }
+
+    return max_keys;
 }
 
 static linked_list_t *
-shc_split_buckets(shardcache_client_t *c, shc_multi_item_t **items, int *num_items)
+shc_split_buckets(shardcache_client_t *c,
+                  shardcache_hdr_t cmd,
+                  shc_multi_item_t **items,
+                  int *num_items)
 {
     linked_list_t *pools = list_create();
     int i;
@@ -774,10 +2811,16 @@ shc_split_buckets(shardcache_client_t *c, shc_multi_item_t **items, int *num_ite
         shc_multi_item_t *item = items[i];
         item->idx = i;
 
-        char *addr = select_node(c, item->key, item->klen, NULL);
+        char *addr = select_node_route(c, shc_command_route(cmd), item->key, item->klen, NULL, NULL);
+
+        // the keys sent to the same node with a single GET_MULTI command
+        // are capped as the requests pipelined on the same connection
+        int max_items = cmd == SHC_HDR_GET ? shc_multi_command_max_keys(c, addr) : 0;
+        if (!max_items)
+            max_items = ATOMIC_READ(c->pipeline_max);
 
         tagged_value_t *tval = list_get_tagged_value(pools, addr);
-        if (!tval || list_count((linked_list_t *)tval->value) > c->pipeline_max)
+        if (!tval || list_count((linked_list_t *)tval->value) >= max_items)
         {
             linked_list_t *sublist = list_create();
             tval = list_create_tagged_sublist(addr, sublist);
@@ -813,21 +2856,98 @@ struct shc_multi_ctx_s {
     int fd;
     int (*cb)(shc_multi_ctx_t *, int);
     void *priv;
+    // all the keys have been requested with a single GET_MULTI command,
+    // the values array in the response is parsed while it arrives
+    int multi;
+    struct {
+        unsigned char size[sizeof(uint32_t)];
+        int size_len;
+        int count_read;
+        int item;
+        uint32_t left;
+        int failed;
+    } parser;
+    fbuf_t statuses;
 };
 
+// parse (part of) the array of values returned by a GET_MULTI command
+static int
+shc_multi_parse_values(shc_multi_ctx_t *ctx, char *data, size_t len)
+{
+    while (len) {
+        if (ctx->parser.left) {
+            shc_multi_item_t *item = ctx->items[ctx->parser.item];
+            size_t copy_len = len < ctx->parser.left ? len : ctx->parser.left;
+            memcpy((char *)item->data + item->dlen, data, copy_len);
+            item->dlen += copy_len;
+            ctx->parser.left -= copy_len;
+            data += copy_len;
+            len -= copy_len;
+            if (!ctx->parser.left)
+                ctx->parser.item++;
+            continue;
+        }
+
+        // the number of items and the size of each of them are 32bit integers
+        int copy_len = sizeof(uint32_t) - ctx->parser.size_len;
+        if (copy_len > len)
+            copy_len = len;
+        memcpy(ctx->parser.size + ctx->parser.size_len, data, copy_len);
+        ctx->parser.size_len += copy_len;
+        data += copy_len;
+        len -= copy_len;
+        if (ctx->parser.size_len < sizeof(uint32_t))
+            break;
+
+        uint32_t size = 0;
+        memcpy(&size, ctx->parser.size, sizeof(uint32_t));
+        size = ntohl(size);
+        ctx->parser.size_len = 0;
+
+        if (!ctx->parser.count_read) {
+            if (size != ctx->num_requests)
+                return -1;
+            ctx->parser.count_read = 1;
+            continue;
+        }
+
+        if (ctx->parser.item >= ctx->num_requests || size > SHARDCACHE_MSG_MAX_RECORD_LEN)
+            return -1;
+
+        shc_multi_item_t *item = ctx->items[ctx->parser.item];
+        free(item->data);
+        item->data = size ? malloc(size) : NULL;
+        item->dlen = 0;
+        if (size && !item->data)
+            return -1;
+
+        ctx->parser.left = size;
+        if (!size)
+            ctx->parser.item++;
+    }
+    return 0;
+}
+
 static int
 shc_multi_collect_data(void *data, size_t len, int idx, size_t total_len, void *priv)
 {
-    if (idx != 0) // XXX - HC (should use the record 1 to check the actual status)
+    shc_multi_ctx_t *ctx = (shc_multi_ctx_t *)priv;
+
+    if (ctx->multi) {
+        if (idx == 0 && !ctx->parser.failed && shc_multi_parse_values(ctx, data, len) != 0)
+            ctx->parser.failed = 1;
+        else if (idx == 1 && len)
+            fbuf_add_binary(&ctx->statuses, data, len);
         return 0;
+    }
 
-    shc_multi_ctx_t *ctx = (shc_multi_ctx_t *)priv;
+    if (idx != 0) // XXX - HC (should use the record 1 to check the actual status)
+        return 0;
 
     if (ctx->response_index >= ctx->num_requests) {
-        ctx->client->errno = SHARDCACHE_CLIENT_ERROR_PROTOCOL;
-        snprintf(ctx->client->errstr, sizeof(ctx->client->errstr),
-                "Unexpected response (response_index: %d, expected_requests: %d)",
-                ctx->response_index, ctx->num_requests);
+        shardcache_client_set_error(ctx->client, SHARDCACHE_CLIENT_ERROR_PROTOCOL,
+                                    "Unexpected response (response_index: %d, expected_requests: %d)",
+                                    ctx->response_index, ctx->num_requests);
         return -1;
     }
 
@@ -851,6 +2971,7 @@ shc_multi_context_destroy(shc_multi_ctx_t *ctx)
 {
     async_read_context_destroy(ctx->reader);
     fbuf_free(ctx->commands);
+    fbuf_destroy(&ctx->statuses);
     free(ctx->items);
 
     if (ctx->fd >= 0) {
@@ -873,6 +2994,7 @@ shc_multi_context_create(shardcache_client_t *c,
                          void *priv)
 {
     shc_multi_ctx_t *ctx = calloc(1, sizeof(shc_multi_ctx_t));
+    shc_messaging_settings(c);
     ctx->client = c;
     ctx->commands = fbuf_create(0);
     ctx->num_requests = list_count(items);
@@ -883,10 +3005,45 @@ shc_multi_context_create(shardcache_client_t *c,
     ctx->total_count = total_count;
     ctx->cb = cb;
     ctx->priv = priv;
+    ctx->multi = (cmd == SHC_HDR_GET && ctx->num_requests > 1 &&
+                  shc_multi_command_max_keys(c, peer) >= ctx->num_requests);
+
     int n;
+    for (n = 0; n < ctx->num_requests; n++)
+        ctx->items[n] = list_pick_value(items, n);
+
+    if (ctx->multi) {
+        void **keys = malloc(sizeof(void *) * ctx->num_requests);
+        size_t *klens = malloc(sizeof(size_t) * ctx->num_requests);
+        for (n = 0; n < ctx->num_requests; n++) {
+            keys[n] = ctx->items[n]->key;
+            klens[n] = ctx->items[n]->klen;
+        }
+        fbuf_t keys_record = FBUF_STATIC_INITIALIZER;
+        keys_to_record(ctx->num_requests, keys, klens, &keys_record);
+        free(keys);
+        free(klens);
+        shardcache_record_t record = {
+            .v = fbuf_data(&keys_record),
+            .l = fbuf_used(&keys_record)
+        };
+        int rc = build_message(SHC_HDR_GET_MULTI, &record, 1, ctx->commands, messaging_protocol_version());
+        fbuf_destroy(&keys_record);
+        if (rc != 0) {
+            shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_INTERNAL,
+                                        "Can't create new command!");
+            fbuf_free(ctx->commands);
+            free(ctx->items);
+            async_read_context_destroy(ctx->reader);
+            free(ctx);
+            return NULL;
+        }
+        gettimeofday(&ctx->last_update, NULL);
+        return ctx;
+    }
+
     for (n = 0; n < ctx->num_requests; n++) {
-        shc_multi_item_t *item = list_pick_value(items, n);
-        ctx->items[n] = item;
+        shc_multi_item_t *item = ctx->items[n];
 
         shardcache_record_t record[3] = {
             {
@@ -916,9 +3073,9 @@ shc_multi_context_create(shardcache_client_t *c,
             }
         }
 
-        if (build_message(cmd, record, num_records, ctx->commands, SHC_PROTOCOL_VERSION) != 0) {
-            c->errno = SHARDCACHE_CLIENT_ERROR_INTERNAL;
-            snprintf(c->errstr, sizeof(c->errstr), "Can't create new command!");
+        if (build_message(cmd, record, num_records, ctx->commands, messaging_protocol_version()) != 0) {
+            shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_INTERNAL,
+                                        "Can't create new command!");
             fbuf_free(ctx->commands);
             free(ctx->items);
             async_read_context_destroy(ctx->reader);
@@ -952,7 +3109,37 @@ shc_multi_fetch_response(iomux_t *iomux, int fd, unsigned char *data, int len, v
 
     SHC_DEBUG3("received %d\n", len);
     async_read_context_state_t state = async_read_context_input_data(ctx->reader, data, len, &processed);
-    while (state == SHC_STATE_READING_DONE) {
+    if (ctx->multi && state == SHC_STATE_READING_DONE) {
+        if (async_read_context_hdr(ctx->reader) != SHC_HDR_RESPONSE ||
+            ctx->parser.failed || ctx->parser.item != ctx->num_requests)
+        {
+            shardcache_client_set_error(ctx->client, SHARDCACHE_CLIENT_ERROR_PROTOCOL,
+                                        "Bad response to the GET_MULTI command from '%s'",
+                                        ctx->peer);
+            iomux_close(iomux, fd);
+            return processed;
+        }
+
+        int i;
+        char *statuses = fbuf_data(&ctx->statuses);
+        for (i = 0; i < ctx->num_requests && i < fbuf_used(&ctx->statuses); i++)
+            ctx->items[i]->status = statuses[i];
+
+        // notify the items one by one as if they were the responses
+        // to pipelined requests
+        while (ctx->response_index < ctx->num_requests) {
+            if (ctx->cb && ctx->cb(ctx, 0) != 0) {
+                iomux_close(iomux, fd);
+                return processed;
+            }
+            ctx->response_index++;
+            if (ctx->total_count)
+                ctx->total_count[0]++;
+        }
+        state = async_read_context_update(ctx->reader);
+    }
+
+    while (!ctx->multi && state == SHC_STATE_READING_DONE) {
         if (ctx->cb && ctx->cb(ctx, 0) != 0) {
             iomux_close(iomux, fd);
             return processed;
@@ -965,11 +3152,10 @@ shc_multi_fetch_response(iomux_t *iomux, int fd, unsigned char *data, int len, v
     }
 
     if (state == SHC_STATE_READING_ERR) {
-        if (ctx->client->errno != SHARDCACHE_CLIENT_ERROR_PROTOCOL) {
-            ctx->client->errno = SHARDCACHE_CLIENT_ERROR_PROTOCOL;
-            snprintf(ctx->client->errstr, sizeof(ctx->client->errstr),
-                    "Async context returned error while parsing response for item %d",
-                    ctx->response_index + 1);
+        if (shardcache_client_errno(ctx->client) != SHARDCACHE_CLIENT_ERROR_PROTOCOL) {
+            shardcache_client_set_error(ctx->client, SHARDCACHE_CLIENT_ERROR_PROTOCOL,
+                                        "Async context returned error while parsing response for item %d",
+                                        ctx->response_index + 1);
         }
         iomux_close(iomux, fd);
     } else if (ctx->response_index == ctx->num_requests) {
@@ -1005,7 +3191,7 @@ shardcache_client_multi_loop(shardcache_client_t *c, iomux_t *iomux, int num_ite
     int rc = 0;
     uint32_t previous_count = 0;
     struct timeval hang_time = { 0, 0 };
-    struct timeval max_hang_time = { c->multi_command_max_wait, 0 };
+    struct timeval max_hang_time = { ATOMIC_READ(c->multi_command_max_wait), 0 };
     for (;;) {
         struct timeval tv = { 1, 0 };
         iomux_run(iomux, &tv);
@@ -1049,8 +3235,7 @@ shardcache_client_multi_send_requests(shardcache_client_t *c,
 {
     uint32_t count = list_count(pools);
 
-    c->errno = SHARDCACHE_CLIENT_OK;
-    c->errstr[0] = 0;
+    shardcache_client_clear_error(c);
 
     linked_list_t *contexts = list_create();
 
@@ -1062,19 +3247,18 @@ shardcache_client_multi_send_requests(shardcache_client_t *c,
         tagged_value_t *tval = list_pick_tagged_value(pools, i);
         linked_list_t *items = (linked_list_t *)tval->value;
         char *addr = tval->tag;
-        int fd = connections_pool_get(c->connections, addr);
+        int fd = shc_connection_get(c, addr);
         if (fd < 0) {
             // 1 retry
             char *failed_addr = addr;
-            addr = select_other_node(c, addr);
-            fd = connections_pool_get(c->connections, addr);
+            addr = select_other_node(c, shardcache_client_tls(c), addr);
+            fd = shc_connection_get(c, addr);
             SHC_WARNING("Can't connect to node at address %s, falling back to %s",
                         failed_addr, addr);
         }
 
         if (fd < 0) {
-            c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-            snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+            shardcache_client_set_connect_error(c, addr);
 
             shc_multi_ctx_t *ctx;
             while ((ctx = list_shift_value(contexts))) {
@@ -1125,49 +3309,124 @@ shardcache_client_multi_send_requests(shardcache_client_t *c,
     return contexts;
 }
 
-static inline int
-shardcache_client_multi(shardcache_client_t *c,
-                         shc_multi_item_t **items,
-                         shardcache_hdr_t cmd)
+// request the items and wait for the responses, the items requested
+// with a GET_MULTI command which wasn't answered properly are returned
+// in the (NULL-terminated) 'failed' array, if provided
+static int
+shardcache_client_multi_round(shardcache_client_t *c,
+                              shc_multi_item_t **items,
+                              shardcache_hdr_t cmd,
+                              uint32_t *total_count,
+                              shc_multi_item_t ***failed)
 {
     int num_items = 0;
-    linked_list_t *pools = shc_split_buckets(c, items, &num_items);
+    linked_list_t *pools = shc_split_buckets(c, cmd, items, &num_items);
 
     SHC_DEBUG("Requesting %d items using %u connections",
               num_items, list_count(pools));
 
     iomux_t *iomux = iomux_create(0, 0);
 
+    linked_list_t *contexts = shardcache_client_multi_send_requests(c, cmd, items, num_items, pools, iomux, total_count, NULL, NULL);
+    if (!contexts) {
+        iomux_destroy(iomux);
+        list_destroy(pools);
+        return -1;
+    }
+
+    // this will run the iomux until we get all the response, an error occurs
+    // or the timeout (c->multi_command_max_wait) expires
+    int rc = shardcache_client_multi_loop(c, iomux, *total_count + num_items, (int *)total_count);
+
+    int num_failed = 0;
+    shc_multi_ctx_t *ctx = NULL;
+    while ((ctx = list_shift_value(contexts))) {
+        if (ctx->fd >= 0)
+            iomux_remove(iomux, ctx->fd);
+
+        if (failed && ctx->multi && ctx->response_index < ctx->num_requests) {
+            SHC_WARNING("Node at address %s didn't handle the GET_MULTI command, "
+                        "using pipelined GET commands for a while", ctx->peer);
+            int i = shc_node_index(c, ctx->peer);
+            if (i >= 0)
+                ATOMIC_SET(c->multi_failures[i], time(NULL));
+
+            *failed = realloc(*failed, sizeof(shc_multi_item_t *) * (num_failed + ctx->num_requests + 1));
+            for (i = 0; i < ctx->num_requests; i++) {
+                shc_multi_item_t *item = ctx->items[i];
+                free(item->data);
+                item->data = NULL;
+                item->dlen = 0;
+                (*failed)[num_failed++] = item;
+            }
+            (*failed)[num_failed] = NULL;
+        }
+
+        shc_multi_context_destroy(ctx);
+    }
+    iomux_destroy(iomux);
+    list_destroy(contexts);
+    list_destroy(pools);
+
+    return rc;
+}
+
+// the node returns an empty value with an error status if it can't fit
+// the value in the response to a GET_MULTI command
+#define SHC_MULTI_ITEM_DROPPED(_i) ((unsigned char)(_i)->status == SHC_RES_ERR && !(_i)->dlen)
+
+// request the item alone (with a plain GET command)
+static void
+shc_multi_refetch_item(shardcache_client_t *c, shc_multi_item_t *item)
+{
+    shc_multi_item_t *single[2] = { item, NULL };
+    uint32_t idx = item->idx;
+    uint32_t count = 0;
+    item->status = SHC_RES_OK;
+    shardcache_client_multi_round(c, single, SHC_HDR_GET, &count, NULL);
+    if (count != 1)
+        item->status = SHC_RES_ERR;
+    item->idx = idx;
+}
+
+static inline int
+shardcache_client_multi(shardcache_client_t *c,
+                         shc_multi_item_t **items,
+                         shardcache_hdr_t cmd)
+{
+    int num_items = 0;
+    while (items[num_items]) {
+        // the status of the items is reported only in GET_MULTI responses
+        if (cmd == SHC_HDR_GET)
+            items[num_items]->status = SHC_RES_OK;
+        num_items++;
+    }
 
     uint32_t total_count = 0;
-
-    linked_list_t *contexts = shardcache_client_multi_send_requests(c, cmd, items, num_items, pools, iomux, &total_count, NULL, NULL);
-    if (!contexts) {
-        iomux_destroy(iomux);
-        list_destroy(pools);
-        return -1;
+    shc_multi_item_t **failed = NULL;
+
+    int rc = shardcache_client_multi_round(c, items, cmd, &total_count, &failed);
+    if (failed) {
+        // nodes not supporting the GET_MULTI command (older versions)
+        // will get the same keys through pipelined GET commands
+        shardcache_client_clear_error(c);
+        rc = shardcache_client_multi_round(c, failed, cmd, &total_count, NULL);
+        free(failed);
     }
 
-    // this will run the iomux until we get all the response, an error occurs
-    // or the timeout (c->multi_command_max_wait) expires
-    int rc = shardcache_client_multi_loop(c, iomux, num_items, &total_count);
-
-    shc_multi_ctx_t *ctx = NULL;
-    while ((ctx = list_shift_value(contexts))) {
-        if (ctx->fd >= 0)
-            iomux_remove(iomux, ctx->fd);
-        shc_multi_context_destroy(ctx);
+    // the values which didn't fit in the response to a GET_MULTI command
+    // (or which couldn't be fetched by the node) are requested one by one
+    int i;
+    for (i = 0; cmd == SHC_HDR_GET && i < num_items; i++) {
+        if (SHC_MULTI_ITEM_DROPPED(items[i]))
+            shc_multi_refetch_item(c, items[i]);
     }
-    iomux_destroy(iomux);
-    list_destroy(contexts);
-    list_destroy(pools);
 
     if (total_count != num_items) {
-        if (c->errno != SHARDCACHE_CLIENT_ERROR_PROTOCOL) {
-            c->errno = SHARDCACHE_CLIENT_ERROR_PROTOCOL;
-            snprintf(c->errstr, sizeof(c->errstr),
-                    "Number of responses doesn't match (received: %d, expected: %d)",
-                    total_count, num_items);
+        if (shardcache_client_errno(c) != SHARDCACHE_CLIENT_ERROR_PROTOCOL) {
+            shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_PROTOCOL,
+                                        "Number of responses doesn't match (received: %d, expected: %d)",
+                                        total_count, num_items);
 
         }
         rc = 2;
@@ -1189,13 +3448,19 @@ shardcache_client_set_multi(shardcache_client_t *c,
                             shc_multi_item_t **items)
 
 {
-    return shardcache_client_multi(c, items, SHC_HDR_SET);
+    int rc = shardcache_client_multi(c, items, SHC_HDR_SET);
+    if (c->near_cache) {
+        int i;
+        for (i = 0; items[i]; i++)
+            shc_near_cache_invalidate(c, items[i]->key, items[i]->klen);
+    }
+    return rc;
 }
 
 shardcache_node_t *
 shardcache_client_current_node(shardcache_client_t *c)
 {
-    return c->current_node;
+    return shardcache_client_tls(c)->current_node;
 }
 
 typedef struct {
@@ -1252,7 +3517,7 @@ async_job_create(shardcache_client_t *c, int cmd, void *argp, size_t argn)
             }
             copy[i] = NULL;
             job->arg.multi.items = copy;
-            job->arg.multi.pools = shc_split_buckets(c,  job->arg.multi.items, &job->arg.multi.nitems);
+            job->arg.multi.pools = shc_split_buckets(c, SHC_HDR_GET, job->arg.multi.items, &job->arg.multi.nitems);
             break;
         }
         default:
@@ -1377,6 +3642,10 @@ async_thread_get_multi(shc_multi_ctx_t *ctx, int eof)
         return 0;
     }
 
+    // NOTE: this blocks the async thread until the value has been received
+    if (ctx->multi && SHC_MULTI_ITEM_DROPPED(item))
+        shc_multi_refetch_item(ctx->client, item);
+
     uint32_t idx_nbo = htonl(item->idx);
     uint32_t dlen_nbo = htonl(item->dlen);
     if (fbuf_used(&job->buf)) {
@@ -1422,12 +3691,13 @@ async_thread(void *priv)
                 case JOB_CMD_GET:
                 {
                     job->arg.single.fd = -1;
-                    char *addr = select_node(c, job->arg.single.key, job->arg.single.klen, &job->arg.single.fd);
+                    char *addr = select_node(c, job->arg.single.key, job->arg.single.klen, &job->arg.single.fd, NULL);
+                    // the response is read asynchronously and isn't measured
+                    shc_address_track_end(shardcache_client_tls(c), 0, 0);
                     if (job->arg.single.fd < 0) {
-                        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
-                        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+                        shardcache_client_set_connect_error(c, addr);
                         async_job_destroy(job);
-                        continue;
+                        break;
                     }
 
                     int rc = fetch_from_peer_async(addr,
@@ -1494,6 +3764,17 @@ async_thread(void *priv)
     pthread_exit(0);
 }
 
+// the async thread is started on demand, possibly
+// by multiple threads sharing the same client
+static void
+shardcache_client_start_async_thread(shardcache_client_t *c)
+{
+    MUTEX_LOCK(c->wakeup_lock);
+    if (!c->thread)
+        pthread_create(&c->thread, NULL, async_thread, c);
+    MUTEX_UNLOCK(c->wakeup_lock);
+}
+
 int
 shardcache_client_getf(shardcache_client_t *c, void *key, size_t klen)
 {
@@ -1501,11 +3782,7 @@ shardcache_client_getf(shardcache_client_t *c, void *key, size_t klen)
     async_job_t *job = async_job_create(c, JOB_CMD_GET, key, klen);
 
     if (job) {
-        if (!c->thread) {
-            MUTEX_INIT(c->wakeup_lock);
-            CONDITION_INIT(c->wakeup_cond);
-            pthread_create(&c->thread, NULL, async_thread, c);
-        }
+        shardcache_client_start_async_thread(c);
         queue_push_left(c->async_jobs, job);
         CONDITION_SIGNAL(c->wakeup_cond, c->wakeup_lock);
         return job->pipe[0];
@@ -1519,11 +3796,7 @@ shardcache_client_get_multif(shardcache_client_t *c, shc_multi_item_t **items)
     async_job_t *job = async_job_create(c, JOB_CMD_GET_MULTI, items, 0);
 
     if (job) {
-        if (!c->thread) {
-            MUTEX_INIT(c->wakeup_lock);
-            CONDITION_INIT(c->wakeup_cond);
-            pthread_create(&c->thread, NULL, async_thread, c);
-        }
+        shardcache_client_start_async_thread(c);
 
         queue_push_left(c->async_jobs, job);
         CONDITION_SIGNAL(c->wakeup_cond, c->wakeup_lock);
@@ -1531,5 +3804,577 @@ shardcache_client_get_multif(shardcache_client_t *c, shc_multi_item_t **items)
     }
     return -1;
 }
+
+/*
+ * Non-blocking api driven by an external event loop
+ *
+ * Each async handle keeps (at most) one connection per node, requests sent
+ * to the same node are pipelined on it and completed in the same order as
+ * they have been issued (which is the order of the responses).
+ * Nothing here blocks or spawns threads: the caller is notified through the
+ * watch callback about the filedescriptors (and the events) to monitor and
+ * it hands back the ready ones to shardcache_client_async_handle()
+ */
+
+typedef struct _shc_async_request_s {
+    unsigned char hdr;
+    void *key;
+    size_t klen;
+    fbuf_t data;   // the first record of the response
+    char status;   // the second record (GET responses only)
+    int num_records;
+    shardcache_client_async_cb cb;
+    void *priv;
+    TAILQ_ENTRY(_shc_async_request_s) next;
+} shc_async_request_t;
+
+typedef struct {
+    shardcache_client_async_t *async;
+    char *addr;
+    int fd;
+    int connecting;
+    int events; // the events the caller has been asked to watch
+    fbuf_t output;
+    async_read_ctx_t *reader;
+    struct timeval last_activity;
+    int num_requests;
+    TAILQ_HEAD(, _shc_async_request_s) requests;
+} shc_async_conn_t;
+
+struct shardcache_client_async_s {
+    shardcache_client_t *client;
+    shardcache_client_watch_cb watch_cb;
+    void *priv;
+    // indexed as the shards array
+    shc_async_conn_t *conns;
+    int num_requests;
+};
+
+static int
+shc_async_collect_response(void *data, size_t len, int idx, size_t total_len, void *priv)
+{
+    shc_async_conn_t *conn = (shc_async_conn_t *)priv;
+    shc_async_request_t *req = TAILQ_FIRST(&conn->requests);
+
+    if (idx < 0)
+        return 0;
+
+    // a response nobody asked for
+    if (!req)
+        return -1;
+
+    if (idx >= req->num_records)
+        req->num_records = idx + 1;
+
+    if (idx == 0 && len)
+        fbuf_add_binary(&req->data, data, len);
+    else if (idx == 1 && len)
+        req->status = *((char *)data);
+
+    return 0;
+}
+
+static void
+shc_async_request_destroy(shc_async_request_t *req)
+{
+    fbuf_destroy(&req->data);
+    free(req->key);
+    free(req);
+}
+
+static inline void
+shc_async_conn_update_events(shc_async_conn_t *conn)
+{
+    if (conn->fd < 0)
+        return;
+
+    int events = SHARDCACHE_CLIENT_ASYNC_READ;
+    if (conn->connecting || fbuf_used(&conn->output))
+        events |= SHARDCACHE_CLIENT_ASYNC_WRITE;
+
+    if (events != conn->events) {
+        conn->events = events;
+        conn->async->watch_cb(conn->fd, events, conn->async->priv);
+    }
+}
+
+static int
+shc_async_conn_open(shc_async_conn_t *conn)
+{
+    int fd = connect_to_peer_nonblocking(conn->addr);
+    if (fd < 0)
+        return -1;
+
+    conn->fd = fd;
+    conn->connecting = 1;
+    conn->events = 0;
+    conn->reader = async_read_context_create(shc_async_collect_response, conn);
+    gettimeofday(&conn->last_activity, NULL);
+    return 0;
+}
+
+// closes the connection and fails all the requests still waiting for a response,
+// returns the number of failed requests
+static int
+shc_async_conn_close(shc_async_conn_t *conn)
+{
+    if (conn->fd < 0)
+        return 0;
+
+    if (conn->events)
+        conn->async->watch_cb(conn->fd, 0, conn->async->priv);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->connecting = 0;
+    conn->events = 0;
+    fbuf_clear(&conn->output);
+    async_read_context_destroy(conn->reader);
+    conn->reader = NULL;
+
+    // detach the pending requests first, the callbacks might
+    // issue new requests (which would reopen the connection)
+    TAILQ_HEAD(, _shc_async_request_s) failed;
+    TAILQ_INIT(&failed);
+    TAILQ_CONCAT(&failed, &conn->requests, next);
+    int num_failed = conn->num_requests;
+    conn->async->num_requests -= num_failed;
+    conn->num_requests = 0;
+
+    shc_async_request_t *req;
+    while ((req = TAILQ_FIRST(&failed))) {
+        TAILQ_REMOVE(&failed, req, next);
+        req->cb(conn->async, req->key, req->klen, NULL, 0, -1, req->priv);
+        shc_async_request_destroy(req);
+    }
+    return num_failed;
+}
+
+static void
+shc_async_request_complete(shc_async_conn_t *conn)
+{
+    shc_async_request_t *req = TAILQ_FIRST(&conn->requests);
+    TAILQ_REMOVE(&conn->requests, req, next);
+    conn->num_requests--;
+    conn->async->num_requests--;
+
+    int rc = -1;
+    if (async_read_context_hdr(conn->reader) == SHC_HDR_RESPONSE) {
+        if (req->hdr == SHC_HDR_GET) {
+            // protocol v1 responses don't include the status record
+            if (req->num_records == 1 || (req->num_records > 1 && req->status == SHC_RES_OK))
+                rc = 0;
+        } else if (fbuf_used(&req->data)) {
+            unsigned char status = *((unsigned char *)fbuf_data(&req->data));
+            if (req->hdr == SHC_HDR_EXISTS)
+                rc = status == SHC_RES_YES ? 1 : (status == SHC_RES_NO ? 0 : -1);
+            else
+                rc = status == SHC_RES_OK ? 0 : (status == SHC_RES_EXISTS ? 1 : -1);
+        }
+    }
+
+    if (req->hdr == SHC_HDR_SET || req->hdr == SHC_HDR_ADD ||
+        req->hdr == SHC_HDR_DELETE || req->hdr == SHC_HDR_EVICT)
+    {
+        shc_near_cache_invalidate(conn->async->client, req->key, req->klen);
+    }
+
+    if (rc == 0 && req->hdr == SHC_HDR_GET)
+        req->cb(conn->async, req->key, req->klen, fbuf_data(&req->data), fbuf_used(&req->data), 0, req->priv);
+    else
+        req->cb(conn->async, req->key, req->klen, NULL, 0, rc, req->priv);
+
+    shc_async_request_destroy(req);
+}
+
+static int
+shc_async_conn_write(shc_async_conn_t *conn)
+{
+    if (conn->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+            SHC_DEBUG("Can't connect to %s : %s", conn->addr, strerror(err ? err : errno));
+            return -1;
+        }
+        conn->connecting = 0;
+    }
+
+    while (fbuf_used(&conn->output)) {
+        ssize_t wb = write(conn->fd, fbuf_data(&conn->output), fbuf_used(&conn->output));
+        if (wb > 0) {
+            fbuf_remove(&conn->output, wb);
+            gettimeofday(&conn->last_activity, NULL);
+        } else if (wb == -1 && errno == EINTR) {
+            continue;
+        } else if (wb == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            SHC_DEBUG("Can't write to %s : %s", conn->addr, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+shc_async_conn_read(shc_async_conn_t *conn)
+{
+    char buf[65536];
+
+    for (;;) {
+        ssize_t rb = read(conn->fd, buf, sizeof(buf));
+        if (rb == -1 && errno == EINTR)
+            continue;
+        if (rb == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (rb <= 0) {
+            // the node closed an idle connection, not an error
+            if (rb == 0 && !conn->num_requests)
+                return -1;
+            SHC_DEBUG("Connection to %s closed : %s",
+                      conn->addr, rb == 0 ? "EOF" : strerror(errno));
+            return -1;
+        }
+
+        gettimeofday(&conn->last_activity, NULL);
+
+        int offset = 0;
+        while (offset < rb) {
+            int processed = 0;
+            async_read_context_state_t state =
+                async_read_context_input_data(conn->reader, buf + offset, rb - offset, &processed);
+            offset += processed;
+
+            while (state == SHC_STATE_READING_DONE) {
+                if (!TAILQ_FIRST(&conn->requests)) {
+                    state = SHC_STATE_READING_ERR;
+                    break;
+                }
+                shc_async_request_complete(conn);
+                state = async_read_context_update(conn->reader);
+            }
+
+            if (state == SHC_STATE_READING_ERR || (!processed && offset < rb)) {
+                SHC_WARNING("Bad response from %s", conn->addr);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+shardcache_client_async_t *
+shardcache_client_async_create(shardcache_client_t *c,
+                               shardcache_client_watch_cb watch_cb,
+                               void *priv)
+{
+    if (!watch_cb)
+        return NULL;
+
+    shardcache_client_async_t *a = calloc(1, sizeof(shardcache_client_async_t));
+    if (!a)
+        return NULL;
+
+    a->conns = calloc(c->num_shards, sizeof(shc_async_conn_t));
+    if (!a->conns) {
+        free(a);
+        return NULL;
+    }
+
+    a->client = c;
+    a->watch_cb = watch_cb;
+    a->priv = priv;
+
+    int i;
+    for (i = 0; i < c->num_shards; i++) {
+        shc_async_conn_t *conn = &a->conns[i];
+        conn->async = a;
+        conn->addr = shardcache_node_get_address(c->shards[i]);
+        conn->fd = -1;
+        FBUF_STATIC_INITIALIZER_POINTER(&conn->output, FBUF_MAXLEN_NONE, 64, 1024, 512);
+        TAILQ_INIT(&conn->requests);
+    }
+    return a;
+}
+
+void
+shardcache_client_async_destroy(shardcache_client_async_t *a)
+{
+    int i;
+    for (i = 0; i < a->client->num_shards; i++) {
+        shc_async_conn_close(&a->conns[i]);
+        fbuf_destroy(&a->conns[i].output);
+    }
+    free(a->conns);
+    free(a);
+}
+
+static int
+shardcache_client_async_command(shardcache_client_async_t *a,
+                                unsigned char hdr,
+                                shardcache_record_t *records,
+                                int num_records,
+                                shardcache_client_async_cb cb,
+                                void *priv)
+{
+    shardcache_client_t *c = a->client;
+    void *key = records[0].v;
+    size_t klen = records[0].l;
+
+    if (!key || !klen || !cb) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_ARGS,
+                                    "A key and a completion callback are required");
+        return -1;
+    }
+
+    // the topology is never refreshed from here (it would block the caller's
+    // event loop), keys owned by nodes the connections haven't been created for
+    // are sent to their owner in the static continuum (which will forward them)
+    shardcache_client_tls_t *tls = shardcache_client_tls(c);
+    shardcache_node_t *node = shc_route_node(c, tls, shc_command_route(hdr), key, klen);
+    int idx = shc_shard_index(c, node);
+    if (idx < 0 && node) {
+        int token = epoch_enter(c->epoch);
+        idx = shc_shard_index(c, shc_lookup_node(c->chash, ATOMIC_READ(c->routing),
+                                                 c->shards, c->num_shards, key, klen));
+        epoch_exit(c->epoch, token);
+    }
+    char *addr = idx >= 0 ? a->conns[idx].addr : NULL;
+    if (idx < 0) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_INTERNAL,
+                                    "Can't find the node responsible for the key");
+        return -1;
+    }
+
+    shc_async_conn_t *conn = &a->conns[idx];
+    if (conn->fd < 0 && shc_async_conn_open(conn) != 0) {
+        shardcache_client_set_connect_error(c, addr);
+        return -1;
+    }
+
+    shc_messaging_settings(c);
+    if (build_message(hdr, records, num_records, &conn->output, messaging_protocol_version()) != 0) {
+        shardcache_client_set_error(c, SHARDCACHE_CLIENT_ERROR_INTERNAL,
+                                    "Can't create the message for node '%s'", addr);
+        return -1;
+    }
+
+    shc_async_request_t *req = calloc(1, sizeof(shc_async_request_t));
+    req->hdr = hdr;
+    req->key = malloc(klen);
+    memcpy(req->key, key, klen);
+    req->klen = klen;
+    req->status = SHC_RES_ERR;
+    FBUF_STATIC_INITIALIZER_POINTER(&req->data, FBUF_MAXLEN_NONE, 64, 1024, 512);
+    req->cb = cb;
+    req->priv = priv;
+
+    // start the timer when the first request is queued
+    // on an idle connection
+    if (!conn->num_requests)
+        gettimeofday(&conn->last_activity, NULL);
+
+    TAILQ_INSERT_TAIL(&conn->requests, req, next);
+    conn->num_requests++;
+    a->num_requests++;
+
+    shc_async_conn_update_events(conn);
+
+    shardcache_client_clear_error(c);
+    return 0;
+}
+
+int
+shardcache_client_async_get(shardcache_client_async_t *a,
+                            void *key,
+                            size_t klen,
+                            shardcache_client_async_cb cb,
+                            void *priv)
+{
+    shardcache_record_t record = { .v = key, .l = klen };
+    return shardcache_client_async_command(a, SHC_HDR_GET, &record, 1, cb, priv);
+}
+
+static int
+shardcache_client_async_set_internal(shardcache_client_async_t *a,
+                                     unsigned char hdr,
+                                     void *key,
+                                     size_t klen,
+                                     void *data,
+                                     size_t dlen,
+                                     uint32_t expire,
+                                     shardcache_client_async_cb cb,
+                                     void *priv)
+{
+    uint32_t expire_nbo = htonl(expire);
+    shardcache_record_t records[3] = {
+        { .v = key, .l = klen },
+        { .v = data, .l = dlen },
+        { .v = &expire_nbo, .l = sizeof(expire_nbo) }
+    };
+    return shardcache_client_async_command(a, hdr, records, expire ? 3 : 2, cb, priv);
+}
+
+int
+shardcache_client_async_set(shardcache_client_async_t *a,
+                            void *key,
+                            size_t klen,
+                            void *data,
+                            size_t dlen,
+                            uint32_t expire,
+                            shardcache_client_async_cb cb,
+                            void *priv)
+{
+    return shardcache_client_async_set_internal(a, SHC_HDR_SET, key, klen, data, dlen, expire, cb, priv);
+}
+
+int
+shardcache_client_async_add(shardcache_client_async_t *a,
+                            void *key,
+                            size_t klen,
+                            void *data,
+                            size_t dlen,
+                            uint32_t expire,
+                            shardcache_client_async_cb cb,
+                            void *priv)
+{
+    return shardcache_client_async_set_internal(a, SHC_HDR_ADD, key, klen, data, dlen, expire, cb, priv);
+}
+
+int
+shardcache_client_async_del(shardcache_client_async_t *a,
+                            void *key,
+                            size_t klen,
+                            shardcache_client_async_cb cb,
+                            void *priv)
+{
+    shardcache_record_t record = { .v = key, .l = klen };
+    return shardcache_client_async_command(a, SHC_HDR_DELETE, &record, 1, cb, priv);
+}
+
+int
+shardcache_client_async_evict(shardcache_client_async_t *a,
+                              void *key,
+                              size_t klen,
+                              shardcache_client_async_cb cb,
+                              void *priv)
+{
+    shardcache_record_t record = { .v = key, .l = klen };
+    return shardcache_client_async_command(a, SHC_HDR_EVICT, &record, 1, cb, priv);
+}
+
+int
+shardcache_client_async_exists(shardcache_client_async_t *a,
+                               void *key,
+                               size_t klen,
+                               shardcache_client_async_cb cb,
+                               void *priv)
+{
+    shardcache_record_t record = { .v = key, .l = klen };
+    return shardcache_client_async_command(a, SHC_HDR_EXISTS, &record, 1, cb, priv);
+}
+
+int
+shardcache_client_async_touch(shardcache_client_async_t *a,
+                              void *key,
+                              size_t klen,
+                              shardcache_client_async_cb cb,
+                              void *priv)
+{
+    shardcache_record_t record = { .v = key, .l = klen };
+    return shardcache_client_async_command(a, SHC_HDR_TOUCH, &record, 1, cb, priv);
+}
+
+int
+shardcache_client_async_handle(shardcache_client_async_t *a, int fd, int events)
+{
+    int i;
+    shc_async_conn_t *conn = NULL;
+    for (i = 0; i < a->client->num_shards; i++) {
+        if (a->conns[i].fd == fd) {
+            conn = &a->conns[i];
+            break;
+        }
+    }
+
+    if (!conn || fd < 0)
+        return -1;
+
+    if ((events & SHARDCACHE_CLIENT_ASYNC_WRITE) && shc_async_conn_write(conn) != 0) {
+        shc_async_conn_close(conn);
+        return 0;
+    }
+
+    // responses can't arrive before the connection has been established
+    // but errors (and hangups) are reported as readable events
+    if ((events & SHARDCACHE_CLIENT_ASYNC_READ) && shc_async_conn_read(conn) != 0) {
+        shc_async_conn_close(conn);
+        return 0;
+    }
+
+    // the callbacks might have closed this connection by now
+    if (conn->fd == fd)
+        shc_async_conn_update_events(conn);
+
+    return 0;
+}
+
+int
+shardcache_client_async_timeout(shardcache_client_async_t *a)
+{
+    int tcp_timeout = shardcache_client_tcp_timeout(a->client, -1);
+    int timeout = -1;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    int i;
+    for (i = 0; i < a->client->num_shards; i++) {
+        shc_async_conn_t *conn = &a->conns[i];
+        if (conn->fd < 0 || !conn->num_requests)
+            continue;
+
+        struct timeval diff;
+        timersub(&now, &conn->last_activity, &diff);
+        int elapsed = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+        int left = elapsed < tcp_timeout ? tcp_timeout - elapsed : 0;
+        if (timeout == -1 || left < timeout)
+            timeout = left;
+    }
+
+    return timeout;
+}
+
+int
+shardcache_client_async_expire(shardcache_client_async_t *a)
+{
+    int tcp_timeout = shardcache_client_tcp_timeout(a->client, -1);
+    struct timeval maxwait = { tcp_timeout / 1000, (tcp_timeout % 1000) * 1000 };
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    int num_failed = 0;
+    int i;
+    for (i = 0; i < a->client->num_shards; i++) {
+        shc_async_conn_t *conn = &a->conns[i];
+        if (conn->fd < 0 || !conn->num_requests)
+            continue;
+
+        struct timeval diff;
+        timersub(&now, &conn->last_activity, &diff);
+        if (timercmp(&diff, &maxwait, >=)) {
+            SHC_WARNING("Timeout while waiting for data from %s", conn->addr);
+            num_failed += shc_async_conn_close(conn);
+        }
+    }
+
+    return num_failed;
+}
+
+int
+shardcache_client_async_pending(shardcache_client_async_t *a)
+{
+    return a->num_requests;
+}
+
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -23,6 +23,16 @@ typedef struct shardcache_client_s shardcache_client_t;
  * @param num_nodes       The number of nodes present in the nodes list
  * @return A newly initialized shardcache client descriptor
  * @note The returned shardcache_client_t structure MUST be disposed using shardcache_client_destroy()
+ * @note Nodes running on the same host can be reached through their unix socket
+ *       (see shardcache_listen_unix()) using a "unix:<path>" address, or through
+ *       a shared memory channel using a "shm:<path>" address.
+ *       The shared memory channel is used only by the synchronous single-key
+ *       commands (get, set, add, del, evict, exists, touch), all the others
+ *       (and the shm ones, if the channel can't be opened) go through the unix socket
+ * @note The same client can be safely shared among multiple threads, the connections
+ *       to the nodes are pooled (each thread keeps a few of them for its own use)
+ *       while the error state, the current node and the shm channels are private
+ *       to each thread
  */
 shardcache_client_t *shardcache_client_create(shardcache_node_t **nodes, int num_nodes);
 
@@ -66,6 +76,33 @@ int shardcache_client_check_connection_timeout(shardcache_client_t *c, int new_v
  */
 int shardcache_client_multi_command_max_wait(shardcache_client_t *c, int new_value);
 
+/**
+ * @brief Get and/or set the protocol version used to send commands
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value If greater than 0 the new value will be set (it must not
+ *                  exceed SHC_PROTOCOL_VERSION_MAX). Otherwise the old value
+ *                  will be queried but no new value will be set
+ * @return The previously configured protocol version
+ * @note Protocol version 3 (compact framing, compression and checksums) must be
+ *       enabled only if all the nodes support it
+ * @note Each client has its own setting, new clients start with the
+ *       default (SHC_PROTOCOL_VERSION)
+ */
+int shardcache_client_protocol_version(shardcache_client_t *c, int new_value);
+
+/**
+ * @brief Get and/or set the size above which records are compressed
+ *        when using protocol version 3
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value If greater or equal to 0 the new value will be set
+ *                  (0 disables compression). Otherwise the old value
+ *                  will be queried but no new value will be set
+ * @return The previously configured compression threshold
+ * @note Each client has its own setting, new clients start with the
+ *       default (SHARDCACHE_COMPRESSION_THRESHOLD_DEFAULT)
+ */
+int shardcache_client_compression_threshold(shardcache_client_t *c, int new_value);
+
 /**
  * @brief Get and/or set the random_node mode on a shardcache client instance.
  *        When on a single (random) node will be used for all the commands instead
@@ -93,6 +130,103 @@ int shardcache_client_use_random_node(shardcache_client_t *c, int new_value);
  */
 int shardcache_client_pipeline_max(shardcache_client_t *c, int new_value);
 
+/**
+ * @brief Get and/or set the maximum number of keys which can be requested
+ *        with a single GET_MULTI command
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value If greater or equal to 0 the new value will be set.
+ *                  Otherwise the old value will be queried but no new value
+ *                  will be set. A value of 0 disables the GET_MULTI commands
+ * @note  this setting affects only shardcache_client_get_multi() and
+ *        shardcache_client_get_multif(), which send the keys owned by the same
+ *        node in a single command (instead of pipelining one GET per key).
+ *        Nodes not answering properly to the GET_MULTI commands (older versions)
+ *        will be queried with pipelined GETs for a while (see pipeline_max)
+ * @return The previously configured value for the multi_command_max_keys option
+ *         (still valid if no new value has been provided)
+ */
+int shardcache_client_multi_command_max_keys(shardcache_client_t *c, int new_value);
+
+/**
+ * @brief Get and/or set the time window (in microseconds) during which the
+ *        single-key gets issued concurrently are collected and sent together
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value If greater or equal to 0 the new value will be set.
+ *                  Otherwise the old value will be queried but no new value
+ *                  will be set. A value of 0 (the default) disables the batching
+ * @note  Only useful when the client is shared among many threads: the gets
+ *        issued within the window are sent with a single shardcache_client_get_multi()
+ *        call and each caller gets its own value (or error) back.
+ *        Each get might be delayed by up to the configured window
+ * @return The previously configured value for the auto_multi_window option
+ *         (still valid if no new value has been provided)
+ */
+int shardcache_client_auto_multi_window(shardcache_client_t *c, int new_value);
+
+/**
+ * @brief Get and/or set the maximum number of keys collected in the same batch
+ *        (see shardcache_client_auto_multi_window())
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value If greater than 0 the new value will be set.
+ *                  Otherwise the old value will be queried but no new value
+ *                  will be set
+ * @note  A full batch is sent immediately, without waiting for the window to expire
+ * @return The previously configured value for the auto_multi_max_keys option
+ *         (still valid if no new value has been provided)
+ */
+int shardcache_client_auto_multi_max_keys(shardcache_client_t *c, int new_value);
+
+/**
+ * @brief Get and/or set the way the owner of a key is determined
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value If greater or equal to 0 the new routing mode
+ *                  (see shardcache_routing_mode_t) will be set.
+ *                  Otherwise the old value will be queried but no new value
+ *                  will be set
+ * @note  The chash (the default) and table modes assign the keys the same way,
+ *        the jump mode MUST be used only if the nodes use it as well
+ *        (see shardcache_routing_mode())
+ * @return The previously configured routing mode
+ *         (still valid if no new value has been provided), -1 if the
+ *         routing table for the new mode couldn't be built
+ */
+int shardcache_client_routing_mode(shardcache_client_t *c, int new_value);
+
+/**
+ * @brief Get and/or set the interval at which the topology of the cluster
+ *        is checked for changes
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value If greater or equal to 0 the new value (in seconds) will be set.
+ *                  Otherwise the old value will be queried but no new value
+ *                  will be set. A value of 0 (the default) disables the checks
+ * @note  The check is done by the first command issued once the interval is
+ *        elapsed (or after a node couldn't be reached) and costs a single
+ *        round-trip to one of the nodes, which sends back the node lists
+ *        only if the topology changed since the last check
+ * @return The previously configured value for the topology_check_interval option
+ *         (still valid if no new value has been provided)
+ * @see shardcache_client_topology_refresh()
+ */
+int shardcache_client_topology_check_interval(shardcache_client_t *c, int new_value);
+
+/**
+ * @brief Fetch the topology of the cluster (the current continuum and, if a
+ *        migration is in progress, the migration continuum) from the nodes
+ * @param c     A valid pointer to a shardcache_client_t structure
+ * @return 0 success, -1 otherwise and the internal errno is set
+ * @note Until the first successful refresh the keys are routed using the list
+ *       of nodes provided to shardcache_client_create(). Afterwards they are
+ *       routed following the same rules the nodes apply during a migration:
+ *       get/offset commands are sent to the owner in the current continuum
+ *       (which looks for the key in the migration continuum if needed) while
+ *       all the other commands are sent to the owner in the migration continuum
+ * @note On success the internal errno will be set to SHARDCACHE_CLIENT_OK
+ * @see shardcache_client_topology_check_interval()
+ * @see shardcache_client_errno()
+ * @see shardcache_client_errstr()
+ */
+int shardcache_client_topology_refresh(shardcache_client_t *c);
+
 /**
  * @brief Get the value for a key
  * @param c       A valid pointer to a shardcache_client_t structure
@@ -112,6 +246,65 @@ int shardcache_client_pipeline_max(shardcache_client_t *c, int new_value);
  */
 size_t shardcache_client_get(shardcache_client_t *c, void *key, size_t klen, void **data);
 
+/**
+ * @brief Keep a local copy of the values retrieved by shardcache_client_get()
+ *
+ * The values are kept in an arc cache of the given size and a background thread
+ * subscribes to the invalidations pushed by all the nodes (which need to run
+ * with evict-on-delete turned on) dropping the keys changed, deleted or expired
+ * on the nodes (and the ones changed through this client).
+ * The cache is used only while all the nodes are subscribed and everything
+ * cached before a subscription was lost is considered stale
+ *
+ * @param c       A valid pointer to a shardcache_client_t structure
+ * @param size    The size (in bytes) of the local cache
+ * @param ttl     If not 0, the max number of seconds a value is kept in the local
+ *                cache (to bound the staleness of the values in case an
+ *                invalidation gets lost)
+ * @return 0 on success, -1 otherwise
+ * @note Like the caches of the nodes, the local cache is only eventually consistent:
+ *       a value changed on a node can still be served until its invalidation
+ *       is received. Missing keys and the values retrieved by the other
+ *       commands (get_multi, get_async, etc.) are never cached
+ * @note Must be called before sharing the client among multiple threads
+ */
+int shardcache_client_near_cache_enable(shardcache_client_t *c, size_t size, uint32_t ttl);
+
+typedef struct {
+    uint64_t hits;          // values served from the local cache
+    uint64_t misses;        // values which had to be fetched from the nodes
+    uint64_t stale;         // cached values found invalidated or expired
+    uint64_t invalidations; // keys invalidated (by the nodes or by local writes)
+    uint64_t flushes;       // subscriptions lost (the whole cache becomes stale)
+    uint64_t count;         // number of cached values
+    uint64_t size;          // size of the local cache (in bytes)
+    int subscribed;         // number of nodes currently subscribed
+} shardcache_client_near_cache_stats_t;
+
+/**
+ * @brief Get the counters of the local cache
+ * @param c       A valid pointer to a shardcache_client_t structure
+ * @param stats   A pointer to the structure which will be filled in
+ * @return 0 on success, -1 if the near cache is not enabled
+ */
+int shardcache_client_near_cache_stats(shardcache_client_t *c,
+                                       shardcache_client_near_cache_stats_t *stats);
+
+/**
+ * @brief Get the load measured by the client on one of the addresses of the nodes
+ * @param c       A valid pointer to a shardcache_client_t structure
+ * @param address One of the addresses (replicas) configured for the nodes
+ * @param stats   A pointer to the structure which will be filled in
+ * @return 0 on success, -1 if the address is unknown
+ * @note When a node has multiple addresses, each command is sent to the one
+ *       with the lowest latency (weighted by the outstanding requests) among
+ *       two random ones, these counters show how the commands are being spread
+ * @see shardcache_node_select_address_index()
+ */
+int shardcache_client_address_stats(shardcache_client_t *c,
+                                    char *address,
+                                    shardcache_node_address_stats_t *stats);
+
 /**
  * @brief Get part of the value for a key
  * @param c       A valid pointer to a shardcache_client_t structure
@@ -176,6 +369,109 @@ int shardcache_client_get_async(shardcache_client_t *c,
                                 shardcache_client_get_aync_data_cb cb,
                                 void *priv);
 
+/**
+ * @brief Opaque structure representing a value being read in chunks
+ */
+typedef struct _shardcache_client_get_stream_s shardcache_client_get_stream_t;
+
+/**
+ * @brief Start reading the value for a key in chunks, as they are received
+ *        from the node responsible for it
+ * @param c       A valid pointer to a shardcache_client_t structure
+ * @param key     A valid pointer to the key
+ * @param klen    The length of the key
+ * @param offset  The offset from which to start reading the value
+ * @param length  The number of bytes to read starting from the offset,
+ *                0 to read the whole value (in which case offset must be 0 as well)
+ * @return A newly initialized stream, NULL in case of errors
+ *         and the internal errno is set
+ * @note  Unlike shardcache_client_get(), the value is usually not fully buffered:
+ *        only the data received with the last read from the socket is kept in memory
+ *        and returned in chunks of at most 64KB by shardcache_client_get_stream_next().
+ *        Compressed records (protocol v3) are the exception, since they must be
+ *        received and decompressed as a whole before their first chunk is returned.
+ *        A non-zero length uses the GET_OFFSET command, so a range of the value
+ *        can be read in a single round trip
+ * @note  The stream owns a connection to the node until it has been fully read
+ *        or closed, and must be used by a single thread at a time
+ * @see shardcache_client_get_stream_next()
+ * @see shardcache_client_get_stream_close()
+ */
+shardcache_client_get_stream_t *shardcache_client_get_stream(shardcache_client_t *c,
+                                                             void *key,
+                                                             size_t klen,
+                                                             uint32_t offset,
+                                                             uint32_t length);
+
+/**
+ * @brief Get the next chunk of the value
+ * @param s     A valid pointer to a shardcache_client_get_stream_t structure
+ * @param data  If not NULL, will be set to point to the chunk
+ * @param dlen  If not NULL, will be set to the length of the chunk
+ * @return 1 if a new chunk is available, 0 if the whole value has been read,
+ *         -1 in case of errors and the internal errno is set
+ * @note The chunk is owned by the stream and is valid only until the next call
+ *       to shardcache_client_get_stream_next() or shardcache_client_get_stream_close()
+ */
+int shardcache_client_get_stream_next(shardcache_client_get_stream_t *s, void **data, size_t *dlen);
+
+/**
+ * @brief Release all the resources used by a get stream
+ * @param s A valid pointer to a shardcache_client_get_stream_t structure
+ * @note If the value hasn't been fully read, the connection to the node is closed
+ */
+void shardcache_client_get_stream_close(shardcache_client_get_stream_t *s);
+
+/**
+ * @brief Opaque structure representing a value being written in chunks
+ */
+typedef struct _shardcache_client_set_stream_s shardcache_client_set_stream_t;
+
+/**
+ * @brief Start setting the value for a key, writing it in chunks
+ *        to the node responsible for it
+ * @param c      A valid pointer to a shardcache_client_t structure
+ * @param key    A valid pointer to the key
+ * @param klen   The length of the key
+ * @param vlen   The total length of the value which will be written
+ * @param expire The number of seconds after which the value should expire,
+ *               0 If the value is persistent and shouldn't expire.
+ * @return A newly initialized stream, NULL in case of errors
+ *         and the internal errno is set
+ * @note  The total length needs to be known in advance since it precedes the
+ *        data of the value in the SET command; each chunk is then written
+ *        directly to the socket, so the value is never fully buffered by the client
+ * @note  The stream owns a connection to the node until it has been closed,
+ *        and must be used by a single thread at a time
+ * @see shardcache_client_set_stream_write()
+ * @see shardcache_client_set_stream_close()
+ */
+shardcache_client_set_stream_t *shardcache_client_set_stream(shardcache_client_t *c,
+                                                             void *key,
+                                                             size_t klen,
+                                                             size_t vlen,
+                                                             uint32_t expire);
+
+/**
+ * @brief Write the next chunk of the value
+ * @param s     A valid pointer to a shardcache_client_set_stream_t structure
+ * @param data  A valid pointer to the chunk
+ * @param len   The length of the chunk
+ * @return 0 on success, -1 otherwise and the internal errno is set
+ * @note Writing more than the total length announced when the stream has been
+ *       created fails (and doesn't affect the stream)
+ */
+int shardcache_client_set_stream_write(shardcache_client_set_stream_t *s, void *data, size_t len);
+
+/**
+ * @brief Complete the SET command and release all the resources used by a set stream
+ * @param s     A valid pointer to a shardcache_client_set_stream_t structure
+ * @return 0 if the value has been stored, -1 otherwise and the internal errno is set
+ * @note If less than the announced total length has been written the command
+ *       is aborted (the connection to the node is closed) and -1 is returned
+ */
+int shardcache_client_set_stream_close(shardcache_client_set_stream_t *s);
+
 /**
  * @brief Check if a specific key exists on the node responsible for it
  * @param c      A valid pointer to a shardcache_client_t structure
@@ -342,8 +638,44 @@ int shardcache_client_migration_abort(shardcache_client_t *c);
  */
 shardcache_storage_index_t *shardcache_client_index(shardcache_client_t *c, char *node_name);
 
+/**
+ * @brief Callback called for each item of the index received from a node
+ * @param key   A pointer to the key (valid only until the callback returns)
+ * @param klen  The length of the key
+ * @param vlen  The length of the value
+ * @param priv  The priv pointer passed to shardcache_client_index_foreach()
+ * @return 0 to keep receiving the index, -1 to stop
+ */
+typedef int (*shardcache_client_index_item_cb)(void *key,
+                                               size_t klen,
+                                               size_t vlen,
+                                               void *priv);
+
+/**
+ * @brief Walk through the index of a shardcache node
+ *
+ *        The index is received a chunk at a time and it's never held
+ *        in memory as a whole (unless the node doesn't support sending
+ *        the index in chunks), which makes it suitable for nodes holding
+ *        a huge number of keys
+ * @param c          A valid pointer to a shardcache_client_t structure
+ * @param node_name  The name of the node we want to get the index from
+ * @param cb         The callback to call for each item of the index
+ * @param priv       A pointer which will be passed to the callback at each call
+ * @return 0 if the whole index has been received, -1 otherwise
+ *         (including the case of the callback stopping the walk)
+ * @note On success the internal errno will be set to SHARDCACHE_CLIENT_OK
+ * @see shardcache_client_errno()
+ * @see shardcache_client_errstr()
+ */
+int shardcache_client_index_foreach(shardcache_client_t *c,
+                                    char *node_name,
+                                    shardcache_client_index_item_cb cb,
+                                    void *priv);
+
 /**
  * @brief Return the error code for the last operation performed by the shardcache client
+ *        in the calling thread
  * @param c     A valid pointer to a shardcache_client_t structure
  * @return The errno
  * @see shardcache_client_errno()
@@ -352,6 +684,7 @@ int shardcache_client_errno(shardcache_client_t *c);
 
 /**
  * @brief Return the error string for the last operation performed by the shardcache client
+ *        in the calling thread
  * @param c     A valid pointer to a shardcache_client_t structure
  * @return The error string
  * @see shardcache_client_errno()
@@ -407,6 +740,8 @@ void shc_multi_item_destroy(shc_multi_item_t *item);
  * @param items      A NULL-terminated array of shc_multi_item_t structures
  *
  * @note the operation will per parallelized among multiple nodes if possible
+ * @note the values a node can't fit in its response to the GET_MULTI command
+ *       (see docs/protocol.txt) are requested again one by one
  */
 int shardcache_client_get_multi(shardcache_client_t *c,
                                 shc_multi_item_t **items);
@@ -422,7 +757,7 @@ int shardcache_client_set_multi(shardcache_client_t *c,
                                 shc_multi_item_t **items);
 
 /**
- * @brief Get the node used to fulfil last request
+ * @brief Get the node used to fulfil last request issued by the calling thread
  * @param c          A valid pointer to a shardcache_Client_t structure
  */
 shardcache_node_t *shardcache_client_current_node(shardcache_client_t *c);
@@ -461,6 +796,194 @@ int shardcache_client_getf(shardcache_client_t *c, void *key, size_t klen);
  */
 int shardcache_client_get_multif(shardcache_client_t *c, shc_multi_item_t **items);
 
+/**
+ * @brief Opaque structure holding the requests issued through a shardcache client
+ *        without blocking, driven by an external event loop (epoll, kqueue, libuv, libevent ...)
+ */
+typedef struct shardcache_client_async_s shardcache_client_async_t;
+
+#define SHARDCACHE_CLIENT_ASYNC_READ  0x01
+#define SHARDCACHE_CLIENT_ASYNC_WRITE 0x02
+
+/**
+ * @brief Callback notifying the caller about the events to watch on a filedescriptor
+ * @param fd     The filedescriptor
+ * @param events A mask of SHARDCACHE_CLIENT_ASYNC_READ and SHARDCACHE_CLIENT_ASYNC_WRITE
+ *               which replaces the one previously requested for the same filedescriptor.
+ *               0 means that the filedescriptor is going to be closed and must not be
+ *               watched anymore
+ * @param priv   The priv pointer passed to shardcache_client_async_create()
+ */
+typedef void (*shardcache_client_watch_cb)(int fd, int events, void *priv);
+
+/**
+ * @brief Callback notifying the completion of a request
+ * @param a      The shardcache_client_async_t structure used to issue the request
+ * @param key    The key of the request
+ * @param klen   The length of the key
+ * @param data   The value (get requests only), NULL otherwise or if the request failed
+ * @param dlen   The length of the value (0 if the key doesn't exist)
+ * @param rc     What the blocking counterpart of the command would have returned:\n
+ *               0 on success and -1 on errors for get, set, del, evict and touch,\n
+ *               1 if the key already exists for add,\n
+ *               1 if the key exists, 0 if it doesn't for exists
+ * @param priv   The priv pointer passed together with the request
+ * @note data is valid only until the callback returns
+ * @note New requests can be issued from within the callback
+ */
+typedef void (*shardcache_client_async_cb)(shardcache_client_async_t *a,
+                                           void *key,
+                                           size_t klen,
+                                           void *data,
+                                           size_t dlen,
+                                           int rc,
+                                           void *priv);
+
+/**
+ * @brief Create a new handle to issue non-blocking requests through a shardcache client
+ * @param c        A valid pointer to a shardcache_client_t structure
+ * @param watch_cb The callback used to tell the caller which filedescriptors to watch
+ * @param priv     A pointer which will be passed to the watch callback
+ * @return A newly initialized shardcache_client_async_t structure, NULL on errors
+ * @note The handle keeps a pipelined connection per node (opened without blocking the first
+ *       time a request needs it), requests are completed in the order they have been
+ *       issued to each node. No threads, pipes or private event loops are involved
+ * @note A handle must be used by one thread at a time, multiple threads (each with its own
+ *       handle) can share the same client
+ * @note The returned structure MUST be disposed using shardcache_client_async_destroy()
+ *       before destroying the client
+ */
+shardcache_client_async_t *shardcache_client_async_create(shardcache_client_t *c,
+                                                          shardcache_client_watch_cb watch_cb,
+                                                          void *priv);
+
+/**
+ * @brief Release all the resources used by an async handle
+ * @param a A valid pointer to a shardcache_client_async_t structure
+ * @note The callbacks of the requests still in progress are called with rc == -1
+ * @note Must not be called from within a completion callback
+ */
+void shardcache_client_async_destroy(shardcache_client_async_t *a);
+
+/**
+ * @brief Issue a non-blocking get request
+ * @param a    A valid pointer to a shardcache_client_async_t structure
+ * @param key  A valid pointer to the key
+ * @param klen The length of the key
+ * @param cb   The callback which will be called once the request completes
+ * @param priv A pointer which will be passed to the callback
+ * @return 0 if the request has been queued (the callback will be called exactly once),
+ *         -1 otherwise (the callback won't be called and the error is available
+ *         through shardcache_client_errno() and shardcache_client_errstr())
+ * @note The request is sent once the connection to the node reports to be writable
+ */
+int shardcache_client_async_get(shardcache_client_async_t *a,
+                                void *key,
+                                size_t klen,
+                                shardcache_client_async_cb cb,
+                                void *priv);
+
+/**
+ * @brief Issue a non-blocking set request
+ * @note See shardcache_client_set() and shardcache_client_async_get()
+ */
+int shardcache_client_async_set(shardcache_client_async_t *a,
+                                void *key,
+                                size_t klen,
+                                void *data,
+                                size_t dlen,
+                                uint32_t expire,
+                                shardcache_client_async_cb cb,
+                                void *priv);
+
+/**
+ * @brief Issue a non-blocking add request
+ * @note See shardcache_client_add() and shardcache_client_async_get()
+ */
+int shardcache_client_async_add(shardcache_client_async_t *a,
+                                void *key,
+                                size_t klen,
+                                void *data,
+                                size_t dlen,
+                                uint32_t expire,
+                                shardcache_client_async_cb cb,
+                                void *priv);
+
+/**
+ * @brief Issue a non-blocking del request
+ * @note See shardcache_client_async_get()
+ */
+int shardcache_client_async_del(shardcache_client_async_t *a,
+                                void *key,
+                                size_t klen,
+                                shardcache_client_async_cb cb,
+                                void *priv);
+
+/**
+ * @brief Issue a non-blocking evict request
+ * @note See shardcache_client_async_get()
+ */
+int shardcache_client_async_evict(shardcache_client_async_t *a,
+                                  void *key,
+                                  size_t klen,
+                                  shardcache_client_async_cb cb,
+                                  void *priv);
+
+/**
+ * @brief Issue a non-blocking exists request
+ * @note See shardcache_client_async_get()
+ */
+int shardcache_client_async_exists(shardcache_client_async_t *a,
+                                   void *key,
+                                   size_t klen,
+                                   shardcache_client_async_cb cb,
+                                   void *priv);
+
+/**
+ * @brief Issue a non-blocking touch request
+ * @note See shardcache_client_async_get()
+ */
+int shardcache_client_async_touch(shardcache_client_async_t *a,
+                                  void *key,
+                                  size_t klen,
+                                  shardcache_client_async_cb cb,
+                                  void *priv);
+
+/**
+ * @brief Process the events reported by the event loop for a filedescriptor
+ * @param a      A valid pointer to a shardcache_client_async_t structure
+ * @param fd     A filedescriptor previously passed to the watch callback
+ * @param events The mask of SHARDCACHE_CLIENT_ASYNC_READ and SHARDCACHE_CLIENT_ASYNC_WRITE
+ *               events which are ready (errors and hangups must be reported as
+ *               SHARDCACHE_CLIENT_ASYNC_READ)
+ * @return 0 on success, -1 if the filedescriptor doesn't belong to the handle
+ * @note The completion callbacks of the requests are called from here
+ */
+int shardcache_client_async_handle(shardcache_client_async_t *a, int fd, int events);
+
+/**
+ * @brief Get the time the event loop can wait before calling shardcache_client_async_expire()
+ * @param a A valid pointer to a shardcache_client_async_t structure
+ * @return The number of milliseconds before the oldest request in progress times out
+ *         (see shardcache_client_tcp_timeout()), -1 if there are no requests in progress
+ */
+int shardcache_client_async_timeout(shardcache_client_async_t *a);
+
+/**
+ * @brief Fail the requests sent to nodes which didn't make any progress within the tcp timeout
+ * @param a A valid pointer to a shardcache_client_async_t structure
+ * @return The number of failed requests
+ * @note The connections to the stalled nodes are closed and their requests completed
+ *       with rc == -1
+ */
+int shardcache_client_async_expire(shardcache_client_async_t *a);
+
+/**
+ * @brief Get the number of requests in progress
+ * @param a A valid pointer to a shardcache_client_async_t structure
+ */
+int shardcache_client_async_pending(shardcache_client_async_t *a);
+
 #endif
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
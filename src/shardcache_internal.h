@@ -15,16 +15,26 @@
 #include <hashtable.h>
 #include <queue.h>
 #include <iomux.h>
+#include <fbuf.h>
 
 #include "connections_pool.h"
 #include "arc.h"
 #include "serving.h"
 #include "counters.h"
+#include "timing_wheel.h"
+#include "volatile_store.h"
+#include "storage_io.h"
+#include "write_behind.h"
+#include "routing_table.h"
+#include "epoch.h"
 #include "shardcache.h"
 #include "shardcache_replica.h"
 
 #define DEBUG_DUMP_MAXSIZE 128
 
+// a client subscribed to the invalidations (see SHC_HDR_SUBSCRIBE)
+typedef struct _shardcache_subscriber_s shardcache_subscriber_t;
+
 #define LIKELY(__e) __builtin_expect((__e), 1)
 #define UNLIKELY(__e) __builtin_expect((__e), 0)
 
@@ -112,19 +122,49 @@ struct _shardcache_s {
     int migration_done;                  // boolean value indicating that the migration is complete
                                          // (to be accessed using ATOMIC_READ())
 
+    int routing_mode;                    // see shardcache_routing_mode()
+    routing_table_t *routing;            // the table built on the chash continuum (NULL in chash mode)
+    routing_table_t *migration_routing;  // the table built on the migration continuum
+    epoch_t *routing_epoch;              // the replaced tables are released once no lookup uses them
+                                         // NOTE: the tables are replaced with the migration lock
+                                         //       held but read using ATOMIC_READ() without it
+
     int use_persistent_storage;    // boolean flag indicating if a persistent storage should be used  
 
 
     shardcache_storage_t storage;  // the structure holding the callbacks for the persistent storage 
 
+    storage_io_pool_t *storage_io; // the threads running the synchronous storage fetches
+                                   // on behalf of the workers (if the storage doesn't
+                                   // implement the fetch_async callback)
+
+    storage_io_batcher_t *storage_batcher; // coalesces the concurrent misses into
+                                           // fetch_multi calls (if supported by the storage)
+
+    int storage_io_threads;            // see shardcache_storage_io_threads()
+    int storage_batch_size;            // see shardcache_storage_batch_size()
+    int storage_batch_window;          // see shardcache_storage_batch_window()
+    pthread_rwlock_t storage_io_lock;  // the storage_io and storage_batcher pointers are
+                                       // replaced with the write lock held
+
+    write_behind_t *write_behind; // queues the updates to the persistent storage
+                                  // and writes them in background (if enabled)
+    pthread_rwlock_t write_behind_lock; // the write_behind pointer is replaced
+                                        // with the write lock held
+
     hashtable_t *volatile_storage; // an hashtable used as volatile storage
 
-    hashtable_t *cache_timeouts; // hashtable holding the timeout_id of the expiration timers
-                                 // for cached objects
-    hashtable_t *volatile_timeouts; // hashtable holding the timeout_id for the expiration timers
-                                    // for volatile items
+    volatile_store_t *volatile_store; // the on-disk log backing the volatile storage (if enabled)
+#define SHARDCACHE_VOLATILE_STORE_LOCKS 64
+    pthread_mutex_t volatile_store_locks[SHARDCACHE_VOLATILE_STORE_LOCKS]; // serialize the updates
+                                       // of the same volatile key, so that the order of the records
+                                       // in the log always matches the order of the updates
+
+    timing_wheel_t *cache_timers;    // timing wheel holding the expiration timers
+                                     // for cached objects (owned by the expirer thread)
+    timing_wheel_t *volatile_timers; // timing wheel holding the expiration timers
+                                     // for volatile items (owned by the expirer thread)
 
-    iomux_t *expirer_mux; // iomux used to handle the expiration timers
     pthread_t expirer_th; // the thread taking care of propagating expiration commands
     queue_t *expirer_queue; // the queue holding shedule/unschedule expiration jobs
 
@@ -163,6 +203,12 @@ struct _shardcache_s {
 
     pthread_t migrate_th; // the migration thread
 
+    int migration_threads;       // number of threads copying the keys during a migration
+    int migration_batch_size;    // max number of keys sent at once to a peer during a migration
+    int migration_max_rate;      // max number of keys migrated per second (0 == no limit)
+    int migration_max_bandwidth; // max number of bytes migrated per second (0 == no limit)
+    char *migration_checkpoint;  // the file where the progress of a migration is saved (if any)
+
     pthread_t evictor_th; // the evictor thread
 
     pthread_cond_t evictor_cond;  // condition variable used by the evictor thread
@@ -172,12 +218,19 @@ struct _shardcache_s {
                                   //condition variable
     hashtable_t *evictor_jobs;    // linked list used as queue for eviction jobs
 
+    shardcache_subscriber_t *subscribers; // clients subscribed to the invalidations
+                                          // (served by the evictor thread)
+    pthread_mutex_t subscribers_lock;     // mutex protecting the subscribers list
+
     shardcache_counters_t *counters; // the internal counters instance
 
 #define SHARDCACHE_COUNTER_LABELS_ARRAY  \
         { "gets", "sets", "dels", "heads", "evicts", "expires", \
           "cache_misses", "fetch_remote", "fetch_local", "not_found", \
-          "volatile_table_size", "cache_size", "cached_items", "errors" }
+          "volatile_table_size", "cache_size", "cached_items", "errors", \
+          "evictor_queue_depth", "evictor_batch_size", "evictor_batches", \
+          "expirer_timers", "expirer_backlog", "expirer_lag_ms", \
+          "startup_time_ms", "storage_fetch_inflight" }
 
 #define SHARDCACHE_COUNTER_GETS             0
 #define SHARDCACHE_COUNTER_SETS             1
@@ -193,7 +246,15 @@ struct _shardcache_s {
 #define SHARDCACHE_COUNTER_CACHE_SIZE       11
 #define SHARDCACHE_COUNTER_CACHED_ITEMS     12
 #define SHARDCACHE_COUNTER_ERRORS           13
-#define SHARDCACHE_NUM_COUNTERS             14
+#define SHARDCACHE_COUNTER_EVICTOR_QUEUE     14
+#define SHARDCACHE_COUNTER_EVICTOR_BATCH_SIZE 15
+#define SHARDCACHE_COUNTER_EVICTOR_BATCHES  16
+#define SHARDCACHE_COUNTER_EXPIRER_TIMERS   17
+#define SHARDCACHE_COUNTER_EXPIRER_BACKLOG  18
+#define SHARDCACHE_COUNTER_EXPIRER_LAG      19
+#define SHARDCACHE_COUNTER_STARTUP_TIME     20
+#define SHARDCACHE_COUNTER_STORAGE_INFLIGHT 21
+#define SHARDCACHE_NUM_COUNTERS             22
     struct {
         const char *name; // the exported label of the counter
         uint64_t value;   // the actual value (accessed using the atomic builtins)
@@ -205,6 +266,8 @@ struct _shardcache_s {
                                           // connections
 
     int tcp_timeout;        // the tcp timeout to use when setting up new connections
+    int protocol_version;      // see shardcache_protocol_version()
+    int compression_threshold; // see shardcache_compression_threshold()
 
     shardcache_async_io_context_t *async_context;
 
@@ -214,19 +277,49 @@ struct _shardcache_s {
     int quit;
 };
 
+// the value of a volatile item.
+// It's immutable and reference counted so that the cached objects can
+// share it with the volatile storage instead of holding their own copy
+// (a new buffer is created whenever the value of the item changes)
 typedef struct {
-    void *data;
+    int refcnt;
+    size_t len;
+    char data[];
+} volatile_buf_t;
+
+volatile_buf_t *volatile_buf_create(void *data, size_t len);
+volatile_buf_t *volatile_buf_retain(volatile_buf_t *buf);
+void volatile_buf_release(volatile_buf_t *buf);
+
+typedef struct {
+    volatile_buf_t *buf; // the value (NULL for placeholders of deleted/expired records)
+    void *data;          // points to buf->data (if any)
     size_t dlen;
     uint32_t expire;
+    volatile_store_loc_t loc; // location of the item in the volatile store (if any)
 } volatile_object_t;
 
 int shardcache_test_migration_ownership(shardcache_t *cache,
         void *key, size_t klen, char *owner, size_t *len);
 
+// apply the protocol settings of the instance to the messages
+// sent by the calling thread (see messaging_thread_settings())
+void shardcache_messaging_settings(shardcache_t *cache);
+
 int shardcache_get_connection_for_peer(shardcache_t *cache, char *peer);
 
 void shardcache_release_connection_for_peer(shardcache_t *cache, char *peer, int fd);
 
+// NOTE: the returned connection is non-blocking and might be still
+//       in progress (see fetch_from_peer_async_deferred())
+int shardcache_reconnect_to_peer(shardcache_t *cache, char *peer, int fd);
+
+// same as shardcache_get/release_connection_for_peer() but the address is
+// taken from a node and resolved to its id in the connections pool only once
+int shardcache_get_connection_for_node(shardcache_t *cache, shardcache_node_t *node, int index);
+
+void shardcache_release_connection_for_node(shardcache_t *cache, shardcache_node_t *node, int index, int fd);
+
 int shardcache_set_internal(shardcache_t *cache,
                             void *key,
                             size_t klen,
@@ -255,5 +348,13 @@ int shardcache_unschedule_expiration(shardcache_t *cache, void *key, size_t klen
 
 void shardcache_queue_async_read_wrk(shardcache_t *cache, async_read_wrk_t *wrk);
 
+// register the connection on fd as a subscriber of the invalidations,
+// the ack (the response to the SUBSCRIBE command) is delivered before any
+// notification. Returns NULL if subscriptions are not available
+shardcache_subscriber_t *shardcache_subscriber_add(shardcache_t *cache, int fd, fbuf_t *ack);
+
+// to be called when the subscribed connection goes away
+void shardcache_subscriber_remove(shardcache_subscriber_t *sub);
+
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -1,19 +1,38 @@
 #include <string.h>
 #include <syslog.h>
 #include <regex.h>
+#include <time.h>
 
 #include "shardcache_node.h"
 #include "shardcache_log.h"
 
 #include "shardcache_internal.h"
 
-#define ADDR_REGEXP "^[a-z0-9_\\.\\-]+(:[0-9]+)?$"
+#define ADDR_REGEXP "^([a-z0-9_\\.\\-]+(:[0-9]+)?|(unix|shm):/.+)$"
+
+// weight of a new sample in the moving average of the latency (1/2^N)
+#define ADDRESS_LATENCY_EWMA_SHIFT 3
+
+// latency sample (in microseconds) accounted for a failed request
+#define ADDRESS_FAILURE_PENALTY 1000000
+
+// seconds after which an address which is not being selected
+// (because slower than the others) is given a new chance
+#define ADDRESS_PROBE_INTERVAL 5
+
+typedef struct {
+    shardcache_node_address_stats_t stats;
+    time_t last_request;
+    int pool_id; // id of the address in the connections pool + 1 , 0 if unknown
+} shardcache_node_address_t;
 
 struct _shardcache_node_s {
     char *label;
     char **address;
     int num_replicas;
     char *string;
+    // the load of each address (indexed as the address array)
+    shardcache_node_address_t *address_stats;
 }; 
 
 static int
@@ -69,6 +88,7 @@ shardcache_node_create_from_string(char *str)
     node->address = addrlist;
     node->string = strdup(str);
     node->num_replicas = num_addresses;
+    node->address_stats = calloc(num_addresses, sizeof(shardcache_node_address_t));
 
     free(copy);
     return node;
@@ -94,6 +114,7 @@ shardcache_node_create(char *label, char **addresses, int num_addresses)
         node->address[i] = strdup(addresses[i]);
     }
     node->string = node_string;
+    node->address_stats = calloc(num_addresses, sizeof(shardcache_node_address_t));
     return node;
 }
 
@@ -109,6 +130,8 @@ shardcache_node_copy(shardcache_node_t *node)
         copy->address[i] = strdup(node->address[i]);
     copy->num_replicas = node->num_replicas;
     copy->string = strdup(node->string);
+    // the copy starts measuring the addresses from scratch
+    copy->address_stats = calloc(node->num_replicas, sizeof(shardcache_node_address_t));
     return copy;
 }
 
@@ -121,6 +144,7 @@ shardcache_node_destroy(shardcache_node_t *node)
         free(node->address[i]);
     free(node->address);
     free(node->string);
+    free(node->address_stats);
     free(node);
 }
 
@@ -136,10 +160,140 @@ shardcache_node_get_label(shardcache_node_t *node)
     return node->label;
 }
 
+static inline uint64_t
+shardcache_node_address_score(shardcache_node_t *node, int index, time_t now, int probe)
+{
+    shardcache_node_address_t *addr = &node->address_stats[index];
+
+    // an address left aside for a while is measured again
+    // (only by one of the callers racing for it)
+    time_t last_request = ATOMIC_READ(addr->last_request);
+    if (probe && now - last_request >= ADDRESS_PROBE_INTERVAL &&
+        ATOMIC_CAS(addr->last_request, last_request, now))
+    {
+        return 0;
+    }
+
+    uint64_t latency = ATOMIC_READ(addr->stats.latency);
+    int outstanding = ATOMIC_READ(addr->stats.outstanding);
+    if (outstanding < 0)
+        outstanding = 0;
+    return latency * (outstanding + 1);
+}
+
+// the probes are claimed only by the callers reporting the completion of
+// their requests, otherwise the probed address would never be measured
+static inline int
+shardcache_node_pick_address_index(shardcache_node_t *node, int probe)
+{
+    if (node->num_replicas < 2)
+        return 0;
+
+    // power of two choices: the least loaded of two random addresses
+    int a = random() % node->num_replicas;
+    int b = (a + 1 + random() % (node->num_replicas - 1)) % node->num_replicas;
+
+    time_t now = time(NULL);
+    uint64_t score_a = shardcache_node_address_score(node, a, now, probe);
+    uint64_t score_b = shardcache_node_address_score(node, b, now, probe);
+
+    return score_b < score_a ? b : a;
+}
+
+int
+shardcache_node_select_address_index(shardcache_node_t *node)
+{
+    return shardcache_node_pick_address_index(node, 1);
+}
+
 char *
 shardcache_node_get_address(shardcache_node_t *node)
 {
-    return node->address[random() % node->num_replicas];
+    return node->address[shardcache_node_pick_address_index(node, 0)];
+}
+
+void
+shardcache_node_address_begin(shardcache_node_t *node, int index)
+{
+    if (index < 0 || index >= node->num_replicas)
+        return;
+
+    shardcache_node_address_t *addr = &node->address_stats[index];
+    ATOMIC_INCREMENT(addr->stats.outstanding);
+    ATOMIC_INCREMENT(addr->stats.requests);
+    ATOMIC_SET(addr->last_request, time(NULL));
+}
+
+void
+shardcache_node_address_end(shardcache_node_t *node, int index, struct timeval *start, int failed)
+{
+    if (index < 0 || index >= node->num_replicas)
+        return;
+
+    shardcache_node_address_t *addr = &node->address_stats[index];
+    ATOMIC_DECREMENT(addr->stats.outstanding);
+
+    uint64_t usecs;
+    if (failed) {
+        ATOMIC_INCREMENT(addr->stats.errors);
+        usecs = ADDRESS_FAILURE_PENALTY;
+    } else if (start) {
+        struct timeval now, diff;
+        gettimeofday(&now, NULL);
+        timersub(&now, start, &diff);
+        // the clock might have been moved backwards meanwhile
+        usecs = diff.tv_sec < 0 ? 0 : diff.tv_sec * 1000000ULL + diff.tv_usec;
+    } else {
+        return;
+    }
+
+    // 0 is reserved for the addresses never measured
+    uint64_t latency, updated;
+    do {
+        latency = ATOMIC_READ(addr->stats.latency);
+        if (latency) {
+            int64_t delta = (int64_t)usecs - (int64_t)latency;
+            updated = latency + delta / (1 << ADDRESS_LATENCY_EWMA_SHIFT);
+        } else {
+            updated = usecs;
+        }
+        if (!updated)
+            updated = 1;
+    } while (!ATOMIC_CAS(addr->stats.latency, latency, updated));
+}
+
+int
+shardcache_node_get_address_pool_id(shardcache_node_t *node, int index)
+{
+    if (index < 0 || index >= node->num_replicas)
+        return -1;
+
+    return ATOMIC_READ(node->address_stats[index].pool_id) - 1;
+}
+
+void
+shardcache_node_set_address_pool_id(shardcache_node_t *node, int index, int pool_id)
+{
+    if (index < 0 || index >= node->num_replicas)
+        return;
+
+    ATOMIC_SET(node->address_stats[index].pool_id, pool_id + 1);
+}
+
+int
+shardcache_node_get_address_stats(shardcache_node_t *node,
+                                  int index,
+                                  shardcache_node_address_stats_t *stats)
+{
+    if (index < 0 || index >= node->num_replicas)
+        return -1;
+
+    shardcache_node_address_t *addr = &node->address_stats[index];
+    stats->latency = ATOMIC_READ(addr->stats.latency);
+    stats->outstanding = ATOMIC_READ(addr->stats.outstanding);
+    stats->requests = ATOMIC_READ(addr->stats.requests);
+    stats->errors = ATOMIC_READ(addr->stats.errors);
+    return 0;
 }
 
 shardcache_node_t *
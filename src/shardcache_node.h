@@ -8,8 +8,26 @@
  */
 typedef struct _shardcache_node_s shardcache_node_t;
 
+#include <stdint.h>
+#include <sys/time.h>
 #include <shardcache.h>
 
+/**
+ * @brief The load measured on one of the addresses (replicas) of a node
+ * @see shardcache_node_get_address_stats()
+ */
+typedef struct {
+    //! moving average of the response times (in microseconds),
+    //! 0 if no response has been measured yet
+    uint64_t latency;
+    //! number of requests currently waiting for a response
+    int outstanding;
+    //! total number of requests sent to the address
+    uint64_t requests;
+    //! total number of failed requests
+    uint64_t errors;
+} shardcache_node_address_stats_t;
+
 /**
  * @brief Create a new shardcache_node_t structure
  * @param label The label of the node
@@ -66,9 +84,79 @@ char *shardcache_node_get_string(shardcache_node_t *node);
  * @return One of the valid addresses for the node passed as argument
  * @note If replicas are used this function may return a different value
  *       (among the configured replicas) each time it's called
+ *       (see shardcache_node_select_address_index())
+ * @note The requests sent to the returned address aren't tracked, so an
+ *       address left aside is never picked here to be measured again
+ *       (only shardcache_node_select_address_index() does it)
  */
 char *shardcache_node_get_address(shardcache_node_t *node);
 
+/**
+ * @brief Select the address (replica) a new request to a given node should be sent to
+ * @param node A previously initialized and valid shardcache_node_t structure
+ * @return The index of the selected address
+ * @note Two random addresses are compared and the one with the lowest latency,
+ *       weighted by the number of outstanding requests, is selected.
+ *       The load is known only if the requests are tracked using
+ *       shardcache_node_address_begin() and shardcache_node_address_end()
+ * @note An address which hasn't been selected for a while is selected again
+ *       to measure its load, so the request sent to the selected address
+ *       MUST be tracked
+ */
+int shardcache_node_select_address_index(shardcache_node_t *node);
+
+/**
+ * @brief Track a request sent to one of the addresses of a given node
+ * @param node A previously initialized and valid shardcache_node_t structure
+ * @param index The index of the address the request has been sent to
+ * @note Each call MUST be balanced by a call to shardcache_node_address_end()
+ */
+void shardcache_node_address_begin(shardcache_node_t *node, int index);
+
+/**
+ * @brief Complete the tracking of a request started with shardcache_node_address_begin()
+ * @param node A previously initialized and valid shardcache_node_t structure
+ * @param index The index of the address the request has been sent to
+ * @param start When the request has been sent, NULL if the response time
+ *              must not be accounted
+ * @param failed 1 if the request failed, 0 otherwise
+ */
+void shardcache_node_address_end(shardcache_node_t *node, int index, struct timeval *start, int failed);
+
+/**
+ * @brief Get the id identifying one of the addresses of a given node
+ *        in the connections pool
+ * @param node A previously initialized and valid shardcache_node_t structure
+ * @param index The index of the address
+ * @return The id stored using shardcache_node_set_address_pool_id()
+ *         or -1 if none has been stored yet
+ * @note The id is meaningful only for the pool it has been obtained from
+ *       (the one owned by the shardcache instance or the client using the node)
+ */
+int shardcache_node_get_address_pool_id(shardcache_node_t *node, int index);
+
+/**
+ * @brief Remember the id identifying one of the addresses of a given node
+ *        in the connections pool
+ * @param node A previously initialized and valid shardcache_node_t structure
+ * @param index The index of the address
+ * @param pool_id The id returned by connections_pool_peer_id()
+ */
+void shardcache_node_set_address_pool_id(shardcache_node_t *node, int index, int pool_id);
+
+/**
+ * @brief Get the load measured on one of the addresses of a given node
+ * @param node A previously initialized and valid shardcache_node_t structure
+ * @param index The index of the address
+ * @param stats Where to store the counters
+ * @return 0 on success, -1 if there is no address at the given index
+ * @note The counters are kept by each shardcache_node_t structure,
+ *       copies (like the nodes returned by shardcache_get_nodes()) start from scratch
+ */
+int shardcache_node_get_address_stats(shardcache_node_t *node,
+                                      int index,
+                                      shardcache_node_address_stats_t *stats);
+
 /**
  * @brief Get the number of addresses (replicas) configured for a given node
  * @param node A previously initialized and valid shardcache_node_t structure
@@ -124,6 +212,19 @@ shardcache_node_t * shardcache_node_select(shardcache_t *cache, char *label);
  */
 shardcache_node_t **shardcache_get_nodes(shardcache_t *cache, int *num_nodes);
 
+/**
+ * @brief Get the list of nodes which will be taking part to the shardcache
+ *        'cloud' once the migration currently in progress (if any) is completed
+ * @param cache   A valid pointer to a shardcache_t structure
+ * @param num_nodes   If provided the number of nodes in the returned array
+ *                  will be will be stored at the location pointed by num_nodes
+ * @return A list containing all the nodes of the migration continuum,
+ *         NULL if no migration is in progress
+ * @note the caller MUST release the returned pointer once done with it
+ *       by using the shardcache_free_nodes() function on the returned list
+ */
+shardcache_node_t **shardcache_get_migration_nodes(shardcache_t *cache, int *num_nodes);
+
 /**
  * @brief Release resources for a list of nodes
  * @param nodes A valid list of shardcache_node_t structures
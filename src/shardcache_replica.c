@@ -369,7 +369,7 @@ kepaxos_send(char **recipients,
             .v = cmd,
             .l = cmd_len
         };
-        int rc = build_message(SHC_HDR_REPLICA_COMMAND, &record, 1, &connection->output, SHC_PROTOCOL_VERSION);
+        int rc = build_message(SHC_HDR_REPLICA_COMMAND, &record, 1, &connection->output, shardcache_protocol_version(replica->shc, -1));
         if (rc == 0) {
 
             iomux_callbacks_t callbacks = {
@@ -473,7 +473,7 @@ shardcache_replica_ping(shardcache_replica_t *replica)
                 .v = msg,
                 .l = msg_len
             };
-            int rc = build_message(SHC_HDR_REPLICA_PING, &record, 1, &connection->output, SHC_PROTOCOL_VERSION);
+            int rc = build_message(SHC_HDR_REPLICA_PING, &record, 1, &connection->output, shardcache_protocol_version(replica->shc, -1));
             if (rc == 0) {
 
                 iomux_callbacks_t callbacks = {
@@ -0,0 +1,526 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "shardcache_internal.h"
+#include "arc_ops.h"
+#include "compression.h"
+
+/*
+ * Snapshot of the ARC cache
+ *
+ * The file starts with a header followed by a sequence of chunks, each
+ * made by a chunk header and a batch of records (protected by a crc32),
+ * and is terminated by an empty chunk. Chunks are independent from each
+ * other so they can be restored in parallel.
+ * Records are stored in the same order the objects have in the cache lists
+ * (mru first, from the least recently used to the most recently used).
+ * The chunks are decoded in parallel but their objects are added to the
+ * cache in the same order, so the recency order is preserved when restored.
+ *
+ * NOTE: all the integers are stored in host byte order
+ */
+
+#define SHARDCACHE_SNAPSHOT_MAGIC   0x61636873 // "shca"
+#define SHARDCACHE_SNAPSHOT_VERSION 1
+
+#define SHARDCACHE_SNAPSHOT_CHUNK_SIZE (1<<20)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t created;     // when the snapshot has been taken
+    uint64_t cache_size; // the size of the cache at the time of the snapshot
+    uint64_t p;          // the arc 'p' marker at the time of the snapshot
+} shardcache_snapshot_hdr_t;
+
+typedef struct {
+    uint32_t count;  // number of records in the chunk (0 marks the end of the snapshot)
+    uint32_t size;   // size of the records in the chunk
+    uint32_t crc;    // crc32 of the records
+    uint32_t reserved;
+} shardcache_snapshot_chunk_hdr_t;
+
+typedef struct {
+    uint32_t klen;
+    uint32_t vlen;
+    int64_t ts_sec;  // when the object has been loaded into the cache
+    int32_t ts_usec;
+    uint8_t frequent; // 1 if the object was in the mfu list
+    uint8_t olen;     // length of the owner label
+    uint16_t reserved;
+    int64_t ttl;
+    // followed by the key, the owner label and the value
+} shardcache_snapshot_record_t;
+
+typedef struct {
+    shardcache_t *cache;
+    int fd;
+    fbuf_t chunk;
+    uint32_t count;
+    int skipped;
+} shardcache_snapshot_writer_t;
+
+static int
+shardcache_snapshot_write(int fd, void *data, size_t len)
+{
+    char *p = (char *)data;
+    while (len) {
+        ssize_t wb = write(fd, p, len);
+        if (wb == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += wb;
+        len -= wb;
+    }
+    return 0;
+}
+
+static int
+shardcache_snapshot_flush_chunk(shardcache_snapshot_writer_t *writer)
+{
+    shardcache_snapshot_chunk_hdr_t hdr = {
+        .count = writer->count,
+        .size = fbuf_used(&writer->chunk),
+        .crc = writer->count ? compression_crc32(0, fbuf_data(&writer->chunk), fbuf_used(&writer->chunk)) : 0,
+        .reserved = 0
+    };
+
+    if (shardcache_snapshot_write(writer->fd, &hdr, sizeof(hdr)) != 0 ||
+        (hdr.size && shardcache_snapshot_write(writer->fd, fbuf_data(&writer->chunk), hdr.size) != 0))
+    {
+        return -1;
+    }
+
+    fbuf_clear(&writer->chunk);
+    writer->count = 0;
+    return 0;
+}
+
+static int
+shardcache_snapshot_dump_object(void *ptr, int frequent, void *priv)
+{
+    shardcache_snapshot_writer_t *writer = (shardcache_snapshot_writer_t *)priv;
+    shardcache_t *cache = writer->cache;
+    cached_object_t *obj = (cached_object_t *)ptr;
+
+    char owner[256];
+    size_t olen = sizeof(owner);
+    memset(owner, 0, olen);
+
+    MUTEX_LOCK(obj->lock);
+    // objects being fetched or about to be dropped are not worth being saved
+    if (!obj->data || !obj->dlen || obj->dlen > UINT32_MAX / 2 || obj->klen > UINT32_MAX / 2 ||
+        (obj->flags & (COBJ_FLAG_FETCHING|COBJ_FLAG_DROP|COBJ_FLAG_EVICT|COBJ_FLAG_EVICTED)))
+    {
+        MUTEX_UNLOCK(obj->lock);
+        writer->skipped++;
+        return 0;
+    }
+
+    shardcache_test_ownership(cache, obj->key, obj->klen, owner, &olen);
+    if (!owner[0])
+        snprintf(owner, sizeof(owner), "%s", cache->me);
+    olen = strlen(owner);
+
+    shardcache_snapshot_record_t record = {
+        .klen = obj->klen,
+        .vlen = obj->dlen,
+        .ts_sec = obj->ts.tv_sec,
+        .ts_usec = obj->ts.tv_usec,
+        .frequent = frequent,
+        .olen = olen,
+        .reserved = 0,
+        .ttl = obj->ttl
+    };
+
+    fbuf_add_binary(&writer->chunk, (char *)&record, sizeof(record));
+    fbuf_add_binary(&writer->chunk, obj->key, obj->klen);
+    fbuf_add_binary(&writer->chunk, owner, olen);
+    fbuf_add_binary(&writer->chunk, obj->data, obj->dlen);
+    MUTEX_UNLOCK(obj->lock);
+
+    writer->count++;
+
+    if (fbuf_used(&writer->chunk) >= SHARDCACHE_SNAPSHOT_CHUNK_SIZE)
+        return shardcache_snapshot_flush_chunk(writer);
+
+    return 0;
+}
+
+int
+shardcache_cache_dump(shardcache_t *cache, char *path)
+{
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd == -1) {
+        SHC_ERROR("Can't create the cache snapshot %s: %s", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    shardcache_snapshot_hdr_t hdr = {
+        .magic = SHARDCACHE_SNAPSHOT_MAGIC,
+        .version = SHARDCACHE_SNAPSHOT_VERSION,
+        .created = time(NULL),
+        .cache_size = ATOMIC_READ(cache->arc_size),
+        .p = arc_get_p(cache->arc)
+    };
+
+    shardcache_snapshot_writer_t writer = {
+        .cache = cache,
+        .fd = fd,
+        .chunk = FBUF_STATIC_INITIALIZER,
+        .count = 0,
+        .skipped = 0
+    };
+
+    int count = -1;
+    if (shardcache_snapshot_write(fd, &hdr, sizeof(hdr)) == 0) {
+        count = arc_walk(cache->arc, shardcache_snapshot_dump_object, &writer);
+        // flush the last chunk (if any) and terminate the snapshot
+        if (count >= 0 && writer.count && shardcache_snapshot_flush_chunk(&writer) != 0)
+            count = -1;
+        if (count >= 0 && shardcache_snapshot_flush_chunk(&writer) != 0)
+            count = -1;
+    }
+    fbuf_destroy(&writer.chunk);
+
+    if (count >= 0 && fsync(fd) != 0)
+        count = -1;
+
+    close(fd);
+
+    if (count < 0 || rename(tmp_path, path) != 0) {
+        SHC_ERROR("Can't write the cache snapshot %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    count -= writer.skipped;
+    SHC_NOTICE("Saved %d cached objects to %s", count, path);
+    return count;
+}
+
+typedef struct {
+    shardcache_t *cache;
+    char *map;
+    size_t *chunks; // offsets of the chunks
+    int num_chunks;
+    int next;
+    int committed;  // number of chunks whose objects have been added to the cache
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t restored;
+    uint64_t skipped;
+} shardcache_snapshot_reader_t;
+
+typedef struct {
+    shardcache_snapshot_record_t *record;
+    char *value;
+} shardcache_snapshot_restore_arg_t;
+
+static int
+shardcache_snapshot_restore_object(void *ptr, size_t *size, void *priv)
+{
+    shardcache_snapshot_restore_arg_t *arg = (shardcache_snapshot_restore_arg_t *)priv;
+    cached_object_t *obj = (cached_object_t *)ptr;
+    size_t vlen = arg->record->vlen;
+
+    char *data = (vlen > sizeof(obj->dbuf)) ? malloc(vlen) : obj->dbuf;
+    if (!data)
+        return -1;
+
+    MUTEX_LOCK(obj->lock);
+    obj->data = data;
+    memcpy(obj->data, arg->value, vlen);
+    obj->dlen = vlen;
+    obj->ts.tv_sec = arg->record->ts_sec;
+    obj->ts.tv_usec = arg->record->ts_usec;
+    COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
+    MUTEX_UNLOCK(obj->lock);
+
+    // NOTE: the size is the one returned by the fetch callback
+    *size = (obj->data == obj->dbuf) ? 0 : obj->dlen;
+    return 0;
+}
+
+// wait until all the previous chunks have been added to the cache
+static void
+shardcache_snapshot_wait_turn(shardcache_snapshot_reader_t *reader, int index)
+{
+    MUTEX_LOCK(reader->lock);
+    while (reader->committed < index)
+        pthread_cond_wait(&reader->cond, &reader->lock);
+    MUTEX_UNLOCK(reader->lock);
+}
+
+static void
+shardcache_snapshot_end_turn(shardcache_snapshot_reader_t *reader)
+{
+    MUTEX_LOCK(reader->lock);
+    reader->committed++;
+    pthread_cond_broadcast(&reader->cond);
+    MUTEX_UNLOCK(reader->lock);
+}
+
+// decode the objects of a chunk (in parallel with the other chunks),
+// they are added to the cache once all the previous chunks have been
+static void
+shardcache_snapshot_restore_chunk(shardcache_snapshot_reader_t *reader, int index)
+{
+    shardcache_t *cache = reader->cache;
+    size_t offset = reader->chunks[index];
+    shardcache_snapshot_chunk_hdr_t hdr;
+    memcpy(&hdr, reader->map + offset, sizeof(hdr));
+
+    char *p = reader->map + offset + sizeof(hdr);
+    char *end = p + hdr.size;
+
+    if (compression_crc32(0, p, hdr.size) != hdr.crc) {
+        SHC_WARNING("Corrupted chunk at offset %lu in the cache snapshot, skipping it", (unsigned long)offset);
+        ATOMIC_INCREASE(reader->skipped, hdr.count);
+        shardcache_snapshot_wait_turn(reader, index);
+        shardcache_snapshot_end_turn(reader);
+        return;
+    }
+
+    // a chunk can't hold more records than this (whatever its header says)
+    uint32_t max_count = hdr.size / sizeof(shardcache_snapshot_record_t);
+    uint32_t count = hdr.count < max_count ? hdr.count : max_count;
+    arc_resource_t *objs = count ? malloc(sizeof(arc_resource_t) * count) : NULL;
+    char *frequent = count ? malloc(count) : NULL;
+    shardcache_snapshot_record_t **records = count ? malloc(sizeof(shardcache_snapshot_record_t *) * count) : NULL;
+    if (count && (!objs || !frequent || !records)) {
+        SHC_ERROR("Can't allocate memory to restore the chunk at offset %lu", (unsigned long)offset);
+        free(objs);
+        free(frequent);
+        free(records);
+        ATOMIC_INCREASE(reader->skipped, hdr.count);
+        shardcache_snapshot_wait_turn(reader, index);
+        shardcache_snapshot_end_turn(reader);
+        return;
+    }
+
+    time_t now = time(NULL);
+    int expire_time = ATOMIC_READ(cache->expire_time);
+    uint64_t skipped = 0;
+    int num_objs = 0;
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        shardcache_snapshot_record_t record;
+        if (end - p < (ssize_t)sizeof(record))
+            break;
+        memcpy(&record, p, sizeof(record));
+        p += sizeof(record);
+        if ((size_t)(end - p) < (size_t)record.klen + record.olen + record.vlen)
+            break;
+
+        char *key = p;
+        char *owner = key + record.klen;
+        char *value = owner + record.olen;
+        p = value + record.vlen;
+
+        // skip the objects which would have already expired
+        if ((expire_time > 0 && record.ts_sec + expire_time <= now) ||
+            (record.ttl > 0 && record.ts_sec + record.ttl <= now))
+        {
+            skipped++;
+            continue;
+        }
+
+        // and the ones whose owner has changed in the meanwhile
+        char node_name[256];
+        size_t node_len = sizeof(node_name);
+        memset(node_name, 0, node_len);
+        shardcache_test_ownership(cache, key, record.klen, node_name, &node_len);
+        if (!node_name[0])
+            snprintf(node_name, sizeof(node_name), "%s", cache->me);
+        if (strlen(node_name) != record.olen || memcmp(node_name, owner, record.olen) != 0) {
+            skipped++;
+            continue;
+        }
+
+        shardcache_snapshot_restore_arg_t arg = {
+            .record = &record,
+            .value = value
+        };
+        arc_resource_t obj = arc_restore_prepare(cache->arc, key, record.klen, record.ttl,
+                                                 shardcache_snapshot_restore_object, &arg);
+        if (!obj) {
+            skipped++;
+            continue;
+        }
+
+        objs[num_objs] = obj;
+        frequent[num_objs] = record.frequent;
+        // NOTE: the record lives in the map, which is valid until the restore completes
+        records[num_objs] = (shardcache_snapshot_record_t *)(key - sizeof(record));
+        num_objs++;
+    }
+
+    if (i < hdr.count) {
+        SHC_WARNING("Truncated chunk at offset %lu in the cache snapshot", (unsigned long)offset);
+        skipped += hdr.count - i;
+    }
+
+    shardcache_snapshot_wait_turn(reader, index);
+    int restored = num_objs ? arc_restore_commit(cache->arc, objs, frequent, num_objs) : 0;
+    shardcache_snapshot_end_turn(reader);
+
+    skipped += num_objs - restored;
+
+    if (expire_time > 0 && !ATOMIC_READ(cache->lazy_expiration)) {
+        // NOTE: the objects which have been dropped (or evicted already) are set to NULL
+        int n;
+        for (n = 0; n < num_objs; n++) {
+            if (!objs[n])
+                continue;
+            shardcache_snapshot_record_t record;
+            memcpy(&record, records[n], sizeof(record));
+            shardcache_schedule_expiration(cache, (char *)records[n] + sizeof(record), record.klen,
+                                           record.ts_sec + expire_time - now, 0);
+        }
+    }
+
+    free(objs);
+    free(frequent);
+    free(records);
+
+    ATOMIC_INCREASE(reader->restored, restored);
+    ATOMIC_INCREASE(reader->skipped, skipped);
+}
+
+static void *
+shardcache_snapshot_restore_worker(void *priv)
+{
+    shardcache_snapshot_reader_t *reader = (shardcache_snapshot_reader_t *)priv;
+    int i;
+    // NOTE: the chunks are taken in order, so the one waiting for
+    //       its turn never prevents the previous ones from being restored
+    while ((i = ATOMIC_INCREASE(reader->next, 1) - 1) < reader->num_chunks)
+        shardcache_snapshot_restore_chunk(reader, i);
+    return NULL;
+}
+
+int
+shardcache_cache_restore(shardcache_t *cache, char *path, int num_threads)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        SHC_ERROR("Can't open the cache snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(shardcache_snapshot_hdr_t)) {
+        SHC_ERROR("Invalid cache snapshot %s", path);
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        SHC_ERROR("Can't map the cache snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    shardcache_snapshot_hdr_t hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    if (hdr.magic != SHARDCACHE_SNAPSHOT_MAGIC || hdr.version != SHARDCACHE_SNAPSHOT_VERSION) {
+        SHC_ERROR("Invalid cache snapshot %s (bad header)", path);
+        munmap(map, size);
+        return -1;
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    shardcache_snapshot_reader_t reader = {
+        .cache = cache,
+        .map = map,
+        .chunks = NULL,
+        .num_chunks = 0,
+        .next = 0,
+        .committed = 0,
+        .restored = 0,
+        .skipped = 0
+    };
+    MUTEX_INIT(reader.lock);
+    CONDITION_INIT(reader.cond);
+
+    // find all the chunks first, so that they can be restored in parallel
+    size_t offset = sizeof(hdr);
+    int complete = 0;
+    while (offset + sizeof(shardcache_snapshot_chunk_hdr_t) <= size) {
+        shardcache_snapshot_chunk_hdr_t chunk;
+        memcpy(&chunk, map + offset, sizeof(chunk));
+        if (!chunk.count) {
+            complete = 1;
+            break;
+        }
+        if (chunk.size > size - offset - sizeof(chunk))
+            break;
+        reader.chunks = realloc(reader.chunks, sizeof(size_t) * (reader.num_chunks + 1));
+        reader.chunks[reader.num_chunks++] = offset;
+        offset += sizeof(chunk) + chunk.size;
+    }
+
+    if (!complete)
+        SHC_WARNING("The cache snapshot %s is truncated, restoring only the complete chunks", path);
+
+    // scale the 'p' marker in case the size of the cache has changed
+    size_t cache_size = ATOMIC_READ(cache->arc_size);
+    if (hdr.cache_size && cache_size)
+        arc_set_p(cache->arc, (size_t)(((double)hdr.p / hdr.cache_size) * cache_size));
+
+    if (num_threads > reader.num_chunks)
+        num_threads = reader.num_chunks;
+
+    if (num_threads > 1) {
+        pthread_t threads[num_threads];
+        int i, n = 0;
+        for (i = 0; i < num_threads - 1; i++) {
+            if (pthread_create(&threads[n], NULL, shardcache_snapshot_restore_worker, &reader) == 0)
+                n++;
+        }
+        shardcache_snapshot_restore_worker(&reader);
+        for (i = 0; i < n; i++)
+            pthread_join(threads[i], NULL);
+    } else {
+        shardcache_snapshot_restore_worker(&reader);
+    }
+
+    free(reader.chunks);
+    munmap(map, size);
+    MUTEX_DESTROY(reader.lock);
+    CONDITION_DESTROY(reader.cond);
+
+    ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
+
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &end);
+    SHC_NOTICE("Restored %"PRIu64" cached objects (%"PRIu64" skipped) from %s in %lu ms",
+               reader.restored, reader.skipped, path,
+               (unsigned long)((end.tv_sec * 1000) + (end.tv_usec / 1000)));
+
+    return reader.restored;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -66,6 +66,51 @@ typedef int (*shardcache_fetch_item_callback_t)
 typedef int (*shardcache_fetch_items_callback_t)
     (void **keys, size_t *klens, int nkeys, void **values, size_t *vlens, void *priv);
 
+/**
+ * @brief Completion callback for the asynchronous fetch.
+ *
+ *        The storage MUST call it exactly once for each successfully
+ *        started asynchronous fetch
+ *
+ * @param key       The key passed to the fetch_async callback
+ * @param klen      The length of the key
+ * @param value     The value for the key, NULL if not found (or in case of errors)
+ * @param vlen      The length of the value
+ * @param status    0 if the fetch succeeded (even if the key was not found); -1 otherwise
+ * @param done_priv The 'done_priv' pointer passed to the fetch_async callback
+ *
+ * @note The value pointer MUST be a volatile copy and shardcache WILL release
+ *       its resources (exactly as for the synchronous fetch callback)
+ * @note It can be called from any thread (even from within the fetch_async
+ *       callback itself)
+ */
+typedef void (*shardcache_fetch_async_done_callback_t)
+    (void *key, size_t klen, void *value, size_t vlen, int status, void *done_priv);
+
+/**
+ * @brief Callback to start fetching the value for a given key without blocking.
+ *
+ *        If implemented, the shardcache instance will use it instead of the
+ *        synchronous fetch callback when serving asynchronous requests
+ *        (which is the case for requests received by the serving workers)
+ *        so that a slow storage won't block the worker thread.\n
+ *        The value is provided through the 'done' callback once available
+ *
+ * @param key       A valid pointer to the key
+ * @param klen      The length of the key
+ * @param done      The callback to call once the fetch is complete
+ * @param done_priv The pointer to pass to the 'done' callback
+ * @param priv      The 'priv' pointer previously stored in the shardcache_storage_t
+ *                  structure at initialization time
+ * @return 0 if the fetch has been started; -1 otherwise (in which case
+ *         the 'done' callback MUST NOT be called)
+ *
+ * @note If not implemented, the synchronous fetch callback will be run
+ *       by a pool of storage i/o threads instead (see shardcache_storage_io_threads())
+ */
+typedef int (*shardcache_fetch_async_callback_t)
+    (void *key, size_t klen, shardcache_fetch_async_done_callback_t done, void *done_priv, void *priv);
+
 /**
  * @brief Callback to store a new value for a given key.
  *
@@ -235,6 +280,36 @@ typedef size_t (*shardcache_count_items_callback_t)(void *priv);
 typedef size_t (*shardcache_get_index_callback_t)
     (shardcache_storage_index_item_t *index, size_t isize, void *priv);
 
+/**
+ * @brief Callback to scan the index of stored keys a chunk at a time.
+ *
+ *        If implemented, the shardcache instance will use it instead of
+ *        the index callback to walk through the keys owned (and stored)
+ *        by the instance without holding the whole index in memory
+ *        (for instance when migrating keys or serving the GET_INDEX command)
+ *
+ * @param cursor A pointer to the scan cursor. It's set to 0 to start a new scan,
+ *               the callback MUST update it to let the next call resume the scan
+ *               where it has been left and MUST set it back to 0 once there are
+ *               no more items to return. The value is opaque to the caller
+ * @param index  An array of shardcache_storage_index_item_t structures
+ *               to hold the chunk of the index
+ * @param isize  The number of slots in the provided index array
+ * @param priv   The priv pointer owned by the storage
+ *
+ * @return The number of items stored in the index array (which can be 0
+ *         even if the scan is not complete yet)
+ *
+ * @note The keys stored in the index array MUST be volatile copies
+ *       and the caller WILL release them
+ * @note A cursor might be used again after the storage has been modified.
+ *       The keys existing for the whole duration of the scan MUST be returned
+ *       at least once (they can be returned more than once), while keys added
+ *       or removed during the scan might be returned or not
+ */
+typedef size_t (*shardcache_scan_index_callback_t)
+    (uint64_t *cursor, shardcache_storage_index_item_t *index, size_t isize, void *priv);
+
 /**
  * @brief Callback used to notify the underlying storage about the creation of a new worker thread
  *
@@ -260,7 +335,7 @@ typedef void (*shardcache_thread_start_callback_t)(void *priv);
 typedef void (*shardcache_thread_exit_callback_t)(void *priv);
 
 
-#define SHARDCACHE_STORAGE_API_VERSION 0x02
+#define SHARDCACHE_STORAGE_API_VERSION 0x04
 
 typedef struct _shardcache_storage_s shardcache_storage_t;
 typedef int (*shardcache_storage_init_t)(shardcache_storage_t *, char **);
@@ -283,6 +358,9 @@ struct _shardcache_storage_s {
     //! The fetch multiple items callback
     shardcache_fetch_items_callback_t      fetch_multi;
 
+    //! The asynchronous fetch callback (optional)
+    shardcache_fetch_async_callback_t      fetch_async;
+
     //! The store callback (optional if the storage is indended to be read-only)
     shardcache_store_item_callback_t       store;
 
@@ -314,6 +392,12 @@ struct _shardcache_storage_s {
      * @note check shardcache_get_index() documentation for more details
      */
     shardcache_count_items_callback_t      count;
+    /**
+     * @brief Optional callback which returns the index of keys a chunk at a time,
+     *        if set it will be used in place of the index callback
+     * @note check shardcache_scan_index() documentation for more details
+     */
+    shardcache_scan_index_callback_t       scan_index;
 
     
     /**
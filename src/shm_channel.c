@@ -0,0 +1,414 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <atomic_defs.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "protocol.h"
+#include "shardcache_log.h"
+#include "shm_channel.h"
+
+#define SHM_CHANNEL_MAGIC 0x73686d31 // "shm1"
+#define SHM_CHANNEL_RING_SIZE_MIN (1<<12)
+#define SHM_CHANNEL_RING_SIZE_MAX (1<<26)
+
+// the positions are never wrapped, their difference is the amount
+// of data in the ring. Each member used by a different process
+// lives in its own cacheline to avoid false sharing
+typedef struct {
+    uint64_t head;            // read position (updated by the reader)
+    char pad1[56];
+    uint64_t tail;            // write position (updated by the writer)
+    char pad2[56];
+    uint32_t reader_waiting;  // the reader is sleeping waiting for data
+    uint32_t writer_waiting;  // the writer is sleeping waiting for space
+    char pad3[56];
+} shm_ring_hdr_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t ring_size;
+    char pad[56];
+    shm_ring_hdr_t rings[2];
+} shm_channel_hdr_t;
+
+// ring 0 carries data from the client to the server,
+// ring 1 carries data from the server to the client
+#define SHM_RING_TO_SERVER 0
+#define SHM_RING_TO_CLIENT 1
+
+typedef struct {
+    shm_ring_hdr_t *hdr;
+    char *data;
+    // our own position (the tail if we are the writer, the head if
+    // we are the reader). We never trust the copy in the shared memory
+    // since it can be modified by the peer
+    uint64_t pos;
+} shm_ring_t;
+
+struct _shm_channel_s {
+    int memfd;
+    int efd[2];      // doorbells: efd[0] wakes up the server, efd[1] the client
+    int is_client;
+    int sock;        // unix socket the channel has been received from (client side only)
+    uint32_t ring_size;
+    size_t map_size;
+    shm_channel_hdr_t *map;
+    shm_ring_t rx;
+    shm_ring_t tx;
+};
+
+static inline void
+shm_channel_ring_doorbell(shm_channel_t *ch)
+{
+    uint64_t one = 1;
+    // NOTE: if the counter is already at its max value the peer
+    //       has a pending wakeup anyway, so we can ignore EAGAIN
+    if (write(ch->efd[ch->is_client ? 0 : 1], &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        SHC_DEBUG("Can't ring the shm doorbell: %s", strerror(errno));
+}
+
+static int
+shm_channel_map(shm_channel_t *ch)
+{
+    ch->map = mmap(NULL, ch->map_size, PROT_READ|PROT_WRITE, MAP_SHARED, ch->memfd, 0);
+    if (ch->map == MAP_FAILED) {
+        ch->map = NULL;
+        return -1;
+    }
+
+    char *data = (char *)ch->map + sizeof(shm_channel_hdr_t);
+    int rx = ch->is_client ? SHM_RING_TO_CLIENT : SHM_RING_TO_SERVER;
+    int tx = ch->is_client ? SHM_RING_TO_SERVER : SHM_RING_TO_CLIENT;
+
+    ch->rx.hdr = &ch->map->rings[rx];
+    ch->rx.data = data + (rx * ch->ring_size);
+    ch->rx.pos = ATOMIC_READ(ch->rx.hdr->head);
+
+    ch->tx.hdr = &ch->map->rings[tx];
+    ch->tx.data = data + (tx * ch->ring_size);
+    ch->tx.pos = ATOMIC_READ(ch->tx.hdr->tail);
+
+    return 0;
+}
+
+shm_channel_t *
+shm_channel_create(size_t ring_size)
+{
+#ifdef __linux__
+    uint32_t size = SHM_CHANNEL_RING_SIZE_MIN;
+    while (size < ring_size && size < SHM_CHANNEL_RING_SIZE_MAX)
+        size <<= 1;
+
+    shm_channel_t *ch = calloc(1, sizeof(shm_channel_t));
+    ch->sock = -1;
+    ch->ring_size = size;
+    ch->map_size = sizeof(shm_channel_hdr_t) + (2 * size);
+    ch->efd[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    ch->efd[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    ch->memfd = memfd_create("shardcache", MFD_CLOEXEC);
+
+    if (ch->efd[0] < 0 || ch->efd[1] < 0 || ch->memfd < 0 ||
+        ftruncate(ch->memfd, ch->map_size) != 0 || shm_channel_map(ch) != 0)
+    {
+        SHC_ERROR("Can't create the shm channel: %s", strerror(errno));
+        shm_channel_destroy(ch);
+        return NULL;
+    }
+
+    ch->map->magic = SHM_CHANNEL_MAGIC;
+    ch->map->ring_size = size;
+
+    // the server starts sleeping, so the client
+    // must ring the doorbell when it writes the first request
+    ATOMIC_SET(ch->map->rings[SHM_RING_TO_SERVER].reader_waiting, 1);
+    ATOMIC_SET(ch->map->rings[SHM_RING_TO_CLIENT].reader_waiting, 1);
+
+    return ch;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+int
+shm_channel_send(shm_channel_t *ch, int sock)
+{
+    int fds[3] = { ch->memfd, ch->efd[0], ch->efd[1] };
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    memset(cbuf, 0, sizeof(cbuf));
+
+    unsigned char noop = SHC_HDR_NOOP;
+    struct iovec iov = { &noop, 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf,
+        .msg_controllen = sizeof(cbuf)
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t wb;
+    do {
+        wb = sendmsg(sock, &msg, 0);
+    } while (wb == -1 && errno == EINTR);
+
+    return (wb == 1) ? 0 : -1;
+}
+
+shm_channel_t *
+shm_channel_receive(int sock)
+{
+#ifdef __linux__
+    int fds[3] = { -1, -1, -1 };
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    memset(cbuf, 0, sizeof(cbuf));
+
+    unsigned char noop = 0;
+    struct iovec iov = { &noop, 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf,
+        .msg_controllen = sizeof(cbuf)
+    };
+
+    ssize_t rb;
+    do {
+        rb = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (rb == -1 && errno == EINTR);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (rb != 1 || noop != SHC_HDR_NOOP || !cmsg ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    {
+        SHC_ERROR("Can't receive the shm channel from the peer");
+        if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+            int i, n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), (n < 3 ? n : 3) * sizeof(int));
+            for (i = 0; i < 3; i++)
+                if (fds[i] >= 0)
+                    close(fds[i]);
+        }
+        return NULL;
+    }
+
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    shm_channel_t *ch = calloc(1, sizeof(shm_channel_t));
+    ch->is_client = 1;
+    ch->sock = -1;
+    ch->memfd = fds[0];
+    ch->efd[0] = fds[1];
+    ch->efd[1] = fds[2];
+
+    shm_channel_hdr_t hdr;
+    struct stat st;
+    if (fstat(ch->memfd, &st) != 0 || st.st_size < (off_t)sizeof(hdr) ||
+        pread(ch->memfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.magic != SHM_CHANNEL_MAGIC ||
+        hdr.ring_size < SHM_CHANNEL_RING_SIZE_MIN ||
+        hdr.ring_size > SHM_CHANNEL_RING_SIZE_MAX ||
+        (hdr.ring_size & (hdr.ring_size - 1)) != 0 ||
+        st.st_size != sizeof(hdr) + (2 * (off_t)hdr.ring_size))
+    {
+        SHC_ERROR("Bad shm channel received from the peer");
+        shm_channel_destroy(ch);
+        return NULL;
+    }
+
+    ch->ring_size = hdr.ring_size;
+    ch->map_size = st.st_size;
+    if (shm_channel_map(ch) != 0) {
+        SHC_ERROR("Can't map the shm channel: %s", strerror(errno));
+        shm_channel_destroy(ch);
+        return NULL;
+    }
+
+    ch->sock = sock;
+    return ch;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+void
+shm_channel_destroy(shm_channel_t *ch)
+{
+    if (ch->map)
+        munmap(ch->map, ch->map_size);
+    if (ch->memfd >= 0)
+        close(ch->memfd);
+    if (ch->efd[0] >= 0)
+        close(ch->efd[0]);
+    if (ch->efd[1] >= 0)
+        close(ch->efd[1]);
+    if (ch->sock >= 0)
+        close(ch->sock);
+    free(ch);
+}
+
+int
+shm_channel_fd(shm_channel_t *ch)
+{
+    return ch->efd[ch->is_client ? 1 : 0];
+}
+
+int
+shm_channel_write(shm_channel_t *ch, const void *data, size_t len)
+{
+    shm_ring_t *ring = &ch->tx;
+    uint64_t used = ring->pos - ATOMIC_READ(ring->hdr->head);
+    if (used > ch->ring_size)
+        return -1;
+
+    size_t avail = ch->ring_size - used;
+    if (len > avail)
+        len = avail;
+
+    if (!len)
+        return 0;
+
+    size_t offset = ring->pos & (ch->ring_size - 1);
+    size_t first = ch->ring_size - offset;
+    if (first > len)
+        first = len;
+
+    memcpy(ring->data + offset, data, first);
+    if (len > first)
+        memcpy(ring->data, (char *)data + first, len - first);
+
+    ring->pos += len;
+    ATOMIC_SET(ring->hdr->tail, ring->pos);
+
+    if (ATOMIC_READ(ring->hdr->reader_waiting)) {
+        ATOMIC_SET(ring->hdr->reader_waiting, 0);
+        shm_channel_ring_doorbell(ch);
+    }
+
+    return len;
+}
+
+int
+shm_channel_peek(shm_channel_t *ch, void **data)
+{
+    shm_ring_t *ring = &ch->rx;
+    uint64_t avail = ATOMIC_READ(ring->hdr->tail) - ring->pos;
+    if (avail > ch->ring_size)
+        return -1;
+
+    size_t offset = ring->pos & (ch->ring_size - 1);
+    if (avail > ch->ring_size - offset)
+        avail = ch->ring_size - offset;
+
+    *data = ring->data + offset;
+    return avail;
+}
+
+void
+shm_channel_consume(shm_channel_t *ch, size_t len)
+{
+    shm_ring_t *ring = &ch->rx;
+
+    if (!len)
+        return;
+
+    ring->pos += len;
+    ATOMIC_SET(ring->hdr->head, ring->pos);
+
+    if (ATOMIC_READ(ring->hdr->writer_waiting)) {
+        ATOMIC_SET(ring->hdr->writer_waiting, 0);
+        shm_channel_ring_doorbell(ch);
+    }
+}
+
+int
+shm_channel_arm(shm_channel_t *ch)
+{
+    shm_ring_t *ring = &ch->rx;
+    ATOMIC_SET(ring->hdr->reader_waiting, 1);
+    // NOTE: the writer might have written new data before seeing the flag
+    return (ATOMIC_READ(ring->hdr->tail) != ring->pos);
+}
+
+int
+shm_channel_arm_write(shm_channel_t *ch)
+{
+    shm_ring_t *ring = &ch->tx;
+    ATOMIC_SET(ring->hdr->writer_waiting, 1);
+    // NOTE: the reader might have consumed some data before seeing the flag
+    return (ring->pos - ATOMIC_READ(ring->hdr->head) < ch->ring_size);
+}
+
+static inline int
+shm_channel_ready(shm_channel_t *ch, shm_channel_wait_mode_t mode)
+{
+    if (mode == SHM_CHANNEL_WAIT_READ)
+        return (ATOMIC_READ(ch->rx.hdr->tail) != ch->rx.pos);
+
+    return (ch->tx.pos - ATOMIC_READ(ch->tx.hdr->head) < ch->ring_size);
+}
+
+int
+shm_channel_wait(shm_channel_t *ch, shm_channel_wait_mode_t mode, int timeout)
+{
+    for (;;) {
+        if (mode == SHM_CHANNEL_WAIT_READ) {
+            ATOMIC_SET(ch->rx.hdr->reader_waiting, 1);
+        } else {
+            ATOMIC_SET(ch->tx.hdr->writer_waiting, 1);
+        }
+
+        if (shm_channel_ready(ch, mode))
+            return 0;
+
+        // the control socket becomes readable only when the peer goes away
+        struct pollfd pfd[2] = {
+            { .fd = shm_channel_fd(ch), .events = POLLIN },
+            { .fd = ch->sock, .events = POLLIN }
+        };
+
+        int rc = poll(pfd, ch->sock >= 0 ? 2 : 1, timeout > 0 ? timeout : -1);
+        if (rc == -1 && errno == EINTR)
+            continue;
+
+        if (rc <= 0 || (ch->sock >= 0 && pfd[1].revents)) {
+            if (rc == 0)
+                errno = ETIMEDOUT;
+            else if (rc > 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+
+        uint64_t value;
+        if (read(shm_channel_fd(ch), &value, sizeof(value)) != sizeof(value) && errno != EAGAIN)
+            return -1;
+
+        if (shm_channel_ready(ch, mode))
+            return 0;
+    }
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
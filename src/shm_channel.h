@@ -0,0 +1,80 @@
+#ifndef SHARDCACHE_SHM_CHANNEL_H
+#define SHARDCACHE_SHM_CHANNEL_H
+
+#include <sys/types.h>
+
+/*
+ * Bidirectional byte channel between two processes living on the same host.
+ *
+ * The channel is made by two single-producer/single-consumer rings
+ * (one per direction) living in a memfd mapped by both processes,
+ * plus two eventfds used as doorbells to wake up a peer sleeping
+ * while waiting for data (or for space in a full ring).
+ *
+ * The server side creates the channel and hands the file descriptors to the
+ * client over a unix domain socket, which the client then keeps open so that
+ * the server can detect when it goes away.
+ *
+ * NOTE: the channel is available only on linux, on other systems
+ *       shm_channel_create() and shm_channel_receive() fail with ENOSYS
+ */
+
+typedef struct _shm_channel_s shm_channel_t;
+
+// size of each of the two rings (rounded up to a power of 2)
+#define SHM_CHANNEL_RING_SIZE_DEFAULT (1<<20)
+
+typedef enum {
+    SHM_CHANNEL_WAIT_READ = 0,  // wait until there is data to read
+    SHM_CHANNEL_WAIT_WRITE = 1  // wait until there is space to write
+} shm_channel_wait_mode_t;
+
+// create a new channel (server side)
+shm_channel_t *shm_channel_create(size_t ring_size);
+
+// send the file descriptors backing the channel over the unix domain socket 'sock'.
+// The descriptors are attached to a single SHC_HDR_NOOP byte, so that the
+// regular response following it can be parsed as usual by the peer
+int shm_channel_send(shm_channel_t *ch, int sock);
+
+// receive a channel from the unix domain socket 'sock' (client side).
+// On success the channel takes ownership of 'sock', which is closed
+// when the channel is destroyed
+shm_channel_t *shm_channel_receive(int sock);
+
+void shm_channel_destroy(shm_channel_t *ch);
+
+// the eventfd which becomes readable when the peer rings our doorbell
+// (meaning that new data is available or that some space has been freed)
+int shm_channel_fd(shm_channel_t *ch);
+
+// write at most 'len' bytes without blocking,
+// returns the number of bytes written or -1 if the channel is broken
+int shm_channel_write(shm_channel_t *ch, const void *data, size_t len);
+
+// point 'data' at the readable bytes (without copying them) and return how many
+// they are (which might be less than the total available if the data wraps
+// around the end of the ring), or -1 if the channel is broken.
+// shm_channel_consume() must be called to release the bytes which have been used
+int shm_channel_peek(shm_channel_t *ch, void **data);
+void shm_channel_consume(shm_channel_t *ch, size_t len);
+
+// tell the peer that we are about to sleep and that the doorbell must be rung
+// as soon as new data is written. Returns 1 if some data arrived in the meanwhile
+// (so the caller must not go to sleep but read it), 0 otherwise
+int shm_channel_arm(shm_channel_t *ch);
+
+// same as shm_channel_arm() but asking the peer to ring the doorbell as soon as
+// it frees some space in the ring we write to. Returns 1 if some space has been
+// freed in the meanwhile, 0 otherwise
+int shm_channel_arm_write(shm_channel_t *ch);
+
+// block until the condition requested by 'mode' is satisfied or the timeout
+// (in milliseconds, 0 means no timeout) expires.
+// Returns 0 on success, -1 on timeout or if the peer has gone away
+int shm_channel_wait(shm_channel_t *ch, shm_channel_wait_mode_t mode, int timeout);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
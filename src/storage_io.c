@@ -0,0 +1,391 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <atomic_defs.h>
+
+#include "shardcache_log.h"
+#include "storage_io.h"
+
+typedef struct {
+    storage_io_job_t job;
+    void *arg;
+} storage_io_entry_t;
+
+struct _storage_io_pool_s {
+    pthread_t *threads;
+    int num_threads;
+
+    // ring buffer holding the queued jobs
+    storage_io_entry_t *queue;
+    int size;
+    int head;
+    int count;
+
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t space_cond; // signaled when a job is taken out of a full queue
+    int waiting;               // callers waiting for a free slot in the queue
+
+    storage_io_thread_cb_t thread_start;
+    storage_io_thread_cb_t thread_exit;
+    void *priv;
+
+    storage_io_pool_counters_t counters;
+};
+
+static void *
+storage_io_worker(void *priv)
+{
+    storage_io_pool_t *pool = (storage_io_pool_t *)priv;
+
+    if (pool->thread_start)
+        pool->thread_start(pool->priv);
+
+    MUTEX_LOCK(pool->lock);
+    for (;;) {
+        while (!pool->count && !pool->quit)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+
+        // the queue is drained before leaving
+        if (!pool->count)
+            break;
+
+        storage_io_entry_t entry = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->size;
+        pool->count--;
+        if (pool->waiting)
+            pthread_cond_signal(&pool->space_cond);
+        ATOMIC_DECREMENT(pool->counters.queued);
+        ATOMIC_INCREMENT(pool->counters.running);
+        MUTEX_UNLOCK(pool->lock);
+
+        entry.job(entry.arg);
+
+        ATOMIC_DECREMENT(pool->counters.running);
+        MUTEX_LOCK(pool->lock);
+    }
+    MUTEX_UNLOCK(pool->lock);
+
+    if (pool->thread_exit)
+        pool->thread_exit(pool->priv);
+
+    return NULL;
+}
+
+storage_io_pool_t *
+storage_io_pool_create(int num_threads,
+                       int max_queued,
+                       storage_io_thread_cb_t thread_start,
+                       storage_io_thread_cb_t thread_exit,
+                       void *priv)
+{
+    if (num_threads <= 0 || max_queued <= 0)
+        return NULL;
+
+    storage_io_pool_t *pool = calloc(1, sizeof(storage_io_pool_t));
+    pool->queue = calloc(max_queued, sizeof(storage_io_entry_t));
+    pool->size = max_queued;
+    pool->threads = calloc(num_threads, sizeof(pthread_t));
+    pool->thread_start = thread_start;
+    pool->thread_exit = thread_exit;
+    pool->priv = priv;
+    MUTEX_INIT(pool->lock);
+    pthread_cond_init(&pool->cond, NULL);
+    pthread_cond_init(&pool->space_cond, NULL);
+
+    int i;
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, storage_io_worker, pool) != 0) {
+            SHC_ERROR("Can't create the storage i/o thread: %s", strerror(errno));
+            storage_io_pool_destroy(pool);
+            return NULL;
+        }
+        pool->num_threads++;
+    }
+
+    return pool;
+}
+
+void
+storage_io_pool_destroy(storage_io_pool_t *pool)
+{
+    MUTEX_LOCK(pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_cond_broadcast(&pool->space_cond);
+    while (pool->waiting) {
+        // let the waiting callers notice that the pool is going away
+        MUTEX_UNLOCK(pool->lock);
+        sched_yield();
+        MUTEX_LOCK(pool->lock);
+    }
+    MUTEX_UNLOCK(pool->lock);
+
+    int i;
+    for (i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    // if no thread could be started nobody has run the queued jobs
+    while (pool->count) {
+        storage_io_entry_t *entry = &pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->size;
+        pool->count--;
+        entry->job(entry->arg);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_cond_destroy(&pool->space_cond);
+    MUTEX_DESTROY(pool->lock);
+    free(pool->threads);
+    free(pool->queue);
+    free(pool);
+}
+
+static int
+storage_io_pool_enqueue(storage_io_pool_t *pool, storage_io_job_t job, void *arg, int wait)
+{
+    MUTEX_LOCK(pool->lock);
+    if (wait) {
+        pool->waiting++;
+        while (!pool->quit && pool->count == pool->size)
+            pthread_cond_wait(&pool->space_cond, &pool->lock);
+        pool->waiting--;
+    }
+    if (pool->quit || pool->count == pool->size) {
+        MUTEX_UNLOCK(pool->lock);
+        ATOMIC_INCREMENT(pool->counters.rejected);
+        return -1;
+    }
+    storage_io_entry_t *entry = &pool->queue[(pool->head + pool->count) % pool->size];
+    entry->job = job;
+    entry->arg = arg;
+    pool->count++;
+    ATOMIC_INCREMENT(pool->counters.queued);
+    pthread_cond_signal(&pool->cond);
+    MUTEX_UNLOCK(pool->lock);
+    return 0;
+}
+
+int
+storage_io_pool_run(storage_io_pool_t *pool, storage_io_job_t job, void *arg)
+{
+    return storage_io_pool_enqueue(pool, job, arg, 0);
+}
+
+int
+storage_io_pool_run_wait(storage_io_pool_t *pool, storage_io_job_t job, void *arg)
+{
+    return storage_io_pool_enqueue(pool, job, arg, 1);
+}
+
+storage_io_pool_counters_t *
+storage_io_pool_counters(storage_io_pool_t *pool)
+{
+    return &pool->counters;
+}
+
+struct _storage_io_batcher_s {
+    pthread_t thread;
+
+    // items collected so far (in order of arrival),
+    // at most STORAGE_IO_BATCHER_MAX_PENDING * max_items
+    void **items;
+    int size;
+    int count;
+    struct timeval first; // when the oldest pending item has been added
+
+    int max_items;
+    int window;
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    storage_io_pool_t *pool;
+    storage_io_batch_cb_t cb;
+    void *priv;
+
+    storage_io_batcher_counters_t counters;
+};
+
+// NOTE: batches don't reference the batcher since they might
+//       still be queued in the pool when the batcher is destroyed
+typedef struct {
+    storage_io_batch_cb_t cb;
+    void *priv;
+    int count;
+    void *items[];
+} storage_io_batch_t;
+
+static void
+storage_io_batch_run(void *arg)
+{
+    storage_io_batch_t *batch = (storage_io_batch_t *)arg;
+    batch->cb(batch->items, batch->count, batch->priv);
+    free(batch);
+}
+
+static void
+storage_io_batcher_flush(storage_io_batcher_t *batcher)
+{
+    int count = batcher->count < batcher->max_items ? batcher->count : batcher->max_items;
+
+    storage_io_batch_t *batch = malloc(sizeof(storage_io_batch_t) + count * sizeof(void *));
+    batch->cb = batcher->cb;
+    batch->priv = batcher->priv;
+    batch->count = count;
+    memcpy(batch->items, batcher->items, count * sizeof(void *));
+
+    batcher->count -= count;
+    if (batcher->count) {
+        memmove(batcher->items, batcher->items + count, batcher->count * sizeof(void *));
+        // the remaining items will be flushed without waiting any further
+    }
+
+    ATOMIC_DECREASE(batcher->counters.pending, count);
+    ATOMIC_INCREMENT(batcher->counters.batches);
+    ATOMIC_INCREASE(batcher->counters.items, count);
+    int bucket = 0;
+    while (bucket < STORAGE_IO_BATCH_HISTOGRAM_SIZE - 1 && (1 << bucket) < count)
+        bucket++;
+    ATOMIC_INCREMENT(batcher->counters.histogram[bucket]);
+
+    // if the pool threads can't keep up wait for a free slot instead of
+    // running the batch here, so that new items keep being collected
+    // (and the callers fall back to synchronous fetches once the batcher is full).
+    // The batch is run here only if the pool is going away
+    MUTEX_UNLOCK(batcher->lock);
+    if (storage_io_pool_run_wait(batcher->pool, storage_io_batch_run, batch) != 0)
+        storage_io_batch_run(batch);
+    MUTEX_LOCK(batcher->lock);
+}
+
+static void *
+storage_io_batcher_worker(void *priv)
+{
+    storage_io_batcher_t *batcher = (storage_io_batcher_t *)priv;
+
+    MUTEX_LOCK(batcher->lock);
+    for (;;) {
+        while (!batcher->count && !batcher->quit)
+            pthread_cond_wait(&batcher->cond, &batcher->lock);
+
+        // the pending items are flushed before leaving
+        if (!batcher->count)
+            break;
+
+        // wait until the batch is full or the oldest item
+        // has been waiting for the whole window
+        struct timeval deadline = { batcher->window / 1000000, batcher->window % 1000000 };
+        timeradd(&batcher->first, &deadline, &deadline);
+        while (batcher->count < batcher->max_items && !batcher->quit) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            if (!timercmp(&now, &deadline, <))
+                break;
+            struct timespec abstime = { deadline.tv_sec, deadline.tv_usec * 1000 };
+            pthread_cond_timedwait(&batcher->cond, &batcher->lock, &abstime);
+        }
+
+        storage_io_batcher_flush(batcher);
+    }
+    MUTEX_UNLOCK(batcher->lock);
+
+    return NULL;
+}
+
+storage_io_batcher_t *
+storage_io_batcher_create(int max_items,
+                          int window,
+                          storage_io_pool_t *pool,
+                          storage_io_batch_cb_t cb,
+                          void *priv)
+{
+    if (max_items <= 0 || window < 0 || !pool || !cb)
+        return NULL;
+
+    storage_io_batcher_t *batcher = calloc(1, sizeof(storage_io_batcher_t));
+    batcher->size = max_items * STORAGE_IO_BATCHER_MAX_PENDING;
+    batcher->items = malloc(batcher->size * sizeof(void *));
+    if (!batcher->items) {
+        free(batcher);
+        return NULL;
+    }
+    batcher->max_items = max_items;
+    batcher->window = window;
+    batcher->pool = pool;
+    batcher->cb = cb;
+    batcher->priv = priv;
+    MUTEX_INIT(batcher->lock);
+    pthread_cond_init(&batcher->cond, NULL);
+
+    if (pthread_create(&batcher->thread, NULL, storage_io_batcher_worker, batcher) != 0) {
+        SHC_ERROR("Can't create the storage batcher thread: %s", strerror(errno));
+        pthread_cond_destroy(&batcher->cond);
+        MUTEX_DESTROY(batcher->lock);
+        free(batcher->items);
+        free(batcher);
+        return NULL;
+    }
+
+    return batcher;
+}
+
+void
+storage_io_batcher_destroy(storage_io_batcher_t *batcher)
+{
+    MUTEX_LOCK(batcher->lock);
+    batcher->quit = 1;
+    pthread_cond_signal(&batcher->cond);
+    MUTEX_UNLOCK(batcher->lock);
+
+    pthread_join(batcher->thread, NULL);
+
+    pthread_cond_destroy(&batcher->cond);
+    MUTEX_DESTROY(batcher->lock);
+    free(batcher->items);
+    free(batcher);
+}
+
+int
+storage_io_batcher_add(storage_io_batcher_t *batcher, void *item)
+{
+    MUTEX_LOCK(batcher->lock);
+    if (batcher->quit) {
+        MUTEX_UNLOCK(batcher->lock);
+        return -1;
+    }
+
+    if (batcher->count == batcher->size) {
+        // the pool threads can't keep up, the caller will run it by itself
+        MUTEX_UNLOCK(batcher->lock);
+        ATOMIC_INCREMENT(batcher->counters.rejected);
+        return -1;
+    }
+
+    if (!batcher->count)
+        gettimeofday(&batcher->first, NULL);
+
+    batcher->items[batcher->count++] = item;
+    ATOMIC_INCREMENT(batcher->counters.pending);
+
+    // wake up the batcher thread if it's idle or if the batch is full
+    if (batcher->count == 1 || batcher->count == batcher->max_items)
+        pthread_cond_signal(&batcher->cond);
+
+    MUTEX_UNLOCK(batcher->lock);
+    return 0;
+}
+
+storage_io_batcher_counters_t *
+storage_io_batcher_counters(storage_io_batcher_t *batcher)
+{
+    return &batcher->counters;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
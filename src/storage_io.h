@@ -0,0 +1,99 @@
+#ifndef SHARDCACHE_STORAGE_IO_H
+#define SHARDCACHE_STORAGE_IO_H
+
+#include <stdint.h>
+
+/*
+ * Bounded pool of threads used to run the blocking storage callbacks
+ * (for storage modules implementing only the synchronous fetch API)
+ * out of the serving workers, so that a slow storage doesn't stall
+ * all the connections handled by the same worker.
+ *
+ * Jobs are kept in a fixed-size queue, once it's full new jobs are refused
+ * and the caller is expected to run them by itself
+ *
+ * A batcher can be stacked on top of the pool to coalesce the items
+ * (typically single-key fetches) submitted within a small time window
+ * into a single job, so that they can be served by a multi-key operation
+ */
+
+typedef struct _storage_io_pool_s storage_io_pool_t;
+
+typedef void (*storage_io_job_t)(void *arg);
+
+// called by each pool thread when it starts and when it exits
+typedef void (*storage_io_thread_cb_t)(void *priv);
+
+typedef struct {
+    uint64_t queued;   // jobs waiting for a free thread
+    uint64_t running;  // jobs being executed
+    uint64_t rejected; // jobs refused because the queue was full
+} storage_io_pool_counters_t;
+
+storage_io_pool_t *storage_io_pool_create(int num_threads,
+                                          int max_queued,
+                                          storage_io_thread_cb_t thread_start,
+                                          storage_io_thread_cb_t thread_exit,
+                                          void *priv);
+
+// NOTE: all the jobs still in the queue are executed before returning
+void storage_io_pool_destroy(storage_io_pool_t *pool);
+
+// returns 0 if the job has been queued, -1 if the queue is full
+int storage_io_pool_run(storage_io_pool_t *pool, storage_io_job_t job, void *arg);
+
+// like storage_io_pool_run() but waits for a free slot if the queue is full,
+// returns -1 only if the pool is being destroyed
+int storage_io_pool_run_wait(storage_io_pool_t *pool, storage_io_job_t job, void *arg);
+
+storage_io_pool_counters_t *storage_io_pool_counters(storage_io_pool_t *pool);
+
+typedef struct _storage_io_batcher_s storage_io_batcher_t;
+
+// called (by one of the pool threads) with the items collected in a batch
+typedef void (*storage_io_batch_cb_t)(void **items, int count, void *priv);
+
+// batches are accounted by size in power of two buckets :
+// 1, 2, 3-4, 5-8, 9-16, 17-32, 33-64, more than 64
+#define STORAGE_IO_BATCH_HISTOGRAM_SIZE 8
+
+// max number of batches (of max_items each) collected by a batcher
+// while waiting for the pool threads to take the previous ones
+#define STORAGE_IO_BATCHER_MAX_PENDING 4
+
+typedef struct {
+    uint64_t pending;  // items waiting for their batch to be flushed
+    uint64_t batches;  // batches flushed so far
+    uint64_t items;    // items flushed so far
+    uint64_t rejected; // items refused because too many were pending
+    uint64_t histogram[STORAGE_IO_BATCH_HISTOGRAM_SIZE];
+} storage_io_batcher_counters_t;
+
+/*
+ * Create a batcher flushing the collected items to 'cb' once 'max_items'
+ * have been collected or 'window' microseconds have passed since the oldest
+ * of them has been added. Batches are run by the pool threads, if the pool
+ * queue is full the batcher thread waits for a free slot (while new items
+ * keep being collected, up to STORAGE_IO_BATCHER_MAX_PENDING batches)
+ */
+storage_io_batcher_t *storage_io_batcher_create(int max_items,
+                                                int window,
+                                                storage_io_pool_t *pool,
+                                                storage_io_batch_cb_t cb,
+                                                void *priv);
+
+// NOTE: the pending items are flushed before returning,
+//       the pool must be destroyed after the batcher
+void storage_io_batcher_destroy(storage_io_batcher_t *batcher);
+
+// returns 0 if the item has been added, -1 if the batcher is being destroyed
+// or if too many items are pending (the caller is expected to process the
+// item by itself in this case)
+int storage_io_batcher_add(storage_io_batcher_t *batcher, void *item);
+
+storage_io_batcher_counters_t *storage_io_batcher_counters(storage_io_batcher_t *batcher);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
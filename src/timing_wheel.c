@@ -0,0 +1,357 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <siphash.h>
+
+#include "timing_wheel.h"
+
+// 4 levels of 256 slots each cover 2^32 ticks,
+// timers scheduled further in the future are parked in the last
+// slot reachable and moved again when that slot is cascaded
+#define TW_LEVELS      4
+#define TW_LEVEL_BITS  8
+#define TW_LEVEL_SIZE  (1 << TW_LEVEL_BITS)
+#define TW_LEVEL_MASK  (TW_LEVEL_SIZE - 1)
+#define TW_MAX_DELTA   UINT32_MAX
+
+#define TW_INDEX_SIZE_MIN (1<<16)
+#define TW_POOL_CHUNK_SIZE 1024
+
+typedef struct _tw_entry_s tw_entry_t;
+
+// NOTE: the entry fits in a single cacheline on 64bit systems
+struct _tw_entry_s {
+    tw_entry_t *next;    // next entry in the slot (or in the free list)
+    tw_entry_t **pprev;  // pointer to the 'next' member pointing to us (or to the slot head)
+    tw_entry_t *hnext;   // next entry in the same index bucket
+    uint64_t expire;     // the tick at which the timer expires
+    uint32_t hash;
+    uint32_t klen;
+    union {
+        char data[TIMING_WHEEL_INLINE_KEY_SIZE];
+        char *ptr;
+    } key;
+};
+
+typedef struct _tw_pool_chunk_s {
+    struct _tw_pool_chunk_s *next;
+    tw_entry_t entries[TW_POOL_CHUNK_SIZE];
+} tw_pool_chunk_t;
+
+struct _timing_wheel_s {
+    tw_entry_t *slots[TW_LEVELS][TW_LEVEL_SIZE];
+    uint64_t tick;          // the next tick to process
+    uint64_t start_ms;
+    unsigned int tick_ms;
+    uint64_t count;
+    tw_entry_t **index;     // key -> entry
+    uint64_t index_size;    // always a power of 2
+    tw_entry_t *free_list;
+    tw_pool_chunk_t *chunks;
+    unsigned char hash_key[16];
+};
+
+static inline uint64_t
+timing_wheel_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static inline uint64_t
+timing_wheel_current_tick(timing_wheel_t *tw, uint64_t now_ms)
+{
+    return (now_ms - tw->start_ms) / tw->tick_ms;
+}
+
+static inline char *
+tw_entry_key(tw_entry_t *e)
+{
+    return (e->klen > TIMING_WHEEL_INLINE_KEY_SIZE) ? e->key.ptr : e->key.data;
+}
+
+timing_wheel_t *
+timing_wheel_create(unsigned int tick_ms)
+{
+    timing_wheel_t *tw = calloc(1, sizeof(timing_wheel_t));
+    tw->tick_ms = tick_ms ? tick_ms : 1;
+    tw->start_ms = timing_wheel_now_ms();
+    tw->index_size = TW_INDEX_SIZE_MIN;
+    tw->index = calloc(tw->index_size, sizeof(tw_entry_t *));
+    int i;
+    for (i = 0; i < (int)sizeof(tw->hash_key); i++)
+        tw->hash_key[i] = random();
+    return tw;
+}
+
+void
+timing_wheel_destroy(timing_wheel_t *tw)
+{
+    uint64_t i;
+    for (i = 0; i < tw->index_size; i++) {
+        tw_entry_t *e = tw->index[i];
+        while (e) {
+            if (e->klen > TIMING_WHEEL_INLINE_KEY_SIZE)
+                free(e->key.ptr);
+            e = e->hnext;
+        }
+    }
+    free(tw->index);
+
+    tw_pool_chunk_t *chunk = tw->chunks;
+    while (chunk) {
+        tw_pool_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(tw);
+}
+
+static tw_entry_t *
+tw_entry_alloc(timing_wheel_t *tw)
+{
+    if (!tw->free_list) {
+        tw_pool_chunk_t *chunk = malloc(sizeof(tw_pool_chunk_t));
+        if (!chunk)
+            return NULL;
+        chunk->next = tw->chunks;
+        tw->chunks = chunk;
+        int i;
+        for (i = 0; i < TW_POOL_CHUNK_SIZE; i++) {
+            chunk->entries[i].next = tw->free_list;
+            tw->free_list = &chunk->entries[i];
+        }
+    }
+    tw_entry_t *e = tw->free_list;
+    tw->free_list = e->next;
+    return e;
+}
+
+static inline void
+tw_entry_release(timing_wheel_t *tw, tw_entry_t *e)
+{
+    if (e->klen > TIMING_WHEEL_INLINE_KEY_SIZE)
+        free(e->key.ptr);
+    e->next = tw->free_list;
+    tw->free_list = e;
+}
+
+static inline void
+tw_slot_link(tw_entry_t **slot, tw_entry_t *e)
+{
+    e->next = *slot;
+    if (e->next)
+        e->next->pprev = &e->next;
+    e->pprev = slot;
+    *slot = e;
+}
+
+static inline void
+tw_slot_unlink(tw_entry_t *e)
+{
+    *e->pprev = e->next;
+    if (e->next)
+        e->next->pprev = e->pprev;
+}
+
+static void
+timing_wheel_add(timing_wheel_t *tw, tw_entry_t *e)
+{
+    uint64_t expire = e->expire;
+    tw_entry_t **slot;
+
+    if (expire < tw->tick) {
+        // already expired, will be handled by the next run
+        slot = &tw->slots[0][tw->tick & TW_LEVEL_MASK];
+    } else {
+        uint64_t delta = expire - tw->tick;
+        if (delta > TW_MAX_DELTA) {
+            delta = TW_MAX_DELTA;
+            expire = tw->tick + delta;
+        }
+        int level = 0;
+        while (level < TW_LEVELS - 1 && delta >= (1ULL << (TW_LEVEL_BITS * (level + 1))))
+            level++;
+        slot = &tw->slots[level][(expire >> (TW_LEVEL_BITS * level)) & TW_LEVEL_MASK];
+    }
+
+    tw_slot_link(slot, e);
+}
+
+// move all the timers in the slot 'idx' of the level 'level' to the lower levels
+static int
+timing_wheel_cascade(timing_wheel_t *tw, int level, int idx)
+{
+    tw_entry_t *e = tw->slots[level][idx];
+    tw->slots[level][idx] = NULL;
+    while (e) {
+        tw_entry_t *next = e->next;
+        timing_wheel_add(tw, e);
+        e = next;
+    }
+    return idx;
+}
+
+static inline tw_entry_t **
+timing_wheel_lookup(timing_wheel_t *tw, void *key, size_t klen, uint32_t hash)
+{
+    tw_entry_t **pe = &tw->index[hash & (tw->index_size - 1)];
+    while (*pe) {
+        tw_entry_t *e = *pe;
+        if (e->hash == hash && e->klen == klen && memcmp(tw_entry_key(e), key, klen) == 0)
+            break;
+        pe = &e->hnext;
+    }
+    return pe;
+}
+
+static void
+timing_wheel_grow_index(timing_wheel_t *tw)
+{
+    uint64_t new_size = tw->index_size << 1;
+    tw_entry_t **new_index = calloc(new_size, sizeof(tw_entry_t *));
+    if (!new_index)
+        return; // we can still go on with longer chains
+
+    uint64_t i;
+    for (i = 0; i < tw->index_size; i++) {
+        tw_entry_t *e = tw->index[i];
+        while (e) {
+            tw_entry_t *next = e->hnext;
+            tw_entry_t **bucket = &new_index[e->hash & (new_size - 1)];
+            e->hnext = *bucket;
+            *bucket = e;
+            e = next;
+        }
+    }
+    free(tw->index);
+    tw->index = new_index;
+    tw->index_size = new_size;
+}
+
+int
+timing_wheel_schedule(timing_wheel_t *tw, void *key, size_t klen, uint64_t timeout_ms)
+{
+    if (klen > UINT32_MAX)
+        return -1;
+
+    uint64_t now_ms = timing_wheel_now_ms();
+    // round up so that timers never fire before their timeout
+    uint64_t expire = (now_ms - tw->start_ms + timeout_ms + tw->tick_ms - 1) / tw->tick_ms;
+
+    uint32_t hash = sip_hash24(tw->hash_key, key, klen);
+    tw_entry_t **pe = timing_wheel_lookup(tw, key, klen, hash);
+    tw_entry_t *e = *pe;
+    if (e) {
+        tw_slot_unlink(e);
+    } else {
+        e = tw_entry_alloc(tw);
+        if (!e)
+            return -1;
+
+        if (klen > TIMING_WHEEL_INLINE_KEY_SIZE) {
+            e->key.ptr = malloc(klen);
+            if (!e->key.ptr) {
+                e->klen = 0;
+                tw_entry_release(tw, e);
+                return -1;
+            }
+            memcpy(e->key.ptr, key, klen);
+        } else {
+            memcpy(e->key.data, key, klen);
+        }
+        e->klen = klen;
+        e->hash = hash;
+        e->hnext = NULL;
+        *pe = e;
+
+        if (++tw->count > tw->index_size)
+            timing_wheel_grow_index(tw);
+    }
+
+    e->expire = expire;
+    timing_wheel_add(tw, e);
+    return 0;
+}
+
+int
+timing_wheel_cancel(timing_wheel_t *tw, void *key, size_t klen)
+{
+    uint32_t hash = sip_hash24(tw->hash_key, key, klen);
+    tw_entry_t **pe = timing_wheel_lookup(tw, key, klen, hash);
+    tw_entry_t *e = *pe;
+    if (!e)
+        return -1;
+
+    *pe = e->hnext;
+    tw_slot_unlink(e);
+    tw_entry_release(tw, e);
+    tw->count--;
+    return 0;
+}
+
+int
+timing_wheel_run(timing_wheel_t *tw, timing_wheel_expire_cb_t cb, void *priv, uint64_t *lag_ms)
+{
+    uint64_t now_ms = timing_wheel_now_ms();
+    uint64_t now = timing_wheel_current_tick(tw, now_ms);
+    uint64_t max_lag = 0;
+    int expired = 0;
+
+    while (tw->tick <= now) {
+        if (!tw->count) {
+            // nothing to expire, we can skip the empty slots
+            tw->tick = now + 1;
+            break;
+        }
+
+        int idx = tw->tick & TW_LEVEL_MASK;
+        // when the lower level wraps around, the next slot of
+        // the upper level needs to be spread over the lower ones
+        int level = 1;
+        while (!idx && level < TW_LEVELS) {
+            idx = timing_wheel_cascade(tw, level, (tw->tick >> (TW_LEVEL_BITS * level)) & TW_LEVEL_MASK);
+            level++;
+        }
+        idx = tw->tick & TW_LEVEL_MASK;
+        tw->tick++;
+
+        // detach the whole slot and expire all its timers as a batch
+        tw_entry_t *e = tw->slots[0][idx];
+        tw->slots[0][idx] = NULL;
+        while (e) {
+            tw_entry_t *next = e->next;
+            char *key = tw_entry_key(e);
+
+            tw_entry_t **pe = timing_wheel_lookup(tw, key, e->klen, e->hash);
+            *pe = e->hnext;
+            tw->count--;
+
+            uint64_t expire_ms = tw->start_ms + (e->expire * tw->tick_ms);
+            if (now_ms > expire_ms && now_ms - expire_ms > max_lag)
+                max_lag = now_ms - expire_ms;
+
+            if (cb)
+                cb(key, e->klen, priv);
+
+            tw_entry_release(tw, e);
+            expired++;
+            e = next;
+        }
+    }
+
+    if (lag_ms)
+        *lag_ms = max_lag;
+
+    return expired;
+}
+
+uint64_t
+timing_wheel_count(timing_wheel_t *tw)
+{
+    return tw->count;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,78 @@
+/**
+ * @file timing_wheel.h
+ * @brief Hierarchical timing wheel used to expire keys
+ *
+ * Timers are identified by the key they refer to, so scheduling a key already
+ * present moves its timer (reschedule) and keys can be cancelled without any
+ * handle being kept by the caller.
+ * Scheduling, rescheduling and cancelling are O(1), timers falling in the same
+ * tick are expired as a single batch and the timers are allocated from an
+ * internal pool (keys up to TIMING_WHEEL_INLINE_KEY_SIZE bytes are stored
+ * inline) so no memory is allocated per key.
+ *
+ * @note The timing wheel is not thread-safe, it's meant to be owned
+ *       by a single thread (the expirer)
+ */
+#ifndef SHARDCACHE_TIMING_WHEEL_H
+#define SHARDCACHE_TIMING_WHEEL_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+typedef struct _timing_wheel_s timing_wheel_t;
+
+//! Keys up to this size don't require any additional allocation
+#define TIMING_WHEEL_INLINE_KEY_SIZE 24
+
+/**
+ * @brief Callback called for each expired key
+ * @note The key is released as soon as the callback returns
+ */
+typedef void (*timing_wheel_expire_cb_t)(void *key, size_t klen, void *priv);
+
+/**
+ * @brief Create a new timing wheel
+ * @param tick_ms The resolution of the timers (in milliseconds)
+ * @return A newly initialized timing wheel
+ */
+timing_wheel_t *timing_wheel_create(unsigned int tick_ms);
+
+/**
+ * @brief Release all the resources used by the timing wheel
+ *        (pending timers are dropped without being expired)
+ */
+void timing_wheel_destroy(timing_wheel_t *tw);
+
+/**
+ * @brief Schedule the expiration of a key after 'timeout_ms' milliseconds,
+ *        if a timer for the same key already exists it will be rescheduled
+ * @return 0 on success, -1 otherwise
+ */
+int timing_wheel_schedule(timing_wheel_t *tw, void *key, size_t klen, uint64_t timeout_ms);
+
+/**
+ * @brief Cancel the timer for a key
+ * @return 0 if the timer has been cancelled, -1 if no timer exists for the key
+ */
+int timing_wheel_cancel(timing_wheel_t *tw, void *key, size_t klen);
+
+/**
+ * @brief Expire all the timers which are due
+ * @param tw     A valid pointer to a timing_wheel_t structure
+ * @param cb     The callback to call for each expired key
+ * @param priv   A pointer which will be passed to the callback
+ * @param lag_ms If not NULL, it will be set to the maximum delay
+ *               (in milliseconds) with which a key has been expired
+ * @return The number of expired keys
+ */
+int timing_wheel_run(timing_wheel_t *tw, timing_wheel_expire_cb_t cb, void *priv, uint64_t *lag_ms);
+
+/**
+ * @brief Return the number of scheduled timers
+ */
+uint64_t timing_wheel_count(timing_wheel_t *tw);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
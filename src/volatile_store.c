@@ -0,0 +1,655 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <atomic_defs.h>
+
+#include "compression.h"
+#include "shardcache_log.h"
+#include "volatile_store.h"
+
+#define VSTORE_MAGIC   0x76636873 // "shcv"
+#define VSTORE_VERSION 1
+
+#define VSTORE_RECORD_PUT 1
+#define VSTORE_RECORD_DEL 2
+
+#define VSTORE_SEGMENT_SIZE_MIN (1<<16)
+#define VSTORE_SEGMENT_SUFFIX ".vseg"
+
+// percentage of obsolete data in the log which triggers the compaction
+#define VSTORE_COMPACTION_THRESHOLD 50
+
+// records are 8-bytes aligned
+#define VSTORE_ALIGN(_s) (((_s) + 7) & ~((size_t)7))
+
+#define VSTORE_LOC(_id, _offset) ((((uint64_t)(_id)) << 32) | (uint64_t)(_offset))
+#define VSTORE_LOC_ID(_loc) ((uint32_t)((_loc) >> 32))
+#define VSTORE_LOC_OFFSET(_loc) ((size_t)((_loc) & 0xFFFFFFFF))
+
+// NOTE: all the integers are stored in host byte order
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t id;
+    uint32_t reserved;
+} vstore_segment_hdr_t;
+
+typedef struct {
+    uint32_t crc;       // crc32 of the rest of the header, the key and the value
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t klen;
+    uint32_t vlen;
+    int64_t expire;     // absolute unix time (0 if the key doesn't expire)
+} vstore_record_hdr_t;
+
+#define VSTORE_DATA_OFFSET VSTORE_ALIGN(sizeof(vstore_segment_hdr_t))
+
+typedef struct {
+    uint32_t id;
+    int fd;
+    char *map;
+    size_t size;    // the size of the segment file (and of the mapping)
+    size_t used;    // the offset where the next record will be written
+    uint64_t dead;  // size of the obsolete records
+    int writers;    // number of writers still copying data into the segment
+} vstore_segment_t;
+
+struct _volatile_store_s {
+    char *path;
+    size_t segment_size;
+    pthread_mutex_t lock;
+    vstore_segment_t **segments; // sorted by id (oldest first)
+    int num_segments;
+    vstore_segment_t *active;    // the segment new records are appended to
+    uint32_t next_id;
+    volatile_store_counters_t counters;
+    volatile_store_relocate_cb_t relocate_cb;
+    void *priv;
+    pthread_t compactor_th;
+    pthread_mutex_t compactor_lock;
+    pthread_cond_t compactor_cond;
+    int quit;
+};
+
+static inline void
+vstore_segment_path(volatile_store_t *store, uint32_t id, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s/%010u%s", store->path, id, VSTORE_SEGMENT_SUFFIX);
+}
+
+static void
+vstore_segment_destroy(vstore_segment_t *seg)
+{
+    if (seg->map)
+        munmap(seg->map, seg->size);
+    if (seg->fd >= 0)
+        close(seg->fd);
+    free(seg);
+}
+
+// reserve the disk blocks for the whole segment, a sparse file would make
+// the writes through the mapping raise SIGBUS once the disk is full
+static int
+vstore_segment_allocate(int fd, size_t size)
+{
+#if defined(__linux__) || defined(__FreeBSD__)
+    int rc = posix_fallocate(fd, 0, size);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+#else
+    return ftruncate(fd, size);
+#endif
+}
+
+// must be called with the lock held
+static vstore_segment_t *
+vstore_segment_create(volatile_store_t *store, size_t size)
+{
+    char fname[2048];
+    uint32_t id = store->next_id++;
+    vstore_segment_path(store, id, fname, sizeof(fname));
+
+    vstore_segment_t *seg = calloc(1, sizeof(vstore_segment_t));
+    seg->id = id;
+    seg->size = size;
+    seg->fd = open(fname, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (seg->fd < 0 || vstore_segment_allocate(seg->fd, size) != 0) {
+        SHC_ERROR("Can't create the volatile store segment %s: %s", fname, strerror(errno));
+        vstore_segment_destroy(seg);
+        unlink(fname);
+        return NULL;
+    }
+
+    seg->map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        SHC_ERROR("Can't map the volatile store segment %s: %s", fname, strerror(errno));
+        seg->map = NULL;
+        vstore_segment_destroy(seg);
+        unlink(fname);
+        return NULL;
+    }
+
+    vstore_segment_hdr_t hdr = {
+        .magic = VSTORE_MAGIC,
+        .version = VSTORE_VERSION,
+        .id = id,
+        .reserved = 0
+    };
+    memcpy(seg->map, &hdr, sizeof(hdr));
+    seg->used = VSTORE_DATA_OFFSET;
+
+    store->segments = realloc(store->segments, sizeof(vstore_segment_t *) * (store->num_segments + 1));
+    store->segments[store->num_segments++] = seg;
+    store->counters.segments++;
+
+    return seg;
+}
+
+// must be called with the lock held
+static vstore_segment_t *
+vstore_segment_lookup(volatile_store_t *store, uint32_t id)
+{
+    int low = 0;
+    int high = store->num_segments - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        vstore_segment_t *seg = store->segments[mid];
+        if (seg->id == id)
+            return seg;
+        if (seg->id < id)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    return NULL;
+}
+
+static volatile_store_loc_t
+vstore_append(volatile_store_t *store,
+              int type,
+              void *key,
+              size_t klen,
+              void *value,
+              size_t vlen,
+              time_t expire)
+{
+    if (klen > UINT32_MAX || vlen > UINT32_MAX)
+        return 0;
+
+    size_t rsize = VSTORE_ALIGN(sizeof(vstore_record_hdr_t) + klen + vlen);
+    if (rsize > UINT32_MAX - VSTORE_DATA_OFFSET)
+        return 0;
+
+    vstore_record_hdr_t hdr = {
+        .crc = 0,
+        .type = type,
+        .reserved = { 0, 0, 0 },
+        .klen = klen,
+        .vlen = vlen,
+        .expire = expire
+    };
+    uint32_t crc = compression_crc32(0, (char *)&hdr + sizeof(hdr.crc), sizeof(hdr) - sizeof(hdr.crc));
+    crc = compression_crc32(crc, key, klen);
+    if (vlen)
+        crc = compression_crc32(crc, value, vlen);
+    hdr.crc = crc;
+
+    pthread_mutex_lock(&store->lock);
+    vstore_segment_t *seg = store->active;
+    if (!seg || seg->size - seg->used < rsize) {
+        // records which don't fit in a regular segment get their own one
+        size_t size = store->segment_size;
+        if (rsize > size - VSTORE_DATA_OFFSET)
+            size = VSTORE_DATA_OFFSET + rsize;
+        seg = vstore_segment_create(store, size);
+        if (!seg) {
+            pthread_mutex_unlock(&store->lock);
+            return 0;
+        }
+        store->active = seg;
+    }
+    size_t offset = seg->used;
+    seg->used += rsize;
+    ATOMIC_INCREMENT(seg->writers);
+    store->counters.size += rsize;
+    pthread_mutex_unlock(&store->lock);
+
+    // the space is reserved, so the data can be copied without holding the lock
+    char *p = seg->map + offset;
+    memcpy(p, &hdr, sizeof(hdr));
+    memcpy(p + sizeof(hdr), key, klen);
+    if (vlen)
+        memcpy(p + sizeof(hdr) + klen, value, vlen);
+
+    ATOMIC_DECREMENT(seg->writers);
+
+    return VSTORE_LOC(seg->id, offset);
+}
+
+volatile_store_loc_t
+volatile_store_put(volatile_store_t *store,
+                   void *key,
+                   size_t klen,
+                   void *value,
+                   size_t vlen,
+                   time_t expire)
+{
+    return vstore_append(store, VSTORE_RECORD_PUT, key, klen, value, vlen, expire);
+}
+
+int
+volatile_store_del(volatile_store_t *store, void *key, size_t klen)
+{
+    volatile_store_loc_t loc = vstore_append(store, VSTORE_RECORD_DEL, key, klen, NULL, 0, 0);
+    if (!loc)
+        return -1;
+
+    // deletion markers are obsolete as soon as they are written
+    volatile_store_release(store, loc);
+    return 0;
+}
+
+void
+volatile_store_release(volatile_store_t *store, volatile_store_loc_t loc)
+{
+    if (!loc)
+        return;
+
+    pthread_mutex_lock(&store->lock);
+    // NOTE: the segment might have already been compacted if the record
+    //       was expired (and so it has not been moved)
+    vstore_segment_t *seg = vstore_segment_lookup(store, VSTORE_LOC_ID(loc));
+    size_t offset = VSTORE_LOC_OFFSET(loc);
+    if (seg && offset >= VSTORE_DATA_OFFSET && offset + sizeof(vstore_record_hdr_t) <= seg->used) {
+        vstore_record_hdr_t hdr;
+        memcpy(&hdr, seg->map + offset, sizeof(hdr));
+        size_t rsize = VSTORE_ALIGN(sizeof(hdr) + hdr.klen + hdr.vlen);
+        seg->dead += rsize;
+        store->counters.dead += rsize;
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+// read the record at 'offset' and verify its checksum if 'verify' is true.
+// returns the size of the record or 0 if there is no valid record at 'offset'
+static size_t
+vstore_read_record(vstore_segment_t *seg, size_t offset, vstore_record_hdr_t *hdr, int verify)
+{
+    if (offset + sizeof(vstore_record_hdr_t) > seg->size)
+        return 0;
+
+    memcpy(hdr, seg->map + offset, sizeof(vstore_record_hdr_t));
+
+    // the unused part of a segment is zero-filled
+    if (hdr->type != VSTORE_RECORD_PUT && hdr->type != VSTORE_RECORD_DEL)
+        return 0;
+
+    size_t rsize = VSTORE_ALIGN(sizeof(vstore_record_hdr_t) + (size_t)hdr->klen + (size_t)hdr->vlen);
+    if (rsize > seg->size - offset)
+        return 0;
+
+    if (verify) {
+        uint32_t crc = compression_crc32(0, seg->map + offset + sizeof(hdr->crc),
+                                         sizeof(vstore_record_hdr_t) - sizeof(hdr->crc) + hdr->klen + hdr->vlen);
+        if (crc != hdr->crc)
+            return 0;
+    }
+
+    return rsize;
+}
+
+// move all the records still alive out of the oldest segment and remove it,
+// returns 1 if a segment has been compacted, 0 if there was no need and -1 on errors
+static int
+vstore_compact(volatile_store_t *store)
+{
+    pthread_mutex_lock(&store->lock);
+    vstore_segment_t *seg = store->num_segments > 1 ? store->segments[0] : NULL;
+    if (!seg || seg == store->active ||
+        store->counters.dead * 100 < store->counters.size * VSTORE_COMPACTION_THRESHOLD)
+    {
+        pthread_mutex_unlock(&store->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    // the segment might still be being written by someone
+    // which reserved space right before it was sealed
+    while (ATOMIC_READ(seg->writers) && !ATOMIC_READ(store->quit))
+        usleep(1000);
+
+    if (ATOMIC_READ(store->quit))
+        return 0;
+
+    SHC_DEBUG("Compacting volatile store segment %u", seg->id);
+
+    time_t now = time(NULL);
+    size_t offset = VSTORE_DATA_OFFSET;
+    while (offset < seg->used && !ATOMIC_READ(store->quit)) {
+        vstore_record_hdr_t hdr;
+        size_t rsize = vstore_read_record(seg, offset, &hdr, 0);
+        if (!rsize)
+            break;
+
+        // deletion markers can be dropped since there are
+        // no older segments which might still contain the key
+        if (hdr.type == VSTORE_RECORD_PUT && (!hdr.expire || hdr.expire > now)) {
+            char *key = seg->map + offset + sizeof(hdr);
+            if (store->relocate_cb(store, key, hdr.klen, key + hdr.klen, hdr.vlen, hdr.expire,
+                                   VSTORE_LOC(seg->id, offset), store->priv) == -1)
+            {
+                SHC_ERROR("Can't move records out of the volatile store segment %u", seg->id);
+                return -1;
+            }
+        }
+        offset += rsize;
+    }
+
+    if (ATOMIC_READ(store->quit))
+        return 0;
+
+    pthread_mutex_lock(&store->lock);
+    store->num_segments--;
+    memmove(store->segments, &store->segments[1], sizeof(vstore_segment_t *) * store->num_segments);
+    store->counters.segments--;
+    store->counters.size -= seg->used - VSTORE_DATA_OFFSET;
+    store->counters.dead -= seg->dead;
+    store->counters.compactions++;
+    pthread_mutex_unlock(&store->lock);
+
+    char fname[2048];
+    vstore_segment_path(store, seg->id, fname, sizeof(fname));
+    vstore_segment_destroy(seg);
+    unlink(fname);
+
+    return 1;
+}
+
+static void *
+vstore_compactor(void *priv)
+{
+    volatile_store_t *store = (volatile_store_t *)priv;
+
+    while (!ATOMIC_READ(store->quit)) {
+        while (!ATOMIC_READ(store->quit) && vstore_compact(store) == 1)
+            ;
+
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        struct timespec abstime = { now.tv_sec + 1, now.tv_usec * 1000 };
+        pthread_mutex_lock(&store->compactor_lock);
+        if (!ATOMIC_READ(store->quit))
+            pthread_cond_timedwait(&store->compactor_cond, &store->compactor_lock, &abstime);
+        pthread_mutex_unlock(&store->compactor_lock);
+    }
+    return NULL;
+}
+
+typedef struct {
+    volatile_store_t *store;
+    volatile_store_replay_cb_t cb;
+    void *priv;
+    int next;
+    uint64_t records;
+} vstore_replay_arg_t;
+
+static void *
+vstore_replay_worker(void *priv)
+{
+    vstore_replay_arg_t *arg = (vstore_replay_arg_t *)priv;
+    volatile_store_t *store = arg->store;
+    uint64_t records = 0;
+    uint64_t dead = 0;
+
+    int i;
+    while ((i = ATOMIC_INCREASE(arg->next, 1) - 1) < store->num_segments) {
+        vstore_segment_t *seg = store->segments[i];
+        size_t offset = VSTORE_DATA_OFFSET;
+        for (;;) {
+            vstore_record_hdr_t hdr;
+            size_t rsize = vstore_read_record(seg, offset, &hdr, 1);
+            if (!rsize) {
+                if (offset + sizeof(hdr) <= seg->size && hdr.type != 0)
+                    SHC_WARNING("Corrupted record at offset %lu in the volatile store segment %u,"
+                                " dropping the rest of the segment", (unsigned long)offset, seg->id);
+                break;
+            }
+
+            char *key = seg->map + offset + sizeof(hdr);
+            volatile_store_loc_t loc = VSTORE_LOC(seg->id, offset);
+            if (hdr.type == VSTORE_RECORD_DEL) {
+                dead += rsize;
+                arg->cb(store, key, hdr.klen, NULL, 0, 0, loc, arg->priv);
+            } else {
+                arg->cb(store, key, hdr.klen, key + hdr.klen, hdr.vlen, hdr.expire, loc, arg->priv);
+            }
+            records++;
+            offset += rsize;
+        }
+
+        // NOTE: the segment won't be written anymore
+        pthread_mutex_lock(&store->lock);
+        seg->used = offset;
+        seg->dead += dead;
+        store->counters.size += offset - VSTORE_DATA_OFFSET;
+        store->counters.dead += dead;
+        pthread_mutex_unlock(&store->lock);
+        dead = 0;
+    }
+
+    ATOMIC_INCREASE(arg->records, records);
+    return NULL;
+}
+
+static int
+vstore_segment_compare(const void *a, const void *b)
+{
+    const vstore_segment_t *s1 = *(const vstore_segment_t **)a;
+    const vstore_segment_t *s2 = *(const vstore_segment_t **)b;
+    return (s1->id > s2->id) - (s1->id < s2->id);
+}
+
+static vstore_segment_t *
+vstore_segment_open(volatile_store_t *store, uint32_t id)
+{
+    char fname[2048];
+    vstore_segment_path(store, id, fname, sizeof(fname));
+
+    vstore_segment_t *seg = calloc(1, sizeof(vstore_segment_t));
+    seg->id = id;
+    seg->fd = open(fname, O_RDONLY);
+
+    struct stat st;
+    if (seg->fd < 0 || fstat(seg->fd, &st) != 0) {
+        SHC_ERROR("Can't open the volatile store segment %s: %s", fname, strerror(errno));
+        vstore_segment_destroy(seg);
+        return NULL;
+    }
+
+    if (st.st_size < (off_t)VSTORE_DATA_OFFSET || st.st_size > UINT32_MAX) {
+        SHC_WARNING("Ignoring the volatile store segment %s (bad size)", fname);
+        vstore_segment_destroy(seg);
+        return NULL;
+    }
+
+    seg->size = st.st_size;
+    // records can be released while the log is being replayed,
+    // the actual end of the data will be known once the segment has been scanned
+    seg->used = seg->size;
+    seg->map = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        SHC_ERROR("Can't map the volatile store segment %s: %s", fname, strerror(errno));
+        seg->map = NULL;
+        vstore_segment_destroy(seg);
+        return NULL;
+    }
+
+    vstore_segment_hdr_t hdr;
+    memcpy(&hdr, seg->map, sizeof(hdr));
+    if (hdr.magic != VSTORE_MAGIC || hdr.version != VSTORE_VERSION || hdr.id != id) {
+        SHC_WARNING("Ignoring the volatile store segment %s (bad header)", fname);
+        vstore_segment_destroy(seg);
+        return NULL;
+    }
+
+    return seg;
+}
+
+static int
+vstore_load_segments(volatile_store_t *store)
+{
+    DIR *dir = opendir(store->path);
+    if (!dir) {
+        SHC_ERROR("Can't open the volatile store directory %s: %s", store->path, strerror(errno));
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        char *end = NULL;
+        unsigned long id = strtoul(entry->d_name, &end, 10);
+        if (end == entry->d_name || strcmp(end, VSTORE_SEGMENT_SUFFIX) != 0 || !id || id >= UINT32_MAX)
+            continue;
+
+        if (id >= store->next_id)
+            store->next_id = id + 1;
+
+        vstore_segment_t *seg = vstore_segment_open(store, id);
+        if (!seg)
+            continue;
+
+        store->segments = realloc(store->segments, sizeof(vstore_segment_t *) * (store->num_segments + 1));
+        store->segments[store->num_segments++] = seg;
+    }
+    closedir(dir);
+
+    if (store->num_segments)
+        qsort(store->segments, store->num_segments, sizeof(vstore_segment_t *), vstore_segment_compare);
+    store->counters.segments = store->num_segments;
+    return 0;
+}
+
+volatile_store_t *
+volatile_store_open(char *path,
+                    size_t segment_size,
+                    int num_threads,
+                    volatile_store_replay_cb_t replay_cb,
+                    volatile_store_relocate_cb_t relocate_cb,
+                    void *priv)
+{
+    struct timeval start, end, elapsed;
+    gettimeofday(&start, NULL);
+
+    if (mkdir(path, S_IRWXU) != 0 && errno != EEXIST) {
+        SHC_ERROR("Can't create the volatile store directory %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    volatile_store_t *store = calloc(1, sizeof(volatile_store_t));
+    store->path = strdup(path);
+    store->segment_size = segment_size < VSTORE_SEGMENT_SIZE_MIN ? VSTORE_SEGMENT_SIZE_MIN : segment_size;
+    if (store->segment_size > UINT32_MAX)
+        store->segment_size = UINT32_MAX;
+    store->next_id = 1;
+    store->relocate_cb = relocate_cb;
+    store->priv = priv;
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_mutex_init(&store->compactor_lock, NULL);
+    pthread_cond_init(&store->compactor_cond, NULL);
+
+    if (vstore_load_segments(store) != 0) {
+        volatile_store_close(store);
+        return NULL;
+    }
+
+    vstore_replay_arg_t arg = {
+        .store = store,
+        .cb = replay_cb,
+        .priv = priv,
+        .next = 0,
+        .records = 0
+    };
+
+    if (num_threads > store->num_segments)
+        num_threads = store->num_segments;
+
+    if (num_threads > 1) {
+        pthread_t threads[num_threads];
+        int i, n = 0;
+        for (i = 0; i < num_threads; i++) {
+            if (pthread_create(&threads[n], NULL, vstore_replay_worker, &arg) == 0)
+                n++;
+        }
+        // if no thread could be started the log is replayed by the calling thread
+        vstore_replay_worker(&arg);
+        for (i = 0; i < n; i++)
+            pthread_join(threads[i], NULL);
+    } else {
+        vstore_replay_worker(&arg);
+    }
+
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &elapsed);
+    uint64_t msecs = (elapsed.tv_sec * 1000) + (elapsed.tv_usec / 1000);
+
+    store->counters.replay_records = arg.records;
+    store->counters.replay_time = msecs;
+    store->counters.replay_rate = msecs ? (arg.records * 1000) / msecs : arg.records;
+
+    SHC_NOTICE("Replayed %"PRIu64" records from %d volatile store segments in %"PRIu64" ms",
+               arg.records, store->num_segments, msecs);
+
+    if (pthread_create(&store->compactor_th, NULL, vstore_compactor, store) != 0) {
+        SHC_ERROR("Can't start the volatile store compactor: %s", strerror(errno));
+        volatile_store_close(store);
+        return NULL;
+    }
+
+    return store;
+}
+
+void
+volatile_store_close(volatile_store_t *store)
+{
+    if (store->compactor_th) {
+        pthread_mutex_lock(&store->compactor_lock);
+        ATOMIC_INCREMENT(store->quit);
+        pthread_cond_signal(&store->compactor_cond);
+        pthread_mutex_unlock(&store->compactor_lock);
+        pthread_join(store->compactor_th, NULL);
+    }
+
+    int i;
+    for (i = 0; i < store->num_segments; i++)
+        vstore_segment_destroy(store->segments[i]);
+    free(store->segments);
+
+    pthread_mutex_destroy(&store->lock);
+    pthread_mutex_destroy(&store->compactor_lock);
+    pthread_cond_destroy(&store->compactor_cond);
+    free(store->path);
+    free(store);
+}
+
+volatile_store_counters_t *
+volatile_store_counters(volatile_store_t *store)
+{
+    return &store->counters;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,115 @@
+#ifndef SHARDCACHE_VOLATILE_STORE_H
+#define SHARDCACHE_VOLATILE_STORE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Append-only on-disk log backing the volatile storage, so that volatile keys
+ * survive restarts.
+ *
+ * The log is made of fixed-size segment files which are memory-mapped and
+ * filled sequentially. Each record (a key/value pair or a deletion marker)
+ * is protected by a crc32 and carries the expiration time of the key as an
+ * absolute unix time.
+ * Records are never modified, the owner of the data tells the store when a
+ * record becomes obsolete (because the key has been overwritten, removed
+ * or expired) and a background thread compacts the log by moving the records
+ * still alive out of the oldest segment and then removing it.
+ *
+ * NOTE: data is written to the page cache (through the mappings) and is never
+ *       explicitly synced, so it survives a crash of the process but not
+ *       a crash of the host. Records being written at the time of a crash are
+ *       detected (by their checksum) and dropped, together with all the records
+ *       following them in the same segment
+ */
+
+typedef struct _volatile_store_s volatile_store_t;
+
+// the location of a record in the log (0 means no location)
+typedef uint64_t volatile_store_loc_t;
+
+#define VOLATILE_STORE_SEGMENT_SIZE_DEFAULT (1<<26)
+
+/*
+ * Callback called for each record found while replaying the log.
+ * 'value' is NULL if the record marks the deletion of the key.
+ * Records are replayed by multiple threads in parallel (and so not
+ * in order), but the location of a newer record is always greater
+ * than the location of an older one.
+ * The callback must release the records it considers obsolete
+ * (deletion markers are released by the store itself)
+ */
+typedef void (*volatile_store_replay_cb_t)(volatile_store_t *store,
+                                           void *key,
+                                           size_t klen,
+                                           void *value,
+                                           size_t vlen,
+                                           time_t expire,
+                                           volatile_store_loc_t loc,
+                                           void *priv);
+
+/*
+ * Callback called by the compaction thread for each record which might still
+ * be alive. If 'old_loc' is still the current location for the key, the
+ * callback must write the record again (using volatile_store_put()) and
+ * replace the location with the new one, preventing any concurrent update
+ * of the key while doing so (otherwise the copy could end up being newer
+ * than the update). Returns 1 if the record has been moved, 0 if it's obsolete
+ * and -1 if it couldn't be written again
+ */
+typedef int (*volatile_store_relocate_cb_t)(volatile_store_t *store,
+                                            void *key,
+                                            size_t klen,
+                                            void *value,
+                                            size_t vlen,
+                                            time_t expire,
+                                            volatile_store_loc_t old_loc,
+                                            void *priv);
+
+typedef struct {
+    uint64_t segments;       // number of segments
+    uint64_t size;           // total size of the records in the log (in bytes)
+    uint64_t dead;           // size of the obsolete records (in bytes)
+    uint64_t compactions;    // number of segments compacted so far
+    uint64_t replay_records; // number of records replayed at startup
+    uint64_t replay_time;    // time spent replaying the log at startup (in milliseconds)
+    uint64_t replay_rate;    // replayed records per second
+} volatile_store_counters_t;
+
+/*
+ * Open (creating it if necessary) the log stored in the directory 'path',
+ * replay all the existing records using 'num_threads' threads and start the
+ * compaction thread. Returns NULL if the log can't be opened
+ */
+volatile_store_t *volatile_store_open(char *path,
+                                      size_t segment_size,
+                                      int num_threads,
+                                      volatile_store_replay_cb_t replay_cb,
+                                      volatile_store_relocate_cb_t relocate_cb,
+                                      void *priv);
+
+void volatile_store_close(volatile_store_t *store);
+
+// append a new value for a key,
+// returns the location of the new record or 0 on failure
+volatile_store_loc_t volatile_store_put(volatile_store_t *store,
+                                        void *key,
+                                        size_t klen,
+                                        void *value,
+                                        size_t vlen,
+                                        time_t expire);
+
+// append a deletion marker for a key
+int volatile_store_del(volatile_store_t *store, void *key, size_t klen);
+
+// mark the record at location 'loc' as obsolete
+void volatile_store_release(volatile_store_t *store, volatile_store_loc_t loc);
+
+volatile_store_counters_t *volatile_store_counters(volatile_store_t *store);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
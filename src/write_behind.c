@@ -0,0 +1,846 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <atomic_defs.h>
+#include <hashtable.h>
+#include <bsd_queue.h>
+
+#include "shardcache_log.h"
+#include "volatile_store.h"
+#include "write_behind.h"
+
+// the pending updates are partitioned by key, each partition
+// has its own lock, table and dirty list
+#define WRITE_BEHIND_SHARDS 16
+
+// time to wait before retrying a failed write,
+// doubled at each failure up to WRITE_BEHIND_RETRY_DELAY_MAX
+#define WRITE_BEHIND_RETRY_DELAY 100000      // (in microseconds)
+#define WRITE_BEHIND_RETRY_DELAY_MAX 5000000 // (in microseconds)
+
+#define WB_OP_STORE  1
+#define WB_OP_REMOVE 2
+#define WB_OP_NONE   3 // placeholder for a key already written (used only while replaying the log)
+
+typedef struct _wb_entry_s {
+    void *key;
+    size_t klen;
+    int op;
+    void *value;
+    size_t vlen;
+    uint64_t version;   // incremented at each update of the key
+    uint64_t written;   // version of the last update written to the storage
+    uint64_t seq;       // sequence number of the oldest update not written yet
+    struct timeval ts;  // when the oldest update not written yet has been queued
+    int dirty;          // the entry is in the dirty list
+    int flushing;       // the entry is being written to the storage
+    void *flush_value;  // the value being written (owned by the writer
+                        // if the entry is updated in the meanwhile)
+    int retries;              // consecutive failed writes
+    struct timeval retry_at;  // the next write can't happen before this time
+
+    volatile_store_loc_t loc; // location of the last update in the log
+    int logging;        // a record for the key is being appended to the log
+                        // (the entry can't be released until done)
+    uint64_t logged;    // version of the last update appended to the log
+    int marked;         // the key has been marked as written in the log
+    TAILQ_ENTRY(_wb_entry_s) next;
+} wb_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // broadcasted when updates have been written (or logged)
+    hashtable_t *table;
+    TAILQ_HEAD(, _wb_entry_s) dirty;
+} wb_shard_t;
+
+typedef struct {
+    wb_shard_t *shard;
+    wb_entry_t *entry;
+    int op;
+    void *value;
+    size_t vlen;
+    uint64_t version;
+    int rc;
+} wb_write_t;
+
+struct _write_behind_s {
+    shardcache_storage_t *storage;
+    wb_shard_t shards[WRITE_BEHIND_SHARDS];
+    unsigned int next_shard; // where the next round starts from
+    int count;               // number of keys with a pending update
+    int max_pending;
+    uint64_t seq;
+    int quit;
+
+    // NOTE: the lock is used only to sleep, the flushers wait on work_cond
+    //       for new updates and the writers wait on space_cond if the queue is full
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t space_cond;
+    int work;           // set when new updates have been queued
+    int idle;           // flushers waiting for work
+    int space_waiters;  // writers waiting for the queue to drain
+
+    pthread_t *threads;
+    int num_threads;
+
+    volatile_store_t *log;
+
+    write_behind_counters_t counters;
+};
+
+static inline wb_shard_t *
+wb_shard(write_behind_t *wb, void *key, size_t klen)
+{
+    uint32_t hash = 5381;
+    size_t i;
+    for (i = 0; i < klen; i++)
+        hash = ((hash << 5) + hash) + ((unsigned char *)key)[i];
+    return &wb->shards[hash % WRITE_BEHIND_SHARDS];
+}
+
+static void
+wb_notify_work(write_behind_t *wb)
+{
+    ATOMIC_SET(wb->work, 1);
+    if (ATOMIC_READ(wb->idle)) {
+        MUTEX_LOCK(wb->lock);
+        pthread_cond_signal(&wb->work_cond);
+        MUTEX_UNLOCK(wb->lock);
+    }
+}
+
+static void
+wb_entry_destroy(wb_entry_t *e)
+{
+    free(e->key);
+    free(e->value);
+    free(e);
+}
+
+// must be called with the shard lock held
+static void
+wb_entry_set(write_behind_t *wb, wb_shard_t *s, wb_entry_t *e, int op, void *value, size_t vlen)
+{
+    // the value being written by a flusher will be released by the flusher
+    if (e->value != e->flush_value)
+        free(e->value);
+    e->value = NULL;
+    e->vlen = 0;
+    if (op == WB_OP_STORE) {
+        e->value = malloc(vlen);
+        memcpy(e->value, value, vlen);
+        e->vlen = vlen;
+    }
+    e->op = op;
+    e->version++;
+
+    if (!e->dirty) {
+        if (!e->flushing) {
+            e->seq = ATOMIC_INCREASE(wb->seq, 1);
+            gettimeofday(&e->ts, NULL);
+        }
+        TAILQ_INSERT_TAIL(&s->dirty, e, next);
+        e->dirty = 1;
+    }
+}
+
+static wb_entry_t *
+wb_entry_create(write_behind_t *wb, wb_shard_t *s, void *key, size_t klen)
+{
+    wb_entry_t *e = calloc(1, sizeof(wb_entry_t));
+    e->key = malloc(klen);
+    memcpy(e->key, key, klen);
+    e->klen = klen;
+    ht_set(s->table, key, klen, e, sizeof(wb_entry_t));
+    return e;
+}
+
+// must be called with the shard lock held
+// NOTE: the entry must not be in use by anyone appending to the log
+static void
+wb_entry_remove(write_behind_t *wb, wb_shard_t *s, wb_entry_t *e)
+{
+    ht_delete(s->table, e->key, e->klen, NULL, NULL);
+    if (e->dirty)
+        TAILQ_REMOVE(&s->dirty, e, next);
+    if (e->op != WB_OP_NONE) {
+        ATOMIC_DECREMENT(wb->count);
+        ATOMIC_DECREMENT(wb->counters.pending);
+        if (ATOMIC_READ(wb->space_waiters)) {
+            MUTEX_LOCK(wb->lock);
+            pthread_cond_broadcast(&wb->space_cond);
+            MUTEX_UNLOCK(wb->lock);
+        }
+    }
+    wb_entry_destroy(e);
+}
+
+static inline int
+wb_entry_clean(wb_entry_t *e)
+{
+    return (!e->dirty && !e->flushing && e->written == e->version);
+}
+
+// bring the log up to date with the entry, appending the last update
+// (or the marker saying that the key has been written) until nothing changes.
+// Must be called with the shard lock held and e->logging set, the lock is
+// released while appending to the log. 'value' can be provided to avoid copying
+// the value of the update 'version' (if it's still the last one).
+// Returns 0 if the entry has been released, 1 otherwise
+static int
+wb_log_sync(write_behind_t *wb, wb_shard_t *s, wb_entry_t *e, void *value, size_t vlen, uint64_t version)
+{
+    for (;;) {
+        int clean = wb_entry_clean(e);
+        if (e->logged == e->version && (!clean || e->marked))
+            break;
+
+        uint64_t logging_version = e->version;
+        void *data = NULL;
+        size_t len = 0;
+        void *copy = NULL;
+        if (!clean && e->op == WB_OP_STORE) {
+            if (value && version == logging_version) {
+                data = value;
+                len = vlen;
+            } else {
+                copy = malloc(e->vlen);
+                memcpy(copy, e->value, e->vlen);
+                data = copy;
+                len = e->vlen;
+            }
+        }
+
+        // NOTE: the key of an entry never changes and the entry can't be
+        //       released while e->logging is set
+        MUTEX_UNLOCK(s->lock);
+        volatile_store_loc_t loc = 0;
+        int rc;
+        if (clean) {
+            rc = volatile_store_del(wb->log, e->key, e->klen);
+        } else {
+            // a removal is logged as an empty value
+            // (empty values can't be stored)
+            loc = volatile_store_put(wb->log, e->key, e->klen, data, len, 0);
+            rc = loc ? 0 : -1;
+        }
+        free(copy);
+        MUTEX_LOCK(s->lock);
+
+        if (rc != 0)
+            SHC_WARNING("Can't write the pending update for key %.*s to the log",
+                        (int)e->klen, (char *)e->key);
+
+        volatile_store_release(wb->log, e->loc);
+        e->loc = loc;
+        e->marked = clean;
+        e->logged = logging_version;
+        pthread_cond_broadcast(&s->cond);
+    }
+
+    e->logging = 0;
+    pthread_cond_broadcast(&s->cond);
+
+    if (wb_entry_clean(e)) {
+        wb_entry_remove(wb, s, e);
+        return 0;
+    }
+    return 1;
+}
+
+// all the updates of the entry have been written to the storage,
+// must be called with the shard lock held
+static void
+wb_entry_done(write_behind_t *wb, wb_shard_t *s, wb_entry_t *e)
+{
+    if (!wb->log) {
+        wb_entry_remove(wb, s, e);
+    } else if (!e->logging) {
+        // mark the key as written in the log before releasing the entry
+        e->logging = 1;
+        wb_log_sync(wb, s, e, NULL, 0, 0);
+    }
+    // else whoever is appending to the log will release the entry
+}
+
+// take an entry out of the dirty list to write it, must be called
+// with the shard lock held
+static void
+wb_write_begin(write_behind_t *wb, wb_shard_t *s, wb_entry_t *e, wb_write_t *w)
+{
+    TAILQ_REMOVE(&s->dirty, e, next);
+    e->dirty = 0;
+    e->flushing = 1;
+    e->flush_value = e->value;
+    w->shard = s;
+    w->entry = e;
+    w->op = e->op;
+    w->value = e->value;
+    w->vlen = e->vlen;
+    w->version = e->version;
+    w->rc = -1;
+}
+
+// called without holding the lock
+static void
+wb_write(write_behind_t *wb, wb_write_t *w)
+{
+    shardcache_storage_t *st = wb->storage;
+    wb_entry_t *e = w->entry;
+    // NOTE: the key of an entry never changes
+    if (w->op == WB_OP_STORE)
+        w->rc = st->store ? st->store(e->key, e->klen, w->value, w->vlen, 0, st->priv) : -1;
+    else
+        w->rc = st->remove ? st->remove(e->key, e->klen, st->priv) : 0;
+}
+
+// must be called with the shard lock held
+static void
+wb_write_end(write_behind_t *wb, wb_write_t *w)
+{
+    wb_shard_t *s = w->shard;
+    wb_entry_t *e = w->entry;
+    e->flushing = 0;
+    if (e->flush_value != e->value)
+        free(e->flush_value);
+    e->flush_value = NULL;
+
+    if (w->rc != 0) {
+        ATOMIC_INCREMENT(wb->counters.errors);
+        e->retries++;
+
+        if (ATOMIC_READ(wb->quit) && !e->logging) {
+            // the storage keeps failing and we are leaving, give up
+            // (the update is left in the log, if any, and will be retried
+            // the next time it's opened)
+            SHC_ERROR("Dropping the pending update for key %.*s which can't be written to the storage",
+                      (int)e->klen, (char *)e->key);
+            ATOMIC_INCREMENT(wb->counters.dropped);
+            wb_entry_remove(wb, s, e);
+            return;
+        }
+
+        if (e->retries >= WRITE_BEHIND_MAX_RETRIES && !ATOMIC_READ(wb->quit)) {
+            SHC_ERROR("Dropping the pending update for key %.*s after %d failed attempts",
+                      (int)e->klen, (char *)e->key, e->retries);
+            ATOMIC_INCREMENT(wb->counters.dropped);
+            e->retries = 0;
+            e->written = w->version;
+            if (wb_entry_clean(e))
+                wb_entry_done(wb, s, e);
+            return;
+        }
+
+        SHC_WARNING("Can't write the pending update for key %.*s to the storage, retrying",
+                    (int)e->klen, (char *)e->key);
+
+        int shift = e->retries - 1 < 6 ? e->retries - 1 : 6;
+        int delay = WRITE_BEHIND_RETRY_DELAY << shift;
+        if (delay > WRITE_BEHIND_RETRY_DELAY_MAX)
+            delay = WRITE_BEHIND_RETRY_DELAY_MAX;
+        struct timeval now, wait_time = { delay / 1000000, delay % 1000000 };
+        gettimeofday(&now, NULL);
+        timeradd(&now, &wait_time, &e->retry_at);
+
+        if (!e->dirty) {
+            TAILQ_INSERT_TAIL(&s->dirty, e, next);
+            e->dirty = 1;
+        }
+        return;
+    }
+
+    struct timeval now, lag;
+    gettimeofday(&now, NULL);
+    timersub(&now, &e->ts, &lag);
+    ATOMIC_SET(wb->counters.lag, lag.tv_sec * 1000 + lag.tv_usec / 1000);
+    ATOMIC_INCREMENT(wb->counters.flushed);
+
+    e->retries = 0;
+    timerclear(&e->retry_at);
+    e->written = w->version;
+
+    // if the key has been updated in the meanwhile
+    // the new update is already in the dirty list
+    if (wb_entry_clean(e))
+        wb_entry_done(wb, s, e);
+}
+
+// take up to 'max' entries from the dirty lists (starting from a different
+// shard at each round), 'next_retry' is set to the earliest time a failed
+// write can be retried (if any has been skipped)
+static int
+wb_collect(write_behind_t *wb, wb_write_t *writes, int max, struct timeval *next_retry)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int quit = ATOMIC_READ(wb->quit);
+
+    int n = 0;
+    unsigned int first = __sync_fetch_and_add(&wb->next_shard, 1);
+    int i;
+    for (i = 0; i < WRITE_BEHIND_SHARDS && n < max; i++) {
+        wb_shard_t *s = &wb->shards[(first + i) % WRITE_BEHIND_SHARDS];
+        MUTEX_LOCK(s->lock);
+        // keys still being written by someone else are left in the list
+        // (they will be taken once written) so that the updates of a key
+        // can't reach the storage out of order
+        wb_entry_t *e = TAILQ_FIRST(&s->dirty);
+        while (n < max && e) {
+            wb_entry_t *next = TAILQ_NEXT(e, next);
+            if (!e->flushing) {
+                if (!quit && timerisset(&e->retry_at) && timercmp(&e->retry_at, &now, >)) {
+                    if (!timerisset(next_retry) || timercmp(&e->retry_at, next_retry, <))
+                        *next_retry = e->retry_at;
+                } else {
+                    wb_write_begin(wb, s, e, &writes[n++]);
+                }
+            }
+            e = next;
+        }
+        MUTEX_UNLOCK(s->lock);
+    }
+    return n;
+}
+
+static void *
+wb_flusher(void *priv)
+{
+    write_behind_t *wb = (write_behind_t *)priv;
+    wb_write_t writes[WRITE_BEHIND_BATCH_SIZE];
+
+    if (wb->storage->thread_start)
+        wb->storage->thread_start(wb->storage->priv);
+
+    for (;;) {
+        ATOMIC_SET(wb->work, 0);
+
+        struct timeval next_retry = { 0, 0 };
+        int n = wb_collect(wb, writes, WRITE_BEHIND_BATCH_SIZE, &next_retry);
+
+        if (!n) {
+            // all the pending updates have been taken before leaving
+            if (ATOMIC_READ(wb->quit))
+                break;
+
+            MUTEX_LOCK(wb->lock);
+            ATOMIC_INCREMENT(wb->idle);
+            if (!ATOMIC_READ(wb->work) && !ATOMIC_READ(wb->quit)) {
+                if (timerisset(&next_retry)) {
+                    struct timespec abstime = { next_retry.tv_sec, next_retry.tv_usec * 1000 };
+                    pthread_cond_timedwait(&wb->work_cond, &wb->lock, &abstime);
+                } else {
+                    pthread_cond_wait(&wb->work_cond, &wb->lock);
+                }
+            }
+            ATOMIC_DECREMENT(wb->idle);
+            MUTEX_UNLOCK(wb->lock);
+            continue;
+        }
+
+        int i;
+        for (i = 0; i < n; i++)
+            wb_write(wb, &writes[i]);
+
+        for (i = 0; i < n; i++) {
+            wb_shard_t *s = writes[i].shard;
+            MUTEX_LOCK(s->lock);
+            wb_write_end(wb, &writes[i]);
+            pthread_cond_broadcast(&s->cond);
+            MUTEX_UNLOCK(s->lock);
+        }
+        ATOMIC_INCREMENT(wb->counters.batches);
+    }
+
+    if (wb->storage->thread_exit)
+        wb->storage->thread_exit(wb->storage->priv);
+
+    return NULL;
+}
+
+static int
+wb_update(write_behind_t *wb, void *key, size_t klen, int op, void *value, size_t vlen)
+{
+    wb_shard_t *s = wb_shard(wb, key, klen);
+
+    MUTEX_LOCK(s->lock);
+    wb_entry_t *e = ht_get(s->table, key, klen, NULL);
+    while (!e && ATOMIC_READ(wb->count) >= wb->max_pending && !ATOMIC_READ(wb->quit)) {
+        // the queue is full, wait for the flushers to catch up
+        MUTEX_UNLOCK(s->lock);
+        MUTEX_LOCK(wb->lock);
+        ATOMIC_INCREMENT(wb->space_waiters);
+        if (ATOMIC_READ(wb->count) >= wb->max_pending && !ATOMIC_READ(wb->quit))
+            pthread_cond_wait(&wb->space_cond, &wb->lock);
+        ATOMIC_DECREMENT(wb->space_waiters);
+        MUTEX_UNLOCK(wb->lock);
+        MUTEX_LOCK(s->lock);
+        e = ht_get(s->table, key, klen, NULL);
+    }
+
+    if (ATOMIC_READ(wb->quit)) {
+        MUTEX_UNLOCK(s->lock);
+        return -1;
+    }
+
+    if (e) {
+        if (e->dirty)
+            ATOMIC_INCREMENT(wb->counters.coalesced);
+    } else {
+        e = wb_entry_create(wb, s, key, klen);
+        ATOMIC_INCREMENT(wb->count);
+        ATOMIC_INCREMENT(wb->counters.pending);
+    }
+
+    wb_entry_set(wb, s, e, op, value, vlen);
+
+    if (wb->log) {
+        uint64_t version = e->version;
+        if (!e->logging) {
+            // the lock is released while appending the update to the log
+            e->logging = 1;
+            wb_log_sync(wb, s, e, value, vlen, version);
+        } else {
+            // someone else is appending a previous update of the key,
+            // it will append this one as well once done
+            // (appends of the same key must happen in order)
+            while ((e = ht_get(s->table, key, klen, NULL)) && e->logging && e->logged < version)
+                pthread_cond_wait(&s->cond, &s->lock);
+        }
+    }
+
+    MUTEX_UNLOCK(s->lock);
+
+    wb_notify_work(wb);
+    return 0;
+}
+
+int
+write_behind_store(write_behind_t *wb, void *key, size_t klen, void *value, size_t vlen)
+{
+    if (!vlen)
+        return -1;
+    return wb_update(wb, key, klen, WB_OP_STORE, value, vlen);
+}
+
+int
+write_behind_remove(write_behind_t *wb, void *key, size_t klen)
+{
+    return wb_update(wb, key, klen, WB_OP_REMOVE, NULL, 0);
+}
+
+int
+write_behind_lookup(write_behind_t *wb, void *key, size_t klen, void **value, size_t *vlen)
+{
+    int rc = -1;
+    wb_shard_t *s = wb_shard(wb, key, klen);
+    MUTEX_LOCK(s->lock);
+    wb_entry_t *e = ht_get(s->table, key, klen, NULL);
+    if (e && e->written != e->version && e->op == WB_OP_STORE) {
+        if (value) {
+            *value = malloc(e->vlen);
+            memcpy(*value, e->value, e->vlen);
+        }
+        if (vlen)
+            *vlen = e->vlen;
+        rc = 1;
+    } else if (e && e->written != e->version && e->op == WB_OP_REMOVE) {
+        rc = 0;
+    }
+    MUTEX_UNLOCK(s->lock);
+    return rc;
+}
+
+int
+write_behind_flush_key(write_behind_t *wb, void *key, size_t klen)
+{
+    int rc = 0;
+    wb_shard_t *s = wb_shard(wb, key, klen);
+    MUTEX_LOCK(s->lock);
+    wb_entry_t *e;
+    while ((e = ht_get(s->table, key, klen, NULL)) && e->op != WB_OP_NONE && e->written != e->version) {
+        if (e->flushing) {
+            // a flusher is writing it, wait for it to complete
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        // write it by ourselves instead of waiting for our turn
+        // (or for the next retry if the last write failed)
+        wb_write_t w;
+        wb_write_begin(wb, s, e, &w);
+        MUTEX_UNLOCK(s->lock);
+        wb_write(wb, &w);
+        MUTEX_LOCK(s->lock);
+        wb_write_end(wb, &w);
+        pthread_cond_broadcast(&s->cond);
+        if (w.rc != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    MUTEX_UNLOCK(s->lock);
+    return rc;
+}
+
+typedef struct {
+    uint64_t seq;
+    int found;
+} wb_flush_arg_t;
+
+static int
+wb_find_older_cb(hashtable_t *table, void *value, size_t vlen, void *user)
+{
+    wb_entry_t *e = (wb_entry_t *)value;
+    wb_flush_arg_t *arg = (wb_flush_arg_t *)user;
+    if (e->op != WB_OP_NONE && e->written != e->version && e->seq <= arg->seq) {
+        arg->found = 1;
+        return 0;
+    }
+    return 1;
+}
+
+void
+write_behind_flush(write_behind_t *wb)
+{
+    wb_flush_arg_t arg = { ATOMIC_READ(wb->seq), 0 };
+    int i;
+    for (i = 0; i < WRITE_BEHIND_SHARDS; i++) {
+        wb_shard_t *s = &wb->shards[i];
+        MUTEX_LOCK(s->lock);
+        for (;;) {
+            arg.found = 0;
+            ht_foreach_value(s->table, wb_find_older_cb, &arg);
+            if (!arg.found || ATOMIC_READ(wb->quit))
+                break;
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        MUTEX_UNLOCK(s->lock);
+    }
+}
+
+static void
+wb_replay_cb(volatile_store_t *log,
+             void *key,
+             size_t klen,
+             void *value,
+             size_t vlen,
+             time_t expire,
+             volatile_store_loc_t loc,
+             void *priv)
+{
+    write_behind_t *wb = (write_behind_t *)priv;
+    wb_shard_t *s = wb_shard(wb, key, klen);
+
+    MUTEX_LOCK(s->lock);
+    wb_entry_t *e = ht_get(s->table, key, klen, NULL);
+    if (e && e->loc > loc) {
+        // we already know about a newer update
+        if (value)
+            volatile_store_release(log, loc);
+        MUTEX_UNLOCK(s->lock);
+        return;
+    }
+
+    if (!e) {
+        e = wb_entry_create(wb, s, key, klen);
+        e->op = WB_OP_NONE;
+    } else if (e->op != WB_OP_NONE) {
+        volatile_store_release(log, e->loc);
+    }
+
+    int op = !value ? WB_OP_NONE : (vlen ? WB_OP_STORE : WB_OP_REMOVE);
+    if (e->op == WB_OP_NONE && op != WB_OP_NONE) {
+        ATOMIC_INCREMENT(wb->count);
+        ATOMIC_INCREMENT(wb->counters.pending);
+    } else if (e->op != WB_OP_NONE && op == WB_OP_NONE) {
+        ATOMIC_DECREMENT(wb->count);
+        ATOMIC_DECREMENT(wb->counters.pending);
+    }
+
+    if (op == WB_OP_NONE) {
+        // the key has been already written to the storage,
+        // keep a placeholder until the replay is complete
+        free(e->value);
+        e->value = NULL;
+        e->vlen = 0;
+        e->op = WB_OP_NONE;
+        if (e->dirty) {
+            TAILQ_REMOVE(&s->dirty, e, next);
+            e->dirty = 0;
+        }
+    } else {
+        wb_entry_set(wb, s, e, op, value, vlen);
+        e->logged = e->version;
+    }
+    e->loc = loc;
+    MUTEX_UNLOCK(s->lock);
+}
+
+static int
+wb_relocate_cb(volatile_store_t *log,
+               void *key,
+               size_t klen,
+               void *value,
+               size_t vlen,
+               time_t expire,
+               volatile_store_loc_t old_loc,
+               void *priv)
+{
+    write_behind_t *wb = (write_behind_t *)priv;
+    wb_shard_t *s = wb_shard(wb, key, klen);
+    int rc = 0;
+
+    MUTEX_LOCK(s->lock);
+    // a newer update of the key might be being appended, the copy
+    // must not end up after it in the log
+    wb_entry_t *e;
+    while ((e = ht_get(s->table, key, klen, NULL)) && e->logging)
+        pthread_cond_wait(&s->cond, &s->lock);
+    if (e && e->loc == old_loc) {
+        volatile_store_loc_t loc = volatile_store_put(log, key, klen, value, vlen, 0);
+        if (loc) {
+            e->loc = loc;
+            volatile_store_release(log, old_loc);
+            rc = 1;
+        } else {
+            rc = -1;
+        }
+    }
+    MUTEX_UNLOCK(s->lock);
+    return rc;
+}
+
+static int
+wb_drop_placeholders_cb(hashtable_t *table, void *value, size_t vlen, void *user)
+{
+    wb_entry_t *e = (wb_entry_t *)value;
+    if (e->op == WB_OP_NONE) {
+        // remove the entry from the table (which has no free callback)
+        wb_entry_destroy(e);
+        return -1;
+    }
+    return 1;
+}
+
+write_behind_t *
+write_behind_create(shardcache_storage_t *storage,
+                    int num_threads,
+                    int max_pending,
+                    char *path)
+{
+    if (num_threads <= 0 || max_pending <= 0)
+        return NULL;
+
+    write_behind_t *wb = calloc(1, sizeof(write_behind_t));
+    wb->storage = storage;
+    wb->max_pending = max_pending;
+    int i;
+    for (i = 0; i < WRITE_BEHIND_SHARDS; i++) {
+        wb_shard_t *s = &wb->shards[i];
+        s->table = ht_create(1<<8, (max_pending / WRITE_BEHIND_SHARDS + 1) * 2, NULL);
+        TAILQ_INIT(&s->dirty);
+        MUTEX_INIT(s->lock);
+        pthread_cond_init(&s->cond, NULL);
+    }
+    MUTEX_INIT(wb->lock);
+    pthread_cond_init(&wb->work_cond, NULL);
+    pthread_cond_init(&wb->space_cond, NULL);
+
+    if (path) {
+        wb->log = volatile_store_open(path,
+                                      0,
+                                      num_threads,
+                                      wb_replay_cb,
+                                      wb_relocate_cb,
+                                      wb);
+        if (!wb->log) {
+            SHC_ERROR("Can't open the write-behind log in %s", path);
+            write_behind_destroy(wb);
+            return NULL;
+        }
+
+        // the placeholders for the keys already written are not needed anymore
+        // NOTE: the compaction thread is already running
+        for (i = 0; i < WRITE_BEHIND_SHARDS; i++) {
+            MUTEX_LOCK(wb->shards[i].lock);
+            ht_foreach_value(wb->shards[i].table, wb_drop_placeholders_cb, NULL);
+            MUTEX_UNLOCK(wb->shards[i].lock);
+        }
+
+        if (wb->count)
+            SHC_NOTICE("Found %d pending updates in the write-behind log", wb->count);
+    }
+
+    wb->threads = calloc(num_threads, sizeof(pthread_t));
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&wb->threads[i], NULL, wb_flusher, wb) != 0) {
+            SHC_ERROR("Can't create the write-behind thread: %s", strerror(errno));
+            write_behind_destroy(wb);
+            return NULL;
+        }
+        wb->num_threads++;
+    }
+
+    return wb;
+}
+
+void
+write_behind_destroy(write_behind_t *wb)
+{
+    MUTEX_LOCK(wb->lock);
+    ATOMIC_SET(wb->quit, 1);
+    pthread_cond_broadcast(&wb->work_cond);
+    pthread_cond_broadcast(&wb->space_cond);
+    MUTEX_UNLOCK(wb->lock);
+
+    int i;
+    for (i = 0; i < WRITE_BEHIND_SHARDS; i++) {
+        MUTEX_LOCK(wb->shards[i].lock);
+        pthread_cond_broadcast(&wb->shards[i].cond);
+        MUTEX_UNLOCK(wb->shards[i].lock);
+    }
+
+    for (i = 0; i < wb->num_threads; i++)
+        pthread_join(wb->threads[i], NULL);
+    free(wb->threads);
+
+    // if no thread could be started the updates are still in the log (if any)
+    for (i = 0; i < WRITE_BEHIND_SHARDS; i++) {
+        wb_shard_t *s = &wb->shards[i];
+        wb_entry_t *e;
+        while ((e = TAILQ_FIRST(&s->dirty))) {
+            TAILQ_REMOVE(&s->dirty, e, next);
+            e->dirty = 0;
+        }
+    }
+
+    // NOTE: the compaction thread accesses the tables
+    if (wb->log)
+        volatile_store_close(wb->log);
+
+    for (i = 0; i < WRITE_BEHIND_SHARDS; i++) {
+        wb_shard_t *s = &wb->shards[i];
+        ht_set_free_item_callback(s->table, (ht_free_item_callback_t)wb_entry_destroy);
+        ht_destroy(s->table);
+        pthread_cond_destroy(&s->cond);
+        MUTEX_DESTROY(s->lock);
+    }
+
+    pthread_cond_destroy(&wb->work_cond);
+    pthread_cond_destroy(&wb->space_cond);
+    MUTEX_DESTROY(wb->lock);
+    free(wb);
+}
+
+write_behind_counters_t *
+write_behind_counters(write_behind_t *wb)
+{
+    return &wb->counters;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,94 @@
+#ifndef SHARDCACHE_WRITE_BEHIND_H
+#define SHARDCACHE_WRITE_BEHIND_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <shardcache.h>
+
+/*
+ * Write-behind queue for the persistent storage.
+ *
+ * Updates (stores and removals) are acknowledged as soon as they are queued
+ * and written to the storage later by a set of background threads, which
+ * take all the keys queued so far at each round (so the slower the storage,
+ * the bigger the groups being written).
+ * Pending updates are partitioned by key, so writers and flushers working
+ * on different keys don't contend for the same lock, and the log records
+ * are appended without holding it.
+ * Updates of a key still waiting to be written are coalesced, only the last
+ * one will reach the storage. Pending updates can be looked up so that readers
+ * can see their own writes before they reach the storage.
+ *
+ * If a path is provided, the queue is backed by an append-only log
+ * (see volatile_store.h) which is replayed at startup, so pending updates
+ * survive a crash of the process (but not a crash of the host).
+ *
+ * Failed writes are retried with an exponential backoff, after
+ * WRITE_BEHIND_MAX_RETRIES consecutive failures the update is dropped
+ * (and accounted in the 'dropped' counter).
+ *
+ * NOTE: the storage callbacks are called by the background threads only
+ *       (or by a thread calling write_behind_flush_key()), the caller
+ *       must flush the pending updates of a key before accessing it
+ *       directly on the storage (for instance for CAS or increments)
+ */
+
+typedef struct _write_behind_s write_behind_t;
+
+#define WRITE_BEHIND_BATCH_SIZE 128 // max number of keys written by a thread at each round
+#define WRITE_BEHIND_MAX_RETRIES 10 // failed writes of an update before giving up
+
+typedef struct {
+    uint64_t pending;   // keys waiting to be written to the storage
+    uint64_t coalesced; // updates merged into a pending update of the same key
+    uint64_t flushed;   // updates written to the storage
+    uint64_t batches;   // rounds of updates written to the storage
+    uint64_t errors;    // failed writes (retried after a while)
+    uint64_t dropped;   // updates given up after too many failed writes
+    uint64_t lag;       // time (in milliseconds) the last written update
+                        // has been waiting in the queue
+} write_behind_counters_t;
+
+/*
+ * Create a write-behind queue for 'storage' served by 'num_threads' threads
+ * and holding up to 'max_pending' keys (writers block if the queue is full).
+ * If 'path' is not NULL, the queue is backed by the log in the directory 'path'
+ * and the updates found in it are queued again.
+ * Returns NULL on failure
+ */
+write_behind_t *write_behind_create(shardcache_storage_t *storage,
+                                    int num_threads,
+                                    int max_pending,
+                                    char *path);
+
+// NOTE: all the pending updates are written to the storage before returning
+void write_behind_destroy(write_behind_t *wb);
+
+// queue a new value for a key, returns 0 on success and -1 otherwise
+int write_behind_store(write_behind_t *wb, void *key, size_t klen, void *value, size_t vlen);
+
+// queue the removal of a key, returns 0 on success and -1 otherwise
+int write_behind_remove(write_behind_t *wb, void *key, size_t klen);
+
+/*
+ * Look up the pending update for a key.
+ * Returns 1 if a value is waiting to be stored (a copy is returned in 'value'
+ * and must be released by the caller), 0 if the key is waiting to be removed
+ * and -1 if there is no pending update for the key
+ */
+int write_behind_lookup(write_behind_t *wb, void *key, size_t klen, void **value, size_t *vlen);
+
+// write the pending update of a key (if any) to the storage and return
+// only once it has been written. Returns 0 on success and -1 if the
+// update couldn't be written (it's left in the queue to be retried)
+int write_behind_flush_key(write_behind_t *wb, void *key, size_t klen);
+
+// return only once all the updates queued so far have been written
+void write_behind_flush(write_behind_t *wb);
+
+write_behind_counters_t *write_behind_counters(write_behind_t *wb);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,441 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <shardcache.h>
+
+/*
+ * In-memory storage module.
+ *
+ * Keys are spread over a number of independent shards (each one being
+ * a chained hashtable protected by its own read-write lock), so that
+ * concurrent readers never contend and concurrent writers contend only
+ * if they hit the same shard.
+ *
+ * Options:
+ *   shards       : the number of shards (defaults to 64)
+ *   initial_size : the initial number of buckets in each shard (defaults to 1024),
+ *                  shards grow automatically when needed
+ */
+
+#define ST_MEM_SHARDS_DEFAULT       64
+#define ST_MEM_INITIAL_SIZE_DEFAULT 1024
+
+int storage_version = SHARDCACHE_STORAGE_API_VERSION;
+
+typedef struct _st_mem_item_s {
+    uint64_t hash;
+    size_t klen;
+    size_t vlen;
+    struct _st_mem_item_s *next;
+    char data[]; // the key followed by the value
+} st_mem_item_t;
+
+typedef struct {
+    pthread_rwlock_t lock;
+    st_mem_item_t **buckets;
+    size_t size;
+    size_t count;
+} st_mem_shard_t;
+
+typedef struct {
+    st_mem_shard_t *shards;
+    int num_shards;
+} st_mem_t;
+
+static inline uint64_t
+st_mem_hash(void *key, size_t klen)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < klen; i++) {
+        hash ^= ((unsigned char *)key)[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static inline st_mem_shard_t *
+st_mem_shard(st_mem_t *st, uint64_t hash)
+{
+    // the low bits select the bucket, use the high ones for the shard
+    return &st->shards[(hash >> 32) % st->num_shards];
+}
+
+// must be called with the shard lock held
+static st_mem_item_t **
+st_mem_lookup(st_mem_shard_t *shard, void *key, size_t klen, uint64_t hash)
+{
+    st_mem_item_t **item = &shard->buckets[hash & (shard->size - 1)];
+    while (*item) {
+        if ((*item)->hash == hash && (*item)->klen == klen && memcmp((*item)->data, key, klen) == 0)
+            break;
+        item = &(*item)->next;
+    }
+    return item;
+}
+
+static void
+st_mem_grow(st_mem_shard_t *shard)
+{
+    size_t size = shard->size * 2;
+    st_mem_item_t **buckets = calloc(size, sizeof(st_mem_item_t *));
+    size_t i;
+    for (i = 0; i < shard->size; i++) {
+        st_mem_item_t *item = shard->buckets[i];
+        while (item) {
+            st_mem_item_t *next = item->next;
+            item->next = buckets[item->hash & (size - 1)];
+            buckets[item->hash & (size - 1)] = item;
+            item = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->size = size;
+}
+
+static st_mem_item_t *
+st_mem_item_create(void *key, size_t klen, void *value, size_t vlen, uint64_t hash)
+{
+    st_mem_item_t *item = malloc(sizeof(st_mem_item_t) + klen + vlen);
+    item->hash = hash;
+    item->klen = klen;
+    item->vlen = vlen;
+    item->next = NULL;
+    memcpy(item->data, key, klen);
+    memcpy(item->data + klen, value, vlen);
+    return item;
+}
+
+// replace (or add) the item pointed by 'slot', must be called with
+// the shard lock held for writing
+static void
+st_mem_replace(st_mem_shard_t *shard, st_mem_item_t **slot, st_mem_item_t *item)
+{
+    if (*slot) {
+        item->next = (*slot)->next;
+        free(*slot);
+        *slot = item;
+    } else {
+        *slot = item;
+        if (++shard->count > shard->size)
+            st_mem_grow(shard);
+    }
+}
+
+static int
+st_fetch(void *key, size_t klen, void **value, size_t *vlen, void *priv)
+{
+    st_mem_t *st = (st_mem_t *)priv;
+    uint64_t hash = st_mem_hash(key, klen);
+    st_mem_shard_t *shard = st_mem_shard(st, hash);
+
+    void *v = NULL;
+    size_t len = 0;
+    pthread_rwlock_rdlock(&shard->lock);
+    st_mem_item_t *item = *st_mem_lookup(shard, key, klen, hash);
+    if (item) {
+        len = item->vlen;
+        v = malloc(len);
+        memcpy(v, item->data + item->klen, len);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    *value = v;
+    if (vlen)
+        *vlen = len;
+    return 0;
+}
+
+static int
+st_fetch_multi(void **keys, size_t *klens, int nkeys, void **values, size_t *vlens, void *priv)
+{
+    int i;
+    for (i = 0; i < nkeys; i++)
+        st_fetch(keys[i], klens[i], &values[i], &vlens[i], priv);
+    return 0;
+}
+
+static int
+st_store(void *key, size_t klen, void *value, size_t vlen, int if_not_exists, void *priv)
+{
+    st_mem_t *st = (st_mem_t *)priv;
+    uint64_t hash = st_mem_hash(key, klen);
+    st_mem_shard_t *shard = st_mem_shard(st, hash);
+
+    // allocate and copy out of the lock
+    st_mem_item_t *item = st_mem_item_create(key, klen, value, vlen, hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    st_mem_item_t **slot = st_mem_lookup(shard, key, klen, hash);
+    if (*slot && if_not_exists) {
+        pthread_rwlock_unlock(&shard->lock);
+        free(item);
+        return 1;
+    }
+    st_mem_replace(shard, slot, item);
+    pthread_rwlock_unlock(&shard->lock);
+    return 0;
+}
+
+static int
+st_cas(void *key, size_t klen, void *old_value, size_t old_len, void *new_value, size_t new_len, void *priv)
+{
+    st_mem_t *st = (st_mem_t *)priv;
+    uint64_t hash = st_mem_hash(key, klen);
+    st_mem_shard_t *shard = st_mem_shard(st, hash);
+
+    st_mem_item_t *item = st_mem_item_create(key, klen, new_value, new_len, hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    st_mem_item_t **slot = st_mem_lookup(shard, key, klen, hash);
+    if (!*slot || (*slot)->vlen != old_len || memcmp((*slot)->data + klen, old_value, old_len) != 0) {
+        pthread_rwlock_unlock(&shard->lock);
+        free(item);
+        return 1;
+    }
+    st_mem_replace(shard, slot, item);
+    pthread_rwlock_unlock(&shard->lock);
+    return 0;
+}
+
+static int
+st_remove(void *key, size_t klen, void *priv)
+{
+    st_mem_t *st = (st_mem_t *)priv;
+    uint64_t hash = st_mem_hash(key, klen);
+    st_mem_shard_t *shard = st_mem_shard(st, hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    st_mem_item_t **slot = st_mem_lookup(shard, key, klen, hash);
+    st_mem_item_t *item = *slot;
+    if (item) {
+        *slot = item->next;
+        shard->count--;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    free(item);
+    return 0;
+}
+
+static int
+st_exist(void *key, size_t klen, void *priv)
+{
+    st_mem_t *st = (st_mem_t *)priv;
+    uint64_t hash = st_mem_hash(key, klen);
+    st_mem_shard_t *shard = st_mem_shard(st, hash);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    int exists = (*st_mem_lookup(shard, key, klen, hash) != NULL);
+    pthread_rwlock_unlock(&shard->lock);
+    return exists;
+}
+
+static size_t
+st_count(void *priv)
+{
+    st_mem_t *st = (st_mem_t *)priv;
+    size_t count = 0;
+    int i;
+    for (i = 0; i < st->num_shards; i++) {
+        pthread_rwlock_rdlock(&st->shards[i].lock);
+        count += st->shards[i].count;
+        pthread_rwlock_unlock(&st->shards[i].lock);
+    }
+    return count;
+}
+
+static size_t
+st_index(shardcache_storage_index_item_t *index, size_t isize, void *priv)
+{
+    st_mem_t *st = (st_mem_t *)priv;
+    size_t n = 0;
+    int i;
+    for (i = 0; i < st->num_shards && n < isize; i++) {
+        st_mem_shard_t *shard = &st->shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        size_t b;
+        for (b = 0; b < shard->size && n < isize; b++) {
+            st_mem_item_t *item = shard->buckets[b];
+            while (item && n < isize) {
+                index[n].key = malloc(item->klen);
+                memcpy(index[n].key, item->data, item->klen);
+                index[n].klen = item->klen;
+                index[n].vlen = item->vlen;
+                n++;
+                item = item->next;
+            }
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    return n;
+}
+
+// the cursor is made of the shard (16 bits), the bucket in the shard (32 bits)
+// and the number of items of the bucket already returned (16 bits).
+// Buckets are returned as a whole unless a bucket doesn't fit in the index array
+// at all. Since shards only grow (doubling the buckets) and the buckets are
+// scanned in order, keys can be returned twice if a shard grows during the scan,
+// but they are never missed
+static size_t
+st_scan_index(uint64_t *cursor, shardcache_storage_index_item_t *index, size_t isize, void *priv)
+{
+    st_mem_t *st = (st_mem_t *)priv;
+    int s = *cursor >> 48;
+    size_t b = (*cursor >> 16) & 0xFFFFFFFF;
+    int skip = *cursor & 0xFFFF;
+    size_t n = 0;
+
+    while (s < st->num_shards && n < isize) {
+        st_mem_shard_t *shard = &st->shards[s];
+        pthread_rwlock_rdlock(&shard->lock);
+        while (b < shard->size && n < isize) {
+            st_mem_item_t *item = shard->buckets[b];
+            int i = 0;
+            while (item && i < skip) {
+                item = item->next;
+                i++;
+            }
+            st_mem_item_t *first = item;
+            size_t len = 0;
+            while (item) {
+                item = item->next;
+                len++;
+            }
+            if (n && n + len > isize)
+                break;
+            item = first;
+            while (item && n < isize) {
+                index[n].key = malloc(item->klen);
+                memcpy(index[n].key, item->data, item->klen);
+                index[n].klen = item->klen;
+                index[n].vlen = item->vlen;
+                n++;
+                i++;
+                item = item->next;
+            }
+            if (item) {
+                // the bucket didn't fit
+                skip = i;
+                break;
+            }
+            skip = 0;
+            b++;
+        }
+        int done = (b >= shard->size);
+        pthread_rwlock_unlock(&shard->lock);
+        if (!done)
+            break;
+        s++;
+        b = 0;
+    }
+
+    *cursor = (s < st->num_shards) ? ((uint64_t)s << 48) | ((uint64_t)b << 16) | skip : 0;
+    return n;
+}
+
+static void
+st_mem_clear(st_mem_t *st)
+{
+    int i;
+    for (i = 0; i < st->num_shards; i++) {
+        st_mem_shard_t *shard = &st->shards[i];
+        pthread_rwlock_wrlock(&shard->lock);
+        size_t b;
+        for (b = 0; b < shard->size; b++) {
+            st_mem_item_t *item = shard->buckets[b];
+            while (item) {
+                st_mem_item_t *next = item->next;
+                free(item);
+                item = next;
+            }
+            shard->buckets[b] = NULL;
+        }
+        shard->count = 0;
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+int
+storage_init(shardcache_storage_t *storage, char **options)
+{
+    int num_shards = ST_MEM_SHARDS_DEFAULT;
+    size_t initial_size = ST_MEM_INITIAL_SIZE_DEFAULT;
+
+    // options come as a NULL-terminated list of name/value pairs
+    if (options) {
+        while (options[0] && options[1]) {
+            char *name = *options++;
+            char *value = *options++;
+            if (strcasecmp(name, "shards") == 0) {
+                num_shards = strtol(value, NULL, 10);
+            } else if (strcasecmp(name, "initial_size") == 0) {
+                initial_size = strtol(value, NULL, 10);
+            } else {
+                SHC_ERROR("Unknown option name %s", name);
+                return -1;
+            }
+        }
+    }
+
+    if (num_shards <= 0 || num_shards > 0xFFFF || initial_size <= 0) {
+        SHC_ERROR("Invalid options for the mem storage");
+        return -1;
+    }
+
+    // the number of buckets must be a power of two
+    size_t size = 1;
+    while (size < initial_size)
+        size <<= 1;
+
+    st_mem_t *st = calloc(1, sizeof(st_mem_t));
+    st->num_shards = num_shards;
+    st->shards = calloc(num_shards, sizeof(st_mem_shard_t));
+    int i;
+    for (i = 0; i < num_shards; i++) {
+        pthread_rwlock_init(&st->shards[i].lock, NULL);
+        st->shards[i].size = size;
+        st->shards[i].buckets = calloc(size, sizeof(st_mem_item_t *));
+    }
+
+    storage->fetch       = st_fetch;
+    storage->fetch_multi = st_fetch_multi;
+    storage->store       = st_store;
+    storage->cas         = st_cas;
+    storage->remove      = st_remove;
+    storage->exist       = st_exist;
+    storage->count       = st_count;
+    storage->index       = st_index;
+    storage->scan_index  = st_scan_index;
+    storage->priv        = st;
+
+    return 0;
+}
+
+int
+storage_reset(char **options, void *priv)
+{
+    st_mem_clear((st_mem_t *)priv);
+    return 0;
+}
+
+void
+storage_destroy(void *priv)
+{
+    st_mem_t *st = (st_mem_t *)priv;
+    st_mem_clear(st);
+    int i;
+    for (i = 0; i < st->num_shards; i++) {
+        pthread_rwlock_destroy(&st->shards[i].lock);
+        free(st->shards[i].buckets);
+    }
+    free(st->shards);
+    free(st);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,766 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <shardcache.h>
+
+/*
+ * Memory-mapped file storage module.
+ *
+ * Data lives in two memory-mapped files in the directory given
+ * by the 'path' option:
+ *   - 'data'  : an append-only file holding the records (key and value)
+ *   - 'index' : an open-addressing hash index (linear probing) mapping
+ *               the hash of each key to the offset of its last record
+ *
+ * Lookups hit only the mappings (no system calls), updates append a new
+ * record and then switch the index slot to it.
+ * When the data file is full and at least half of it is obsolete, or when
+ * the index gets too crowded, both files are rebuilt with only the live
+ * records (and, if needed, a bigger index).
+ * Readers run concurrently, updates are serialized. The live records are
+ * copied to the new files while the readers keep using the old ones, which
+ * are blocked only while switching to the new mappings.
+ * Files are grown with posix_fallocate() so that running out of disk space
+ * is reported as an error instead of a SIGBUS when touching the mapping.
+ *
+ * NOTE: Data is written to the page cache (through the mappings) and is never
+ *       explicitly synced (but while rebuilding the files), so it survives
+ *       a crash of the process but not a crash of the host.
+ *
+ * Options:
+ *   path        : the directory where the files are stored (mandatory)
+ *   index_slots : the initial number of slots in the index (defaults to 1048576)
+ *   data_size   : the initial size of the data file (defaults to 64MB)
+ */
+
+#define ST_MMAP_INDEX_SLOTS_DEFAULT (1<<20)
+#define ST_MMAP_DATA_SIZE_DEFAULT   (1<<26)
+
+#define ST_MMAP_INDEX_MAGIC 0x53484349 // SHCI
+#define ST_MMAP_DATA_MAGIC  0x53484344 // SHCD
+#define ST_MMAP_VERSION     1
+
+#define ST_MMAP_HDR_SIZE 64 // space reserved for the file headers
+
+#define ST_MMAP_TOMBSTONE UINT64_MAX
+
+#define ST_MMAP_ALIGN(_s) (((_s) + 7) & ~((size_t)7))
+
+int storage_version = SHARDCACHE_STORAGE_API_VERSION;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation; // must match the generation of the data file
+    uint64_t num_slots;  // always a power of two
+    uint64_t count;      // live keys
+    uint64_t tombstones; // slots of removed keys
+} st_mmap_index_hdr_t;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t offset; // 0 if the slot is empty
+} st_mmap_slot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;
+    uint64_t used; // end of the last record
+    uint64_t dead; // size of the obsolete records
+} st_mmap_data_hdr_t;
+
+typedef struct {
+    uint32_t klen;
+    uint32_t vlen;
+    // followed by the key and the value
+} st_mmap_record_t;
+
+typedef struct {
+    int fd;
+    char *map;
+    size_t size;
+} st_mmap_file_t;
+
+typedef struct {
+    char *path;
+    pthread_rwlock_t lock;  // held for writing only while changing the mappings
+    pthread_mutex_t write_lock; // serializes the updates (and the rebuilds)
+    st_mmap_file_t index;
+    st_mmap_file_t data;
+    size_t initial_data_size;
+} st_mmap_t;
+
+#define ST_MMAP_INDEX_HDR(_st) ((st_mmap_index_hdr_t *)(_st)->index.map)
+#define ST_MMAP_SLOTS(_st) ((st_mmap_slot_t *)((_st)->index.map + ST_MMAP_HDR_SIZE))
+#define ST_MMAP_DATA_HDR(_st) ((st_mmap_data_hdr_t *)(_st)->data.map)
+
+static inline uint64_t
+st_mmap_hash(void *key, size_t klen)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < klen; i++) {
+        hash ^= ((unsigned char *)key)[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void
+st_mmap_file_close(st_mmap_file_t *file)
+{
+    if (file->map)
+        munmap(file->map, file->size);
+    if (file->fd >= 0)
+        close(file->fd);
+    file->map = NULL;
+    file->fd = -1;
+}
+
+// open (creating it if needed) and map a file of at least 'size' bytes
+static int
+st_mmap_file_open(char *fname, size_t size, st_mmap_file_t *file)
+{
+    file->map = NULL;
+    file->fd = open(fname, O_RDWR|O_CREAT, 0644);
+    if (file->fd < 0) {
+        SHC_ERROR("Can't open %s: %s", fname, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(file->fd, &st) != 0) {
+        SHC_ERROR("Can't stat %s: %s", fname, strerror(errno));
+        st_mmap_file_close(file);
+        return -1;
+    }
+
+    file->size = st.st_size;
+    if (file->size < size) {
+        int rc = posix_fallocate(file->fd, file->size, size - file->size);
+        if (rc != 0) {
+            SHC_ERROR("Can't resize %s: %s", fname, strerror(rc));
+            st_mmap_file_close(file);
+            return -1;
+        }
+        file->size = size;
+    }
+
+    file->map = mmap(NULL, file->size, PROT_READ|PROT_WRITE, MAP_SHARED, file->fd, 0);
+    if (file->map == MAP_FAILED) {
+        SHC_ERROR("Can't map %s: %s", fname, strerror(errno));
+        file->map = NULL;
+        st_mmap_file_close(file);
+        return -1;
+    }
+    return 0;
+}
+
+// must be called with the write_lock held, the lock is taken
+// only to switch to the new mapping
+static int
+st_mmap_file_grow(st_mmap_t *st, st_mmap_file_t *file, size_t size)
+{
+    int rc = posix_fallocate(file->fd, file->size, size - file->size);
+    if (rc != 0) {
+        SHC_ERROR("Can't grow the data file to %zu bytes: %s", size, strerror(rc));
+        return -1;
+    }
+    char *map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, file->fd, 0);
+    if (map == MAP_FAILED) {
+        SHC_ERROR("Can't map the data file (%zu bytes): %s", size, strerror(errno));
+        return -1;
+    }
+    pthread_rwlock_wrlock(&st->lock);
+    char *old_map = file->map;
+    size_t old_size = file->size;
+    file->map = map;
+    file->size = size;
+    pthread_rwlock_unlock(&st->lock);
+    munmap(old_map, old_size);
+    return 0;
+}
+
+static void
+st_mmap_fname(st_mmap_t *st, char *name, char *fname, size_t size)
+{
+    snprintf(fname, size, "%s/%s", st->path, name);
+}
+
+static inline st_mmap_record_t *
+st_mmap_record(st_mmap_t *st, uint64_t offset)
+{
+    // ignore offsets pointing past the data written so far
+    // (an update might have been interrupted by a crash)
+    if (offset < ST_MMAP_HDR_SIZE || offset + sizeof(st_mmap_record_t) > ST_MMAP_DATA_HDR(st)->used)
+        return NULL;
+    st_mmap_record_t *rec = (st_mmap_record_t *)(st->data.map + offset);
+    if (offset + sizeof(st_mmap_record_t) + rec->klen + rec->vlen > ST_MMAP_DATA_HDR(st)->used)
+        return NULL;
+    return rec;
+}
+
+#define ST_MMAP_RECORD_SIZE(_r) ST_MMAP_ALIGN(sizeof(st_mmap_record_t) + (_r)->klen + (_r)->vlen)
+#define ST_MMAP_RECORD_KEY(_r) ((char *)(_r) + sizeof(st_mmap_record_t))
+#define ST_MMAP_RECORD_VALUE(_r) (ST_MMAP_RECORD_KEY(_r) + (_r)->klen)
+
+/*
+ * Look up the slot for a key, must be called with the lock held.
+ * Returns the slot holding the key or NULL if not found, in which case
+ * the slot where the key can be added is returned in 'free_slot'
+ */
+static st_mmap_slot_t *
+st_mmap_lookup(st_mmap_t *st, void *key, size_t klen, uint64_t hash, st_mmap_slot_t **free_slot)
+{
+    st_mmap_slot_t *slots = ST_MMAP_SLOTS(st);
+    uint64_t mask = ST_MMAP_INDEX_HDR(st)->num_slots - 1;
+    uint64_t i = hash & mask;
+    st_mmap_slot_t *tombstone = NULL;
+    uint64_t probes;
+    for (probes = 0; probes <= mask; probes++) {
+        st_mmap_slot_t *slot = &slots[i];
+        if (!slot->offset) {
+            if (free_slot)
+                *free_slot = tombstone ? tombstone : slot;
+            return NULL;
+        }
+        if (slot->offset == ST_MMAP_TOMBSTONE) {
+            if (!tombstone)
+                tombstone = slot;
+        } else if (slot->hash == hash) {
+            st_mmap_record_t *rec = st_mmap_record(st, slot->offset);
+            if (rec && rec->klen == klen && memcmp(ST_MMAP_RECORD_KEY(rec), key, klen) == 0)
+                return slot;
+        }
+        i = (i + 1) & mask;
+    }
+    if (free_slot)
+        *free_slot = tombstone;
+    return NULL;
+}
+
+/*
+ * Rebuild the index (with 'num_slots' slots) and the data file with only
+ * the live records. The new files are written aside, synced and then
+ * renamed over the old ones (the index first), a data file left aside
+ * by a crash is picked up at the next startup if its generation matches
+ * the one of the index.
+ * Must be called with the write_lock held (so the old files can't change
+ * while being copied), the lock is taken only to switch to the new files
+ */
+static int
+st_mmap_rebuild(st_mmap_t *st, uint64_t num_slots)
+{
+    char index_fname[PATH_MAX], data_fname[PATH_MAX];
+    char new_index_fname[PATH_MAX], new_data_fname[PATH_MAX];
+    st_mmap_fname(st, "index", index_fname, sizeof(index_fname));
+    st_mmap_fname(st, "data", data_fname, sizeof(data_fname));
+    st_mmap_fname(st, "index.new", new_index_fname, sizeof(new_index_fname));
+    st_mmap_fname(st, "data.new", new_data_fname, sizeof(new_data_fname));
+
+    st_mmap_data_hdr_t *data_hdr = ST_MMAP_DATA_HDR(st);
+    st_mmap_index_hdr_t *index_hdr = ST_MMAP_INDEX_HDR(st);
+
+    // leave as much room as the live data for new records
+    size_t live = data_hdr->used - ST_MMAP_HDR_SIZE - data_hdr->dead;
+    size_t data_size = st->initial_data_size;
+    while (data_size < ST_MMAP_HDR_SIZE + live * 2)
+        data_size *= 2;
+
+    unlink(new_index_fname);
+    unlink(new_data_fname);
+
+    st_mmap_file_t index, data;
+    if (st_mmap_file_open(new_index_fname, ST_MMAP_HDR_SIZE + num_slots * sizeof(st_mmap_slot_t), &index) != 0)
+        return -1;
+    if (st_mmap_file_open(new_data_fname, data_size, &data) != 0) {
+        st_mmap_file_close(&index);
+        unlink(new_index_fname);
+        return -1;
+    }
+
+    uint64_t generation = index_hdr->generation + 1;
+    st_mmap_index_hdr_t *new_index_hdr = (st_mmap_index_hdr_t *)index.map;
+    st_mmap_slot_t *new_slots = (st_mmap_slot_t *)(index.map + ST_MMAP_HDR_SIZE);
+    uint64_t used = ST_MMAP_HDR_SIZE;
+    uint64_t count = 0;
+
+    st_mmap_slot_t *slots = ST_MMAP_SLOTS(st);
+    uint64_t i;
+    for (i = 0; i < index_hdr->num_slots; i++) {
+        if (!slots[i].offset || slots[i].offset == ST_MMAP_TOMBSTONE)
+            continue;
+        st_mmap_record_t *rec = st_mmap_record(st, slots[i].offset);
+        if (!rec)
+            continue;
+        size_t rsize = ST_MMAP_RECORD_SIZE(rec);
+        memcpy(data.map + used, rec, sizeof(st_mmap_record_t) + rec->klen + rec->vlen);
+
+        uint64_t n = slots[i].hash & (num_slots - 1);
+        while (new_slots[n].offset)
+            n = (n + 1) & (num_slots - 1);
+        new_slots[n].hash = slots[i].hash;
+        new_slots[n].offset = used;
+
+        used += rsize;
+        count++;
+    }
+
+    st_mmap_data_hdr_t *new_data_hdr = (st_mmap_data_hdr_t *)data.map;
+    new_data_hdr->magic = ST_MMAP_DATA_MAGIC;
+    new_data_hdr->version = ST_MMAP_VERSION;
+    new_data_hdr->generation = generation;
+    new_data_hdr->used = used;
+    new_data_hdr->dead = 0;
+
+    new_index_hdr->magic = ST_MMAP_INDEX_MAGIC;
+    new_index_hdr->version = ST_MMAP_VERSION;
+    new_index_hdr->generation = generation;
+    new_index_hdr->num_slots = num_slots;
+    new_index_hdr->count = count;
+    new_index_hdr->tombstones = 0;
+
+    if (msync(data.map, used, MS_SYNC) != 0 ||
+        msync(index.map, index.size, MS_SYNC) != 0 ||
+        rename(new_index_fname, index_fname) != 0 ||
+        rename(new_data_fname, data_fname) != 0)
+    {
+        SHC_ERROR("Can't replace the storage files in %s: %s", st->path, strerror(errno));
+        st_mmap_file_close(&index);
+        st_mmap_file_close(&data);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&st->lock);
+    st_mmap_file_t old_index = st->index;
+    st_mmap_file_t old_data = st->data;
+    st->index = index;
+    st->data = data;
+    pthread_rwlock_unlock(&st->lock);
+
+    st_mmap_file_close(&old_index);
+    st_mmap_file_close(&old_data);
+    return 0;
+}
+
+/*
+ * Make room for a new record of a key/value pair (rebuilding the files
+ * or growing the data file if needed), must be called with the write_lock
+ * held but not the lock.
+ * Returns 0 on success and -1 on failure
+ */
+static int
+st_mmap_reserve(st_mmap_t *st, size_t klen, size_t vlen)
+{
+    if (klen > UINT32_MAX || vlen > UINT32_MAX)
+        return -1;
+
+    size_t rsize = ST_MMAP_ALIGN(sizeof(st_mmap_record_t) + klen + vlen);
+
+    // NOTE: the files are changed only by who holds the write_lock,
+    //       so the headers can be read without holding the lock
+
+    // keep the index at most 3/4 full (tombstones included)
+    st_mmap_index_hdr_t *index_hdr = ST_MMAP_INDEX_HDR(st);
+    if ((index_hdr->count + index_hdr->tombstones + 1) * 4 > index_hdr->num_slots * 3) {
+        uint64_t num_slots = index_hdr->num_slots;
+        if ((index_hdr->count + 1) * 2 > num_slots)
+            num_slots *= 2;
+        if (st_mmap_rebuild(st, num_slots) != 0)
+            return -1;
+    }
+
+    st_mmap_data_hdr_t *data_hdr = ST_MMAP_DATA_HDR(st);
+    if (data_hdr->used + rsize > st->data.size && data_hdr->dead * 2 >= data_hdr->used) {
+        // drop the obsolete records rather than growing the file
+        if (st_mmap_rebuild(st, ST_MMAP_INDEX_HDR(st)->num_slots) != 0)
+            return -1;
+        data_hdr = ST_MMAP_DATA_HDR(st);
+    }
+
+    if (data_hdr->used + rsize > st->data.size) {
+        size_t size = st->data.size;
+        while (data_hdr->used + rsize > size)
+            size *= 2;
+        if (st_mmap_file_grow(st, &st->data, size) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Append a new record to the data file, must be called with the lock
+ * held for writing once the space has been reserved (see st_mmap_reserve()).
+ * Returns the offset of the new record
+ */
+static uint64_t
+st_mmap_append(st_mmap_t *st, void *key, size_t klen, void *value, size_t vlen)
+{
+    size_t rsize = ST_MMAP_ALIGN(sizeof(st_mmap_record_t) + klen + vlen);
+    st_mmap_data_hdr_t *data_hdr = ST_MMAP_DATA_HDR(st);
+    uint64_t offset = data_hdr->used;
+    st_mmap_record_t *rec = (st_mmap_record_t *)(st->data.map + offset);
+    rec->klen = klen;
+    rec->vlen = vlen;
+    memcpy(ST_MMAP_RECORD_KEY(rec), key, klen);
+    memcpy(ST_MMAP_RECORD_VALUE(rec), value, vlen);
+    data_hdr->used += rsize;
+    return offset;
+}
+
+// must be called with the lock held for writing
+// once the space has been reserved (see st_mmap_reserve())
+static int
+st_mmap_put(st_mmap_t *st, void *key, size_t klen, void *value, size_t vlen, uint64_t hash)
+{
+    uint64_t offset = st_mmap_append(st, key, klen, value, vlen);
+
+    st_mmap_slot_t *free_slot = NULL;
+    st_mmap_slot_t *slot = st_mmap_lookup(st, key, klen, hash, &free_slot);
+    if (slot) {
+        st_mmap_record_t *old = st_mmap_record(st, slot->offset);
+        ST_MMAP_DATA_HDR(st)->dead += ST_MMAP_RECORD_SIZE(old);
+    } else {
+        // there is always a free slot since the index is never full
+        slot = free_slot;
+        if (slot->offset == ST_MMAP_TOMBSTONE)
+            ST_MMAP_INDEX_HDR(st)->tombstones--;
+        slot->hash = hash;
+        ST_MMAP_INDEX_HDR(st)->count++;
+    }
+    slot->offset = offset;
+    return 0;
+}
+
+// must be called with the lock held
+static void
+st_mmap_copy_value(st_mmap_t *st, void *key, size_t klen, void **value, size_t *vlen)
+{
+    *value = NULL;
+    if (vlen)
+        *vlen = 0;
+    st_mmap_slot_t *slot = st_mmap_lookup(st, key, klen, st_mmap_hash(key, klen), NULL);
+    if (slot) {
+        st_mmap_record_t *rec = st_mmap_record(st, slot->offset);
+        *value = malloc(rec->vlen);
+        memcpy(*value, ST_MMAP_RECORD_VALUE(rec), rec->vlen);
+        if (vlen)
+            *vlen = rec->vlen;
+    }
+}
+
+static int
+st_fetch(void *key, size_t klen, void **value, size_t *vlen, void *priv)
+{
+    st_mmap_t *st = (st_mmap_t *)priv;
+    pthread_rwlock_rdlock(&st->lock);
+    st_mmap_copy_value(st, key, klen, value, vlen);
+    pthread_rwlock_unlock(&st->lock);
+    return 0;
+}
+
+static int
+st_fetch_multi(void **keys, size_t *klens, int nkeys, void **values, size_t *vlens, void *priv)
+{
+    st_mmap_t *st = (st_mmap_t *)priv;
+    pthread_rwlock_rdlock(&st->lock);
+    int i;
+    for (i = 0; i < nkeys; i++)
+        st_mmap_copy_value(st, keys[i], klens[i], &values[i], &vlens[i]);
+    pthread_rwlock_unlock(&st->lock);
+    return 0;
+}
+
+static int
+st_store(void *key, size_t klen, void *value, size_t vlen, int if_not_exists, void *priv)
+{
+    st_mmap_t *st = (st_mmap_t *)priv;
+    uint64_t hash = st_mmap_hash(key, klen);
+    pthread_mutex_lock(&st->write_lock);
+    if (st_mmap_reserve(st, klen, vlen) != 0) {
+        pthread_mutex_unlock(&st->write_lock);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&st->lock);
+    int rc = 1;
+    if (!if_not_exists || !st_mmap_lookup(st, key, klen, hash, NULL))
+        rc = st_mmap_put(st, key, klen, value, vlen, hash);
+    pthread_rwlock_unlock(&st->lock);
+    pthread_mutex_unlock(&st->write_lock);
+    return rc;
+}
+
+static int
+st_cas(void *key, size_t klen, void *old_value, size_t old_len, void *new_value, size_t new_len, void *priv)
+{
+    st_mmap_t *st = (st_mmap_t *)priv;
+    uint64_t hash = st_mmap_hash(key, klen);
+    pthread_mutex_lock(&st->write_lock);
+    if (st_mmap_reserve(st, klen, new_len) != 0) {
+        pthread_mutex_unlock(&st->write_lock);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&st->lock);
+    int rc = 1;
+    st_mmap_slot_t *slot = st_mmap_lookup(st, key, klen, hash, NULL);
+    st_mmap_record_t *rec = slot ? st_mmap_record(st, slot->offset) : NULL;
+    if (rec && rec->vlen == old_len && memcmp(ST_MMAP_RECORD_VALUE(rec), old_value, old_len) == 0)
+        rc = st_mmap_put(st, key, klen, new_value, new_len, hash);
+    pthread_rwlock_unlock(&st->lock);
+    pthread_mutex_unlock(&st->write_lock);
+    return rc;
+}
+
+static int
+st_remove(void *key, size_t klen, void *priv)
+{
+    st_mmap_t *st = (st_mmap_t *)priv;
+    pthread_mutex_lock(&st->write_lock);
+    pthread_rwlock_wrlock(&st->lock);
+    st_mmap_slot_t *slot = st_mmap_lookup(st, key, klen, st_mmap_hash(key, klen), NULL);
+    if (slot) {
+        st_mmap_record_t *rec = st_mmap_record(st, slot->offset);
+        ST_MMAP_DATA_HDR(st)->dead += ST_MMAP_RECORD_SIZE(rec);
+        slot->offset = ST_MMAP_TOMBSTONE;
+        ST_MMAP_INDEX_HDR(st)->count--;
+        ST_MMAP_INDEX_HDR(st)->tombstones++;
+    }
+    pthread_rwlock_unlock(&st->lock);
+    pthread_mutex_unlock(&st->write_lock);
+    return 0;
+}
+
+static int
+st_exist(void *key, size_t klen, void *priv)
+{
+    st_mmap_t *st = (st_mmap_t *)priv;
+    pthread_rwlock_rdlock(&st->lock);
+    int exists = (st_mmap_lookup(st, key, klen, st_mmap_hash(key, klen), NULL) != NULL);
+    pthread_rwlock_unlock(&st->lock);
+    return exists;
+}
+
+static size_t
+st_count(void *priv)
+{
+    st_mmap_t *st = (st_mmap_t *)priv;
+    pthread_rwlock_rdlock(&st->lock);
+    size_t count = ST_MMAP_INDEX_HDR(st)->count;
+    pthread_rwlock_unlock(&st->lock);
+    return count;
+}
+
+static size_t
+st_index(shardcache_storage_index_item_t *index, size_t isize, void *priv)
+{
+    st_mmap_t *st = (st_mmap_t *)priv;
+    size_t n = 0;
+    pthread_rwlock_rdlock(&st->lock);
+    st_mmap_slot_t *slots = ST_MMAP_SLOTS(st);
+    uint64_t i;
+    for (i = 0; i < ST_MMAP_INDEX_HDR(st)->num_slots && n < isize; i++) {
+        if (!slots[i].offset || slots[i].offset == ST_MMAP_TOMBSTONE)
+            continue;
+        st_mmap_record_t *rec = st_mmap_record(st, slots[i].offset);
+        if (!rec)
+            continue;
+        index[n].key = malloc(rec->klen);
+        memcpy(index[n].key, ST_MMAP_RECORD_KEY(rec), rec->klen);
+        index[n].klen = rec->klen;
+        index[n].vlen = rec->vlen;
+        n++;
+    }
+    pthread_rwlock_unlock(&st->lock);
+    return n;
+}
+
+// the cursor is made of the generation of the index (24 bits) and the next slot
+// to scan (40 bits). Keys never move in the index but when the files are rebuilt,
+// in which case the scan starts again (returning some keys twice)
+static size_t
+st_scan_index(uint64_t *cursor, shardcache_storage_index_item_t *index, size_t isize, void *priv)
+{
+    st_mmap_t *st = (st_mmap_t *)priv;
+    size_t n = 0;
+    pthread_rwlock_rdlock(&st->lock);
+    st_mmap_index_hdr_t *index_hdr = ST_MMAP_INDEX_HDR(st);
+    st_mmap_slot_t *slots = ST_MMAP_SLOTS(st);
+    uint64_t generation = index_hdr->generation & 0xFFFFFF;
+    uint64_t i = 0;
+    if (*cursor && (*cursor >> 40) == generation)
+        i = *cursor & 0xFFFFFFFFFFULL;
+    for (; i < index_hdr->num_slots && n < isize; i++) {
+        if (!slots[i].offset || slots[i].offset == ST_MMAP_TOMBSTONE)
+            continue;
+        st_mmap_record_t *rec = st_mmap_record(st, slots[i].offset);
+        if (!rec)
+            continue;
+        index[n].key = malloc(rec->klen);
+        memcpy(index[n].key, ST_MMAP_RECORD_KEY(rec), rec->klen);
+        index[n].klen = rec->klen;
+        index[n].vlen = rec->vlen;
+        n++;
+    }
+    *cursor = (i < index_hdr->num_slots) ? (generation << 40) | i : 0;
+    pthread_rwlock_unlock(&st->lock);
+    return n;
+}
+
+// open the files in st->path, initializing them if they are new
+static int
+st_mmap_open(st_mmap_t *st, uint64_t num_slots)
+{
+    char index_fname[PATH_MAX], data_fname[PATH_MAX], new_data_fname[PATH_MAX];
+    st_mmap_fname(st, "index", index_fname, sizeof(index_fname));
+    st_mmap_fname(st, "data", data_fname, sizeof(data_fname));
+    st_mmap_fname(st, "data.new", new_data_fname, sizeof(new_data_fname));
+
+    if (mkdir(st->path, 0755) != 0 && errno != EEXIST) {
+        SHC_ERROR("Can't create the storage directory %s: %s", st->path, strerror(errno));
+        return -1;
+    }
+
+    if (st_mmap_file_open(index_fname, ST_MMAP_HDR_SIZE + num_slots * sizeof(st_mmap_slot_t), &st->index) != 0)
+        return -1;
+
+    st_mmap_index_hdr_t *index_hdr = ST_MMAP_INDEX_HDR(st);
+    int is_new = (index_hdr->magic == 0);
+    if (is_new) {
+        index_hdr->magic = ST_MMAP_INDEX_MAGIC;
+        index_hdr->version = ST_MMAP_VERSION;
+        index_hdr->generation = 1;
+        index_hdr->num_slots = num_slots;
+    } else if (index_hdr->magic != ST_MMAP_INDEX_MAGIC || index_hdr->version != ST_MMAP_VERSION ||
+               ST_MMAP_HDR_SIZE + index_hdr->num_slots * sizeof(st_mmap_slot_t) > st->index.size)
+    {
+        SHC_ERROR("Bad index file %s", index_fname);
+        return -1;
+    }
+
+    // complete a rebuild interrupted after replacing the index
+    int fd = open(new_data_fname, O_RDONLY);
+    if (fd >= 0) {
+        st_mmap_data_hdr_t hdr;
+        if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+            hdr.magic == ST_MMAP_DATA_MAGIC && hdr.generation == index_hdr->generation)
+        {
+            rename(new_data_fname, data_fname);
+        } else {
+            unlink(new_data_fname);
+        }
+        close(fd);
+    }
+
+    if (st_mmap_file_open(data_fname, st->initial_data_size, &st->data) != 0)
+        return -1;
+
+    st_mmap_data_hdr_t *data_hdr = ST_MMAP_DATA_HDR(st);
+    if (is_new) {
+        data_hdr->magic = ST_MMAP_DATA_MAGIC;
+        data_hdr->version = ST_MMAP_VERSION;
+        data_hdr->generation = index_hdr->generation;
+        data_hdr->used = ST_MMAP_HDR_SIZE;
+        data_hdr->dead = 0;
+    } else if (data_hdr->magic != ST_MMAP_DATA_MAGIC || data_hdr->version != ST_MMAP_VERSION ||
+               data_hdr->generation != index_hdr->generation || data_hdr->used > st->data.size)
+    {
+        SHC_ERROR("Bad data file %s", data_fname);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+st_mmap_destroy(st_mmap_t *st)
+{
+    st_mmap_file_close(&st->index);
+    st_mmap_file_close(&st->data);
+    pthread_rwlock_destroy(&st->lock);
+    pthread_mutex_destroy(&st->write_lock);
+    free(st->path);
+    free(st);
+}
+
+int
+storage_init(shardcache_storage_t *storage, char **options)
+{
+    char *path = NULL;
+    uint64_t index_slots = ST_MMAP_INDEX_SLOTS_DEFAULT;
+    size_t data_size = ST_MMAP_DATA_SIZE_DEFAULT;
+
+    // options come as a NULL-terminated list of name/value pairs
+    if (options) {
+        while (options[0] && options[1]) {
+            char *name = *options++;
+            char *value = *options++;
+            if (strcasecmp(name, "path") == 0) {
+                path = value;
+            } else if (strcasecmp(name, "index_slots") == 0) {
+                index_slots = strtoull(value, NULL, 10);
+            } else if (strcasecmp(name, "data_size") == 0) {
+                data_size = strtoull(value, NULL, 10);
+            } else {
+                SHC_ERROR("Unknown option name %s", name);
+                return -1;
+            }
+        }
+    }
+
+    if (!path || !index_slots || data_size <= ST_MMAP_HDR_SIZE) {
+        SHC_ERROR("Invalid options for the mmap storage (the path is mandatory)");
+        return -1;
+    }
+
+    st_mmap_t *st = calloc(1, sizeof(st_mmap_t));
+    st->path = strdup(path);
+    st->index.fd = -1;
+    st->data.fd = -1;
+    st->initial_data_size = data_size;
+    pthread_rwlock_init(&st->lock, NULL);
+    pthread_mutex_init(&st->write_lock, NULL);
+
+    // the number of slots must be a power of two
+    uint64_t num_slots = 1;
+    while (num_slots < index_slots)
+        num_slots <<= 1;
+
+    if (st_mmap_open(st, num_slots) != 0) {
+        st_mmap_destroy(st);
+        return -1;
+    }
+
+    storage->fetch       = st_fetch;
+    storage->fetch_multi = st_fetch_multi;
+    storage->store       = st_store;
+    storage->cas         = st_cas;
+    storage->remove      = st_remove;
+    storage->exist       = st_exist;
+    storage->count       = st_count;
+    storage->index       = st_index;
+    storage->scan_index  = st_scan_index;
+    storage->priv        = st;
+
+    return 0;
+}
+
+void
+storage_destroy(void *priv)
+{
+    st_mmap_destroy((st_mmap_t *)priv);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
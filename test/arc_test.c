@@ -0,0 +1,173 @@
+#include <arc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_OBJECTS 3000
+
+typedef struct {
+    char key[32];
+    int value;
+} test_object_t;
+
+static void
+test_init(const void *key, size_t klen, int async, time_t ttl, arc_resource_t res, void *ptr, void *priv)
+{
+    test_object_t *obj = (test_object_t *)ptr;
+    snprintf(obj->key, sizeof(obj->key), "%.*s", (int)klen, (char *)key);
+    obj->value = -1;
+}
+
+static int
+test_fetch(void *ptr, size_t *size, void *priv)
+{
+    test_object_t *obj = (test_object_t *)ptr;
+    obj->value = atoi(obj->key + 4);
+    *size = sizeof(int);
+    return 0;
+}
+
+static void
+test_evict(void *ptr, void *priv)
+{
+}
+
+typedef struct {
+    int values[NUM_OBJECTS];
+    char frequent[NUM_OBJECTS];
+    int count;
+    int stop_at;
+} walk_result_t;
+
+static int
+collect_cb(void *ptr, int frequent, void *priv)
+{
+    walk_result_t *res = (walk_result_t *)priv;
+    if (res->count < NUM_OBJECTS) {
+        res->values[res->count] = ((test_object_t *)ptr)->value;
+        res->frequent[res->count] = frequent;
+    }
+    res->count++;
+    return (res->stop_at && res->count == res->stop_at) ? -1 : 0;
+}
+
+static int
+restore_cb(void *ptr, size_t *size, void *priv)
+{
+    ((test_object_t *)ptr)->value = *((int *)priv);
+    *size = sizeof(int);
+    return 0;
+}
+
+static arc_resource_t
+lookup(arc_t *cache, int i)
+{
+    char key[32];
+    snprintf(key, sizeof(key), "key_%d", i);
+    return arc_lookup(cache, key, strlen(key), NULL, 0, 0);
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    arc_ops_t ops = {
+        .init = test_init,
+        .fetch = test_fetch,
+        .evict = test_evict
+    };
+    uint64_t *lists_size[4];
+    arc_t *cache = arc_create(&ops, 1<<26, sizeof(test_object_t), lists_size, 0);
+
+    int i;
+    for (i = 0; i < NUM_OBJECTS; i++)
+        arc_release_resource(cache, lookup(cache, i));
+
+    // the walk spans multiple chunks, the order must be preserved across them
+    ut_testing("arc_walk() visits all the objects from the least recently used one");
+    walk_result_t res;
+    memset(&res, 0, sizeof(res));
+    int rc = arc_walk(cache, collect_cb, &res);
+    int ordered = 1;
+    for (i = 0; i < NUM_OBJECTS && ordered; i++)
+        ordered = (res.values[i] == i && !res.frequent[i]);
+    if (rc == NUM_OBJECTS && res.count == NUM_OBJECTS && ordered)
+        ut_success();
+    else
+        ut_failure("rc: %d, visited: %d, ordered: %d", rc, res.count, ordered);
+
+    ut_testing("arc_walk() stops (and returns -1) when the callback returns -1");
+    memset(&res, 0, sizeof(res));
+    res.stop_at = 1500;
+    rc = arc_walk(cache, collect_cb, &res);
+    ut_validate_int(rc == -1 && res.count == 1500, 1);
+
+    ut_testing("Objects looked up twice are reported as frequent, after the mru ones");
+    arc_release_resource(cache, lookup(cache, 10));
+    arc_release_resource(cache, lookup(cache, 20));
+    memset(&res, 0, sizeof(res));
+    rc = arc_walk(cache, collect_cb, &res);
+    if (rc == NUM_OBJECTS &&
+        res.values[NUM_OBJECTS - 2] == 10 && res.frequent[NUM_OBJECTS - 2] &&
+        res.values[NUM_OBJECTS - 1] == 20 && res.frequent[NUM_OBJECTS - 1] &&
+        !res.frequent[NUM_OBJECTS - 3])
+    {
+        ut_success();
+    } else {
+        ut_failure("Unexpected walk result (rc: %d)", rc);
+    }
+
+    // replay the walk into a new cache (as done when restoring a snapshot)
+    ut_testing("arc_restore_commit() preserves the order of the restored objects");
+    arc_t *restored = arc_create(&ops, 1<<26, sizeof(test_object_t), lists_size, 0);
+    int added = 0;
+    int offset;
+    for (offset = 0; offset < NUM_OBJECTS; offset += 100) {
+        arc_resource_t objs[100];
+        int n;
+        for (n = 0; n < 100; n++) {
+            char key[32];
+            snprintf(key, sizeof(key), "key_%d", res.values[offset + n]);
+            objs[n] = arc_restore_prepare(restored, key, strlen(key), 0, restore_cb, &res.values[offset + n]);
+        }
+        added += arc_restore_commit(restored, objs, &res.frequent[offset], 100);
+    }
+    walk_result_t res2;
+    memset(&res2, 0, sizeof(res2));
+    rc = arc_walk(restored, collect_cb, &res2);
+    if (added == NUM_OBJECTS && rc == NUM_OBJECTS &&
+        memcmp(res.values, res2.values, sizeof(res.values)) == 0 &&
+        memcmp(res.frequent, res2.frequent, sizeof(res.frequent)) == 0)
+    {
+        ut_success();
+    } else {
+        ut_failure("added: %d, visited: %d", added, rc);
+    }
+
+    ut_testing("arc_restore_prepare() skips the keys which are already in the cache");
+    int value = 42;
+    ut_validate_int(arc_restore_prepare(restored, "key_1", 5, 0, restore_cb, &value) == NULL, 1);
+
+    ut_testing("arc_restore_commit() drops the objects whose key has been added in the meanwhile");
+    arc_resource_t obj = arc_restore_prepare(restored, "key_new", 7, 0, restore_cb, &value);
+    arc_resource_t current = arc_lookup(restored, "key_new", 7, NULL, 0, 0);
+    char frequent = 0;
+    added = obj ? arc_restore_commit(restored, &obj, &frequent, 1) : -1;
+    void *ptr = current ? arc_get_resource_ptr(current) : NULL;
+    if (added == 0 && obj == NULL && ptr && ((test_object_t *)ptr)->value != 42)
+        ut_success();
+    else
+        ut_failure("added: %d", added);
+    if (current)
+        arc_release_resource(restored, current);
+
+    arc_destroy(restored);
+    arc_destroy(cache);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
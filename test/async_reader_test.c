@@ -0,0 +1,132 @@
+#include <messaging.h>
+#include <async_reader.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ut.h>
+#include <libgen.h>
+
+// the pending buffer of the reader never holds more than this
+#define PENDING_MAX (1<<16)
+
+typedef struct {
+    fbuf_t record;
+    int done;
+    int errors;
+} parsed_record_t;
+
+static int
+collect_record(void *data, size_t len, int idx, size_t total_len, void *priv)
+{
+    parsed_record_t *msg = (parsed_record_t *)priv;
+    if (idx == 0 && data && len)
+        fbuf_add_binary(&msg->record, data, len);
+    else if (idx == -1)
+        msg->done++;
+    else if (idx == -2)
+        msg->errors++;
+    return 0;
+}
+
+static void
+build_record_message(char *value, fbuf_t *out)
+{
+    shardcache_record_t record = { value, strlen(value) };
+    build_message(SHC_HDR_SET, &record, 1, out, global_protocol_version(-1));
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    parsed_record_t msg;
+    memset(&msg, 0, sizeof(msg));
+
+    fbuf_t first = FBUF_STATIC_INITIALIZER;
+    fbuf_t second = FBUF_STATIC_INITIALIZER;
+    build_record_message("first value", &first);
+    build_record_message("second value", &second);
+
+    ut_testing("Two pipelined messages in a single input are parsed one at a time");
+    async_read_ctx_t *ctx = async_read_context_create(collect_record, &msg);
+    fbuf_t input = FBUF_STATIC_INITIALIZER;
+    fbuf_add_binary(&input, fbuf_data(&first), fbuf_used(&first));
+    fbuf_add_binary(&input, fbuf_data(&second), fbuf_used(&second));
+    int processed = 0;
+    async_read_context_state_t state =
+        async_read_context_input_data(ctx, fbuf_data(&input), fbuf_used(&input), &processed);
+    if (state == SHC_STATE_READING_DONE && msg.done == 1 &&
+        processed == fbuf_used(&input) &&
+        fbuf_used(&msg.record) == strlen("first value") &&
+        memcmp(fbuf_data(&msg.record), "first value", fbuf_used(&msg.record)) == 0)
+    {
+        ut_success();
+    } else {
+        ut_failure("state: %d, done: %d, processed: %d", state, msg.done, processed);
+    }
+
+    ut_testing("async_read_context_update() parses the pending message");
+    fbuf_clear(&msg.record);
+    state = async_read_context_update(ctx);
+    if (state == SHC_STATE_READING_DONE && msg.done == 2 &&
+        fbuf_used(&msg.record) == strlen("second value") &&
+        memcmp(fbuf_data(&msg.record), "second value", fbuf_used(&msg.record)) == 0)
+    {
+        ut_success();
+    } else {
+        ut_failure("state: %d, done: %d", state, msg.done);
+    }
+    async_read_context_destroy(ctx);
+    fbuf_destroy(&input);
+
+    ut_testing("Data exceeding the pending buffer is not reported as processed");
+    memset(&msg, 0, sizeof(msg));
+    ctx = async_read_context_create(collect_record, &msg);
+    int extra = PENDING_MAX * 2;
+    char *data = malloc(fbuf_used(&first) + extra);
+    memcpy(data, fbuf_data(&first), fbuf_used(&first));
+    memset(data + fbuf_used(&first), 0, extra);
+    processed = 0;
+    state = async_read_context_input_data(ctx, data, fbuf_used(&first) + extra, &processed);
+    ut_validate_int(processed, fbuf_used(&first) + PENDING_MAX);
+
+    async_read_context_destroy(ctx);
+    free(data);
+
+    ut_testing("A message fed one byte at a time is parsed");
+    memset(&msg, 0, sizeof(msg));
+    ctx = async_read_context_create(collect_record, &msg);
+    int i;
+    for (i = 0; i < fbuf_used(&second); i++) {
+        processed = 0;
+        state = async_read_context_input_data(ctx, fbuf_data(&second) + i, 1, &processed);
+        if (processed != 1)
+            break;
+    }
+    if (i == fbuf_used(&second) && state == SHC_STATE_READING_DONE && msg.done == 1 &&
+        fbuf_used(&msg.record) == strlen("second value"))
+    {
+        ut_success();
+    } else {
+        ut_failure("stopped at byte %d of %d (state: %d)", i, fbuf_used(&second), state);
+    }
+    async_read_context_destroy(ctx);
+
+    ut_testing("A bad magic moves the reader to the error state and the input is discarded");
+    memset(&msg, 0, sizeof(msg));
+    ctx = async_read_context_create(collect_record, &msg);
+    char garbage[] = "garbage";
+    processed = 0;
+    state = async_read_context_input_data(ctx, garbage, sizeof(garbage) - 1, &processed);
+    ut_validate_int(state == SHC_STATE_READING_ERR && processed == sizeof(garbage) - 1, 1);
+    async_read_context_destroy(ctx);
+
+    fbuf_destroy(&msg.record);
+    fbuf_destroy(&first);
+    fbuf_destroy(&second);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
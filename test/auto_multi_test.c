@@ -0,0 +1,179 @@
+#include <shardcache_client.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_NODES 2
+#define NUM_KEYS 100
+#define NUM_THREADS 8
+#define NUM_GETS 200
+
+typedef struct {
+    shardcache_client_t *client;
+    int id;
+    int gets;
+    int errors;
+} getter_arg_t;
+
+static void *
+getter(void *priv)
+{
+    getter_arg_t *arg = (getter_arg_t *)priv;
+    int i;
+    for (i = 0; i < NUM_GETS; i++) {
+        // each thread asks for different keys at the same time
+        int n = (arg->id + i * NUM_THREADS) % NUM_KEYS;
+        char key[32], val[32];
+        snprintf(key, sizeof(key), "key%d", n);
+        snprintf(val, sizeof(val), "value%d", n);
+        void *value = NULL;
+        size_t size = shardcache_client_get(arg->client, key, strlen(key), &value);
+        if (size != strlen(val) || memcmp(value, val, size) != 0 ||
+            shardcache_client_errno(arg->client) != SHARDCACHE_CLIENT_OK)
+        {
+            arg->errors++;
+        }
+        free(value);
+        arg->gets++;
+    }
+    return NULL;
+}
+
+static int
+elapsed_msecs(struct timeval *start)
+{
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &diff);
+    return diff.tv_sec * 1000 + diff.tv_usec / 1000;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    shardcache_node_t *nodes[NUM_NODES];
+    shardcache_t *servers[NUM_NODES];
+
+    shardcache_log_init("shardcached", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    for (i = 0; i < NUM_NODES; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "peer%d", i);
+        char address[32];
+        snprintf(address, sizeof(address), "127.0.0.1:986%d", i);
+        char *address_array[1] = { address };
+        nodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+
+    for (i = 0; i < NUM_NODES; i++) {
+        servers[i] = shardcache_create(shardcache_node_get_label(nodes[i]), nodes, NUM_NODES, NULL, 5, 0, 1<<20);
+        if (!servers[i]) {
+            ut_testing("shardcache_create()");
+            ut_failure("Errors creating the shardcache instance");
+            ut_summary();
+            exit(ut_failed);
+        }
+        shardcache_iomux_run_timeout_low(servers[i], 5000);
+    }
+
+    sleep(1); // let the servers complete their startup
+
+    shardcache_client_t *client = shardcache_client_create(nodes, NUM_NODES);
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32], val[32];
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(val, sizeof(val), "value%d", i);
+        shardcache_client_set(client, key, strlen(key), val, strlen(val), 0);
+    }
+
+    ut_testing("shardcache_client_auto_multi_window() returns the previous value");
+    int old_window = shardcache_client_auto_multi_window(client, 10000);
+    ut_validate_int(old_window == 0 && shardcache_client_auto_multi_window(client, -1) == 10000, 1);
+
+    ut_testing("A single get is sent once the window expires");
+    void *value = NULL;
+    size_t size = shardcache_client_get(client, "key1", 4, &value);
+    ut_validate_buffer(value, size, "value1", 6);
+    free(value);
+
+    ut_testing("A missing key isn't reported as an error");
+    value = NULL;
+    size = shardcache_client_get(client, "missing", 7, &value);
+    ut_validate_int(size == 0 && value == NULL &&
+                    shardcache_client_errno(client) == SHARDCACHE_CLIENT_OK, 1);
+
+    ut_testing("The gets of concurrent threads are batched and return their own values");
+    pthread_t threads[NUM_THREADS];
+    getter_arg_t args[NUM_THREADS];
+    for (i = 0; i < NUM_THREADS; i++) {
+        memset(&args[i], 0, sizeof(getter_arg_t));
+        args[i].client = client;
+        args[i].id = i;
+        pthread_create(&threads[i], NULL, getter, &args[i]);
+    }
+    int gets = 0, errors = 0;
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        gets += args[i].gets;
+        errors += args[i].errors;
+    }
+    if (gets == NUM_THREADS * NUM_GETS && !errors)
+        ut_success();
+    else
+        ut_failure("gets: %d, errors: %d", gets, errors);
+
+    ut_testing("A full batch is sent without waiting for the window to expire");
+    // a 5 seconds window, but a batch of a single key is full right away
+    shardcache_client_auto_multi_window(client, 5000000);
+    shardcache_client_auto_multi_max_keys(client, 1);
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    value = NULL;
+    size = shardcache_client_get(client, "key2", 4, &value);
+    int msecs = elapsed_msecs(&start);
+    if (size == 6 && memcmp(value, "value2", 6) == 0 && msecs < 1000)
+        ut_success();
+    else
+        ut_failure("size: %d, elapsed: %dms", (int)size, msecs);
+    free(value);
+
+    ut_testing("The gets are sent one by one once the window is disabled");
+    shardcache_client_auto_multi_window(client, 0);
+    shardcache_client_auto_multi_max_keys(client, 64);
+    value = NULL;
+    size = shardcache_client_get(client, "key3", 4, &value);
+    ut_validate_buffer(value, size, "value3", 6);
+    free(value);
+
+    shardcache_client_destroy(client);
+
+    ut_testing("The failure of the batch is reported to each caller");
+    // nothing listens on this address
+    char *unreachable_address[1] = { "127.0.0.1:9869" };
+    shardcache_node_t *unreachable = shardcache_node_create("unreachable", unreachable_address, 1);
+    client = shardcache_client_create(&unreachable, 1);
+    shardcache_client_tcp_timeout(client, 100);
+    shardcache_client_auto_multi_window(client, 1000);
+    value = NULL;
+    size = shardcache_client_get(client, "key1", 4, &value);
+    ut_validate_int(size == 0 && value == NULL &&
+                    shardcache_client_errno(client) != SHARDCACHE_CLIENT_OK, 1);
+    shardcache_client_destroy(client);
+    shardcache_node_destroy(unreachable);
+
+    for (i = 0; i < NUM_NODES; i++) {
+        shardcache_destroy(servers[i]);
+        shardcache_node_destroy(nodes[i]);
+    }
+
+    ut_summary();
+    exit(ut_failed);
+}
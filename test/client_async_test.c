@@ -0,0 +1,316 @@
+#include <shardcache_client.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_NODES 2
+#define NUM_KEYS 100
+#define MAX_FDS 16
+
+// a minimal event loop driven by poll()
+typedef struct {
+    struct pollfd fds[MAX_FDS];
+    int num_fds;
+    int bad_watch; // fds which couldn't be watched
+} loop_t;
+
+static void
+watch_cb(int fd, int events, void *priv)
+{
+    loop_t *loop = (loop_t *)priv;
+    int i;
+    for (i = 0; i < loop->num_fds && loop->fds[i].fd != fd; i++)
+        ;
+
+    if (!events) {
+        if (i < loop->num_fds)
+            loop->fds[i] = loop->fds[--loop->num_fds];
+        return;
+    }
+
+    if (i == loop->num_fds) {
+        if (loop->num_fds == MAX_FDS) {
+            loop->bad_watch++;
+            return;
+        }
+        loop->num_fds++;
+    }
+
+    loop->fds[i].fd = fd;
+    loop->fds[i].events = ((events & SHARDCACHE_CLIENT_ASYNC_READ) ? POLLIN : 0) |
+                          ((events & SHARDCACHE_CLIENT_ASYNC_WRITE) ? POLLOUT : 0);
+}
+
+// runs until there are no requests in progress (or for max 10 seconds)
+static void
+run_loop(shardcache_client_async_t *a, loop_t *loop)
+{
+    int i;
+    for (i = 0; i < 1000 && shardcache_client_async_pending(a); i++) {
+        int timeout = shardcache_client_async_timeout(a);
+        if (timeout < 0 || timeout > 10)
+            timeout = 10;
+        struct pollfd fds[MAX_FDS];
+        int num_fds = loop->num_fds;
+        memcpy(fds, loop->fds, sizeof(struct pollfd) * num_fds);
+        if (poll(fds, num_fds, timeout) > 0) {
+            int n;
+            for (n = 0; n < num_fds; n++) {
+                int events = 0;
+                if (fds[n].revents & (POLLIN|POLLERR|POLLHUP))
+                    events |= SHARDCACHE_CLIENT_ASYNC_READ;
+                if (fds[n].revents & POLLOUT)
+                    events |= SHARDCACHE_CLIENT_ASYNC_WRITE;
+                if (events)
+                    shardcache_client_async_handle(a, fds[n].fd, events);
+            }
+        }
+        shardcache_client_async_expire(a);
+    }
+}
+
+typedef struct {
+    int completed;
+    int failed;
+    int bad_values;
+    int out_of_order;
+    int last_index;
+    int rcs[4];      // counts of rc == -1, 0, 1, other
+    char *prefix;    // the expected values (if any)
+    shardcache_client_async_t *chained; // issue a get from within the set callback
+} results_t;
+
+static void
+count_rc(results_t *res, int rc)
+{
+    res->rcs[(rc >= -1 && rc <= 1) ? rc + 1 : 3]++;
+}
+
+static void
+completion_cb(shardcache_client_async_t *a,
+              void *key,
+              size_t klen,
+              void *data,
+              size_t dlen,
+              int rc,
+              void *priv)
+{
+    results_t *res = (results_t *)priv;
+    res->completed++;
+    count_rc(res, rc);
+    if (rc == -1)
+        res->failed++;
+
+    if (res->prefix) {
+        char keybuf[32], expected[64];
+        snprintf(keybuf, sizeof(keybuf), "%.*s", (int)klen, (char *)key);
+        int index = atoi(keybuf + 3);
+        snprintf(expected, sizeof(expected), "%s%d", res->prefix, index);
+        if (dlen != strlen(expected) || memcmp(data, expected, dlen) != 0)
+            res->bad_values++;
+    }
+}
+
+// the keys sent to the same node are completed in order
+static void
+ordered_cb(shardcache_client_async_t *a,
+           void *key,
+           size_t klen,
+           void *data,
+           size_t dlen,
+           int rc,
+           void *priv)
+{
+    results_t *res = (results_t *)priv;
+    char keybuf[32];
+    snprintf(keybuf, sizeof(keybuf), "%.*s", (int)klen, (char *)key);
+    int index = atoi(keybuf + 3);
+    if (index <= res->last_index)
+        res->out_of_order++;
+    res->last_index = index;
+    completion_cb(a, key, klen, data, dlen, rc, priv);
+}
+
+static void
+chained_cb(shardcache_client_async_t *a,
+           void *key,
+           size_t klen,
+           void *data,
+           size_t dlen,
+           int rc,
+           void *priv)
+{
+    results_t *res = (results_t *)priv;
+    completion_cb(a, key, klen, data, dlen, rc, priv);
+    if (res->chained && shardcache_client_async_get(a, key, klen, completion_cb, res) != 0)
+        res->failed++;
+    res->chained = NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    shardcache_node_t *nodes[NUM_NODES];
+    shardcache_t *servers[NUM_NODES];
+
+    shardcache_log_init("shardcached", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    for (i = 0; i < NUM_NODES; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "peer%d", i);
+        char address[32];
+        snprintf(address, sizeof(address), "127.0.0.1:982%d", i);
+        char *address_array[1] = { address };
+        nodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+
+    for (i = 0; i < NUM_NODES; i++) {
+        servers[i] = shardcache_create(shardcache_node_get_label(nodes[i]), nodes, NUM_NODES, NULL, 5, 0, 1<<20);
+        if (!servers[i]) {
+            ut_testing("shardcache_create()");
+            ut_failure("Errors creating the shardcache instance");
+            ut_summary();
+            exit(ut_failed);
+        }
+        shardcache_iomux_run_timeout_low(servers[i], 5000);
+    }
+
+    sleep(1); // let the servers complete their startup
+
+    shardcache_client_t *client = shardcache_client_create(nodes, NUM_NODES);
+
+    loop_t loop;
+    memset(&loop, 0, sizeof(loop));
+
+    ut_testing("shardcache_client_async_create()");
+    shardcache_client_async_t *async = shardcache_client_async_create(client, watch_cb, &loop);
+    ut_validate_int(async != NULL, 1);
+
+    ut_testing("shardcache_client_async_set() completes all the requests");
+    results_t res;
+    memset(&res, 0, sizeof(res));
+    int queued = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32], val[32];
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(val, sizeof(val), "value%d", i);
+        if (shardcache_client_async_set(async, key, strlen(key), val, strlen(val), 0, completion_cb, &res) == 0)
+            queued++;
+    }
+    run_loop(async, &loop);
+    if (queued == NUM_KEYS && res.completed == NUM_KEYS && res.rcs[1] == NUM_KEYS && !loop.bad_watch)
+        ut_success();
+    else
+        ut_failure("queued: %d, completed: %d, failed: %d", queued, res.completed, res.failed);
+
+    ut_testing("shardcache_client_async_get() returns the values in order");
+    // all the keys owned by the same node
+    memset(&res, 0, sizeof(res));
+    res.prefix = "value";
+    res.last_index = -1;
+    queued = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32], owner[256];
+        size_t len = sizeof(owner);
+        snprintf(key, sizeof(key), "key%d", i);
+        shardcache_test_ownership(servers[0], key, strlen(key), owner, &len);
+        if (strcmp(owner, "peer0") == 0 &&
+            shardcache_client_async_get(async, key, strlen(key), ordered_cb, &res) == 0)
+        {
+            queued++;
+        }
+    }
+    run_loop(async, &loop);
+    if (queued > 0 && res.completed == queued && !res.failed && !res.bad_values && !res.out_of_order)
+        ut_success();
+    else
+        ut_failure("queued: %d, completed: %d, failed: %d, bad values: %d, out of order: %d",
+                   queued, res.completed, res.failed, res.bad_values, res.out_of_order);
+
+    ut_testing("add(), exists(), del() and get() of a missing key");
+    results_t add_res, exists_res, del_res, missing_res, get_res;
+    memset(&add_res, 0, sizeof(results_t));
+    memset(&exists_res, 0, sizeof(results_t));
+    memset(&del_res, 0, sizeof(results_t));
+    memset(&missing_res, 0, sizeof(results_t));
+    memset(&get_res, 0, sizeof(results_t));
+    // the requests for the same key are completed in the order they have been issued
+    shardcache_client_async_add(async, "key1", 4, "other", 5, 0, completion_cb, &add_res);
+    shardcache_client_async_exists(async, "key1", 4, completion_cb, &exists_res);
+    shardcache_client_async_del(async, "key1", 4, completion_cb, &del_res);
+    shardcache_client_async_exists(async, "key1", 4, completion_cb, &missing_res);
+    shardcache_client_async_get(async, "key1", 4, completion_cb, &get_res);
+    run_loop(async, &loop);
+    if (add_res.rcs[2] == 1 && exists_res.rcs[2] == 1 && del_res.rcs[1] == 1 &&
+        missing_res.rcs[1] == 1 && get_res.rcs[1] == 1 && get_res.completed == 1)
+    {
+        ut_success();
+    } else {
+        ut_failure("add: %d, exists: %d, del: %d, exists after del: %d, get: %d",
+                   add_res.completed, exists_res.rcs[2], del_res.rcs[1], missing_res.rcs[1], get_res.rcs[1]);
+    }
+
+    ut_testing("New requests can be issued from within the completion callback");
+    memset(&res, 0, sizeof(res));
+    res.chained = async;
+    shardcache_client_async_set(async, "key1", 4, "chained", 7, 0, chained_cb, &res);
+    run_loop(async, &loop);
+    ut_validate_int(res.completed == 2 && !res.failed, 1);
+
+    ut_testing("shardcache_client_async_destroy() fails the requests in progress");
+    memset(&res, 0, sizeof(res));
+    shardcache_client_async_get(async, "key2", 4, completion_cb, &res);
+    shardcache_client_async_destroy(async);
+    ut_validate_int(res.completed == 1 && res.failed == 1, 1);
+
+    shardcache_client_destroy(client);
+
+    ut_testing("shardcache_client_async_expire() fails the requests to a stalled node");
+    // a node which accepts connections but never answers
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(9829);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(sock, 16) == 0) {
+        char *address_array[1] = { "127.0.0.1:9829" };
+        shardcache_node_t *stalled = shardcache_node_create("stalled", address_array, 1);
+        client = shardcache_client_create(&stalled, 1);
+        shardcache_client_tcp_timeout(client, 200);
+        memset(&loop, 0, sizeof(loop));
+        async = shardcache_client_async_create(client, watch_cb, &loop);
+        memset(&res, 0, sizeof(res));
+        int rc = shardcache_client_async_get(async, "key1", 4, completion_cb, &res);
+        run_loop(async, &loop);
+        if (rc == 0 && res.completed == 1 && res.failed == 1 && shardcache_client_async_pending(async) == 0)
+            ut_success();
+        else
+            ut_failure("rc: %d, completed: %d, failed: %d", rc, res.completed, res.failed);
+        shardcache_client_async_destroy(async);
+        shardcache_client_destroy(client);
+        shardcache_node_destroy(stalled);
+    } else {
+        ut_failure("Can't listen on port 9829");
+    }
+    close(sock);
+
+    for (i = 0; i < NUM_NODES; i++) {
+        shardcache_destroy(servers[i]);
+        shardcache_node_destroy(nodes[i]);
+    }
+
+    ut_summary();
+    exit(ut_failed);
+}
@@ -0,0 +1,146 @@
+#include <shardcache_client.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_NODES 2
+#define NUM_THREADS 8
+#define NUM_ITERATIONS 200
+
+typedef struct {
+    shardcache_client_t *client;
+    int id;
+    int errors;
+    int bad_errno;
+} worker_arg_t;
+
+static void *
+worker(void *priv)
+{
+    worker_arg_t *arg = (worker_arg_t *)priv;
+    int i;
+    for (i = 0; i < NUM_ITERATIONS; i++) {
+        char key[32], val[32];
+        snprintf(key, sizeof(key), "thread%d_key%d", arg->id, i);
+        snprintf(val, sizeof(val), "thread%d_value%d", arg->id, i);
+
+        if (shardcache_client_set(arg->client, key, strlen(key), val, strlen(val), 0) != 0) {
+            arg->errors++;
+            continue;
+        }
+
+        void *value = NULL;
+        size_t size = shardcache_client_get(arg->client, key, strlen(key), &value);
+        if (size != strlen(val) || memcmp(value, val, size) != 0)
+            arg->errors++;
+        free(value);
+
+        // the error state is private to each thread
+        if (shardcache_client_errno(arg->client) != SHARDCACHE_CLIENT_OK)
+            arg->bad_errno++;
+
+        if (shardcache_client_del(arg->client, key, strlen(key)) != 0)
+            arg->errors++;
+    }
+    return NULL;
+}
+
+static void *
+failing_worker(void *priv)
+{
+    worker_arg_t *arg = (worker_arg_t *)priv;
+    char *buf = NULL;
+    size_t len = 0;
+    if (shardcache_client_stats(arg->client, "unknown_node", &buf, &len) == 0)
+        arg->errors++;
+    free(buf);
+    if (shardcache_client_errno(arg->client) != SHARDCACHE_CLIENT_ERROR_ARGS)
+        arg->bad_errno++;
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    shardcache_node_t *nodes[NUM_NODES];
+    shardcache_t *servers[NUM_NODES];
+
+    shardcache_log_init("shardcached", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    for (i = 0; i < NUM_NODES; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "peer%d", i);
+        char address[32];
+        snprintf(address, sizeof(address), "127.0.0.1:980%d", i);
+        char *address_array[1] = { address };
+        nodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+
+    for (i = 0; i < NUM_NODES; i++) {
+        servers[i] = shardcache_create(shardcache_node_get_label(nodes[i]), nodes, NUM_NODES, NULL, 5, 0, 1<<20);
+        if (!servers[i]) {
+            ut_testing("shardcache_create()");
+            ut_failure("Errors creating the shardcache instance");
+            ut_summary();
+            exit(ut_failed);
+        }
+        shardcache_iomux_run_timeout_low(servers[i], 5000);
+    }
+
+    sleep(1); // let the servers complete their startup
+
+    shardcache_client_t *client = shardcache_client_create(nodes, NUM_NODES);
+
+    ut_testing("A client shared by %d threads serves all the requests", NUM_THREADS);
+    pthread_t threads[NUM_THREADS];
+    worker_arg_t args[NUM_THREADS];
+    for (i = 0; i < NUM_THREADS; i++) {
+        memset(&args[i], 0, sizeof(worker_arg_t));
+        args[i].client = client;
+        args[i].id = i;
+        pthread_create(&threads[i], NULL, worker, &args[i]);
+    }
+    int errors = 0;
+    int bad_errno = 0;
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        errors += args[i].errors;
+        bad_errno += args[i].bad_errno;
+    }
+    if (!errors && !bad_errno)
+        ut_success();
+    else
+        ut_failure("errors: %d, unexpected error codes: %d", errors, bad_errno);
+
+    ut_testing("The error of a thread isn't reported to the others");
+    shardcache_client_set(client, "shared_key", 10, "shared_value", 12, 0);
+    worker_arg_t failing_arg;
+    memset(&failing_arg, 0, sizeof(failing_arg));
+    failing_arg.client = client;
+    pthread_t th;
+    pthread_create(&th, NULL, failing_worker, &failing_arg);
+    pthread_join(th, NULL);
+    if (!failing_arg.errors && !failing_arg.bad_errno &&
+        shardcache_client_errno(client) == SHARDCACHE_CLIENT_OK)
+    {
+        ut_success();
+    } else {
+        ut_failure("errno: %d", shardcache_client_errno(client));
+    }
+
+    shardcache_client_destroy(client);
+
+    for (i = 0; i < NUM_NODES; i++) {
+        shardcache_destroy(servers[i]);
+        shardcache_node_destroy(nodes[i]);
+    }
+
+    ut_summary();
+    exit(ut_failed);
+}
@@ -0,0 +1,131 @@
+#include <connections_pool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ut.h>
+#include <libgen.h>
+
+static int
+start_listener(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 || listen(fd, 128) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    // keep the limit low enough to be exhausted quickly
+    struct rlimit limit = { 256, 256 };
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    int listeners[3] = { start_listener(9770), start_listener(9771), start_listener(9772) };
+    char *addrs[3] = { "127.0.0.1:9770", "127.0.0.1:9771", "127.0.0.1:9772" };
+
+    ut_testing("start_listener(9770) && start_listener(9771) && start_listener(9772)");
+    ut_validate_int(listeners[0] >= 0 && listeners[1] >= 0 && listeners[2] >= 0, 1);
+
+    connections_pool_t *cc = connections_pool_create(1000, 5000, 2);
+    connections_pool_counters_t *counters = connections_pool_counters(cc);
+
+    ut_testing("connections_pool_peer_id() returns the same id for the same address");
+    int id0 = connections_pool_peer_id(cc, addrs[0]);
+    int id1 = connections_pool_peer_id(cc, addrs[1]);
+    if (id0 >= 0 && id1 >= 0 && id0 != id1 && connections_pool_peer_id(cc, addrs[0]) == id0)
+        ut_success();
+    else
+        ut_failure("Got ids %d and %d", id0, id1);
+
+    ut_testing("connections_pool_get_by_id(cc, -1) == -1");
+    ut_validate_int(connections_pool_get_by_id(cc, -1), -1);
+
+    ut_testing("connections_pool_get_by_id() on an empty pool creates a new connection");
+    int fd = connections_pool_get_by_id(cc, id0);
+    ut_validate_int(fd >= 0 && counters->misses == 1 && counters->hits == 0, 1);
+
+    ut_testing("connections_pool_get_by_id() reuses the connection put back using connections_pool_add_by_id()");
+    connections_pool_add_by_id(cc, id0, fd);
+    int fd2 = connections_pool_get_by_id(cc, id0);
+    ut_validate_int(fd2 == fd && counters->hits == 1, 1);
+
+    ut_testing("connections_pool_get() shares the connections with connections_pool_get_by_id()");
+    int fd3 = connections_pool_get_by_id(cc, id0);
+    connections_pool_add(cc, addrs[0], fd2);
+    connections_pool_add(cc, addrs[0], fd3);
+    int a = connections_pool_get_by_id(cc, id0);
+    int b = connections_pool_get(cc, addrs[0]);
+    ut_validate_int(((a == fd2 && b == fd3) || (a == fd3 && b == fd2)) && counters->hits == 3, 1);
+    connections_pool_add_by_id(cc, id0, a);
+    connections_pool_add_by_id(cc, id0, b);
+
+    ut_testing("Connections to different peers are not mixed up");
+    int other = connections_pool_get_by_id(cc, id1);
+    ut_validate_int(other >= 0 && other != a && other != b, 1);
+    connections_pool_add_by_id(cc, id1, other);
+
+    // exhaust the filedescriptors to verify that both the stashed
+    // connections and the pooled ones are released to make room
+    // for a new connection
+    ut_testing("All the idle connections are flushed when running out of filedescriptors");
+    int dups[256];
+    int num_dups = 0;
+    int dfd = dup(listeners[0]);
+    while (dfd >= 0 && num_dups < 256) {
+        dups[num_dups++] = dfd;
+        dfd = dup(listeners[0]);
+    }
+    if (dfd >= 0) {
+        ut_failure("Can't exhaust the filedescriptors");
+    } else {
+        uint64_t misses = counters->misses;
+        int nfd = connections_pool_get(cc, addrs[2]);
+        if (nfd >= 0) {
+            close(nfd);
+            // a, b and other must have been closed, so three more
+            // filedescriptors should be available now
+            int freed = 0;
+            dfd = dup(listeners[0]);
+            while (dfd >= 0 && num_dups < 256) {
+                dups[num_dups++] = dfd;
+                freed++;
+                dfd = dup(listeners[0]);
+            }
+            if (freed == 3 && counters->misses == misses + 1)
+                ut_success();
+            else
+                ut_failure("Only %d filedescriptors have been released", freed);
+        } else {
+            ut_failure("Can't create a new connection (%s)", strerror(errno));
+        }
+    }
+    while (num_dups)
+        close(dups[--num_dups]);
+
+    connections_pool_destroy(cc);
+    close(listeners[0]);
+    close(listeners[1]);
+    close(listeners[2]);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
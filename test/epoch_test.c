@@ -0,0 +1,140 @@
+#include <epoch.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_READERS 4
+#define NUM_SWAPS 1000
+
+typedef struct {
+    int alive;
+} object_t;
+
+typedef struct {
+    epoch_t *epoch;
+    object_t *object;
+    int quit;
+    int reads;
+    int dead_reads; // objects seen already released within a read section
+} shared_t;
+
+static void *
+reader(void *priv)
+{
+    shared_t *s = (shared_t *)priv;
+    while (!__sync_fetch_and_add(&s->quit, 0)) {
+        int token = epoch_enter(s->epoch);
+        object_t *object = __sync_fetch_and_add(&s->object, 0);
+        int i;
+        for (i = 0; i < 10000; i++) {
+            if (!__sync_fetch_and_add(&object->alive, 0)) {
+                __sync_fetch_and_add(&s->dead_reads, 1);
+                break;
+            }
+        }
+        epoch_exit(s->epoch, token);
+        // leave some room to the writer (on a single cpu)
+        if (__sync_add_and_fetch(&s->reads, 1) % 8 == 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+typedef struct {
+    epoch_t *epoch;
+    int done;
+} slow_reader_t;
+
+static void *
+slow_reader(void *priv)
+{
+    slow_reader_t *r = (slow_reader_t *)priv;
+    int token = epoch_enter(r->epoch);
+    usleep(200000);
+    __sync_fetch_and_add(&r->done, 1);
+    epoch_exit(r->epoch, token);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    ut_init(basename(argv[0]));
+
+    ut_testing("epoch_create()");
+    epoch_t *epoch = epoch_create();
+    ut_validate_int(epoch != NULL, 1);
+
+    ut_testing("epoch_synchronize() returns right away with no readers");
+    epoch_synchronize(epoch);
+    ut_success();
+
+    ut_testing("Nested read sections");
+    int outer = epoch_enter(epoch);
+    int inner = epoch_enter(epoch);
+    epoch_exit(epoch, inner);
+    epoch_exit(epoch, outer);
+    epoch_synchronize(epoch);
+    ut_success();
+
+    ut_testing("epoch_synchronize() waits for the readers in progress");
+    slow_reader_t slow = { epoch, 0 };
+    pthread_t th;
+    pthread_create(&th, NULL, slow_reader, &slow);
+    usleep(50000);
+    epoch_synchronize(epoch);
+    int done = __sync_fetch_and_add(&slow.done, 0);
+    pthread_join(th, NULL);
+    ut_validate_int(done, 1);
+
+    ut_testing("Replaced objects are never seen released by the readers (%d swaps)", NUM_SWAPS);
+    shared_t s;
+    memset(&s, 0, sizeof(s));
+    s.epoch = epoch;
+    s.object = calloc(1, sizeof(object_t));
+    s.object->alive = 1;
+    pthread_t readers[NUM_READERS];
+    for (i = 0; i < NUM_READERS; i++)
+        pthread_create(&readers[i], NULL, reader, &s);
+
+    // let the readers start
+    while (__sync_fetch_and_add(&s.reads, 0) < NUM_READERS)
+        usleep(1000);
+
+    object_t **retired = calloc(NUM_SWAPS, sizeof(object_t *));
+    for (i = 0; i < NUM_SWAPS; i++) {
+        object_t *object = calloc(1, sizeof(object_t));
+        object->alive = 1;
+        object_t *old = __sync_lock_test_and_set(&s.object, object);
+        epoch_synchronize(epoch);
+        // not freed, so that a reader still using it would notice
+        __sync_fetch_and_sub(&old->alive, 1);
+        retired[i] = old;
+        sched_yield();
+    }
+
+    __sync_fetch_and_add(&s.quit, 1);
+    for (i = 0; i < NUM_READERS; i++)
+        pthread_join(readers[i], NULL);
+    for (i = 0; i < NUM_SWAPS; i++)
+        free(retired[i]);
+    free(retired);
+    free(s.object);
+
+    if (!s.dead_reads && s.reads > 0)
+        ut_success();
+    else
+        ut_failure("reads: %d, released objects seen: %d", s.reads, s.dead_reads);
+
+    epoch_destroy(epoch);
+
+    ut_summary();
+    exit(ut_failed);
+}
@@ -0,0 +1,243 @@
+#include <shardcache.h>
+#include <messaging.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ut.h>
+#include <libgen.h>
+
+// a peer running an older version of the protocol,
+// it knows about EVICT but not about EVICT_MULTI
+typedef struct {
+    int fd;
+    int quit;
+    int multi;    // EVICT_MULTI commands received
+    int single;   // EVICT commands received
+    int drop;     // close the connection when receiving EVICT_MULTI
+                  // instead of replying with an error
+    pthread_mutex_t lock;
+} legacy_peer_t;
+
+typedef struct {
+    legacy_peer_t *peer;
+    int fd;
+} legacy_connection_t;
+
+static int
+legacy_peer_reply(int fd, char status)
+{
+    shardcache_record_t record = { &status, 1 };
+    fbuf_t out = FBUF_STATIC_INITIALIZER;
+    build_message(SHC_HDR_RESPONSE, &record, 1, &out, global_protocol_version(-1));
+    int rc = write(fd, fbuf_data(&out), fbuf_used(&out));
+    fbuf_destroy(&out);
+    return rc;
+}
+
+static void *
+legacy_peer_connection(void *priv)
+{
+    legacy_connection_t *conn = (legacy_connection_t *)priv;
+    legacy_peer_t *peer = conn->peer;
+    for (;;) {
+        fbuf_t record = FBUF_STATIC_INITIALIZER;
+        fbuf_t *records[1] = { &record };
+        shardcache_hdr_t hdr = 0;
+        int rc = read_message(conn->fd, records, 1, &hdr, 1);
+        fbuf_destroy(&record);
+        if (rc < 0)
+            break;
+
+        pthread_mutex_lock(&peer->lock);
+        if (hdr == SHC_HDR_EVICT_MULTI)
+            peer->multi++;
+        else if (hdr == SHC_HDR_EVICT)
+            peer->single++;
+        int drop = peer->drop;
+        pthread_mutex_unlock(&peer->lock);
+
+        if (hdr == SHC_HDR_EVICT_MULTI && drop)
+            break;
+
+        if (legacy_peer_reply(conn->fd, hdr == SHC_HDR_EVICT ? SHC_RES_OK : SHC_RES_ERR) <= 0)
+            break;
+    }
+    close(conn->fd);
+    free(conn);
+    return NULL;
+}
+
+static void *
+legacy_peer_run(void *priv)
+{
+    legacy_peer_t *peer = (legacy_peer_t *)priv;
+    while (!__sync_fetch_and_add(&peer->quit, 0)) {
+        struct pollfd pfd = { peer->fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) != 1)
+            continue;
+        int fd = accept(peer->fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        legacy_connection_t *conn = malloc(sizeof(legacy_connection_t));
+        conn->peer = peer;
+        conn->fd = fd;
+        pthread_t th;
+        pthread_create(&th, NULL, legacy_peer_connection, conn);
+        pthread_detach(th);
+    }
+    return NULL;
+}
+
+static int
+legacy_peer_start(legacy_peer_t *peer, int port, pthread_t *th)
+{
+    memset(peer, 0, sizeof(legacy_peer_t));
+    pthread_mutex_init(&peer->lock, NULL);
+    peer->fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(peer->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (bind(peer->fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 || listen(peer->fd, 128) != 0)
+        return -1;
+    return pthread_create(th, NULL, legacy_peer_run, peer);
+}
+
+static int
+legacy_peer_count(legacy_peer_t *peer, int *multi)
+{
+    pthread_mutex_lock(&peer->lock);
+    int single = peer->single;
+    if (multi)
+        *multi = peer->multi;
+    pthread_mutex_unlock(&peer->lock);
+    return single;
+}
+
+// change num_keys keys owned by the local node,
+// each change must be propagated to the other nodes
+static int
+change_keys(shardcache_t *cache, char *prefix, int num_keys)
+{
+    int changed = 0;
+    int i;
+    for (i = 0; changed < num_keys && i < num_keys * 100; i++) {
+        char key[64];
+        snprintf(key, sizeof(key), "%s_%d", prefix, i);
+        if (!shardcache_test_ownership(cache, key, strlen(key), NULL, NULL))
+            continue;
+        // only overwriting an existing value triggers the eviction
+        shardcache_set(cache, key, strlen(key), "value1", 6, 0, 0, 0, NULL, NULL);
+        shardcache_set(cache, key, strlen(key), "value2", 6, 0, 0, 0, NULL, NULL);
+        changed++;
+    }
+    return changed;
+}
+
+static int
+wait_for_single(legacy_peer_t *peer, int expected)
+{
+    int i;
+    for (i = 0; i < 50 && legacy_peer_count(peer, NULL) < expected; i++)
+        usleep(100000);
+    return legacy_peer_count(peer, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int num_nodes = 2;
+    shardcache_node_t *nodes[num_nodes];
+
+    shardcache_log_init("shardcached", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    for (i = 0; i < num_nodes; i++) {
+        char label[32];
+        sprintf(label, "peer%d", i);
+        char address[32];
+        sprintf(address, "127.0.0.1:978%d", i);
+        char *address_array[1] = { address };
+        nodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+
+    legacy_peer_t legacy;
+    pthread_t legacy_th;
+    ut_testing("legacy_peer_start(127.0.0.1:9781)");
+    ut_validate_int(legacy_peer_start(&legacy, 9781, &legacy_th), 0);
+
+    ut_testing("shardcache_create(peer0, nodes, num_nodes, NULL, 5, 0, 1<<29)");
+    shardcache_t *cache = shardcache_create("peer0", nodes, num_nodes, NULL, 5, 0, 1<<29);
+    if (!cache) {
+        ut_failure("Errors creating the shardcache instance");
+        exit(-1);
+    }
+    ut_success();
+
+    sleep(1); // let the server complete its startup
+
+    ut_testing("A peer rejecting EVICT_MULTI receives single EVICT commands for all the changed keys");
+    int changed = change_keys(cache, "rejected", 20);
+    int multi = 0;
+    int single = wait_for_single(&legacy, changed);
+    legacy_peer_count(&legacy, &multi);
+    if (changed == 20 && single == changed && multi > 0)
+        ut_success();
+    else
+        ut_failure("changed %d keys, the peer received %d EVICT and %d EVICT_MULTI commands",
+                   changed, single, multi);
+
+    ut_testing("Once detected EVICT_MULTI isn't sent anymore to the same peer");
+    changed = change_keys(cache, "detected", 20);
+    int multi_before = multi;
+    single = wait_for_single(&legacy, single + changed);
+    legacy_peer_count(&legacy, &multi);
+    ut_validate_int(multi, multi_before);
+
+    shardcache_destroy(cache);
+
+    // a new instance starts again probing the peer
+    // which, this time, drops the connection on EVICT_MULTI
+    pthread_mutex_lock(&legacy.lock);
+    legacy.drop = 1;
+    legacy.single = 0;
+    legacy.multi = 0;
+    pthread_mutex_unlock(&legacy.lock);
+
+    cache = shardcache_create("peer0", nodes, num_nodes, NULL, 5, 0, 1<<29);
+    sleep(1);
+
+    ut_testing("A peer dropping the connection on EVICT_MULTI receives single EVICT commands");
+    changed = change_keys(cache, "dropped", 20);
+    single = wait_for_single(&legacy, changed);
+    legacy_peer_count(&legacy, &multi);
+    if (single == changed && multi == 2)
+        ut_success();
+    else
+        ut_failure("changed %d keys, the peer received %d EVICT and %d EVICT_MULTI commands",
+                   changed, single, multi);
+
+    shardcache_destroy(cache);
+
+    __sync_fetch_and_add(&legacy.quit, 1);
+    pthread_join(legacy_th, NULL);
+    close(legacy.fd);
+
+    for (i = 0; i < num_nodes; i++)
+        shardcache_node_destroy(nodes[i]);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
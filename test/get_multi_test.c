@@ -0,0 +1,261 @@
+#include <shardcache_client.h>
+#include <messaging.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_NODES 2
+#define NUM_KEYS 1000
+
+// bigger than half of the max amount of data buffered by a node
+// for the response to a GET_MULTI command (64MB)
+#define BIG_VALUE_SIZE (33<<20)
+
+// the key in the middle of the array doesn't exist if 'missing' is true
+static shc_multi_item_t **
+create_items(int num_items, int missing)
+{
+    shc_multi_item_t **items = calloc(num_items + 1, sizeof(shc_multi_item_t *));
+    int i;
+    for (i = 0; i < num_items; i++) {
+        char key[32];
+        if (missing && i == num_items / 2)
+            snprintf(key, sizeof(key), "missing_key");
+        else
+            snprintf(key, sizeof(key), "key%d", i);
+        items[i] = shc_multi_item_create(key, strlen(key), NULL, 0);
+    }
+    return items;
+}
+
+static void
+destroy_items(shc_multi_item_t **items)
+{
+    int i;
+    for (i = 0; items[i]; i++)
+        shc_multi_item_destroy(items[i]);
+    free(items);
+}
+
+// returns the number of items not holding the expected value
+// (the item at index 'missing' is expected to be empty)
+static int
+check_items(shc_multi_item_t **items, int missing)
+{
+    int i;
+    int bad = 0;
+    for (i = 0; items[i]; i++) {
+        char expected[32];
+        snprintf(expected, sizeof(expected), "value%d", i);
+        if (i == missing) {
+            if (items[i]->dlen)
+                bad++;
+        } else if (items[i]->dlen != strlen(expected) || memcmp(items[i]->data, expected, items[i]->dlen) != 0) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+// sends a SET_MULTI or DELETE_MULTI command for 'key1' and 'key2'
+// directly to a node, returns the status in the response (or -1)
+static int
+send_multi_command(char *address, unsigned char hdr)
+{
+    int fd = connect_to_peer(address, 1000);
+    if (fd < 0)
+        return -1;
+
+    fbuf_t keys = FBUF_STATIC_INITIALIZER;
+    fbuf_t values = FBUF_STATIC_INITIALIZER;
+    fbuf_t *key_items[2] = { fbuf_create(0), fbuf_create(0) };
+    fbuf_t *value_items[2] = { fbuf_create(0), fbuf_create(0) };
+    int i;
+    for (i = 0; i < 2; i++) {
+        fbuf_printf(key_items[i], "key%d", i + 1);
+        fbuf_printf(value_items[i], "new_value%d", i + 1);
+    }
+    array_to_record(2, key_items, &keys);
+    array_to_record(2, value_items, &values);
+
+    shardcache_record_t records[2] = {
+        { .v = fbuf_data(&keys), .l = fbuf_used(&keys) },
+        { .v = fbuf_data(&values), .l = fbuf_used(&values) }
+    };
+
+    int status = -1;
+    if (write_message(fd, hdr, records, hdr == SHC_HDR_SET_MULTI ? 2 : 1) == 0) {
+        fbuf_t resp = FBUF_STATIC_INITIALIZER;
+        fbuf_t *respp[1] = { &resp };
+        shardcache_hdr_t rhdr = 0;
+        if (read_message(fd, respp, 1, &rhdr, 0) == 1 &&
+            rhdr == SHC_HDR_RESPONSE && fbuf_used(&resp) == 1)
+        {
+            status = (unsigned char)fbuf_data(&resp)[0];
+        }
+        fbuf_destroy(&resp);
+    }
+
+    for (i = 0; i < 2; i++) {
+        fbuf_free(key_items[i]);
+        fbuf_free(value_items[i]);
+    }
+    fbuf_destroy(&keys);
+    fbuf_destroy(&values);
+    close(fd);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    shardcache_node_t *nodes[NUM_NODES];
+    shardcache_t *servers[NUM_NODES];
+
+    shardcache_log_init("shardcached", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    for (i = 0; i < NUM_NODES; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "peer%d", i);
+        char address[32];
+        snprintf(address, sizeof(address), "127.0.0.1:981%d", i);
+        char *address_array[1] = { address };
+        nodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+
+    for (i = 0; i < NUM_NODES; i++) {
+        servers[i] = shardcache_create(shardcache_node_get_label(nodes[i]), nodes, NUM_NODES, NULL, 5, 0, 1<<20);
+        if (!servers[i]) {
+            ut_testing("shardcache_create()");
+            ut_failure("Errors creating the shardcache instance");
+            ut_summary();
+            exit(ut_failed);
+        }
+        shardcache_iomux_run_timeout_low(servers[i], 5000);
+    }
+
+    sleep(1); // let the servers complete their startup
+
+    shardcache_client_t *client = shardcache_client_create(nodes, NUM_NODES);
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32], val[32];
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(val, sizeof(val), "value%d", i);
+        shardcache_client_set(client, key, strlen(key), val, strlen(val), 0);
+    }
+
+    int sizes[] = { 10, 100, 1000 };
+    for (i = 0; i < sizeof(sizes) / sizeof(int); i++) {
+        ut_testing("shardcache_client_get_multi() with %d keys", sizes[i]);
+        shc_multi_item_t **items = create_items(sizes[i], 0);
+        int rc = shardcache_client_get_multi(client, items);
+        int bad = check_items(items, -1);
+        if (rc == 0 && !bad)
+            ut_success();
+        else
+            ut_failure("rc: %d, bad values: %d", rc, bad);
+        destroy_items(items);
+    }
+
+    ut_testing("Missing keys are returned empty");
+    shc_multi_item_t **items = create_items(100, 1);
+    int rc = shardcache_client_get_multi(client, items);
+    int bad = check_items(items, 50);
+    if (rc == 0 && !bad)
+        ut_success();
+    else
+        ut_failure("rc: %d, bad values: %d", rc, bad);
+    destroy_items(items);
+
+    ut_testing("Duplicate keys get the same value");
+    items = calloc(4, sizeof(shc_multi_item_t *));
+    items[0] = shc_multi_item_create("key1", 4, NULL, 0);
+    items[1] = shc_multi_item_create("key2", 4, NULL, 0);
+    items[2] = shc_multi_item_create("key1", 4, NULL, 0);
+    rc = shardcache_client_get_multi(client, items);
+    if (rc == 0 && items[2]->dlen == 6 && memcmp(items[2]->data, "value1", 6) == 0 &&
+        items[0]->dlen == 6 && memcmp(items[0]->data, "value1", 6) == 0)
+    {
+        ut_success();
+    } else {
+        ut_failure("rc: %d", rc);
+    }
+    destroy_items(items);
+
+    ut_testing("Pipelined GETs are used if multi_command_max_keys is 0");
+    shardcache_client_multi_command_max_keys(client, 0);
+    items = create_items(100, 0);
+    rc = shardcache_client_get_multi(client, items);
+    bad = check_items(items, -1);
+    if (rc == 0 && !bad)
+        ut_success();
+    else
+        ut_failure("rc: %d, bad values: %d", rc, bad);
+    destroy_items(items);
+    shardcache_client_multi_command_max_keys(client, 256);
+
+    ut_testing("Values not fitting in the GET_MULTI response are fetched one by one");
+    char *big_value = malloc(BIG_VALUE_SIZE);
+    memset(big_value, 'x', BIG_VALUE_SIZE);
+    // the keys must be owned by the same node to be requested at once
+    char *big_keys[2] = { NULL, NULL };
+    int found = 0;
+    char owner[256];
+    for (i = 0; found < 2 && i < NUM_KEYS; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "big_key%d", i);
+        size_t len = sizeof(owner);
+        shardcache_test_ownership(servers[0], key, strlen(key), owner, &len);
+        if (strcmp(owner, "peer0") == 0)
+            big_keys[found++] = strdup(key);
+    }
+    for (i = 0; i < found; i++)
+        shardcache_client_set(client, big_keys[i], strlen(big_keys[i]), big_value, BIG_VALUE_SIZE, 0);
+    items = calloc(found + 1, sizeof(shc_multi_item_t *));
+    for (i = 0; i < found; i++)
+        items[i] = shc_multi_item_create(big_keys[i], strlen(big_keys[i]), NULL, 0);
+    rc = shardcache_client_get_multi(client, items);
+    bad = 0;
+    for (i = 0; i < found; i++) {
+        if (items[i]->dlen != BIG_VALUE_SIZE || memcmp(items[i]->data, big_value, BIG_VALUE_SIZE) != 0)
+            bad++;
+        free(big_keys[i]);
+    }
+    if (found == 2 && rc == 0 && !bad)
+        ut_success();
+    else
+        ut_failure("rc: %d, bad values: %d", rc, bad);
+    destroy_items(items);
+    free(big_value);
+
+    ut_testing("SET_MULTI and DELETE_MULTI are refused by the nodes");
+    int set_status = send_multi_command("127.0.0.1:9810", SHC_HDR_SET_MULTI);
+    int del_status = send_multi_command("127.0.0.1:9810", SHC_HDR_DELETE_MULTI);
+    void *value = NULL;
+    size_t size = shardcache_client_get(client, "key1", 4, &value);
+    // the keys are left untouched
+    if (set_status == SHC_RES_ERR && del_status == SHC_RES_ERR &&
+        size == 6 && memcmp(value, "value1", 6) == 0)
+    {
+        ut_success();
+    } else {
+        ut_failure("statuses: %d/%d, size: %d", set_status, del_status, (int)size);
+    }
+    free(value);
+
+    shardcache_client_destroy(client);
+
+    for (i = 0; i < NUM_NODES; i++) {
+        shardcache_destroy(servers[i]);
+        shardcache_node_destroy(nodes[i]);
+    }
+
+    ut_summary();
+    exit(ut_failed);
+}
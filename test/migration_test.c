@@ -0,0 +1,167 @@
+#include <shardcache.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define MEM_STORAGE "storage/mem.storage"
+
+#define NUM_KEYS 2000
+#define NUM_NODES 3
+
+// returns the number of nodes known by the instance once the migration
+// has been completed (or the number of nodes it started with on timeout)
+static int
+wait_migration(shardcache_t *cache, int expected)
+{
+    int i;
+    int num_nodes = 0;
+    for (i = 0; i < 1000; i++) {
+        // the first ownership test after the migrator is done
+        // swaps the continua
+        shardcache_test_ownership(cache, "key_0", 5, NULL, NULL);
+        shardcache_node_t **nodes = shardcache_get_nodes(cache, &num_nodes);
+        shardcache_free_nodes(nodes, num_nodes);
+        if (num_nodes == expected)
+            break;
+        usleep(10000);
+    }
+    return num_nodes;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    shardcache_log_init("shardcached", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    char *labels[NUM_NODES] = { "peer0", "peer1", "peer2" };
+    char *addresses[NUM_NODES] = { "127.0.0.1:9780", "127.0.0.1:9781", "127.0.0.1:9782" };
+    shardcache_node_t *nodes[NUM_NODES];
+    for (i = 0; i < NUM_NODES; i++)
+        nodes[i] = shardcache_node_create(labels[i], &addresses[i], 1);
+
+    char *options[] = { "shards", "4", NULL };
+    shardcache_storage_t *storages[NUM_NODES];
+    shardcache_t *caches[NUM_NODES];
+
+    ut_testing("shardcache_create() for the two initial nodes");
+    int failed = 0;
+    for (i = 0; i < NUM_NODES - 1; i++) {
+        storages[i] = shardcache_storage_load(MEM_STORAGE, options);
+        caches[i] = storages[i] ? shardcache_create(labels[i], nodes, NUM_NODES - 1, storages[i], 2, 0, 1<<20) : NULL;
+        if (!caches[i])
+            failed++;
+    }
+    if (failed) {
+        ut_failure("Can't create the shardcache instances");
+        ut_summary();
+        exit(ut_failed);
+    }
+    ut_success();
+
+    ut_testing("The keys are distributed among the two nodes");
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32], value[32];
+        snprintf(key, sizeof(key), "key_%d", i);
+        snprintf(value, sizeof(value), "value_%d", i);
+        shardcache_set(caches[0], key, strlen(key), value, strlen(value), 0, 0, 0, NULL, NULL);
+    }
+    int count0 = storages[0]->count(storages[0]->priv);
+    int count1 = storages[1]->count(storages[1]->priv);
+    if (count0 > 0 && count1 > 0 && count0 + count1 == NUM_KEYS)
+        ut_success();
+    else
+        ut_failure("peer0: %d keys, peer1: %d keys", count0, count1);
+
+    ut_testing("shardcache_migration_abort() keeps the current nodes");
+    shardcache_migration_begin(caches[0], nodes, NUM_NODES, 0);
+    int num_migration_nodes = 0;
+    shardcache_node_t **migration_nodes = shardcache_get_migration_nodes(caches[0], &num_migration_nodes);
+    if (migration_nodes)
+        shardcache_free_nodes(migration_nodes, num_migration_nodes);
+    int rc = shardcache_migration_abort(caches[0]);
+    int num_nodes = 0;
+    shardcache_node_t **current_nodes = shardcache_get_nodes(caches[0], &num_nodes);
+    shardcache_free_nodes(current_nodes, num_nodes);
+    migration_nodes = shardcache_get_migration_nodes(caches[0], &num_migration_nodes);
+    if (migration_nodes)
+        shardcache_free_nodes(migration_nodes, num_migration_nodes);
+    if (rc == 0 && num_nodes == NUM_NODES - 1 && num_migration_nodes == 0)
+        ut_success();
+    else
+        ut_failure("rc: %d, nodes: %d, migration nodes: %d", rc, num_nodes, num_migration_nodes);
+
+    storages[NUM_NODES - 1] = shardcache_storage_load(MEM_STORAGE, options);
+    caches[NUM_NODES - 1] = storages[NUM_NODES - 1]
+                          ? shardcache_create(labels[NUM_NODES - 1], nodes, NUM_NODES,
+                                              storages[NUM_NODES - 1], 2, 0, 1<<20)
+                          : NULL;
+
+    ut_testing("shardcache_migration_begin() moves the keys to the new node");
+    shardcache_migration_threads(caches[0], 2);
+    shardcache_migration_batch_size(caches[0], 16);
+    rc = caches[NUM_NODES - 1] ? shardcache_migration_begin(caches[0], nodes, NUM_NODES, 1) : -1;
+    int nodes0 = rc == 0 ? wait_migration(caches[0], NUM_NODES) : 0;
+    int nodes1 = rc == 0 ? wait_migration(caches[1], NUM_NODES) : 0;
+    int count2 = caches[NUM_NODES - 1] ? storages[NUM_NODES - 1]->count(storages[NUM_NODES - 1]->priv) : 0;
+    if (rc == 0 && nodes0 == NUM_NODES && nodes1 == NUM_NODES && count2 > 0)
+        ut_success();
+    else
+        ut_failure("rc: %d, peer0 nodes: %d, peer1 nodes: %d, keys on peer2: %d", rc, nodes0, nodes1, count2);
+
+    ut_testing("Each key is stored by its new owner only");
+    int misplaced = 0;
+    int missing = 0;
+    for (i = 0; rc == 0 && i < NUM_KEYS; i++) {
+        char key[32], owner[64];
+        size_t olen = sizeof(owner);
+        snprintf(key, sizeof(key), "key_%d", i);
+        shardcache_test_ownership(caches[0], key, strlen(key), owner, &olen);
+        int n;
+        for (n = 0; n < NUM_NODES; n++) {
+            int exists = storages[n]->exist(key, strlen(key), storages[n]->priv);
+            if (strcmp(owner, labels[n]) == 0 && !exists)
+                missing++;
+            else if (strcmp(owner, labels[n]) != 0 && exists)
+                misplaced++;
+        }
+    }
+    if (rc == 0 && !missing && !misplaced)
+        ut_success();
+    else
+        ut_failure("missing: %d, misplaced: %d", missing, misplaced);
+
+    ut_testing("All the keys can be read from any node after the migration");
+    int bad = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32], expected[32];
+        snprintf(key, sizeof(key), "key_%d", i);
+        snprintf(expected, sizeof(expected), "value_%d", i);
+        void *value = NULL;
+        size_t vlen = 0;
+        shardcache_t *cache = caches[i % NUM_NODES];
+        if (!cache || shardcache_get_sync(cache, key, strlen(key), &value, &vlen, NULL) != 0 ||
+            vlen != strlen(expected) || memcmp(value, expected, vlen) != 0)
+        {
+            bad++;
+        }
+        free(value);
+    }
+    ut_validate_int(bad, 0);
+
+    for (i = 0; i < NUM_NODES; i++) {
+        if (caches[i])
+            shardcache_destroy(caches[i]);
+        if (storages[i])
+            shardcache_storage_dispose(storages[i]);
+        shardcache_node_destroy(nodes[i]);
+    }
+
+    ut_summary();
+    exit(ut_failed);
+}
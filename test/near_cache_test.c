@@ -0,0 +1,124 @@
+#include <shardcache_client.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_NODES 2
+
+// returns 1 if the client gets the expected value (NULL for a missing key)
+// within a couple of seconds
+static int
+wait_value(shardcache_client_t *client, char *key, char *expected)
+{
+    int i;
+    for (i = 0; i < 200; i++) {
+        void *value = NULL;
+        size_t size = shardcache_client_get(client, key, strlen(key), &value);
+        int match = expected ? (size == strlen(expected) && memcmp(value, expected, size) == 0)
+                             : (size == 0);
+        free(value);
+        if (match)
+            return 1;
+        usleep(10000);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    shardcache_node_t *nodes[NUM_NODES];
+    shardcache_t *servers[NUM_NODES];
+
+    shardcache_log_init("shardcached", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    for (i = 0; i < NUM_NODES; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "peer%d", i);
+        char address[32];
+        snprintf(address, sizeof(address), "127.0.0.1:983%d", i);
+        char *address_array[1] = { address };
+        nodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+
+    for (i = 0; i < NUM_NODES; i++) {
+        servers[i] = shardcache_create(shardcache_node_get_label(nodes[i]), nodes, NUM_NODES, NULL, 5, 0, 1<<20);
+        if (!servers[i]) {
+            ut_testing("shardcache_create()");
+            ut_failure("Errors creating the shardcache instance");
+            ut_summary();
+            exit(ut_failed);
+        }
+        shardcache_iomux_run_timeout_low(servers[i], 5000);
+    }
+
+    sleep(1); // let the servers complete their startup
+
+    shardcache_client_t *client = shardcache_client_create(nodes, NUM_NODES);
+    shardcache_client_t *writer = shardcache_client_create(nodes, NUM_NODES);
+
+    ut_testing("shardcache_client_near_cache_stats() fails if the cache is disabled");
+    shardcache_client_near_cache_stats_t stats;
+    ut_validate_int(shardcache_client_near_cache_stats(client, &stats), -1);
+
+    ut_testing("shardcache_client_near_cache_enable() subscribes to all the nodes");
+    int rc = shardcache_client_near_cache_enable(client, 1<<20, 0);
+    memset(&stats, 0, sizeof(stats));
+    for (i = 0; i < 200 && stats.subscribed < NUM_NODES; i++) {
+        shardcache_client_near_cache_stats(client, &stats);
+        usleep(10000);
+    }
+    ut_validate_int(rc == 0 && stats.subscribed == NUM_NODES, 1);
+
+    ut_testing("Values read twice are served from the local cache");
+    shardcache_client_set(writer, "key1", 4, "value1", 6, 0);
+    int ok = wait_value(client, "key1", "value1") && wait_value(client, "key1", "value1");
+    shardcache_client_near_cache_stats(client, &stats);
+    if (ok && stats.hits >= 1 && stats.count >= 1)
+        ut_success();
+    else
+        ut_failure("hits: %d, misses: %d, count: %d", (int)stats.hits, (int)stats.misses, (int)stats.count);
+
+    ut_testing("Values changed by another client are invalidated");
+    uint64_t invalidations = stats.invalidations;
+    shardcache_client_set(writer, "key1", 4, "value2", 6, 0);
+    ok = wait_value(client, "key1", "value2");
+    shardcache_client_near_cache_stats(client, &stats);
+    ut_validate_int(ok && stats.invalidations > invalidations, 1);
+
+    ut_testing("Values deleted by another client are invalidated");
+    shardcache_client_del(writer, "key1", 4);
+    ut_validate_int(wait_value(client, "key1", NULL), 1);
+
+    ut_testing("Local writes invalidate the cached value right away");
+    shardcache_client_set(client, "key2", 4, "value1", 6, 0);
+    wait_value(client, "key2", "value1");
+    shardcache_client_set(client, "key2", 4, "value2", 6, 0);
+    void *value = NULL;
+    size_t size = shardcache_client_get(client, "key2", 4, &value);
+    ut_validate_buffer(value, size, "value2", 6);
+    free(value);
+
+    ut_testing("Expired volatile values are invalidated");
+    shardcache_client_set(writer, "key3", 4, "volatile", 8, 1);
+    ok = wait_value(client, "key3", "volatile");
+    // the expiration timers have a 100ms resolution
+    sleep(2);
+    ut_validate_int(ok && wait_value(client, "key3", NULL), 1);
+
+    shardcache_client_destroy(writer);
+    shardcache_client_destroy(client);
+
+    for (i = 0; i < NUM_NODES; i++) {
+        shardcache_destroy(servers[i]);
+        shardcache_node_destroy(nodes[i]);
+    }
+
+    ut_summary();
+    exit(ut_failed);
+}
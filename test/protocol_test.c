@@ -0,0 +1,173 @@
+#include <messaging.h>
+#include <async_reader.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_RECORDS 3
+
+typedef struct {
+    fbuf_t records[NUM_RECORDS];
+    int done;
+    int errors;
+} parsed_message_t;
+
+static int
+collect_record(void *data, size_t len, int idx, size_t total_len, void *priv)
+{
+    parsed_message_t *msg = (parsed_message_t *)priv;
+    if (idx >= 0 && idx < NUM_RECORDS && data && len)
+        fbuf_add_binary(&msg->records[idx], data, len);
+    else if (idx == -1)
+        msg->done++;
+    else if (idx == -2)
+        msg->errors++;
+    return 0;
+}
+
+// feed the message to an async reader in small slices
+// (so that records and headers are split across reads)
+static int
+parse_message(fbuf_t *input, parsed_message_t *msg, int *version)
+{
+    memset(msg, 0, sizeof(parsed_message_t));
+    async_read_ctx_t *ctx = async_read_context_create(collect_record, msg);
+    char *data = fbuf_data(input);
+    int used = fbuf_used(input);
+    int offset = 0;
+    async_read_context_state_t state = SHC_STATE_READING_NONE;
+    while (offset < used && state != SHC_STATE_READING_ERR && !msg->done) {
+        int len = used - offset < 7 ? used - offset : 7;
+        int processed = 0;
+        state = async_read_context_input_data(ctx, data + offset, len, &processed);
+        if (!processed && state != SHC_STATE_READING_ERR)
+            state = async_read_context_update(ctx);
+        offset += processed;
+    }
+    if (version)
+        *version = async_read_context_protocol_version(ctx);
+    async_read_context_destroy(ctx);
+    return (msg->done == 1 && !msg->errors) ? 0 : -1;
+}
+
+static void
+parsed_message_destroy(parsed_message_t *msg)
+{
+    int i;
+    for (i = 0; i < NUM_RECORDS; i++)
+        fbuf_destroy(&msg->records[i]);
+}
+
+static void *
+thread_protocol_version(void *priv)
+{
+    *((int *)priv) = messaging_protocol_version();
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    char small[] = "small value";
+    char *big = malloc(1<<16);
+    int i;
+    for (i = 0; i < (1<<16); i++)
+        big[i] = "abcd"[(i / 64) % 4];
+
+    shardcache_record_t records[NUM_RECORDS] = {
+        { small, strlen(small) },
+        { NULL, 0 },
+        { big, 1<<16 }
+    };
+
+    int version;
+    for (version = 1; version <= SHC_PROTOCOL_VERSION_MAX; version++) {
+        ut_testing("build_message() + async reader round trip using protocol version %d", version);
+        fbuf_t out = FBUF_STATIC_INITIALIZER;
+        parsed_message_t msg;
+        int parsed_version = 0;
+        if (build_message(SHC_HDR_SET, records, NUM_RECORDS, &out, version) != 0) {
+            ut_failure("Can't build the message");
+        } else if (parse_message(&out, &msg, &parsed_version) != 0) {
+            ut_failure("Can't parse the message");
+            parsed_message_destroy(&msg);
+        } else {
+            int ok = (parsed_version == version);
+            for (i = 0; i < NUM_RECORDS; i++) {
+                if (fbuf_used(&msg.records[i]) != records[i].l ||
+                    (records[i].l && memcmp(fbuf_data(&msg.records[i]), records[i].v, records[i].l) != 0))
+                {
+                    ok = 0;
+                }
+            }
+            if (ok)
+                ut_success();
+            else
+                ut_failure("The parsed records don't match (version %d)", parsed_version);
+            parsed_message_destroy(&msg);
+        }
+        fbuf_destroy(&out);
+    }
+
+    ut_testing("Protocol version 3 compresses the records bigger than the threshold");
+    fbuf_t compressed = FBUF_STATIC_INITIALIZER;
+    fbuf_t plain = FBUF_STATIC_INITIALIZER;
+    messaging_thread_settings(-1, 1024);
+    build_message(SHC_HDR_SET, records, NUM_RECORDS, &compressed, 3);
+    messaging_thread_settings(-1, 0);
+    build_message(SHC_HDR_SET, records, NUM_RECORDS, &plain, 3);
+    messaging_thread_settings(-1, -1);
+    if (fbuf_used(&compressed) < (1<<14) && fbuf_used(&plain) > (1<<16))
+        ut_success();
+    else
+        ut_failure("compressed: %d bytes, plain: %d bytes", fbuf_used(&compressed), fbuf_used(&plain));
+
+    ut_testing("A compressed message is decompressed by the reader");
+    parsed_message_t msg;
+    if (parse_message(&compressed, &msg, NULL) == 0 &&
+        fbuf_used(&msg.records[2]) == (1<<16) &&
+        memcmp(fbuf_data(&msg.records[2]), big, 1<<16) == 0)
+    {
+        ut_success();
+    } else {
+        ut_failure("The decompressed record doesn't match");
+    }
+    parsed_message_destroy(&msg);
+
+    ut_testing("A corrupted version 3 message is rejected (crc mismatch)");
+    fbuf_data(&plain)[fbuf_used(&plain) / 2] ^= 0x5a;
+    ut_validate_int(parse_message(&plain, &msg, NULL), -1);
+    parsed_message_destroy(&msg);
+
+    fbuf_destroy(&compressed);
+    fbuf_destroy(&plain);
+
+    ut_testing("varint_encode(300) == 0xAC 0x02");
+    unsigned char varint[SHC_VARINT_MAXLEN];
+    int vlen = varint_encode(300, varint);
+    ut_validate_buffer((char *)varint, vlen, "\xAC\x02", 2);
+
+    ut_testing("messaging_thread_settings() applies only to the calling thread");
+    int global_version = global_protocol_version(-1);
+    int other_version = 0;
+    messaging_thread_settings(global_version == 3 ? 2 : 3, -1);
+    int own_version = messaging_protocol_version();
+    pthread_t th;
+    pthread_create(&th, NULL, thread_protocol_version, &other_version);
+    pthread_join(th, NULL);
+    messaging_thread_settings(-1, -1);
+    ut_validate_int(own_version != global_version &&
+                    other_version == global_version &&
+                    messaging_protocol_version() == global_version, 1);
+
+    free(big);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
@@ -0,0 +1,104 @@
+#include <shardcache_node.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_SELECTIONS 1000
+
+// an address is measured again if it hasn't been selected for 5 seconds
+#define PROBE_INTERVAL 5
+
+// account a request which took 'usecs' microseconds
+static void
+track_request(shardcache_node_t *node, int index, int usecs)
+{
+    struct timeval start, now, elapsed = { 0, usecs };
+    gettimeofday(&now, NULL);
+    timersub(&now, &elapsed, &start);
+    shardcache_node_address_begin(node, index);
+    shardcache_node_address_end(node, index, &start, 0);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    char *addresses[2] = { "127.0.0.1:9850", "127.0.0.1:9851" };
+
+    ut_init(basename(argv[0]));
+
+    shardcache_node_t *node = shardcache_node_create("peer0", addresses, 2);
+
+    ut_testing("The address with the lowest latency is preferred");
+    for (i = 0; i < 10; i++) {
+        track_request(node, 0, 100);
+        track_request(node, 1, 100000);
+    }
+    int selected[2] = { 0, 0 };
+    for (i = 0; i < NUM_SELECTIONS; i++) {
+        int index = shardcache_node_select_address_index(node);
+        if (index == 0 || index == 1)
+            selected[index]++;
+        // keep the slow address out of the probes
+        track_request(node, index, index ? 100000 : 100);
+    }
+    if (selected[0] == NUM_SELECTIONS)
+        ut_success();
+    else
+        ut_failure("selections: %d/%d", selected[0], selected[1]);
+
+    ut_testing("The outstanding requests are accounted");
+    shardcache_node_address_begin(node, 0);
+    shardcache_node_address_stats_t stats;
+    shardcache_node_get_address_stats(node, 0, &stats);
+    int outstanding = stats.outstanding;
+    shardcache_node_address_end(node, 0, NULL, 0);
+    shardcache_node_get_address_stats(node, 0, &stats);
+    ut_validate_int(outstanding == 1 && stats.outstanding == 0, 1);
+
+    ut_testing("shardcache_node_get_address() doesn't claim the probe of an address left aside");
+    sleep(PROBE_INTERVAL + 1);
+    // only the slow address is left aside
+    track_request(node, 0, 100);
+    int slow = 0;
+    for (i = 0; i < NUM_SELECTIONS; i++) {
+        if (strcmp(shardcache_node_get_address(node), addresses[1]) == 0)
+            slow++;
+    }
+    ut_validate_int(slow, 0);
+
+    ut_testing("shardcache_node_select_address_index() probes the address left aside");
+    int probed = shardcache_node_select_address_index(node);
+    // the probe is claimed once
+    int again = shardcache_node_select_address_index(node);
+    ut_validate_int(probed == 1 && again == 0, 1);
+
+    ut_testing("Failures make an address less likely to be selected");
+    shardcache_node_address_begin(node, 0);
+    shardcache_node_address_end(node, 0, NULL, 1);
+    shardcache_node_get_address_stats(node, 0, &stats);
+    int errors = stats.errors;
+    for (i = 0; i < 10; i++) {
+        shardcache_node_address_begin(node, 0);
+        shardcache_node_address_end(node, 0, NULL, 1);
+    }
+    track_request(node, 1, 100);
+    memset(selected, 0, sizeof(selected));
+    for (i = 0; i < NUM_SELECTIONS; i++) {
+        int index = shardcache_node_select_address_index(node);
+        if (index == 0 || index == 1)
+            selected[index]++;
+    }
+    if (errors == 1 && selected[1] == NUM_SELECTIONS)
+        ut_success();
+    else
+        ut_failure("errors: %d, selections: %d/%d", errors, selected[0], selected[1]);
+
+    shardcache_node_destroy(node);
+
+    ut_summary();
+    exit(ut_failed);
+}
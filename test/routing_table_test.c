@@ -0,0 +1,160 @@
+#include <routing_table.h>
+#include <chash.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_KEYS 100000
+
+// the keys of the libchash test (and of the python client)
+static size_t
+make_key(int i, char *buf, size_t size)
+{
+    return snprintf(buf, size, "foo%d\n", i);
+}
+
+// random binary keys (of 1 to 64 bytes), always the same ones for a given index
+static size_t
+make_random_key(int i, char *buf, size_t size)
+{
+    unsigned int seed = i;
+    size_t len = 1 + rand_r(&seed) % 64;
+    size_t n;
+    for (n = 0; n < len && n < size; n++)
+        buf[n] = rand_r(&seed) % 256;
+    return n;
+}
+
+// returns the number of keys assigned by the table to a node
+// other than the one chash_lookup() returns
+static int
+compare_with_chash(char **labels, int num_nodes, int random_keys)
+{
+    size_t lens[num_nodes];
+    int i;
+    for (i = 0; i < num_nodes; i++)
+        lens[i] = strlen(labels[i]);
+
+    routing_table_t *table = routing_table_create(SHARDCACHE_ROUTING_TABLE, labels, num_nodes, NULL);
+    struct chash_t *chash = chash_create((const char **)labels, lens, num_nodes, ROUTING_TABLE_CHASH_REPLICAS);
+    if (!table || !chash)
+        return -1;
+
+    int mismatches = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[64];
+        size_t klen = random_keys ? make_random_key(i, key, sizeof(key))
+                                  : make_key(i, key, sizeof(key));
+        const char *node_name = NULL;
+        size_t name_len = 0;
+        chash_lookup(chash, key, klen, &node_name, &name_len);
+        size_t len = 0;
+        char *label = routing_table_label(table, routing_table_lookup(table, key, klen), &len);
+        if (!label || len != name_len || memcmp(label, node_name, len) != 0)
+            mismatches++;
+    }
+
+    routing_table_destroy(table);
+    chash_free(chash);
+    return mismatches;
+}
+
+static char **
+create_labels(int num_nodes, char *fmt)
+{
+    char **labels = malloc(sizeof(char *) * num_nodes);
+    int i;
+    for (i = 0; i < num_nodes; i++) {
+        labels[i] = malloc(32);
+        snprintf(labels[i], 32, fmt, i, i % 256);
+    }
+    return labels;
+}
+
+static void
+destroy_labels(char **labels, int num_nodes)
+{
+    int i;
+    for (i = 0; i < num_nodes; i++)
+        free(labels[i]);
+    free(labels);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    char *servers[] = { "server1", "server2", "server3", "server4", "server5" };
+
+    ut_init(basename(argv[0]));
+
+    ut_testing("routing_table_create() fails with no nodes or with the chash mode");
+    ut_validate_int(routing_table_create(SHARDCACHE_ROUTING_TABLE, servers, 0, NULL) == NULL &&
+                    routing_table_create(SHARDCACHE_ROUTING_CHASH, servers, 5, NULL) == NULL, 1);
+
+    ut_testing("routing_table_self() returns the index of the local node");
+    routing_table_t *table = routing_table_create(SHARDCACHE_ROUTING_TABLE, servers, 5, "server3");
+    routing_table_t *other = routing_table_create(SHARDCACHE_ROUTING_TABLE, servers, 5, "unknown");
+    ut_validate_int(routing_table_self(table) == 2 && routing_table_self(other) == -1, 1);
+    routing_table_destroy(other);
+
+    ut_testing("The table mode spreads the keys as the python client does");
+    // see python/shardcache-client/shardcache_client/chash.py
+    int expected[] = { 19555, 21327, 19966, 17552, 21600 };
+    int counts[5] = { 0, 0, 0, 0, 0 };
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32];
+        size_t klen = make_key(i, key, sizeof(key));
+        int index = routing_table_lookup(table, key, klen);
+        if (index >= 0 && index < 5)
+            counts[index]++;
+    }
+    if (memcmp(counts, expected, sizeof(counts)) == 0)
+        ut_success();
+    else
+        ut_failure("%d %d %d %d %d", counts[0], counts[1], counts[2], counts[3], counts[4]);
+    routing_table_destroy(table);
+
+    ut_testing("The table mode assigns the keys as chash_lookup() does");
+    ut_validate_int(compare_with_chash(servers, 5, 0), 0);
+
+    ut_testing("The table mode assigns random keys as chash_lookup() does");
+    ut_validate_int(compare_with_chash(servers, 5, 1), 0);
+
+    // with 200K points in the continuum some of them are
+    // likely to be shared by different nodes
+    char *formats[] = { "node%d", "peer%d", "10.0.%d.%d:4444" };
+    int sizes[] = { 1, 2, 3, 7, 10, 64, 100, 1000 };
+    int f;
+    for (f = 0; f < sizeof(formats) / sizeof(char *); f++) {
+        for (i = 0; i < sizeof(sizes) / sizeof(int); i++) {
+            ut_testing("The table mode assigns the keys as chash_lookup() does (%d nodes labeled '%s')",
+                       sizes[i], formats[f]);
+            char **labels = create_labels(sizes[i], formats[f]);
+            ut_validate_int(compare_with_chash(labels, sizes[i], 0) +
+                            compare_with_chash(labels, sizes[i], 1), 0);
+            destroy_labels(labels, sizes[i]);
+        }
+    }
+
+    ut_testing("The jump mode doesn't depend on the order of the nodes");
+    char *reversed[] = { "server5", "server4", "server3", "server2", "server1" };
+    table = routing_table_create(SHARDCACHE_ROUTING_JUMP, servers, 5, NULL);
+    other = routing_table_create(SHARDCACHE_ROUTING_JUMP, reversed, 5, NULL);
+    int mismatches = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32];
+        size_t klen = make_key(i, key, sizeof(key));
+        char *label = routing_table_label(table, routing_table_lookup(table, key, klen), NULL);
+        char *other_label = routing_table_label(other, routing_table_lookup(other, key, klen), NULL);
+        if (!label || !other_label || strcmp(label, other_label) != 0)
+            mismatches++;
+    }
+    ut_validate_int(mismatches, 0);
+    routing_table_destroy(other);
+    routing_table_destroy(table);
+
+    ut_summary();
+    exit(ut_failed);
+}
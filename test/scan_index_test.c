@@ -0,0 +1,124 @@
+#include <shardcache.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define MEM_STORAGE "storage/mem.storage"
+
+#define NUM_KEYS 10000
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    shardcache_log_init("shardcached", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    char *address_array[1] = { "127.0.0.1:9770" };
+    shardcache_node_t *node = shardcache_node_create("peer0", address_array, 1);
+
+    ut_testing("shardcache_create() with the mem storage");
+    char *options[] = { "shards", "4", NULL };
+    shardcache_storage_t *storage = shardcache_storage_load(MEM_STORAGE, options);
+    shardcache_t *cache = storage ? shardcache_create("peer0", &node, 1, storage, 2, 0, 1<<20) : NULL;
+    if (!cache) {
+        ut_failure("Can't create the shardcache instance");
+        ut_summary();
+        exit(ut_failed);
+    }
+    ut_success();
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32], value[32];
+        snprintf(key, sizeof(key), "key_%d", i);
+        snprintf(value, sizeof(value), "value_%d", i);
+        shardcache_set(cache, key, strlen(key), value, strlen(value), 0, 0, 0, NULL, NULL);
+    }
+
+    ut_testing("shardcache_scan_index() returns each key in chunks");
+    char *seen = calloc(1, NUM_KEYS);
+    shardcache_storage_index_item_t items[100];
+    uint64_t cursor = 0;
+    int chunks = 0;
+    int found = 0;
+    int unexpected = 0;
+    do {
+        int n = shardcache_scan_index(cache, &cursor, items, 100);
+        if (n < 0 || n > 100) {
+            unexpected++;
+            break;
+        }
+        int j;
+        for (j = 0; j < n; j++) {
+            char key[32];
+            snprintf(key, sizeof(key), "%.*s", (int)items[j].klen, (char *)items[j].key);
+            int idx = atoi(key + 4);
+            if (strncmp(key, "key_", 4) != 0 || idx < 0 || idx >= NUM_KEYS || items[j].vlen != strlen(key) + 2)
+                unexpected++;
+            else if (!seen[idx]++)
+                found++;
+            free(items[j].key);
+        }
+        chunks++;
+    } while (cursor);
+    if (found == NUM_KEYS && !unexpected && chunks >= NUM_KEYS / 100)
+        ut_success();
+    else
+        ut_failure("found: %d, unexpected: %d, chunks: %d", found, unexpected, chunks);
+    free(seen);
+
+    ut_testing("The keys removed before the scan are not returned");
+    for (i = 0; i < NUM_KEYS / 2; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key_%d", i);
+        shardcache_del(cache, key, strlen(key), NULL, NULL);
+    }
+    cursor = 0;
+    found = 0;
+    unexpected = 0;
+    do {
+        int n = shardcache_scan_index(cache, &cursor, items, 100);
+        if (n < 0)
+            break;
+        int j;
+        for (j = 0; j < n; j++) {
+            char key[32];
+            snprintf(key, sizeof(key), "%.*s", (int)items[j].klen, (char *)items[j].key);
+            if (atoi(key + 4) < NUM_KEYS / 2)
+                unexpected++;
+            else
+                found++;
+            free(items[j].key);
+        }
+    } while (cursor);
+    if (found == NUM_KEYS / 2 && !unexpected)
+        ut_success();
+    else
+        ut_failure("found: %d, removed keys returned: %d", found, unexpected);
+
+    ut_testing("shardcache_get_index() returns the whole index");
+    shardcache_storage_index_t *index = shardcache_get_index(cache);
+    ut_validate_int(index ? (int)index->size : -1, NUM_KEYS / 2);
+    if (index)
+        shardcache_free_index(index);
+
+    shardcache_destroy(cache);
+    shardcache_storage_dispose(storage);
+
+    ut_testing("shardcache_scan_index() completes at once without a persistent storage");
+    cache = shardcache_create("peer0", &node, 1, NULL, 2, 0, 1<<20);
+    cursor = 1;
+    int n = cache ? shardcache_scan_index(cache, &cursor, items, 100) : -1;
+    ut_validate_int(n == 0 && cursor == 0, 1);
+    if (cache)
+        shardcache_destroy(cache);
+
+    shardcache_node_destroy(node);
+
+    ut_summary();
+    exit(ut_failed);
+}
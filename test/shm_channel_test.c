@@ -0,0 +1,98 @@
+#include <shm_channel.h>
+#include <protocol.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define RING_SIZE (1<<12)
+
+// true if the doorbell of the channel has been rung (and drain it)
+static int
+doorbell_rung(shm_channel_t *ch)
+{
+    struct pollfd pfd = { shm_channel_fd(ch), POLLIN, 0 };
+    if (poll(&pfd, 1, 0) != 1)
+        return 0;
+    uint64_t value;
+    return (read(shm_channel_fd(ch), &value, sizeof(value)) == sizeof(value));
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    int sv[2];
+    ut_testing("socketpair(AF_UNIX, SOCK_STREAM, 0, sv)");
+    ut_validate_int(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+    ut_testing("shm_channel_create(%d) && shm_channel_send()", RING_SIZE);
+    shm_channel_t *server = shm_channel_create(RING_SIZE);
+    if (!server || shm_channel_send(server, sv[0]) != 0) {
+        ut_failure("Can't create the channel");
+        exit(-1);
+    }
+    ut_success();
+
+    ut_testing("shm_channel_receive() gets the channel from the socket");
+    shm_channel_t *client = shm_channel_receive(sv[1]);
+    if (!client) {
+        ut_failure("Can't receive the channel");
+        exit(-1);
+    }
+    ut_success();
+
+    ut_testing("Data written by the client can be read by the server");
+    void *data = NULL;
+    int wb = shm_channel_write(client, "request", 7);
+    int rb = shm_channel_peek(server, &data);
+    if (wb == 7 && rb == 7 && memcmp(data, "request", 7) == 0)
+        ut_success();
+    else
+        ut_failure("written %d bytes, read %d", wb, rb);
+    shm_channel_consume(server, rb);
+
+    ut_testing("An armed reader is woken up when new data is written");
+    int armed = shm_channel_arm(server);
+    shm_channel_write(client, "x", 1);
+    ut_validate_int(armed == 0 && doorbell_rung(server), 1);
+    shm_channel_consume(server, shm_channel_peek(server, &data));
+
+    ut_testing("shm_channel_write() doesn't write more than the ring can hold");
+    char *buf = malloc(RING_SIZE * 2);
+    memset(buf, 'a', RING_SIZE * 2);
+    wb = shm_channel_write(server, buf, RING_SIZE * 2);
+    int wb2 = shm_channel_write(server, buf, RING_SIZE);
+    ut_validate_int(wb == RING_SIZE && wb2 == 0, 1);
+
+    ut_testing("shm_channel_arm_write() returns 0 while the ring is full");
+    ut_validate_int(shm_channel_arm_write(server), 0);
+
+    ut_testing("The doorbell isn't rung until the reader frees some space");
+    ut_validate_int(doorbell_rung(server), 0);
+
+    ut_testing("The doorbell is rung when the reader consumes the data");
+    rb = shm_channel_peek(client, &data);
+    shm_channel_consume(client, rb);
+    ut_validate_int(rb == RING_SIZE && doorbell_rung(server) && shm_channel_arm_write(server) == 1, 1);
+
+    ut_testing("shm_channel_wait() times out if nothing is written");
+    ut_validate_int(shm_channel_wait(client, SHM_CHANNEL_WAIT_READ, 10), -1);
+
+    ut_testing("shm_channel_wait() fails once the peer has gone away");
+    shm_channel_destroy(server);
+    close(sv[0]);
+    ut_validate_int(shm_channel_wait(client, SHM_CHANNEL_WAIT_READ, 1000), -1);
+
+    shm_channel_destroy(client);
+    free(buf);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
@@ -0,0 +1,189 @@
+#include <storage_io.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ut.h>
+#include <libgen.h>
+
+typedef struct {
+    int started;
+    int exited;
+    int done;
+    int blocked;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} pool_state_t;
+
+static __thread int in_pool_thread = 0;
+
+static void
+thread_start_cb(void *priv)
+{
+    in_pool_thread = 1;
+    __sync_fetch_and_add(&((pool_state_t *)priv)->started, 1);
+}
+
+static void
+thread_exit_cb(void *priv)
+{
+    __sync_fetch_and_add(&((pool_state_t *)priv)->exited, 1);
+}
+
+static void
+count_job(void *arg)
+{
+    __sync_fetch_and_add(&((pool_state_t *)arg)->done, 1);
+}
+
+// keeps the thread busy until unblock_jobs() is called
+static void
+blocking_job(void *arg)
+{
+    pool_state_t *state = (pool_state_t *)arg;
+    pthread_mutex_lock(&state->lock);
+    while (state->blocked)
+        pthread_cond_wait(&state->cond, &state->lock);
+    pthread_mutex_unlock(&state->lock);
+    __sync_fetch_and_add(&state->done, 1);
+}
+
+static void
+unblock_jobs(pool_state_t *state)
+{
+    pthread_mutex_lock(&state->lock);
+    state->blocked = 0;
+    pthread_cond_broadcast(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+}
+
+typedef struct {
+    int items;
+    int batches;
+    int outside_pool; // batches not run by a pool thread
+} batch_state_t;
+
+static void
+batch_cb(void **items, int count, void *priv)
+{
+    batch_state_t *state = (batch_state_t *)priv;
+    if (!in_pool_thread)
+        __sync_fetch_and_add(&state->outside_pool, 1);
+    __sync_fetch_and_add(&state->batches, 1);
+    __sync_fetch_and_add(&state->items, count);
+}
+
+static int
+wait_for(int *value, int expected)
+{
+    int i;
+    for (i = 0; i < 200 && __sync_fetch_and_add(value, 0) < expected; i++)
+        usleep(10000);
+    return __sync_fetch_and_add(value, 0);
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    pool_state_t state;
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+
+    ut_testing("storage_io_pool_create(0, 8, ...) == NULL");
+    ut_validate_int(storage_io_pool_create(0, 8, NULL, NULL, NULL) == NULL, 1);
+
+    ut_testing("storage_io_pool_create(4, 8, ...) calls thread_start for each thread");
+    storage_io_pool_t *pool = storage_io_pool_create(4, 8, thread_start_cb, thread_exit_cb, &state);
+    ut_validate_int(pool && wait_for(&state.started, 4) == 4, 1);
+
+    ut_testing("The queued jobs are run by the pool threads");
+    int i;
+    for (i = 0; i < 100; i++) {
+        while (storage_io_pool_run(pool, count_job, &state) != 0)
+            usleep(1000);
+    }
+    ut_validate_int(wait_for(&state.done, 100), 100);
+
+    ut_testing("New jobs are refused once all the threads are busy and the queue is full");
+    state.done = 0;
+    state.blocked = 1;
+    storage_io_pool_counters_t *counters = storage_io_pool_counters(pool);
+    for (i = 0; i < 4; i++)
+        storage_io_pool_run(pool, blocking_job, &state);
+    for (i = 0; i < 200 && __sync_fetch_and_add(&counters->running, 0) < 4; i++)
+        usleep(10000);
+    int queued = 0;
+    uint64_t rejected = counters->rejected;
+    while (storage_io_pool_run(pool, blocking_job, &state) == 0)
+        queued++;
+    if (queued == 8 && counters->running == 4 && counters->queued == 8 && counters->rejected == rejected + 1)
+        ut_success();
+    else
+        ut_failure("queued: %d, running: %d, rejected: %d",
+                   queued, (int)counters->running, (int)counters->rejected);
+
+    ut_testing("storage_io_pool_destroy() completes the queued jobs before returning");
+    unblock_jobs(&state);
+    storage_io_pool_destroy(pool);
+    ut_validate_int(state.done == 12 && state.exited == 4, 1);
+
+    ut_testing("A full batch is flushed without waiting for the whole window");
+    memset(&state, 0, sizeof(state));
+    batch_state_t batches = { 0, 0, 0 };
+    pool = storage_io_pool_create(1, 1, thread_start_cb, thread_exit_cb, &state);
+    storage_io_batcher_t *batcher = storage_io_batcher_create(4, 10000000, pool, batch_cb, &batches);
+    storage_io_batcher_counters_t *batcher_counters = storage_io_batcher_counters(batcher);
+    for (i = 0; i < 4; i++)
+        storage_io_batcher_add(batcher, &state);
+    if (wait_for(&batches.items, 4) == 4 && batches.batches == 1 && batcher_counters->histogram[2] == 1)
+        ut_success();
+    else
+        ut_failure("items: %d, batches: %d", batches.items, batches.batches);
+
+    // keep the only pool thread busy and its queue full
+    state.blocked = 1;
+    storage_io_pool_run(pool, blocking_job, &state);
+    for (i = 0; i < 200 && __sync_fetch_and_add(&storage_io_pool_counters(pool)->running, 0) < 1; i++)
+        usleep(10000);
+    storage_io_pool_run(pool, blocking_job, &state);
+
+    ut_testing("Items are refused once STORAGE_IO_BATCHER_MAX_PENDING batches are pending");
+    memset(&batches, 0, sizeof(batches));
+    int added = 0;
+    while (added < 1000 && storage_io_batcher_add(batcher, &state) == 0)
+        added++;
+    // the batcher thread might have taken the first batch out already
+    if (added >= 4 * STORAGE_IO_BATCHER_MAX_PENDING &&
+        added <= 4 * (STORAGE_IO_BATCHER_MAX_PENDING + 1) &&
+        batcher_counters->rejected == 1)
+    {
+        ut_success();
+    } else {
+        ut_failure("added: %d, rejected: %d", added, (int)batcher_counters->rejected);
+    }
+
+    ut_testing("The batcher waits for the pool instead of running the batches by itself");
+    usleep(100000);
+    ut_validate_int(batches.batches, 0);
+
+    ut_testing("The pending batches are run by the pool threads once they are free");
+    unblock_jobs(&state);
+    if (wait_for(&batches.items, added) == added && !batches.outside_pool && state.done == 2)
+        ut_success();
+    else
+        ut_failure("items: %d/%d, batches run outside the pool: %d",
+                   batches.items, added, batches.outside_pool);
+
+    storage_io_batcher_destroy(batcher);
+    storage_io_pool_destroy(pool);
+
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.lock);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
@@ -0,0 +1,198 @@
+#include <shardcache.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ut.h>
+#include <libgen.h>
+
+// the storage modules are built in the storage/ directory
+// and the tests are run from the top of the source tree
+#define MEM_STORAGE  "storage/mem.storage"
+#define MMAP_STORAGE "storage/mmap.storage"
+
+#define NUM_KEYS 5000
+
+static int
+store_keys(shardcache_storage_t *st, int first, int last, char *prefix)
+{
+    int i;
+    int failed = 0;
+    for (i = first; i < last; i++) {
+        char key[32], value[64];
+        snprintf(key, sizeof(key), "key_%d", i);
+        snprintf(value, sizeof(value), "%s_%d", prefix, i);
+        if (st->store(key, strlen(key), value, strlen(value), 0, st->priv) != 0)
+            failed++;
+    }
+    return failed;
+}
+
+// returns the number of keys in [first, last) not holding the expected value
+static int
+check_keys(shardcache_storage_t *st, int first, int last, char *prefix)
+{
+    int i;
+    int bad = 0;
+    for (i = first; i < last; i++) {
+        char key[32], expected[64];
+        snprintf(key, sizeof(key), "key_%d", i);
+        snprintf(expected, sizeof(expected), "%s_%d", prefix, i);
+        void *value = NULL;
+        size_t vlen = 0;
+        st->fetch(key, strlen(key), &value, &vlen, st->priv);
+        if (!value || vlen != strlen(expected) || memcmp(value, expected, vlen) != 0)
+            bad++;
+        free(value);
+    }
+    return bad;
+}
+
+static void
+test_basic_ops(shardcache_storage_t *st, char *name)
+{
+    char label[256];
+
+    snprintf(label, sizeof(label), "%s: stored values can be fetched", name);
+    ut_testing(label);
+    int failed = store_keys(st, 0, 100, "value");
+    ut_validate_int(failed + check_keys(st, 0, 100, "value"), 0);
+
+    snprintf(label, sizeof(label), "%s: store(if_not_exists) doesn't overwrite existing keys", name);
+    ut_testing(label);
+    int rc = st->store("key_1", 5, "other", 5, 1, st->priv);
+    ut_validate_int(rc == 1 && check_keys(st, 1, 2, "value") == 0, 1);
+
+    snprintf(label, sizeof(label), "%s: cas() replaces only the expected value", name);
+    ut_testing(label);
+    int rc1 = st->cas("key_2", 5, "wrong", 5, "cas_2", 5, st->priv);
+    int rc2 = st->cas("key_2", 5, "value_2", 7, "cas_2", 5, st->priv);
+    if (rc1 == 1 && rc2 == 0 && check_keys(st, 2, 3, "cas") == 0)
+        ut_success();
+    else
+        ut_failure("rc1: %d, rc2: %d", rc1, rc2);
+
+    snprintf(label, sizeof(label), "%s: removed keys don't exist anymore", name);
+    ut_testing(label);
+    st->remove("key_3", 5, st->priv);
+    void *value = NULL;
+    size_t vlen = 0;
+    st->fetch("key_3", 5, &value, &vlen, st->priv);
+    if (!value && !st->exist("key_3", 5, st->priv) && st->exist("key_4", 5, st->priv) && st->count(st->priv) == 99)
+        ut_success();
+    else
+        ut_failure("count: %d", (int)st->count(st->priv));
+    free(value);
+
+    snprintf(label, sizeof(label), "%s: scan_index() returns each key", name);
+    ut_testing(label);
+    shardcache_storage_index_item_t items[16];
+    uint64_t cursor = 0;
+    int found = 0;
+    do {
+        size_t n = st->scan_index(&cursor, items, 16, st->priv);
+        size_t i;
+        for (i = 0; i < n; i++) {
+            found++;
+            free(items[i].key);
+        }
+    } while (cursor);
+    ut_validate_int(found, 99);
+}
+
+typedef struct {
+    shardcache_storage_t *st;
+    int quit;
+    int errors;
+    int reads;
+} reader_arg_t;
+
+// the first 100 keys are never changed while the reader runs
+static void *
+reader(void *priv)
+{
+    reader_arg_t *arg = (reader_arg_t *)priv;
+    while (!__sync_fetch_and_add(&arg->quit, 0)) {
+        __sync_fetch_and_add(&arg->errors, check_keys(arg->st, 0, 100, "stable"));
+        __sync_fetch_and_add(&arg->reads, 1);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    char *mem_options[] = { "shards", "4", "initial_size", "16", NULL };
+    shardcache_storage_t *st = shardcache_storage_load(MEM_STORAGE, mem_options);
+    ut_testing("shardcache_storage_load(" MEM_STORAGE ")");
+    ut_validate_int(st != NULL, 1);
+    if (st) {
+        test_basic_ops(st, "mem");
+
+        ut_testing("mem: shards grow while keys are added");
+        int failed = store_keys(st, 0, NUM_KEYS, "grown");
+        ut_validate_int(failed + check_keys(st, 0, NUM_KEYS, "grown"), 0);
+
+        shardcache_storage_dispose(st);
+    }
+
+    char dir[] = "/tmp/storage_test_XXXXXX";
+    if (!mkdtemp(dir)) {
+        ut_testing("mkdtemp()");
+        ut_failure("Can't create the directory for the mmap storage");
+        ut_summary();
+        exit(ut_failed);
+    }
+
+    // small files to trigger the rebuilds and the growth of the data file
+    char *mmap_options[] = { "path", dir, "index_slots", "64", "data_size", "4096", NULL };
+    st = shardcache_storage_load(MMAP_STORAGE, mmap_options);
+    ut_testing("shardcache_storage_load(" MMAP_STORAGE ")");
+    ut_validate_int(st != NULL, 1);
+    if (st) {
+        test_basic_ops(st, "mmap");
+
+        ut_testing("mmap: readers keep working while the files are rebuilt");
+        store_keys(st, 0, 100, "stable");
+        reader_arg_t arg = { st, 0, 0, 0 };
+        pthread_t th;
+        pthread_create(&th, NULL, reader, &arg);
+        int failed = 0;
+        int round;
+        // overwriting the same keys leaves obsolete records behind
+        // which are dropped by the rebuilds
+        for (round = 0; round < 5; round++)
+            failed += store_keys(st, 100, NUM_KEYS, "rebuilt");
+        __sync_fetch_and_add(&arg.quit, 1);
+        pthread_join(th, NULL);
+        if (!failed && !arg.errors && arg.reads > 0 && check_keys(st, 100, NUM_KEYS, "rebuilt") == 0)
+            ut_success();
+        else
+            ut_failure("failed stores: %d, bad reads: %d (of %d rounds)", failed, arg.errors, arg.reads);
+
+        shardcache_storage_dispose(st);
+
+        ut_testing("mmap: the data survives reopening the files");
+        st = shardcache_storage_load(MMAP_STORAGE, mmap_options);
+        if (st && check_keys(st, 0, 100, "stable") == 0 &&
+            check_keys(st, 100, NUM_KEYS, "rebuilt") == 0 && st->count(st->priv) == NUM_KEYS)
+        {
+            ut_success();
+        } else {
+            ut_failure("can't find the stored keys");
+        }
+        if (st)
+            shardcache_storage_dispose(st);
+    }
+
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0)
+        fprintf(stderr, "Can't remove %s\n", dir);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
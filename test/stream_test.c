@@ -0,0 +1,155 @@
+#include <shardcache_client.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_NODES 2
+#define VALUE_SIZE (1<<20)
+#define NUM_PIECES 16
+// the size of the chunks returned by shardcache_client_get_stream_next()
+#define MAX_CHUNK_SIZE 65536
+
+// reads the whole stream checking the size of the chunks,
+// returns the number of bytes matching the expected data (or -1)
+static int
+read_stream(shardcache_client_get_stream_t *s, char *expected, size_t expected_len, int *max_chunk)
+{
+    size_t total = 0;
+    int rc;
+    void *chunk = NULL;
+    size_t len = 0;
+    *max_chunk = 0;
+    while ((rc = shardcache_client_get_stream_next(s, &chunk, &len)) == 1) {
+        if (len > *max_chunk)
+            *max_chunk = len;
+        if (total + len > expected_len || memcmp(chunk, expected + total, len) != 0)
+            return -1;
+        total += len;
+    }
+    return rc == 0 ? total : -1;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    shardcache_node_t *nodes[NUM_NODES];
+    shardcache_t *servers[NUM_NODES];
+
+    shardcache_log_init("shardcached", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    for (i = 0; i < NUM_NODES; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "peer%d", i);
+        char address[32];
+        snprintf(address, sizeof(address), "127.0.0.1:987%d", i);
+        char *address_array[1] = { address };
+        nodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+
+    for (i = 0; i < NUM_NODES; i++) {
+        servers[i] = shardcache_create(shardcache_node_get_label(nodes[i]), nodes, NUM_NODES, NULL, 5, 0, 1<<24);
+        if (!servers[i]) {
+            ut_testing("shardcache_create()");
+            ut_failure("Errors creating the shardcache instance");
+            ut_summary();
+            exit(ut_failed);
+        }
+        shardcache_compression_threshold(servers[i], 1024);
+        shardcache_iomux_run_timeout_low(servers[i], 5000);
+    }
+
+    sleep(1); // let the servers complete their startup
+
+    shardcache_client_t *client = shardcache_client_create(nodes, NUM_NODES);
+
+    char *value = malloc(VALUE_SIZE);
+    for (i = 0; i < VALUE_SIZE; i++)
+        value[i] = random() % 256;
+
+    ut_testing("shardcache_client_set_stream() stores a value written in pieces");
+    shardcache_client_set_stream_t *ss = shardcache_client_set_stream(client, "big", 3, VALUE_SIZE, 0);
+    int rc = ss ? 0 : -1;
+    for (i = 0; ss && i < NUM_PIECES && rc == 0; i++)
+        rc = shardcache_client_set_stream_write(ss, value + i * (VALUE_SIZE / NUM_PIECES), VALUE_SIZE / NUM_PIECES);
+    if (ss && shardcache_client_set_stream_close(ss) != 0)
+        rc = -1;
+    ut_validate_int(rc, 0);
+
+    ut_testing("shardcache_client_get_stream() reads the whole value in bounded chunks");
+    int max_chunk = 0;
+    shardcache_client_get_stream_t *gs = shardcache_client_get_stream(client, "big", 3, 0, 0);
+    int total = gs ? read_stream(gs, value, VALUE_SIZE, &max_chunk) : -1;
+    if (gs)
+        shardcache_client_get_stream_close(gs);
+    if (total == VALUE_SIZE && max_chunk <= MAX_CHUNK_SIZE)
+        ut_success();
+    else
+        ut_failure("read: %d, biggest chunk: %d", total, max_chunk);
+
+    ut_testing("shardcache_client_get_stream() reads a range of the value");
+    gs = shardcache_client_get_stream(client, "big", 3, 1000, 200000);
+    total = gs ? read_stream(gs, value + 1000, 200000, &max_chunk) : -1;
+    if (gs)
+        shardcache_client_get_stream_close(gs);
+    ut_validate_int(total, 200000);
+
+    ut_testing("shardcache_client_get_stream() requires a length with an offset");
+    gs = shardcache_client_get_stream(client, "big", 3, 1000, 0);
+    ut_validate_int(gs == NULL && shardcache_client_errno(client) == SHARDCACHE_CLIENT_ERROR_ARGS, 1);
+
+    ut_testing("A stream can be closed before reading the whole value");
+    gs = shardcache_client_get_stream(client, "big", 3, 0, 0);
+    void *chunk = NULL;
+    size_t len = 0;
+    rc = gs ? shardcache_client_get_stream_next(gs, &chunk, &len) : -1;
+    if (gs)
+        shardcache_client_get_stream_close(gs);
+    // the client can still be used afterwards
+    void *small = NULL;
+    shardcache_client_set(client, "small", 5, "value", 5, 0);
+    size_t size = shardcache_client_get(client, "small", 5, &small);
+    if (rc == 1 && len > 0 && size == 5 && memcmp(small, "value", 5) == 0)
+        ut_success();
+    else
+        ut_failure("rc: %d, size: %d", rc, (int)size);
+    free(small);
+
+    ut_testing("A missing key produces no chunks");
+    gs = shardcache_client_get_stream(client, "missing", 7, 0, 0);
+    rc = gs ? shardcache_client_get_stream_next(gs, &chunk, &len) : -1;
+    if (gs)
+        shardcache_client_get_stream_close(gs);
+    ut_validate_int(rc == 0 || rc == -1, 1);
+
+    ut_testing("Decompressed records are returned in bounded chunks (protocol v3)");
+    // a compressible value, sent and received as a single compressed record
+    for (i = 0; i < VALUE_SIZE; i++)
+        value[i] = 'a' + (i / 64) % 26;
+    shardcache_client_protocol_version(client, 3);
+    shardcache_client_compression_threshold(client, 1024);
+    rc = shardcache_client_set(client, "compressed", 10, value, VALUE_SIZE, 0);
+    gs = shardcache_client_get_stream(client, "compressed", 10, 0, 0);
+    total = gs ? read_stream(gs, value, VALUE_SIZE, &max_chunk) : -1;
+    if (gs)
+        shardcache_client_get_stream_close(gs);
+    if (rc == 0 && total == VALUE_SIZE && max_chunk <= MAX_CHUNK_SIZE)
+        ut_success();
+    else
+        ut_failure("rc: %d, read: %d, biggest chunk: %d", rc, total, max_chunk);
+
+    free(value);
+    shardcache_client_destroy(client);
+
+    for (i = 0; i < NUM_NODES; i++) {
+        shardcache_destroy(servers[i]);
+        shardcache_node_destroy(nodes[i]);
+    }
+
+    ut_summary();
+    exit(ut_failed);
+}
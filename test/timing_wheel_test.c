@@ -0,0 +1,116 @@
+#include <timing_wheel.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_KEYS 1000
+
+typedef struct {
+    int expired[NUM_KEYS];
+    int count;
+} expired_keys_t;
+
+static void
+collect_expired(void *key, size_t klen, void *priv)
+{
+    expired_keys_t *ek = (expired_keys_t *)priv;
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%.*s", (int)klen, (char *)key);
+    int idx = atoi(buf + 4);
+    if (idx >= 0 && idx < NUM_KEYS)
+        ek->expired[idx]++;
+    ek->count++;
+}
+
+// alternate short (inline) keys with long ones
+static size_t
+make_key(int i, char *buf, size_t size)
+{
+    if (i % 2)
+        return snprintf(buf, size, "key_%d_%s", i, "a_long_suffix_to_exceed_the_inline_size");
+    return snprintf(buf, size, "key_%d", i);
+}
+
+// run the wheel until either 'count' keys have expired or 'ms' have passed
+static void
+run_for(timing_wheel_t *tw, expired_keys_t *ek, int count, int ms)
+{
+    int waited;
+    for (waited = 0; waited < ms && ek->count < count; waited += 5) {
+        timing_wheel_run(tw, collect_expired, ek, NULL);
+        usleep(5000);
+    }
+    timing_wheel_run(tw, collect_expired, ek, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    char key[128];
+    size_t klen;
+    int i;
+    expired_keys_t ek;
+    memset(&ek, 0, sizeof(ek));
+
+    timing_wheel_t *tw = timing_wheel_create(10);
+
+    ut_testing("timing_wheel_schedule() %d keys", NUM_KEYS);
+    int failed = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        klen = make_key(i, key, sizeof(key));
+        if (timing_wheel_schedule(tw, key, klen, 100 + (i % 10) * 10) != 0)
+            failed++;
+    }
+    ut_validate_int(failed == 0 && timing_wheel_count(tw) == NUM_KEYS, 1);
+
+    ut_testing("Scheduling an existing key moves its timer");
+    klen = make_key(0, key, sizeof(key));
+    timing_wheel_schedule(tw, key, klen, 60000);
+    ut_validate_int(timing_wheel_count(tw), NUM_KEYS);
+
+    ut_testing("timing_wheel_cancel() removes the timer");
+    klen = make_key(1, key, sizeof(key));
+    int rc = timing_wheel_cancel(tw, key, klen);
+    ut_validate_int(rc == 0 && timing_wheel_count(tw) == NUM_KEYS - 1 &&
+                    timing_wheel_cancel(tw, key, klen) == -1, 1);
+
+    ut_testing("Nothing expires before its timeout");
+    timing_wheel_run(tw, collect_expired, &ek, NULL);
+    ut_validate_int(ek.count, 0);
+
+    ut_testing("All the scheduled keys expire exactly once");
+    run_for(tw, &ek, NUM_KEYS - 2, 2000);
+    int wrong = 0;
+    for (i = 2; i < NUM_KEYS; i++)
+        if (ek.expired[i] != 1)
+            wrong++;
+    if (ek.count == NUM_KEYS - 2 && !wrong)
+        ut_success();
+    else
+        ut_failure("%d keys expired, %d expired a wrong number of times", ek.count, wrong);
+
+    ut_testing("Cancelled and rescheduled keys didn't expire");
+    ut_validate_int(ek.expired[0] == 0 && ek.expired[1] == 0 && timing_wheel_count(tw) == 1, 1);
+
+    ut_testing("Keys scheduled beyond the first level of the wheel expire on time");
+    memset(&ek, 0, sizeof(ek));
+    klen = make_key(2, key, sizeof(key));
+    timing_wheel_schedule(tw, key, klen, 3000);
+    run_for(tw, &ek, 1, 2500);
+    int early = ek.count;
+    run_for(tw, &ek, 1, 1500);
+    if (!early && ek.count == 1 && ek.expired[2] == 1)
+        ut_success();
+    else
+        ut_failure("expired %d keys before the timeout, %d in total", early, ek.count);
+
+    timing_wheel_destroy(tw);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
@@ -0,0 +1,144 @@
+#include <shardcache_client.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_NODES 3
+#define NUM_KEYS 100
+#define NUM_THREADS 4
+#define NUM_REFRESHES 50
+
+typedef struct {
+    shardcache_client_t *client;
+    int quit;
+    int gets;
+    int errors;
+} reader_arg_t;
+
+static void *
+reader(void *priv)
+{
+    reader_arg_t *arg = (reader_arg_t *)priv;
+    int i = 0;
+    while (!__sync_fetch_and_add(&arg->quit, 0)) {
+        char key[32], val[32];
+        snprintf(key, sizeof(key), "key%d", i % NUM_KEYS);
+        snprintf(val, sizeof(val), "value%d", i % NUM_KEYS);
+        void *value = NULL;
+        size_t size = shardcache_client_get(arg->client, key, strlen(key), &value);
+        if (size != strlen(val) || memcmp(value, val, size) != 0)
+            arg->errors++;
+        free(value);
+        arg->gets++;
+        i++;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    shardcache_node_t *nodes[NUM_NODES];
+    shardcache_t *servers[NUM_NODES];
+
+    shardcache_log_init("shardcached", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    for (i = 0; i < NUM_NODES; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "peer%d", i);
+        char address[32];
+        snprintf(address, sizeof(address), "127.0.0.1:984%d", i);
+        char *address_array[1] = { address };
+        nodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+
+    for (i = 0; i < NUM_NODES; i++) {
+        servers[i] = shardcache_create(shardcache_node_get_label(nodes[i]), nodes, NUM_NODES, NULL, 5, 0, 1<<20);
+        if (!servers[i]) {
+            ut_testing("shardcache_create()");
+            ut_failure("Errors creating the shardcache instance");
+            ut_summary();
+            exit(ut_failed);
+        }
+        shardcache_iomux_run_timeout_low(servers[i], 5000);
+    }
+
+    sleep(1); // let the servers complete their startup
+
+    // the client knows only the first node
+    shardcache_client_t *client = shardcache_client_create(nodes, 1);
+
+    ut_testing("shardcache_client_topology_refresh() learns the other nodes");
+    int rc = shardcache_client_topology_refresh(client);
+    int misrouted = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32], val[32], owner[256];
+        size_t len = sizeof(owner);
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(val, sizeof(val), "value%d", i);
+        shardcache_client_set(client, key, strlen(key), val, strlen(val), 0);
+        shardcache_test_ownership(servers[0], key, strlen(key), owner, &len);
+        shardcache_node_t *node = shardcache_client_current_node(client);
+        if (!node || strcmp(shardcache_node_get_label(node), owner) != 0)
+            misrouted++;
+    }
+    if (rc == 0 && !misrouted)
+        ut_success();
+    else
+        ut_failure("rc: %d, keys sent to the wrong node: %d", rc, misrouted);
+
+    ut_testing("The addresses of the learned nodes are measured");
+    shardcache_node_address_stats_t stats;
+    ut_validate_int(shardcache_client_address_stats(client, "127.0.0.1:9841", &stats) == 0 &&
+                    shardcache_client_address_stats(client, "127.0.0.1:9842", &stats) == 0, 1);
+
+    ut_testing("The topology can be replaced while other threads are routing keys");
+    shardcache_node_t *current = shardcache_client_current_node(client);
+    int mode = shardcache_client_routing_mode(client, -1);
+    pthread_t threads[NUM_THREADS];
+    reader_arg_t args[NUM_THREADS];
+    for (i = 0; i < NUM_THREADS; i++) {
+        memset(&args[i], 0, sizeof(reader_arg_t));
+        args[i].client = client;
+        pthread_create(&threads[i], NULL, reader, &args[i]);
+    }
+    // changing the routing mode forces the topology to be rebuilt
+    // (the nodes forward the keys they don't own, so the values
+    // are still found while the modes don't match)
+    for (i = 0; i < NUM_REFRESHES; i++) {
+        shardcache_client_routing_mode(client, (i % 2) ? SHARDCACHE_ROUTING_TABLE : SHARDCACHE_ROUTING_JUMP);
+        usleep(10000);
+    }
+    shardcache_client_routing_mode(client, mode);
+    int gets = 0, errors = 0;
+    for (i = 0; i < NUM_THREADS; i++) {
+        __sync_fetch_and_add(&args[i].quit, 1);
+        pthread_join(threads[i], NULL);
+        gets += args[i].gets;
+        errors += args[i].errors;
+    }
+    if (gets > 0 && !errors)
+        ut_success();
+    else
+        ut_failure("gets: %d, errors: %d", gets, errors);
+
+    ut_testing("The learned nodes survive the replaced topologies");
+    // the node returned before the refreshes is still valid
+    ut_validate_int(current && strncmp(shardcache_node_get_label(current), "peer", 4) == 0, 1);
+
+    shardcache_client_destroy(client);
+
+    for (i = 0; i < NUM_NODES; i++) {
+        shardcache_destroy(servers[i]);
+        shardcache_node_destroy(nodes[i]);
+    }
+
+    ut_summary();
+    exit(ut_failed);
+}
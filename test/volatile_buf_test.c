@@ -0,0 +1,110 @@
+#include <shardcache.h>
+#include <shardcache_internal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ut.h>
+#include <libgen.h>
+
+// the number of references to the value of a volatile item
+// (1 if only the volatile storage holds it)
+static int
+volatile_refcnt(shardcache_t *cache, char *key)
+{
+    volatile_object_t *obj = ht_get(cache->volatile_storage, key, strlen(key), NULL);
+    return (obj && obj->buf) ? obj->buf->refcnt : 0;
+}
+
+static int
+check_value(shardcache_t *cache, char *key, char *expected)
+{
+    void *value = NULL;
+    size_t vlen = 0;
+    int rc = shardcache_get_sync(cache, key, strlen(key), &value, &vlen, NULL);
+    int ok = (rc == 0 && vlen == strlen(expected) && memcmp(value, expected, vlen) == 0);
+    free(value);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    shardcache_log_init("shardcached", LOG_WARNING);
+
+    ut_init(basename(argv[0]));
+
+    ut_testing("volatile_buf_create() copies the data");
+    char data[] = "some data";
+    volatile_buf_t *buf = volatile_buf_create(data, sizeof(data));
+    data[0] = 'S';
+    if (buf && buf->refcnt == 1 && buf->len == sizeof(data) && strcmp(buf->data, "some data") == 0)
+        ut_success();
+    else
+        ut_failure("Unexpected buffer");
+
+    ut_testing("volatile_buf_retain() increments the reference count");
+    volatile_buf_t *ref = volatile_buf_retain(buf);
+    ut_validate_int(ref == buf && buf->refcnt == 2, 1);
+
+    ut_testing("volatile_buf_release() keeps the buffer while it's still referenced");
+    volatile_buf_release(buf);
+    ut_validate_int(ref->refcnt == 1 && strcmp(ref->data, "some data") == 0, 1);
+    volatile_buf_release(ref);
+    volatile_buf_release(NULL);
+
+    char *address_array[1] = { "127.0.0.1:9790" };
+    shardcache_node_t *node = shardcache_node_create("peer0", address_array, 1);
+
+    // without a persistent storage all the items are volatile
+    shardcache_t *cache = shardcache_create("peer0", &node, 1, NULL, 2, 0, 1<<20);
+    if (!cache) {
+        ut_testing("shardcache_create()");
+        ut_failure("Can't create the shardcache instance");
+        ut_summary();
+        exit(ut_failed);
+    }
+    shardcache_cache_on_set(cache, 0);
+
+    ut_testing("A volatile value is referenced only by the volatile storage until it's read");
+    shardcache_set(cache, "key1", 4, "value1", 6, 60, 0, 0, NULL, NULL);
+    ut_validate_int(volatile_refcnt(cache, "key1"), 1);
+
+    ut_testing("The cached object shares the value of the volatile item");
+    int ok = check_value(cache, "key1", "value1") && check_value(cache, "key1", "value1");
+    ut_validate_int(ok && volatile_refcnt(cache, "key1") == 2, 1);
+
+    ut_testing("An update creates a new value and drops the cached one");
+    shardcache_set(cache, "key1", 4, "new_value1", 10, 60, 0, 0, NULL, NULL);
+    int refcnt = volatile_refcnt(cache, "key1");
+    ok = check_value(cache, "key1", "new_value1");
+    if (refcnt == 1 && ok && volatile_refcnt(cache, "key1") == 2)
+        ut_success();
+    else
+        ut_failure("refcnt: %d, read: %d", refcnt, ok);
+
+    ut_testing("cache_on_set makes the cached object reference the new value");
+    shardcache_set(cache, "key2", 4, "old_value2", 10, 60, 0, 0, NULL, NULL);
+    shardcache_cache_on_set(cache, 1);
+    // only updates of existing volatile items are loaded into the cache
+    shardcache_set(cache, "key2", 4, "value2", 6, 60, 0, 0, NULL, NULL);
+    refcnt = volatile_refcnt(cache, "key2");
+    ok = check_value(cache, "key2", "value2");
+    if (refcnt == 2 && ok)
+        ut_success();
+    else
+        ut_failure("refcnt: %d, read: %d", refcnt, ok);
+
+    ut_testing("A removed volatile item can't be read from the cache anymore");
+    shardcache_del(cache, "key2", 4, NULL, NULL);
+    void *value = NULL;
+    size_t vlen = 0;
+    shardcache_get_sync(cache, "key2", 4, &value, &vlen, NULL);
+    ut_validate_int(value == NULL && vlen == 0, 1);
+    free(value);
+
+    shardcache_destroy(cache);
+    shardcache_node_destroy(node);
+
+    ut_summary();
+    exit(ut_failed);
+}
@@ -0,0 +1,228 @@
+#include <volatile_store.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_KEYS 20
+
+// size of a record holding a 7 bytes key ("key_NNN") and
+// a 9 bytes value ("value_NNN"): 24 bytes header + key + value (8-bytes aligned)
+#define RECORD_SIZE 40
+// the records follow the 16 bytes segment header
+#define RECORD_OFFSET(_i) (16 + (_i) * RECORD_SIZE)
+
+typedef struct {
+    volatile_store_loc_t loc[NUM_KEYS];
+    char value[NUM_KEYS][64];
+    int alive[NUM_KEYS];
+    time_t expire[NUM_KEYS];
+    int records;
+    int relocated;
+    pthread_mutex_t lock;
+} replayed_keys_t;
+
+static int
+key_index(void *key, size_t klen)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.*s", (int)klen, (char *)key);
+    int idx = atoi(buf + 4);
+    return (idx >= 0 && idx < NUM_KEYS) ? idx : 0;
+}
+
+static void
+replay_cb(volatile_store_t *store, void *key, size_t klen, void *value, size_t vlen,
+          time_t expire, volatile_store_loc_t loc, void *priv)
+{
+    replayed_keys_t *keys = (replayed_keys_t *)priv;
+    int idx = key_index(key, klen);
+    pthread_mutex_lock(&keys->lock);
+    keys->records++;
+    // records are replayed in parallel, keep the newest one
+    if (loc > keys->loc[idx]) {
+        if (keys->loc[idx] && keys->alive[idx])
+            volatile_store_release(store, keys->loc[idx]);
+        keys->loc[idx] = loc;
+        keys->alive[idx] = (value != NULL);
+        keys->expire[idx] = expire;
+        snprintf(keys->value[idx], sizeof(keys->value[idx]), "%.*s", (int)vlen, value ? (char *)value : "");
+    } else if (value) {
+        volatile_store_release(store, loc);
+    }
+    pthread_mutex_unlock(&keys->lock);
+}
+
+static int
+relocate_cb(volatile_store_t *store, void *key, size_t klen, void *value, size_t vlen,
+            time_t expire, volatile_store_loc_t old_loc, void *priv)
+{
+    replayed_keys_t *keys = (replayed_keys_t *)priv;
+    int idx = key_index(key, klen);
+    int rc = 0;
+    pthread_mutex_lock(&keys->lock);
+    if (keys->loc[idx] == old_loc) {
+        volatile_store_loc_t loc = volatile_store_put(store, key, klen, value, vlen, expire);
+        if (loc) {
+            keys->loc[idx] = loc;
+            keys->relocated++;
+            rc = 1;
+        } else {
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&keys->lock);
+    return rc;
+}
+
+static volatile_store_t *
+open_store(char *path, replayed_keys_t *keys)
+{
+    memset(keys, 0, sizeof(replayed_keys_t));
+    pthread_mutex_init(&keys->lock, NULL);
+    return volatile_store_open(path, 1<<16, 4, replay_cb, relocate_cb, keys);
+}
+
+static void
+remove_store(char *path)
+{
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+    if (system(cmd) != 0)
+        fprintf(stderr, "Can't remove %s\n", path);
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    char path[] = "/tmp/shardcache_vstore_test";
+    char segment[1024];
+    snprintf(segment, sizeof(segment), "%s/%010u.vseg", path, 1);
+    remove_store(path);
+
+    replayed_keys_t keys;
+    int i;
+
+    ut_testing("volatile_store_open() creates an empty log");
+    volatile_store_t *store = open_store(path, &keys);
+    if (!store) {
+        ut_failure("Can't open the store in %s", path);
+        exit(-1);
+    }
+    ut_validate_int(volatile_store_counters(store)->replay_records, 0);
+
+    ut_testing("volatile_store_put() %d keys and volatile_store_del() one of them", NUM_KEYS);
+    time_t expire = time(NULL) + 3600;
+    int failed = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        char key[32];
+        char value[32];
+        snprintf(key, sizeof(key), "key_%03d", i);
+        snprintf(value, sizeof(value), "value_%03d", i);
+        if (!volatile_store_put(store, key, strlen(key), value, strlen(value), i == 0 ? expire : 0))
+            failed++;
+    }
+    if (volatile_store_del(store, "key_003", 7) != 0)
+        failed++;
+    ut_validate_int(failed, 0);
+    volatile_store_close(store);
+
+    ut_testing("All the records are replayed when reopening the log");
+    store = open_store(path, &keys);
+    int ok = (store && keys.records == NUM_KEYS + 1);
+    for (i = 0; ok && i < NUM_KEYS; i++) {
+        char value[32];
+        snprintf(value, sizeof(value), "value_%03d", i);
+        if (i != 3 && (!keys.alive[i] || strcmp(keys.value[i], value) != 0))
+            ok = 0;
+    }
+    if (ok)
+        ut_success();
+    else
+        ut_failure("%d records replayed", keys.records);
+
+    ut_testing("The deletion marker is replayed after the value");
+    ut_validate_int(keys.alive[3], 0);
+
+    ut_testing("The expiration time is preserved");
+    ut_validate_int(keys.expire[0] == expire && keys.expire[1] == 0, 1);
+    volatile_store_close(store);
+
+    // simulate a record partially written at the time of a crash
+    ut_testing("A corrupted record is dropped together with the ones following it");
+    int fd = open(segment, O_RDWR);
+    char byte = 'X';
+    if (fd < 0 || pwrite(fd, &byte, 1, RECORD_OFFSET(10) + RECORD_SIZE - 10) != 1) {
+        ut_failure("Can't corrupt the segment %s", segment);
+    } else {
+        close(fd);
+        store = open_store(path, &keys);
+        // the deletion of key_003 followed the corrupted record
+        if (store && keys.records == 10 && keys.alive[3] && keys.alive[9] && !keys.alive[10])
+            ut_success();
+        else
+            ut_failure("%d records replayed", keys.records);
+    }
+
+    ut_testing("New records are appended to a new segment after a crash");
+    if (store && volatile_store_put(store, "key_010", 7, "value_new", 9, 0)) {
+        volatile_store_close(store);
+        store = open_store(path, &keys);
+        ut_validate_int(store && keys.alive[10] && strcmp(keys.value[10], "value_new") == 0, 1);
+    } else {
+        ut_failure("Can't write to the store");
+    }
+    if (store)
+        volatile_store_close(store);
+    remove_store(path);
+
+    ut_testing("Obsolete segments are compacted and the alive records moved");
+    store = open_store(path, &keys);
+    char value[64];
+    memset(value, 'v', sizeof(value));
+    int round;
+    for (round = 0; round < 2000; round++) {
+        for (i = 0; i < NUM_KEYS; i++) {
+            char key[32];
+            snprintf(key, sizeof(key), "key_%03d", i);
+            snprintf(value, sizeof(value), "value_%03d_%d", i, round);
+            pthread_mutex_lock(&keys.lock);
+            volatile_store_loc_t loc = volatile_store_put(store, key, strlen(key), value, strlen(value), 0);
+            if (keys.loc[i])
+                volatile_store_release(store, keys.loc[i]);
+            keys.loc[i] = loc;
+            pthread_mutex_unlock(&keys.lock);
+        }
+    }
+    for (i = 0; i < 50 && !volatile_store_counters(store)->compactions; i++)
+        usleep(100000);
+    volatile_store_counters_t *counters = volatile_store_counters(store);
+    if (counters->compactions > 0 && counters->dead * 2 <= counters->size + (1<<16))
+        ut_success();
+    else
+        ut_failure("%d compactions, %d bytes of %d are obsolete",
+                   (int)counters->compactions, (int)counters->dead, (int)counters->size);
+    volatile_store_close(store);
+
+    ut_testing("The latest values survive the compaction");
+    store = open_store(path, &keys);
+    ok = (store != NULL);
+    for (i = 0; ok && i < NUM_KEYS; i++) {
+        snprintf(value, sizeof(value), "value_%03d_%d", i, round - 1);
+        if (!keys.alive[i] || strcmp(keys.value[i], value) != 0)
+            ok = 0;
+    }
+    ut_validate_int(ok, 1);
+    if (store)
+        volatile_store_close(store);
+    remove_store(path);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
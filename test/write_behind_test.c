@@ -0,0 +1,262 @@
+#include <write_behind.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ut.h>
+#include <libgen.h>
+
+#define NUM_KEYS 100
+
+typedef struct {
+    char value[NUM_KEYS][64];
+    int present[NUM_KEYS];
+    int stores;
+    int removes;
+    int fail;    // writes fail while set
+    int blocked; // writes wait while set
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} test_storage_t;
+
+static int
+key_index(void *key, size_t klen)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.*s", (int)klen, (char *)key);
+    int idx = atoi(buf + 4);
+    return (idx >= 0 && idx < NUM_KEYS) ? idx : 0;
+}
+
+static int
+wait_unblocked(test_storage_t *st)
+{
+    pthread_mutex_lock(&st->lock);
+    while (st->blocked)
+        pthread_cond_wait(&st->cond, &st->lock);
+    int fail = st->fail;
+    pthread_mutex_unlock(&st->lock);
+    return fail;
+}
+
+static int
+st_store(void *key, size_t klen, void *value, size_t vlen, int mode, void *priv)
+{
+    test_storage_t *st = (test_storage_t *)priv;
+    if (wait_unblocked(st))
+        return -1;
+    int idx = key_index(key, klen);
+    pthread_mutex_lock(&st->lock);
+    snprintf(st->value[idx], sizeof(st->value[idx]), "%.*s", (int)vlen, (char *)value);
+    st->present[idx] = 1;
+    st->stores++;
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+static int
+st_remove(void *key, size_t klen, void *priv)
+{
+    test_storage_t *st = (test_storage_t *)priv;
+    if (wait_unblocked(st))
+        return -1;
+    int idx = key_index(key, klen);
+    pthread_mutex_lock(&st->lock);
+    st->present[idx] = 0;
+    st->removes++;
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+static void
+st_set(test_storage_t *st, int blocked, int fail)
+{
+    pthread_mutex_lock(&st->lock);
+    st->blocked = blocked;
+    st->fail = fail;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+}
+
+static int
+store_key(write_behind_t *wb, int i, char *prefix)
+{
+    char key[32];
+    char value[64];
+    snprintf(key, sizeof(key), "key_%d", i);
+    snprintf(value, sizeof(value), "%s_%d", prefix, i);
+    return write_behind_store(wb, key, strlen(key), value, strlen(value));
+}
+
+static int
+lookup_key(write_behind_t *wb, int i, char *value, size_t size)
+{
+    char key[32];
+    snprintf(key, sizeof(key), "key_%d", i);
+    void *v = NULL;
+    size_t vlen = 0;
+    int rc = write_behind_lookup(wb, key, strlen(key), &v, &vlen);
+    if (rc == 1) {
+        snprintf(value, size, "%.*s", (int)vlen, (char *)v);
+        free(v);
+    }
+    return rc;
+}
+
+static int
+check_storage(test_storage_t *st, char *prefix, int num_keys)
+{
+    int i;
+    int bad = 0;
+    pthread_mutex_lock(&st->lock);
+    for (i = 0; i < num_keys; i++) {
+        char expected[64];
+        snprintf(expected, sizeof(expected), "%s_%d", prefix, i);
+        if (!st->present[i] || strcmp(st->value[i], expected) != 0)
+            bad++;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    test_storage_t st;
+    memset(&st, 0, sizeof(st));
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+
+    shardcache_storage_t storage;
+    memset(&storage, 0, sizeof(storage));
+    storage.store = st_store;
+    storage.remove = st_remove;
+    storage.priv = &st;
+
+    ut_testing("write_behind_create(storage, 0, 10, NULL) == NULL");
+    ut_validate_int(write_behind_create(&storage, 0, 10, NULL) == NULL, 1);
+
+    write_behind_t *wb = write_behind_create(&storage, 4, 1000, NULL);
+    write_behind_counters_t *counters = write_behind_counters(wb);
+
+    ut_testing("Pending updates can be looked up before reaching the storage");
+    st_set(&st, 1, 0);
+    int i;
+    for (i = 0; i < NUM_KEYS; i++)
+        store_key(wb, i, "first");
+    char value[64];
+    int found = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        if (lookup_key(wb, i, value, sizeof(value)) == 1 && strncmp(value, "first_", 6) == 0)
+            found++;
+    }
+    ut_validate_int(found, NUM_KEYS);
+
+    ut_testing("Updates of a key still waiting to be written are coalesced");
+    // the keys already taken by the (blocked) flushers are not coalesced
+    // with the first update, but the following ones are
+    for (i = 0; i < NUM_KEYS; i++)
+        store_key(wb, i, "second");
+    for (i = 0; i < NUM_KEYS; i++)
+        store_key(wb, i, "second");
+    if (counters->coalesced >= NUM_KEYS && counters->pending == NUM_KEYS)
+        ut_success();
+    else
+        ut_failure("coalesced: %d, pending: %d", (int)counters->coalesced, (int)counters->pending);
+
+    ut_testing("write_behind_flush() writes the last update of each key");
+    st_set(&st, 0, 0);
+    write_behind_flush(wb);
+    if (check_storage(&st, "second", NUM_KEYS) == 0 && counters->pending == 0 &&
+        lookup_key(wb, 0, value, sizeof(value)) == -1)
+    {
+        ut_success();
+    } else {
+        ut_failure("bad keys: %d, pending: %d", check_storage(&st, "second", NUM_KEYS), (int)counters->pending);
+    }
+
+    ut_testing("A pending removal is looked up as a missing key");
+    st_set(&st, 1, 0);
+    write_behind_remove(wb, "key_1", 5);
+    ut_validate_int(lookup_key(wb, 1, value, sizeof(value)), 0);
+    st_set(&st, 0, 0);
+    write_behind_flush(wb);
+
+    ut_testing("write_behind_flush_key() returns -1 if the update can't be written");
+    st_set(&st, 0, 1);
+    uint64_t errors = counters->errors;
+    store_key(wb, 2, "third");
+    int rc = write_behind_flush_key(wb, "key_2", 5);
+    if (rc == -1 && counters->errors > errors && lookup_key(wb, 2, value, sizeof(value)) == 1)
+        ut_success();
+    else
+        ut_failure("rc: %d, errors: %d", rc, (int)counters->errors);
+
+    ut_testing("The update is dropped after WRITE_BEHIND_MAX_RETRIES failed writes");
+    // write_behind_flush_key() doesn't wait for the backoff
+    for (i = 0; i < WRITE_BEHIND_MAX_RETRIES && lookup_key(wb, 2, value, sizeof(value)) == 1; i++)
+        write_behind_flush_key(wb, "key_2", 5);
+    if (counters->dropped == 1 && lookup_key(wb, 2, value, sizeof(value)) == -1 && counters->pending == 0)
+        ut_success();
+    else
+        ut_failure("dropped: %d, pending: %d", (int)counters->dropped, (int)counters->pending);
+
+    ut_testing("write_behind_flush_key() returns 0 once the update has been written");
+    st_set(&st, 0, 0);
+    store_key(wb, 2, "fourth");
+    rc = write_behind_flush_key(wb, "key_2", 5);
+    ut_validate_int(rc == 0 && strcmp(st.value[2], "fourth_2") == 0, 1);
+
+    write_behind_destroy(wb);
+
+    char dir[] = "/tmp/write_behind_test_XXXXXX";
+    if (!mkdtemp(dir)) {
+        ut_testing("mkdtemp()");
+        ut_failure("Can't create the directory for the log");
+        ut_summary();
+        exit(ut_failed);
+    }
+
+    ut_testing("Updates which couldn't be written are replayed from the log");
+    memset(st.present, 0, sizeof(st.present));
+    st_set(&st, 0, 1);
+    wb = write_behind_create(&storage, 2, 1000, dir);
+    for (i = 0; i < NUM_KEYS; i++)
+        store_key(wb, i, "logged");
+    // the failing updates are dropped from the queue but left in the log
+    write_behind_destroy(wb);
+    // keep the replayed updates pending until they have been counted
+    st_set(&st, 1, 0);
+    wb = write_behind_create(&storage, 2, 1000, dir);
+    counters = wb ? write_behind_counters(wb) : NULL;
+    int replayed = wb ? (int)counters->pending : -1;
+    st_set(&st, 0, 0);
+    if (wb)
+        write_behind_flush(wb);
+    if (replayed == NUM_KEYS && check_storage(&st, "logged", NUM_KEYS) == 0)
+        ut_success();
+    else
+        ut_failure("replayed: %d, bad keys: %d", replayed, check_storage(&st, "logged", NUM_KEYS));
+    if (wb)
+        write_behind_destroy(wb);
+
+    ut_testing("Updates written to the storage are not replayed again");
+    wb = write_behind_create(&storage, 2, 1000, dir);
+    ut_validate_int(wb ? (int)write_behind_counters(wb)->pending : -1, 0);
+    if (wb)
+        write_behind_destroy(wb);
+
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0)
+        fprintf(stderr, "Can't remove %s\n", dir);
+
+    pthread_cond_destroy(&st.cond);
+    pthread_mutex_destroy(&st.lock);
+
+    ut_summary();
+
+    exit(ut_failed);
+}
@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <inttypes.h>
+
+#include <shardcache.h>
+
+static int num_threads = 64;
+static int num_requests = 1000;
+static int fetch_latency = 2000;
+static int batch_size = SHARDCACHE_STORAGE_BATCH_SIZE_DEFAULT;
+static int batch_window = SHARDCACHE_STORAGE_BATCH_WINDOW_DEFAULT;
+static int io_threads = SHARDCACHE_STORAGE_IO_THREADS_DEFAULT;
+static int base_port = 4450;
+
+typedef struct {
+    uint64_t fetches;
+    uint64_t multi_fetches;
+    uint64_t keys;
+} mock_storage_stats_t;
+
+typedef struct {
+    shardcache_t *cache;
+    int index;
+    uint64_t *latencies; // in microseconds
+    int errors;
+} benchmark_thread_arg_t;
+
+static void
+usage(char *progname, int rc, char *msg, ...)
+{
+    if (msg) {
+        va_list arg;
+        va_start(arg, msg);
+        vprintf(msg, arg);
+        printf("\n");
+    }
+
+    printf("Usage: %s [OPTION]...\n"
+           "    -t <num_threads>  The number of threads issuing concurrent gets (defaults to: %d)\n"
+           "    -n <num_requests> The number of gets issued by each thread (defaults to: %d)\n"
+           "    -l <latency>      The latency of each call to the mock storage in microseconds\n"
+           "                      (defaults to: %d)\n"
+           "    -b <batch_size>   The max number of misses coalesced in a single fetch_multi\n"
+           "                      (defaults to: %d)\n"
+           "    -w <window>       The batching window in microseconds (defaults to: %d)\n"
+           "    -i <io_threads>   The number of storage i/o threads (defaults to: %d)\n"
+           "    -p <port>         The first port used by the benchmarked instances (defaults to: %d)\n"
+           "    -h                Print this message and exit\n"
+           "\n"
+           "All the gets miss the cache, the benchmark runs first with the misses\n"
+           "coalesced into fetch_multi calls and then fetching each key by itself\n"
+           , progname
+           , num_threads
+           , num_requests
+           , fetch_latency
+           , batch_size
+           , batch_window
+           , io_threads
+           , base_port);
+    exit(rc);
+}
+
+// the mock storage pays the same latency for a single key and for a batch,
+// as a database would for a round trip
+static int
+mock_fetch(void *key, size_t klen, void **value, size_t *vlen, void *priv)
+{
+    mock_storage_stats_t *stats = (mock_storage_stats_t *)priv;
+    usleep(fetch_latency);
+    *value = malloc(klen);
+    memcpy(*value, key, klen);
+    *vlen = klen;
+    __sync_fetch_and_add(&stats->fetches, 1);
+    __sync_fetch_and_add(&stats->keys, 1);
+    return 0;
+}
+
+static int
+mock_fetch_multi(void **keys, size_t *klens, int nkeys, void **values, size_t *vlens, void *priv)
+{
+    mock_storage_stats_t *stats = (mock_storage_stats_t *)priv;
+    usleep(fetch_latency);
+    int i;
+    for (i = 0; i < nkeys; i++) {
+        values[i] = malloc(klens[i]);
+        memcpy(values[i], keys[i], klens[i]);
+        vlens[i] = klens[i];
+    }
+    __sync_fetch_and_add(&stats->multi_fetches, 1);
+    __sync_fetch_and_add(&stats->keys, nkeys);
+    return 0;
+}
+
+static void *
+benchmark_thread(void *priv)
+{
+    benchmark_thread_arg_t *arg = (benchmark_thread_arg_t *)priv;
+    int i;
+    for (i = 0; i < num_requests; i++) {
+        char key[64];
+        snprintf(key, sizeof(key), "batch_benchmark_%d_%d", arg->index, i);
+
+        struct timeval start, end, elapsed;
+        gettimeofday(&start, NULL);
+
+        void *value = NULL;
+        size_t vlen = 0;
+        int rc = shardcache_get_sync(arg->cache, key, strlen(key), &value, &vlen, NULL);
+        if (rc != 0 || vlen != strlen(key))
+            arg->errors++;
+        free(value);
+
+        gettimeofday(&end, NULL);
+        timersub(&end, &start, &elapsed);
+        arg->latencies[i] = elapsed.tv_sec * 1000000 + elapsed.tv_usec;
+    }
+    return NULL;
+}
+
+static int
+compare_latencies(const void *a, const void *b)
+{
+    uint64_t la = *((uint64_t *)a);
+    uint64_t lb = *((uint64_t *)b);
+    return (la > lb) - (la < lb);
+}
+
+static void
+print_counter(shardcache_t *cache, char *prefix)
+{
+    shardcache_counter_t *counters = NULL;
+    int num_counters = shardcache_get_counters(cache, &counters);
+    int i;
+    for (i = 0; i < num_counters; i++) {
+        if (strncmp(counters[i].name, prefix, strlen(prefix)) == 0 && counters[i].value)
+            printf("    %s: %"PRIu64"\n", counters[i].name, counters[i].value);
+    }
+    free(counters);
+}
+
+static void
+run_benchmark(int port, int batched)
+{
+    mock_storage_stats_t stats = { 0, 0, 0 };
+    shardcache_storage_t storage;
+    memset(&storage, 0, sizeof(storage));
+    storage.version = SHARDCACHE_STORAGE_API_VERSION;
+    storage.fetch = mock_fetch;
+    storage.fetch_multi = mock_fetch_multi;
+    storage.priv = &stats;
+
+    char address[32];
+    snprintf(address, sizeof(address), "127.0.0.1:%d", port);
+    char *address_array[1] = { address };
+    shardcache_node_t *node = shardcache_node_create("bench", address_array, 1);
+
+    shardcache_t *cache = shardcache_create("bench", &node, 1, &storage, 1, 0, 1<<29);
+    if (!cache) {
+        fprintf(stderr, "Can't create the shardcache instance on port %d\n", port);
+        exit(-1);
+    }
+    shardcache_storage_batch_size(cache, batched ? batch_size : 0);
+    shardcache_storage_batch_window(cache, batch_window);
+    shardcache_storage_io_threads(cache, io_threads);
+
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    benchmark_thread_arg_t *args = calloc(num_threads, sizeof(benchmark_thread_arg_t));
+    uint64_t *latencies = calloc((size_t)num_threads * num_requests, sizeof(uint64_t));
+
+    struct timeval start, end, elapsed;
+    gettimeofday(&start, NULL);
+
+    int i;
+    for (i = 0; i < num_threads; i++) {
+        args[i].cache = cache;
+        args[i].index = i;
+        args[i].latencies = latencies + ((size_t)i * num_requests);
+        pthread_create(&threads[i], NULL, benchmark_thread, &args[i]);
+    }
+
+    int errors = 0;
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        errors += args[i].errors;
+    }
+
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &elapsed);
+
+    double secs = elapsed.tv_sec + elapsed.tv_usec / 1e6;
+    if (secs <= 0)
+        secs = 1e-6;
+
+    size_t total = (size_t)num_threads * num_requests;
+    qsort(latencies, total, sizeof(uint64_t), compare_latencies);
+
+    printf("%s : %zu gets in %.3f secs (%.0f gets/s), latency p50 %"PRIu64"us"
+           " p99 %"PRIu64"us max %"PRIu64"us%s\n",
+           batched ? "batched" : "single ", total, secs, total / secs,
+           latencies[total / 2], latencies[(total * 99) / 100], latencies[total - 1],
+           errors ? " ERRORS!" : "");
+    printf("    storage calls: %"PRIu64" fetch, %"PRIu64" fetch_multi (%"PRIu64" keys)\n",
+           stats.fetches, stats.multi_fetches, stats.keys);
+    if (batched)
+        print_counter(cache, "storage_batch");
+
+    shardcache_destroy(cache);
+    shardcache_node_destroy(node);
+    free(latencies);
+    free(args);
+    free(threads);
+}
+
+int
+main (int argc, char **argv)
+{
+    static struct option long_options[] = {
+        { "threads", 2, 0, 't' },
+        { "requests", 2, 0, 'n' },
+        { "latency", 2, 0, 'l' },
+        { "batch_size", 2, 0, 'b' },
+        { "window", 2, 0, 'w' },
+        { "io_threads", 2, 0, 'i' },
+        { "port", 2, 0, 'p' },
+        { "help", 0, 0, 'h' },
+        { NULL, 0, 0,  0 }
+    };
+
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "hb:i:l:n:p:t:w:", long_options, &option_index))) {
+        if (c == -1)
+            break;
+        switch(c) {
+            case 'h':
+                usage(argv[0], 0, NULL);
+                break;
+            case 'b':
+                batch_size = strtol(optarg, NULL, 10);
+                break;
+            case 'i':
+                io_threads = strtol(optarg, NULL, 10);
+                break;
+            case 'l':
+                fetch_latency = strtol(optarg, NULL, 10);
+                break;
+            case 'n':
+                num_requests = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                base_port = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                num_threads = strtol(optarg, NULL, 10);
+                break;
+            case 'w':
+                batch_window = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0], -1, NULL);
+        }
+    }
+
+    if (num_threads <= 0 || num_requests <= 0 || fetch_latency < 0 ||
+        batch_size < 2 || batch_window < 0 || io_threads <= 0)
+    {
+        usage(argv[0], -1, "Invalid arguments (batches need at least 2 keys and at least 1 i/o thread is needed)");
+    }
+
+    shardcache_log_init("batch_benchmark", LOG_WARNING);
+
+    run_benchmark(base_port, 1);
+    run_benchmark(base_port + 1, 0);
+
+    exit(0);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <sys/time.h>
+#include <inttypes.h>
+#include <fbuf.h>
+
+#include <messaging.h>
+#include <async_reader.h>
+
+static int num_messages = 10000;
+static int num_records = 2;
+static int record_size = 1024;
+static int read_size = 16384;
+static int compression_threshold = 0;
+
+typedef struct {
+    uint64_t bytes;
+    uint64_t records;
+    uint64_t messages;
+    uint64_t errors;
+} parser_stats_t;
+
+static void
+usage(char *progname, int rc, char *msg, ...)
+{
+    if (msg) {
+        va_list arg;
+        va_start(arg, msg);
+        vprintf(msg, arg);
+        printf("\n");
+    }
+
+    printf("Usage: %s [OPTION]...\n"
+           "    -m <num_messages> The number of messages to parse for each protocol version (defaults to: %d)\n"
+           "    -n <num_records>  The number of records in each message (defaults to: %d)\n"
+           "    -s <record_size>  The size of each record in bytes (defaults to: %d)\n"
+           "    -r <read_size>    The size of the buffers fed to the parser,\n"
+           "                      simulating the reads from a socket (defaults to: %d)\n"
+           "    -z <threshold>    Compression threshold used for protocol version 3\n"
+           "                      (defaults to: %d, which disables compression)\n"
+           "    -h                Print this message and exit\n"
+           , progname
+           , num_messages
+           , num_records
+           , record_size
+           , read_size
+           , compression_threshold);
+    exit(rc);
+}
+
+static int
+parser_callback(void *data, size_t len, int idx, size_t total_len, void *priv)
+{
+    parser_stats_t *stats = (parser_stats_t *)priv;
+    if (idx >= 0) {
+        if (data)
+            stats->bytes += len;
+        else
+            stats->records++;
+    } else if (idx == -1) {
+        stats->records++;
+        stats->messages++;
+    } else if (idx == -2) {
+        stats->errors++;
+    }
+    return 0;
+}
+
+static void
+run_benchmark(char version)
+{
+    int i;
+    shardcache_record_t records[num_records];
+    char *data = malloc(record_size);
+    for (i = 0; i < record_size; i++)
+        data[i] = 'a' + (i % 26);
+
+    for (i = 0; i < num_records; i++) {
+        records[i].v = data;
+        records[i].l = record_size;
+    }
+
+    // all the messages are sent back-to-back (as pipelined requests would be)
+    fbuf_t input = FBUF_STATIC_INITIALIZER;
+    for (i = 0; i < num_messages; i++) {
+        if (build_message(SHC_HDR_SET, records, num_records, &input, version) != 0) {
+            fprintf(stderr, "Can't build the test messages\n");
+            exit(-1);
+        }
+    }
+
+    parser_stats_t stats = { 0, 0, 0, 0 };
+    async_read_ctx_t *ctx = async_read_context_create(parser_callback, &stats);
+
+    struct timeval start, end, elapsed;
+    gettimeofday(&start, NULL);
+
+    char *p = fbuf_data(&input);
+    int left = fbuf_used(&input);
+    while (left > 0) {
+        int len = left < read_size ? left : read_size;
+        int processed = 0;
+        async_read_context_state_t state = async_read_context_input_data(ctx, p, len, &processed);
+        while (state == SHC_STATE_READING_DONE)
+            state = async_read_context_update(ctx);
+        if (state == SHC_STATE_READING_ERR)
+            break;
+        p += processed;
+        left -= processed;
+    }
+
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &elapsed);
+
+    double secs = elapsed.tv_sec + elapsed.tv_usec / 1e6;
+    if (secs <= 0)
+        secs = 1e-6;
+
+    printf("v%d : %"PRIu64" messages, %"PRIu64" records, %"PRIu64" bytes in %.3f secs"
+           " (%.0f msg/s, %.2f MB/s on the wire)%s\n",
+           version, stats.messages, stats.records, stats.bytes, secs,
+           stats.messages / secs, fbuf_used(&input) / secs / (1<<20),
+           stats.errors ? " ERRORS!" : "");
+
+    async_read_context_destroy(ctx);
+    fbuf_destroy(&input);
+    free(data);
+}
+
+int
+main (int argc, char **argv)
+{
+    static struct option long_options[] = {
+        { "messages", 2, 0, 'm' },
+        { "records", 2, 0, 'n' },
+        { "record_size", 2, 0, 's' },
+        { "read_size", 2, 0, 'r' },
+        { "compression_threshold", 2, 0, 'z' },
+        { "help", 0, 0, 'h' },
+        { NULL, 0, 0,  0 }
+    };
+
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "hm:n:r:s:z:", long_options, &option_index))) {
+        if (c == -1)
+            break;
+        switch(c) {
+            case 'h':
+                usage(argv[0], 0, NULL);
+                break;
+            case 'm':
+                num_messages = strtol(optarg, NULL, 10);
+                break;
+            case 'n':
+                num_records = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                read_size = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                record_size = strtol(optarg, NULL, 10);
+                break;
+            case 'z':
+                compression_threshold = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0], -1, NULL);
+        }
+    }
+
+    if (num_messages <= 0 || num_records <= 0 || record_size <= 0 || read_size <= 0)
+        usage(argv[0], -1, "All the sizes must be positive numbers");
+
+    global_compression_threshold(compression_threshold);
+
+    char version;
+    for (version = 1; version <= SHC_PROTOCOL_VERSION_MAX; version++)
+        run_benchmark(version);
+
+    exit(0);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <sys/time.h>
+#include <inttypes.h>
+#include <chash.h>
+
+#include <routing_table.h>
+
+static int num_nodes = 10;
+static int num_keys = 1000000;
+static int key_size = 16;
+
+typedef struct {
+    char **labels;
+    size_t *lens;
+    int num_nodes;
+    struct chash_t *chash;
+    routing_table_t *table;
+} routing_t;
+
+static void
+usage(char *progname, int rc, char *msg, ...)
+{
+    if (msg) {
+        va_list arg;
+        va_start(arg, msg);
+        vprintf(msg, arg);
+        printf("\n");
+    }
+
+    printf("Usage: %s [OPTION]...\n"
+           "    -n <num_nodes> The number of nodes in the continuum (defaults to: %d)\n"
+           "    -k <num_keys>  The number of keys to look up in each mode (defaults to: %d)\n"
+           "    -s <key_size>  The size of each key in bytes (defaults to: %d)\n"
+           "    -h             Print this message and exit\n"
+           , progname
+           , num_nodes
+           , num_keys
+           , key_size);
+    exit(rc);
+}
+
+static double
+elapsed_secs(struct timeval *start)
+{
+    struct timeval end, elapsed;
+    gettimeofday(&end, NULL);
+    timersub(&end, start, &elapsed);
+    double secs = elapsed.tv_sec + elapsed.tv_usec / 1e6;
+    return secs > 0 ? secs : 1e-6;
+}
+
+static void
+routing_init(routing_t *r, shardcache_routing_mode_t mode, int nodes)
+{
+    int i;
+    r->num_nodes = nodes;
+    r->labels = malloc(sizeof(char *) * nodes);
+    r->lens = malloc(sizeof(size_t) * nodes);
+    for (i = 0; i < nodes; i++) {
+        r->labels[i] = malloc(32);
+        // jump hashing moves the minimum of keys only when nodes are
+        // appended to the sorted list, so the labels sort numerically
+        snprintf(r->labels[i], 32, "node%05d", i);
+        r->lens[i] = strlen(r->labels[i]);
+    }
+    r->chash = chash_create((const char **)r->labels, r->lens, nodes, ROUTING_TABLE_CHASH_REPLICAS);
+    r->table = NULL;
+    if (mode != SHARDCACHE_ROUTING_CHASH) {
+        r->table = routing_table_create(mode, r->labels, nodes, NULL);
+        if (!r->table) {
+            fprintf(stderr, "Can't create the routing table\n");
+            exit(-1);
+        }
+    }
+}
+
+static void
+routing_destroy(routing_t *r)
+{
+    int i;
+    if (r->table)
+        routing_table_destroy(r->table);
+    chash_free(r->chash);
+    for (i = 0; i < r->num_nodes; i++)
+        free(r->labels[i]);
+    free(r->labels);
+    free(r->lens);
+}
+
+// the chash mode resolves the label returned by the continuum
+// to the node index as the client used to do
+static inline int
+routing_lookup(routing_t *r, void *key, size_t klen)
+{
+    if (r->table)
+        return routing_table_lookup(r->table, key, klen);
+
+    const char *node_name = NULL;
+    size_t name_len = 0;
+    chash_lookup(r->chash, key, klen, &node_name, &name_len);
+    int i;
+    for (i = 0; i < r->num_nodes; i++) {
+        if (strncmp(node_name, r->labels[i], name_len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void
+run_benchmark(shardcache_routing_mode_t mode, char *name, char *keys)
+{
+    routing_t r, grown;
+    struct timeval start;
+
+    gettimeofday(&start, NULL);
+    routing_init(&r, mode, num_nodes);
+    double build_secs = elapsed_secs(&start);
+
+    int *owners = malloc(sizeof(int) * num_keys);
+    uint64_t *counts = calloc(num_nodes, sizeof(uint64_t));
+    int i;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < num_keys; i++)
+        owners[i] = routing_lookup(&r, keys + (size_t)i * key_size, key_size);
+    double secs = elapsed_secs(&start);
+
+    uint64_t min = UINT64_MAX, max = 0;
+    for (i = 0; i < num_keys; i++) {
+        if (owners[i] >= 0)
+            counts[owners[i]]++;
+    }
+    for (i = 0; i < num_nodes; i++) {
+        if (counts[i] < min)
+            min = counts[i];
+        if (counts[i] > max)
+            max = counts[i];
+    }
+
+    // keys changing owner when a node is added (the optimum is 1/(num_nodes+1))
+    routing_init(&grown, mode, num_nodes + 1);
+    uint64_t moved = 0;
+    for (i = 0; i < num_keys; i++) {
+        if (routing_lookup(&grown, keys + (size_t)i * key_size, key_size) != owners[i])
+            moved++;
+    }
+
+    double avg = (double)num_keys / num_nodes;
+    printf("%-6s: %d lookups in %.3f secs (%.0f lookups/s, %.1f ns/lookup), built in %.3f msecs\n"
+           "        keys per node min/max: %.1f%%/%.1f%% of the average,"
+           " moved adding a node: %.2f%% (optimum %.2f%%)\n",
+           name, num_keys, secs, num_keys / secs, secs * 1e9 / num_keys, build_secs * 1e3,
+           min * 100 / avg, max * 100 / avg,
+           moved * 100.0 / num_keys, 100.0 / (num_nodes + 1));
+
+    routing_destroy(&grown);
+    routing_destroy(&r);
+    free(counts);
+    free(owners);
+}
+
+int
+main (int argc, char **argv)
+{
+    static struct option long_options[] = {
+        { "nodes", 2, 0, 'n' },
+        { "keys", 2, 0, 'k' },
+        { "key_size", 2, 0, 's' },
+        { "help", 0, 0, 'h' },
+        { NULL, 0, 0,  0 }
+    };
+
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "hk:n:s:", long_options, &option_index))) {
+        if (c == -1)
+            break;
+        switch(c) {
+            case 'h':
+                usage(argv[0], 0, NULL);
+                break;
+            case 'k':
+                num_keys = strtol(optarg, NULL, 10);
+                break;
+            case 'n':
+                num_nodes = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                key_size = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0], -1, NULL);
+        }
+    }
+
+    if (num_keys <= 0 || key_size <= 0)
+        usage(argv[0], -1, "All the sizes must be positive numbers");
+
+    if (num_nodes <= 0 || num_nodes >= ROUTING_TABLE_MAX_NODES)
+        usage(argv[0], -1, "The number of nodes must be between 1 and %d", ROUTING_TABLE_MAX_NODES - 1);
+
+    // the same keys are looked up in all the modes
+    char *keys = malloc((size_t)num_keys * key_size);
+    size_t i;
+    unsigned int seed = 1;
+    for (i = 0; i < (size_t)num_keys * key_size; i++)
+        keys[i] = 'a' + rand_r(&seed) % 26;
+
+    run_benchmark(SHARDCACHE_ROUTING_CHASH, "chash", keys);
+    run_benchmark(SHARDCACHE_ROUTING_TABLE, "table", keys);
+    run_benchmark(SHARDCACHE_ROUTING_JUMP, "jump", keys);
+
+    free(keys);
+    exit(0);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
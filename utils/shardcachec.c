@@ -3,21 +3,32 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 #include <chash.h>
 #include <shardcache_client.h>
 #include <pthread.h>
 
+static int
+print_index_item(void *key, size_t klen, size_t vlen, void *priv)
+{
+    printf("%.*s => %u\n", (int)klen, (char *)key, (uint32_t)vlen);
+    return 0;
+}
+
 void usage(char *prgname) {
     printf("Usage: %s <Command> <Key>\n"
            "   Commands: \n"
            "        get       <key> [ <output_file> (defaults to stdout) ]\n"
            "        getf      <key> [ <output_file> (defaults to stdout) ]\n"
            "        get_async <key> [ <output_file> (defaults to stdout) ]\n"
+           "        get_stream <key> [ <output_file> (defaults to stdout) ]\n"
            "        get_multi <key> [ <key> ... ] [ -o <output_dir>   (defaults to stdout) ]\n"
            "        offset    <key> <offset> <kength> [ <output_file> (defaults to stdout)\n"
            "        set       <key> [ -e <expire> ] [ -i <input_file> (defaults to stdin) ]\n"
            "        add       <key> [ -e <expire> ] [ -i <input_file> (defaults to stdin) ]\n"
+           "        set_stream <key> [ -e <expire> ] [ -i <input_file> (defaults to stdin) ]\n"
+           "                  (the input must be a regular file)\n"
            "        exists    <key>\n"
            "        touch     <key>\n"
            "        del       <key>\n"
@@ -161,6 +172,25 @@ int main (int argc, char **argv) {
             }
         }
         rc = shardcache_client_get_async(client, argv[2], strlen(argv[2]), print_chunk, output_file); 
+    } else if (strcasecmp(cmd, "get_stream") == 0) {
+        if (argc > 3) {
+            output_file = fopen(argv[3], "w");
+            if (!output_file) {
+                fprintf(stderr, "Can't open file %s for writing : %s\n",
+                        argv[3], strerror(errno));
+                exit(-1);
+            }
+        }
+        shardcache_client_get_stream_t *stream = shardcache_client_get_stream(client, argv[2], strlen(argv[2]), 0, 0);
+        if (stream) {
+            void *chunk = NULL;
+            size_t len = 0;
+            while ((rc = shardcache_client_get_stream_next(stream, &chunk, &len)) == 1)
+                print_chunk(NULL, NULL, 0, chunk, len, 0, 0, output_file);
+            shardcache_client_get_stream_close(stream);
+        } else {
+            rc = -1;
+        }
     } else if (strcasecmp(cmd, "get_multi") == 0) {
         char **keys = &argv[2];
         int num_keys = argc - 2;
@@ -224,7 +254,8 @@ int main (int argc, char **argv) {
             free(outname);
         }
     } else if (strcasecmp(cmd, "set") == 0 ||
-               strcasecmp(cmd, "add") == 0)
+               strcasecmp(cmd, "add") == 0 ||
+               strcasecmp(cmd, "set_stream") == 0)
     {
         FILE *infile = NULL;
         uint32_t expire = 0;
@@ -262,24 +293,48 @@ int main (int argc, char **argv) {
                 exit(-1);
             }
         }
-        char *in = NULL;
-        size_t s = 0;
-        char buf[1024];
-        int rb = fread(buf, 1, 1024, infile ? infile : stdin);
-        while (rb > 0) {
-            in = realloc(in, s+rb);
-            memcpy(in + s, buf, rb);
-            s += rb;
-            rb = fread(buf, 1, 1024, infile ? infile : stdin);
-        }
 
-        if (strcasecmp(cmd, "set") == 0) {
-            rc = shardcache_client_set(client, argv[2], strlen(argv[2]), in, s, expire);
+        if (strcasecmp(cmd, "set_stream") == 0) {
+            // the size of the value must be known before sending it
+            struct stat st;
+            if (fstat(fileno(infile ? infile : stdin), &st) != 0 || !S_ISREG(st.st_mode)) {
+                fprintf(stderr, "The input of set_stream must be a regular file\n");
+                exit(-1);
+            }
+            shardcache_client_set_stream_t *stream =
+                shardcache_client_set_stream(client, argv[2], strlen(argv[2]), st.st_size, expire);
+            rc = stream ? 0 : -1;
+            char buf[65536];
+            int rb;
+            while (rc == 0 && (rb = fread(buf, 1, sizeof(buf), infile ? infile : stdin)) > 0)
+                rc = shardcache_client_set_stream_write(stream, buf, rb);
+            if (stream) {
+                // an incomplete value is discarded
+                int close_rc = shardcache_client_set_stream_close(stream);
+                if (rc == 0)
+                    rc = close_rc;
+            }
         } else {
-            rc = shardcache_client_add(client, argv[2], strlen(argv[2]), in, s, expire);
-            if (rc == 1)
-                printf("Already exists!\n");
+            char *in = NULL;
+            size_t s = 0;
+            char buf[1024];
+            int rb = fread(buf, 1, 1024, infile ? infile : stdin);
+            while (rb > 0) {
+                in = realloc(in, s+rb);
+                memcpy(in + s, buf, rb);
+                s += rb;
+                rb = fread(buf, 1, 1024, infile ? infile : stdin);
+            }
+
+            if (strcasecmp(cmd, "set") == 0) {
+                rc = shardcache_client_set(client, argv[2], strlen(argv[2]), in, s, expire);
+            } else {
+                rc = shardcache_client_add(client, argv[2], strlen(argv[2]), in, s, expire);
+                if (rc == 1)
+                    printf("Already exists!\n");
+            }
         }
+
         if (infile)
             fclose(infile);
     } else if (strcasecmp(cmd, "del") == 0 || strcasecmp(cmd, "delete") == 0) {
@@ -351,19 +406,8 @@ int main (int argc, char **argv) {
                 continue;
             found++;
             printf("* Index for node: %s (%s)\n\n", label, address);
-            shardcache_storage_index_t *index = shardcache_client_index(client, label);
-            if (index) {
-                int n;
-                for (n = 0; n < index->size; n ++) {
-                    shardcache_storage_index_item_t *item = &index->items[n];
-                    char keystr[item->klen+1];
-                    snprintf(keystr, sizeof(keystr), "%s", (char *)item->key);
-                    printf("%s => %u\n", keystr, (uint32_t)item->vlen);
-                }
-                shardcache_free_index(index);
-            } else {
+            if (shardcache_client_index_foreach(client, label, print_index_item, NULL) != 0)
                 printf("%s NOT OK\n", label);
-            }
             printf("\n");
         }
         if (found == 0 && selected_node)
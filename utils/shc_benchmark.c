@@ -21,6 +21,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
 static int quit = 0;
 static shardcache_node_t **hosts = NULL;
 static int num_hosts = 0;
@@ -42,6 +43,13 @@ static uint64_t num_gets = 0;
 static uint64_t num_sets = 0;
 static uint64_t num_responses = 0;
 static uint64_t num_running_clients = 0;
+static int shared_mode = 0;
+static int batch_size = 0;
+static int use_multi_commands = 1;
+static int async_depth = 0;
+static size_t near_cache_size = 0;
+static int auto_multi_window = 0;
+static shardcache_client_t *shared_client = NULL;
 char *index_file = NULL;
 shardcache_counters_t *counters = NULL;
 hashtable_t *prev_counts = NULL;
@@ -53,8 +61,22 @@ typedef struct {
     uint64_t num_responses;
     char *node;
     struct timeval last_update;
+    shm_channel_t *shm;
 } client_ctx;
 
+// state of a worker issuing requests through the shardcache
+// client api, either blocking (-S) or non-blocking (-A)
+typedef struct {
+    shardcache_client_t *client;
+    uint64_t num_requests;
+    uint64_t num_responses;
+    unsigned int seed;
+    int id;
+    // the filedescriptors the async client asked to watch
+    struct pollfd *pollfds;
+    int num_pollfds;
+} sync_worker_ctx;
+
 static void
 usage(char *progname, int rc, char *msg, ...)
 {
@@ -72,6 +94,8 @@ usage(char *progname, int rc, char *msg, ...)
            "    -t <num_threads>  The number of threads (defaults to: %d)\n"
            "    -h                Print this message and exit\n"
            "    -H <hosts_string> A shardcache hosts string (defaults to: $SHC_HOSTS)\n"
+           "                      (node addresses can be 'host:port', 'unix:<path>' or 'shm:<path>'\n"
+           "                      to compare the tcp, unix socket and shared memory transports)\n"
            "    -i                Use the index instead of generating test keys\n"
            "    -k <num_keys>     The number of keys to use during the test (defaults to: %d)\n"
            "    -e <expire_time>  Optionally set the expiration time for the test keys (defaults to: 0)\n"
@@ -81,6 +105,21 @@ usage(char *progname, int rc, char *msg, ...)
            "    -w <wrate>        Rate at which to send set/del/evict commands instead of get\n"
            "    -W <write_mode>   Determines which command to send at the requested write rate\n"
            "                      0 => 'set', 1 => 'del' , 2 => 'evict' (defaults to 0)\n"
+           "    -S <shared_mode>  Use the blocking client api instead of raw pipelined connections\n"
+           "                      1 => one client shared by all the threads,\n"
+           "                      2 => one client per thread (to measure the contention\n"
+           "                           on a shared client against private ones)\n"
+           "    -b <batch_size>   Get the keys in batches using shardcache_client_get_multi()\n"
+           "                      (implies -S 1 if no shared mode has been specified)\n"
+           "    -M                Pipeline one GET per key in the batches instead of sending\n"
+           "                      a single GET_MULTI command to each node\n"
+           "    -A <depth>        Use the non-blocking client api from a poll() loop, keeping\n"
+           "                      <depth> requests in progress in each thread\n"
+           "                      (implies -S 2 if no shared mode has been specified)\n"
+           "    -N <size>         Keep a near cache of <size> bytes in the blocking clients\n"
+           "                      (implies -S 1 if no shared mode has been specified)\n"
+           "    -B <usecs>        Collect the gets issued by the threads sharing the client within\n"
+           "                      <usecs> microseconds and send them together (implies -S 1)\n"
            "    -v                Be verbose\n"
            , progname
            , num_clients
@@ -112,8 +151,13 @@ close_connection(iomux_t *iomux, int fd, void *priv)
     async_read_context_destroy(ctx->reader);
     fbuf_free(ctx->output);
 
+    // NOTE: when using a shm channel the fd is its doorbell
+    //       and gets closed together with the channel
+    if (ctx->shm)
+        shm_channel_destroy(ctx->shm);
+    else
+        close(fd);
     free(ctx);
-    close(fd);
     __sync_sub_and_fetch(&num_running_clients, 1);
 }
 
@@ -176,7 +220,16 @@ send_command(iomux_t *iomux, int fd, unsigned char **data, int *len, void *priv)
     }
 
     // flush as much as we can
-    if (fbuf_used(output_buffer)) {
+    if (ctx->shm) {
+        // the requests are written directly in the ring,
+        // nothing has to be written to the doorbell
+        if (fbuf_used(output_buffer)) {
+            int wb = shm_channel_write(ctx->shm, fbuf_data(output_buffer), fbuf_used(output_buffer));
+            if (wb > 0)
+                fbuf_remove(output_buffer, wb);
+        }
+        *len = 0;
+    } else if (fbuf_used(output_buffer)) {
         *len = fbuf_detach(output_buffer, (char **)data, NULL);
     } else {
         *len = 0;
@@ -184,13 +237,11 @@ send_command(iomux_t *iomux, int fd, unsigned char **data, int *len, void *priv)
     return IOMUX_OUTPUT_MODE_FREE;
 }
 
-int
-discard_response(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+static int
+parse_responses(client_ctx *ctx, void *data, int len)
 {
-    client_ctx *ctx = (client_ctx *)priv;
     int processed = 0;
-    
-    //printf("received %d\n", len);
+
     async_read_context_state_t state = async_read_context_input_data(ctx->reader, data, len, &processed);
     while (state == SHC_STATE_READING_DONE) {
         __sync_add_and_fetch(&num_responses, 1);
@@ -200,37 +251,63 @@ discard_response(iomux_t *iomux, int fd, unsigned char *data, int len, void *pri
     if (state == SHC_STATE_READING_ERR) {
         fprintf(stderr, "Async context returned error\n");
     }
+    return processed;
+}
+
+static int start_client(iomux_t *iomux, char *addr, int timeout, iomux_timeout_callback_t timeout_cb);
+
+// returns 1 if the connection has been closed and replaced by a new one
+static int
+renew_connection(iomux_t *iomux, int fd, client_ctx *ctx)
+{
     if (max_requests && __sync_fetch_and_add(&ctx->num_responses, 0) >= max_requests) {
-        int newfd = connect_to_peer(ctx->node, 10000);
-        if (newfd < 0) {
-            fprintf(stderr, "Can't connect to %s: %s\n", ctx->node, strerror(errno));
+        if (start_client(iomux, ctx->node, 10000, NULL) != 0)
             exit(-99);
+        iomux_close(iomux, fd);
+        return 1;
+    }
+
+    gettimeofday(&ctx->last_update, NULL);
+    return 0;
+}
+
+int
+discard_response(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    client_ctx *ctx = (client_ctx *)priv;
+
+    //printf("received %d\n", len);
+    parse_responses(ctx, data, len);
+    renew_connection(iomux, fd, ctx);
+    return len;
+}
+
+int
+discard_shm_response(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    client_ctx *ctx = (client_ctx *)priv;
+
+    // 'data' is just the doorbell counter, the responses are in the ring
+    for (;;) {
+        void *rdata = NULL;
+        int rlen = shm_channel_peek(ctx->shm, &rdata);
+        if (rlen == -1) {
+            fprintf(stderr, "Broken shm channel to %s\n", ctx->node);
+            iomux_close(iomux, fd);
+            break;
         }
 
-        client_ctx *newctx = calloc(1, sizeof(client_ctx));
-        newctx->reader = async_read_context_create(NULL, NULL);
-        newctx->output = fbuf_create(0);
-        newctx->node = ctx->node;
-        iomux_callbacks_t cbs = {
-            .mux_output = send_command,
-            .mux_timeout = NULL,
-            .mux_input = discard_response,
-            .mux_eof = close_connection,
-            .priv = newctx
-        };
+        if (rlen == 0) {
+            // go to sleep only if nothing arrived in the meanwhile
+            if (shm_channel_arm(ctx->shm) == 0)
+                break;
+            continue;
+        }
 
-        char label[256];
-        snprintf(label, sizeof(label), "[client %p] requests", newctx);
-        shardcache_counter_add(counters, label, &newctx->num_requests);
-        snprintf(label, sizeof(label), "[client %p] responses", newctx);
-        shardcache_counter_add(counters, label, &newctx->num_responses);
-        if (iomux_add(iomux, newfd, &cbs) == 1)
-            __sync_add_and_fetch(&num_running_clients, 1);
+        shm_channel_consume(ctx->shm, parse_responses(ctx, rdata, rlen));
 
-        iomux_close(iomux, fd);
-    
-    } else {
-        gettimeofday(&ctx->last_update, NULL);
+        if (renew_connection(iomux, fd, ctx))
+            break;
     }
     return len;
 }
@@ -251,6 +328,51 @@ timeout_connection(iomux_t *iomux, int fd, void *priv)
     }
 }
 
+static int
+start_client(iomux_t *iomux, char *addr, int timeout, iomux_timeout_callback_t timeout_cb)
+{
+    client_ctx *ctx = calloc(1, sizeof(client_ctx));
+    int fd = -1;
+
+    if (strncmp(addr, "shm:", 4) == 0) {
+        ctx->shm = open_shm_channel(addr, timeout);
+        if (ctx->shm)
+            fd = shm_channel_fd(ctx->shm);
+    } else {
+        fd = connect_to_peer(addr, timeout);
+    }
+
+    if (fd < 0) {
+        fprintf(stderr, "Can't connect to %s: %s\n", addr, strerror(errno));
+        free(ctx);
+        return -1;
+    }
+
+    ctx->reader = async_read_context_create(NULL, NULL);
+    ctx->output = fbuf_create(0);
+    ctx->node = addr;
+    iomux_callbacks_t cbs = {
+        .mux_output = send_command,
+        .mux_timeout = timeout_cb,
+        .mux_input = ctx->shm ? discard_shm_response : discard_response,
+        .mux_eof = close_connection,
+        .priv = ctx
+    };
+
+    char label[256];
+    snprintf(label, sizeof(label), "[client %p] requests", ctx);
+    shardcache_counter_add(counters, label, &ctx->num_requests);
+    snprintf(label, sizeof(label), "[client %p] responses", ctx);
+    shardcache_counter_add(counters, label, &ctx->num_responses);
+    if (iomux_add(iomux, fd, &cbs) == 1) {
+        //struct timeval max_timeout = { 10, 0 };
+        __sync_add_and_fetch(&num_running_clients, 1);
+        gettimeofday(&ctx->last_update, NULL);
+        //iomux_set_timeout(iomux, fd, &max_timeout);
+    }
+    return 0;
+}
+
 static void
 *worker(void *priv)
 {
@@ -260,35 +382,8 @@ static void
     for (i = 0; i < num_hosts; i++) {
         char *addr = shardcache_node_get_address(hosts[i]);
         for (n = 0; n < num_clients; n++) {
-            int fd = connect_to_peer(addr, 5000);
-            if (fd < 0) {
-                fprintf(stderr, "Can't connect to %s: %s\n", addr, strerror(errno));
+            if (start_client(iomux, addr, 5000, timeout_connection) != 0)
                 exit(-99);
-            }
-
-            client_ctx *ctx = calloc(1, sizeof(client_ctx));
-            ctx->reader = async_read_context_create(NULL, NULL);
-            ctx->output = fbuf_create(0);
-            ctx->node = addr;
-            iomux_callbacks_t cbs = {
-                .mux_output = send_command,
-                .mux_timeout = timeout_connection,
-                .mux_input = discard_response,
-                .mux_eof = close_connection,
-                .priv = ctx
-            };
-
-            char label[256];
-            snprintf(label, sizeof(label), "[client %p] requests", ctx);
-            shardcache_counter_add(counters, label, &ctx->num_requests);
-            snprintf(label, sizeof(label), "[client %p] responses", ctx);
-            shardcache_counter_add(counters, label, &ctx->num_responses);
-            if (iomux_add(iomux, fd, &cbs) == 1) {
-                //struct timeval max_timeout = { 10, 0 };
-                __sync_add_and_fetch(&num_running_clients, 1);
-                gettimeofday(&ctx->last_update, NULL);
-                //iomux_set_timeout(iomux, fd, &max_timeout);
-            }
         }
     }
 
@@ -302,7 +397,297 @@ static void
     return NULL;
 }
 
-#define ADDR_REGEXP "^([a-z0-9_\\.\\-]+|\\*)(:[0-9]+)?$"
+static void
+print_near_cache_stats(shardcache_client_t *client, char *label)
+{
+    shardcache_client_near_cache_stats_t stats;
+    if (!near_cache_size || shardcache_client_near_cache_stats(client, &stats) != 0)
+        return;
+
+    fprintf(stderr, "%s near cache: hits %" PRIu64 ", misses %" PRIu64
+            ", stale %" PRIu64 ", invalidations %" PRIu64 ", flushes %" PRIu64
+            ", count %" PRIu64 ", size %" PRIu64 "\n",
+            label, stats.hits, stats.misses, stats.stale, stats.invalidations,
+            stats.flushes, stats.count, stats.size);
+}
+
+// shows how the requests have been spread among the replicas of the nodes
+static void
+print_address_stats(shardcache_client_t *client, char *label)
+{
+    int i;
+    for (i = 0; i < num_hosts; i++) {
+        int n, num_addresses = shardcache_node_num_addresses(hosts[i]);
+        if (num_addresses < 2)
+            continue;
+        for (n = 0; n < num_addresses; n++) {
+            char *addr = shardcache_node_get_address_at_index(hosts[i], n);
+            shardcache_node_address_stats_t stats;
+            if (shardcache_client_address_stats(client, addr, &stats) != 0)
+                continue;
+            fprintf(stderr, "%s %s: requests %" PRIu64 ", errors %" PRIu64
+                    ", latency %" PRIu64 " usecs, outstanding %d\n",
+                    label, addr, stats.requests, stats.errors,
+                    stats.latency, stats.outstanding);
+        }
+    }
+}
+
+static void
+*sync_worker(void *priv)
+{
+    sync_worker_ctx *ctx = (sync_worker_ctx *)priv;
+    shardcache_client_t *client = ctx->client
+                                ? ctx->client
+                                : shardcache_client_create(hosts, num_hosts);
+    if (!client) {
+        fprintf(stderr, "Can't create the shardcache client for thread %d\n", ctx->id);
+        exit(-99);
+    }
+    if (!ctx->client && !use_multi_commands)
+        shardcache_client_multi_command_max_keys(client, 0);
+    if (!ctx->client && near_cache_size)
+        shardcache_client_near_cache_enable(client, near_cache_size, 0);
+
+    char label[256];
+    snprintf(label, sizeof(label), "[thread %d] requests", ctx->id);
+    shardcache_counter_add(counters, label, &ctx->num_requests);
+    snprintf(label, sizeof(label), "[thread %d] responses", ctx->id);
+    shardcache_counter_add(counters, label, &ctx->num_responses);
+    __sync_add_and_fetch(&num_running_clients, 1);
+
+    uint32_t max_idx = (num_keys && num_keys < keys_index->size) ? num_keys : keys_index->size;
+    shc_multi_item_t **batch = batch_size ? calloc(batch_size + 1, sizeof(shc_multi_item_t *)) : NULL;
+    while(!__sync_add_and_fetch(&quit, 0)) {
+        if (batch) {
+            int n;
+            for (n = 0; n < batch_size; n++) {
+                shardcache_storage_index_item_t *item = &keys_index->items[rand_r(&ctx->seed) % max_idx];
+                batch[n] = shc_multi_item_create(item->key, item->klen, NULL, 0);
+            }
+
+            __sync_fetch_and_add(&ctx->num_requests, batch_size);
+            __sync_add_and_fetch(&num_gets, batch_size);
+            int rc = shardcache_client_get_multi(client, batch);
+            if (rc != 0 && verbose)
+                fprintf(stderr, "[thread %d] %s\n", ctx->id, shardcache_client_errstr(client));
+
+            for (n = 0; n < batch_size; n++) {
+                if (rc == 0) {
+                    __sync_add_and_fetch(&num_responses, 1);
+                    __sync_add_and_fetch(&ctx->num_responses, 1);
+                }
+                shc_multi_item_destroy(batch[n]);
+            }
+            continue;
+        }
+
+        shardcache_storage_index_item_t *item = &keys_index->items[rand_r(&ctx->seed) % max_idx];
+        int rc = 0;
+
+        __sync_fetch_and_add(&ctx->num_requests, 1);
+        if (wrate && rand_r(&ctx->seed)%100 > wrate) {
+            switch(wmode) {
+                case 0:
+                {
+                    char value[256];
+                    snprintf(value, sizeof(value), "TEST%d", (int)time(NULL));
+                    rc = shardcache_client_set(client, item->key, item->klen,
+                                               value, strlen(value), key_expire_time);
+                    break;
+                }
+                case 1:
+                    rc = shardcache_client_del(client, item->key, item->klen);
+                    break;
+                case 2:
+                    rc = shardcache_client_evict(client, item->key, item->klen);
+                    break;
+            }
+            __sync_add_and_fetch(&num_sets, 1);
+        } else {
+            void *data = NULL;
+            shardcache_client_get(client, item->key, item->klen, &data);
+            free(data);
+            // the error state is private to each thread
+            // even when the client is shared
+            if (shardcache_client_errno(client) != SHARDCACHE_CLIENT_OK)
+                rc = -1;
+            __sync_add_and_fetch(&num_gets, 1);
+        }
+
+        if (rc != 0) {
+            if (verbose)
+                fprintf(stderr, "[thread %d] %s\n", ctx->id, shardcache_client_errstr(client));
+            continue;
+        }
+
+        __sync_add_and_fetch(&num_responses, 1);
+        __sync_add_and_fetch(&ctx->num_responses, 1);
+    }
+
+    __sync_sub_and_fetch(&num_running_clients, 1);
+    free(batch);
+    if (!ctx->client) {
+        snprintf(label, sizeof(label), "[thread %d]", ctx->id);
+        print_near_cache_stats(client, label);
+        print_address_stats(client, label);
+        shardcache_client_destroy(client);
+    }
+
+    return NULL;
+}
+
+static void
+async_watch(int fd, int events, void *priv)
+{
+    sync_worker_ctx *ctx = (sync_worker_ctx *)priv;
+    int i;
+    for (i = 0; i < ctx->num_pollfds; i++) {
+        if (ctx->pollfds[i].fd == fd)
+            break;
+    }
+
+    if (!events) {
+        if (i < ctx->num_pollfds)
+            ctx->pollfds[i] = ctx->pollfds[--ctx->num_pollfds];
+        return;
+    }
+
+    if (i == ctx->num_pollfds) {
+        ctx->pollfds = realloc(ctx->pollfds, sizeof(struct pollfd) * (ctx->num_pollfds + 1));
+        ctx->pollfds[ctx->num_pollfds++].fd = fd;
+    }
+
+    ctx->pollfds[i].events = ((events & SHARDCACHE_CLIENT_ASYNC_READ) ? POLLIN : 0) |
+                             ((events & SHARDCACHE_CLIENT_ASYNC_WRITE) ? POLLOUT : 0);
+    ctx->pollfds[i].revents = 0;
+}
+
+static void
+async_done(shardcache_client_async_t *a, void *key, size_t klen, void *data, size_t dlen, int rc, void *priv)
+{
+    sync_worker_ctx *ctx = (sync_worker_ctx *)priv;
+    if (rc == -1) {
+        if (verbose)
+            fprintf(stderr, "[thread %d] Request for key %.*s failed\n", ctx->id, (int)klen, (char *)key);
+        return;
+    }
+    __sync_add_and_fetch(&num_responses, 1);
+    __sync_add_and_fetch(&ctx->num_responses, 1);
+}
+
+static int
+async_send_request(shardcache_client_async_t *a, sync_worker_ctx *ctx)
+{
+    uint32_t max_idx = (num_keys && num_keys < keys_index->size) ? num_keys : keys_index->size;
+    shardcache_storage_index_item_t *item = &keys_index->items[rand_r(&ctx->seed) % max_idx];
+    int rc = -1;
+
+    if (wrate && rand_r(&ctx->seed)%100 > wrate) {
+        switch(wmode) {
+            case 0:
+            {
+                char value[256];
+                snprintf(value, sizeof(value), "TEST%d", (int)time(NULL));
+                rc = shardcache_client_async_set(a, item->key, item->klen, value, strlen(value),
+                                                 key_expire_time, async_done, ctx);
+                break;
+            }
+            case 1:
+                rc = shardcache_client_async_del(a, item->key, item->klen, async_done, ctx);
+                break;
+            case 2:
+                rc = shardcache_client_async_evict(a, item->key, item->klen, async_done, ctx);
+                break;
+        }
+        if (rc == 0)
+            __sync_add_and_fetch(&num_sets, 1);
+    } else {
+        rc = shardcache_client_async_get(a, item->key, item->klen, async_done, ctx);
+        if (rc == 0)
+            __sync_add_and_fetch(&num_gets, 1);
+    }
+
+    if (rc == 0)
+        __sync_fetch_and_add(&ctx->num_requests, 1);
+    else if (verbose)
+        fprintf(stderr, "[thread %d] %s\n", ctx->id, shardcache_client_errstr(ctx->client));
+
+    return rc;
+}
+
+static void
+*async_worker(void *priv)
+{
+    sync_worker_ctx *ctx = (sync_worker_ctx *)priv;
+    shardcache_client_t *client = ctx->client;
+    if (!client) {
+        client = shardcache_client_create(hosts, num_hosts);
+        if (!client) {
+            fprintf(stderr, "Can't create the shardcache client for thread %d\n", ctx->id);
+            exit(-99);
+        }
+        ctx->client = client;
+    }
+
+    shardcache_client_async_t *a = shardcache_client_async_create(client, async_watch, ctx);
+    if (!a) {
+        fprintf(stderr, "Can't create the async client for thread %d\n", ctx->id);
+        exit(-99);
+    }
+
+    char label[256];
+    snprintf(label, sizeof(label), "[thread %d] requests", ctx->id);
+    shardcache_counter_add(counters, label, &ctx->num_requests);
+    snprintf(label, sizeof(label), "[thread %d] responses", ctx->id);
+    shardcache_counter_add(counters, label, &ctx->num_responses);
+    __sync_add_and_fetch(&num_running_clients, 1);
+
+    struct pollfd *ready = NULL;
+    while(!__sync_add_and_fetch(&quit, 0)) {
+        while (shardcache_client_async_pending(a) < async_depth) {
+            if (async_send_request(a, ctx) != 0)
+                break;
+        }
+
+        int timeout = shardcache_client_async_timeout(a);
+        if (timeout < 0 || timeout > 1000)
+            timeout = 1000;
+
+        int n = poll(ctx->pollfds, ctx->num_pollfds, timeout);
+        if (n > 0) {
+            // the callbacks can change the set of watched filedescriptors
+            // so let's work on a copy of the ready ones
+            int i, num_ready = 0;
+            ready = realloc(ready, sizeof(struct pollfd) * ctx->num_pollfds);
+            for (i = 0; i < ctx->num_pollfds; i++) {
+                if (ctx->pollfds[i].revents)
+                    ready[num_ready++] = ctx->pollfds[i];
+            }
+            for (i = 0; i < num_ready; i++) {
+                int events = 0;
+                if (ready[i].revents & (POLLIN|POLLERR|POLLHUP))
+                    events |= SHARDCACHE_CLIENT_ASYNC_READ;
+                if (ready[i].revents & POLLOUT)
+                    events |= SHARDCACHE_CLIENT_ASYNC_WRITE;
+                shardcache_client_async_handle(a, ready[i].fd, events);
+            }
+        }
+
+        shardcache_client_async_expire(a);
+    }
+
+    __sync_sub_and_fetch(&num_running_clients, 1);
+    shardcache_client_async_destroy(a);
+    free(ready);
+    free(ctx->pollfds);
+    if (client != shared_client)
+        shardcache_client_destroy(client);
+
+    return NULL;
+}
+
+#define ADDR_REGEXP "^(([a-z0-9_\\.\\-]+|\\*)(:[0-9]+)?|(unix|shm):/.+)$"
 
 static int
 check_address_string(char *str)
@@ -371,6 +756,12 @@ main (int argc, char **argv)
         { "stats_file", 2, 0, 's' },
         { "write_rate", 2, 0, 'w' },
         { "write_mode", 2, 0, 'W' },
+        { "shared_mode", 2, 0, 'S' },
+        { "batch_size", 2, 0, 'b' },
+        { "no_multi_commands", 0, 0, 'M' },
+        { "async_depth", 2, 0, 'A' },
+        { "near_cache", 2, 0, 'N' },
+        { "auto_multi_window", 2, 0, 'B' },
         { "verbose", 0, 0, 'v' },
         { NULL, 0, 0,  0 }
     };
@@ -378,10 +769,24 @@ main (int argc, char **argv)
     hosts_string = getenv("SHC_HOSTS");
     int option_index = 0;
     char c;
-    while ((c = getopt_long(argc, argv, "c:hH:iI:m:k:p:s:Pt:w:W:v", long_options, &option_index))) {
+    while ((c = getopt_long(argc, argv, "A:b:B:c:hH:iI:m:Mk:N:p:s:PS:t:w:W:v", long_options, &option_index))) {
         if (c == -1)
             break;
         switch(c) {
+            case 'A':
+                async_depth = strtol(optarg, NULL, 10);
+                if (async_depth <= 0)
+                    usage(argv[0], -1, "The async depth must be greater than 0");
+                if (!shared_mode)
+                    shared_mode = 2;
+                num_clients = 1;
+                break;
+            case 'b':
+                batch_size = strtol(optarg, NULL, 10);
+                if (!shared_mode)
+                    shared_mode = 1;
+                num_clients = 1;
+                break;
             case 'c':
                 num_clients = strtol(optarg, NULL, 10);
                 break;
@@ -404,9 +809,24 @@ main (int argc, char **argv)
             case 'm':
                 max_requests = strtol(optarg, NULL, 10);
                 break;
+            case 'M':
+                use_multi_commands = 0;
+                break;
             case 'k':
                 num_keys = strtol(optarg, NULL, 10);
                 break;
+            case 'N':
+                near_cache_size = strtoull(optarg, NULL, 10);
+                if (!shared_mode)
+                    shared_mode = 1;
+                num_clients = 1;
+                break;
+            case 'B':
+                auto_multi_window = strtol(optarg, NULL, 10);
+                // only the threads sharing the same client can be batched together
+                shared_mode = 1;
+                num_clients = 1;
+                break;
             case 'p':
                 prefix = optarg;
                 break;
@@ -430,6 +850,13 @@ main (int argc, char **argv)
                 if (wmode < 0 || wmode > 2)
                     usage(argv[0], -1, "Unknown write mode %d (valid are 0, 1 or 2)", wmode);
                 break;
+            case 'S':
+                shared_mode = strtol(optarg, NULL, 10);
+                if (shared_mode < 0 || shared_mode > 2)
+                    usage(argv[0], -1, "Unknown shared mode %d (valid are 1 or 2)", shared_mode);
+                // each thread drives a single client
+                num_clients = 1;
+                break;
             case 'v':
                 verbose++;
                 break;
@@ -496,7 +923,17 @@ main (int argc, char **argv)
         fprintf(stderr, "Empty index\n");
         exit(-1);
     }
-    shardcache_client_destroy(client);
+    if (!use_multi_commands)
+        shardcache_client_multi_command_max_keys(client, 0);
+
+    if (shared_mode == 1) {
+        shared_client = client;
+        if (near_cache_size)
+            shardcache_client_near_cache_enable(client, near_cache_size, 0);
+        if (auto_multi_window > 0)
+            shardcache_client_auto_multi_window(client, auto_multi_window);
+    } else
+        shardcache_client_destroy(client);
     signal (SIGINT, stop);
 
     srandom(time(NULL));
@@ -508,9 +945,20 @@ main (int argc, char **argv)
     int i;
     pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
     iomux_t **muxes = malloc(sizeof(iomux_t *) * num_threads);
+    sync_worker_ctx *sync_workers = calloc(num_threads, sizeof(sync_worker_ctx));
     for (i = 0; i < num_threads; i++) {
-        muxes[i] = iomux_create(0, 0);
-        if (pthread_create(&threads[i], NULL, worker, muxes[i]) != 0) {
+        int rc;
+        if (shared_mode) {
+            muxes[i] = NULL;
+            sync_workers[i].client = shared_client;
+            sync_workers[i].seed = random();
+            sync_workers[i].id = i;
+            rc = pthread_create(&threads[i], NULL, async_depth ? async_worker : sync_worker, &sync_workers[i]);
+        } else {
+            muxes[i] = iomux_create(0, 0);
+            rc = pthread_create(&threads[i], NULL, worker, muxes[i]);
+        }
+        if (rc != 0) {
             fprintf(stderr, "Can't spawn thread: %s\n", strerror(errno));
             exit(-1);            
         }
@@ -625,6 +1073,12 @@ main (int argc, char **argv)
         fprintf(stderr, "Thread %d done\n", i);
     }
 
+    if (shared_client) {
+        print_near_cache_stats(shared_client, "[shared client]");
+        print_address_stats(shared_client, "[shared client]");
+        shardcache_client_destroy(shared_client);
+    }
+
     if (prev_counts)
         ht_destroy(prev_counts);
 
@@ -638,6 +1092,7 @@ main (int argc, char **argv)
 
     free(threads);
     free(muxes);
+    free(sync_workers);
 
     exit (0);
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -7,14 +8,19 @@
 #include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/time.h>
 
 #include <shardcache.h>
 
 #define DEFAULT_NUM_THREADS    4
+#define DEFAULT_VALUE_SIZE    64
 #define MODULE_PATH_LEN     1024
 #define OPTION_STRING_LEN   1024
 #define MAX_STORAGE_OPTIONS  256
 
+#define CONFORMANCE_KEYS     1000
+#define CONFORMANCE_THREADS     8
+
 /* - */
 
 typedef int  (*module_init)    (shardcache_storage_t *st, const char **options);
@@ -24,12 +30,22 @@ typedef struct {
     shardcache_storage_t       * storage;
     shardcache_storage_index_t * index;
     int                        * counter;
+    int                          write_ratio;
+    int                          batch_size;
+    size_t                       value_size;
+    unsigned int                 seed;
 } worker_thread_args_t;
 
 typedef struct {
     char storage_module[MODULE_PATH_LEN];
     char storage_options_string[OPTION_STRING_LEN];
     int  number_of_threads;
+    int  conformance;
+    int  num_keys;
+    int  write_ratio;
+    int  batch_size;
+    int  duration;
+    size_t value_size;
     char * storage_options[MAX_STORAGE_OPTIONS];
 } options_t;
 
@@ -50,8 +66,41 @@ static int index_get_from_storage(shardcache_storage_t * storage, shardcache_sto
     index->size  = storage->count(storage->priv);
     index->items = calloc(index->size, sizeof(shardcache_storage_index_item_t));
 
-    storage->index(index->items, index->size, storage->priv);
+    index->size = storage->index(index->items, index->size, storage->priv);
+
+    return 0;
+}
+
+// store 'num_keys' keys and build the index out of them
+static int index_populate(shardcache_storage_t * storage, shardcache_storage_index_t * index, int num_keys, size_t value_size)
+{
+    if (storage->store == NULL) {
+        SHC_ERROR("this storage module doesn't implement the STORE command, unable to populate it");
+        return -1;
+    }
+
+    char * value = malloc(value_size);
+    memset(value, 'v', value_size);
+
+    index->size  = num_keys;
+    index->items = calloc(index->size, sizeof(shardcache_storage_index_item_t));
+
+    for (int i = 0; i < num_keys; i++) {
+        char key[64];
+        int klen = snprintf(key, sizeof(key), "st_benchmark_%d", i);
+
+        if (storage->store(key, klen, value, value_size, 0, storage->priv) != 0) {
+            SHC_ERROR("unable to store the key %s", key);
+            free(value);
+            return -1;
+        }
+
+        index->items[i].key  = strdup(key);
+        index->items[i].klen = klen;
+        index->items[i].vlen = value_size;
+    }
 
+    free(value);
     return 0;
 }
 
@@ -64,18 +113,49 @@ static void * worker_thread(void * in_args)
 
     worker_thread_args_t * args = (worker_thread_args_t *)in_args;
 
+    char * new_value = malloc(args->value_size);
+    memset(new_value, 'w', args->value_size);
+
+    int batch_size = args->batch_size > 1 ? args->batch_size : 1;
+    void   * keys   [batch_size];
+    size_t   klens  [batch_size];
+    void   * values [batch_size];
+    size_t   vlens  [batch_size];
+
     if (args->storage->thread_start)
         args->storage->thread_start(args->storage->priv);
 
-    while (!__sync_fetch_and_add(&quit, 0)) {
-        for (int i = 0; i < args->index->size; i++) {
-            args->storage->fetch(args->index->items[i].key,
-                                        args->index->items[i].klen,
-                                        &value,
-                                        &value_len,
-                                        args->storage->priv);
-
-            __sync_fetch_and_add(args->counter, 1);
+    while (!__sync_fetch_and_add(&quit, 0) && args->index->size) {
+        for (int i = 0; i < args->index->size; i += batch_size) {
+            shardcache_storage_index_item_t * item = &args->index->items[i];
+
+            if (args->write_ratio && (rand_r(&args->seed) % 100) < args->write_ratio) {
+                args->storage->store(item->key, item->klen, new_value, args->value_size, 0, args->storage->priv);
+                __sync_fetch_and_add(args->counter, 1);
+            } else if (batch_size > 1) {
+                int n = 0;
+                for (; n < batch_size && i + n < args->index->size; n++) {
+                    keys[n]  = args->index->items[i + n].key;
+                    klens[n] = args->index->items[i + n].klen;
+                }
+
+                memset(values, 0, sizeof(values));
+                args->storage->fetch_multi(keys, klens, n, values, vlens, args->storage->priv);
+                for (int j = 0; j < n; j++)
+                    free(values[j]);
+
+                __sync_fetch_and_add(args->counter, n);
+            } else {
+                value = NULL;
+                args->storage->fetch(item->key,
+                                     item->klen,
+                                     &value,
+                                     &value_len,
+                                     args->storage->priv);
+                free(value);
+
+                __sync_fetch_and_add(args->counter, 1);
+            }
 
             if (__sync_fetch_and_add(&quit, 0))
                 break;
@@ -85,6 +165,7 @@ static void * worker_thread(void * in_args)
     if (args->storage->thread_exit)
         args->storage->thread_exit(args->storage->priv);
 
+    free(new_value);
     return NULL;
 }
 
@@ -96,14 +177,233 @@ static void stop(int signal)
 
 /* - */
 
+static int conformance_failures = 0;
+
+static void check(int condition, const char * what)
+{
+    printf("    %-60s %s\n", what, condition ? "ok" : "FAILED");
+    if (!condition)
+        conformance_failures++;
+}
+
+static int value_matches(shardcache_storage_t * storage, char * key, char * expected, size_t expected_len)
+{
+    void   * value     = NULL;
+    size_t   value_len = 0;
+
+    if (storage->fetch(key, strlen(key), &value, &value_len, storage->priv) != 0)
+        return 0;
+
+    int matches = expected ? (value && value_len == expected_len && memcmp(value, expected, value_len) == 0)
+                           : (value == NULL);
+    free(value);
+    return matches;
+}
+
+static void * conformance_thread(void * in_args)
+{
+    worker_thread_args_t * args = (worker_thread_args_t *)in_args;
+    shardcache_storage_t * storage = args->storage;
+
+    if (storage->thread_start)
+        storage->thread_start(storage->priv);
+
+    for (int i = 0; i < CONFORMANCE_KEYS; i++) {
+        char key[64], value[64];
+        snprintf(key, sizeof(key), "__st_conformance_thread_%u_%d", args->seed, i % 16);
+        int vlen = snprintf(value, sizeof(value), "value_%u_%d", args->seed, i);
+
+        if (storage->store(key, strlen(key), value, vlen, 0, storage->priv) != 0 ||
+            !value_matches(storage, key, value, vlen))
+        {
+            __sync_fetch_and_add(args->counter, 1);
+        }
+    }
+
+    for (int i = 0; i < 16; i++) {
+        char key[64];
+        snprintf(key, sizeof(key), "__st_conformance_thread_%u_%d", args->seed, i);
+        storage->remove(key, strlen(key), storage->priv);
+    }
+
+    if (storage->thread_exit)
+        storage->thread_exit(storage->priv);
+
+    return NULL;
+}
+
+// check that the storage module behaves as expected by libshardcache
+static int run_conformance(shardcache_storage_t * storage)
+{
+    char * key  = "__st_conformance_key";
+    size_t klen = strlen(key);
+
+    printf("Running the conformance checks\n");
+
+    if (storage->fetch == NULL) {
+        check(0, "fetch is implemented");
+        return -1;
+    }
+
+    if (storage->store == NULL || storage->remove == NULL) {
+        printf("    the storage is read-only, skipping the checks for the updates\n");
+        return 0;
+    }
+
+    if (storage->thread_start)
+        storage->thread_start(storage->priv);
+
+    storage->remove(key, klen, storage->priv);
+    check(value_matches(storage, key, NULL, 0), "fetch of a missing key returns NULL");
+
+    check(storage->store(key, klen, "value1", 6, 0, storage->priv) == 0, "store returns 0");
+    check(value_matches(storage, key, "value1", 6), "fetch returns the stored value");
+
+    check(storage->store(key, klen, "value2", 6, 1, storage->priv) == 1, "store if not exists of an existing key returns 1");
+    check(value_matches(storage, key, "value1", 6), "store if not exists doesn't overwrite the value");
+
+    check(storage->store(key, klen, "value_3", 7, 0, storage->priv) == 0, "overwrite returns 0");
+    check(value_matches(storage, key, "value_3", 7), "fetch returns the new value");
+
+    if (storage->exist) {
+        check(storage->exist(key, klen, storage->priv) == 1, "exist of an existing key returns 1");
+        check(storage->exist("__st_conformance_missing", 24, storage->priv) == 0, "exist of a missing key returns 0");
+    }
+
+    if (storage->cas) {
+        check(storage->cas(key, klen, "wrong", 5, "value4", 6, storage->priv) == 1, "cas with a wrong old value returns 1");
+        check(value_matches(storage, key, "value_3", 7), "cas with a wrong old value doesn't update the value");
+        check(storage->cas(key, klen, "value_3", 7, "value4", 6, storage->priv) == 0, "cas with the right old value returns 0");
+        check(value_matches(storage, key, "value4", 6), "cas with the right old value updates the value");
+    }
+
+    if (storage->fetch_multi) {
+        void   * keys   [3] = { key, "__st_conformance_missing", key };
+        size_t   klens  [3] = { klen, 24, klen };
+        void   * values [3] = { NULL, NULL, NULL };
+        size_t   vlens  [3] = { 0, 0, 0 };
+        int rc = storage->fetch_multi(keys, klens, 3, values, vlens, storage->priv);
+        check(rc == 0, "fetch_multi returns 0");
+        check(values[0] && vlens[0] == 6 && memcmp(values[0], "value4", 6) == 0 &&
+              values[1] == NULL &&
+              values[2] && vlens[2] == 6 && memcmp(values[2], "value4", 6) == 0,
+              "fetch_multi returns the values in order (NULL if missing)");
+        for (int i = 0; i < 3; i++)
+            free(values[i]);
+    }
+
+    size_t big_len = 1<<20;
+    char * big = malloc(big_len);
+    for (size_t i = 0; i < big_len; i++)
+        big[i] = (char)i;
+    check(storage->store(key, klen, big, big_len, 0, storage->priv) == 0 &&
+          value_matches(storage, key, big, big_len), "a 1MB value survives a round trip");
+    free(big);
+
+    check(storage->remove(key, klen, storage->priv) == 0, "remove returns 0");
+    check(value_matches(storage, key, NULL, 0), "fetch of a removed key returns NULL");
+    if (storage->exist)
+        check(storage->exist(key, klen, storage->priv) == 0, "exist of a removed key returns 0");
+
+    if (storage->count && storage->index) {
+        size_t initial_count = storage->count(storage->priv);
+        int stored = 1;
+        for (int i = 0; i < CONFORMANCE_KEYS; i++) {
+            char k[64];
+            int kl = snprintf(k, sizeof(k), "__st_conformance_%d", i);
+            if (storage->store(k, kl, k, kl, 0, storage->priv) != 0)
+                stored = 0;
+        }
+        check(stored, "store of many keys returns 0");
+        check(storage->count(storage->priv) == initial_count + CONFORMANCE_KEYS, "count includes the new keys");
+
+        shardcache_storage_index_t index = {0};
+        index_get_from_storage(storage, &index);
+        int found = 0;
+        for (size_t i = 0; i < index.size; i++) {
+            if (index.items[i].klen > 17 && strncmp(index.items[i].key, "__st_conformance_", 17) == 0 &&
+                index.items[i].vlen == index.items[i].klen)
+            {
+                found++;
+            }
+            free(index.items[i].key);
+        }
+        free(index.items);
+        check(found == CONFORMANCE_KEYS, "index returns all the new keys (with the right value size)");
+
+        if (storage->scan_index) {
+            // use small chunks to exercise the cursor
+            shardcache_storage_index_item_t items[7];
+            char *seen = calloc(1, CONFORMANCE_KEYS);
+            uint64_t cursor = 0;
+            int rounds = 0;
+            do {
+                size_t n = storage->scan_index(&cursor, items, 7, storage->priv);
+                for (size_t i = 0; i < n; i++) {
+                    if (items[i].klen > 17 && items[i].klen < 64 && strncmp(items[i].key, "__st_conformance_", 17) == 0) {
+                        char k[64];
+                        snprintf(k, sizeof(k), "%.*s", (int)items[i].klen - 17, (char *)items[i].key + 17);
+                        int num = strtol(k, NULL, 10);
+                        if (num >= 0 && num < CONFORMANCE_KEYS)
+                            seen[num] = 1;
+                    }
+                    free(items[i].key);
+                }
+            } while (cursor && ++rounds < 1000000);
+            found = 0;
+            for (int i = 0; i < CONFORMANCE_KEYS; i++)
+                found += seen[i];
+            free(seen);
+            check(cursor == 0 && found == CONFORMANCE_KEYS, "scan_index returns all the new keys");
+        }
+
+        for (int i = 0; i < CONFORMANCE_KEYS; i++) {
+            char k[64];
+            int kl = snprintf(k, sizeof(k), "__st_conformance_%d", i);
+            storage->remove(k, kl, storage->priv);
+        }
+        check(storage->count(storage->priv) == initial_count, "count doesn't include the removed keys");
+    }
+
+    if (storage->thread_exit)
+        storage->thread_exit(storage->priv);
+
+    int errors = 0;
+    pthread_t            threads     [CONFORMANCE_THREADS];
+    worker_thread_args_t thread_args [CONFORMANCE_THREADS];
+    for (int i = 0; i < CONFORMANCE_THREADS; i++) {
+        thread_args[i].storage = storage;
+        thread_args[i].counter = &errors;
+        thread_args[i].seed    = i;
+        pthread_create(&threads[i], NULL, conformance_thread, &thread_args[i]);
+    }
+    for (int i = 0; i < CONFORMANCE_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    check(errors == 0, "concurrent threads read their own writes");
+
+    printf("%s (%d failed checks)\n", conformance_failures ? "FAILED" : "PASSED", conformance_failures);
+    return conformance_failures ? -1 : 0;
+}
+
+/* - */
+
 static void usage(char * prog, int rc) {
     printf("usage: %s [OPTIONS]...\n"
            "    -s <storagemodule>    the path of the storage module plugin\n"
            "    -o <options>          comma-separated list of storage options\n"
            "    -n <num_threads>      specify the number of threads to use for the test (defaults to: %d)\n"
+           "    -c                    run the conformance checks and exit\n"
+           "    -k <num_keys>         store <num_keys> keys before starting the test\n"
+           "                          (otherwise the keys in the storage index are used)\n"
+           "    -v <value_size>       the size of the values stored by the test (defaults to: %d)\n"
+           "    -w <percent>          the percentage of stores in the test (defaults to: 0)\n"
+           "    -m <batch_size>       fetch the keys in batches using fetch_multi\n"
+           "    -d <seconds>          stop the test after <seconds> and print a summary\n"
+           "                          (defaults to: 0, run until interrupted)\n"
            "    -h                    prints this help\n",
            prog,
-           DEFAULT_NUM_THREADS);
+           DEFAULT_NUM_THREADS,
+           DEFAULT_VALUE_SIZE);
     exit(rc);
 }
 
@@ -116,37 +416,78 @@ static void parse_cmdline(int argc, char ** argv, options_t * options) {
         { "storagemodule", 2, 0, 's' },
         { "options",       2, 0, 'o' },
         { "num-threads",   2, 0, 'n' },
+        { "conformance",   0, 0, 'c' },
+        { "keys",          2, 0, 'k' },
+        { "value-size",    2, 0, 'v' },
+        { "writes",        2, 0, 'w' },
+        { "multi",         2, 0, 'm' },
+        { "duration",      2, 0, 'd' },
         { "help",          0, 0, 'h' },
         { NULL,            0, 0,  0  }
     };
 
     int  option_index = 0;
-    char c;
+    int  c;
 
     options->number_of_threads = DEFAULT_NUM_THREADS;
+    options->value_size = DEFAULT_VALUE_SIZE;
 
-    while ((c = getopt_long(argc, argv, "s:o:n:h", long_options, &option_index))) {
+    while ((c = getopt_long(argc, argv, "s:o:n:ck:v:w:m:d:h", long_options, &option_index))) {
         if (c == -1)
             break;
 
         switch (c) {
             case 's':
-                strncpy(options->storage_module, optarg, MODULE_PATH_LEN);
+                strncpy(options->storage_module, optarg, MODULE_PATH_LEN - 1);
                 break;
 
             case 'o':
-                strncpy(options->storage_options_string, optarg, OPTION_STRING_LEN);
+                strncpy(options->storage_options_string, optarg, OPTION_STRING_LEN - 1);
                 break;
 
             case 'n':
                 options->number_of_threads = strtol(optarg, NULL, 10);
                 break;
 
+            case 'c':
+                options->conformance = 1;
+                break;
+
+            case 'k':
+                options->num_keys = strtol(optarg, NULL, 10);
+                break;
+
+            case 'v':
+                options->value_size = strtol(optarg, NULL, 10);
+                break;
+
+            case 'w':
+                options->write_ratio = strtol(optarg, NULL, 10);
+                break;
+
+            case 'm':
+                options->batch_size = strtol(optarg, NULL, 10);
+                break;
+
+            case 'd':
+                options->duration = strtol(optarg, NULL, 10);
+                break;
+
             case 'h':
                 usage(argv[0], 0);
                 break;
+
+            default:
+                usage(argv[0], -1);
         }
     }
+
+    if (options->number_of_threads <= 0 || options->num_keys < 0 || options->value_size <= 0 ||
+        options->write_ratio < 0 || options->write_ratio > 100 || options->batch_size < 0 ||
+        options->duration < 0)
+    {
+        usage(argv[0], -1);
+    }
 }
 
 static int parse_options(char        * options_string,
@@ -157,6 +498,11 @@ static int parse_options(char        * options_string,
     char * p      = options_string;
     char * str    = p;
 
+    if (*p == 0) {
+        module_options[0] = NULL;
+        return 0;
+    }
+
     while (*p != 0 && optidx < max_storage_options) {
         if (*p == '=' || *p == ',') {
             *p = 0;
@@ -199,10 +545,31 @@ int main(int argc, char ** argv) {
     if (!storage)
         exit(-1);
 
+    if (options.conformance) {
+        int rc = run_conformance(storage);
+        shardcache_storage_dispose(storage);
+        exit(rc == 0 ? 0 : 1);
+    }
+
+    if (options.batch_size > 1 && storage->fetch_multi == NULL) {
+        SHC_ERROR("this storage module doesn't implement the FETCH_MULTI command");
+        exit(-1);
+    }
+
+    if (options.write_ratio && storage->store == NULL) {
+        SHC_ERROR("this storage module doesn't implement the STORE command");
+        exit(-1);
+    }
+
     signal(SIGINT, stop);
 
     shardcache_storage_index_t index = {0};
-    index_get_from_storage(storage, &index);
+    if (options.num_keys) {
+        if (index_populate(storage, &index, options.num_keys, options.value_size) != 0)
+            exit(-1);
+    } else {
+        index_get_from_storage(storage, &index);
+    }
 
     pthread_t            threads        [options.number_of_threads];
     worker_thread_args_t thread_args    [options.number_of_threads];
@@ -213,14 +580,21 @@ int main(int argc, char ** argv) {
 
     for (int i = 0; i < options.number_of_threads; i++) {
         worker_thread_args_t * args = &thread_args[i];
-        args->storage = storage,
-        args->index   = &index,
-        args->counter = &counters[i];
+        args->storage     = storage;
+        args->index       = &index;
+        args->counter     = &counters[i];
+        args->write_ratio = options.write_ratio;
+        args->batch_size  = options.batch_size;
+        args->value_size  = options.value_size;
+        args->seed        = i;
 
         counters[i] = 0;
         counters_prev[i] = 0;
     }
 
+    struct timeval start, end, elapsed;
+    gettimeofday(&start, NULL);
+
     for (int i = 0; i < options.number_of_threads; i++) {
         if (pthread_create(&threads[i], NULL, worker_thread, &thread_args[i]) != 0) {
             SHC_ERROR("Cannot spawn new thread: %s\n", strerror(errno));
@@ -228,32 +602,51 @@ int main(int argc, char ** argv) {
         }
     }
 
+    int seconds = 0;
     while (!__sync_fetch_and_add(&quit, 0)) {
         sleep(1);
 
-        printf("\033[H\033[J"); // clear the screen
+        if (!options.duration)
+            printf("\033[H\033[J"); // clear the screen
         for (int i = 0; i < options.number_of_threads; i++) {
             counters_local[i] = __sync_fetch_and_add(&counters[i], 0);
 
-            printf("Thread %d: %d - %d per sec.\n",
-                i,
-                counters_local[i],
-                counters_local[i] - counters_prev[i]
-            );
+            if (!options.duration)
+                printf("Thread %d: %d - %d per sec.\n",
+                    i,
+                    counters_local[i],
+                    counters_local[i] - counters_prev[i]
+                );
 
             counters_prev[i] = counters_local[i];
         }
 
-        printf("\n");
+        if (!options.duration)
+            printf("\n");
+        else if (++seconds >= options.duration)
+            (void)__sync_fetch_and_add(&quit, 1);
     }
 
+    uint64_t total = 0;
     for (int i = 0; i < options.number_of_threads; i++) {
         pthread_join(threads[i], NULL);
-        printf("Thread %d done\n", i);
+        total += counters[i];
+        if (!options.duration)
+            printf("Thread %d done\n", i);
     }
 
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &elapsed);
+    double secs = elapsed.tv_sec + elapsed.tv_usec / 1e6;
+
+    printf("%llu operations (%d%% stores) on %zu keys in %.2f secs: %.0f ops/sec\n",
+           (unsigned long long)total, options.write_ratio, index.size, secs, secs > 0 ? total / secs : 0);
+
+    for (int i = 0; i < index.size; i++)
+        free(index.items[i].key);
+    free(index.items);
+
     shardcache_storage_dispose(storage);
 
     return 0;
 }
-